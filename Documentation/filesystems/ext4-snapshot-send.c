@@ -0,0 +1,239 @@
+/*
+ * ext4-snapshot-send.c - replicate ext4 snapshot images
+ *
+ * Sends the blocks that differ between two snapshots of an ext4 file
+ * system, as listed by the EXT4_IOC_SNAPSHOT_SEND ioctl, and applies
+ * them to a replica of the older snapshot image:
+ *
+ *   ext4-snapshot-send send <older snapshot> <snapshot> | \
+ *	ssh replica ext4-snapshot-send receive <replica image>
+ *
+ * The first replica is a full copy of the older snapshot image, e.g.:
+ *   dd if=<older snapshot> of=<replica image> bs=1M
+ *
+ * Stream format (little endian):
+ *   header:	"EXT4SNAP", __u32 version, __u32 block size, __u64 blocks
+ *   records:	__u64 start block, __u64 no. of blocks, block data
+ *   end:	record with 0 blocks
+ */
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+/* from fs/ext4/ext4.h */
+struct ext4_snapshot_diff_extent {
+	uint64_t de_start;
+	uint64_t de_len;
+};
+
+struct ext4_snapshot_send {
+	int32_t ss_base_fd;
+	uint32_t ss_flags;
+	uint64_t ss_start;
+	uint32_t ss_count;
+	uint32_t ss_mapped;
+	struct ext4_snapshot_diff_extent ss_extents[0];
+};
+
+#define EXT4_IOC_SNAPSHOT_SEND	_IOWR('f', 22, struct ext4_snapshot_send)
+
+#define SEND_MAGIC	"EXT4SNAP"
+#define SEND_VERSION	1
+#define SEND_EXTENTS	1024		/* extents per ioctl */
+#define SEND_IO_SIZE	(1 << 20)	/* bytes per read/write */
+
+struct send_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t block_size;
+	uint64_t blocks;
+};
+
+struct send_record {
+	uint64_t start;
+	uint64_t len;
+};
+
+static char buf[SEND_IO_SIZE];
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void write_all(int fd, const void *p, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			die("write");
+		p = (const char *)p + n;
+		len -= n;
+	}
+}
+
+static void read_all(int fd, void *p, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			die("read");
+		if (n == 0) {
+			fprintf(stderr, "unexpected end of stream\n");
+			exit(1);
+		}
+		p = (char *)p + n;
+		len -= n;
+	}
+}
+
+/* copy @len bytes at offset @off of @in to @out, a large chunk at a time */
+static void send_range(int in, int out, off_t off, uint64_t len)
+{
+	size_t n;
+	ssize_t r;
+
+	while (len > 0) {
+		n = len < SEND_IO_SIZE ? len : SEND_IO_SIZE;
+		r = pread(in, buf, n, off);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r != (ssize_t)n)
+			die("pread");
+		write_all(out, buf, n);
+		off += n;
+		len -= n;
+	}
+}
+
+static int do_send(const char *base_path, const char *path)
+{
+	struct ext4_snapshot_send *send;
+	struct send_header hdr;
+	struct send_record rec;
+	struct stat st;
+	uint64_t blocks, total = 0;
+	unsigned int i;
+	int base, fd;
+
+	base = open(base_path, O_RDONLY);
+	if (base < 0)
+		die(base_path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st))
+		die(path);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	blocks = st.st_size / st.st_blksize;
+
+	memcpy(hdr.magic, SEND_MAGIC, sizeof(hdr.magic));
+	hdr.version = htole32(SEND_VERSION);
+	hdr.block_size = htole32(st.st_blksize);
+	hdr.blocks = htole64(blocks);
+	write_all(1, &hdr, sizeof(hdr));
+
+	send = calloc(1, sizeof(*send) +
+		      SEND_EXTENTS * sizeof(send->ss_extents[0]));
+	if (!send)
+		die("calloc");
+	send->ss_base_fd = base;
+	do {
+		send->ss_count = SEND_EXTENTS;
+		if (ioctl(fd, EXT4_IOC_SNAPSHOT_SEND, send))
+			die("EXT4_IOC_SNAPSHOT_SEND");
+		for (i = 0; i < send->ss_mapped; i++) {
+			struct ext4_snapshot_diff_extent *ext =
+				&send->ss_extents[i];
+
+			rec.start = htole64(ext->de_start);
+			rec.len = htole64(ext->de_len);
+			write_all(1, &rec, sizeof(rec));
+			send_range(fd, 1, ext->de_start * st.st_blksize,
+				   ext->de_len * st.st_blksize);
+			total += ext->de_len;
+		}
+	} while (send->ss_start < blocks);
+
+	rec.start = 0;
+	rec.len = 0;
+	write_all(1, &rec, sizeof(rec));
+	fprintf(stderr, "sent %llu of %llu blocks\n",
+		(unsigned long long)total, (unsigned long long)blocks);
+	free(send);
+	return 0;
+}
+
+static int do_receive(const char *path)
+{
+	struct send_header hdr;
+	struct send_record rec;
+	uint64_t start, len, total = 0;
+	uint32_t bs;
+	size_t n;
+	int fd;
+
+	read_all(0, &hdr, sizeof(hdr));
+	if (memcmp(hdr.magic, SEND_MAGIC, sizeof(hdr.magic)) ||
+	    le32toh(hdr.version) != SEND_VERSION) {
+		fprintf(stderr, "not an ext4 snapshot stream\n");
+		return 1;
+	}
+	bs = le32toh(hdr.block_size);
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		die(path);
+	for (;;) {
+		read_all(0, &rec, sizeof(rec));
+		start = le64toh(rec.start);
+		len = le64toh(rec.len);
+		if (!len)
+			break;
+		total += len;
+		start *= bs;
+		len *= bs;
+		while (len > 0) {
+			n = len < SEND_IO_SIZE ? len : SEND_IO_SIZE;
+			read_all(0, buf, n);
+			if (pwrite(fd, buf, n, start) != (ssize_t)n)
+				die("pwrite");
+			start += n;
+			len -= n;
+		}
+	}
+	if (fsync(fd))
+		die("fsync");
+	fprintf(stderr, "received %llu of %llu blocks\n",
+		(unsigned long long)total,
+		(unsigned long long)le64toh(hdr.blocks));
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc == 4 && !strcmp(argv[1], "send"))
+		return do_send(argv[2], argv[3]);
+	if (argc == 3 && !strcmp(argv[1], "receive"))
+		return do_receive(argv[2]);
+
+	fprintf(stderr, "usage: %s send <older snapshot> <snapshot>\n"
+		"       %s receive <replica image>\n", argv[0], argv[0]);
+	return 2;
+}
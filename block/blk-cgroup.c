@@ -119,6 +119,52 @@ struct blkio_cgroup *task_blkio_cgroup(struct task_struct *tsk)
 }
 EXPORT_SYMBOL_GPL(task_blkio_cgroup);
 
+/*
+ * Returns the cgroup to charge @bio to: the cgroup the bio was issued on
+ * behalf of, if it is tagged and the cgroup still exists, or the cgroup of
+ * the submitting task.  Called under rcu_read_lock().
+ */
+struct blkio_cgroup *bio_blkio_cgroup(struct bio *bio)
+{
+#ifdef CONFIG_BLK_CGROUP
+	struct cgroup_subsys_state *css;
+
+	if (bio->bi_blkcg_id) {
+		css = css_lookup(&blkio_subsys, bio->bi_blkcg_id);
+		if (css)
+			return container_of(css, struct blkio_cgroup, css);
+	}
+#endif
+	return task_blkio_cgroup(current);
+}
+EXPORT_SYMBOL_GPL(bio_blkio_cgroup);
+
+#ifdef CONFIG_BLK_CGROUP
+/*
+ * blkio_cgroup_charge_cow - account copy-on-write I/O to the current task
+ * @bytes: size of the copy the current task triggered
+ *
+ * File systems that copy data on write (e.g. to a snapshot) often write
+ * the copies later, from the journal or the flusher thread.  Account the
+ * copy to the cgroup of the task that triggered it and return the css id
+ * to tag the buffer with (b_blkcg_id), so the write is charged to the
+ * same cgroup when it is submitted.
+ */
+unsigned short blkio_cgroup_charge_cow(unsigned int bytes)
+{
+	struct blkio_cgroup *blkcg;
+	unsigned short id;
+
+	rcu_read_lock();
+	blkcg = task_blkio_cgroup(current);
+	atomic64_add(bytes, &blkcg->cow_bytes);
+	id = css_id(&blkcg->css);
+	rcu_read_unlock();
+	return id;
+}
+EXPORT_SYMBOL_GPL(blkio_cgroup_charge_cow);
+#endif
+
 static inline void
 blkio_update_group_weight(struct blkio_group *blkg, unsigned int weight)
 {
@@ -586,6 +632,7 @@ blkiocg_reset_stats(struct cgroup *cgroup, struct cftype *cftype, u64 val)
 #endif
 
 	blkcg = cgroup_to_blkio_cgroup(cgroup);
+	atomic64_set(&blkcg->cow_bytes, 0);
 	spin_lock_irq(&blkcg->lock);
 	hlist_for_each_entry(blkg, n, &blkcg->blkg_list, blkcg_node) {
 		spin_lock(&blkg->stats_lock);
@@ -1365,6 +1412,13 @@ blkiocg_file_write_u64(struct cgroup *cgrp, struct cftype *cft, u64 val)
 	return 0;
 }
 
+#ifdef CONFIG_BLK_CGROUP
+static u64 blkiocg_cow_bytes_read(struct cgroup *cgrp, struct cftype *cft)
+{
+	return atomic64_read(&cgroup_to_blkio_cgroup(cgrp)->cow_bytes);
+}
+
+#endif
 struct cftype blkio_files[] = {
 	{
 		.name = "weight_device",
@@ -1433,6 +1487,12 @@ struct cftype blkio_files[] = {
 		.name = "reset_stats",
 		.write_u64 = blkiocg_reset_stats,
 	},
+#ifdef CONFIG_BLK_CGROUP
+	{
+		.name = "cow_bytes",
+		.read_u64 = blkiocg_cow_bytes_read,
+	},
+#endif
 #ifdef CONFIG_BLK_DEV_THROTTLING
 	{
 		.name = "throttle.read_bps_device",
@@ -306,14 +306,15 @@ throtl_grp *throtl_find_tg(struct throtl_data *td, struct blkio_cgroup *blkcg)
  * This function returns with queue lock unlocked in case of error, like
  * request queue is no more
  */
-static struct throtl_grp * throtl_get_tg(struct throtl_data *td)
+static struct throtl_grp * throtl_get_tg(struct throtl_data *td,
+					  struct bio *bio)
 {
 	struct throtl_grp *tg = NULL, *__tg = NULL;
 	struct blkio_cgroup *blkcg;
 	struct request_queue *q = td->queue;
 
 	rcu_read_lock();
-	blkcg = task_blkio_cgroup(current);
+	blkcg = bio_blkio_cgroup(bio);
 	tg = throtl_find_tg(td, blkcg);
 	if (tg) {
 		rcu_read_unlock();
@@ -353,7 +354,7 @@ static struct throtl_grp * throtl_get_tg(struct throtl_data *td)
 	 * Initialize the new group. After sleeping, read the blkcg again.
 	 */
 	rcu_read_lock();
-	blkcg = task_blkio_cgroup(current);
+	blkcg = bio_blkio_cgroup(bio);
 
 	/*
 	 * If some other thread already allocated the group while we were
@@ -755,6 +756,32 @@ static void throtl_charge_bio(struct throtl_grp *tg, struct bio *bio)
 	blkiocg_update_dispatch_stats(&tg->blkg, bio->bi_size, rw, sync);
 }
 
+/*
+ * Metadata bios are issued by file systems while holding file system wide
+ * resources, e.g. a running journal transaction handle.  Queueing them
+ * behind the limits of the issuing group would stall the tasks of every
+ * other group on the same file system.  Dispatch them right away, but
+ * charge them to the current slice of the group, so the group pays for
+ * them by having its following bios delayed.
+ * The same goes for bios tagged with the group they are issued on behalf
+ * of (bi_blkcg_id), e.g. snapshot copies written by the journal at commit
+ * time, so one throttled group cannot hold up the commit for all groups.
+ */
+static void throtl_charge_bypass_bio(struct throtl_data *td,
+		struct throtl_grp *tg, struct bio *bio)
+{
+	bool rw = bio_data_dir(bio);
+
+	if (throtl_slice_used(td, tg, rw))
+		throtl_start_new_slice(td, tg, rw);
+	throtl_charge_bio(tg, bio);
+	throtl_log_tg(td, tg, "[%c] bypass bio. bdisp=%llu sz=%u"
+			" iodisp=%u queued=%d/%d",
+			rw == READ ? 'R' : 'W',
+			tg->bytes_disp[rw], bio->bi_size, tg->io_disp[rw],
+			tg->nr_queued[READ], tg->nr_queued[WRITE]);
+}
+
 static void throtl_add_bio_tg(struct throtl_data *td, struct throtl_grp *tg,
 			struct bio *bio)
 {
@@ -1143,7 +1170,7 @@ int blk_throtl_bio(struct request_queue *q, struct bio **biop)
 	 */
 
 	rcu_read_lock();
-	blkcg = task_blkio_cgroup(current);
+	blkcg = bio_blkio_cgroup(bio);
 	tg = throtl_find_tg(td, blkcg);
 	if (tg) {
 		throtl_tg_fill_dev_details(td, tg);
@@ -1163,7 +1190,7 @@ int blk_throtl_bio(struct request_queue *q, struct bio **biop)
 	 */
 
 	spin_lock_irq(q->queue_lock);
-	tg = throtl_get_tg(td);
+	tg = throtl_get_tg(td, bio);
 
 	if (IS_ERR(tg)) {
 		if (PTR_ERR(tg)	== -ENODEV) {
@@ -1174,6 +1201,11 @@ int blk_throtl_bio(struct request_queue *q, struct bio **biop)
 		}
 	}
 
+	if ((bio->bi_rw & REQ_META) || bio->bi_blkcg_id) {
+		throtl_charge_bypass_bio(td, tg, bio);
+		goto out;
+	}
+
 	if (tg->nr_queued[rw]) {
 		/*
 		 * There is already another bio queued in same dir. No
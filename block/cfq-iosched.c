@@ -3821,6 +3821,33 @@ queue_fail:
 	return 1;
 }
 
+/*
+ * The current task waits for I/O of another task, e.g. an fsync caller
+ * waiting for the jbd2 commit thread.  If its sync queue is active and
+ * has no more requests queued, expire the slice now instead of idling
+ * for requests that will not come before the other task's I/O is done.
+ * Called with the queue lock held.
+ */
+static void cfq_yield(struct request_queue *q)
+{
+	struct cfq_data *cfqd = q->elevator->elevator_data;
+	struct cfq_io_context *cic;
+	struct cfq_queue *cfqq;
+
+	cic = cfq_cic_lookup(cfqd, current->io_context);
+	if (!cic)
+		return;
+
+	cfqq = cic_to_cfqq(cic, 1);
+	if (!cfqq || cfqq != cfqd->active_queue ||
+	    !RB_EMPTY_ROOT(&cfqq->sort_list))
+		return;
+
+	cfq_log_cfqq(cfqd, cfqq, "yield");
+	__cfq_slice_expired(cfqd, cfqq, false);
+	cfq_schedule_dispatch(cfqd);
+}
+
 static void cfq_kick_queue(struct work_struct *work)
 {
 	struct cfq_data *cfqd =
@@ -4233,6 +4260,7 @@ static struct elevator_type iosched_cfq = {
 		.elevator_set_req_fn =		cfq_set_request,
 		.elevator_put_req_fn =		cfq_put_request,
 		.elevator_may_queue_fn =	cfq_may_queue,
+		.elevator_yield_fn =		cfq_yield,
 		.elevator_init_fn =		cfq_init_queue,
 		.elevator_exit_fn =		cfq_exit_queue,
 		.trim =				cfq_free_io_context,
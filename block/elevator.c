@@ -783,6 +783,25 @@ int elv_may_queue(struct request_queue *q, int rw)
 	return ELV_MQUEUE_MAY;
 }
 
+/*
+ * The current task is going to sleep until I/O issued by another task
+ * completes, e.g. a journal commit.  Let the elevator stop waiting for
+ * more requests from the current task.  The elevator hook is called with
+ * the queue lock held, so it cannot race with an elevator switch.
+ */
+void elv_yield(struct request_queue *q)
+{
+	struct elevator_queue *e;
+	unsigned long flags;
+
+	spin_lock_irqsave(q->queue_lock, flags);
+	e = q->elevator;
+	if (e && e->ops->elevator_yield_fn)
+		e->ops->elevator_yield_fn(q);
+	spin_unlock_irqrestore(q->queue_lock, flags);
+}
+EXPORT_SYMBOL(elv_yield);
+
 void elv_abort_queue(struct request_queue *q)
 {
 	struct request *rq;
@@ -83,6 +83,7 @@ static DEFINE_MUTEX(loop_index_mutex);
 
 static int max_part;
 static int part_shift;
+static int read_threads = 4;
 
 /*
  * Transfer functions
@@ -451,12 +452,31 @@ do_lo_receive(struct loop_device *lo,
 	return 0;
 }
 
+/*
+ * The bio is read one segment at a time, so start readahead of the whole
+ * bio range up front, to have the backing file's readpages submit it as
+ * a few large reads.
+ */
+static void
+lo_readahead(struct loop_device *lo, struct bio *bio, loff_t pos)
+{
+	struct file *file = lo->lo_backing_file;
+	pgoff_t index = pos >> PAGE_CACHE_SHIFT;
+	pgoff_t end = (pos + bio->bi_size - 1) >> PAGE_CACHE_SHIFT;
+
+	page_cache_sync_readahead(file->f_mapping, &file->f_ra, file,
+				  index, end - index + 1);
+}
+
 static int
 lo_receive(struct loop_device *lo, struct bio *bio, int bsize, loff_t pos)
 {
 	struct bio_vec *bvec;
 	int i, ret = 0;
 
+	if (bio->bi_size > PAGE_SIZE)
+		lo_readahead(lo, bio, pos);
+
 	bio_for_each_segment(bvec, bio, i) {
 		ret = do_lo_receive(lo, bvec, bsize, pos);
 		if (ret < 0)
@@ -529,6 +549,20 @@ static int loop_make_request(struct request_queue *q, struct bio *old_bio)
 		goto out;
 	if (unlikely(rw == WRITE && (lo->lo_flags & LO_FLAGS_READ_ONLY)))
 		goto out;
+	/*
+	 * transfer functions other than none may keep per device state.
+	 * while a switch is pending, reads are queued behind it, so they
+	 * are served from the new backing file.
+	 */
+	if (unlikely(!old_bio->bi_bdev))
+		lo->lo_switch_pending++;
+	else if (rw == READ && lo->lo_nr_read_threads &&
+		 !lo->lo_switch_pending && lo->transfer == transfer_none) {
+		bio_list_add(&lo->lo_read_list, old_bio);
+		wake_up(&lo->lo_read_event);
+		spin_unlock_irq(&lo->lo_lock);
+		return 0;
+	}
 	loop_add_bio(lo, old_bio);
 	wake_up(&lo->lo_event);
 	spin_unlock_irq(&lo->lo_lock);
@@ -596,6 +630,88 @@ static int loop_thread(void *data)
 	return 0;
 }
 
+/*
+ * reader thread of a read-only loop device.  Reads do not need to be
+ * ordered against each other, so several of these serve lo_read_list
+ * in parallel, to keep more than one read in flight on the backing file.
+ * They are stopped like loop_thread, after lo_state is set to Lo_rundown.
+ */
+static int loop_read_thread(void *data)
+{
+	struct loop_device *lo = data;
+	struct bio *bio;
+	int ret;
+
+	set_user_nice(current, -20);
+
+	while (!kthread_should_stop() || !bio_list_empty(&lo->lo_read_list)) {
+
+		wait_event_interruptible(lo->lo_read_event,
+				!bio_list_empty(&lo->lo_read_list) ||
+				kthread_should_stop());
+
+		spin_lock_irq(&lo->lo_lock);
+		bio = bio_list_pop(&lo->lo_read_list);
+		if (bio)
+			lo->lo_reads_active++;
+		spin_unlock_irq(&lo->lo_lock);
+		if (!bio)
+			continue;
+
+		ret = do_bio_filebacked(lo, bio);
+		bio_endio(bio, ret);
+
+		spin_lock_irq(&lo->lo_lock);
+		lo->lo_reads_active--;
+		if (!lo->lo_reads_active && bio_list_empty(&lo->lo_read_list))
+			wake_up(&lo->lo_read_idle);
+		spin_unlock_irq(&lo->lo_lock);
+	}
+
+	return 0;
+}
+
+static int loop_reads_idle(struct loop_device *lo)
+{
+	int idle;
+
+	spin_lock_irq(&lo->lo_lock);
+	idle = !lo->lo_reads_active && bio_list_empty(&lo->lo_read_list);
+	spin_unlock_irq(&lo->lo_lock);
+	return idle;
+}
+
+static void loop_stop_read_threads(struct loop_device *lo)
+{
+	while (lo->lo_nr_read_threads > 0)
+		kthread_stop(lo->lo_read_threads[--lo->lo_nr_read_threads]);
+}
+
+/*
+ * Start the reader threads of a read-only loop device.  Failing to start
+ * them is not fatal, loop_thread serves the reads of a device with none.
+ */
+static void loop_start_read_threads(struct loop_device *lo)
+{
+	int nr = min(read_threads, LOOP_MAX_READ_THREADS);
+	struct task_struct *t;
+
+	bio_list_init(&lo->lo_read_list);
+	lo->lo_reads_active = 0;
+	lo->lo_switch_pending = 0;
+	lo->lo_nr_read_threads = 0;
+	if (!(lo->lo_flags & LO_FLAGS_READ_ONLY))
+		return;
+
+	while (lo->lo_nr_read_threads < nr) {
+		t = kthread_run(loop_read_thread, lo, "loop%d.%d",
+				lo->lo_number, lo->lo_nr_read_threads);
+		if (IS_ERR(t))
+			break;
+		lo->lo_read_threads[lo->lo_nr_read_threads++] = t;
+	}
+}
+
 /*
  * loop_switch performs the hard work of switching a backing store.
  * First it needs to flush existing IO, it does this by sending a magic
@@ -637,6 +753,12 @@ static void do_loop_switch(struct loop_device *lo, struct switch_request *p)
 	struct file *old_file = lo->lo_backing_file;
 	struct address_space *mapping;
 
+	/*
+	 * reads queued to the reader threads are flushed as well.
+	 * no more reads are queued to them until the switch is done.
+	 */
+	wait_event(lo->lo_read_idle, loop_reads_idle(lo));
+
 	/* if no new file, only flush of queued bios requested */
 	if (!file)
 		goto out;
@@ -649,6 +771,9 @@ static void do_loop_switch(struct loop_device *lo, struct switch_request *p)
 	lo->old_gfp_mask = mapping_gfp_mask(mapping);
 	mapping_set_gfp_mask(mapping, lo->old_gfp_mask & ~(__GFP_IO|__GFP_FS));
 out:
+	spin_lock_irq(&lo->lo_lock);
+	lo->lo_switch_pending--;
+	spin_unlock_irq(&lo->lo_lock);
 	complete(&p->wait);
 }
 
@@ -917,6 +1042,7 @@ static int loop_set_fd(struct loop_device *lo, fmode_t mode,
 		error = PTR_ERR(lo->lo_thread);
 		goto out_clr;
 	}
+	loop_start_read_threads(lo);
 	lo->lo_state = Lo_bound;
 	wake_up_process(lo->lo_thread);
 	if (max_part > 0)
@@ -998,6 +1124,7 @@ static int loop_clr_fd(struct loop_device *lo, struct block_device *bdev)
 	lo->lo_state = Lo_rundown;
 	spin_unlock_irq(&lo->lo_lock);
 
+	loop_stop_read_threads(lo);
 	kthread_stop(lo->lo_thread);
 
 	spin_lock_irq(&lo->lo_lock);
@@ -1548,6 +1675,8 @@ module_param(max_loop, int, S_IRUGO);
 MODULE_PARM_DESC(max_loop, "Maximum number of loop devices");
 module_param(max_part, int, S_IRUGO);
 MODULE_PARM_DESC(max_part, "Maximum number of partitions per loop device");
+module_param(read_threads, int, S_IRUGO);
+MODULE_PARM_DESC(read_threads, "Number of reader threads per read-only loop device");
 MODULE_LICENSE("GPL");
 MODULE_ALIAS_BLOCKDEV_MAJOR(LOOP_MAJOR);
 
@@ -1639,6 +1768,8 @@ static int loop_add(struct loop_device **l, int i)
 	lo->lo_number		= i;
 	lo->lo_thread		= NULL;
 	init_waitqueue_head(&lo->lo_event);
+	init_waitqueue_head(&lo->lo_read_event);
+	init_waitqueue_head(&lo->lo_read_idle);
 	spin_lock_init(&lo->lo_lock);
 	disk->major		= LOOP_MAJOR;
 	disk->first_minor	= i << part_shift;
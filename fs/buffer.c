@@ -1240,7 +1240,7 @@ static struct buffer_head *__bread_slow(struct buffer_head *bh)
  * a local interrupt disable for that.
  */
 
-#define BH_LRU_SIZE	8
+#define BH_LRU_SIZE	16
 
 struct bh_lru {
 	struct buffer_head *bhs[BH_LRU_SIZE];
@@ -2941,6 +2941,11 @@ int submit_bh(int rw, struct buffer_head * bh)
 
 	bio->bi_end_io = end_bio_bh_io_sync;
 	bio->bi_private = bh;
+#ifdef CONFIG_BLK_CGROUP
+	/* charge I/O issued on behalf of another cgroup to that cgroup */
+	bio->bi_blkcg_id = bh->b_blkcg_id;
+	bh->b_blkcg_id = 0;
+#endif
 
 	bio_get(bio);
 	submit_bio(rw, bio);
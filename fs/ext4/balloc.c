@@ -414,8 +414,13 @@ unsigned ext4_init_exclude_bitmap(struct super_block *sb,
  *
  * Return buffer_head on success or NULL in case of failure.
  */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_CACHE
+static struct buffer_head *
+__ext4_read_exclude_bitmap(struct super_block *sb, ext4_group_t block_group)
+#else
 struct buffer_head *
 ext4_read_exclude_bitmap(struct super_block *sb, ext4_group_t block_group)
+#endif
 {
 	struct ext4_group_desc *desc;
 	struct buffer_head *bh = NULL;
@@ -484,6 +489,119 @@ ext4_read_exclude_bitmap(struct super_block *sb, ext4_group_t block_group)
 	return bh;
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_CACHE
+/*
+ * Read the exclude bitmap for a given block_group and pin the buffer in the
+ * group info, so the next calls skip the descriptor and buffer cache lookup.
+ *
+ * Return buffer_head on success or NULL in case of failure.
+ */
+struct buffer_head *
+ext4_read_exclude_bitmap(struct super_block *sb, ext4_group_t block_group)
+{
+	struct ext4_group_info *grp = ext4_get_group_info(sb, block_group);
+	struct buffer_head *bh;
+
+	ext4_lock_group(sb, block_group);
+	bh = grp->bg_exclude_bh;
+	if (bh)
+		get_bh(bh);
+	ext4_unlock_group(sb, block_group);
+	if (bh)
+		return bh;
+
+	bh = __ext4_read_exclude_bitmap(sb, block_group);
+	if (!bh || !buffer_uptodate(bh))
+		return bh;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_SHRINK
+	/* over the pin limit - return the buffer without pinning it */
+	if (EXT4_SB(sb)->s_exclude_bh_max &&
+	    atomic_read(&EXT4_SB(sb)->s_exclude_bh_pinned) >=
+	    EXT4_SB(sb)->s_exclude_bh_max)
+		return bh;
+#endif
+
+	ext4_lock_group(sb, block_group);
+	if (!grp->bg_exclude_bh) {
+		get_bh(bh);
+		grp->bg_exclude_bh = bh;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_SHRINK
+		atomic_inc(&EXT4_SB(sb)->s_exclude_bh_pinned);
+#endif
+	}
+	ext4_unlock_group(sb, block_group);
+	return bh;
+}
+
+/*
+ * Release the exclude bitmap buffer pinned in the group info.
+ */
+void ext4_put_exclude_bitmap(struct super_block *sb, ext4_group_t block_group)
+{
+	struct ext4_group_info *grp = ext4_get_group_info(sb, block_group);
+	struct buffer_head *bh;
+
+	ext4_lock_group(sb, block_group);
+	bh = grp->bg_exclude_bh;
+	grp->bg_exclude_bh = NULL;
+	ext4_unlock_group(sb, block_group);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_SHRINK
+	if (bh)
+		atomic_dec(&EXT4_SB(sb)->s_exclude_bh_pinned);
+#endif
+	brelse(bh);
+}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_SHRINK
+
+/*
+ * Unpin exclude bitmap buffers under memory pressure, so their pages can
+ * be reclaimed.  Groups are scanned round robin from where the last scan
+ * stopped.  An unpinned exclude bitmap is pinned again on next access.
+ */
+static int ext4_exclude_bh_shrink(struct shrinker *shrink,
+				  struct shrink_control *sc)
+{
+	struct ext4_sb_info *sbi = container_of(shrink, struct ext4_sb_info,
+						s_exclude_bh_shrinker);
+	struct super_block *sb = sbi->s_exclude_bh_sb;
+	ext4_group_t ngroups = ext4_get_groups_count(sb);
+	ext4_group_t group = sbi->s_exclude_bh_scan;
+	int nr_to_scan = sc->nr_to_scan;
+	ext4_group_t i;
+
+	for (i = 0; i < ngroups && nr_to_scan > 0 &&
+	     atomic_read(&sbi->s_exclude_bh_pinned) > 0; i++) {
+		if (++group >= ngroups)
+			group = 0;
+		if (!ACCESS_ONCE(ext4_get_group_info(sb, group)->bg_exclude_bh))
+			continue;
+		ext4_put_exclude_bitmap(sb, group);
+		nr_to_scan--;
+	}
+	sbi->s_exclude_bh_scan = group;
+	return atomic_read(&sbi->s_exclude_bh_pinned) / 100 *
+		sysctl_vfs_cache_pressure;
+}
+
+void ext4_register_exclude_shrinker(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	sbi->s_exclude_bh_sb = sb;
+	sbi->s_exclude_bh_scan = 0;
+	atomic_set(&sbi->s_exclude_bh_pinned, 0);
+	sbi->s_exclude_bh_shrinker.shrink = ext4_exclude_bh_shrink;
+	sbi->s_exclude_bh_shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&sbi->s_exclude_bh_shrinker);
+}
+
+void ext4_unregister_exclude_shrinker(struct super_block *sb)
+{
+	unregister_shrinker(&EXT4_SB(sb)->s_exclude_bh_shrinker);
+}
+#endif
+
+#endif
 #endif
 /**
  * ext4_has_free_blocks()
@@ -498,7 +616,13 @@ static int ext4_has_free_blocks(struct ext4_sb_info *sbi,
 {
 	s64 free_blocks, dirty_blocks, root_blocks;
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_EXACT
+	struct percpu_counter *rbc = &sbi->s_snapshot_r_blocks_counter;
+	s64 snapshot_r_blocks = 0;
+	int cowing = 0;
+#else
 	ext4_fsblk_t snapshot_r_blocks;
+#endif
 	handle_t *handle = journal_current_handle();
 #endif
 	struct percpu_counter *fbc = &sbi->s_freeblocks_counter;
@@ -507,8 +631,39 @@ static int ext4_has_free_blocks(struct ext4_sb_info *sbi,
 	free_blocks  = percpu_counter_read_positive(fbc);
 	dirty_blocks = percpu_counter_read_positive(dbc);
 	root_blocks = ext4_r_blocks_count(sbi->s_es);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_EVICT
+	/* evict snapshots before COW runs out of space */
+	if (ext4_snapshot_active(sbi) &&
+	    ext4_snapshot_evict_needed(sbi, free_blocks - dirty_blocks))
+		ext4_snapshot_wake_evict(sbi);
+#endif
 
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_EXACT
+	if (ext4_snapshot_active(sbi)) {
+		/* any available space may be used by COWing task */
+		cowing = handle && unlikely(IS_COWING(handle));
+		/* reserve blocks for active snapshot */
+		if (!cowing)
+			snapshot_r_blocks = percpu_counter_read_positive(rbc);
+	}
+	if (free_blocks - (nblocks + root_blocks + snapshot_r_blocks +
+			   dirty_blocks) < EXT4_FREEBLOCKS_WATERMARK) {
+		free_blocks  = percpu_counter_sum_positive(fbc);
+		dirty_blocks = percpu_counter_sum_positive(dbc);
+		if (snapshot_r_blocks)
+			snapshot_r_blocks = percpu_counter_sum_positive(rbc);
+	}
+	if (cowing)
+		return free_blocks >= nblocks + dirty_blocks;
+	/*
+	 * The last snapshot_r_blocks are reserved for active snapshot
+	 * and may not be allocated even by root.
+	 */
+	if (free_blocks < nblocks + dirty_blocks + snapshot_r_blocks)
+		return 0;
+	/* mortal users must reserve blocks for both snapshot and root user */
+	root_blocks += snapshot_r_blocks;
+#elif defined(CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE)
 	if (ext4_snapshot_active(sbi)) {
 		if (unlikely(free_blocks < (nblocks + dirty_blocks)))
 			/* sorry, but we're really out of space */
@@ -517,8 +672,13 @@ static int ext4_has_free_blocks(struct ext4_sb_info *sbi,
 			/* any available space may be used by COWing task */
 			return 1;
 		/* reserve blocks for active snapshot */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_TRACK
+		snapshot_r_blocks = percpu_counter_read_positive(
+				&sbi->s_snapshot_r_blocks_counter);
+#else
 		snapshot_r_blocks =
 			le64_to_cpu(sbi->s_es->s_snapshot_r_blocks_count);
+#endif
 		/*
 		 * The last snapshot_r_blocks are reserved for active snapshot
 		 * and may not be allocated even by root.
@@ -533,11 +693,13 @@ static int ext4_has_free_blocks(struct ext4_sb_info *sbi,
 	}
 
 #endif
+#ifndef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_EXACT
 	if (free_blocks - (nblocks + root_blocks + dirty_blocks) <
 						EXT4_FREEBLOCKS_WATERMARK) {
 		free_blocks  = percpu_counter_sum_positive(fbc);
 		dirty_blocks = percpu_counter_sum_positive(dbc);
 	}
+#endif
 	/* Check whether we have space after
 	 * accounting for current dirty blocks & root reserved blocks.
 	 */
@@ -567,6 +729,21 @@ int ext4_claim_free_blocks(struct ext4_sb_info *sbi,
 		return -ENOSPC;
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_DATA
+/*
+ * ext4_snapshot_has_free_blocks() - check for space to COW journaled data
+ * Journaled data blocks are COWed to the active snapshot, and a COW may not
+ * fail, so check before the overwrite that @nblocks are available outside
+ * of the snapshot reserve, as for a move-on-write allocation.
+ */
+int ext4_snapshot_has_free_blocks(struct super_block *sb, s64 nblocks)
+{
+	if (!ext4_snapshot_has_active(sb))
+		return 1;
+	return ext4_has_free_blocks(EXT4_SB(sb), nblocks, 0);
+}
+
+#endif
 /**
  * ext4_should_retry_alloc()
  * @sb:			super block
@@ -615,7 +792,12 @@ ext4_fsblk_t ext4_new_meta_blocks(handle_t *handle, struct inode *inode,
 	ar.inode = inode;
 	ar.goal = goal;
 	ar.len = count ? *count : 1;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_TRACK
+	/* account for metadata blocks in ext4_mb_new_blocks() */
+	ar.flags = flags | EXT4_MB_HINT_METADATA;
+#else
 	ar.flags = flags;
+#endif
 
 	ret = ext4_mb_new_blocks(handle, &ar, errp);
 	if (count)
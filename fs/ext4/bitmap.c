@@ -11,6 +11,29 @@
 #include <linux/jbd2.h>
 #include "ext4.h"
 
+#ifdef CONFIG_EXT4_FS_COUNT_FREE_HWEIGHT
+/*
+ * Count the clear bits in the first @numchars bytes of the bitmap.
+ * b_data is at least word aligned, so whole words are counted first
+ * and only the trailing bytes are counted one at a time.
+ */
+unsigned int ext4_count_free(struct buffer_head *map, unsigned int numchars)
+{
+	const char *bitmap;
+	unsigned int i = 0, used = 0;
+
+	if (!map)
+		return 0;
+	bitmap = map->b_data;
+	for (; i + sizeof(unsigned long) <= numchars;
+	     i += sizeof(unsigned long))
+		used += hweight_long(*(const unsigned long *)(bitmap + i));
+	for (; i < numchars; i++)
+		used += hweight8(bitmap[i]);
+	return numchars * 8 - used;
+}
+
+#else
 #ifdef EXT4FS_DEBUG
 
 static const int nibblemap[] = {4, 3, 3, 2, 3, 2, 2, 1, 3, 2, 2, 1, 2, 1, 1, 0};
@@ -28,4 +51,4 @@ unsigned int ext4_count_free(struct buffer_head *map, unsigned int numchars)
 }
 
 #endif  /*  EXT4FS_DEBUG  */
-
+#endif
@@ -29,6 +29,13 @@ struct ext4_system_zone {
 
 static struct kmem_cache *ext4_system_zone_cachep;
 
+#ifdef CONFIG_EXT4_FS_SYSTEM_ZONE_ARRAY
+struct ext4_system_zone_range {
+	ext4_fsblk_t	start_blk;
+	ext4_fsblk_t	end_blk;	/* last block + 1 */
+};
+#endif
+
 int __init ext4_init_system_zone(void)
 {
 	ext4_system_zone_cachep = KMEM_CACHE(ext4_system_zone, 0);
@@ -138,6 +145,77 @@ static void debug_print_tree(struct ext4_sb_info *sbi)
 	printk("\n");
 }
 
+static void release_system_zone_tree(struct ext4_sb_info *sbi)
+{
+	struct rb_node	*n = sbi->system_blks.rb_node;
+	struct rb_node	*parent;
+	struct ext4_system_zone	*entry;
+
+	while (n) {
+		/* Do the node's children first */
+		if (n->rb_left) {
+			n = n->rb_left;
+			continue;
+		}
+		if (n->rb_right) {
+			n = n->rb_right;
+			continue;
+		}
+		/*
+		 * The node has no children; free it, and then zero
+		 * out parent's link to it.  Finally go to the
+		 * beginning of the loop and try to free the parent
+		 * node.
+		 */
+		parent = rb_parent(n);
+		entry = rb_entry(n, struct ext4_system_zone, node);
+		kmem_cache_free(ext4_system_zone_cachep, entry);
+		if (!parent)
+			sbi->system_blks = RB_ROOT;
+		else if (parent->rb_left == n)
+			parent->rb_left = NULL;
+		else if (parent->rb_right == n)
+			parent->rb_right = NULL;
+		n = parent;
+	}
+	sbi->system_blks = RB_ROOT;
+}
+
+#ifdef CONFIG_EXT4_FS_SYSTEM_ZONE_ARRAY
+/*
+ * Pack the system zones tree into a sorted array of ranges, which is
+ * cheaper to search, and free the tree.
+ */
+static int pack_system_zone(struct ext4_sb_info *sbi)
+{
+	struct ext4_system_zone_range *zones;
+	struct ext4_system_zone *entry;
+	struct rb_node *node;
+	unsigned int nr = 0;
+
+	for (node = rb_first(&sbi->system_blks); node; node = rb_next(node))
+		nr++;
+	if (!nr)
+		return 0;
+
+	zones = ext4_kvmalloc(nr * sizeof(*zones), GFP_KERNEL);
+	if (!zones)
+		return -ENOMEM;
+
+	nr = 0;
+	for (node = rb_first(&sbi->system_blks); node; node = rb_next(node)) {
+		entry = rb_entry(node, struct ext4_system_zone, node);
+		zones[nr].start_blk = entry->start_blk;
+		zones[nr].end_blk = entry->start_blk + entry->count;
+		nr++;
+	}
+	sbi->s_system_zones = zones;
+	sbi->s_nr_system_zones = nr;
+	release_system_zone_tree(sbi);
+	return 0;
+}
+
+#endif
 int ext4_setup_system_zone(struct super_block *sb)
 {
 	ext4_group_t ngroups = ext4_get_groups_count(sb);
@@ -147,6 +225,13 @@ int ext4_setup_system_zone(struct super_block *sb)
 	int flex_size = ext4_flex_bg_size(sbi);
 	int ret;
 
+#ifdef CONFIG_EXT4_FS_SYSTEM_ZONE_ARRAY
+	if (sbi->s_system_zones) {
+		if (!test_opt(sb, BLOCK_VALIDITY))
+			ext4_release_system_zone(sb);
+		return 0;
+	}
+#endif
 	if (!test_opt(sb, BLOCK_VALIDITY)) {
 		if (EXT4_SB(sb)->system_blks.rb_node)
 			ext4_release_system_zone(sb);
@@ -175,44 +260,24 @@ int ext4_setup_system_zone(struct super_block *sb)
 
 	if (test_opt(sb, DEBUG))
 		debug_print_tree(EXT4_SB(sb));
+#ifdef CONFIG_EXT4_FS_SYSTEM_ZONE_ARRAY
+	return pack_system_zone(sbi);
+#else
 	return 0;
+#endif
 }
 
 /* Called when the filesystem is unmounted */
 void ext4_release_system_zone(struct super_block *sb)
 {
-	struct rb_node	*n = EXT4_SB(sb)->system_blks.rb_node;
-	struct rb_node	*parent;
-	struct ext4_system_zone	*entry;
+#ifdef CONFIG_EXT4_FS_SYSTEM_ZONE_ARRAY
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
 
-	while (n) {
-		/* Do the node's children first */
-		if (n->rb_left) {
-			n = n->rb_left;
-			continue;
-		}
-		if (n->rb_right) {
-			n = n->rb_right;
-			continue;
-		}
-		/*
-		 * The node has no children; free it, and then zero
-		 * out parent's link to it.  Finally go to the
-		 * beginning of the loop and try to free the parent
-		 * node.
-		 */
-		parent = rb_parent(n);
-		entry = rb_entry(n, struct ext4_system_zone, node);
-		kmem_cache_free(ext4_system_zone_cachep, entry);
-		if (!parent)
-			EXT4_SB(sb)->system_blks = RB_ROOT;
-		else if (parent->rb_left == n)
-			parent->rb_left = NULL;
-		else if (parent->rb_right == n)
-			parent->rb_right = NULL;
-		n = parent;
-	}
-	EXT4_SB(sb)->system_blks = RB_ROOT;
+	ext4_kvfree(sbi->s_system_zones);
+	sbi->s_system_zones = NULL;
+	sbi->s_nr_system_zones = 0;
+#endif
+	release_system_zone_tree(EXT4_SB(sb));
 }
 
 /*
@@ -232,6 +297,30 @@ int ext4_data_block_valid(struct ext4_sb_info *sbi, ext4_fsblk_t start_blk,
 		sbi->s_es->s_last_error_block = cpu_to_le64(start_blk);
 		return 0;
 	}
+#ifdef CONFIG_EXT4_FS_SYSTEM_ZONE_ARRAY
+	if (sbi->s_nr_system_zones) {
+		struct ext4_system_zone_range *zone = sbi->s_system_zones;
+		ext4_fsblk_t last_blk = start_blk + count - 1;
+		unsigned int nr = sbi->s_nr_system_zones, half;
+
+		/*
+		 * Find the last zone which starts at or before last_blk.
+		 * The loop has a fixed number of iterations for a given
+		 * array size and the compare compiles to a conditional move.
+		 */
+		while (nr > 1) {
+			half = nr >> 1;
+			zone = (zone[half].start_blk <= last_blk) ?
+				zone + half : zone;
+			nr -= half;
+		}
+		if (zone->start_blk <= last_blk && start_blk < zone->end_blk) {
+			sbi->s_es->s_last_error_block = cpu_to_le64(start_blk);
+			return 0;
+		}
+		return 1;
+	}
+#endif
 	while (n) {
 		entry = rb_entry(n, struct ext4_system_zone, node);
 		if (start_blk + count - 1 < entry->start_blk)
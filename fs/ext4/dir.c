@@ -108,6 +108,45 @@ int __ext4_check_dir_entry(const char *function, unsigned int line,
 	return 1;
 }
 
+#ifdef CONFIG_EXT4_FS_DIR_INODE_READAHEAD
+#define DIR_INODE_RA_BATCH	32
+
+/*
+ * Read ahead the inode table blocks of the entries of a directory block,
+ * for the stat() calls that usually follow readdir.
+ */
+void ext4_dirblock_inode_readahead(struct inode *dir, struct buffer_head *bh)
+{
+	struct super_block *sb = dir->i_sb;
+	unsigned long inos[DIR_INODE_RA_BATCH];
+	struct ext4_dir_entry_2 *de;
+	unsigned int offset = 0, rlen;
+	int nr = 0;
+
+	if (!EXT4_SB(sb)->s_dir_inode_readahead)
+		return;
+
+	while (offset + EXT4_DIR_REC_LEN(1) <= sb->s_blocksize) {
+		de = (struct ext4_dir_entry_2 *) (bh->b_data + offset);
+		rlen = ext4_rec_len_from_disk(de->rec_len, sb->s_blocksize);
+		/* bad entries are reported by the readdir that follows */
+		if (rlen < EXT4_DIR_REC_LEN(1) ||
+		    offset + rlen > sb->s_blocksize)
+			break;
+		offset += rlen;
+		if (!de->inode)
+			continue;
+		inos[nr++] = le32_to_cpu(de->inode);
+		if (nr == DIR_INODE_RA_BATCH) {
+			ext4_inode_table_readahead(sb, inos, nr);
+			nr = 0;
+		}
+	}
+	if (nr)
+		ext4_inode_table_readahead(sb, inos, nr);
+}
+
+#endif
 static int ext4_readdir(struct file *filp,
 			 void *dirent, filldir_t filldir)
 {
@@ -159,6 +198,10 @@ static int ext4_readdir(struct file *filp,
 					index, 1);
 			filp->f_ra.prev_pos = (loff_t)index << PAGE_CACHE_SHIFT;
 			bh = ext4_bread(NULL, inode, map.m_lblk, 0, &err);
+#ifdef CONFIG_EXT4_FS_DIR_INODE_READAHEAD
+			if (bh && !offset)
+				ext4_dirblock_inode_readahead(inode, bh);
+#endif
 		}
 
 		/*
@@ -286,6 +329,120 @@ struct fname {
 	char		name[0];
 };
 
+#ifdef CONFIG_EXT4_FS_READDIR_CACHE
+/*
+ * Tree nodes are allocated from page sized chunks that are linked to the
+ * open directory file.  The whole tree is freed at once by rewinding the
+ * chunks, which are reused for the next fill of the tree.
+ */
+struct fname_chunk {
+	struct fname_chunk	*next;
+	unsigned int		used;
+	char			data[0];
+};
+
+#define FNAME_CHUNK_SIZE	(PAGE_SIZE - sizeof(struct fname_chunk))
+
+static struct fname *ext4_htree_alloc_fname(struct dir_private_info *info,
+					    int len)
+{
+	struct fname_chunk *chunk = info->curr_chunk;
+	struct fname *fname;
+
+	len = ALIGN(len, sizeof(long));
+	if (chunk && chunk->used + len > FNAME_CHUNK_SIZE) {
+		chunk = chunk->next;
+		if (chunk)
+			chunk->used = 0;
+	}
+	if (!chunk) {
+		chunk = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if (!chunk)
+			return NULL;
+		chunk->used = 0;
+		if (info->curr_chunk) {
+			chunk->next = info->curr_chunk->next;
+			info->curr_chunk->next = chunk;
+		} else {
+			chunk->next = info->chunks;
+			info->chunks = chunk;
+		}
+	}
+	info->curr_chunk = chunk;
+
+	fname = (struct fname *) (chunk->data + chunk->used);
+	chunk->used += len;
+	memset(fname, 0, sizeof(*fname));
+	return fname;
+}
+
+/*
+ * Forget all of the nodes in the red-black tree, keep the chunks
+ */
+static void ext4_htree_reset_fnames(struct dir_private_info *info)
+{
+	info->root = RB_ROOT;
+	info->curr_chunk = info->chunks;
+	if (info->curr_chunk)
+		info->curr_chunk->used = 0;
+}
+
+static void ext4_htree_free_fnames(struct dir_private_info *info)
+{
+	struct fname_chunk *chunk;
+
+	while ((chunk = info->chunks)) {
+		info->chunks = chunk->next;
+		kfree(chunk);
+	}
+	info->curr_chunk = NULL;
+	info->root = RB_ROOT;
+}
+
+/*
+ * If the directory has not changed and the new position is inside the
+ * hash range covered by the tree, move the cursor instead of reading the
+ * leaf blocks again.  Returns 1 if the cursor was moved.
+ */
+static int ext4_htree_seek_cached(struct file *filp,
+				  struct dir_private_info *info)
+{
+	struct inode *inode = filp->f_path.dentry->d_inode;
+	__u32 hash = pos2maj_hash(filp->f_pos);
+	__u32 minor_hash = pos2min_hash(filp->f_pos);
+	struct rb_node *n = info->root.rb_node, *next = NULL;
+	struct fname *fname;
+
+	if (!n || filp->f_version != inode->i_version)
+		return 0;
+	if (hash < info->start_hash ||
+	    (hash == info->start_hash && minor_hash < info->start_minor_hash))
+		return 0;
+	if (info->next_hash != ~0 && hash >= info->next_hash)
+		return 0;
+
+	/* find the first node at or after the new position */
+	while (n) {
+		fname = rb_entry(n, struct fname, rb_hash);
+		if (hash < fname->hash ||
+		    (hash == fname->hash && minor_hash <= fname->minor_hash)) {
+			next = n;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+	if (!next)
+		return 0;
+
+	fname = rb_entry(next, struct fname, rb_hash);
+	info->curr_node = next;
+	info->extra_fname = NULL;
+	info->curr_hash = fname->hash;
+	info->curr_minor_hash = fname->minor_hash;
+	return 1;
+}
+
+#else
 /*
  * This functoin implements a non-recursive way of freeing all of the
  * nodes in the red-black tree.
@@ -329,6 +486,7 @@ static void free_rb_tree_fname(struct rb_root *root)
 	}
 }
 
+#endif
 
 static struct dir_private_info *ext4_htree_create_dir_info(loff_t pos)
 {
@@ -344,7 +502,11 @@ static struct dir_private_info *ext4_htree_create_dir_info(loff_t pos)
 
 void ext4_htree_free_dir_info(struct dir_private_info *p)
 {
+#ifdef CONFIG_EXT4_FS_READDIR_CACHE
+	ext4_htree_free_fnames(p);
+#else
 	free_rb_tree_fname(&p->root);
+#endif
 	kfree(p);
 }
 
@@ -365,7 +527,11 @@ int ext4_htree_store_dirent(struct file *dir_file, __u32 hash,
 
 	/* Create and allocate the fname structure */
 	len = sizeof(struct fname) + dirent->name_len + 1;
+#ifdef CONFIG_EXT4_FS_READDIR_CACHE
+	new_fn = ext4_htree_alloc_fname(info, len);
+#else
 	new_fn = kzalloc(len, GFP_KERNEL);
+#endif
 	if (!new_fn)
 		return -ENOMEM;
 	new_fn->hash = hash;
@@ -464,8 +630,14 @@ static int ext4_dx_readdir(struct file *filp,
 		return 0;	/* EOF */
 
 	/* Some one has messed with f_pos; reset the world */
+#ifdef CONFIG_EXT4_FS_READDIR_CACHE
+	if (info->last_pos != filp->f_pos &&
+	    !ext4_htree_seek_cached(filp, info)) {
+		ext4_htree_reset_fnames(info);
+#else
 	if (info->last_pos != filp->f_pos) {
 		free_rb_tree_fname(&info->root);
+#endif
 		info->curr_node = NULL;
 		info->extra_fname = NULL;
 		info->curr_hash = pos2maj_hash(filp->f_pos);
@@ -493,7 +665,13 @@ static int ext4_dx_readdir(struct file *filp,
 		if ((!info->curr_node) ||
 		    (filp->f_version != inode->i_version)) {
 			info->curr_node = NULL;
+#ifdef CONFIG_EXT4_FS_READDIR_CACHE
+			ext4_htree_reset_fnames(info);
+			info->start_hash = info->curr_hash;
+			info->start_minor_hash = info->curr_minor_hash;
+#else
 			free_rb_tree_fname(&info->root);
+#endif
 			filp->f_version = inode->i_version;
 			ret = ext4_htree_fill_tree(filp, info->curr_hash,
 						   info->curr_minor_hash,
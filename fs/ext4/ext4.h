@@ -43,45 +43,164 @@
 #endif
 #define CONFIG_EXT4_FS_SECURITY
 #define CONFIG_EXT4_DEBUG
+#define CONFIG_EXT4_FS_MB_GROUP_INDEX
+#define CONFIG_EXT4_FS_MB_PREFETCH
+#define CONFIG_EXT4_FS_MB_ADAPTIVE_GROUP_PREALLOC
+#define CONFIG_EXT4_FS_MB_BATCHED_TRIM
+#define CONFIG_EXT4_FS_HTREE_READAHEAD
+#define CONFIG_EXT4_FS_READDIR_CACHE
+#define CONFIG_EXT4_FS_ORPHAN_SHORT_LOCK
+#define CONFIG_EXT4_FS_DIR_INODE_READAHEAD
+#define CONFIG_EXT4_FS_JOURNAL_CSUM_CRC32C
+#define CONFIG_EXT4_FS_FSYNC_BATCH
+#define CONFIG_EXT4_FS_SYSTEM_ZONE_ARRAY
+#define CONFIG_EXT4_FS_LAZYINIT_BATCH
+#define CONFIG_EXT4_FS_MMP_SHARED
+#define CONFIG_EXT4_FS_STATFS_CACHE
+#define CONFIG_EXT4_FS_MB_FIND_RUN
+#define CONFIG_EXT4_FS_COUNT_FREE_HWEIGHT
+#define CONFIG_EXT4_FS_DIRHASH_WORD
+#define CONFIG_EXT4_FS_FREE_DATA_SORT
+#define CONFIG_EXT4_FS_GDT_CSUM_SEED
+#define CONFIG_EXT4_FS_FLEX_COUNTERS_PCPU
+#define CONFIG_EXT4_FS_ORLOV_GROUP_INDEX
+#define CONFIG_EXT4_FS_DIR_FREE_HINTS
+#define CONFIG_EXT4_FS_HTREE_LARGEDIR
+#define CONFIG_EXT4_FS_INLINE_DATA
 #define CONFIG_EXT4_FS_SNAPSHOT
 #define CONFIG_EXT4_FS_SNAPSHOT_
 #define CONFIG_EXT4_FS_SNAPSHOT_ROCOMPAT
 #define CONFIG_EXT4_FS_SNAPSHOT_DEBUG
+#define CONFIG_EXT4_FS_SNAPSHOT_DEBUG_LATENCY
+#define CONFIG_EXT4_FS_SNAPSHOT_DEBUG_BENCH
 #define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_JBD
+#define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_JBD_CREATE
 #define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_BITMAP
+#define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_BITMAP_CACHED
 #define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE
 #define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA
+#define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_DEFER
+#define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_WRITEBACK
+#define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_MMAP
+#define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_PARTIAL
+#define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_MOVE_EXT
+#define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_XATTR
+#define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE_BULK
+#define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE_ASYNC
 #define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DIO
 #define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT
+#define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_RANGE
+#define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_PATH
+#define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_CACHE
+#define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_MIGRATE
+#define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DIO_MOW
+#define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_PREALLOC
+#define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_NEW_BLOCKS
+#define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_MOW_GOAL
+#define CONFIG_EXT4_FS_SNAPSHOT_HOOKS_FAST
 #define CONFIG_EXT4_FS_SNAPSHOT_FILE
 #define CONFIG_EXT4_FS_SNAPSHOT_FILE_READ
+#define CONFIG_EXT4_FS_SNAPSHOT_FILE_READAHEAD
+#define CONFIG_EXT4_FS_SNAPSHOT_FILE_READAHEAD_SORT
+#define CONFIG_EXT4_FS_SNAPSHOT_FILE_READ_SHARED
+#define CONFIG_EXT4_FS_SNAPSHOT_FILE_SPLICE_SHARED
+#define CONFIG_EXT4_FS_SNAPSHOT_FILE_SPLICE_BATCH
 #define CONFIG_EXT4_FS_SNAPSHOT_FILE_PERM
 #define CONFIG_EXT4_FS_SNAPSHOT_FILE_STORE
+#define CONFIG_EXT4_FS_SNAPSHOT_META_BG
 #define CONFIG_EXT4_FS_SNAPSHOT_FILE_HUGE
+#define CONFIG_EXT4_FS_SNAPSHOT_FILE_FIEMAP
+#define CONFIG_EXT4_FS_SNAPSHOT_FILE_BDEV
+#define CONFIG_EXT4_FS_SNAPSHOT_FILE_AUTOMOUNT
+#define CONFIG_EXT4_FS_SNAPSHOT_FILE_CLONE
 #define CONFIG_EXT4_FS_SNAPSHOT_BLOCK
 #define CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW
+#define CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_RANGE
+#define CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_PACKED
+#define CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_DEDUP
+#define CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_NUMA
+#define CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COPY_NOCACHE
+#define CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_PLUG
+#define CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_MAP
+#define CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_CGROUP
 #define CONFIG_EXT4_FS_SNAPSHOT_BLOCK_MOVE
+#define CONFIG_EXT4_FS_SNAPSHOT_BLOCK_MOVE_QUOTA
 #define CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP
+#define CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_FAST
+#define CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_EXTENTS
+#define CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_HANDLE
 #define CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_ERROR
 #define CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CREDITS
+#define CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CREDITS_LAZY
 #define CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_RELEASE
 #define CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BYPASS
+#define CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BYPASS_CREDITS
 #define CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CACHE
+#define CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CACHE_LOCKLESS
 #define CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_TRACE
+#define CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
+#define CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS_RESET
+#define CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS_LOCK
+#define CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BUDGET
+#define CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CREDITS_ADAPTIVE
+#define CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_WRITEBACK
+#define CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_DATA
+#define CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_ORDERED_RANGE
+#define CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_WB_PRIO
+#define CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS
 #define CONFIG_EXT4_FS_SNAPSHOT_LIST
 #define CONFIG_EXT4_FS_SNAPSHOT_LIST_READ
+#define CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_CACHE
+#define CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_RCU
 #define CONFIG_EXT4_FS_SNAPSHOT_RACE_BITMAP
+#define CONFIG_EXT4_FS_SNAPSHOT_RACE_BITMAP_WAITQ
 #define CONFIG_EXT4_FS_SNAPSHOT_RACE_COW
+#define CONFIG_EXT4_FS_SNAPSHOT_RACE_COW_WAITQ
 #define CONFIG_EXT4_FS_SNAPSHOT_RACE_READ
+#define CONFIG_EXT4_FS_SNAPSHOT_RACE_READ_RANGE
 #define CONFIG_EXT4_FS_SNAPSHOT_CTL_INIT
+#define CONFIG_EXT4_FS_SNAPSHOT_CTL_PREALLOC
 #define CONFIG_EXT4_FS_SNAPSHOT_CTL_FIX
+#define CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_PREPARE
+#define CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_PREFETCH
+#define CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_JOURNAL_FREEZE
 #define CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE
+#define CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_TRACK
+#define CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_EXACT
+#define CONFIG_EXT4_FS_SNAPSHOT_CTL_DIFF
+#define CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_ASYNC
+#define CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_GROUP
+#define CONFIG_EXT4_FS_SNAPSHOT_CTL_SCHED
+#define CONFIG_EXT4_FS_SNAPSHOT_CTL_PREBUILD
+#define CONFIG_EXT4_FS_SNAPSHOT_CTL_LOAD_COW_BITMAP
+#define CONFIG_EXT4_FS_SNAPSHOT_CTL_LOAD_FAST
+#define CONFIG_EXT4_FS_SNAPSHOT_CTL_UPDATE_INCREMENTAL
+#define CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+#define CONFIG_EXT4_FS_SNAPSHOT_CTL_QUERY
+#define CONFIG_EXT4_FS_SNAPSHOT_CTL_GROUP_STATS
+#define CONFIG_EXT4_FS_SNAPSHOT_CTL_SEND
+#define CONFIG_EXT4_FS_SNAPSHOT_CTL_REVERT
+#define CONFIG_EXT4_FS_SNAPSHOT_CTL_CONVERT
 #define CONFIG_EXT4_FS_SNAPSHOT_CTL_DUMP
 #define CONFIG_EXT4_FS_SNAPSHOT_CTL
 #define CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
+#define CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_CACHE
+#define CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_SHRINK
+#define CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+#define CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_INHERIT
+#define CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_FIX_GROUP
+#define CONFIG_EXT4_FS_SNAPSHOT_RESIZE
 #define CONFIG_EXT4_FS_SNAPSHOT_CLEANUP
 #define CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_SHRINK
+#define CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_SHRINK_PARALLEL
 #define CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_MERGE
+#define CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_MERGE_PARALLEL
+#define CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_READAHEAD
+#define CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_DISCARD
+#define CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC
+#define CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_IOPRIO
+#define CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_EVICT
+#define CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_COMPACT
 #endif
 #ifndef CONFIG_EXT4_FS_SNAPSHOT_
 #define CONFIG_EXT4_FS_SNAPSHOT_
@@ -284,6 +403,9 @@ struct ext4_io_submit {
 #define EXT4_UNDEL_DIR_INO	 6	/* Undelete directory inode */
 #define EXT4_RESIZE_INO		 7	/* Reserved group descriptors inode */
 #define EXT4_JOURNAL_INO	 8	/* Journal inode */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_CONVERT
+#define EXT4_EXCLUDE_INO	 9	/* next3 snapshot exclude inode */
+#endif
 
 /* First non-reserved inode for old ext4 filesystems */
 #define EXT4_GOOD_OLD_FIRST_INO	11
@@ -368,14 +490,50 @@ struct flex_groups {
 	atomic_t free_inodes;
 	atomic_t free_blocks;
 	atomic_t used_dirs;
+#ifdef CONFIG_EXT4_FS_ORLOV_GROUP_INDEX
+	/* on s_flex_free_inodes[free_inodes_order] */
+	struct list_head free_inodes_node;
+	int free_inodes_order;
+#endif
+};
+
+#ifdef CONFIG_EXT4_FS_ORLOV_GROUP_INDEX
+/* flex groups are listed by fls() of their free inodes */
+#define EXT4_FLEX_FREE_ORDERS		33
+#endif
+
+#ifdef CONFIG_EXT4_FS_FLEX_COUNTERS_PCPU
+/*
+ * Per-CPU deltas of the flex group counters, hashed by flex group.
+ * A delta is folded into struct flex_groups when its slot is taken by
+ * another flex group or when it reaches the batch size, so the shared
+ * counters lag by at most a batch per CPU.
+ */
+#define EXT4_FLEX_DELTA_SLOTS		16
+#define EXT4_FLEX_DELTA_BATCH		32	/* inodes and dirs */
+#define EXT4_FLEX_DELTA_BLOCKS_BATCH	1024	/* blocks */
+
+struct ext4_flex_delta {
+	ext4_group_t fd_flex;		/* flex group + 1, 0 if unused */
+	int fd_free_inodes;
+	int fd_free_blocks;
+	int fd_used_dirs;
 };
 
+struct ext4_flex_deltas {
+	struct ext4_flex_delta slot[EXT4_FLEX_DELTA_SLOTS];
+};
+#endif
+
 #define EXT4_BG_INODE_UNINIT	0x0001 /* Inode table/bitmap not in use */
 #define EXT4_BG_BLOCK_UNINIT	0x0002 /* Block bitmap not in use */
 #define EXT4_BG_INODE_ZEROED	0x0004 /* On-disk itable initialized to zero */
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
 #define EXT4_BG_EXCLUDE_UNINIT	0x0008 /* Exclude bitmap not in use */
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_FIX_GROUP
+#define EXT4_BG_EXCLUDE_FIX	0x0010 /* Exclude/COW bitmap needs fsck */
+#endif
 
 /*
  * Macro-instructions used to manage group descriptors
@@ -403,6 +561,10 @@ struct flex_groups {
 #define	EXT4_DIND_BLOCK			(EXT4_IND_BLOCK + 1)
 #define	EXT4_TIND_BLOCK			(EXT4_DIND_BLOCK + 1)
 #define	EXT4_N_BLOCKS			(EXT4_TIND_BLOCK + 1)
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+/* max. size of file data stored in i_block */
+#define EXT4_MIN_INLINE_DATA_SIZE	((sizeof(__le32) * EXT4_N_BLOCKS))
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_HUGE
 /*
  * Snapshot files have different indirection mapping that can map up to 2^32
@@ -449,10 +611,18 @@ struct flex_groups {
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE
 /* snapshot persistent flags */
 #define EXT4_SNAPFILE_FL		0x01000000 /* snapshot file */
+#define EXT4_EXCLUDED_FL		0x02000000 /* excluded from snapshots */
 #define EXT4_SNAPFILE_DELETED_FL	0x04000000 /* snapshot is deleted */
 #define EXT4_SNAPFILE_SHRUNK_FL		0x08000000 /* snapshot was shrunk */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+#define EXT4_EXCLUDE_PENDING_FL		0x20000000 /* blocks not all excluded */
+#endif
 /* end of snapshot flags */
 #endif
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+/* private flag, not the upstream inline_data layout */
+#define EXT4_IBLOCK_DATA_FL		0x40000000 /* Data in i_block */
+#endif
 #define EXT4_RESERVED_FL		0x80000000 /* reserved for ext4 lib */
 
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE
@@ -525,8 +695,17 @@ enum {
 	EXT4_INODE_EOFBLOCKS	= 22,	/* Blocks allocated beyond EOF */
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE
 	EXT4_INODE_SNAPFILE	= 24,	/* Snapshot file/dir */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+	EXT4_INODE_EXCLUDED	= 25,	/* File excluded from snapshots */
+#endif
 	EXT4_INODE_SNAPFILE_DELETED = 26,	/* Snapshot is deleted */
 	EXT4_INODE_SNAPFILE_SHRUNK = 27,	/* Snapshot was shrunk */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+	EXT4_INODE_EXCLUDE_PENDING = 29,	/* Blocks not all excluded */
+#endif
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+	EXT4_INODE_IBLOCK_DATA	= 30,	/* Data in i_block */
 #endif
 	EXT4_INODE_RESERVED	= 31,	/* reserved for ext4 lib */
 };
@@ -576,8 +755,17 @@ static inline void ext4_check_flag_values(void)
 	CHECK_FLAG_VALUE(EOFBLOCKS);
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE
 	CHECK_FLAG_VALUE(SNAPFILE);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+	CHECK_FLAG_VALUE(EXCLUDED);
+#endif
 	CHECK_FLAG_VALUE(SNAPFILE_DELETED);
 	CHECK_FLAG_VALUE(SNAPFILE_SHRUNK);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+	CHECK_FLAG_VALUE(EXCLUDE_PENDING);
+#endif
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+	CHECK_FLAG_VALUE(IBLOCK_DATA);
 #endif
 	CHECK_FLAG_VALUE(RESERVED);
 }
@@ -654,6 +842,13 @@ struct ext4_new_group_data {
 	 */
 #define EXT4_GET_BLOCKS_MOVE_ON_WRITE		0x0100
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DIO_MOW
+	/* Caller is from the block aligned direct IO write path,
+	 * so blocks may be moved-on-write to an uninitialized extent
+	 * instead of falling back to buffered IO.
+	 */
+#define EXT4_GET_BLOCKS_MOVE_DIO		0x1000
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK
 /*
  * snapshot_map_blocks() flags passed to ext4_map_blocks() for mapping
@@ -698,6 +893,30 @@ struct ext4_new_group_data {
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL
 #define EXT4_IOC_GETSNAPFLAGS		_IOR('f', 13, long)
 #define EXT4_IOC_SETSNAPFLAGS		_IOW('f', 14, long)
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+#define EXT4_IOC_SNAPSHOT_EXCLUDE	_IO('f', 16)
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_DIFF
+#define EXT4_IOC_SNAPSHOT_DIFF		_IOWR('f', 17, struct ext4_snapshot_diff)
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_ASYNC
+#define EXT4_IOC_SNAPSHOT_TAKE_ASYNC	_IOWR('f', 18, struct ext4_snapshot_take)
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_GROUP
+#define EXT4_IOC_SNAPSHOT_TAKE_GROUP	_IOW('f', 19, struct ext4_snapshot_group)
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+#define EXT4_IOC_SNAPSHOT_STATS		_IOR('f', 20, struct ext4_snapshot_stats)
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_QUERY
+#define EXT4_IOC_SNAPSHOT_QUERY		_IOWR('f', 21, struct ext4_snapshot_query)
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_SEND
+#define EXT4_IOC_SNAPSHOT_SEND		_IOWR('f', 22, struct ext4_snapshot_send)
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_CLONE
+#define EXT4_IOC_SNAPSHOT_CLONE		_IOWR('f', 23, struct ext4_snapshot_clone)
+#endif
 #endif
 #define EXT4_IOC_MOVE_EXT		_IOWR('f', 15, struct move_extent)
 
@@ -794,6 +1013,100 @@ struct move_extent {
 	__u64 moved_len;	/* moved block length */
 };
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_DIFF
+/* A range of blocks that changed after a snapshot was taken */
+struct ext4_snapshot_diff_extent {
+	__u64 de_start;		/* first changed block */
+	__u64 de_len;		/* number of changed blocks */
+};
+
+struct ext4_snapshot_diff {
+	__u64 sd_start;		/* in: first block to scan, out: next block */
+	__u32 sd_count;		/* in: no. of extents in sd_extents[] */
+	__u32 sd_mapped;	/* out: no. of extents filled */
+	struct ext4_snapshot_diff_extent sd_extents[0];
+};
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_SEND
+struct ext4_snapshot_send {
+	__s32 ss_base_fd;	/* in: file of older snapshot */
+	__u32 ss_flags;		/* in: must be 0 */
+	__u64 ss_start;		/* in: first block to scan, out: next block */
+	__u32 ss_count;		/* in: no. of extents in ss_extents[] */
+	__u32 ss_mapped;	/* out: no. of extents filled */
+	struct ext4_snapshot_diff_extent ss_extents[0];
+};
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_CLONE
+/* Flags of struct ext4_snapshot_clone */
+#define EXT4_SNAPSHOT_CLONE_REMOVE	0x0001	/* remove clone sc_index */
+
+struct ext4_snapshot_clone {
+	__s32 sc_fd;		/* in: overlay file of new clone */
+	__u32 sc_flags;		/* in: 0 or EXT4_SNAPSHOT_CLONE_REMOVE */
+	__u32 sc_index;		/* out: new clone /dev/ext4cloneN minor */
+				/* in: clone to remove */
+	__u32 sc_reserved;
+};
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_ASYNC
+struct ext4_snapshot_take {
+	__s32 st_eventfd;	/* in: eventfd to signal on completion or -1 */
+	__u32 st_flags;		/* in: must be 0 */
+	__u64 st_ticket;	/* out: ticket of the queued take */
+};
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_GROUP
+/* max. no. of file systems in a snapshot group take */
+#define EXT4_SNAPSHOT_GROUP_MAX	16
+
+struct ext4_snapshot_group {
+	__u32 sg_count;		/* no. of snapshot files in sg_fds[] */
+	__u32 sg_flags;		/* must be 0 */
+	__s32 sg_fds[0];	/* other snapshot files to take */
+};
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+/* counters were reset on mount, not on snapshot take */
+#define EXT4_SNAPSHOT_STATS_PARTIAL	0x1
+/* older snapshots may need some of the blocks - ss_freeable is 0 */
+#define EXT4_SNAPSHOT_STATS_SHARED	0x2
+
+struct ext4_snapshot_stats {
+	__u32 ss_id;		/* snapshot id */
+	__u32 ss_flags;		/* EXT4_SNAPSHOT_STATS_* */
+	__u64 ss_blocks;	/* blocks owned by the snapshot file */
+	__u64 ss_cowed;		/* blocks copied to snapshot */
+	__u64 ss_moved;		/* blocks moved to snapshot */
+	__u64 ss_merged;	/* blocks merged from deleted snapshots */
+	__u64 ss_freeable;	/* blocks freed by snapshot delete */
+};
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_QUERY
+/* max. no. of snapshots reported by one snapshot query */
+#define EXT4_SNAPSHOT_QUERY_MAX	1024
+
+struct ext4_snapshot_info {
+	__u32 si_ino;		/* snapshot file inode number */
+	__u32 si_flags;		/* 1 << EXT4_SNAPSTATE_* */
+	__u64 si_size;		/* snapshot image size in bytes */
+	__u64 si_progress;	/* shrink/merge/cleanup progress in blocks */
+	struct ext4_snapshot_stats si_stats; /* snapshot id and space */
+};
+
+struct ext4_snapshot_query {
+	__u32 sq_count;		/* in: entries in sq_info[], out: snapshots */
+	__u32 sq_flags;		/* must be 0 */
+	struct ext4_snapshot_info sq_info[0];
+};
+#endif
+
 #define EXT4_EPOCH_BITS 2
 #define EXT4_EPOCH_MASK ((1 << EXT4_EPOCH_BITS) - 1)
 #define EXT4_NSEC_MASK  (~0UL << EXT4_EPOCH_BITS)
@@ -923,6 +1236,10 @@ struct ext4_inode_info {
 	 */
 	ext4_group_t	i_block_group;
 	ext4_lblk_t	i_dir_start_lookup;
+#ifdef CONFIG_EXT4_FS_DIR_FREE_HINTS
+	/* free space of linear directory blocks, under i_mutex */
+	struct ext4_dir_hints *i_dir_hints;
+#endif
 #if (BITS_PER_LONG < 64)
 	unsigned long	i_state_flags;		/* Dynamic state flags */
 #endif
@@ -949,6 +1266,44 @@ struct ext4_inode_info {
 	 */
 #define i_snaplist i_orphan
 	__u32	i_next_snapshot_ino;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_SHRINK_PARALLEL
+	/* first block group to resume shrink from (stored in i_version_hi) */
+	__u32	i_snapshot_shrink_group;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_CACHE
+	/* cached read through skips (allocated on first read through) */
+	struct ext4_snapshot_read_cache *i_snapshot_read_cache;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_BDEV
+	/* block device of enabled snapshot [ snapshot_mutex ] */
+	struct ext4_snapshot_bdev *i_snapshot_bdev;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_CLONE
+	/* writable clones of enabled snapshot [ snapshot_mutex ] */
+	struct list_head i_snapshot_clones;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_MOW_GOAL
+	/* last move-on-write arena [ i_data_sem ] */
+	ext4_lblk_t	i_snapshot_mow_lblk;	/* first logical block */
+	ext4_fsblk_t	i_snapshot_mow_pblk;	/* goal for first block */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_NEW_BLOCKS
+	/* blocks allocated after snapshot take [ i_data_sem ] */
+	__u32		i_snapshot_new_id;	/* active snapshot id */
+	ext4_lblk_t	i_snapshot_new_lblk;	/* first logical block */
+	ext4_lblk_t	i_snapshot_new_len;	/* no. of blocks */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_PACKED
+	/* next block of snapshot allocation zone [ i_data_sem ] */
+	ext4_fsblk_t	i_snapshot_cow_goal;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+	/* blocks added to snapshot since take (or since mount) */
+	atomic64_t	i_snapshot_cowed;	/* copied on write */
+	atomic64_t	i_snapshot_moved;	/* moved on write */
+	atomic64_t	i_snapshot_merged;	/* merged from deleted snapshots */
+	int		i_snapshot_stats_partial; /* counting since mount */
+#endif
 
 #endif
 	/*
@@ -983,6 +1338,19 @@ struct ext4_inode_info {
 	struct jbd2_inode *jinode;
 
 	struct ext4_ext_cache i_cached_extent;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_CACHE
+	/*
+	 * Recently used extents and gaps, in addition to i_cached_extent.
+	 * i_extent_cache is sorted by logical block and i_extent_cache_lru
+	 * by last use.  Both are protected by i_block_reservation_lock.
+	 * i_extent_cache_list is on the shrinker list while the inode has
+	 * cached extents.
+	 */
+	struct rb_root i_extent_cache;
+	struct list_head i_extent_cache_lru;
+	struct list_head i_extent_cache_list;
+	unsigned int i_extent_cache_nr;
+#endif
 	/*
 	 * File creation time. Its function is same as that of
 	 * struct timespec i_{a,c,m}time in the generic inode.
@@ -1046,6 +1414,9 @@ struct ext4_inode_info {
 #define EXT4_FLAGS_IS_SNAPSHOT		0x0010 /* Is a snapshot image */
 #define EXT4_FLAGS_FIX_SNAPSHOT		0x0020 /* Corrupted snapshot */
 #define EXT4_FLAGS_FIX_EXCLUDE		0x0040 /* Bad exclude bitmap */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_FIX_GROUP
+#define EXT4_FLAGS_FIX_GROUPS		0x0080 /* Only EXCLUDE_FIX groups */
+#endif
 
 #define EXT4_SET_FLAGS(sb, mask)				 \
 	do {							 \
@@ -1093,6 +1464,15 @@ struct ext4_inode_info {
 #define EXT4_MOUNT_BLOCK_VALIDITY	0x20000000 /* Block validity checking */
 #define EXT4_MOUNT_DISCARD		0x40000000 /* Issue DISCARD requests */
 #define EXT4_MOUNT_INIT_INODE_TABLE	0x80000000 /* Initialize uninitialized itables */
+#ifdef CONFIG_EXT4_FS_JOURNAL_CSUM_CRC32C
+#define EXT4_MOUNT2_JOURNAL_CSUM_CRC32C	0x00000001 /* crc32c journal checksums */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_REVERT
+#define EXT4_MOUNT2_SNAPSHOT_REVERT	0x00000002 /* revert to active snapshot */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_CONVERT
+#define EXT4_MOUNT2_SNAPSHOT_CONVERT	0x00000004 /* convert next3 snapshots */
+#endif
 
 #define clear_opt(sb, opt)		EXT4_SB(sb)->s_mount_opt &= \
 						~EXT4_MOUNT_##opt
@@ -1255,6 +1635,56 @@ struct ext4_super_block {
 #define EXT4_MF_MNTDIR_SAMPLED	0x0001
 #define EXT4_MF_FS_ABORTED	0x0002	/* Fatal error detected */
 
+#ifdef CONFIG_EXT4_FS_MB_BATCHED_TRIM
+/*
+ * FITRIM run statistics
+ */
+struct ext4_trim_stats {
+	unsigned long ts_groups;	/* groups scanned */
+	unsigned long ts_skipped;	/* groups skipped, already trimmed */
+	unsigned long ts_extents;	/* free extents found */
+	unsigned long ts_discards;	/* discard requests submitted */
+	unsigned long long ts_blocks;	/* blocks discarded */
+};
+
+#endif
+#ifdef CONFIG_EXT4_FS_STATFS_CACHE
+/*
+ * Sums of the per-cpu counters reported by statfs, so that statfs does
+ * not have to sum the counters of all cpus on every call.
+ */
+struct ext4_statfs_cache {
+	spinlock_t lock;
+	int valid;
+	unsigned long stamp;		/* jiffies of the last refresh */
+	s64 freeblocks;
+	s64 dirtyblocks;
+	s64 freeinodes;
+	s64 dirs;
+	s64 snapshot_r_blocks;
+};
+
+#define EXT4_DEF_STATFS_CACHE_MS	5
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE_ASYNC
+/* defer delete of unlinked files larger than this many blocks */
+#define EXT4_DEF_SNAPSHOT_REAP_BLOCKS	32768
+/* blocks freed by the delete worker per truncate call */
+#define EXT4_SNAPSHOT_REAP_STEP		8192
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_DISCARD
+/* max. MB/s discarded from blocks freed by snapshot cleanup */
+#define EXT4_DEF_SNAPSHOT_DISCARD_RATE	1024
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREALLOC
+/* max. block groups whose snapshot indirect blocks are allocated on create */
+#define EXT4_DEF_SNAPSHOT_PREALLOC_GROUPS	64
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_LOAD_FAST
+/* max. inode table blocks read ahead per snapshot inode on mount */
+#define EXT4_SNAPSHOT_LOAD_READAHEAD	32
+#endif
+
 /*
  * fourth extended-fs super-block data in memory
  */
@@ -1273,6 +1703,9 @@ struct ext4_sb_info {
 	loff_t s_bitmap_maxbytes;	/* max bytes for bitmap files */
 	struct buffer_head * s_sbh;	/* Buffer containing the super block */
 	struct ext4_super_block *s_es;	/* Pointer to the super block in the buffer */
+#ifdef CONFIG_EXT4_FS_GDT_CSUM_SEED
+	__u16 s_csum_seed;		/* crc16 of the fs UUID */
+#endif
 	struct buffer_head **s_group_desc;
 	unsigned int s_mount_opt;
 	unsigned int s_mount_opt2;
@@ -1287,6 +1720,12 @@ struct ext4_sb_info {
 	int s_inode_size;
 	int s_first_ino;
 	unsigned int s_inode_readahead_blks;
+#ifdef CONFIG_EXT4_FS_HTREE_READAHEAD
+	unsigned int s_htree_readahead_blks;
+#endif
+#ifdef CONFIG_EXT4_FS_DIR_INODE_READAHEAD
+	unsigned int s_dir_inode_readahead;
+#endif
 	unsigned int s_inode_goal;
 	spinlock_t s_next_gen_lock;
 	u32 s_next_generation;
@@ -1297,6 +1736,10 @@ struct ext4_sb_info {
 	struct percpu_counter s_freeinodes_counter;
 	struct percpu_counter s_dirs_counter;
 	struct percpu_counter s_dirtyblocks_counter;
+#ifdef CONFIG_EXT4_FS_STATFS_CACHE
+	struct ext4_statfs_cache s_statfs_cache;
+	unsigned int s_statfs_cache_ms;	/* max age of s_statfs_cache */
+#endif
 	struct blockgroup_lock *s_blockgroup_lock;
 	struct proc_dir_entry *s_proc;
 	struct kobject s_kobj;
@@ -1304,6 +1747,10 @@ struct ext4_sb_info {
 
 	/* Journaling */
 	struct journal_s *s_journal;
+#ifdef CONFIG_EXT4_FS_FSYNC_BATCH
+	atomic_t s_fsync_waiters;	/* tasks in ext4_sync_file() */
+	pid_t s_last_fsync_pid;
+#endif
 	struct list_head s_orphan;
 	struct mutex s_orphan_lock;
 	unsigned long s_resize_flags;		/* Flags indicating if there
@@ -1313,11 +1760,149 @@ struct ext4_sb_info {
 	u32 s_min_batch_time;
 	struct block_device *journal_bdev;
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE
-	struct mutex s_snapshot_mutex;		/* protects 2 fields below: */
+	struct mutex s_snapshot_mutex;		/* protects fields below: */
 	struct inode *s_active_snapshot;	/* [ s_snapshot_mutex ] */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREBUILD
+	struct task_struct *s_snapshot_prebuild; /* [ s_snapshot_mutex ] */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS_LOCK
+	u64 s_snapshot_mutex_acquired;		/* [ s_snapshot_mutex ] */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREALLOC
+	unsigned int s_snapshot_prealloc_groups; /* groups to premap on create */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_PACKED
+	unsigned int s_snapshot_cow_packed;	/* pack snapshot copies */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_DEDUP
+	unsigned int s_snapshot_cow_dedup;	/* share identical copies */
+	unsigned int s_snapshot_dedup_blocks;	/* [ s_snapshot_mutex ] */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_MOVE_QUOTA
+	unsigned int s_snapshot_charge_quota;	/* charge snapshot owner */
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST
 	struct list_head s_snapshot_list;	/* [ s_snapshot_mutex ] */
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_CACHE
+	unsigned int s_snapshot_list_gen;	/* [ s_snapshot_mutex ] */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_AUTOMOUNT
+	/* changes when a snapshot is exported or removed from .snapshot */
+	unsigned int s_snapshot_dir_gen;	/* [ s_snapshot_mutex ] */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_TRACK
+	struct percpu_counter s_meta_blocks_counter; /* metadata blocks */
+	struct percpu_counter s_snapshot_r_blocks_counter; /* reserve left */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_PREPARE
+	/* latency of last snapshot take phases (usec) */
+	u64 s_snapshot_take_prepare_us;		/* before freeze_super() */
+	u64 s_snapshot_take_freeze_us;		/* freeze_super() */
+	u64 s_snapshot_take_commit_us;		/* under freeze_super() */
+	u64 s_snapshot_take_thaw_us;		/* thaw_super() */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_JOURNAL_FREEZE
+	unsigned int s_snapshot_take_journal_freeze; /* no page cache sync */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
+	struct ext4_snapshot_cow_stats __percpu *s_snapshot_stats;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BYPASS_CREDITS
+	spinlock_t s_snapshot_bypass_lock;	/* protects fields below: */
+	tid_t s_snapshot_bypass_tid;		/* accounted transaction */
+	unsigned int s_snapshot_bypass_used;	/* its journaled blocks */
+	unsigned int s_snapshot_bypass_credits;	/* max journaled blocks */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BUDGET
+	spinlock_t s_snapshot_budget_lock;	/* protects fields below: */
+	tid_t s_snapshot_budget_tid;		/* accounted transaction */
+	unsigned int s_snapshot_budget_cur;	/* its COW credits so far */
+	unsigned int s_snapshot_budget_avg;	/* avg COW credits per trans */
+	unsigned int s_snapshot_budget_peak;	/* max COW credits per trans */
+	int s_snapshot_budget_throttled;	/* reduced transaction size */
+	int s_snapshot_budget_credits;		/* largest handle that had to fit */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CREDITS_ADAPTIVE
+	atomic_t s_snapshot_budget_user;	/* user credits since rollover */
+	unsigned int s_snapshot_cow_ratio;	/* avg COW/user credits << 8 */
+	unsigned int s_snapshot_cow_samples;	/* transactions sampled */
+	unsigned int s_snapshot_cow_fallbacks;	/* failed COW top-ups */
+	int s_snapshot_cow_fallback;		/* static factor until take */
+#endif
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC
+	struct task_struct *s_snapshot_cleanup;	/* snapshot cleanup thread */
+	unsigned long s_snapshot_cleanup_state;	/* cleanup state bits */
+	atomic_t s_snapshot_mutex_waiters;	/* tasks waiting for mutex */
+	unsigned int s_snapshot_cleanup_passes;	/* completed cleanup passes */
+	int s_snapshot_cleanup_err;		/* last cleanup pass error */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_EVICT
+	unsigned int s_snapshot_evict_ratio;	/* evict below % free blocks */
+	unsigned int s_snapshot_evictions;	/* snapshots evicted */
+	unsigned long s_snapshot_evict_next;	/* next eviction pass jiffies */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_COMPACT
+	unsigned int s_snapshot_compact_age;	/* cold snapshot age (sec) */
+	unsigned int s_snapshot_compacted_blocks; /* copies freed */
+#endif
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_DISCARD
+	spinlock_t s_snapshot_discard_lock;	/* protects list below: */
+	struct list_head s_snapshot_discard_list; /* committed snapshot frees */
+	struct work_struct s_snapshot_discard_work; /* discards them */
+	unsigned int s_snapshot_discard_rate;	/* max. discard MB/s, 0=none */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE_ASYNC
+	struct workqueue_struct *s_snapshot_reap_wq; /* deferred deletes */
+	unsigned int s_snapshot_reap_blocks;	/* defer delete of larger files */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_MOW_GOAL
+	atomic_t s_snapshot_mow_allocs;		/* move-on-write allocations */
+	atomic_t s_snapshot_mow_arena;		/* allocations with arena goal */
+	atomic_t s_snapshot_mow_hits;		/* allocations at goal */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_SHRINK
+	struct shrinker s_exclude_bh_shrinker;	/* unpins exclude bitmaps */
+	struct super_block *s_exclude_bh_sb;	/* back pointer for shrinker */
+	atomic_t s_exclude_bh_pinned;		/* pinned exclude bitmaps */
+	unsigned int s_exclude_bh_max;		/* pin limit (0 = no limit) */
+	ext4_group_t s_exclude_bh_scan;		/* last group scanned */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+	unsigned long s_snapshot_exclude_ino;	/* file being excluded */
+	ext4_lblk_t s_snapshot_exclude_lblk;	/* excluded up to this block */
+	unsigned long s_snapshot_exclude_resume_ino; /* interrupted file */
+	unsigned long long s_snapshot_exclude_blocks; /* blocks excluded */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_READ_RANGE
+	spinlock_t s_tracked_reads_lock;	/* protects fields below: */
+	struct list_head s_tracked_reads;	/* pending read through ranges */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_ASYNC
+	spinlock_t s_snapshot_take_lock;	/* protects fields below: */
+	struct list_head s_snapshot_take_list;	/* queued take requests */
+	__u64 s_snapshot_take_queued;		/* last queued ticket */
+	__u64 s_snapshot_take_done;		/* last completed ticket */
+	int s_snapshot_take_err;		/* last completed take result */
+	struct work_struct s_snapshot_take_work; /* runs queued takes */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_SCHED
+	unsigned int s_snapshot_sched_dir;	/* snapshot directory inode */
+	unsigned int s_snapshot_sched_interval;	/* seconds between takes */
+	unsigned int s_snapshot_sched_jitter;	/* max. random delay (sec) */
+	unsigned int s_snapshot_sched_idle;	/* max. commits per poll */
+	unsigned int s_snapshot_sched_keep;	/* snapshots to keep */
+	unsigned int s_snapshot_sched_max_age;	/* expire age (sec) */
+	struct delayed_work s_snapshot_sched_work; /* polls the schedule */
+	struct super_block *s_snapshot_sched_sb; /* back pointer for the work */
+	struct task_struct *s_snapshot_sched_task; /* task taking snapshot */
+	tid_t s_snapshot_sched_tid;		/* last commit at last poll */
+	unsigned long s_snapshot_sched_last;	/* last take time (sec) */
+	unsigned int s_snapshot_sched_delay;	/* random delay (mod jitter) */
+	unsigned int s_snapshot_sched_taken;	/* scheduled takes */
+	unsigned int s_snapshot_sched_expired;	/* expired snapshots */
+	int s_snapshot_sched_err;		/* last scheduled take result */
+#endif
 #endif
 #ifdef CONFIG_JBD2_DEBUG
 	struct timer_list turn_ro_timer;	/* For turning read-only (crash simulation) */
@@ -1329,6 +1914,10 @@ struct ext4_sb_info {
 #endif
 	unsigned int s_want_extra_isize; /* New inodes should reserve # bytes */
 	struct rb_root system_blks;
+#ifdef CONFIG_EXT4_FS_SYSTEM_ZONE_ARRAY
+	struct ext4_system_zone_range *s_system_zones; /* packed system_blks */
+	unsigned int s_nr_system_zones;
+#endif
 
 #ifdef EXTENTS_STATS
 	/* ext4 extents stats */
@@ -1359,6 +1948,23 @@ struct ext4_sb_info {
 	unsigned int s_mb_order2_reqs;
 	unsigned int s_mb_group_prealloc;
 	unsigned int s_max_writeback_mb_bump;
+#ifdef CONFIG_EXT4_FS_MB_GROUP_INDEX
+	unsigned int s_mb_group_index;
+	/* lists of groups by largest free order, see mb_set_largest_free_order() */
+	struct list_head *s_mb_largest_free_orders;
+	rwlock_t *s_mb_largest_free_orders_locks;
+	/* no. of groups whose buddy was never loaded (not on the lists) */
+	atomic_t s_mb_groups_need_init;
+#endif
+#ifdef CONFIG_EXT4_FS_MB_PREFETCH
+	unsigned int s_mb_prefetch;	/* groups to read ahead at once */
+	ext4_group_t s_mb_prefetch_next; /* next group to initialize */
+	struct work_struct s_mb_prefetch_work;
+	struct super_block *s_mb_prefetch_sb; /* back pointer for the work */
+#endif
+#ifdef CONFIG_EXT4_FS_MB_ADAPTIVE_GROUP_PREALLOC
+	unsigned int s_mb_group_prealloc_adapt;
+#endif
 	/* where last allocation was done - for stream allocation */
 	unsigned long s_mb_last_group;
 	unsigned long s_mb_last_start;
@@ -1388,6 +1994,15 @@ struct ext4_sb_info {
 
 	unsigned int s_log_groups_per_flex;
 	struct flex_groups *s_flex_groups;
+#ifdef CONFIG_EXT4_FS_FLEX_COUNTERS_PCPU
+	struct ext4_flex_deltas __percpu *s_flex_deltas;
+#endif
+#ifdef CONFIG_EXT4_FS_ORLOV_GROUP_INDEX
+	unsigned int s_orlov_group_index;
+	/* lists of flex groups by order of free inodes */
+	struct list_head s_flex_free_inodes[EXT4_FLEX_FREE_ORDERS];
+	spinlock_t s_flex_free_inodes_lock;
+#endif
 
 	/* workqueue for dio unwritten */
 	struct workqueue_struct *dio_unwritten_wq;
@@ -1400,11 +2015,21 @@ struct ext4_sb_info {
 	/* Wait multiplier for lazy initialization thread */
 	unsigned int s_li_wait_mult;
 
+#ifdef CONFIG_EXT4_FS_MMP_SHARED
+	/* Multiple mount protection state, updated by the kmmpd thread */
+	struct mmpd_data *s_mmp_data;
+#else
 	/* Kernel thread for multiple mount protection */
 	struct task_struct *s_mmp_tsk;
+#endif
 
 	/* record the last minlen when FITRIM is called. */
 	atomic_t s_last_trim_minblks;
+#ifdef CONFIG_EXT4_FS_MB_BATCHED_TRIM
+	/* statistics of the last FITRIM run */
+	spinlock_t s_trim_stats_lock;
+	struct ext4_trim_stats s_trim_stats;
+#endif
 };
 
 static inline struct ext4_sb_info *EXT4_SB(struct super_block *sb)
@@ -1444,6 +2069,15 @@ enum {
 	EXT4_STATE_DIO_UNWRITTEN,	/* need convert on dio done*/
 	EXT4_STATE_NEWENTRY,		/* File just added to dir */
 	EXT4_STATE_DELALLOC_RESERVED,	/* blks already reserved for delalloc */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE_ASYNC
+	EXT4_STATE_REAPED,		/* deferred delete has been done */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_COMPACT
+	EXT4_STATE_COMPACTED,		/* cold snapshot was compacted */
+#endif
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+	EXT4_STATE_MAY_INLINE_DATA,	/* new file may store data inline */
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE
 	EXT4_STATE_LAST
 };
@@ -1515,6 +2149,14 @@ static inline void ext4_clear_state_flags(struct ext4_inode_info *ei)
 	/* We depend on the fact that callers will set i_flags */
 }
 #endif
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+
+/* file data is stored in i_block */
+static inline int ext4_has_inline_data(struct inode *inode)
+{
+	return ext4_test_inode_flag(inode, EXT4_INODE_IBLOCK_DATA);
+}
+#endif
 #else
 /* Assume that user mode programs are passing in an ext4fs superblock, not
  * a kernel struct super_block.  This will allow us to call the feature-test
@@ -1576,6 +2218,9 @@ static inline void ext4_clear_state_flags(struct ext4_inode_info *ei)
 #define EXT4_FEATURE_COMPAT_EXT_ATTR		0x0008
 #define EXT4_FEATURE_COMPAT_RESIZE_INODE	0x0010
 #define EXT4_FEATURE_COMPAT_DIR_INDEX		0x0020
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_CONVERT
+#define EXT4_FEATURE_COMPAT_EXCLUDE_INODE	0x0080 /* next3 exclude inode */
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
 #define EXT4_FEATURE_COMPAT_EXCLUDE_BITMAP	0x0100 /* Has exclude bitmap */
 #endif
@@ -1603,6 +2248,13 @@ static inline void ext4_clear_state_flags(struct ext4_inode_info *ei)
 #define EXT4_FEATURE_INCOMPAT_FLEX_BG		0x0200
 #define EXT4_FEATURE_INCOMPAT_EA_INODE		0x0400 /* EA in inode */
 #define EXT4_FEATURE_INCOMPAT_DIRDATA		0x1000 /* data in dirent */
+#define EXT4_FEATURE_INCOMPAT_LARGEDIR		0x4000 /* >2GB or 3-lvl htree */
+/*
+ * Private feature: file data in i_block only.  This is not the upstream
+ * inline_data layout (0x8000), which also stores data in the system.data
+ * extended attribute, and e2fsprogs does not support it.
+ */
+#define EXT4_FEATURE_INCOMPAT_IBLOCK_DATA	0x40000000 /* data in i_block */
 
 #define EXT2_FEATURE_COMPAT_SUPP	EXT4_FEATURE_COMPAT_EXT_ATTR
 #define EXT2_FEATURE_INCOMPAT_SUPP	(EXT4_FEATURE_INCOMPAT_FILETYPE| \
@@ -1619,6 +2271,17 @@ static inline void ext4_clear_state_flags(struct ext4_inode_info *ei)
 					 EXT4_FEATURE_RO_COMPAT_LARGE_FILE| \
 					 EXT4_FEATURE_RO_COMPAT_BTREE_DIR)
 
+#ifdef CONFIG_EXT4_FS_HTREE_LARGEDIR
+#define EXT4_FEATURE_INCOMPAT_LARGEDIR_SUPP	EXT4_FEATURE_INCOMPAT_LARGEDIR
+#else
+#define EXT4_FEATURE_INCOMPAT_LARGEDIR_SUPP	0
+#endif
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+#define EXT4_FEATURE_INCOMPAT_IBLOCK_DATA_SUPP	EXT4_FEATURE_INCOMPAT_IBLOCK_DATA
+#else
+#define EXT4_FEATURE_INCOMPAT_IBLOCK_DATA_SUPP	0
+#endif
+
 #define EXT4_FEATURE_COMPAT_SUPP	EXT2_FEATURE_COMPAT_EXT_ATTR
 #define EXT4_FEATURE_INCOMPAT_SUPP	(EXT4_FEATURE_INCOMPAT_FILETYPE| \
 					 EXT4_FEATURE_INCOMPAT_RECOVER| \
@@ -1626,7 +2289,9 @@ static inline void ext4_clear_state_flags(struct ext4_inode_info *ei)
 					 EXT4_FEATURE_INCOMPAT_EXTENTS| \
 					 EXT4_FEATURE_INCOMPAT_64BIT| \
 					 EXT4_FEATURE_INCOMPAT_FLEX_BG| \
-					 EXT4_FEATURE_INCOMPAT_MMP)
+					 EXT4_FEATURE_INCOMPAT_MMP| \
+					 EXT4_FEATURE_INCOMPAT_LARGEDIR_SUPP| \
+					 EXT4_FEATURE_INCOMPAT_IBLOCK_DATA_SUPP)
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_ROCOMPAT
 #define EXT4_FEATURE_RO_COMPAT_SUPP	(EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER| \
 					 EXT4_FEATURE_RO_COMPAT_LARGE_FILE| \
@@ -1653,6 +2318,9 @@ static inline void ext4_clear_state_flags(struct ext4_inode_info *ei)
 #define	EXT4_DEF_RESGID		0
 
 #define EXT4_DEF_INODE_READAHEAD_BLKS	32
+#ifdef CONFIG_EXT4_FS_HTREE_READAHEAD
+#define EXT4_DEF_HTREE_READAHEAD_BLKS	32
+#endif
 
 /*
  * Default mount options
@@ -1805,6 +2473,22 @@ struct dx_hash_info
 
 #define EXT4_HTREE_EOF	0x7fffffff
 
+/*
+ * Maximum number of htree index levels, counting the root.  Directories
+ * with the largedir feature may grow a third level.
+ */
+#define EXT4_HTREE_LEVEL_COMPAT	2
+#define EXT4_HTREE_LEVEL	3
+
+static inline int ext4_dir_htree_level(struct super_block *sb)
+{
+#ifdef CONFIG_EXT4_FS_HTREE_LARGEDIR
+	if (EXT4_HAS_INCOMPAT_FEATURE(sb, EXT4_FEATURE_INCOMPAT_LARGEDIR))
+		return EXT4_HTREE_LEVEL;
+#endif
+	return EXT4_HTREE_LEVEL_COMPAT;
+}
+
 /*
  * Control parameters used by ext4_htree_next_block
  */
@@ -1839,8 +2523,21 @@ struct dir_private_info {
 	__u32		curr_hash;
 	__u32		curr_minor_hash;
 	__u32		next_hash;
+#ifdef CONFIG_EXT4_FS_READDIR_CACHE
+	/* hash range covered by the tree is [start_hash, next_hash) */
+	__u32		start_hash;
+	__u32		start_minor_hash;
+	/* chunks that tree nodes are allocated from */
+	struct fname_chunk *chunks;
+	struct fname_chunk *curr_chunk;
+#endif
 };
 
+#ifdef CONFIG_EXT4_FS_READDIR_CACHE
+/* max no. of leaf blocks read into the readdir tree at once */
+#define EXT4_HTREE_FILL_BLOCKS	16
+#endif
+
 /* calculate the first block number of the group */
 static inline ext4_fsblk_t
 ext4_group_first_block_no(struct super_block *sb, ext4_group_t group_no)
@@ -1935,6 +2632,14 @@ struct mmp_struct {
 struct mmpd_data {
 	struct buffer_head *bh; /* bh from initial read_mmp_block() */
 	struct super_block *sb;  /* super block of the fs */
+#ifdef CONFIG_EXT4_FS_MMP_SHARED
+	struct list_head list;	/* on the kmmpd list */
+	unsigned long next_update;	/* jiffies of the next update */
+	unsigned long last_update;	/* jiffies of the last update */
+	unsigned check_interval;	/* current mmp_check_interval */
+	unsigned long failed_writes;
+	u32 seq;		/* last sequence written by kmmpd */
+#endif
 };
 
 /*
@@ -1993,6 +2698,9 @@ extern struct ext4_group_desc * ext4_get_group_desc(struct super_block * sb,
 						    ext4_group_t block_group,
 						    struct buffer_head ** bh);
 extern int ext4_should_retry_alloc(struct super_block *sb, int *retries);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_DATA
+extern int ext4_snapshot_has_free_blocks(struct super_block *sb, s64 nblocks);
+#endif
 struct buffer_head *ext4_read_block_bitmap(struct super_block *sb,
 				      ext4_group_t block_group);
 extern unsigned ext4_init_block_bitmap(struct super_block *sb,
@@ -2005,6 +2713,14 @@ extern unsigned ext4_init_block_bitmap(struct super_block *sb,
 extern struct buffer_head *ext4_read_exclude_bitmap(struct super_block *sb,
 					       unsigned int block_group);
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_CACHE
+extern void ext4_put_exclude_bitmap(struct super_block *sb,
+				    ext4_group_t block_group);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_SHRINK
+extern void ext4_register_exclude_shrinker(struct super_block *sb);
+extern void ext4_unregister_exclude_shrinker(struct super_block *sb);
+#endif
 ext4_fsblk_t ext4_inode_to_goal_block(struct inode *);
 
 /* dir.c */
@@ -2019,6 +2735,10 @@ extern int ext4_htree_store_dirent(struct file *dir_file, __u32 hash,
 				    __u32 minor_hash,
 				    struct ext4_dir_entry_2 *dirent);
 extern void ext4_htree_free_dir_info(struct dir_private_info *p);
+#ifdef CONFIG_EXT4_FS_DIR_INODE_READAHEAD
+extern void ext4_dirblock_inode_readahead(struct inode *dir,
+					  struct buffer_head *bh);
+#endif
 
 /* fsync.c */
 extern int ext4_sync_file(struct file *, loff_t, loff_t, int);
@@ -2045,6 +2765,9 @@ extern long ext4_mb_stats;
 extern long ext4_mb_max_to_scan;
 extern int ext4_mb_init(struct super_block *, int);
 extern int ext4_mb_release(struct super_block *);
+#ifdef CONFIG_EXT4_FS_MB_PREFETCH
+extern void ext4_mb_prefetch_start(struct super_block *);
+#endif
 extern ext4_fsblk_t ext4_mb_new_blocks(handle_t *,
 				struct ext4_allocation_request *, int *);
 extern int ext4_mb_reserve_blocks(struct super_block *, int);
@@ -2069,6 +2792,9 @@ extern int ext4_mb_add_groupinfo(struct super_block *sb,
 extern int ext4_group_add_blocks(handle_t *handle, struct super_block *sb,
 				ext4_fsblk_t block, unsigned long count);
 extern int ext4_trim_fs(struct super_block *, struct fstrim_range *);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_DISCARD
+extern void ext4_snapshot_discard_work(struct work_struct *work);
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW
 extern int ext4_mb_test_bit_range(int bit, void *addr, int *pcount);
 #endif
@@ -2095,11 +2821,18 @@ extern int  ext4_setattr(struct dentry *, struct iattr *);
 extern int  ext4_getattr(struct vfsmount *mnt, struct dentry *dentry,
 				struct kstat *stat);
 extern void ext4_evict_inode(struct inode *);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE_ASYNC
+extern void ext4_reap_inode(struct inode *, unsigned int step);
+#endif
 extern void ext4_clear_inode(struct inode *);
 extern int  ext4_sync_inode(handle_t *, struct inode *);
 extern void ext4_dirty_inode(struct inode *, int);
 extern int ext4_change_inode_journal_flag(struct inode *, int);
 extern int ext4_get_inode_loc(struct inode *, struct ext4_iloc *);
+#ifdef CONFIG_EXT4_FS_DIR_INODE_READAHEAD
+extern void ext4_inode_table_readahead(struct super_block *sb,
+				       unsigned long *inos, int nr);
+#endif
 extern int ext4_can_truncate(struct inode *inode);
 extern void ext4_truncate(struct inode *);
 extern int ext4_punch_hole(struct file *file, loff_t offset, loff_t length);
@@ -2118,10 +2851,29 @@ extern int ext4_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf);
 extern qsize_t *ext4_get_reserved_space(struct inode *inode);
 extern void ext4_da_update_reserve_space(struct inode *inode,
 					int used, int quota_claim);
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+extern int ext4_convert_inline_data(struct inode *inode);
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE
 
 /* snapshot_inode.c */
 extern int ext4_snapshot_readpage(struct file *file, struct page *page);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READAHEAD
+extern int ext4_snapshot_readpages(struct file *file,
+		struct address_space *mapping,
+		struct list_head *pages, unsigned nr_pages);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READ_SHARED
+extern ssize_t ext4_snapshot_file_read(struct file *filp, char __user *buf,
+		size_t len, loff_t *ppos);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_SPLICE_SHARED
+extern ssize_t ext4_snapshot_file_splice_read(struct file *in, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_CACHE
+extern void ext4_snapshot_free_read_cache(struct inode *inode);
+#endif
 
 #endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP
@@ -2158,6 +2910,15 @@ extern ssize_t ext4_ind_direct_IO(int rw, struct kiocb *iocb,
 extern int ext4_ind_calc_metadata_amount(struct inode *inode, sector_t lblock);
 extern int ext4_ind_trans_blocks(struct inode *inode, int nrblocks, int chunk);
 extern void ext4_ind_truncate(struct inode *inode);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREALLOC
+extern int ext4_snapshot_map_ind(handle_t *handle, struct inode *inode,
+				 ext4_lblk_t iblock, ext4_fsblk_t *goal);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_DEDUP
+extern int ext4_snapshot_set_leaf(handle_t *handle, struct inode *inode,
+				  ext4_lblk_t iblock, ext4_fsblk_t old,
+				  ext4_fsblk_t new);
+#endif
 
 /* ioctl.c */
 extern long ext4_ioctl(struct file *, unsigned int, unsigned long);
@@ -2171,6 +2932,9 @@ extern int ext4_orphan_add(handle_t *, struct inode *);
 extern int ext4_orphan_del(handle_t *, struct inode *);
 extern int ext4_htree_fill_tree(struct file *dir_file, __u32 start_hash,
 				__u32 start_minor_hash, __u32 *next_hash);
+#ifdef CONFIG_EXT4_FS_DIR_FREE_HINTS
+extern void ext4_dir_hints_free(struct inode *dir);
+#endif
 
 /* resize.c */
 extern int ext4_group_add(struct super_block *sb,
@@ -2248,6 +3012,11 @@ extern void ext4_block_bitmap_set(struct super_block *sb,
 				  struct ext4_group_desc *bg, ext4_fsblk_t blk);
 extern void ext4_inode_bitmap_set(struct super_block *sb,
 				  struct ext4_group_desc *bg, ext4_fsblk_t blk);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RESIZE
+extern void ext4_exclude_bitmap_set(struct super_block *sb,
+				    struct ext4_group_desc *bg,
+				    ext4_fsblk_t blk);
+#endif
 extern void ext4_inode_table_set(struct super_block *sb,
 				 struct ext4_group_desc *bg, ext4_fsblk_t blk);
 extern void ext4_free_blks_set(struct super_block *sb,
@@ -2306,9 +3075,14 @@ static inline void ext4_r_blocks_count_set(struct ext4_super_block *es,
 	es->s_r_blocks_count_hi = cpu_to_le32(blk >> 32);
 }
 
-static inline loff_t ext4_isize(struct ext4_inode *raw_inode)
+static inline loff_t ext4_isize(struct super_block *sb,
+				struct ext4_inode *raw_inode)
 {
-	if (S_ISREG(le16_to_cpu(raw_inode->i_mode)))
+	if (S_ISREG(le16_to_cpu(raw_inode->i_mode))
+#ifdef CONFIG_EXT4_FS_HTREE_LARGEDIR
+	    || EXT4_HAS_INCOMPAT_FEATURE(sb, EXT4_FEATURE_INCOMPAT_LARGEDIR)
+#endif
+	    )
 		return ((loff_t)le32_to_cpu(raw_inode->i_size_high) << 32) |
 			le32_to_cpu(raw_inode->i_size_lo);
 	else
@@ -2357,6 +3131,31 @@ static inline unsigned int ext4_flex_bg_size(struct ext4_sb_info *sbi)
 	return 1 << sbi->s_log_groups_per_flex;
 }
 
+#ifdef CONFIG_EXT4_FS_FLEX_COUNTERS_PCPU
+extern void ext4_flex_add(struct ext4_sb_info *sbi, ext4_group_t flex,
+			  int free_inodes, int free_blocks, int used_dirs);
+extern void ext4_flex_fold_local(struct ext4_sb_info *sbi, ext4_group_t flex);
+#ifdef CONFIG_EXT4_FS_ORLOV_GROUP_INDEX
+extern void ext4_flex_index_update(struct ext4_sb_info *sbi,
+				   ext4_group_t flex);
+#endif
+#else
+static inline void ext4_flex_add(struct ext4_sb_info *sbi, ext4_group_t flex,
+				 int free_inodes, int free_blocks,
+				 int used_dirs)
+{
+	struct flex_groups *fg = &sbi->s_flex_groups[flex];
+
+	if (free_inodes)
+		atomic_add(free_inodes, &fg->free_inodes);
+	if (free_blocks)
+		atomic_add(free_blocks, &fg->free_blocks);
+	if (used_dirs)
+		atomic_add(used_dirs, &fg->used_dirs);
+}
+#define ext4_flex_fold_local(sbi, flex) do {} while (0)
+#endif
+
 #define ext4_std_error(sb, errno)				\
 do {								\
 	if ((errno))						\
@@ -2385,6 +3184,37 @@ static inline void ext4_update_i_disksize(struct inode *inode, loff_t newsize)
 	return ;
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_EXTENTS
+/* in-memory summary of the COW bitmap */
+#define EXT4_COW_EXTENTS_MAX		4
+#define EXT4_COW_EXTENTS_UNKNOWN	-1
+#define EXT4_COW_EXTENTS_MANY		-2
+
+struct ext4_cow_extent {
+	ext4_grpblk_t	ce_start;	/* first block in use by snapshot */
+	ext4_grpblk_t	ce_end;		/* first block after the extent */
+};
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_MAP
+/* blocks of a group known to be mapped in the active snapshot */
+struct ext4_cow_map {
+	struct rcu_head	cm_rcu;
+	unsigned long	cm_bits[0];
+};
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_GROUP_STATS
+/* per group snapshot event counters, see /proc/fs/ext4/<dev>/snapshot_groups */
+enum ext4_snapshot_group_stat {
+	EXT4_SNAPSHOT_GROUP_COW,	/* blocks copied to snapshot */
+	EXT4_SNAPSHOT_GROUP_MOVE,	/* blocks moved to snapshot */
+	EXT4_SNAPSHOT_GROUP_BITMAP,	/* COW bitmap created */
+	EXT4_SNAPSHOT_GROUP_WAIT,	/* waits for pending COW */
+	EXT4_SNAPSHOT_GROUP_STATS
+};
+
+#endif
 struct ext4_group_info {
 	unsigned long   bb_state;
 	struct rb_root  bb_free_root;
@@ -2393,6 +3223,11 @@ struct ext4_group_info {
 	ext4_grpblk_t	bb_fragments;	/* nr of freespace fragments */
 	ext4_grpblk_t	bb_largest_free_order;/* order of largest frag in BG */
 	struct          list_head bb_prealloc_list;
+#ifdef CONFIG_EXT4_FS_MB_GROUP_INDEX
+	ext4_group_t	bb_group;
+	/* on s_mb_largest_free_orders[bb_largest_free_order] */
+	struct list_head bb_largest_free_order_node;
+#endif
 #ifdef DOUBLE_CHECK
 	void            *bb_bitmap;
 #endif
@@ -2401,9 +3236,43 @@ struct ext4_group_info {
 	/*
 	 * bg_cow_bitmap is reset to zero on mount time and on every snapshot
 	 * take and initialized lazily on first block group write access.
+	 * With CONFIG_EXT4_FS_SNAPSHOT_CTL_LOAD_COW_BITMAP, bg_cow_bitmap is
+	 * loaded from the active snapshot on mount time.
 	 * bg_cow_bitmap is protected by sb_bgl_lock().
 	 */
 	unsigned long bg_cow_bitmap;	/* COW bitmap cache */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_EXTENTS
+	/*
+	 * bg_cow_extents are the in-use extents of the COW bitmap, sorted by
+	 * start.  bg_cow_nr_extents is the no. of extents (0 if no block is
+	 * in use by snapshot), EXT4_COW_EXTENTS_UNKNOWN if the summary was
+	 * not built yet or EXT4_COW_EXTENTS_MANY if the COW bitmap has more
+	 * extents than fit in the summary.
+	 * bg_cow_extents are protected by ext4_lock_group().
+	 */
+	int bg_cow_nr_extents;
+	struct ext4_cow_extent bg_cow_extents[EXT4_COW_EXTENTS_MAX];
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_MAP
+	/*
+	 * bg_cow_map marks the blocks that were found mapped in (or COWed
+	 * to) the active snapshot.  It is allocated on first use, tested
+	 * and set without locks under RCU and freed on snapshot take.
+	 */
+	struct ext4_cow_map *bg_cow_map;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_CACHE
+	/*
+	 * bg_exclude_bh holds a reference to the exclude bitmap buffer from
+	 * first access until snapshot take or umount.
+	 * bg_exclude_bh is protected by ext4_lock_group().
+	 */
+	struct buffer_head *bg_exclude_bh; /* exclude bitmap cache */
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_GROUP_STATS
+	/* snapshot events in the group since the last snapshot take */
+	atomic_t bg_snapshot_stats[EXT4_SNAPSHOT_GROUP_STATS];
+#endif
 #endif
 	ext4_grpblk_t	bb_counters[];	/* Nr of free power-of-two-block
 					 * regions, index is order.
@@ -2413,6 +3282,14 @@ struct ext4_group_info {
 
 #define EXT4_GROUP_INFO_NEED_INIT_BIT		0
 #define EXT4_GROUP_INFO_WAS_TRIMMED_BIT		1
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_BITMAP_WAITQ
+/* set while the COW bitmap of the group is being created */
+#define EXT4_GROUP_INFO_COW_BITMAP_BIT		2
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREBUILD
+/* set if the group was COWed during the lifetime of the previous snapshot */
+#define EXT4_GROUP_INFO_COW_ACTIVE_BIT		3
+#endif
 
 #define EXT4_MB_GRP_NEED_INIT(grp)	\
 	(test_bit(EXT4_GROUP_INFO_NEED_INIT_BIT, &((grp)->bb_state)))
@@ -2497,6 +3374,9 @@ extern const struct file_operations ext4_dir_operations;
 /* file.c */
 extern const struct inode_operations ext4_file_inode_operations;
 extern const struct file_operations ext4_file_operations;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READ_SHARED
+extern const struct file_operations ext4_snapfile_operations;
+#endif
 extern loff_t ext4_llseek(struct file *file, loff_t offset, int origin);
 
 /* namei.c */
@@ -2526,6 +3406,10 @@ extern int ext4_ext_index_trans_blocks(struct inode *inode, int nrblocks,
 				       int chunk);
 extern int ext4_ext_map_blocks(handle_t *handle, struct inode *inode,
 			       struct ext4_map_blocks *map, int flags);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+extern int ext4_ext_exclude_blocks(handle_t *handle, struct inode *inode,
+				   ext4_lblk_t *lblk, int maxext);
+#endif
 extern void ext4_ext_truncate(struct inode *);
 extern int ext4_ext_punch_hole(struct file *file, loff_t offset,
 				loff_t length);
@@ -2559,6 +3443,10 @@ extern int ext4_bio_write_page(struct ext4_io_submit *io,
 
 /* mmp.c */
 extern int ext4_multi_mount_protect(struct super_block *, ext4_fsblk_t);
+#ifdef CONFIG_EXT4_FS_MMP_SHARED
+extern void ext4_stop_mmp(struct super_block *);
+extern void ext4_exit_mmp(void);
+#endif
 
 /* BH_Uninit flag: blocks are allocated but uninitialized on disk */
 enum ext4_state_bits {
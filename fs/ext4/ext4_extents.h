@@ -193,11 +193,17 @@ static inline unsigned short ext_depth(struct inode *inode)
 	return le16_to_cpu(ext_inode_hdr(inode)->eh_depth);
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_CACHE
+extern void ext4_ext_invalidate_cache(struct inode *inode);
+extern void ext4_ext_invalidate_cache_range(struct inode *inode,
+					    ext4_lblk_t block, __u32 len);
+#else
 static inline void
 ext4_ext_invalidate_cache(struct inode *inode)
 {
 	EXT4_I(inode)->i_cached_extent.ec_len = 0;
 }
+#endif
 
 static inline void ext4_ext_mark_uninitialized(struct ext4_extent *ext)
 {
@@ -66,6 +66,35 @@ int __ext4_journal_get_write_access(const char *where, unsigned int line,
 	return err;
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_JBD
+/*
+ * Get write access to @count physically subsequent metadata blocks (e.g.
+ * GDT blocks), which are COWed to the active snapshot in one go.
+ */
+int __ext4_journal_get_write_access_range(const char *where,
+					  unsigned int line, handle_t *handle,
+					  struct buffer_head **bhs, int count)
+{
+	int i, err = 0;
+
+	if (!ext4_handle_valid(handle))
+		return 0;
+
+	for (i = 0; i < count && !err; i++)
+		err = jbd2_journal_get_write_access(handle, bhs[i]);
+	if (!err)
+		err = ext4_snapshot_get_write_access_range(handle, NULL,
+							   bhs, count);
+	if (err)
+		ext4_journal_abort_handle(where, line, __func__, NULL,
+					  handle, err);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_TRACE
+	ext4_journal_trace(SNAP_DEBUG, where, handle, count);
+#endif
+	return err;
+}
+#endif
+
 /*
  * The ext4 forget function must perform a revoke if we are freeing data
  * which has been journaled.  Metadata (eg. indirect blocks) must be
@@ -285,10 +314,11 @@ static void ext4_journal_cow_stats(int n, handle_t *handle)
 {
 	snapshot_debug(n, "COW stats: moved/copied=%d/%d, "
 			 "mapped/bitmap/cached=%d/%d/%d, "
-			 "bitmaps/cleared=%d/%d\n", handle->h_cow_moved,
+			 "bitmaps/cleared/waits=%d/%d/%d\n", handle->h_cow_moved,
 			 handle->h_cow_copied, handle->h_cow_ok_mapped,
 			 handle->h_cow_ok_bitmap, handle->h_cow_ok_jh,
-			 handle->h_cow_bitmaps, handle->h_cow_excluded);
+			 handle->h_cow_bitmaps, handle->h_cow_excluded,
+			 handle->h_cow_bitmap_waits);
 }
 #else
 #define ext4_journal_cow_stats(n, handle)
@@ -133,6 +133,99 @@
 #define EXT4_RESERVE_COW_CREDITS	(EXT4_COW_CREDITS +		\
 					 EXT4_SNAPSHOT_CREDITS)
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CREDITS_LAZY
+/*
+ * without an active snapshot there are no COW operations, but every block
+ * bitmap update may be shadowed by an exclude bitmap update, so for N
+ * buffer credits we request 2N+6 buffer credits.
+ * the active snapshot is only changed under journal_lock_updates(),
+ * so the test result never changes during the lifetime of a handle.
+ */
+#define EXT4_SNAPSHOT_IDLE_TRANS_BLOCKS(n) \
+	(2*(n)+EXT4_SNAPSHOT_CREDITS)
+#define EXT4_SNAPSHOT_IDLE_START_TRANS_BLOCKS(n) \
+	(2*(n)+2*EXT4_SNAPSHOT_CREDITS)
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CREDITS_ADAPTIVE
+/*
+ * the worst case factor of 21 credits per user credit is rarely used.
+ * once enough transactions were sampled, reserve twice the learned ratio
+ * of COW credits per user credit instead.  every COW operation tops up
+ * the handle to EXT4_RESERVE_COW_CREDITS before it starts, so a low
+ * estimate costs a jbd2_journal_extend() and not a journal abort.
+ */
+#define EXT4_SNAPSHOT_COW_RATIO_SHIFT	8
+#define EXT4_SNAPSHOT_COW_MIN_SAMPLES	8
+
+static inline int ext4_snapshot_cow_factor(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	unsigned int ratio = ACCESS_ONCE(sbi->s_snapshot_cow_ratio);
+	int factor;
+
+	if (ACCESS_ONCE(sbi->s_snapshot_cow_fallback) ||
+	    ACCESS_ONCE(sbi->s_snapshot_cow_samples) <
+	    EXT4_SNAPSHOT_COW_MIN_SAMPLES)
+		return 1+EXT4_COW_CREDITS;
+	factor = 1 + DIV_ROUND_UP(2*ratio, 1 << EXT4_SNAPSHOT_COW_RATIO_SHIFT);
+	return clamp_t(int, factor, 2, 1+EXT4_COW_CREDITS);
+}
+
+#define EXT4_SNAPSHOT_ACTIVE_TRANS_BLOCKS(sb, n) \
+	((n)*ext4_snapshot_cow_factor(sb)+EXT4_SNAPSHOT_CREDITS)
+#define EXT4_SNAPSHOT_ACTIVE_START_TRANS_BLOCKS(sb, n)			\
+	min_t(int, EXT4_SNAPSHOT_START_TRANS_BLOCKS(n),			\
+	      (n)*ext4_snapshot_cow_factor(sb)+EXT4_RESERVE_COW_CREDITS+ \
+	      EXT4_SNAPSHOT_CREDITS)
+#else
+#define EXT4_SNAPSHOT_ACTIVE_TRANS_BLOCKS(sb, n) \
+	EXT4_SNAPSHOT_TRANS_BLOCKS(n)
+#define EXT4_SNAPSHOT_ACTIVE_START_TRANS_BLOCKS(sb, n) \
+	EXT4_SNAPSHOT_START_TRANS_BLOCKS(n)
+#endif
+
+#define ext4_snapshot_trans_blocks(sb, n)				\
+	(ext4_snapshot_has_active(sb) ?					\
+	 EXT4_SNAPSHOT_ACTIVE_TRANS_BLOCKS(sb, n) :			\
+	 EXT4_SNAPSHOT_IDLE_TRANS_BLOCKS(n))
+#define ext4_snapshot_start_trans_blocks(sb, n)				\
+	(ext4_snapshot_has_active(sb) ?					\
+	 EXT4_SNAPSHOT_ACTIVE_START_TRANS_BLOCKS(sb, n) :		\
+	 EXT4_SNAPSHOT_IDLE_START_TRANS_BLOCKS(n))
+#else
+#define ext4_snapshot_trans_blocks(sb, n)				\
+	EXT4_SNAPSHOT_TRANS_BLOCKS(n)
+#define ext4_snapshot_start_trans_blocks(sb, n)				\
+	EXT4_SNAPSHOT_START_TRANS_BLOCKS(n)
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE_BULK
+/*
+ * ext4_snapshot_delete_credits() - credits to move deleted blocks
+ * @inode:	owner of blocks
+ * @count:	no. of blocks about to be deleted
+ *
+ * Moving @count blocks to the active snapshot maps them with an indirect
+ * block per EXT4_ADDR_PER_BLOCK() blocks, which are allocated in COW context
+ * and only use buffer credits.  Returns the no. of user credits, whose
+ * extra COW credits are enough to move @count blocks, so that the caller
+ * can reserve them before deleting a whole extent.
+ */
+static inline int ext4_snapshot_delete_credits(struct inode *inode,
+		unsigned long count)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned long ind;
+
+	if (!ext4_snapshot_has_active(sb) || ext4_snapshot_excluded(inode))
+		return 0;
+
+	/* +1 for a double indirect block */
+	ind = DIV_ROUND_UP(count, EXT4_ADDR_PER_BLOCK(sb)) + 1;
+	return DIV_ROUND_UP(ind * EXT4_COW_BLOCK_CREDITS,
+			    1 + EXT4_COW_CREDITS);
+}
+#endif
+
 /*
  * Ext4 is not designed for filesystems under 4G with journal size < 128M
  * Recommended journal size is 3G (created with 'mke2fs -j -J big')
@@ -143,7 +236,12 @@
 #endif
 #define EXT4_RESERVE_TRANS_BLOCKS	12U
 
+#ifdef CONFIG_EXT4_FS_HTREE_LARGEDIR
+/* a split may reach the root of a three level htree */
+#define EXT4_INDEX_EXTRA_TRANS_BLOCKS	12
+#else
 #define EXT4_INDEX_EXTRA_TRANS_BLOCKS	8
+#endif
 
 #ifdef CONFIG_QUOTA
 /* Amount of blocks needed for quota update - we know that the structure was
@@ -200,6 +298,9 @@ int __ext4_journal_get_undo_access(const char *where, unsigned int line,
 int __ext4_journal_get_write_access_inode(const char *where, unsigned int line,
 					 handle_t *handle, struct inode *inode,
 					 struct buffer_head *bh, int exclude);
+int __ext4_journal_get_write_access_range(const char *where,
+					  unsigned int line, handle_t *handle,
+					  struct buffer_head **bhs, int count);
 #else
 int __ext4_journal_get_write_access(const char *where, unsigned int line,
 				    handle_t *handle, struct buffer_head *bh);
@@ -237,6 +338,9 @@ int __ext4_handle_dirty_super(const char *where, unsigned int line,
 #define ext4_journal_get_write_access_inode(handle, inode, bh) \
 	__ext4_journal_get_write_access_inode(__func__, __LINE__, \
 						(handle), (inode), (bh), 0)
+#define ext4_journal_get_write_access_range(handle, bhs, count) \
+	__ext4_journal_get_write_access_range(__func__, __LINE__, \
+					      (handle), (bhs), (count))
 #else
 #define ext4_journal_get_write_access(handle, bh) \
 	__ext4_journal_get_write_access(__func__, __LINE__, (handle), (bh))
@@ -253,6 +357,21 @@ int __ext4_handle_dirty_super(const char *where, unsigned int line,
 	__ext4_handle_dirty_super(__func__, __LINE__, (handle), (sb))
 
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
+/*
+ * account COW statistics in the per-CPU counters of the file system.
+ * a valid handle is always attached to the journal of the file system.
+ */
+#define stats_cow_add(handle, name, num)				\
+	do {								\
+		if (ext4_handle_valid(handle))				\
+			this_cpu_add(EXT4_SB((handle)->h_transaction->	\
+				t_journal->j_private)->s_snapshot_stats->	\
+				cow_##name, (num));			\
+	} while (0)
+#else
+#define stats_cow_add(handle, name, num)
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_TRACE
 /*
  * macros for ext4 to update transaction COW statistics.
@@ -261,18 +380,25 @@ int __ext4_handle_dirty_super(const char *where, unsigned int line,
  */
 #ifdef CONFIG_JBD2_DEBUG
 #define trace_cow_add(handle, name, num)	\
-	(handle)->h_cow_##name += (num)
+	do {					\
+		(handle)->h_cow_##name += (num);	\
+		stats_cow_add(handle, name, num);	\
+	} while (0)
 #define trace_cow_inc(handle, name)		\
-	(handle)->h_cow_##name++;
+	trace_cow_add(handle, name, 1)
 
 #else
-#define trace_cow_add(handle, name, num)
-#define trace_cow_inc(handle, name)
+#define trace_cow_add(handle, name, num)	\
+	stats_cow_add(handle, name, num)
+#define trace_cow_inc(handle, name)		\
+	stats_cow_add(handle, name, 1)
 
 #endif
 #else
-#define trace_cow_add(handle, name, num)
-#define trace_cow_inc(handle, name)
+#define trace_cow_add(handle, name, num)	\
+	stats_cow_add(handle, name, num)
+#define trace_cow_inc(handle, name)		\
+	stats_cow_add(handle, name, 1)
 
 #endif
 #endif
@@ -361,8 +487,15 @@ static inline int ext4_handle_has_enough_credits(handle_t *handle, int needed)
 		return 1;
 
 	sb = handle->h_transaction->t_journal->j_private;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CREDITS_LAZY
+	if (EXT4_SNAPSHOTS(sb))
+		return handle->h_buffer_credits >=
+			ext4_snapshot_trans_blocks(sb, needed) &&
+			handle->h_user_credits >= needed;
+#else
 	if (EXT4_SNAPSHOTS(sb))
 		return EXT4_SNAPSHOT_HAS_TRANS_BLOCKS(handle, needed);
+#endif
 	/* sb has no snapshot feature */
 	if (handle->h_buffer_credits < needed)
 #else
@@ -411,9 +544,17 @@ static inline int __ext4_journal_extend(const char *where,
 	sb = handle->h_transaction->t_journal->j_private;
 	if (EXT4_SNAPSHOTS(sb)) {
 		/* extend transaction to valid buffer/user credits ratio */
-		credits = EXT4_SNAPSHOT_TRANS_BLOCKS(handle->h_user_credits +
-			nblocks) - handle->h_buffer_credits;
+		credits = ext4_snapshot_trans_blocks(sb,
+			handle->h_user_credits + nblocks) -
+			handle->h_buffer_credits;
 	}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BUDGET
+	if (unlikely(credits > 0 && handle->h_buffer_credits + credits >
+		     handle->h_transaction->t_journal->
+		     j_max_transaction_buffers) && EXT4_SNAPSHOTS(sb))
+		ext4_snapshot_budget_fit(sb, handle->h_buffer_credits +
+					 credits);
+#endif
 	if (credits > 0)
 		err = jbd2_journal_extend((handle_t *)handle, credits);
 	if (EXT4_SNAPSHOTS(sb) && !err) {
@@ -444,7 +585,12 @@ static inline int __ext4_journal_restart(const char *where,
 
 	sb = handle->h_transaction->t_journal->j_private;
 	credits = EXT4_SNAPSHOTS(sb) ?
-		  EXT4_SNAPSHOT_START_TRANS_BLOCKS(nblocks) : nblocks;
+		  ext4_snapshot_start_trans_blocks(sb, nblocks) : nblocks;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BUDGET
+	if (unlikely(credits > handle->h_transaction->t_journal->
+		     j_max_transaction_buffers) && EXT4_SNAPSHOTS(sb))
+		ext4_snapshot_budget_fit(sb, credits);
+#endif
 	err = jbd2_journal_restart((handle_t *)handle, credits);
 	if (EXT4_SNAPSHOTS(sb) && !err) {
 		handle->h_base_credits = nblocks;
@@ -496,6 +642,19 @@ static inline int ext4_jbd2_file_inode(handle_t *handle, struct inode *inode)
 	return 0;
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_ORDERED_RANGE
+static inline int ext4_jbd2_file_inode_range(handle_t *handle,
+					     struct inode *inode,
+					     loff_t start, loff_t length)
+{
+	if (ext4_handle_valid(handle))
+		return jbd2_journal_file_inode_range(handle,
+						     EXT4_I(inode)->jinode,
+						     start, length);
+	return 0;
+}
+#endif
+
 static inline void ext4_update_inode_fsync_trans(handle_t *handle,
 						 struct inode *inode,
 						 int datasync)
@@ -518,7 +677,12 @@ static inline int ext4_should_journal_data(struct inode *inode)
 		return 0;
 	if (!S_ISREG(inode->i_mode))
 		return 1;
-#ifdef CONFIG_EXT4_FS_SNAPSHOT
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_DATA
+	if (EXT4_SNAPSHOTS(inode->i_sb) &&
+	    ext4_test_inode_flag(inode, EXT4_INODE_SNAPFILE))
+		/* snapshot files are written by COW */
+		return 0;
+#elif defined(CONFIG_EXT4_FS_SNAPSHOT)
 	if (EXT4_SNAPSHOTS(inode->i_sb))
 		/* snapshots enforce ordered data */
 		return 0;
@@ -536,7 +700,16 @@ static inline int ext4_should_order_data(struct inode *inode)
 		return 0;
 	if (!S_ISREG(inode->i_mode))
 		return 0;
-#ifdef CONFIG_EXT4_FS_SNAPSHOT
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_DATA
+	if (ext4_should_journal_data(inode))
+		return 0;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_WRITEBACK
+	if (EXT4_SNAPSHOTS(inode->i_sb))
+		/* snapshots enforce ordered or writeback data */
+		return test_opt(inode->i_sb, DATA_FLAGS) !=
+			EXT4_MOUNT_WRITEBACK_DATA;
+#elif defined(CONFIG_EXT4_FS_SNAPSHOT)
 	if (EXT4_SNAPSHOTS(inode->i_sb))
 		/* snapshots enforce ordered data */
 		return 1;
@@ -552,7 +725,17 @@ static inline int ext4_should_writeback_data(struct inode *inode)
 {
 	if (EXT4_JOURNAL(inode) == NULL)
 		return 1;
-#ifdef CONFIG_EXT4_FS_SNAPSHOT
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_DATA
+	if (ext4_should_journal_data(inode))
+		return 0;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_WRITEBACK
+	if (EXT4_SNAPSHOTS(inode->i_sb))
+		/* snapshots enforce ordered or writeback data */
+		return S_ISREG(inode->i_mode) &&
+			test_opt(inode->i_sb, DATA_FLAGS) ==
+			EXT4_MOUNT_WRITEBACK_DATA;
+#elif defined(CONFIG_EXT4_FS_SNAPSHOT)
 	if (EXT4_SNAPSHOTS(inode->i_sb))
 		/* snapshots enforce ordered data */
 		return 0;
@@ -581,7 +764,8 @@ static inline int ext4_should_dioread_nolock(struct inode *inode)
 		return 0;
 	if (!S_ISREG(inode->i_mode))
 		return 0;
-#ifdef CONFIG_EXT4_FS_SNAPSHOT
+#if defined(CONFIG_EXT4_FS_SNAPSHOT) && \
+	!defined(CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DIO_MOW)
 	if (EXT4_SNAPSHOTS(inode->i_sb))
 		/* XXX: should snapshots support dioread_nolock? */
 		return 0;
@@ -600,10 +784,19 @@ static inline int ext4_should_dioread_nolock(struct inode *inode)
  */
 static inline int ext4_snapshot_should_move_data(struct inode *inode)
 {
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_MOVE_EXT
+	handle_t *handle = ext4_journal_current_handle();
+
+#endif
 	if (!EXT4_SNAPSHOTS(inode->i_sb))
 		return 0;
 	if (EXT4_JOURNAL(inode) == NULL)
 		return 0;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_MOVE_EXT
+	/* blocks swapped out by move extent are not overwritten in place */
+	if (ext4_handle_valid(handle) && handle->h_move_extent)
+		return 0;
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE
 	if (ext4_snapshot_excluded(inode))
 		return 0;
@@ -612,12 +805,27 @@ static inline int ext4_snapshot_should_move_data(struct inode *inode)
 	if (ext4_test_inode_flag(inode, EXT4_INODE_EXTENTS))
 		return 0;
 #endif
-	/* when a data block is journaled, it is already COWed as metadata */
+	/* when a data block is journaled, it is COWed as metadata */
 	if (ext4_should_journal_data(inode))
 		return 0;
 	return 1;
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_NEW_BLOCKS
+/*
+ * check if @inode data blocks @lblk..@lblk+@len-1 should be moved-on-write.
+ * Blocks allocated after the active snapshot was taken are overwritten in
+ * place without testing the COW bitmap.
+ */
+static inline int ext4_snapshot_should_move_blocks(struct inode *inode,
+		ext4_lblk_t lblk, unsigned int len)
+{
+	if (!ext4_snapshot_should_move_data(inode))
+		return 0;
+	return !ext4_snapshot_new_blocks(inode, lblk, len);
+}
+
+#endif
 #endif
 #endif
 #endif	/* _EXT4_JBD2_H */
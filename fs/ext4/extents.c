@@ -1257,7 +1257,21 @@ static int ext4_ext_search_left(struct inode *inode,
 		return 0;
 	}
 
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_RANGE
+	if (*logical < (le32_to_cpu(ex->ee_block) + ee_len)) {
+		/*
+		 * Move-on-write inside ex: the blocks of ex left of *logical
+		 * stay in the file, but the old block at *logical is moved to
+		 * snapshot, so new blocks can never be merged with them.
+		 * Only the extent before ex can be a real neighbour.
+		 */
+		if (*logical > le32_to_cpu(ex->ee_block) ||
+		    ex == EXT_FIRST_EXTENT(path[depth].p_hdr))
+			return 0;
+		ex--;
+		ee_len = ext4_ext_get_actual_len(ex);
+	}
+#elif defined(CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT)
 	if (*logical < (le32_to_cpu(ex->ee_block) + ee_len)) {
 		*logical -= 1;
 		*phys = ext4_ext_pblock(ex) + *logical;
@@ -1333,7 +1347,15 @@ static int ext4_ext_search_right(struct inode *inode,
 		return 0;
 	}
 
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_RANGE
+	/*
+	 * Move-on-write inside ex: the blocks of ex from *logical stay in
+	 * the file, but the old blocks before them are moved to snapshot,
+	 * so new blocks can never be merged with them.
+	 */
+	if (*logical < (le32_to_cpu(ex->ee_block) + ee_len))
+		return 0;
+#elif defined(CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT)
 	if (*logical < (le32_to_cpu(ex->ee_block) + ee_len)) {
 		*logical += 1;
 		*phys = ext4_ext_pblock(ex) + *logical;
@@ -1864,7 +1886,13 @@ cleanup:
 		ext4_ext_drop_refs(npath);
 		kfree(npath);
 	}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_CACHE
+	/* merged and split extents keep their mapping */
+	ext4_ext_invalidate_cache_range(inode, le32_to_cpu(newext->ee_block),
+					ext4_ext_get_actual_len(newext));
+#else
 	ext4_ext_invalidate_cache(inode);
+#endif
 	return err;
 }
 
@@ -1983,17 +2011,272 @@ static int ext4_ext_walk_space(struct inode *inode, ext4_lblk_t block,
 	return err;
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_CACHE
+/*
+ * Multi-entry extent cache
+ *
+ * i_cached_extent is the most recently used extent or gap of the inode.
+ * Extents and gaps put in the cache are also kept in the i_extent_cache
+ * rbtree, so a miss of i_cached_extent may still be answered without
+ * a walk of the extent tree.  Cached ranges never overlap.
+ * The number of cached extents per inode is limited and the least
+ * recently used extents are freed by a shrinker under memory pressure.
+ */
+#define EXT4_EXT_CACHE_MAX	256	/* max. cached extents per inode */
+
+struct ext4_ext_cache_entry {
+	struct rb_node		ece_node;	/* in i_extent_cache */
+	struct list_head	ece_lru;	/* in i_extent_cache_lru */
+	struct ext4_ext_cache	ece_ext;
+};
+
+static struct kmem_cache *ext4_ext_cache_cachep;
+/* inodes with cached extents, least recently added first */
+static LIST_HEAD(ext4_ext_cache_inodes);
+/* protects ext4_ext_cache_inodes, nests inside i_block_reservation_lock */
+static DEFINE_SPINLOCK(ext4_ext_cache_lock);
+static atomic_t ext4_ext_cache_count = ATOMIC_INIT(0);
+
+/* test if range [@b1, @b1 + @l1) overlaps range [@b2, @b2 + @l2) */
+static inline int ext4_ext_cache_overlap(ext4_lblk_t b1, __u32 l1,
+					 ext4_lblk_t b2, __u32 l2)
+{
+	return b1 >= b2 ? b1 - b2 < l2 : b2 - b1 < l1;
+}
+
+/*
+ * Find the first cached extent that ends after @block.
+ * Called under i_block_reservation_lock.
+ */
+static struct ext4_ext_cache_entry *
+__ext4_ext_cache_find(struct ext4_inode_info *ei, ext4_lblk_t block)
+{
+	struct rb_node *n = ei->i_extent_cache.rb_node;
+	struct ext4_ext_cache_entry *entry, *found = NULL;
+
+	while (n) {
+		entry = rb_entry(n, struct ext4_ext_cache_entry, ece_node);
+		if (block < entry->ece_ext.ec_block) {
+			found = entry;
+			n = n->rb_left;
+		} else if (block - entry->ece_ext.ec_block >=
+			   entry->ece_ext.ec_len) {
+			n = n->rb_right;
+		} else {
+			return entry;
+		}
+	}
+	return found;
+}
+
+static void __ext4_ext_cache_remove(struct ext4_inode_info *ei,
+				    struct ext4_ext_cache_entry *entry)
+{
+	rb_erase(&entry->ece_node, &ei->i_extent_cache);
+	list_del(&entry->ece_lru);
+	ei->i_extent_cache_nr--;
+	atomic_dec(&ext4_ext_cache_count);
+	kmem_cache_free(ext4_ext_cache_cachep, entry);
+}
+
+/*
+ * Remove cached extents in range [@block, @block + @len).
+ * Called under i_block_reservation_lock.
+ */
+static void __ext4_ext_cache_remove_range(struct ext4_inode_info *ei,
+					  ext4_lblk_t block, __u32 len)
+{
+	struct ext4_ext_cache_entry *entry, *next;
+	struct rb_node *n;
+
+	entry = __ext4_ext_cache_find(ei, block);
+	while (entry && ext4_ext_cache_overlap(entry->ece_ext.ec_block,
+					       entry->ece_ext.ec_len,
+					       block, len)) {
+		n = rb_next(&entry->ece_node);
+		next = n ? rb_entry(n, struct ext4_ext_cache_entry,
+				    ece_node) : NULL;
+		__ext4_ext_cache_remove(ei, entry);
+		entry = next;
+	}
+}
+
+/*
+ * Add the inode to the shrinker list if it has cached extents or remove
+ * it from the list if it has none.  Called under i_block_reservation_lock.
+ */
+static void __ext4_ext_cache_update_list(struct ext4_inode_info *ei)
+{
+	spin_lock(&ext4_ext_cache_lock);
+	if (!ei->i_extent_cache_nr)
+		list_del_init(&ei->i_extent_cache_list);
+	else if (list_empty(&ei->i_extent_cache_list))
+		list_add_tail(&ei->i_extent_cache_list,
+			      &ext4_ext_cache_inodes);
+	spin_unlock(&ext4_ext_cache_lock);
+}
+
+/*
+ * Insert @entry into the inode extent cache, replacing overlapping
+ * cached extents.  Called under i_block_reservation_lock.
+ */
+static void __ext4_ext_cache_insert(struct ext4_inode_info *ei,
+				    struct ext4_ext_cache_entry *entry)
+{
+	struct rb_node **p = &ei->i_extent_cache.rb_node;
+	struct rb_node *parent = NULL;
+	struct ext4_ext_cache_entry *e;
+	ext4_lblk_t block = entry->ece_ext.ec_block;
+
+	__ext4_ext_cache_remove_range(ei, block, entry->ece_ext.ec_len);
+	while (*p) {
+		parent = *p;
+		e = rb_entry(parent, struct ext4_ext_cache_entry, ece_node);
+		if (block < e->ece_ext.ec_block)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&entry->ece_node, parent, p);
+	rb_insert_color(&entry->ece_node, &ei->i_extent_cache);
+	list_add(&entry->ece_lru, &ei->i_extent_cache_lru);
+	ei->i_extent_cache_nr++;
+	atomic_inc(&ext4_ext_cache_count);
+
+	while (ei->i_extent_cache_nr > EXT4_EXT_CACHE_MAX) {
+		e = list_entry(ei->i_extent_cache_lru.prev,
+			       struct ext4_ext_cache_entry, ece_lru);
+		__ext4_ext_cache_remove(ei, e);
+	}
+	__ext4_ext_cache_update_list(ei);
+}
+
+/*
+ * ext4_ext_invalidate_cache_range()
+ * Remove cached extents and gaps in range [@block, @block + @len),
+ * after the mapping of the range was changed.
+ */
+void ext4_ext_invalidate_cache_range(struct inode *inode,
+				     ext4_lblk_t block, __u32 len)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct ext4_ext_cache *cex = &ei->i_cached_extent;
+
+	spin_lock(&ei->i_block_reservation_lock);
+	if (cex->ec_len && ext4_ext_cache_overlap(cex->ec_block, cex->ec_len,
+						  block, len))
+		cex->ec_len = 0;
+	if (ei->i_extent_cache_nr) {
+		__ext4_ext_cache_remove_range(ei, block, len);
+		if (!ei->i_extent_cache_nr)
+			__ext4_ext_cache_update_list(ei);
+	}
+	spin_unlock(&ei->i_block_reservation_lock);
+}
+
+/*
+ * ext4_ext_invalidate_cache()
+ * Remove all cached extents and gaps of the inode.
+ */
+void ext4_ext_invalidate_cache(struct inode *inode)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct ext4_ext_cache_entry *entry, *tmp;
+
+	spin_lock(&ei->i_block_reservation_lock);
+	ei->i_cached_extent.ec_len = 0;
+	if (ei->i_extent_cache_nr) {
+		list_for_each_entry_safe(entry, tmp, &ei->i_extent_cache_lru,
+					 ece_lru)
+			__ext4_ext_cache_remove(ei, entry);
+		__ext4_ext_cache_update_list(ei);
+	}
+	spin_unlock(&ei->i_block_reservation_lock);
+}
+
+/*
+ * Free least recently used extents of the inodes that were added to
+ * the shrinker list first.  Inodes whose lock is contended are skipped.
+ */
+static int ext4_ext_cache_shrink(struct shrinker *shrink,
+				 struct shrink_control *sc)
+{
+	int nr_to_scan = sc->nr_to_scan;
+	struct ext4_inode_info *ei;
+	struct ext4_ext_cache_entry *entry;
+
+	spin_lock(&ext4_ext_cache_lock);
+	while (nr_to_scan > 0 && !list_empty(&ext4_ext_cache_inodes)) {
+		ei = list_first_entry(&ext4_ext_cache_inodes,
+				      struct ext4_inode_info,
+				      i_extent_cache_list);
+		list_move_tail(&ei->i_extent_cache_list,
+			       &ext4_ext_cache_inodes);
+		if (!spin_trylock(&ei->i_block_reservation_lock)) {
+			nr_to_scan--;
+			continue;
+		}
+		while (nr_to_scan > 0 && ei->i_extent_cache_nr) {
+			entry = list_entry(ei->i_extent_cache_lru.prev,
+					   struct ext4_ext_cache_entry,
+					   ece_lru);
+			__ext4_ext_cache_remove(ei, entry);
+			nr_to_scan--;
+		}
+		if (!ei->i_extent_cache_nr)
+			list_del_init(&ei->i_extent_cache_list);
+		spin_unlock(&ei->i_block_reservation_lock);
+	}
+	spin_unlock(&ext4_ext_cache_lock);
+	return (atomic_read(&ext4_ext_cache_count) / 100) *
+		sysctl_vfs_cache_pressure;
+}
+
+static struct shrinker ext4_ext_cache_shrinker = {
+	.shrink = ext4_ext_cache_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+int __init ext4_init_ext_cache(void)
+{
+	ext4_ext_cache_cachep = KMEM_CACHE(ext4_ext_cache_entry, 0);
+	if (!ext4_ext_cache_cachep)
+		return -ENOMEM;
+	register_shrinker(&ext4_ext_cache_shrinker);
+	return 0;
+}
+
+void ext4_exit_ext_cache(void)
+{
+	unregister_shrinker(&ext4_ext_cache_shrinker);
+	kmem_cache_destroy(ext4_ext_cache_cachep);
+}
+
+#endif
 static void
 ext4_ext_put_in_cache(struct inode *inode, ext4_lblk_t block,
 			__u32 len, ext4_fsblk_t start)
 {
 	struct ext4_ext_cache *cex;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_CACHE
+	struct ext4_ext_cache_entry *entry;
+#endif
 	BUG_ON(len == 0);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_CACHE
+	/* failure to allocate an entry is not an error */
+	entry = kmem_cache_alloc(ext4_ext_cache_cachep, GFP_NOFS);
+#endif
 	spin_lock(&EXT4_I(inode)->i_block_reservation_lock);
 	cex = &EXT4_I(inode)->i_cached_extent;
 	cex->ec_block = block;
 	cex->ec_len = len;
 	cex->ec_start = start;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_CACHE
+	if (entry) {
+		entry->ece_ext = *cex;
+		__ext4_ext_cache_insert(EXT4_I(inode), entry);
+	}
+#endif
 	spin_unlock(&EXT4_I(inode)->i_block_reservation_lock);
 }
 
@@ -2075,9 +2358,23 @@ static int ext4_ext_check_cache(struct inode *inode, ext4_lblk_t block,
 	cex = &EXT4_I(inode)->i_cached_extent;
 	sbi = EXT4_SB(inode->i_sb);
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_CACHE
+	/* has cache valid data? */
+	if (cex->ec_len == 0 || !in_range(block, cex->ec_block, cex->ec_len)) {
+		struct ext4_ext_cache_entry *entry;
+
+		/* look for block in the multi-entry cache */
+		entry = __ext4_ext_cache_find(EXT4_I(inode), block);
+		if (!entry || block < entry->ece_ext.ec_block)
+			goto errout;
+		list_move(&entry->ece_lru, &EXT4_I(inode)->i_extent_cache_lru);
+		*cex = entry->ece_ext;
+	}
+#else
 	/* has cache valid data? */
 	if (cex->ec_len == 0)
 		goto errout;
+#endif
 
 	if (in_range(block, cex->ec_block, cex->ec_len)) {
 		memcpy(ex, cex, sizeof(struct ext4_ext_cache));
@@ -2435,6 +2732,10 @@ ext4_ext_rm_leaf(handle_t *handle, struct inode *inode,
 			credits += (ext_depth(inode)) + 1;
 		}
 		credits += EXT4_MAXQUOTAS_TRANS_BLOCKS(inode->i_sb);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE_BULK
+		/* reserve credits to move the whole extent to snapshot */
+		credits += ext4_snapshot_delete_credits(inode, b - a + 1);
+#endif
 
 		err = ext4_ext_truncate_extend_restart(handle, inode, credits);
 		if (err)
@@ -2794,6 +3095,10 @@ static int ext4_split_extent_at(handle_t *handle,
 
 	BUG_ON(split < ee_block || split >= (ee_block + ee_len));
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_CACHE
+	/* parts of the extent may change state */
+	ext4_ext_invalidate_cache_range(inode, ee_block, ee_len);
+#endif
 	err = ext4_ext_get_access(handle, inode, path + depth);
 	if (err)
 		goto out;
@@ -3310,13 +3615,111 @@ out1:
 	map->m_pblk = newblock;
 	map->m_len = allocated;
 out2:
+#ifndef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_PATH
+	/* with HOOKS_EXTENT_PATH, the caller releases the path */
 	if (path) {
 		ext4_ext_drop_refs(path);
 		kfree(path);
 	}
+#endif
 	return err ? err : allocated;
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+/*
+ * Mark a range of blocks in exclude bitmap and clear them from the active
+ * snapshot COW bitmap, one block group at a time.
+ * Return the no. of newly excluded blocks or < 0 on error.
+ */
+static int ext4_ext_exclude_range(handle_t *handle, struct super_block *sb,
+				  ext4_fsblk_t block, unsigned int len)
+{
+	int n, ret, excluded = 0;
+
+	while (len > 0) {
+		n = SNAPSHOT_BLOCKS_PER_GROUP -
+			SNAPSHOT_BLOCK_GROUP_OFFSET(block);
+		if (n > len)
+			n = len;
+		ret = ext4_snapshot_exclude_blocks(handle, sb, block, n);
+		if (ret < 0)
+			return ret;
+		excluded += ret;
+		ret = ext4_snapshot_exclude_cow_bitmap(handle, sb, block, n);
+		if (ret < 0)
+			return ret;
+		block += n;
+		len -= n;
+	}
+	return excluded;
+}
+
+/*
+ * ext4_ext_exclude_blocks - mark extent mapped file blocks in exclude bitmap
+ * @handle:	JBD handle
+ * @inode:	excluded file
+ * @lblk:	logical block to start from (returns where to resume from)
+ * @maxext:	max. no. of extents to exclude
+ *
+ * Marks the tree blocks on the path to the leaf that maps @lblk and the
+ * blocks of up to @maxext extents in that leaf in exclude bitmap.
+ * *@lblk is set to EXT_MAX_BLOCKS after the last extent of the file.
+ * Called under down_read(&i_data_sem), so extents cannot be freed meanwhile.
+ *
+ * Return the no. of newly excluded blocks or < 0 on error.
+ */
+int ext4_ext_exclude_blocks(handle_t *handle, struct inode *inode,
+			    ext4_lblk_t *lblk, int maxext)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext4_ext_path *path;
+	struct ext4_extent *ex, *last;
+	int depth, i, ret, excluded = 0;
+
+	path = ext4_ext_find_extent(inode, *lblk, NULL);
+	if (IS_ERR(path))
+		return PTR_ERR(path);
+	depth = path->p_depth;
+
+	/* exclude index and leaf blocks */
+	for (i = 1; i <= depth; i++) {
+		ret = ext4_ext_exclude_range(handle, sb,
+					     path[i].p_bh->b_blocknr, 1);
+		if (ret < 0)
+			goto out;
+		excluded += ret;
+	}
+
+	ex = path[depth].p_ext;
+	if (!ex) {
+		/* empty file */
+		*lblk = EXT_MAX_BLOCKS;
+		goto out_ok;
+	}
+	if (*lblk >= le32_to_cpu(ex->ee_block) + ext4_ext_get_actual_len(ex))
+		ex++;
+
+	last = EXT_LAST_EXTENT(path[depth].p_hdr);
+	for (; ex <= last && maxext > 0; ex++, maxext--) {
+		ret = ext4_ext_exclude_range(handle, sb, ext4_ext_pblock(ex),
+					     ext4_ext_get_actual_len(ex));
+		if (ret < 0)
+			goto out;
+		excluded += ret;
+		*lblk = le32_to_cpu(ex->ee_block) +
+			ext4_ext_get_actual_len(ex);
+	}
+	if (ex > last)
+		*lblk = ext4_ext_next_leaf_block(path);
+out_ok:
+	ret = excluded;
+out:
+	ext4_ext_drop_refs(path);
+	kfree(path);
+	return ret;
+}
+
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT
 /*
  * Move oldblocks to snapshot and newblocks to the file.
@@ -3325,7 +3728,7 @@ static int ext4_ext_move_to_snapshot(handle_t *handle, struct inode *inode,
 				     struct ext4_map_blocks *map,
 				     struct ext4_ext_path *path,
 				     ext4_fsblk_t oldblock,
-				     ext4_fsblk_t newblock)
+				     ext4_fsblk_t newblock, int flags)
 {
 	struct ext4_extent *ex;
 	int err, depth, len;
@@ -3366,6 +3769,18 @@ static int ext4_ext_move_to_snapshot(handle_t *handle, struct inode *inode,
 		if (!err) {
 			/* splice new blocks to the inode*/
 			ext4_ext_store_pblock(ex, newblock);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_CACHE
+			ext4_ext_invalidate_cache_range(inode, map->m_lblk,
+							map->m_len);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DIO_MOW
+			/*
+			 * New blocks of direct I/O write are uninitialized
+			 * until the I/O completes.
+			 */
+			if (flags & EXT4_GET_BLOCKS_UNINIT_EXT)
+				ext4_ext_mark_uninitialized(ex);
+#endif
 			ext4_ext_try_to_merge(inode, path, ex);
 			err = ext4_ext_dirty(handle, inode,
 					     path + depth);
@@ -3375,6 +3790,39 @@ static int ext4_ext_move_to_snapshot(handle_t *handle, struct inode *inode,
 out:
 	return err;
 }
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_PATH
+/*
+ * Size of the path array on the stack of ext4_ext_map_blocks().
+ * A lookup needs depth + 2 entries to account for a possible depth
+ * increase, so trees of depth up to 2 do not allocate a path array.
+ */
+#define EXT4_EXT_PATH_ONSTACK	4
+
+/*
+ * Find extent using the path array @path_buf if it is big enough for the
+ * extent tree of @inode.  Otherwise, allocate a path array.
+ */
+static struct ext4_ext_path *
+ext4_ext_find_extent_onstack(struct inode *inode, ext4_lblk_t block,
+			     struct ext4_ext_path *path_buf)
+{
+	if (ext_depth(inode) + 2 > EXT4_EXT_PATH_ONSTACK)
+		return ext4_ext_find_extent(inode, block, NULL);
+
+	memset(path_buf, 0, sizeof(*path_buf) * EXT4_EXT_PATH_ONSTACK);
+	return ext4_ext_find_extent(inode, block, path_buf);
+}
+
+/* Release a path returned by ext4_ext_find_extent_onstack() */
+static void ext4_ext_free_path(struct ext4_ext_path *path,
+			       struct ext4_ext_path *path_buf)
+{
+	ext4_ext_drop_refs(path);
+	if (path != path_buf)
+		kfree(path);
+}
+
 #endif
 /*
  * Block allocation/map/preallocation routine for extents based files
@@ -3398,6 +3846,9 @@ int ext4_ext_map_blocks(handle_t *handle, struct inode *inode,
 			struct ext4_map_blocks *map, int flags)
 {
 	struct ext4_ext_path *path = NULL;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_PATH
+	struct ext4_ext_path path_buf[EXT4_EXT_PATH_ONSTACK];
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT
 	struct ext4_extent newex, *ex = NULL;
 	ext4_fsblk_t oldblock = 0;
@@ -3446,7 +3897,11 @@ int ext4_ext_map_blocks(handle_t *handle, struct inode *inode,
 	}
 
 	/* find extent for this block */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_PATH
+	path = ext4_ext_find_extent_onstack(inode, map->m_lblk, path_buf);
+#else
 	path = ext4_ext_find_extent(inode, map->m_lblk, NULL);
+#endif
 	if (IS_ERR(path)) {
 		err = PTR_ERR(path);
 		path = NULL;
@@ -3505,6 +3960,9 @@ int ext4_ext_map_blocks(handle_t *handle, struct inode *inode,
 				ret = ext4_ext_handle_uninitialized_extents(
 					handle, inode, map, path, flags,
 					allocated, newblock);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_PATH
+				ext4_ext_free_path(path, path_buf);
+#endif
 				return ret;
 			}
 
@@ -3545,11 +4003,18 @@ int ext4_ext_map_blocks(handle_t *handle, struct inode *inode,
 				 * find extent for the block at
 				 * the start of the hole
 				 */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_PATH
+				ext4_ext_free_path(path, path_buf);
+
+				path = ext4_ext_find_extent_onstack(inode,
+				map->m_lblk, path_buf);
+#else
 				ext4_ext_drop_refs(path);
 				kfree(path);
 
 				path = ext4_ext_find_extent(inode,
 				map->m_lblk, NULL);
+#endif
 				if (IS_ERR(path)) {
 					err = PTR_ERR(path);
 					path = NULL;
@@ -3640,7 +4105,12 @@ found:
 
 	if (path == NULL) {
 		/* find extent for this block */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_PATH
+		path = ext4_ext_find_extent_onstack(inode, map->m_lblk,
+						    path_buf);
+#else
 		path = ext4_ext_find_extent(inode, map->m_lblk, NULL);
+#endif
 		if (IS_ERR(path)) {
 			err = PTR_ERR(path);
 			path = NULL;
@@ -3710,9 +4180,25 @@ found:
 		ar.flags = 0;
 	if (flags & EXT4_GET_BLOCKS_NO_NORMALIZE)
 		ar.flags |= EXT4_MB_HINT_NOPREALLOC;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_MOW_GOAL
+	if (oldblock) {
+		int arena;
+
+		/* keep new blocks of the rewrite arena contiguous */
+		ar.goal = ext4_snapshot_mow_goal(inode, map->m_lblk,
+						 ar.goal, &arena);
+		if (arena)
+			ar.flags |= EXT4_MB_HINT_TRY_GOAL;
+	}
+#endif
 	newblock = ext4_mb_new_blocks(handle, &ar, &err);
 	if (!newblock)
 		goto out2;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_MOW_GOAL
+	if (oldblock)
+		ext4_snapshot_mow_allocated(inode, map->m_lblk,
+					    ar.goal, newblock);
+#endif
 	ext_debug("allocate new block: goal %llu, found %llu/%u\n",
 		  ar.goal, newblock, allocated);
 
@@ -3750,7 +4236,7 @@ found:
 		map->m_len = ar.len;
 		BUG_ON(!(flags & EXT4_GET_BLOCKS_MOVE_ON_WRITE));
 		err = ext4_ext_move_to_snapshot(handle, inode, map, path,
-						oldblock, newblock);
+						oldblock, newblock, flags);
 	} else
 		err = ext4_ext_insert_extent(handle, inode,
 					     path, &newex, flags);
@@ -3775,6 +4261,11 @@ found:
 	if (allocated > map->m_len)
 		allocated = map->m_len;
 	map->m_flags |= EXT4_MAP_NEW;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_NEW_BLOCKS
+	if (EXT4_SNAPSHOTS(inode->i_sb) && !IS_COWING(handle))
+		/* no move-on-write when the new blocks are overwritten */
+		ext4_snapshot_new_allocated(inode, map->m_lblk, allocated);
+#endif
 
 	/*
 	 * Update reserved blocks/metadata blocks after successful
@@ -3809,10 +4300,15 @@ out:
 	map->m_pblk = newblock;
 	map->m_len = allocated;
 out2:
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_PATH
+	if (path)
+		ext4_ext_free_path(path, path_buf);
+#else
 	if (path) {
 		ext4_ext_drop_refs(path);
 		kfree(path);
 	}
+#endif
 	trace_ext4_ext_map_blocks_exit(inode, map->m_lblk,
 		newblock, map->m_len, err ? err : allocated);
 
@@ -3942,6 +4438,12 @@ long ext4_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
 	struct ext4_map_blocks map;
 	unsigned int credits, blkbits = inode->i_blkbits;
 
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+	/* preallocated blocks are beyond i_block */
+	ret = ext4_convert_inline_data(inode);
+	if (ret)
+		return ret;
+#endif
 	/*
 	 * currently supporting (pre)allocate mode for extent-based
 	 * files _only_
@@ -4320,6 +4822,33 @@ static int ext4_xattr_fiemap(struct inode *inode,
 	return (error < 0 ? error : 0);
 }
 
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+static int ext4_inline_fiemap(struct inode *inode,
+			      struct fiemap_extent_info *fieinfo, __u64 start)
+{
+	struct ext4_iloc iloc;
+	__u64 physical;
+	int error;
+
+	if (!inode->i_size || start >= inode->i_size)
+		return 0;
+
+	/* inline data is in i_block of the on-disk inode */
+	error = ext4_get_inode_loc(inode, &iloc);
+	if (error)
+		return error;
+	physical = ((__u64)iloc.bh->b_blocknr << inode->i_sb->s_blocksize_bits) +
+		((char *)ext4_raw_inode(&iloc)->i_block - iloc.bh->b_data);
+	brelse(iloc.bh);
+
+	error = fiemap_fill_next_extent(fieinfo, 0, physical, inode->i_size,
+					FIEMAP_EXTENT_DATA_INLINE |
+					FIEMAP_EXTENT_NOT_ALIGNED |
+					FIEMAP_EXTENT_LAST);
+	return (error < 0 ? error : 0);
+}
+#endif
+
 /*
  * ext4_ext_punch_hole
  *
@@ -4497,6 +5026,20 @@ int ext4_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
 	ext4_lblk_t start_blk;
 	int error = 0;
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_FIEMAP
+	/* snapshot files have read through holes */
+	if (ext4_snapshot_file(inode))
+		return ext4_snapshot_fiemap(inode, fieinfo, start, len);
+#endif
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+	if (ext4_has_inline_data(inode)) {
+		if (fiemap_check_flags(fieinfo, EXT4_FIEMAP_FLAGS))
+			return -EBADR;
+		if (fieinfo->fi_flags & FIEMAP_FLAG_XATTR)
+			return ext4_xattr_fiemap(inode, fieinfo);
+		return ext4_inline_fiemap(inode, fieinfo, start);
+	}
+#endif
 	/* fallback to generic here if not in extents fmt */
 	if (!(ext4_test_inode_flag(inode, EXT4_INODE_EXTENTS)))
 		return generic_block_fiemap(inode, fieinfo, start, len,
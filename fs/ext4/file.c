@@ -307,6 +307,35 @@ const struct file_operations ext4_file_operations = {
 	.fallocate	= ext4_fallocate,
 };
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READ_SHARED
+/*
+ * snapshot files are read with ext4_snapshot_file_read(), which copies
+ * blocks shared with the file system out of the block device buffer cache.
+ */
+const struct file_operations ext4_snapfile_operations = {
+	.llseek		= ext4_llseek,
+	.read		= ext4_snapshot_file_read,
+	.write		= do_sync_write,
+	.aio_read	= generic_file_aio_read,
+	.aio_write	= ext4_file_write,
+	.unlocked_ioctl = ext4_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl	= ext4_compat_ioctl,
+#endif
+	.mmap		= ext4_file_mmap,
+	.open		= ext4_file_open,
+	.release	= ext4_release_file,
+	.fsync		= ext4_sync_file,
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_SPLICE_SHARED
+	.splice_read	= ext4_snapshot_file_splice_read,
+#else
+	.splice_read	= generic_file_splice_read,
+#endif
+	.splice_write	= generic_file_splice_write,
+	.fallocate	= ext4_fallocate,
+};
+#endif
+
 const struct inode_operations ext4_file_inode_operations = {
 	.setattr	= ext4_setattr,
 	.getattr	= ext4_getattr,
@@ -193,6 +193,27 @@ static int __sync_inode(struct inode *inode, int datasync)
 	return ret;
 }
 
+#ifdef CONFIG_EXT4_FS_FSYNC_BATCH
+/*
+ * Give other fsyncing tasks a chance to join the transaction before we
+ * force it to commit.  A single task doing a stream of fsyncs gains
+ * nothing from waiting, so only batch when someone else is fsyncing
+ * right now or the previous fsync came from another task.
+ * The caller drops s_fsync_waiters once its commit is done.
+ */
+static void ext4_fsync_batch(struct super_block *sb, tid_t commit_tid)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	pid_t pid = current->pid;
+
+	if (atomic_inc_return(&sbi->s_fsync_waiters) > 1 ||
+	    sbi->s_last_fsync_pid != pid) {
+		sbi->s_last_fsync_pid = pid;
+		jbd2_log_batch_commit(sbi->s_journal, commit_tid);
+	}
+}
+
+#endif
 /*
  * akpm: A new design for ext4_sync_file().
  *
@@ -259,11 +280,17 @@ int ext4_sync_file(struct file *file, loff_t start, loff_t end, int datasync)
 	}
 
 	commit_tid = datasync ? ei->i_datasync_tid : ei->i_sync_tid;
+#ifdef CONFIG_EXT4_FS_FSYNC_BATCH
+	ext4_fsync_batch(inode->i_sb, commit_tid);
+#endif
 	if (journal->j_flags & JBD2_BARRIER &&
 	    !jbd2_trans_will_send_data_barrier(journal, commit_tid))
 		needs_barrier = true;
 	jbd2_log_start_commit(journal, commit_tid);
 	ret = jbd2_log_wait_commit(journal, commit_tid);
+#ifdef CONFIG_EXT4_FS_FSYNC_BATCH
+	atomic_dec(&EXT4_SB(inode->i_sb)->s_fsync_waiters);
+#endif
 	if (needs_barrier)
 		blkdev_issue_flush(inode->i_sb->s_bdev, GFP_KERNEL, NULL);
  out:
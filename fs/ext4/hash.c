@@ -67,6 +67,13 @@ static __u32 dx_hack_hash_signed(const char *name, int len)
 	return hash0 << 1;
 }
 
+#ifdef CONFIG_EXT4_FS_DIRHASH_WORD
+/*
+ * The name is packed into the hash buffer a whole word at a time.  Only
+ * the last partial word is padded, so the result is identical to packing
+ * the name a byte at a time.
+ */
+#endif
 static void str2hashbuf_signed(const char *msg, int len, __u32 *buf, int num)
 {
 	__u32	pad, val;
@@ -76,6 +83,16 @@ static void str2hashbuf_signed(const char *msg, int len, __u32 *buf, int num)
 	pad = (__u32)len | ((__u32)len << 8);
 	pad |= pad << 16;
 
+#ifdef CONFIG_EXT4_FS_DIRHASH_WORD
+	if (len > num*4)
+		len = num * 4;
+	for (i = 0; i + 4 <= len; i += 4, num--)
+		*buf++ = ((__u32) scp[i] << 24) + ((__u32) scp[i + 1] << 16) +
+			 ((__u32) scp[i + 2] << 8) + (__u32) scp[i + 3];
+	val = pad;
+	for (; i < len; i++)
+		val = ((int) scp[i]) + (val << 8);
+#else
 	val = pad;
 	if (len > num*4)
 		len = num * 4;
@@ -89,6 +106,7 @@ static void str2hashbuf_signed(const char *msg, int len, __u32 *buf, int num)
 			num--;
 		}
 	}
+#endif
 	if (--num >= 0)
 		*buf++ = val;
 	while (--num >= 0)
@@ -104,6 +122,16 @@ static void str2hashbuf_unsigned(const char *msg, int len, __u32 *buf, int num)
 	pad = (__u32)len | ((__u32)len << 8);
 	pad |= pad << 16;
 
+#ifdef CONFIG_EXT4_FS_DIRHASH_WORD
+	if (len > num*4)
+		len = num * 4;
+	for (i = 0; i + 4 <= len; i += 4, num--)
+		*buf++ = ((__u32) ucp[i] << 24) + ((__u32) ucp[i + 1] << 16) +
+			 ((__u32) ucp[i + 2] << 8) + (__u32) ucp[i + 3];
+	val = pad;
+	for (; i < len; i++)
+		val = ((int) ucp[i]) + (val << 8);
+#else
 	val = pad;
 	if (len > num*4)
 		len = num * 4;
@@ -117,6 +145,7 @@ static void str2hashbuf_unsigned(const char *msg, int len, __u32 *buf, int num)
 			num--;
 		}
 	}
+#endif
 	if (--num >= 0)
 		*buf++ = val;
 	while (--num >= 0)
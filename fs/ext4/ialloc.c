@@ -273,9 +273,7 @@ void ext4_free_inode(handle_t *handle, struct inode *inode)
 	if (sbi->s_log_groups_per_flex) {
 		ext4_group_t f = ext4_flex_group(sbi, block_group);
 
-		atomic_inc(&sbi->s_flex_groups[f].free_inodes);
-		if (is_directory)
-			atomic_dec(&sbi->s_flex_groups[f].used_dirs);
+		ext4_flex_add(sbi, f, 1, 0, is_directory ? -1 : 0);
 	}
 	BUFFER_TRACE(bh2, "call ext4_handle_dirty_metadata");
 	fatal = ext4_handle_dirty_metadata(handle, NULL, bh2);
@@ -424,6 +422,7 @@ static void get_orlov_stats(struct super_block *sb, ext4_group_t g,
 	struct flex_groups *flex_group = EXT4_SB(sb)->s_flex_groups;
 
 	if (flex_size > 1) {
+		ext4_flex_fold_local(EXT4_SB(sb), g);
 		stats->free_inodes = atomic_read(&flex_group[g].free_inodes);
 		stats->free_blocks = atomic_read(&flex_group[g].free_blocks);
 		stats->used_dirs = atomic_read(&flex_group[g].used_dirs);
@@ -442,6 +441,61 @@ static void get_orlov_stats(struct super_block *sb, ext4_group_t g,
 	}
 }
 
+#ifdef CONFIG_EXT4_FS_ORLOV_GROUP_INDEX
+/*
+ * number of flex groups tested for a top level directory
+ */
+#define ORLOV_INDEX_SCAN	64
+
+/*
+ * Pick the flex group of a top level directory from the lists of flex
+ * groups by order of free inodes, instead of testing every flex group.
+ * Only up to ORLOV_INDEX_SCAN flex groups with the most free inodes are
+ * tested.  The chosen flex group is moved to the tail of its list, so
+ * successive top level directories are spread over the flex groups,
+ * like the hashed start of the linear scan spreads them.
+ */
+static int find_flex_orlov_indexed(struct super_block *sb,
+				   unsigned int avefreei,
+				   ext4_fsblk_t avefreeb,
+				   ext4_group_t *group)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct flex_groups *fg, *best = NULL;
+	int best_ndir = EXT4_INODES_PER_GROUP(sb);
+	int order, scanned = 0;
+	unsigned int free_inodes;
+	int used_dirs;
+
+	spin_lock(&sbi->s_flex_free_inodes_lock);
+	for (order = EXT4_FLEX_FREE_ORDERS - 1;
+	     order >= fls(avefreei) && scanned < ORLOV_INDEX_SCAN; order--) {
+		list_for_each_entry(fg, &sbi->s_flex_free_inodes[order],
+				    free_inodes_node) {
+			if (++scanned > ORLOV_INDEX_SCAN)
+				break;
+			free_inodes = atomic_read(&fg->free_inodes);
+			used_dirs = atomic_read(&fg->used_dirs);
+			if (!free_inodes || free_inodes < avefreei)
+				continue;
+			if (used_dirs >= best_ndir)
+				continue;
+			if (atomic_read(&fg->free_blocks) < avefreeb)
+				continue;
+			best = fg;
+			best_ndir = used_dirs;
+		}
+	}
+	if (best) {
+		list_move_tail(&best->free_inodes_node,
+			       &sbi->s_flex_free_inodes[best->free_inodes_order]);
+		*group = best - sbi->s_flex_groups;
+	}
+	spin_unlock(&sbi->s_flex_free_inodes_lock);
+	return best ? 0 : -1;
+}
+
+#endif
 /*
  * Orlov's allocator for directories.
  *
@@ -502,6 +556,14 @@ static int find_group_orlov(struct super_block *sb, struct inode *parent,
 		int best_ndir = inodes_per_group;
 		int ret = -1;
 
+#ifdef CONFIG_EXT4_FS_ORLOV_GROUP_INDEX
+		if (flex_size > 1 && sbi->s_orlov_group_index) {
+			if (find_flex_orlov_indexed(sb, avefreei, avefreeb,
+						    &grp))
+				goto fallback;
+			goto found_flex_bg;
+		}
+#endif
 		if (qstr) {
 			hinfo.hash_version = DX_HASH_HALF_MD4;
 			hinfo.seed = sbi->s_hash_seed;
@@ -782,7 +844,7 @@ static int ext4_claim_inode(struct super_block *sb,
 		if (sbi->s_log_groups_per_flex) {
 			ext4_group_t f = ext4_flex_group(sbi, group);
 
-			atomic_inc(&sbi->s_flex_groups[f].used_dirs);
+			ext4_flex_add(sbi, f, 0, 0, 1);
 		}
 	}
 	gdp->bg_checksum = ext4_group_desc_csum(sbi, group, gdp);
@@ -997,7 +1059,7 @@ got:
 
 	if (sbi->s_log_groups_per_flex) {
 		flex_group = ext4_flex_group(sbi, group);
-		atomic_dec(&sbi->s_flex_groups[flex_group].free_inodes);
+		ext4_flex_add(sbi, flex_group, -1, 0, 0);
 	}
 
 	if (test_opt(sb, GRPID)) {
@@ -1075,6 +1137,31 @@ got:
 			ext4_ext_tree_init(handle, inode);
 		}
 	}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_INHERIT
+
+	/*
+	 * New directories and extent mapped files in an excluded directory
+	 * are excluded.  A new file has no blocks yet, so all its blocks are
+	 * excluded on allocation and are never moved to snapshot.
+	 */
+	if (ext4_test_inode_flag(dir, EXT4_INODE_EXCLUDED) &&
+	    !ext4_snapshot_file(inode) && (S_ISDIR(mode) || (S_ISREG(mode) &&
+	     ext4_test_inode_flag(inode, EXT4_INODE_EXTENTS))))
+		ext4_set_inode_flag(inode, EXT4_INODE_EXCLUDED);
+#endif
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+
+	/* the data of a new file is inline until it outgrows i_block */
+	if (EXT4_HAS_INCOMPAT_FEATURE(sb, EXT4_FEATURE_INCOMPAT_IBLOCK_DATA) &&
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE
+	    !ext4_snapshot_file(inode) &&
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+	    !ext4_test_inode_flag(inode, EXT4_INODE_EXCLUDED) &&
+#endif
+	    S_ISREG(mode))
+		ext4_set_inode_state(inode, EXT4_STATE_MAY_INLINE_DATA);
+#endif
 
 	if (ext4_handle_valid(handle)) {
 		ei->i_sync_tid = handle->h_transaction->t_tid;
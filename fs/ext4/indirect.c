@@ -22,6 +22,9 @@
 
 #include <linux/module.h>
 #include <linux/quotaops.h>
+#ifdef CONFIG_EXT4_FS_FREE_DATA_SORT
+#include <linux/sort.h>
+#endif
 #include "ext4_jbd2.h"
 #include "truncate.h"
 #include "snapshot.h"
@@ -552,7 +555,7 @@ static int ext4_alloc_branch(handle_t *handle, struct inode *inode,
 				return err;
 		}
 		/* charge snapshot file owner for moved blocks */
-		dquot_alloc_block_nofail(inode, *blks);
+		ext4_snapshot_charge_blocks(inode, *blks);
 		num = *blks;
 		new_blocks[indirect_blks] = current_block;
 	} else
@@ -659,7 +662,7 @@ failed:
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_MOVE
 	if (SNAPMAP_ISMOVE(flags) && num > 0)
 		/* don't charge snapshot file owner if move failed */
-		dquot_free_block(inode, num);
+		ext4_snapshot_uncharge_blocks(inode, num);
 	else if (num > 0)
 		ext4_free_blocks(handle, inode, NULL, new_blocks[i], num, 0);
 #else
@@ -782,7 +785,7 @@ err_out:
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_MOVE
 	if (SNAPMAP_ISMOVE(flags))
 		/* don't charge snapshot file owner if move failed */
-		dquot_free_block(inode, blks);
+		ext4_snapshot_uncharge_blocks(inode, blks);
 	else
 		ext4_free_blocks(handle, inode, NULL,
 				 le32_to_cpu(where[num].key), blks, 0);
@@ -838,6 +841,9 @@ int ext4_ind_map_blocks(handle_t *handle, struct inode *inode,
 	ext4_fsblk_t first_block = 0;
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW
 	struct buffer_head *sbh = NULL;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_RANGE
+	int pending = 0;
+#endif
 #endif
 
 	trace_ext4_ind_map_blocks_enter(inode, map->m_lblk, map->m_len, flags);
@@ -924,6 +930,21 @@ int ext4_ind_map_blocks(handle_t *handle, struct inode *inode,
 	 * Okay, we need to do block allocation.
 	*/
 	goal = ext4_find_goal(inode, map->m_lblk, partial);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_PACKED
+	if (SNAPMAP_ISCOW(flags))
+		/* pack snapshot copies in the snapshot allocation zone */
+		goal = ext4_snapshot_cow_goal(inode, goal);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_MOW_GOAL
+	if (map->m_flags & EXT4_MAP_REMAP) {
+		int arena;
+
+		/* keep new blocks of the rewrite arena contiguous */
+		goal = ext4_snapshot_mow_goal(inode, map->m_lblk, goal,
+					      &arena);
+		goal = goal & EXT4_MAX_BLOCK_FILE_PHYS;
+	}
+#endif
 
 	/* the number of blocks need to allocate for [d,t]indirect blocks */
 	indirect_blks = (chain + depth) - partial - 1;
@@ -942,6 +963,12 @@ int ext4_ind_map_blocks(handle_t *handle, struct inode *inode,
 #else
 	count = ext4_blks_to_allocate(partial, indirect_blks,
 				      map->m_len, blocks_to_boundary);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BYPASS_CREDITS
+	if (SNAPMAP_ISSYNC(flags) && indirect_blks > 0 &&
+	    ext4_snapshot_bypass_credits(handle, indirect_blks))
+		/* journal the COW bitmap indirect blocks instead of sync */
+		flags &= ~EXT4_GET_BLOCKS_SYNC;
 #endif
 	/*
 	 * Block out ext4_truncate while we alter the tree
@@ -952,6 +979,17 @@ int ext4_ind_map_blocks(handle_t *handle, struct inode *inode,
 				partial, flags);
 	if (err)
 		goto cleanup;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_MOW_GOAL
+	if (map->m_flags & EXT4_MAP_REMAP)
+		/* first data block, which becomes map->m_pblk below */
+		ext4_snapshot_mow_allocated(inode, map->m_lblk, goal,
+				le32_to_cpu(chain[depth-1].key));
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_PACKED
+	if (SNAPMAP_ISCOW(flags))
+		ext4_snapshot_cow_allocated(inode,
+				le32_to_cpu(chain[depth-1].key), count);
+#endif
 #else
 	err = ext4_alloc_branch(handle, inode, map->m_lblk, indirect_blks,
 				&count, goal,
@@ -976,6 +1014,15 @@ int ext4_ind_map_blocks(handle_t *handle, struct inode *inode,
 			goto cleanup;
 		}
 		ext4_snapshot_start_pending_cow(sbh);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_RANGE
+		/* multi-block COW - mark the rest of the new blocks pending */
+		pending = ext4_snapshot_start_pending_cow_range(inode->i_sb,
+				sbh->b_blocknr + 1, count - 1);
+		if (pending < count - 1) {
+			err = -EIO;
+			goto cleanup;
+		}
+#endif
 	}
 
 #endif
@@ -1037,8 +1084,13 @@ cleanup:
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW
 	/* cancel pending COW operation on failure to alloc snapshot block */
 	if (SNAPMAP_ISCOW(flags)) {
-		if (err < 0 && sbh)
+		if (err < 0 && sbh) {
 			ext4_snapshot_end_pending_cow(sbh);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_RANGE
+			ext4_snapshot_end_pending_cow_range(inode->i_sb,
+					sbh->b_blocknr + 1, pending);
+#endif
+		}
 		brelse(sbh);
 	}
 #endif
@@ -1053,6 +1105,176 @@ out:
 	return err;
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREALLOC
+/*
+ * ext4_snapshot_map_ind - allocate the indirect blocks on the path to
+ * @iblock of a snapshot file, without mapping @iblock itself.
+ * @goal:	in - preferred location of the new indirect blocks
+ *		out - the block after the indirect block that maps @iblock
+ *
+ * Returns the number of allocated indirect blocks or a negative error.
+ * Called from snapshot_create() under snapshot_mutex, before the snapshot
+ * is active, so there are no concurrent mappers of the snapshot file.
+ */
+int ext4_snapshot_map_ind(handle_t *handle, struct inode *inode,
+			  ext4_lblk_t iblock, ext4_fsblk_t *goal)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	ext4_lblk_t offsets[4];
+	Indirect chain[4];
+	Indirect *partial;
+	ext4_fsblk_t new_blocks[4];
+	struct buffer_head *bh;
+	int blocks_to_boundary = 0;
+	int depth, level, indirect_blks = 0;
+	int i, n = 0, err = 0;
+
+	depth = ext4_block_to_path(inode, iblock, offsets,
+				   &blocks_to_boundary);
+	if (depth < 2)
+		/* direct block - no indirect blocks to allocate */
+		return 0;
+
+	down_write(&ei->i_data_sem);
+	partial = ext4_get_branch(inode, depth, offsets, chain, &err);
+	if (err)
+		goto cleanup;
+	if (!partial || partial == chain + depth - 1) {
+		/* the indirect block that maps iblock is already allocated */
+		*goal = le32_to_cpu(chain[depth - 2].key) + 1;
+		partial = chain + depth - 1;
+		goto cleanup;
+	}
+
+	/* allocate the missing indirect blocks from partial down */
+	level = partial - chain;
+	indirect_blks = depth - 1 - level;
+	ext4_alloc_blocks(handle, inode, iblock, *goal, indirect_blks, 0,
+			  new_blocks, &err);
+	if (err)
+		goto cleanup;
+
+	for (n = 0; n < indirect_blks; n++) {
+		bh = sb_getblk(inode->i_sb, new_blocks[n]);
+		if (unlikely(!bh)) {
+			err = -EIO;
+			goto failed;
+		}
+		lock_buffer(bh);
+		err = ext4_journal_get_create_access(handle, bh);
+		if (err) {
+			unlock_buffer(bh);
+			brelse(bh);
+			goto failed;
+		}
+		memset(bh->b_data, 0, bh->b_size);
+		if (n + 1 < indirect_blks)
+			((__le32 *)bh->b_data)[offsets[level + n + 1]] =
+				cpu_to_le32(new_blocks[n + 1]);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		err = ext4_handle_dirty_metadata(handle, inode, bh);
+		brelse(bh);
+		if (err)
+			goto failed;
+	}
+
+	/* splice the new branch */
+	if (partial->bh) {
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_JBD
+		err = ext4_journal_get_write_access_inode(handle, inode,
+							   partial->bh);
+#else
+		err = ext4_journal_get_write_access(handle, partial->bh);
+#endif
+		if (err)
+			goto failed;
+	}
+	*partial->p = cpu_to_le32(new_blocks[0]);
+	if (partial->bh)
+		err = ext4_handle_dirty_metadata(handle, inode, partial->bh);
+	if (err)
+		goto cleanup;
+	*goal = new_blocks[indirect_blks - 1] + 1;
+	err = indirect_blks;
+	goto cleanup;
+
+failed:
+	/* free the new blocks, forgetting the ones we have journaled */
+	for (i = 0; i < indirect_blks; i++)
+		ext4_free_blocks(handle, inode, NULL, new_blocks[i], 1,
+				 i <= n ? EXT4_FREE_BLOCKS_FORGET : 0);
+cleanup:
+	up_write(&ei->i_data_sem);
+	while (partial > chain) {
+		brelse(partial->bh);
+		partial--;
+	}
+	if (err > 0) {
+		/* i_blocks and maybe i_data were changed */
+		n = ext4_mark_inode_dirty(handle, inode);
+		if (n)
+			err = n;
+	}
+	return err;
+}
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_DEDUP
+/*
+ * ext4_snapshot_set_leaf - replace the mapping of @iblock in a snapshot file
+ * @old:	expected current mapping of @iblock (0 for a hole)
+ * @new:	new mapping of @iblock (0 to punch a hole)
+ *
+ * Only the block pointer is changed.  Indirect blocks are not allocated or
+ * freed and block usage is not updated.
+ * Returns 1 if the mapping was replaced, 0 if @iblock is not mapped to @old
+ * or the indirect block that maps it is not allocated and <0 on error.
+ */
+int ext4_snapshot_set_leaf(handle_t *handle, struct inode *inode,
+			   ext4_lblk_t iblock, ext4_fsblk_t old,
+			   ext4_fsblk_t new)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	ext4_lblk_t offsets[4];
+	Indirect chain[4];
+	Indirect *partial, *leaf;
+	int depth, err = 0;
+
+	depth = ext4_block_to_path(inode, iblock, offsets, NULL);
+	if (depth < 2)
+		/* snapshot blocks are mapped by indirect blocks */
+		return 0;
+
+	leaf = chain + depth - 1;
+	down_write(&ei->i_data_sem);
+	partial = ext4_get_branch(inode, depth, offsets, chain, &err);
+	if (!partial)
+		partial = leaf;
+	if (err || partial != leaf)
+		/* no indirect block to hold the mapping */
+		goto cleanup;
+	if (le32_to_cpu(leaf->key) != old)
+		goto cleanup;
+
+	/* snapshot blocks are excluded - don't COW them */
+	err = ext4_journal_get_write_access_exclude(handle, leaf->bh);
+	if (err)
+		goto cleanup;
+	*leaf->p = cpu_to_le32(new);
+	err = ext4_handle_dirty_metadata(handle, inode, leaf->bh);
+	if (!err)
+		err = 1;
+cleanup:
+	up_write(&ei->i_data_sem);
+	while (partial > chain) {
+		brelse(partial->bh);
+		partial--;
+	}
+	return err;
+}
+
+#endif
 /*
  * O_DIRECT for ext3 (or indirect map) based files
  *
@@ -1609,6 +1831,150 @@ static void ext4_free_data(handle_t *handle, struct inode *inode,
 	}
 }
 
+#ifdef CONFIG_EXT4_FS_FREE_DATA_SORT
+/*
+ * Sort key of a data block pointer - the block number in the high 32 bits
+ * and the pointer index in the low 32 bits, so the sorted keys are in
+ * block order and still locate the pointer to clear.
+ */
+static int ext4_free_data_cmp(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * ext4_free_data_ordered - are the data blocks of an indirect block
+ * in block order?
+ */
+static int ext4_free_data_ordered(__le32 *first, __le32 *last)
+{
+	ext4_fsblk_t prev = 0, nr;
+	__le32 *p;
+
+	for (p = first; p < last; p++) {
+		nr = le32_to_cpu(*p);
+		if (!nr)
+			continue;
+		if (nr < prev)
+			return 0;
+		prev = nr;
+	}
+	return 1;
+}
+
+/*
+ * ext4_free_data_sorted - free the data blocks of an indirect block in
+ * block order
+ *
+ * The data blocks of a fragmented file, and the blocks of a snapshot file,
+ * which are copies allocated when the blocks were COWed, are scattered, so
+ * ext4_free_data() finds few contiguous runs in logical order and every
+ * run updates the bitmap, buddy and descriptor of another group.
+ * Sort the pointers by block number and free contiguous runs, so the runs
+ * in a group are freed one after the other, while the group's bitmap and
+ * buddy are hot and already journaled in the running transaction.
+ * Like ext4_clear_blocks(), the pointers of a run are cleared in the
+ * transaction that frees the run.
+ * Indirect blocks that are already in block order, and allocation
+ * failure of the sort array, fall back to ext4_free_data().
+ */
+static void ext4_free_data_sorted(handle_t *handle, struct inode *inode,
+				  struct buffer_head *this_bh,
+				  __le32 *first, __le32 *last)
+{
+	int flags = EXT4_FREE_BLOCKS_FORGET | EXT4_FREE_BLOCKS_VALIDATED;
+	ext4_fsblk_t block_to_free = 0, nr;
+	unsigned long count = 0;
+	int i, j, n = 0, start = 0, err;
+	u64 *keys = NULL;
+
+	if (!ext4_free_data_ordered(first, last))
+		keys = kmalloc((last - first) * sizeof(*keys), GFP_NOFS);
+	if (!keys) {
+		ext4_free_data(handle, inode, this_bh, first, last);
+		return;
+	}
+	for (i = 0; i < last - first; i++)
+		if (first[i])
+			keys[n++] = (u64)le32_to_cpu(first[i]) << 32 | i;
+	sort(keys, n, sizeof(*keys), ext4_free_data_cmp, NULL);
+
+	if (S_ISDIR(inode->i_mode) || S_ISLNK(inode->i_mode))
+		flags |= EXT4_FREE_BLOCKS_METADATA;
+
+	BUFFER_TRACE(this_bh, "get_write_access");
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_JBD
+	err = ext4_journal_get_write_access_inode(handle, inode, this_bh);
+#else
+	err = ext4_journal_get_write_access(handle, this_bh);
+#endif
+	if (err)
+		goto out;
+
+	for (i = 0; i <= n; i++) {
+		nr = i < n ? keys[i] >> 32 : 0;
+		if (count && nr == block_to_free + count) {
+			count++;
+			continue;
+		}
+		if (count) {
+			if (!ext4_data_block_valid(EXT4_SB(inode->i_sb),
+						   block_to_free, count)) {
+				EXT4_ERROR_INODE(inode, "attempt to clear "
+						 "invalid blocks %llu len %lu",
+					(unsigned long long) block_to_free,
+					count);
+				goto out_dirty;
+			}
+			if (try_to_extend_transaction(handle, inode)) {
+				err = ext4_handle_dirty_metadata(handle, inode,
+								 this_bh);
+				if (!err)
+					err = ext4_mark_inode_dirty(handle,
+								    inode);
+				if (!err)
+					err = ext4_truncate_restart_trans(
+						handle, inode,
+						ext4_blocks_for_truncate(inode));
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_JBD
+				if (!err)
+					err = ext4_journal_get_write_access_inode(
+						handle, inode, this_bh);
+#else
+				if (!err)
+					err = ext4_journal_get_write_access(
+						handle, this_bh);
+#endif
+				if (err) {
+					ext4_std_error(inode->i_sb, err);
+					goto out;
+				}
+			}
+			for (j = start; j < i; j++)
+				first[(u32)keys[j]] = 0;
+			ext4_free_blocks(handle, inode, NULL, block_to_free,
+					 count, flags);
+		}
+		block_to_free = nr;
+		start = i;
+		count = 1;
+	}
+out_dirty:
+	BUFFER_TRACE(this_bh, "call ext4_handle_dirty_metadata");
+	if ((EXT4_JOURNAL(inode) == NULL) || bh2jh(this_bh))
+		ext4_handle_dirty_metadata(handle, inode, this_bh);
+	else
+		EXT4_ERROR_INODE(inode,
+				 "circular indirect block detected at "
+				 "block %llu",
+				 (unsigned long long) this_bh->b_blocknr);
+out:
+	kfree(keys);
+}
+
+#endif
 /**
  *	ext4_free_branches - free an array of branches
  *	@handle: JBD handle for this transaction
@@ -1741,6 +2107,12 @@ static void ext4_free_branches(handle_t *handle, struct inode *inode,
 	} else {
 		/* We have reached the bottom of the tree. */
 		BUFFER_TRACE(parent_bh, "free data blocks");
+#ifdef CONFIG_EXT4_FS_FREE_DATA_SORT
+		if (parent_bh)
+			ext4_free_data_sorted(handle, inode, parent_bh,
+					      first, last);
+		else
+#endif
 		ext4_free_data(handle, inode, parent_bh, first, last);
 	}
 }
@@ -40,6 +40,7 @@
 #include <linux/printk.h>
 #include <linux/slab.h>
 #include <linux/ratelimit.h>
+#include <linux/sort.h>
 
 #include "ext4_jbd2.h"
 #include "xattr.h"
@@ -129,6 +130,47 @@ int ext4_truncate_restart_trans(handle_t *handle, struct inode *inode,
 	return ret;
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE_ASYNC
+/*
+ * Called from the deferred delete worker, with a reference on an unlinked
+ * inode, whose last iput() was deferred by ext4_drop_inode().
+ * Free the file blocks from the end, @step blocks per truncate call, so
+ * that moving the blocks to snapshot is done in many short transactions
+ * instead of one long truncate in ext4_evict_inode().
+ * The inode stays on the orphan list, because its i_nlink is zero, and
+ * the final iput() deletes the (now empty) inode.
+ */
+void ext4_reap_inode(struct inode *inode, unsigned int step)
+{
+	struct super_block *sb = inode->i_sb;
+	loff_t bytes = (loff_t)step << inode->i_blkbits;
+	loff_t size;
+
+	mutex_lock(&inode->i_mutex);
+	if (inode->i_nlink || is_bad_inode(inode))
+		goto out;
+
+	dquot_initialize(inode);
+	if (ext4_should_order_data(inode))
+		ext4_begin_ordered_truncate(inode, 0);
+	truncate_inode_pages(&inode->i_data, 0);
+
+	while (inode->i_size > 0 && !(sb->s_flags & MS_RDONLY)) {
+		size = inode->i_size > bytes ? inode->i_size - bytes : 0;
+		/* keep the intermediate sizes block aligned */
+		size = round_down(size, 1 << inode->i_blkbits);
+		i_size_write(inode, size);
+		ext4_truncate(inode);
+		if (EXT4_I(inode)->i_disksize != size)
+			/* truncate failed - leave the rest to evict */
+			break;
+		cond_resched();
+	}
+out:
+	mutex_unlock(&inode->i_mutex);
+}
+
+#endif
 /*
  * Called at the last iput() if i_nlink is zero.
  */
@@ -444,6 +486,10 @@ int ext4_map_blocks(handle_t *handle, struct inode *inode,
 	int retval;
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW
 	int cowing = 0;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS_LOCK
+	u64 acquired = 0;
+	int contended = 0;
+#endif
 
 	if (handle && IS_COWING(handle)) {
 		/*
@@ -472,6 +518,13 @@ int ext4_map_blocks(handle_t *handle, struct inode *inode,
 	down_read_nested((&EXT4_I(inode)->i_data_sem), cowing);
 #else
 	down_read((&EXT4_I(inode)->i_data_sem));
+#endif
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+	if (ext4_has_inline_data(inode)) {
+		/* i_block holds data - no blocks to map */
+		up_read((&EXT4_I(inode)->i_data_sem));
+		return (flags & EXT4_GET_BLOCKS_CREATE) ? -EIO : 0;
+	}
 #endif
 	if (ext4_test_inode_flag(inode, EXT4_INODE_EXTENTS)) {
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT
@@ -497,8 +550,14 @@ int ext4_map_blocks(handle_t *handle, struct inode *inode,
 	}
 
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DIO
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DIO_MOW
+	if (retval > 0 && (map->m_flags & EXT4_MAP_REMAP) &&
+	    (flags & EXT4_GET_BLOCKS_PRE_IO) &&
+	    !(flags & EXT4_GET_BLOCKS_MOVE_DIO)) {
+#else
 	if (retval > 0 && (map->m_flags & EXT4_MAP_REMAP) &&
 	    (flags & EXT4_GET_BLOCKS_PRE_IO)) {
+#endif
 		/*
 		 * If mow is needed on the requested block and
 		 * request comes from async-direct-io-write path,
@@ -546,7 +605,19 @@ int ext4_map_blocks(handle_t *handle, struct inode *inode,
 	 * with create == 1 flag.
 	 */
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS_LOCK
+	if (cowing) {
+		contended = rwsem_is_locked(&EXT4_I(inode)->i_data_sem);
+		acquired = local_clock();
+	}
 	down_write_nested((&EXT4_I(inode)->i_data_sem), cowing);
+	if (cowing)
+		acquired = ext4_snapshot_stats_lock_wait(inode->i_sb,
+				EXT4_SNAPSHOT_LOCK_DATA_SEM, acquired,
+				contended);
+#else
+	down_write_nested((&EXT4_I(inode)->i_data_sem), cowing);
+#endif
 #else
 	down_write((&EXT4_I(inode)->i_data_sem));
 #endif
@@ -590,6 +661,11 @@ int ext4_map_blocks(handle_t *handle, struct inode *inode,
 	if (flags & EXT4_GET_BLOCKS_DELALLOC_RESERVE)
 		ext4_clear_inode_state(inode, EXT4_STATE_DELALLOC_RESERVED);
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS_LOCK
+	if (cowing)
+		ext4_snapshot_stats_lock_hold(inode->i_sb,
+				EXT4_SNAPSHOT_LOCK_DATA_SEM, acquired);
+#endif
 	up_write((&EXT4_I(inode)->i_data_sem));
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA
 	/* Clear EXT4_MAP_REMAP, it is not needed any more. */
@@ -711,7 +787,12 @@ int ext4_get_block_mow(struct inode *inode, sector_t iblock,
 {
 	int flags = create ? EXT4_GET_BLOCKS_CREATE : 0;
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_NEW_BLOCKS
+	if (ext4_snapshot_should_move_blocks(inode, iblock,
+					     bh->b_size >> inode->i_blkbits))
+#else
 	if (ext4_snapshot_should_move_data(inode))
+#endif
 		flags |= EXT4_GET_BLOCKS_MOVE_ON_WRITE;
 	return _ext4_get_block(inode, iblock, bh, flags);
 }
@@ -735,7 +816,12 @@ int ext4_get_block_dio_write(struct inode *inode, sector_t iblock,
 	 * ext4_map_blocks() will return an unmapped buffer if block
 	 * is not allocated or if it needs to be moved to snapshot.
 	 */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_NEW_BLOCKS
+	if (ext4_snapshot_should_move_blocks(inode, iblock,
+					     bh->b_size >> inode->i_blkbits))
+#else
 	if (ext4_snapshot_should_move_data(inode))
+#endif
 		flags |= EXT4_GET_BLOCKS_MOVE_ON_WRITE|
 			EXT4_GET_BLOCKS_PRE_IO;
 
@@ -779,7 +865,15 @@ struct buffer_head *ext4_getblk(handle_t *handle, struct inode *inode,
 		return NULL;
 	*errp = 0;
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_NUMA
+	if (SNAPMAP_ISCOW(create) && (map.m_flags & EXT4_MAP_NEW))
+		/* COW copy is written right away by this CPU */
+		bh = ext4_snapshot_getblk_local(inode->i_sb, map.m_pblk);
+	else
+		bh = sb_getblk(inode->i_sb, map.m_pblk);
+#else
 	bh = sb_getblk(inode->i_sb, map.m_pblk);
+#endif
 	if (!bh) {
 		*errp = -EIO;
 		return NULL;
@@ -921,12 +1015,30 @@ static int do_journal_get_write_access(handle_t *handle,
 	 */
 	if (dirty)
 		clear_buffer_dirty(bh);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_DATA
+	/* COW the data block on behalf of its owner, unless excluded */
+	ret = ext4_journal_get_write_access_inode(handle,
+						  bh->b_page->mapping->host, bh);
+#else
 	ret = ext4_journal_get_write_access(handle, bh);
+#endif
 	if (!ret && dirty)
 		ret = ext4_handle_dirty_metadata(handle, NULL, bh);
 	return ret;
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_NEW_BLOCKS
+/* check if the blocks of @page should be moved-on-write */
+static inline int ext4_snapshot_should_move_page(struct inode *inode,
+						 struct page *page)
+{
+	return ext4_snapshot_should_move_blocks(inode,
+			(ext4_lblk_t)page->index <<
+			(PAGE_CACHE_SHIFT - inode->i_blkbits),
+			PAGE_CACHE_SIZE >> inode->i_blkbits);
+}
+
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA
 /*
  * Prepare for snapshot.
@@ -944,9 +1056,15 @@ static void ext4_snapshot_write_begin(struct inode *inode,
 	 * guarantee this we have to know that the transaction is not restarted.
 	 * Can we count on that?
 	 */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_NEW_BLOCKS
+	if (!EXT4_SNAPSHOTS(inode->i_sb) ||
+	    !ext4_snapshot_should_move_page(inode, page))
+		return;
+#else
 	if (!EXT4_SNAPSHOTS(inode->i_sb) ||
 	    !ext4_snapshot_should_move_data(inode))
 		return;
+#endif
 
 	if (!page_has_buffers(page))
 		create_empty_buffers(page, inode->i_sb->s_blocksize, 0);
@@ -959,6 +1077,15 @@ static void ext4_snapshot_write_begin(struct inode *inode,
 	 * data buffers are flushed on snapshot take via freeze_fs()
 	 * API.
 	 */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_WRITEBACK
+	/*
+	 * A dirty remap buffer is already reserved and will be handled by
+	 * the move-on-write of its extent at writeback, so don't map it
+	 * again (and reserve another block for it) on every overwrite.
+	 */
+	if (delay && buffer_remap(bh))
+		return;
+#endif
 	if (!buffer_jbd(bh) && !buffer_delay(bh)) {
 		clear_buffer_mapped(bh);
 		/* explicitly request move-on-write */
@@ -968,9 +1095,258 @@ static void ext4_snapshot_write_begin(struct inode *inode,
 	}
 }
 
+#endif
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+/*
+ * Inline data: the data of a tiny regular file is stored in i_block
+ * instead of in a data block, so a rewrite only journals (and COWs) the
+ * inode table block.  Page 0 is the only page of an inline file and it is
+ * never dirtied, so the inline data is never written back through the
+ * block mapping.  The inline flag is only changed under the lock of page 0.
+ */
+static int write_end_fn(handle_t *handle, struct buffer_head *bh);
+
+static void ext4_read_inline_page(struct inode *inode, struct page *page)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	void *kaddr;
+
+	BUG_ON(!PageLocked(page));
+	if (page->index) {
+		/* beyond end of file */
+		zero_user(page, 0, PAGE_CACHE_SIZE);
+		SetPageUptodate(page);
+		return;
+	}
+	kaddr = kmap(page);
+	down_read(&ei->i_data_sem);
+	memcpy(kaddr, ei->i_data, EXT4_MIN_INLINE_DATA_SIZE);
+	up_read(&ei->i_data_sem);
+	memset(kaddr + EXT4_MIN_INLINE_DATA_SIZE, 0,
+	       PAGE_CACHE_SIZE - EXT4_MIN_INLINE_DATA_SIZE);
+	flush_dcache_page(page);
+	kunmap(page);
+	SetPageUptodate(page);
+}
+
+/*
+ * Move the inline data of @inode to a data block.  Called before the file
+ * grows beyond i_block, is mapped for write or is preallocated.
+ */
+int ext4_convert_inline_data(struct inode *inode)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct address_space *mapping = inode->i_mapping;
+	unsigned size;
+	handle_t *handle;
+	struct page *page;
+	void *kaddr;
+	int ret = 0, ret2;
+
+	if (!ext4_has_inline_data(inode))
+		return 0;
+
+	handle = ext4_journal_start(inode,
+				    ext4_writepage_trans_blocks(inode) + 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	page = grab_cache_page_write_begin(mapping, 0, AOP_FLAG_NOFS);
+	if (!page) {
+		ext4_journal_stop(handle);
+		return -ENOMEM;
+	}
+	/* recheck under page lock */
+	if (!ext4_has_inline_data(inode))
+		goto out;
+	if (!PageUptodate(page))
+		ext4_read_inline_page(inode, page);
+	size = inode->i_size;
+
+	down_write(&ei->i_data_sem);
+	memset(ei->i_data, 0, sizeof(ei->i_data));
+	ext4_clear_inode_flag(inode, EXT4_INODE_IBLOCK_DATA);
+	up_write(&ei->i_data_sem);
+	if (EXT4_HAS_INCOMPAT_FEATURE(inode->i_sb,
+				      EXT4_FEATURE_INCOMPAT_EXTENTS)) {
+		ext4_ext_tree_init(handle, inode);
+		ext4_set_inode_flag(inode, EXT4_INODE_EXTENTS);
+	}
+
+	/*
+	 * Allocate the block now rather than delay it, so i_disksize never
+	 * covers data that is not yet mapped.
+	 */
+	if (size)
+		ret = __block_write_begin(page, 0, size, ext4_get_block);
+	if (!ret && size && ext4_should_journal_data(inode))
+		ret = walk_page_buffers(handle, page_buffers(page), 0, size,
+					NULL, do_journal_get_write_access);
+	if (ret) {
+		/* back to inline - nothing was allocated */
+		kaddr = kmap(page);
+		down_write(&ei->i_data_sem);
+		memcpy(ei->i_data, kaddr, EXT4_MIN_INLINE_DATA_SIZE);
+		ext4_clear_inode_flag(inode, EXT4_INODE_EXTENTS);
+		ext4_set_inode_flag(inode, EXT4_INODE_IBLOCK_DATA);
+		up_write(&ei->i_data_sem);
+		kunmap(page);
+		if (page_has_buffers(page))
+			block_invalidatepage(page, 0);
+		goto out;
+	}
+
+	if (size && ext4_should_journal_data(inode)) {
+		ret = walk_page_buffers(handle, page_buffers(page), 0, size,
+					NULL, write_end_fn);
+		ext4_set_inode_state(inode, EXT4_STATE_JDATA);
+	} else if (size) {
+		if (ext4_should_order_data(inode))
+			ret = ext4_jbd2_file_inode(handle, inode);
+		block_commit_write(page, 0, size);
+	}
+	ext4_update_inode_fsync_trans(handle, inode, 1);
+	ret2 = ext4_mark_inode_dirty(handle, inode);
+	if (!ret)
+		ret = ret2;
+out:
+	unlock_page(page);
+	page_cache_release(page);
+	ret2 = ext4_journal_stop(handle);
+	return ret ? ret : ret2;
+}
+
+/*
+ * Returns 0 with page 0 locked and a handle started if the write goes to
+ * the inline data, 1 if the write should take the block mapped path, or a
+ * negative error.  An empty new file becomes inline on its first write.
+ */
+static int ext4_inline_write_begin(struct address_space *mapping,
+				   loff_t pos, unsigned len, unsigned flags,
+				   struct page **pagep)
+{
+	struct inode *inode = mapping->host;
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	handle_t *handle;
+	struct page *page;
+	int ret;
+
+	if (!ext4_has_inline_data(inode) &&
+	    !ext4_test_inode_state(inode, EXT4_STATE_MAY_INLINE_DATA))
+		return 1;
+
+	if (pos + len > EXT4_MIN_INLINE_DATA_SIZE) {
+		ext4_clear_inode_state(inode, EXT4_STATE_MAY_INLINE_DATA);
+		ret = ext4_convert_inline_data(inode);
+		return ret ? ret : 1;
+	}
+
+	handle = ext4_journal_start(inode, 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	page = grab_cache_page_write_begin(mapping, 0, flags | AOP_FLAG_NOFS);
+	if (!page) {
+		ext4_journal_stop(handle);
+		return -ENOMEM;
+	}
+
+	if (!ext4_has_inline_data(inode)) {
+		ret = 1;
+		if (!ext4_test_inode_state(inode, EXT4_STATE_MAY_INLINE_DATA))
+			goto out;
+		ext4_clear_inode_state(inode, EXT4_STATE_MAY_INLINE_DATA);
+		if (inode->i_size || inode->i_blocks ||
+		    ei->i_reserved_data_blocks || page_has_buffers(page))
+			goto out;
+
+		down_write(&ei->i_data_sem);
+		memset(ei->i_data, 0, sizeof(ei->i_data));
+		ext4_clear_inode_flag(inode, EXT4_INODE_EXTENTS);
+		ext4_set_inode_flag(inode, EXT4_INODE_IBLOCK_DATA);
+		up_write(&ei->i_data_sem);
+		ret = ext4_mark_inode_dirty(handle, inode);
+		if (ret)
+			goto out;
+	}
+
+	if (!PageUptodate(page))
+		ext4_read_inline_page(inode, page);
+	*pagep = page;
+	return 0;
+out:
+	unlock_page(page);
+	page_cache_release(page);
+	ext4_journal_stop(handle);
+	return ret;
+}
+
+/*
+ * Copy the written range of page 0 to i_block.  Completes all variants of
+ * write_end() for an inline file.
+ */
+static int ext4_inline_write_end(struct inode *inode, loff_t pos,
+				 unsigned copied, struct page *page)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	handle_t *handle = ext4_journal_current_handle();
+	void *kaddr;
+	int ret, ret2;
+
+	kaddr = kmap(page);
+	down_write(&ei->i_data_sem);
+	memcpy((char *)ei->i_data + pos, kaddr + pos, copied);
+	up_write(&ei->i_data_sem);
+	kunmap(page);
+
+	if (pos + copied > inode->i_size)
+		i_size_write(inode, pos + copied);
+	ext4_update_i_disksize(inode, inode->i_size);
+	unlock_page(page);
+	page_cache_release(page);
+
+	ext4_update_inode_fsync_trans(handle, inode, 1);
+	ret = ext4_mark_inode_dirty(handle, inode);
+	ret2 = ext4_journal_stop(handle);
+	if (!ret)
+		ret = ret2;
+	return ret ? ret : copied;
+}
+
+static void ext4_inline_truncate(struct inode *inode)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	handle_t *handle;
+
+	handle = ext4_journal_start(inode, 3);
+	if (IS_ERR(handle)) {
+		ext4_std_error(inode->i_sb, PTR_ERR(handle));
+		return;
+	}
+
+	/* keep the tail of i_block zeroed for extending writes */
+	down_write(&ei->i_data_sem);
+	if (inode->i_size < EXT4_MIN_INLINE_DATA_SIZE)
+		memset((char *)ei->i_data + inode->i_size, 0,
+		       EXT4_MIN_INLINE_DATA_SIZE - inode->i_size);
+	ei->i_disksize = inode->i_size;
+	up_write(&ei->i_data_sem);
+	ext4_mark_inode_dirty(handle, inode);
+
+	if (IS_SYNC(inode))
+		ext4_handle_sync(handle);
+	if (inode->i_nlink)
+		ext4_orphan_del(handle, inode);
+	ext4_journal_stop(handle);
+}
+
 #endif
 static int ext4_get_block_write(struct inode *inode, sector_t iblock,
 		   struct buffer_head *bh_result, int create);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DIO_MOW
+static int ext4_get_block_write_mow(struct inode *inode, sector_t iblock,
+		   struct buffer_head *bh_result, int create);
+#endif
 static int ext4_write_begin(struct file *file, struct address_space *mapping,
 			    loff_t pos, unsigned len, unsigned flags,
 			    struct page **pagep, void **fsdata)
@@ -984,6 +1360,11 @@ static int ext4_write_begin(struct file *file, struct address_space *mapping,
 	unsigned from, to;
 
 	trace_ext4_write_begin(inode, pos, len, flags);
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+	ret = ext4_inline_write_begin(mapping, pos, len, flags, pagep);
+	if (ret <= 0)
+		return ret;
+#endif
 	/*
 	 * Reserve one block more for addition to orphan list in case
 	 * we allocate blocks but write fails for some reason
@@ -994,6 +1375,14 @@ static int ext4_write_begin(struct file *file, struct address_space *mapping,
 	to = from + len;
 
 retry:
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_DATA
+	if (ext4_should_journal_data(inode) &&
+	    !ext4_snapshot_has_free_blocks(inode->i_sb,
+			PAGE_CACHE_SIZE >> inode->i_blkbits)) {
+		ret = -ENOSPC;
+		goto out_nospc;
+	}
+#endif
 	handle = ext4_journal_start(inode, needed_blocks);
 	if (IS_ERR(handle)) {
 		ret = PTR_ERR(handle);
@@ -1011,12 +1400,40 @@ retry:
 		goto out;
 	}
 	*pagep = page;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_PARTIAL
+	/*
+	 * A write from the start of the page up to or beyond end of file
+	 * leaves no existing data in the block to preserve. The block can
+	 * be moved to snapshot without reading it first, and the new block
+	 * is zeroed out beyond the written range in block_write_begin().
+	 */
+	if (from == 0 && pos + len >= i_size_read(inode))
+		ext4_snapshot_write_begin(inode, page, PAGE_CACHE_SIZE, 0);
+	else
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA
 	ext4_snapshot_write_begin(inode, page, len, 0);
 #endif
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DIO_MOW
+	/*
+	 * Partial blocks are read in before moving them to snapshot,
+	 * so buffered write can always do move-on-write to uninitialized
+	 * extents and never needs to fall back.
+	 */
+	if (ext4_should_dioread_nolock(inode))
+		ret = __block_write_begin(page, pos, len,
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_NEW_BLOCKS
+				ext4_snapshot_should_move_page(inode, page) ?
+#else
+				ext4_snapshot_should_move_data(inode) ?
+#endif
+				ext4_get_block_write_mow :
+				ext4_get_block_write);
+#else
 	if (ext4_should_dioread_nolock(inode))
 		ret = __block_write_begin(page, pos, len, ext4_get_block_write);
+#endif
 	else
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA
 		ret = __block_write_begin(page, pos, len, ext4_get_block_mow);
@@ -1057,6 +1474,9 @@ retry:
 		}
 	}
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_DATA
+out_nospc:
+#endif
 	if (ret == -ENOSPC && ext4_should_retry_alloc(inode->i_sb, &retries))
 		goto retry;
 out:
@@ -1135,6 +1555,10 @@ static int ext4_ordered_write_end(struct file *file,
 	int ret = 0, ret2;
 
 	trace_ext4_ordered_write_end(inode, pos, len, copied);
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+	if (ext4_has_inline_data(inode))
+		return ext4_inline_write_end(inode, pos, copied, page);
+#endif
 	ret = ext4_jbd2_file_inode(handle, inode);
 
 	if (ret == 0) {
@@ -1179,6 +1603,10 @@ static int ext4_writeback_write_end(struct file *file,
 	int ret = 0, ret2;
 
 	trace_ext4_writeback_write_end(inode, pos, len, copied);
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+	if (ext4_has_inline_data(inode))
+		return ext4_inline_write_end(inode, pos, copied, page);
+#endif
 	ret2 = ext4_generic_write_end(file, mapping, pos, len, copied,
 							page, fsdata);
 	copied = ret2;
@@ -1223,6 +1651,10 @@ static int ext4_journalled_write_end(struct file *file,
 	loff_t new_i_size;
 
 	trace_ext4_journalled_write_end(inode, pos, len, copied);
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+	if (ext4_has_inline_data(inode))
+		return ext4_inline_write_end(inode, pos, copied, page);
+#endif
 	from = pos & (PAGE_CACHE_SIZE - 1);
 	to = from + len;
 
@@ -1389,6 +1821,13 @@ static void ext4_da_page_release_reservation(struct page *page,
 			to_release++;
 			clear_buffer_delay(bh);
 		}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_DEFER
+		/* block reserved for a deferred move-on-write */
+		if ((offset <= curr_off) && buffer_remap(bh)) {
+			to_release++;
+			clear_buffer_remap(bh);
+		}
+#endif
 		curr_off = next_off;
 	} while ((bh = bh->b_this_page) != head);
 	ext4_da_release_space(page->mapping->host, to_release);
@@ -1665,6 +2104,9 @@ static void mpage_da_map_and_submit(struct mpage_da_data *mpd)
 	 * EXT4_GET_BLOCKS_DELALLOC_RESERVE so the delalloc accounting
 	 * variables are updated after the blocks have been allocated.
 	 */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_WRITEBACK
+map_next:
+#endif
 	map.m_lblk = next;
 	map.m_len = max_blocks;
 	get_blocks_flags = EXT4_GET_BLOCKS_CREATE;
@@ -1725,6 +2167,18 @@ static void mpage_da_map_and_submit(struct mpage_da_data *mpd)
 	}
 	BUG_ON(blks == 0);
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_DEFER
+	/*
+	 * The move-on-write decision was deferred from write_begin time and
+	 * a block was reserved for every overwritten block. If the blocks
+	 * did not need to be moved to snapshot, nothing was allocated, so
+	 * give back the reservation.
+	 */
+	if ((mpd->b_state & (1 << BH_Remap)) &&
+	    !(map.m_flags & EXT4_MAP_NEW))
+		ext4_da_release_space(mpd->inode, blks);
+
+#endif
 	mapp = &map;
 	if (map.m_flags & EXT4_MAP_NEW) {
 		struct block_device *bdev = mpd->inode->i_sb->s_bdev;
@@ -1757,6 +2211,37 @@ static void mpage_da_map_and_submit(struct mpage_da_data *mpd)
 	}
 
 submit_io:
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_WRITEBACK
+	/*
+	 * A remap extent may be mapped in several parts, because the
+	 * snapshot decides move-on-write for a run of blocks at a time.
+	 * Instead of leaving the rest of the extent to the next writeback
+	 * pass, submit the pages of the mapped part and go on mapping the
+	 * rest of the extent, while the pages are still locked.
+	 */
+	if (mapp && blks < max_blocks &&
+	    (mpd->b_state & (1 << BH_Remap)) &&
+	    mpd->inode->i_blkbits == PAGE_CACHE_SHIFT) {
+		unsigned long next_page = mpd->next_page;
+		int credits = ext4_chunk_trans_blocks(mpd->inode,
+						      max_blocks - blks);
+
+		if (!ext4_handle_has_enough_credits(handle, credits) &&
+		    ext4_journal_extend(handle, credits))
+			goto submit_all;
+		mpd->next_page = next + blks;
+		mpage_da_submit_io(mpd, mapp);
+		mpd->first_page = mpd->next_page;
+		mpd->next_page = next_page;
+		next += blks;
+		max_blocks -= blks;
+		mpd->b_blocknr = next;
+		mpd->b_size = (size_t)max_blocks << mpd->inode->i_blkbits;
+		mapp = NULL;
+		goto map_next;
+	}
+submit_all:
+#endif
 	mpage_da_submit_io(mpd, mapp);
 	mpd->io_done = 1;
 }
@@ -1890,8 +2375,13 @@ static int ext4_da_get_block_prep(struct inode *inode, sector_t iblock,
 	map.m_lblk = iblock;
 	map.m_len = 1;
 
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA
+#if defined(CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA) && \
+	!defined(CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_DEFER)
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_NEW_BLOCKS
+	if (ext4_snapshot_should_move_blocks(inode, iblock, 1))
+#else
 	if (ext4_snapshot_should_move_data(inode))
+#endif
 		flags |= EXT4_GET_BLOCKS_MOVE_ON_WRITE;
 
 #endif
@@ -1924,6 +2414,24 @@ static int ext4_da_get_block_prep(struct inode *inode, sector_t iblock,
 		return 0;
 	}
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_DEFER
+	/*
+	 * Do not ask the snapshot whether the block should be moved here,
+	 * in the write syscall path. Assume that it does, reserve a block
+	 * for it and mark it for remap, so writeback will make the decision
+	 * once for the entire extent in mpage_da_map_and_submit().
+	 * A buffer which is redirtied before writeback is already mapped, so
+	 * we are not called again for it.
+	 */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_NEW_BLOCKS
+	if (ext4_snapshot_should_move_blocks(inode, iblock, 1) &&
+	    !(map.m_flags & EXT4_MAP_UNWRITTEN))
+#else
+	if (ext4_snapshot_should_move_data(inode) &&
+	    !(map.m_flags & EXT4_MAP_UNWRITTEN))
+#endif
+		map.m_flags |= EXT4_MAP_REMAP;
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA
 	if (map.m_flags & EXT4_MAP_REMAP) {
 		ret = ext4_da_reserve_space(inode, iblock);
@@ -2562,6 +3070,12 @@ static int ext4_da_write_begin(struct file *file, struct address_space *mapping,
 
 	index = pos >> PAGE_CACHE_SHIFT;
 
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+	*fsdata = (void *)0;
+	ret = ext4_inline_write_begin(mapping, pos, len, flags, pagep);
+	if (ret <= 0)
+		return ret;
+#endif
 	if (ext4_nonda_switch(inode->i_sb)) {
 		*fsdata = (void *)FALL_BACK_TO_NONDELALLOC;
 		return ext4_write_begin(file, mapping, pos,
@@ -2664,6 +3178,10 @@ static int ext4_da_write_end(struct file *file,
 	}
 
 	trace_ext4_da_write_end(inode, pos, len, copied);
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+	if (ext4_has_inline_data(inode))
+		return ext4_inline_write_end(inode, pos, copied, page);
+#endif
 	start = pos & (PAGE_CACHE_SIZE - 1);
 	end = start + copied - 1;
 
@@ -2836,6 +3354,13 @@ static sector_t ext4_bmap(struct address_space *mapping, sector_t block)
 static int ext4_readpage(struct file *file, struct page *page)
 {
 	trace_ext4_readpage(page);
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+	if (ext4_has_inline_data(page->mapping->host)) {
+		ext4_read_inline_page(page->mapping->host, page);
+		unlock_page(page);
+		return 0;
+	}
+#endif
 	return mpage_readpage(page, ext4_get_block);
 }
 
@@ -2843,6 +3368,11 @@ static int
 ext4_readpages(struct file *file, struct address_space *mapping,
 		struct list_head *pages, unsigned nr_pages)
 {
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+	/* leave page 0 to ext4_readpage() */
+	if (ext4_has_inline_data(mapping->host))
+		return 0;
+#endif
 	return mpage_readpages(mapping, pages, nr_pages, ext4_get_block);
 }
 
@@ -2918,7 +3448,13 @@ static int ext4_get_block_write(struct inode *inode, sector_t iblock,
 
 	ext4_debug("ext4_get_block_write: inode %lu, create flag %d\n",
 		   inode->i_ino, create);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_NEW_BLOCKS
+	/* converting unwritten extents allocated after snapshot take */
+	if (ext4_snapshot_should_move_blocks(inode, iblock,
+				bh_result->b_size >> inode->i_blkbits))
+#else
 	if (ext4_snapshot_should_move_data(inode))
+#endif
 		flags |= EXT4_GET_BLOCKS_MOVE_ON_WRITE;
 	return _ext4_get_block(inode, iblock, bh_result, flags);
 #else
@@ -2929,6 +3465,25 @@ static int ext4_get_block_write(struct inode *inode, sector_t iblock,
 #endif
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DIO_MOW
+/*
+ * ext4_get_block_write_mow used when preparing for a block aligned DIO write.
+ * Blocks that need to be moved to snapshot are replaced with new blocks,
+ * which are mapped as an uninitialized extent, just like holes are.
+ * The extent will be converted to initialized after the IO is complete.
+ */
+static int ext4_get_block_write_mow(struct inode *inode, sector_t iblock,
+		   struct buffer_head *bh_result, int create)
+{
+	ext4_debug("ext4_get_block_write_mow: inode %lu, create flag %d\n",
+		   inode->i_ino, create);
+	return _ext4_get_block(inode, iblock, bh_result,
+			       EXT4_GET_BLOCKS_IO_CREATE_EXT |
+			       EXT4_GET_BLOCKS_MOVE_ON_WRITE |
+			       EXT4_GET_BLOCKS_MOVE_DIO);
+}
+#endif
+
 static void ext4_end_io_dio(struct kiocb *iocb, loff_t offset,
 			    ssize_t size, void *private, int ret,
 			    bool is_async)
@@ -3079,9 +3634,30 @@ static ssize_t ext4_ext_direct_IO(int rw, struct kiocb *iocb,
 	struct inode *inode = file->f_mapping->host;
 	ssize_t ret;
 	size_t count = iov_length(iov, nr_segs);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DIO_MOW
+	get_block_t *get_block = ext4_get_block_write;
+#endif
 
 	loff_t final_size = offset + count;
 	if (rw == WRITE && final_size <= inode->i_size) {
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DIO_MOW
+		/*
+		 * Blocks moved to snapshot are replaced with new blocks, so
+		 * a partial block write would zero the rest of the old data.
+		 * Only block aligned writes do move-on-write inline, others
+		 * fall back to buffered I/O for blocks that need to be moved.
+		 */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_NEW_BLOCKS
+		if (ext4_snapshot_should_move_blocks(inode,
+				offset >> inode->i_blkbits,
+				(count + inode->i_sb->s_blocksize - 1) >>
+				inode->i_blkbits) &&
+#else
+		if (ext4_snapshot_should_move_data(inode) &&
+#endif
+		    !((offset | count) & (inode->i_sb->s_blocksize - 1)))
+			get_block = ext4_get_block_write_mow;
+#endif
 		/*
  		 * We could direct write to holes and fallocate.
 		 *
@@ -3121,7 +3697,11 @@ static ssize_t ext4_ext_direct_IO(int rw, struct kiocb *iocb,
 		ret = __blockdev_direct_IO(rw, iocb, inode,
 					 inode->i_sb->s_bdev, iov,
 					 offset, nr_segs,
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DIO_MOW
+					 get_block,
+#else
 					 ext4_get_block_write,
+#endif
 					 ext4_end_io_dio,
 					 NULL,
 					 DIO_LOCKING | DIO_SKIP_HOLES);
@@ -3172,6 +3752,17 @@ static ssize_t ext4_direct_IO(int rw, struct kiocb *iocb,
 	struct inode *inode = file->f_mapping->host;
 	ssize_t ret;
 
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+	if (ext4_has_inline_data(inode)) {
+		/* fall back to buffered I/O, which handles inline data */
+		if (!(rw & WRITE) || offset + iov_length(iov, nr_segs) <=
+		    EXT4_MIN_INLINE_DATA_SIZE)
+			return 0;
+		ret = ext4_convert_inline_data(inode);
+		if (ret)
+			return ret;
+	}
+#endif
 	trace_ext4_direct_IO_enter(inode, offset, iov_length(iov, nr_segs), rw);
 	if (ext4_test_inode_flag(inode, EXT4_INODE_EXTENTS))
 		ret = ext4_ext_direct_IO(rw, iocb, iov, offset, nr_segs);
@@ -3282,6 +3873,9 @@ static int ext4_no_writepage(struct page *page,
 static const struct address_space_operations ext4_snapfile_aops = {
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READ
 	.readpage		= ext4_snapshot_readpage,
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READAHEAD
+	.readpages		= ext4_snapshot_readpages,
+#endif
 #else
 	.readpage		= ext4_readpage,
 	.readpages		= ext4_readpages,
@@ -3427,7 +4021,11 @@ int ext4_block_zero_page_range(handle_t *handle,
 #endif
 	if (ext4_should_journal_data(inode)) {
 		BUFFER_TRACE(bh, "get write access");
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_DATA
+		err = ext4_journal_get_write_access_inode(handle, inode, bh);
+#else
 		err = ext4_journal_get_write_access(handle, bh);
+#endif
 		if (err)
 			goto unlock;
 	}
@@ -3537,6 +4135,11 @@ void ext4_truncate(struct inode *inode)
 	if (inode->i_size == 0 && !test_opt(inode->i_sb, NO_AUTO_DA_ALLOC))
 		ext4_set_inode_state(inode, EXT4_STATE_DA_ALLOC_CLOSE);
 
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+	if (ext4_has_inline_data(inode))
+		ext4_inline_truncate(inode);
+	else
+#endif
 	if (ext4_test_inode_flag(inode, EXT4_INODE_EXTENTS))
 		ext4_ext_truncate(inode);
 	else
@@ -3551,6 +4154,63 @@ void ext4_truncate(struct inode *inode)
  * data in memory that is needed to recreate the on-disk version of this
  * inode.
  */
+#ifdef CONFIG_EXT4_FS_DIR_INODE_READAHEAD
+static int ext4_cmp_ino(const void *a, const void *b)
+{
+	unsigned long ia = *(const unsigned long *)a;
+	unsigned long ib = *(const unsigned long *)b;
+
+	return ia < ib ? -1 : ia > ib;
+}
+
+/*
+ * ext4_inode_table_readahead() - read ahead the inode table blocks of
+ * @nr inodes in one sweep.  @inos is sorted in place, so that blocks
+ * are submitted in ascending order and each block only once.
+ * Blocks that are cached or beyond the used part of the inode table are
+ * skipped.
+ */
+void ext4_inode_table_readahead(struct super_block *sb,
+				unsigned long *inos, int nr)
+{
+	struct ext4_group_desc *gdp = NULL;
+	ext4_group_t group, last_group = 0;
+	ext4_fsblk_t block, last_block = 0;
+	int inodes_per_block = EXT4_SB(sb)->s_inodes_per_block;
+	unsigned long offset, used = 0;
+	struct blk_plug plug;
+	int i;
+
+	sort(inos, nr, sizeof(*inos), ext4_cmp_ino, NULL);
+
+	blk_start_plug(&plug);
+	for (i = 0; i < nr; i++) {
+		if (!ext4_valid_inum(sb, inos[i]))
+			continue;
+		group = (inos[i] - 1) / EXT4_INODES_PER_GROUP(sb);
+		offset = (inos[i] - 1) % EXT4_INODES_PER_GROUP(sb);
+		if (!gdp || group != last_group) {
+			gdp = ext4_get_group_desc(sb, group, NULL);
+			if (!gdp)
+				continue;
+			last_group = group;
+			used = EXT4_INODES_PER_GROUP(sb);
+			if (EXT4_HAS_RO_COMPAT_FEATURE(sb,
+				       EXT4_FEATURE_RO_COMPAT_GDT_CSUM))
+				used -= ext4_itable_unused_count(sb, gdp);
+		}
+		if (offset >= used)
+			continue;
+		block = ext4_inode_table(sb, gdp) + offset / inodes_per_block;
+		if (block == last_block)
+			continue;
+		last_block = block;
+		sb_breadahead(sb, block);
+	}
+	blk_finish_plug(&plug);
+}
+
+#endif
 static int __ext4_get_inode_loc(struct inode *inode,
 				struct ext4_iloc *iloc, int in_mem)
 {
@@ -3843,7 +4503,7 @@ struct inode *ext4_iget(struct super_block *sb, unsigned long ino)
 	if (EXT4_HAS_INCOMPAT_FEATURE(sb, EXT4_FEATURE_INCOMPAT_64BIT))
 		ei->i_file_acl |=
 			((__u64)le16_to_cpu(raw_inode->i_file_acl_high)) << 32;
-	inode->i_size = ext4_isize(raw_inode);
+	inode->i_size = ext4_isize(sb, raw_inode);
 	ei->i_disksize = inode->i_size;
 #ifdef CONFIG_QUOTA
 	ei->i_reserved_quota = 0;
@@ -3929,6 +4589,15 @@ struct inode *ext4_iget(struct super_block *sb, unsigned long ino)
 			inode->i_version |=
 			(__u64)(le32_to_cpu(raw_inode->i_version_hi)) << 32;
 	}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_SHRINK_PARALLEL
+	/* snapshot shrink checkpoint is stored in snapshot inode version hi */
+	ei->i_snapshot_shrink_group = 0;
+	if (ext4_snapshot_file(inode) &&
+	    EXT4_INODE_SIZE(inode->i_sb) > EXT4_GOOD_OLD_INODE_SIZE &&
+	    EXT4_FITS_IN_INODE(raw_inode, ei, i_version_hi))
+		ei->i_snapshot_shrink_group =
+			le32_to_cpu(raw_inode->i_version_hi);
+#endif
 
 	ret = 0;
 	if (ei->i_file_acl &&
@@ -3937,6 +4606,18 @@ struct inode *ext4_iget(struct super_block *sb, unsigned long ino)
 				 ei->i_file_acl);
 		ret = -EIO;
 		goto bad_inode;
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+	} else if (ext4_has_inline_data(inode)) {
+		if (!S_ISREG(inode->i_mode) ||
+		    !EXT4_HAS_INCOMPAT_FEATURE(sb,
+				EXT4_FEATURE_INCOMPAT_IBLOCK_DATA) ||
+		    ext4_test_inode_flag(inode, EXT4_INODE_EXTENTS) ||
+		    inode->i_size > EXT4_MIN_INLINE_DATA_SIZE) {
+			EXT4_ERROR_INODE(inode, "bad inline data inode "
+					 "(size %lld)", inode->i_size);
+			ret = -EIO;
+		}
+#endif
 	} else if (ext4_test_inode_flag(inode, EXT4_INODE_EXTENTS)) {
 		if (S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode) ||
 		    (S_ISLNK(inode->i_mode) &&
@@ -3955,6 +4636,10 @@ struct inode *ext4_iget(struct super_block *sb, unsigned long ino)
 	if (S_ISREG(inode->i_mode)) {
 		inode->i_op = &ext4_file_inode_operations;
 		inode->i_fop = &ext4_file_operations;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READ_SHARED
+		if (ext4_snapshot_file(inode))
+			inode->i_fop = &ext4_snapfile_operations;
+#endif
 		ext4_set_aops(inode);
 	} else if (S_ISDIR(inode->i_mode)) {
 		inode->i_op = &ext4_dir_inode_operations;
@@ -4149,6 +4834,15 @@ static int ext4_do_update_inode(handle_t *handle,
 		 */
 		raw_inode->i_disk_version =
 			cpu_to_le32(ei->i_next_snapshot_ino);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_SHRINK_PARALLEL
+		if (ei->i_extra_isize) {
+			if (EXT4_FITS_IN_INODE(raw_inode, ei, i_version_hi))
+				raw_inode->i_version_hi =
+				cpu_to_le32(ei->i_snapshot_shrink_group);
+			raw_inode->i_extra_isize =
+				cpu_to_le16(ei->i_extra_isize);
+		}
+#endif
 	} else {
 		raw_inode->i_disk_version = cpu_to_le32(inode->i_version);
 		if (ei->i_extra_isize) {
@@ -4328,6 +5022,14 @@ int ext4_setattr(struct dentry *dentry, struct iattr *attr)
 #endif
 		inode_dio_wait(inode);
 
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+		if (ext4_has_inline_data(inode) &&
+		    attr->ia_size > EXT4_MIN_INLINE_DATA_SIZE) {
+			error = ext4_convert_inline_data(inode);
+			if (error)
+				return error;
+		}
+#endif
 		if (!(ext4_test_inode_flag(inode, EXT4_INODE_EXTENTS))) {
 			struct ext4_sb_info *sbi = EXT4_SB(inode->i_sb);
 
@@ -4813,14 +5515,31 @@ int ext4_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
 	 * __block_page_mkwrite() to do a reliable check.
 	 */
 	vfs_check_frozen(inode->i_sb, SB_FREEZE_WRITE);
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+	/* a mapped page is written back through the block mapping */
+	ret = ext4_convert_inline_data(inode);
+	if (ret)
+		goto out_ret;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_MMAP
+	/*
+	 * Like ext4_da_write_begin(), leave the buffers that are already
+	 * pending move-on-write for writeback.  ext4_da_get_block_prep()
+	 * only reserves a block for the others, so the delalloc case needs
+	 * no handle, same as without snapshots.
+	 */
+	ext4_snapshot_write_begin(inode, page, PAGE_CACHE_SIZE,
+				  test_opt(inode->i_sb, DELALLOC) &&
+				  !ext4_should_journal_data(inode));
+#elif defined(CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA)
 	ext4_snapshot_write_begin(inode, page, PAGE_CACHE_SIZE, 0);
 #endif
 	/* Delalloc case is easy... */
 	if (test_opt(inode->i_sb, DELALLOC) &&
 	    !ext4_should_journal_data(inode) &&
 	    !ext4_nonda_switch(inode->i_sb)) {
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA
+#if defined(CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA) && \
+	!defined(CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_MMAP)
 		if (ext4_snapshot_should_move_data(inode)) {
 			handle = ext4_journal_start(inode, 1);
 			if (IS_ERR(handle)) {
@@ -4834,7 +5553,8 @@ int ext4_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
 						   ext4_da_get_block_prep);
 		} while (ret == -ENOSPC &&
 		       ext4_should_retry_alloc(inode->i_sb, &retries));
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA
+#if defined(CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA) && \
+	!defined(CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA_MMAP)
 		if (handle)
 			ext4_journal_stop(handle);
 #endif
@@ -4878,6 +5598,16 @@ int ext4_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
 		get_block = ext4_get_block;
 #endif
 retry_alloc:
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_DATA
+	if (ext4_should_journal_data(inode) &&
+	    !ext4_snapshot_has_free_blocks(inode->i_sb,
+			PAGE_CACHE_SIZE >> inode->i_blkbits)) {
+		ret = -ENOSPC;
+		if (ext4_should_retry_alloc(inode->i_sb, &retries))
+			goto retry_alloc;
+		goto out_ret;
+	}
+#endif
 	handle = ext4_journal_start(inode, ext4_writepage_trans_blocks(inode));
 	if (IS_ERR(handle)) {
 		ret = VM_FAULT_SIGBUS;
@@ -223,7 +223,7 @@ flags_out:
 		 * A: snapshot_take() ->
 		 * A: journal_lock_updates() (waiting for B)
 		 */
-		mutex_lock(&EXT4_SB(inode->i_sb)->s_snapshot_mutex);
+		ext4_snapshot_mutex_lock(inode->i_sb);
 
 		handle = ext4_journal_start(inode, 1);
 		if (IS_ERR(handle)) {
@@ -252,19 +252,151 @@ snapflags_out:
 		if ((oldflags|flags) & 1UL<<EXT4_SNAPSTATE_LIST) {
 			/* if clearing list flag, cleanup snapshot list */
 			int ret;
-
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC
+			int cleanup = !(flags & 1UL<<EXT4_SNAPSTATE_LIST);
+
+			/* leave the cleanup to the snapshot cleanup thread */
+			if (cleanup && ext4_snapshot_wake_cleanup(inode->i_sb))
+				cleanup = 0;
+			/* update snapshots list even if take failed */
+			ret = ext4_snapshot_update_inode(inode, cleanup);
+#else
 			/* update/cleanup snapshots list even if take failed */
-			ret = ext4_snapshot_update(inode->i_sb,
-					!(flags & 1UL<<EXT4_SNAPSTATE_LIST), 0);
+			ret = ext4_snapshot_update_inode(inode,
+					!(flags & 1UL<<EXT4_SNAPSTATE_LIST));
+#endif
 			if (!err)
 				err = ret;
 		}
 
-		mutex_unlock(&EXT4_SB(inode->i_sb)->s_snapshot_mutex);
+		ext4_snapshot_mutex_unlock(inode->i_sb);
 		mutex_unlock(&inode->i_mutex);
 		mnt_drop_write(filp->f_path.mnt);
 		return err;
 	}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+	case EXT4_IOC_SNAPSHOT_EXCLUDE: {
+		int err;
+
+		if (!EXT4_SNAPSHOTS(inode->i_sb) ||
+		    !EXT4_HAS_COMPAT_FEATURE(inode->i_sb,
+					     EXT4_FEATURE_COMPAT_EXCLUDE_BITMAP))
+			return -EOPNOTSUPP;
+
+		if (!capable(CAP_SYS_RESOURCE))
+			return -EPERM;
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_INHERIT
+		if (S_ISDIR(inode->i_mode) && !ext4_snapshot_file(inode)) {
+			err = mnt_want_write(filp->f_path.mnt);
+			if (err)
+				return err;
+			err = ext4_snapshot_exclude_dir(inode);
+			mnt_drop_write(filp->f_path.mnt);
+			return err;
+		}
+
+#endif
+		if (!S_ISREG(inode->i_mode) || ext4_snapshot_file(inode))
+			return -EINVAL;
+
+		/* indirect mapped files are not supported */
+		if (!ext4_test_inode_flag(inode, EXT4_INODE_EXTENTS))
+			return -EOPNOTSUPP;
+
+		err = mnt_want_write(filp->f_path.mnt);
+		if (err)
+			return err;
+		err = ext4_snapshot_exclude_file(inode);
+		mnt_drop_write(filp->f_path.mnt);
+		return err;
+	}
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_DIFF
+	case EXT4_IOC_SNAPSHOT_DIFF:
+		if (!EXT4_SNAPSHOTS(inode->i_sb))
+			return -EOPNOTSUPP;
+
+		if (!capable(CAP_SYS_RESOURCE))
+			return -EPERM;
+
+		if (!ext4_snapshot_file(inode))
+			return -EINVAL;
+
+		return ext4_snapshot_diff(inode,
+				(struct ext4_snapshot_diff __user *)arg);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_SEND
+	case EXT4_IOC_SNAPSHOT_SEND:
+		if (!EXT4_SNAPSHOTS(inode->i_sb))
+			return -EOPNOTSUPP;
+
+		if (!capable(CAP_SYS_RESOURCE))
+			return -EPERM;
+
+		if (!ext4_snapshot_file(inode))
+			return -EINVAL;
+
+		return ext4_snapshot_send(inode,
+				(struct ext4_snapshot_send __user *)arg);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_CLONE
+	case EXT4_IOC_SNAPSHOT_CLONE:
+		if (!EXT4_SNAPSHOTS(inode->i_sb))
+			return -EOPNOTSUPP;
+
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+
+		if (!ext4_snapshot_file(inode))
+			return -EINVAL;
+
+		return ext4_snapshot_clone(inode,
+				(struct ext4_snapshot_clone __user *)arg);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_ASYNC
+	case EXT4_IOC_SNAPSHOT_TAKE_ASYNC:
+		if (!EXT4_SNAPSHOTS(inode->i_sb))
+			return -EOPNOTSUPP;
+
+		if (!ext4_snapshot_file(inode) ||
+				!capable(CAP_SYS_RESOURCE))
+			return -EPERM;
+
+		return ext4_snapshot_take_async(filp,
+				(struct ext4_snapshot_take __user *)arg);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_GROUP
+	case EXT4_IOC_SNAPSHOT_TAKE_GROUP:
+		if (!EXT4_SNAPSHOTS(inode->i_sb))
+			return -EOPNOTSUPP;
+
+		if (!ext4_snapshot_file(inode) ||
+				!capable(CAP_SYS_RESOURCE))
+			return -EPERM;
+
+		return ext4_snapshot_take_group(filp,
+				(struct ext4_snapshot_group __user *)arg);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+	case EXT4_IOC_SNAPSHOT_STATS:
+		if (!EXT4_SNAPSHOTS(inode->i_sb))
+			return -EOPNOTSUPP;
+
+		if (!ext4_snapshot_file(inode))
+			return -EINVAL;
+
+		return ext4_snapshot_get_stats(inode,
+				(struct ext4_snapshot_stats __user *)arg);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_QUERY
+	case EXT4_IOC_SNAPSHOT_QUERY:
+		if (!EXT4_SNAPSHOTS(inode->i_sb))
+			return -EOPNOTSUPP;
+
+		return ext4_snapshot_query(inode->i_sb,
+				(struct ext4_snapshot_query __user *)arg);
+#endif
 #endif
 	case EXT4_IOC_GETVERSION:
 	case EXT4_IOC_GETVERSION_OLD:
@@ -340,7 +472,7 @@ setversion_out:
 			return -EFAULT;
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL
 		/* avoid snapshot_take() in the middle of group_extend() */
-		mutex_lock(&EXT4_SB(sb)->s_snapshot_mutex);
+		ext4_snapshot_mutex_lock(sb);
 #endif
 
 		err = mnt_want_write(filp->f_path.mnt);
@@ -356,7 +488,7 @@ setversion_out:
 		if (err == 0)
 			err = err2;
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL
-		mutex_unlock(&EXT4_SB(sb)->s_snapshot_mutex);
+		ext4_snapshot_mutex_unlock(sb);
 #endif
 		mnt_drop_write(filp->f_path.mnt);
 		ext4_resize_end(sb);
@@ -424,7 +556,7 @@ mext_out:
 
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL
 		/* avoid snapshot_take() in the middle of group_add() */
-		mutex_lock(&EXT4_SB(sb)->s_snapshot_mutex);
+		ext4_snapshot_mutex_lock(sb);
 #endif
 		err = ext4_group_add(sb, &input);
 		if (EXT4_SB(sb)->s_journal) {
@@ -435,7 +567,7 @@ mext_out:
 		if (err == 0)
 			err = err2;
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL
-		mutex_unlock(&EXT4_SB(sb)->s_snapshot_mutex);
+		ext4_snapshot_mutex_unlock(sb);
 #endif
 		mnt_drop_write(filp->f_path.mnt);
 		ext4_resize_end(sb);
@@ -576,6 +708,30 @@ long ext4_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	}
 	case EXT4_IOC_MOVE_EXT:
 	case FITRIM:
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+	case EXT4_IOC_SNAPSHOT_EXCLUDE:
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_DIFF
+	case EXT4_IOC_SNAPSHOT_DIFF:
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_SEND
+	case EXT4_IOC_SNAPSHOT_SEND:
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_CLONE
+	case EXT4_IOC_SNAPSHOT_CLONE:
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_ASYNC
+	case EXT4_IOC_SNAPSHOT_TAKE_ASYNC:
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_GROUP
+	case EXT4_IOC_SNAPSHOT_TAKE_GROUP:
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+	case EXT4_IOC_SNAPSHOT_STATS:
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_QUERY
+	case EXT4_IOC_SNAPSHOT_QUERY:
+#endif
 		break;
 	default:
 		return -ENOIOCTLCMD;
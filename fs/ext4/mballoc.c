@@ -25,6 +25,9 @@
 #include <linux/debugfs.h>
 #include <linux/slab.h>
 #include <trace/events/ext4.h>
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_DISCARD
+#include <linux/list_sort.h>
+#endif
 #include "snapshot.h"
 
 /*
@@ -358,6 +361,9 @@ static void ext4_mb_generate_from_pa(struct super_block *sb, void *bitmap,
 static void ext4_mb_generate_from_freelist(struct super_block *sb, void *bitmap,
 						ext4_group_t group);
 static void release_blocks_on_commit(journal_t *journal, transaction_t *txn);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_PREALLOC
+static void ext4_discard_snapshot_preallocations(struct inode *inode);
+#endif
 
 static inline void *mb_correct_addr_and_bit(int *bit, void *addr)
 {
@@ -421,6 +427,49 @@ static inline int mb_find_next_bit(void *addr, int max, int start)
 	return ret;
 }
 
+#ifdef CONFIG_EXT4_FS_MB_FIND_RUN
+/* load a word of a little-endian bitmap */
+static inline unsigned long mb_le_word(const unsigned long *p)
+{
+#if BITS_PER_LONG == 64
+	return le64_to_cpu(*(const __le64 *)p);
+#else
+	return le32_to_cpu(*(const __le32 *)p);
+#endif
+}
+
+/*
+ * Find the run of bits equal to bit @start, a word at a time.
+ * Set *pset to the value of bit @start.
+ * Return the length of the run, up to bit @max.
+ */
+static int mb_find_run(void *addr, int max, int start, int *pset)
+{
+	const unsigned long *p;
+	unsigned long word, invert;
+	int fix = 0, end;
+
+	addr = mb_correct_addr_and_bit(&fix, addr);
+	p = (const unsigned long *)addr + (start + fix) / BITS_PER_LONG;
+	end = start + fix - (start + fix) % BITS_PER_LONG;
+
+	word = mb_le_word(p);
+	*pset = (word >> ((start + fix) % BITS_PER_LONG)) & 1;
+	invert = *pset ? ~0UL : 0UL;
+	/* the run ends at the first bit that differs from bit @start */
+	word = (word ^ invert) >> ((start + fix) % BITS_PER_LONG)
+		<< ((start + fix) % BITS_PER_LONG);
+	while (!word) {
+		end += BITS_PER_LONG;
+		if (end - fix >= max)
+			return max - start;
+		word = mb_le_word(++p) ^ invert;
+	}
+	end += __ffs(word) - fix;
+	return min(end, max) - start;
+}
+
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW
 /*
  * Find the largest range of set or clear bits.
@@ -429,6 +478,16 @@ static inline int mb_find_next_bit(void *addr, int max, int start)
  */
 int ext4_mb_test_bit_range(int bit, void *addr, int *pcount)
 {
+#ifdef CONFIG_EXT4_FS_MB_FIND_RUN
+	int ret;
+
+	if (*pcount <= 0) {
+		*pcount = 0;
+		return mb_test_bit(bit, addr) ? 1 : 0;
+	}
+	*pcount = mb_find_run(addr, bit + *pcount, bit, &ret);
+	return ret;
+#else
 	int i, ret;
 
 	ret = mb_test_bit(bit, addr);
@@ -438,6 +497,7 @@ int ext4_mb_test_bit_range(int bit, void *addr, int *pcount)
 		i = mb_find_next_bit(addr, bit + *pcount, bit);
 	*pcount = i - bit;
 	return ret ? 1 : 0;
+#endif
 }
 
 #endif
@@ -704,11 +764,43 @@ static void ext4_mb_mark_free_simple(struct super_block *sb,
  * Cache the order of the largest free extent we have available in this block
  * group.
  */
+#ifdef CONFIG_EXT4_FS_MB_GROUP_INDEX
+/*
+ * Move the group to the list of its new largest free order.
+ * Groups without free blocks are not on any list.
+ * Called under the group lock.
+ */
+static void
+mb_update_largest_free_order_list(struct super_block *sb,
+		struct ext4_group_info *grp, int old)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	int new = grp->bb_largest_free_order;
+
+	if (old == new)
+		return;
+	if (old >= 0) {
+		write_lock(&sbi->s_mb_largest_free_orders_locks[old]);
+		list_del_init(&grp->bb_largest_free_order_node);
+		write_unlock(&sbi->s_mb_largest_free_orders_locks[old]);
+	}
+	if (new >= 0) {
+		write_lock(&sbi->s_mb_largest_free_orders_locks[new]);
+		list_add_tail(&grp->bb_largest_free_order_node,
+			      &sbi->s_mb_largest_free_orders[new]);
+		write_unlock(&sbi->s_mb_largest_free_orders_locks[new]);
+	}
+}
+
+#endif
 static void
 mb_set_largest_free_order(struct super_block *sb, struct ext4_group_info *grp)
 {
 	int i;
 	int bits;
+#ifdef CONFIG_EXT4_FS_MB_GROUP_INDEX
+	int old = grp->bb_largest_free_order;
+#endif
 
 	grp->bb_largest_free_order = -1; /* uninit */
 
@@ -719,6 +811,9 @@ mb_set_largest_free_order(struct super_block *sb, struct ext4_group_info *grp)
 			break;
 		}
 	}
+#ifdef CONFIG_EXT4_FS_MB_GROUP_INDEX
+	mb_update_largest_free_order_list(sb, grp, old);
+#endif
 }
 
 static noinline_for_stack
@@ -765,7 +860,13 @@ void ext4_mb_generate_buddy(struct super_block *sb,
 	}
 	mb_set_largest_free_order(sb, grp);
 
+#ifdef CONFIG_EXT4_FS_MB_GROUP_INDEX
+	if (test_and_clear_bit(EXT4_GROUP_INFO_NEED_INIT_BIT,
+			       &(grp->bb_state)))
+		atomic_dec(&EXT4_SB(sb)->s_mb_groups_need_init);
+#else
 	clear_bit(EXT4_GROUP_INFO_NEED_INIT_BIT, &(grp->bb_state));
+#endif
 
 	period = get_cycles() - period;
 	spin_lock(&EXT4_SB(sb)->s_bal_lock);
@@ -1123,6 +1224,81 @@ err:
 	return ret;
 }
 
+#ifdef CONFIG_EXT4_FS_MB_PREFETCH
+/*
+ * Buddy prefetch
+ *
+ * After mount, a work item initializes the buddies of all groups in
+ * batches of s_mb_prefetch groups.  The block bitmaps of the next batch
+ * are read ahead under a plug, before the buddies of the current batch
+ * are built, so bitmap reads are in flight while buddies are built.
+ */
+static void ext4_mb_prefetch_bitmaps(struct super_block *sb,
+				     ext4_group_t group, ext4_group_t end)
+{
+	struct ext4_group_desc *desc;
+	struct blk_plug plug;
+
+	blk_start_plug(&plug);
+	for (; group < end; group++) {
+		if (!EXT4_MB_GRP_NEED_INIT(ext4_get_group_info(sb, group)))
+			continue;
+		desc = ext4_get_group_desc(sb, group, NULL);
+		/* uninit block bitmap is not read from disk */
+		if (!desc ||
+		    desc->bg_flags & cpu_to_le16(EXT4_BG_BLOCK_UNINIT))
+			continue;
+		sb_breadahead(sb, ext4_block_bitmap(sb, desc));
+	}
+	blk_finish_plug(&plug);
+}
+
+static void ext4_mb_prefetch_work(struct work_struct *work)
+{
+	struct ext4_sb_info *sbi = container_of(work, struct ext4_sb_info,
+						s_mb_prefetch_work);
+	struct super_block *sb = sbi->s_mb_prefetch_sb;
+	ext4_group_t ngroups = ext4_get_groups_count(sb);
+	ext4_group_t group = sbi->s_mb_prefetch_next;
+	ext4_group_t end, next_end;
+	unsigned int nr = ACCESS_ONCE(sbi->s_mb_prefetch);
+
+	if (!nr || group >= ngroups)
+		return;
+
+	end = min_t(ext4_group_t, group + nr, ngroups);
+	next_end = min_t(ext4_group_t, end + nr, ngroups);
+	if (group == 0)
+		ext4_mb_prefetch_bitmaps(sb, group, end);
+	ext4_mb_prefetch_bitmaps(sb, end, next_end);
+
+	for (; group < end; group++) {
+		/* errors are reported again by the allocation that hits them */
+		if (EXT4_MB_GRP_NEED_INIT(ext4_get_group_info(sb, group)))
+			ext4_mb_init_group(sb, group);
+		cond_resched();
+	}
+
+	sbi->s_mb_prefetch_next = end;
+	if (end < ngroups)
+		queue_work(system_long_wq, work);
+}
+
+/*
+ * ext4_mb_prefetch_start() is called at the end of mount
+ */
+void ext4_mb_prefetch_start(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	if (sb->s_flags & MS_RDONLY)
+		return;
+	sbi->s_mb_prefetch_next = 0;
+	queue_work(system_long_wq, &sbi->s_mb_prefetch_work);
+}
+
+#endif
+
 /*
  * Locking note:  This routine calls ext4_mb_init_cache(), which takes the
  * block group lock of all groups for this page; do not hold the BG lock when
@@ -1427,6 +1603,18 @@ static int mb_find_extent(struct ext4_buddy *e4b, int order, int block,
 		return 0;
 	}
 
+#ifdef CONFIG_EXT4_FS_MB_FIND_RUN
+	if (likely(order == 0)) {
+		int set;
+
+		/* scan the free run word at a time, up to the needed length */
+		ex->fe_len = mb_find_run(buddy, min(block + needed, max),
+					 block, &set);
+		ex->fe_start = block;
+		ex->fe_group = e4b->bd_group;
+		return ex->fe_len;
+	}
+#endif
 	/* FIXME dorp order completely ? */
 	if (likely(order == 0)) {
 		/* find actual order */
@@ -1977,6 +2165,103 @@ static int ext4_mb_good_group(struct ext4_allocation_context *ac,
 	return 0;
 }
 
+#ifdef CONFIG_EXT4_FS_MB_GROUP_INDEX
+/*
+ * Scan one group with criteria @cr if it is a good group.
+ * Return 0 or error.  ac->ac_status tells if an extent was found.
+ */
+static int ext4_mb_scan_group(struct ext4_allocation_context *ac,
+			      ext4_group_t group, int cr)
+{
+	struct super_block *sb = ac->ac_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_buddy e4b;
+	int err;
+
+	/* This now checks without needing the buddy page */
+	if (!ext4_mb_good_group(ac, group, cr))
+		return 0;
+
+	err = ext4_mb_load_buddy(sb, group, &e4b);
+	if (err)
+		return err;
+
+	ext4_lock_group(sb, group);
+
+	/*
+	 * We need to check again after locking the
+	 * block group
+	 */
+	if (!ext4_mb_good_group(ac, group, cr)) {
+		ext4_unlock_group(sb, group);
+		ext4_mb_unload_buddy(&e4b);
+		return 0;
+	}
+
+	ac->ac_groups_scanned++;
+	if (cr == 0)
+		ext4_mb_simple_scan_group(ac, &e4b);
+	else if (cr == 1 && sbi->s_stripe &&
+			!(ac->ac_g_ex.fe_len % sbi->s_stripe))
+		ext4_mb_scan_aligned(ac, &e4b);
+	else
+		ext4_mb_complex_scan_group(ac, &e4b);
+
+	ext4_unlock_group(sb, group);
+	ext4_mb_unload_buddy(&e4b);
+	return 0;
+}
+
+/*
+ * Scan the groups whose largest free extent order is at least @order,
+ * lowest order first, instead of walking all groups.
+ * The buddy of a group cannot be loaded under the list lock, so groups
+ * are taken from a list in batches.
+ * Return 0 or error.  ac->ac_status tells if an extent was found.
+ */
+static int ext4_mb_scan_group_index(struct ext4_allocation_context *ac,
+				    int cr, int order, ext4_group_t ngroups)
+{
+	struct super_block *sb = ac->ac_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	ext4_group_t groups[MB_GROUP_INDEX_BATCH];
+	struct ext4_group_info *grp;
+	int i, n, pos, skip, more, err;
+
+	for (; order < MB_NUM_ORDERS(sb); order++) {
+		skip = 0;
+		do {
+			n = pos = more = 0;
+			read_lock(&sbi->s_mb_largest_free_orders_locks[order]);
+			list_for_each_entry(grp,
+					&sbi->s_mb_largest_free_orders[order],
+					bb_largest_free_order_node) {
+				if (pos++ < skip)
+					continue;
+				if (n == MB_GROUP_INDEX_BATCH) {
+					more = 1;
+					break;
+				}
+				/* non-extent files are limited to low groups */
+				if (grp->bb_group < ngroups)
+					groups[n++] = grp->bb_group;
+			}
+			read_unlock(&sbi->s_mb_largest_free_orders_locks[order]);
+			skip = pos - more;
+
+			for (i = 0; i < n; i++) {
+				err = ext4_mb_scan_group(ac, groups[i], cr);
+				if (err)
+					return err;
+				if (ac->ac_status != AC_STATUS_CONTINUE)
+					return 0;
+			}
+		} while (more);
+	}
+	return 0;
+}
+
+#endif
 static noinline_for_stack int
 ext4_mb_regular_allocator(struct ext4_allocation_context *ac)
 {
@@ -1986,6 +2271,9 @@ ext4_mb_regular_allocator(struct ext4_allocation_context *ac)
 	struct ext4_sb_info *sbi;
 	struct super_block *sb;
 	struct ext4_buddy e4b;
+#ifdef CONFIG_EXT4_FS_MB_GROUP_INDEX
+	int indexed;
+#endif
 
 	sb = ac->ac_sb;
 	sbi = EXT4_SB(sb);
@@ -2042,6 +2330,27 @@ ext4_mb_regular_allocator(struct ext4_allocation_context *ac)
 repeat:
 	for (; cr < 4 && ac->ac_status == AC_STATUS_CONTINUE; cr++) {
 		ac->ac_criteria = cr;
+#ifdef CONFIG_EXT4_FS_MB_GROUP_INDEX
+		/*
+		 * A good group for criteria 0 has a free extent of order
+		 * ac_2order.  A good group for criteria 1 has an average
+		 * free extent of at least fe_len blocks, so its largest
+		 * free extent order is at least fls(fe_len) - 1.
+		 */
+		indexed = cr < 2 && sbi->s_mb_group_index;
+		if (indexed) {
+			err = ext4_mb_scan_group_index(ac, cr, cr == 0 ?
+					ac->ac_2order :
+					fls(ac->ac_g_ex.fe_len) - 1, ngroups);
+			if (err)
+				goto out;
+			if (ac->ac_status != AC_STATUS_CONTINUE)
+				break;
+			/* groups that were never loaded are not indexed */
+			if (!atomic_read(&sbi->s_mb_groups_need_init))
+				continue;
+		}
+#endif
 		/*
 		 * searching for the right group start
 		 * from the goal value specified
@@ -2052,6 +2361,16 @@ repeat:
 			if (group == ngroups)
 				group = 0;
 
+#ifdef CONFIG_EXT4_FS_MB_GROUP_INDEX
+			if (indexed && !EXT4_MB_GRP_NEED_INIT(
+					ext4_get_group_info(sb, group)))
+				continue;
+			err = ext4_mb_scan_group(ac, group, cr);
+			if (err)
+				goto out;
+			if (ac->ac_status != AC_STATUS_CONTINUE)
+				break;
+#else
 			/* This now checks without needing the buddy page */
 			if (!ext4_mb_good_group(ac, group, cr))
 				continue;
@@ -2086,6 +2405,7 @@ repeat:
 
 			if (ac->ac_status != AC_STATUS_CONTINUE)
 				break;
+#endif
 		}
 	}
 
@@ -2283,6 +2603,17 @@ int ext4_mb_add_groupinfo(struct super_block *sb, ext4_group_t group,
 	init_rwsem(&meta_group_info[i]->alloc_sem);
 	meta_group_info[i]->bb_free_root = RB_ROOT;
 	meta_group_info[i]->bb_largest_free_order = -1;  /* uninit */
+#ifdef CONFIG_EXT4_FS_MB_GROUP_INDEX
+	meta_group_info[i]->bb_group = group;
+	INIT_LIST_HEAD(&meta_group_info[i]->bb_largest_free_order_node);
+	atomic_inc(&sbi->s_mb_groups_need_init);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_EXTENTS
+	meta_group_info[i]->bg_cow_nr_extents = EXT4_COW_EXTENTS_UNKNOWN;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_MAP
+	meta_group_info[i]->bg_cow_map = NULL;
+#endif
 
 #ifdef DOUBLE_CHECK
 	{
@@ -2489,6 +2820,31 @@ int ext4_mb_init(struct super_block *sb, int needs_recovery)
 	spin_lock_init(&sbi->s_md_lock);
 	spin_lock_init(&sbi->s_bal_lock);
 
+#ifdef CONFIG_EXT4_FS_MB_GROUP_INDEX
+	sbi->s_mb_largest_free_orders =
+		kmalloc(MB_NUM_ORDERS(sb) * sizeof(struct list_head),
+			GFP_KERNEL);
+	sbi->s_mb_largest_free_orders_locks =
+		kmalloc(MB_NUM_ORDERS(sb) * sizeof(rwlock_t), GFP_KERNEL);
+	if (!sbi->s_mb_largest_free_orders ||
+	    !sbi->s_mb_largest_free_orders_locks) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < MB_NUM_ORDERS(sb); i++) {
+		INIT_LIST_HEAD(&sbi->s_mb_largest_free_orders[i]);
+		rwlock_init(&sbi->s_mb_largest_free_orders_locks[i]);
+	}
+	atomic_set(&sbi->s_mb_groups_need_init, 0);
+	sbi->s_mb_group_index = MB_DEFAULT_GROUP_INDEX;
+#endif
+#ifdef CONFIG_EXT4_FS_MB_PREFETCH
+	sbi->s_mb_prefetch = MB_DEFAULT_PREFETCH;
+	sbi->s_mb_prefetch_next = 0;
+	sbi->s_mb_prefetch_sb = sb;
+	INIT_WORK(&sbi->s_mb_prefetch_work, ext4_mb_prefetch_work);
+#endif
+
 	sbi->s_mb_max_to_scan = MB_DEFAULT_MAX_TO_SCAN;
 	sbi->s_mb_min_to_scan = MB_DEFAULT_MIN_TO_SCAN;
 	sbi->s_mb_stats = MB_DEFAULT_STATS;
@@ -2520,17 +2876,37 @@ int ext4_mb_init(struct super_block *sb, int needs_recovery)
 		for (j = 0; j < PREALLOC_TB_SIZE; j++)
 			INIT_LIST_HEAD(&lg->lg_prealloc_list[j]);
 		spin_lock_init(&lg->lg_prealloc_lock);
+#ifdef CONFIG_EXT4_FS_MB_ADAPTIVE_GROUP_PREALLOC
+		lg->lg_prealloc_shift = 0;
+		lg->lg_hits = lg->lg_misses = 0;
+#endif
 	}
+#ifdef CONFIG_EXT4_FS_MB_ADAPTIVE_GROUP_PREALLOC
+	sbi->s_mb_group_prealloc_adapt = MB_DEFAULT_GROUP_PREALLOC_ADAPT;
+#endif
+#ifdef CONFIG_EXT4_FS_MB_BATCHED_TRIM
+	spin_lock_init(&sbi->s_trim_stats_lock);
+	memset(&sbi->s_trim_stats, 0, sizeof(sbi->s_trim_stats));
+#endif
 
 	/* init file for buddy data */
 	ret = ext4_mb_init_backend(sb);
 	if (ret != 0) {
 		goto out;
 	}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_SHRINK
+	/* exclude bitmaps are pinned in the group info from now on */
+	ext4_register_exclude_shrinker(sb);
+#endif
 
 	if (sbi->s_proc)
 		proc_create_data("mb_groups", S_IRUGO, sbi->s_proc,
 				 &ext4_mb_seq_groups_fops, sb);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_GROUP_STATS
+	if (sbi->s_proc && EXT4_SNAPSHOTS(sb))
+		proc_create_data("snapshot_groups", S_IRUGO, sbi->s_proc,
+				 &ext4_snapshot_seq_groups_fops, sb);
+#endif
 
 	if (sbi->s_journal)
 		sbi->s_journal->j_commit_callback = release_blocks_on_commit;
@@ -2538,6 +2914,10 @@ out:
 	if (ret) {
 		kfree(sbi->s_mb_offsets);
 		kfree(sbi->s_mb_maxs);
+#ifdef CONFIG_EXT4_FS_MB_GROUP_INDEX
+		kfree(sbi->s_mb_largest_free_orders);
+		kfree(sbi->s_mb_largest_free_orders_locks);
+#endif
 	}
 	return ret;
 }
@@ -2569,11 +2949,25 @@ int ext4_mb_release(struct super_block *sb)
 	struct ext4_sb_info *sbi = EXT4_SB(sb);
 	struct kmem_cache *cachep = get_groupinfo_cache(sb->s_blocksize_bits);
 
+#ifdef CONFIG_EXT4_FS_MB_PREFETCH
+	/* the prefetch work re-queues itself until all groups are done */
+	cancel_work_sync(&sbi->s_mb_prefetch_work);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_SHRINK
+	/* before group info with the pinned exclude bitmaps is freed */
+	ext4_unregister_exclude_shrinker(sb);
+#endif
 	if (sbi->s_group_info) {
 		for (i = 0; i < ngroups; i++) {
 			grinfo = ext4_get_group_info(sb, i);
 #ifdef DOUBLE_CHECK
 			kfree(grinfo->bb_bitmap);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_CACHE
+			ext4_put_exclude_bitmap(sb, i);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_MAP
+			ext4_snapshot_cow_map_free(sb, i);
 #endif
 			ext4_lock_group(sb, i);
 			ext4_mb_cleanup_pa(grinfo);
@@ -2589,6 +2983,10 @@ int ext4_mb_release(struct super_block *sb)
 	}
 	kfree(sbi->s_mb_offsets);
 	kfree(sbi->s_mb_maxs);
+#ifdef CONFIG_EXT4_FS_MB_GROUP_INDEX
+	kfree(sbi->s_mb_largest_free_orders);
+	kfree(sbi->s_mb_largest_free_orders_locks);
+#endif
 	if (sbi->s_buddy_cache)
 		iput(sbi->s_buddy_cache);
 	if (sbi->s_mb_stats) {
@@ -2618,6 +3016,10 @@ int ext4_mb_release(struct super_block *sb)
 	free_percpu(sbi->s_locality_groups);
 	if (sbi->s_proc)
 		remove_proc_entry("mb_groups", sbi->s_proc);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_GROUP_STATS
+	if (sbi->s_proc && EXT4_SNAPSHOTS(sb))
+		remove_proc_entry("snapshot_groups", sbi->s_proc);
+#endif
 
 	return 0;
 }
@@ -2633,6 +3035,133 @@ static inline int ext4_issue_discard(struct super_block *sb,
 	return sb_issue_discard(sb, discard_block, count, GFP_NOFS, 0);
 }
 
+/*
+ * Return the blocks of a committed free extent to the buddy cache and
+ * free the extent.
+ */
+static void ext4_mb_release_free_data(struct super_block *sb,
+				      struct ext4_free_data *entry)
+{
+	struct ext4_buddy e4b;
+	struct ext4_group_info *db;
+	int err;
+
+	err = ext4_mb_load_buddy(sb, entry->group, &e4b);
+	/* we expect to find existing buddy because it's pinned */
+	BUG_ON(err != 0);
+
+	db = e4b.bd_info;
+	ext4_lock_group(sb, entry->group);
+	/* Take it out of per group rb tree */
+	rb_erase(&entry->node, &(db->bb_free_root));
+	mb_free_blocks(NULL, &e4b, entry->start_blk, entry->count);
+
+	/*
+	 * Clear the trimmed flag for the group so that the next
+	 * ext4_trim_fs can trim it.
+	 * If the volume is mounted with -o discard, online discard
+	 * is supported and the free blocks will be trimmed online.
+	 */
+	if (!test_opt(sb, DISCARD))
+		EXT4_MB_GRP_CLEAR_TRIMMED(db);
+
+	if (!db->bb_free_root.rb_node) {
+		/* No more items in the per group rb tree
+		 * balance refcounts from ext4_mb_free_metadata()
+		 */
+		page_cache_release(e4b.bd_buddy_page);
+		page_cache_release(e4b.bd_bitmap_page);
+	}
+	ext4_unlock_group(sb, entry->group);
+	kmem_cache_free(ext4_free_ext_cachep, entry);
+	ext4_mb_unload_buddy(&e4b);
+}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_DISCARD
+static int ext4_free_data_cmp(void *priv, struct list_head *a,
+			      struct list_head *b)
+{
+	struct ext4_free_data *fa = list_entry(a, struct ext4_free_data, list);
+	struct ext4_free_data *fb = list_entry(b, struct ext4_free_data, list);
+
+	if (fa->group != fb->group)
+		return fa->group < fb->group ? -1 : 1;
+	return fa->start_blk - fb->start_blk;
+}
+
+/*
+ * Discard a range of blocks freed by snapshot cleanup and return them to
+ * the buddy cache.  The extents on @run are sorted and contiguous.
+ * Sleep as needed to keep the discard rate below snapshot_discard_rate.
+ */
+static void ext4_snapshot_discard_run(struct super_block *sb,
+				      struct list_head *run,
+				      ext4_fsblk_t start, ext4_fsblk_t len,
+				      unsigned long begin, u64 *bytes)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_free_data *entry, *tmp;
+	unsigned int rate = sbi->s_snapshot_discard_rate;
+	unsigned long due;
+
+	trace_ext4_discard_blocks(sb, (unsigned long long) start, len);
+	sb_issue_discard(sb, start, len, GFP_NOFS, 0);
+	list_for_each_entry_safe(entry, tmp, run, list) {
+		list_del(&entry->list);
+		ext4_mb_release_free_data(sb, entry);
+	}
+
+	*bytes += len << sb->s_blocksize_bits;
+	if (!rate)
+		return;
+	/* jiffies it takes to discard *bytes at the allowed rate */
+	due = begin + div64_u64(*bytes * HZ, (u64)rate << 20);
+	if (time_before(jiffies, due))
+		schedule_timeout_uninterruptible(due - jiffies);
+}
+
+/*
+ * Discard the blocks freed by snapshot cleanup in committed transactions.
+ * The freed extents are sorted and merged, so a removed snapshot results in
+ * a few large discards instead of one synchronous discard per freed extent
+ * in the commit thread.  The blocks stay on the per group to-be-freed tree,
+ * so they cannot be reallocated before they are discarded.
+ */
+void ext4_snapshot_discard_work(struct work_struct *work)
+{
+	struct ext4_sb_info *sbi = container_of(work, struct ext4_sb_info,
+						s_snapshot_discard_work);
+	struct super_block *sb = sbi->s_buddy_cache->i_sb;
+	struct ext4_free_data *entry, *tmp;
+	ext4_fsblk_t start = 0, len = 0, blk;
+	unsigned long begin = jiffies;
+	u64 bytes = 0;
+	LIST_HEAD(list);
+	LIST_HEAD(run);
+
+	spin_lock(&sbi->s_snapshot_discard_lock);
+	list_splice_init(&sbi->s_snapshot_discard_list, &list);
+	spin_unlock(&sbi->s_snapshot_discard_lock);
+
+	list_sort(NULL, &list, ext4_free_data_cmp);
+	list_for_each_entry_safe(entry, tmp, &list, list) {
+		blk = ext4_group_first_block_no(sb, entry->group) +
+			entry->start_blk;
+		if (len && blk != start + len) {
+			ext4_snapshot_discard_run(sb, &run, start, len,
+						  begin, &bytes);
+			len = 0;
+		}
+		if (!len)
+			start = blk;
+		len += entry->count;
+		list_move_tail(&entry->list, &run);
+	}
+	if (len)
+		ext4_snapshot_discard_run(sb, &run, start, len, begin, &bytes);
+}
+
+#endif
 /*
  * This function is called by the jbd2 layer once the commit has finished,
  * so we know we can free the blocks that were released with that commit.
@@ -2640,11 +3169,13 @@ static inline int ext4_issue_discard(struct super_block *sb,
 static void release_blocks_on_commit(journal_t *journal, transaction_t *txn)
 {
 	struct super_block *sb = journal->j_private;
-	struct ext4_buddy e4b;
-	struct ext4_group_info *db;
-	int err, count = 0, count2 = 0;
+	int count = 0, count2 = 0;
 	struct ext4_free_data *entry;
 	struct list_head *l, *ltmp;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_DISCARD
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	int deferred = 0;
+#endif
 
 	list_for_each_safe(l, ltmp, &txn->t_private_list) {
 		entry = list_entry(l, struct ext4_free_data, list);
@@ -2652,43 +3183,30 @@ static void release_blocks_on_commit(journal_t *journal, transaction_t *txn)
 		mb_debug(1, "gonna free %u blocks in group %u (0x%p):",
 			 entry->count, entry->group, entry);
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_DISCARD
+		if (entry->snapshot && test_opt(sb, DISCARD)) {
+			/* discard and free later in a batch */
+			spin_lock(&sbi->s_snapshot_discard_lock);
+			list_move_tail(&entry->list,
+				       &sbi->s_snapshot_discard_list);
+			spin_unlock(&sbi->s_snapshot_discard_lock);
+			deferred++;
+			continue;
+		}
+#endif
 		if (test_opt(sb, DISCARD))
 			ext4_issue_discard(sb, entry->group,
 					   entry->start_blk, entry->count);
 
-		err = ext4_mb_load_buddy(sb, entry->group, &e4b);
-		/* we expect to find existing buddy because it's pinned */
-		BUG_ON(err != 0);
-
-		db = e4b.bd_info;
 		/* there are blocks to put in buddy to make them really free */
 		count += entry->count;
 		count2++;
-		ext4_lock_group(sb, entry->group);
-		/* Take it out of per group rb tree */
-		rb_erase(&entry->node, &(db->bb_free_root));
-		mb_free_blocks(NULL, &e4b, entry->start_blk, entry->count);
-
-		/*
-		 * Clear the trimmed flag for the group so that the next
-		 * ext4_trim_fs can trim it.
-		 * If the volume is mounted with -o discard, online discard
-		 * is supported and the free blocks will be trimmed online.
-		 */
-		if (!test_opt(sb, DISCARD))
-			EXT4_MB_GRP_CLEAR_TRIMMED(db);
-
-		if (!db->bb_free_root.rb_node) {
-			/* No more items in the per group rb tree
-			 * balance refcounts from ext4_mb_free_metadata()
-			 */
-			page_cache_release(e4b.bd_buddy_page);
-			page_cache_release(e4b.bd_bitmap_page);
-		}
-		ext4_unlock_group(sb, entry->group);
-		kmem_cache_free(ext4_free_ext_cachep, entry);
-		ext4_mb_unload_buddy(&e4b);
+		ext4_mb_release_free_data(sb, entry);
 	}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_DISCARD
+	if (deferred)
+		queue_work(system_long_wq, &sbi->s_snapshot_discard_work);
+#endif
 
 	mb_debug(1, "freed %u blocks in %u structures\n", count, count2);
 }
@@ -2876,8 +3394,7 @@ ext4_mb_mark_diskspace_used(struct ext4_allocation_context *ac,
 	if (sbi->s_log_groups_per_flex) {
 		ext4_group_t flex_group = ext4_flex_group(sbi,
 							  ac->ac_b_ex.fe_group);
-		atomic_sub(ac->ac_b_ex.fe_len,
-			   &sbi->s_flex_groups[flex_group].free_blocks);
+		ext4_flex_add(sbi, flex_group, 0, -ac->ac_b_ex.fe_len, 0);
 	}
 
 	err = ext4_handle_dirty_metadata(handle, NULL, bitmap_bh);
@@ -2891,6 +3408,13 @@ ext4_mb_mark_diskspace_used(struct ext4_allocation_context *ac,
 			goto out_err;
 	}
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_JBD_CREATE
+	if (EXT4_SNAPSHOTS(sb) && ext4_handle_valid(handle)) {
+		/* blocks were free in block bitmap - not in use by snapshot */
+		handle->h_alloc_start = block;
+		handle->h_alloc_len = ac->ac_b_ex.fe_len;
+	}
+#endif
 
 	err = ext4_handle_dirty_metadata(handle, NULL, gdp_bh);
 
@@ -2900,6 +3424,38 @@ out_err:
 	return err;
 }
 
+#ifdef CONFIG_EXT4_FS_MB_ADAPTIVE_GROUP_PREALLOC
+/*
+ * Adapt the prealloc size of a locality group to its pool hit rate.
+ * Every MB_LG_ADAPT_WINDOW requests, the size is doubled if most requests
+ * missed the pools, because small files are created faster than the pools
+ * are refilled, and halved if almost all requests hit, so that idle CPUs
+ * do not hold on to large preallocations.
+ * Called with lg_mutex held.
+ */
+static void ext4_mb_adapt_group_prealloc(struct super_block *sb,
+					 struct ext4_locality_group *lg)
+{
+	unsigned int hits = lg->lg_hits, misses = lg->lg_misses;
+
+	if (!EXT4_SB(sb)->s_mb_group_prealloc_adapt) {
+		lg->lg_prealloc_shift = 0;
+		return;
+	}
+	if (hits + misses < MB_LG_ADAPT_WINDOW)
+		return;
+
+	if (misses * 2 > hits) {
+		if (lg->lg_prealloc_shift < MB_LG_PREALLOC_MAX_SHIFT)
+			lg->lg_prealloc_shift++;
+	} else if (misses * 16 < hits) {
+		if (lg->lg_prealloc_shift > 0)
+			lg->lg_prealloc_shift--;
+	}
+	lg->lg_hits = lg->lg_misses = 0;
+}
+
+#endif
 /*
  * here we normalize request for locality group
  * Group request are normalized to s_mb_group_prealloc, which goes to
@@ -2916,6 +3472,19 @@ static void ext4_mb_normalize_group_request(struct ext4_allocation_context *ac)
 
 	BUG_ON(lg == NULL);
 	ac->ac_g_ex.fe_len = EXT4_SB(sb)->s_mb_group_prealloc;
+#ifdef CONFIG_EXT4_FS_MB_ADAPTIVE_GROUP_PREALLOC
+	ext4_mb_adapt_group_prealloc(sb, lg);
+	if (lg->lg_prealloc_shift) {
+		unsigned int len = ac->ac_g_ex.fe_len << lg->lg_prealloc_shift;
+
+		/* leave room for other locality groups in the group */
+		ac->ac_g_ex.fe_len = min_t(unsigned int, len,
+					   EXT4_BLOCKS_PER_GROUP(sb) >> 2);
+		/* mb_group_prealloc itself may be bigger than that */
+		ac->ac_g_ex.fe_len = max_t(unsigned int, ac->ac_g_ex.fe_len,
+				   EXT4_SB(sb)->s_mb_group_prealloc);
+	}
+#endif
 	mb_debug(1, "#%u: goal %u blocks for locality group\n",
 		current->pid, ac->ac_g_ex.fe_len);
 }
@@ -3240,6 +3809,11 @@ ext4_mb_use_preallocated(struct ext4_allocation_context *ac)
 	struct ext4_locality_group *lg;
 	struct ext4_prealloc_space *pa, *cpa = NULL;
 	ext4_fsblk_t goal_block;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_PREALLOC
+	struct ext4_sb_info *sbi = EXT4_SB(ac->ac_sb);
+	int stale_pa = ext4_snapshot_active(sbi);
+	__u32 snapshot_id = le32_to_cpu(sbi->s_es->s_snapshot_id);
+#endif
 
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DATA
 	/*
@@ -3263,7 +3837,12 @@ ext4_mb_use_preallocated(struct ext4_allocation_context *ac)
 	 */
 	if (ext4_snapshot_active(EXT4_SB(ac->ac_inode->i_sb)) &&
 	    !ext4_snapshot_mow_in_tid(ac->ac_inode)) {
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_PREALLOC
+		/* preallocations created after snapshot take are kept */
+		ext4_discard_snapshot_preallocations(ac->ac_inode);
+#else
 		ext4_discard_preallocations(ac->ac_inode);
+#endif
 	}
 #endif
 	/* only data can be preallocated */
@@ -3285,6 +3864,16 @@ ext4_mb_use_preallocated(struct ext4_allocation_context *ac)
 			pa->pa_pstart + pa->pa_len > EXT4_MAX_BLOCK_FILE_PHYS)
 			continue;
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_PREALLOC
+		/*
+		 * pa created before snapshot take, which was busy when stale
+		 * preallocations were discarded - its blocks are in use by
+		 * the snapshot.
+		 */
+		if (stale_pa && pa->pa_snapshot_id != snapshot_id)
+			continue;
+#endif
+
 		/* found preallocated blocks, use them */
 		spin_lock(&pa->pa_lock);
 		if (pa->pa_deleted == 0 && pa->pa_free) {
@@ -3335,8 +3924,14 @@ ext4_mb_use_preallocated(struct ext4_allocation_context *ac)
 	if (cpa) {
 		ext4_mb_use_group_pa(ac, cpa);
 		ac->ac_criteria = 20;
+#ifdef CONFIG_EXT4_FS_MB_ADAPTIVE_GROUP_PREALLOC
+		lg->lg_hits++;
+#endif
 		return 1;
 	}
+#ifdef CONFIG_EXT4_FS_MB_ADAPTIVE_GROUP_PREALLOC
+	lg->lg_misses++;
+#endif
 	return 0;
 }
 
@@ -3538,6 +4133,9 @@ ext4_mb_new_inode_pa(struct ext4_allocation_context *ac)
 	INIT_LIST_HEAD(&pa->pa_group_list);
 	pa->pa_deleted = 0;
 	pa->pa_type = MB_INODE_PA;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_PREALLOC
+	pa->pa_snapshot_id = le32_to_cpu(EXT4_SB(sb)->s_es->s_snapshot_id);
+#endif
 
 	mb_debug(1, "new inode pa %p: %llu/%u for %u\n", pa,
 			pa->pa_pstart, pa->pa_len, pa->pa_lstart);
@@ -3940,6 +4538,82 @@ repeat:
 	}
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_PREALLOC
+/*
+ * Discard the inode preallocations, which were created before the active
+ * snapshot was taken.  The free blocks of these preallocations are marked
+ * in use in the snapshot COW bitmap, so they may not be allocated to the
+ * inode.  Preallocations that were created after snapshot take are kept.
+ * Preallocations that are in use or being discarded are skipped here, and
+ * ext4_mb_use_preallocated() does not use them while the snapshot is active.
+ */
+static void ext4_discard_snapshot_preallocations(struct inode *inode)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct super_block *sb = inode->i_sb;
+	__u32 snapshot_id = le32_to_cpu(EXT4_SB(sb)->s_es->s_snapshot_id);
+	struct buffer_head *bitmap_bh = NULL;
+	struct ext4_prealloc_space *pa, *tmp;
+	ext4_group_t group = 0;
+	struct list_head list;
+	struct ext4_buddy e4b;
+	int err;
+
+	if (!S_ISREG(inode->i_mode))
+		return;
+
+	INIT_LIST_HEAD(&list);
+
+	/* collect the inode pa's that were created before snapshot take */
+	spin_lock(&ei->i_prealloc_lock);
+	list_for_each_entry_safe(pa, tmp, &ei->i_prealloc_list, pa_inode_list) {
+		if (pa->pa_snapshot_id == snapshot_id)
+			continue;
+		spin_lock(&pa->pa_lock);
+		if (atomic_read(&pa->pa_count) || pa->pa_deleted) {
+			spin_unlock(&pa->pa_lock);
+			continue;
+		}
+		pa->pa_deleted = 1;
+		spin_unlock(&pa->pa_lock);
+		list_del_rcu(&pa->pa_inode_list);
+		list_add(&pa->u.pa_tmp_list, &list);
+	}
+	spin_unlock(&ei->i_prealloc_lock);
+
+	list_for_each_entry_safe(pa, tmp, &list, u.pa_tmp_list) {
+		BUG_ON(pa->pa_type != MB_INODE_PA);
+		ext4_get_group_no_and_offset(sb, pa->pa_pstart, &group, NULL);
+
+		err = ext4_mb_load_buddy(sb, group, &e4b);
+		if (err) {
+			ext4_error(sb, "Error loading buddy information for %u",
+					group);
+			continue;
+		}
+
+		bitmap_bh = ext4_read_block_bitmap(sb, group);
+		if (bitmap_bh == NULL) {
+			ext4_error(sb, "Error reading block bitmap for %u",
+					group);
+			ext4_mb_unload_buddy(&e4b);
+			continue;
+		}
+
+		ext4_lock_group(sb, group);
+		list_del(&pa->pa_group_list);
+		ext4_mb_release_inode_pa(&e4b, bitmap_bh, pa);
+		ext4_unlock_group(sb, group);
+
+		ext4_mb_unload_buddy(&e4b);
+		put_bh(bitmap_bh);
+
+		list_del(&pa->u.pa_tmp_list);
+		call_rcu(&(pa)->u.pa_rcu, ext4_mb_pa_callback);
+	}
+}
+
+#endif
 #ifdef CONFIG_EXT4_DEBUG
 static void ext4_mb_show_ac(struct ext4_allocation_context *ac)
 {
@@ -4423,6 +5097,24 @@ repeat:
 		else {
 			block = ext4_grp_offs_to_block(sb, &ac->ac_b_ex);
 			ar->len = ac->ac_b_ex.fe_len;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_TRACK
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_DATA
+			/* copies of journaled data are not in the reserve */
+			if (ext4_snapshot_file(ar->inode) &&
+			    !(ext4_handle_valid(handle) && handle->h_cow_data))
+#else
+			if (ext4_snapshot_file(ar->inode))
+#endif
+				/* snapshot blocks consume snapshot reserve */
+				percpu_counter_sub(
+					&sbi->s_snapshot_r_blocks_counter,
+					ar->len);
+			else if ((ar->flags & EXT4_MB_HINT_METADATA) ||
+				 S_ISDIR(ar->inode->i_mode) ||
+				 S_ISLNK(ar->inode->i_mode))
+				percpu_counter_add(&sbi->s_meta_blocks_counter,
+						   ar->len);
+#endif
 		}
 	} else {
 		freed  = ext4_mb_discard_preallocations(sb, ac->ac_o_ex.fe_len);
@@ -4465,7 +5157,11 @@ static int can_merge(struct ext4_free_data *entry1,
 {
 	if ((entry1->t_tid == entry2->t_tid) &&
 	    (entry1->group == entry2->group) &&
-	    ((entry1->start_blk + entry1->count) == entry2->start_blk))
+	    ((entry1->start_blk + entry1->count) == entry2->start_blk)
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_DISCARD
+	    && (entry1->snapshot == entry2->snapshot)
+#endif
+	    )
 		return 1;
 	return 0;
 }
@@ -4610,6 +5306,16 @@ void ext4_free_blocks(handle_t *handle, struct inode *inode,
 
 	ext4_debug("freeing block %llu\n", block);
 	trace_ext4_free_blocks(inode, block, count, flags);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_TRACK
+	/* directory and symlink blocks are also freed as metadata */
+	if ((flags & EXT4_FREE_BLOCKS_METADATA) && !ext4_snapshot_file(inode))
+		percpu_counter_sub(&sbi->s_meta_blocks_counter, count);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_EXACT
+	/* blocks freed from active snapshot return to snapshot reserve */
+	if (ext4_snapshot_is_active(inode))
+		percpu_counter_add(&sbi->s_snapshot_r_blocks_counter, count);
+#endif
 
 	if (flags & EXT4_FREE_BLOCKS_FORGET) {
 		struct buffer_head *tbh = bh;
@@ -4650,6 +5356,36 @@ do_more:
 		overflow = bit + count - EXT4_BLOCKS_PER_GROUP(sb);
 		count -= overflow;
 	}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE_BULK
+	/*
+	 * Move blocks in use by the snapshot before reading the group
+	 * bitmaps, which are not modified for moved blocks.  Deleting a large
+	 * file with an active snapshot then costs no bitmap lookups.
+	 */
+	maxblocks = count;
+	ret = ext4_snapshot_get_delete_access(handle, inode,
+					      block, &maxblocks);
+	if (ret < 0) {
+		ext4_journal_abort_handle(where, line, __func__,
+					  NULL, handle, ret);
+		err = ret;
+		goto error_return;
+	}
+	if (ret > 0) {
+		/* 'ret' blocks were moved to snapshot - skip them */
+		block += maxblocks;
+		count -= maxblocks;
+		count += overflow;
+		cond_resched();
+		if (count > 0)
+			goto do_more;
+		/* no more blocks to free/move to snapshot */
+		ext4_mark_super_dirty(sb);
+		goto error_return;
+	}
+	overflow += count - maxblocks;
+	count = maxblocks;
+#endif
 	bitmap_bh = ext4_read_block_bitmap(sb, block_group);
 	if (!bitmap_bh) {
 		err = -EIO;
@@ -4674,7 +5410,8 @@ do_more:
 		goto error_return;
 	}
 
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE
+#if defined(CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE) && \
+	!defined(CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE_BULK)
 	maxblocks = count;
 	ret = ext4_snapshot_get_delete_access(handle, inode,
 					      block, &maxblocks);
@@ -4749,6 +5486,15 @@ do_more:
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
 	if (exclude_bitmap_bh) {
 		unsigned long i;
+#ifdef CONFIG_EXT4_FS_MB_FIND_RUN
+		int set;
+
+		/* length of the run of excluded (or non-excluded) blocks */
+		i = mb_find_run(exclude_bitmap_bh->b_data, bit + count, bit,
+				&set);
+		if (set != !!excluded_file)
+			i = 0;
+#else
 
 		if (excluded_file)
 			i = mb_find_next_zero_bit(exclude_bitmap_bh->b_data,
@@ -4756,8 +5502,15 @@ do_more:
 		else
 			i = mb_find_next_bit(exclude_bitmap_bh->b_data,
 					     bit + count, bit) - bit;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+		/* file blocks are still being marked in exclude bitmap */
+		if (i < count && excluded_file > 0 &&
+		    ext4_snapshot_exclude_pending(inode))
+			i = count;
+#endif
 		if (i < count) {
-			EXT4_SET_FLAGS(sb, EXT4_FLAGS_FIX_EXCLUDE);
+			ext4_snapshot_mark_group_fix(handle, sb, block_group);
 			ext4_error(sb, "%sexcluded file (ino=%lu)"
 				   " block [%lu-%lu/%u, %llu] was %sexcluded!"
 				   " - run fsck to fix exclude bitmap.\n",
@@ -4792,6 +5545,9 @@ do_more:
 		new_entry->group  = block_group;
 		new_entry->count = count;
 		new_entry->t_tid = handle->h_transaction->t_tid;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_DISCARD
+		new_entry->snapshot = ext4_snapshot_file(inode);
+#endif
 
 		ext4_lock_group(sb, block_group);
 		mb_clear_bits(bitmap_bh->b_data, bit, count);
@@ -4824,7 +5580,7 @@ do_more:
 
 	if (sbi->s_log_groups_per_flex) {
 		ext4_group_t flex_group = ext4_flex_group(sbi, block_group);
-		atomic_add(count, &sbi->s_flex_groups[flex_group].free_blocks);
+		ext4_flex_add(sbi, flex_group, 0, count, 0);
 	}
 
 	ext4_mb_unload_buddy(&e4b);
@@ -4981,8 +5737,7 @@ int ext4_group_add_blocks(handle_t *handle, struct super_block *sb,
 
 	if (sbi->s_log_groups_per_flex) {
 		ext4_group_t flex_group = ext4_flex_group(sbi, block_group);
-		atomic_add(blocks_freed,
-			   &sbi->s_flex_groups[flex_group].free_blocks);
+		ext4_flex_add(sbi, flex_group, 0, blocks_freed, 0);
 	}
 
 	ext4_mb_unload_buddy(&e4b);
@@ -5126,6 +5881,266 @@ out:
 	return count;
 }
 
+#ifdef CONFIG_EXT4_FS_MB_BATCHED_TRIM
+/*
+ * Batched FITRIM
+ *
+ * Free extents are marked in use in the buddy of their group, so no one
+ * can allocate them while they are being discarded, and collected into a
+ * batch.  When the batch is full, adjacent extents (also across groups)
+ * are merged, the discards of all extents are submitted at once and after
+ * they complete, the extents are freed in the buddy again.
+ * The buddies of the groups in the batch are kept loaded, because an
+ * evicted buddy would be rebuilt from the block bitmap, where the extents
+ * are still free.
+ *
+ * Blocks that were moved into a snapshot on delete are still in use in
+ * the block bitmap, so they are never seen as free and never discarded.
+ */
+struct ext4_trim_range {
+	int		tr_e4b;		/* index of group buddy in batch */
+	ext4_grpblk_t	tr_start;
+	ext4_grpblk_t	tr_count;
+};
+
+struct ext4_trim_batch {
+	struct super_block	*tb_sb;
+	struct ext4_buddy	tb_e4b[MB_TRIM_BATCH_GROUPS];
+	int			tb_nr_groups;
+	struct ext4_trim_range	tb_range[MB_TRIM_BATCH_RANGES];
+	int			tb_nr_ranges;
+	/* in-flight discard bios */
+	atomic_t		tb_pending;
+	struct completion	tb_done;
+	struct ext4_trim_stats	tb_stats;
+};
+
+static void ext4_trim_end_io(struct bio *bio, int err)
+{
+	struct ext4_trim_batch *tb = bio->bi_private;
+
+	/* discard errors are ignored, as they are by ext4_trim_extent() */
+	if (atomic_dec_and_test(&tb->tb_pending))
+		complete(&tb->tb_done);
+	bio_put(bio);
+}
+
+/*
+ * submit the discard bios of one merged extent without waiting for them
+ */
+static void ext4_trim_submit(struct ext4_trim_batch *tb,
+			     ext4_fsblk_t block, ext4_fsblk_t count)
+{
+	struct super_block *sb = tb->tb_sb;
+	struct request_queue *q = bdev_get_queue(sb->s_bdev);
+	sector_t sector = block << (sb->s_blocksize_bits - 9);
+	sector_t nr_sects = count << (sb->s_blocksize_bits - 9);
+	unsigned int max_sects;
+	struct bio *bio;
+
+	trace_ext4_discard_blocks(sb, (unsigned long long) block, count);
+
+	max_sects = min(q->limits.max_discard_sectors, UINT_MAX >> 9);
+	if (q->limits.discard_granularity)
+		max_sects &= ~((q->limits.discard_granularity >> 9) - 1);
+	if (!max_sects)
+		return;
+
+	while (nr_sects) {
+		unsigned int len = min_t(sector_t, nr_sects, max_sects);
+
+		bio = bio_alloc(GFP_NOFS, 1);
+		if (!bio)
+			return;
+		bio->bi_sector = sector;
+		bio->bi_bdev = sb->s_bdev;
+		bio->bi_end_io = ext4_trim_end_io;
+		bio->bi_private = tb;
+		bio->bi_size = len << 9;
+		sector += len;
+		nr_sects -= len;
+
+		atomic_inc(&tb->tb_pending);
+		submit_bio(REQ_WRITE | REQ_DISCARD, bio);
+		tb->tb_stats.ts_discards++;
+	}
+}
+
+/*
+ * discard all extents in the batch, free them in the buddy and unload
+ * the group buddies
+ */
+static void ext4_trim_batch_flush(struct ext4_trim_batch *tb)
+{
+	struct super_block *sb = tb->tb_sb;
+	struct ext4_trim_range *tr;
+	ext4_fsblk_t start = 0, block, count = 0;
+	struct blk_plug plug;
+	int i;
+
+	atomic_set(&tb->tb_pending, 1);
+	INIT_COMPLETION(tb->tb_done);
+	blk_start_plug(&plug);
+	for (i = 0; i < tb->tb_nr_ranges; i++) {
+		tr = &tb->tb_range[i];
+		block = ext4_group_first_block_no(sb,
+				tb->tb_e4b[tr->tr_e4b].bd_group) + tr->tr_start;
+		if (count && start + count == block) {
+			count += tr->tr_count;
+			continue;
+		}
+		if (count)
+			ext4_trim_submit(tb, start, count);
+		start = block;
+		count = tr->tr_count;
+	}
+	if (count)
+		ext4_trim_submit(tb, start, count);
+	blk_finish_plug(&plug);
+	if (!atomic_dec_and_test(&tb->tb_pending))
+		wait_for_completion(&tb->tb_done);
+
+	for (i = 0; i < tb->tb_nr_ranges; i++) {
+		struct ext4_buddy *e4b;
+
+		tr = &tb->tb_range[i];
+		e4b = &tb->tb_e4b[tr->tr_e4b];
+		ext4_lock_group(sb, e4b->bd_group);
+		mb_free_blocks(NULL, e4b, tr->tr_start, tr->tr_count);
+		ext4_unlock_group(sb, e4b->bd_group);
+	}
+	for (i = 0; i < tb->tb_nr_groups; i++)
+		ext4_mb_unload_buddy(&tb->tb_e4b[i]);
+	tb->tb_nr_ranges = 0;
+	tb->tb_nr_groups = 0;
+}
+
+/*
+ * collect free extents of @group from *@startp to @max into the batch.
+ * Stops when the batch is full, with *@startp set to where to resume, or
+ * sets *@startp to @max when done with the group.
+ * Returns the no. of blocks collected or a negative error.
+ */
+static ext4_grpblk_t
+ext4_trim_batch_group(struct ext4_trim_batch *tb, ext4_group_t group,
+		      ext4_grpblk_t *startp, ext4_grpblk_t max,
+		      ext4_grpblk_t minblocks)
+{
+	struct super_block *sb = tb->tb_sb;
+	struct ext4_buddy *e4b = &tb->tb_e4b[tb->tb_nr_groups];
+	int nr_ranges = tb->tb_nr_ranges;
+	ext4_grpblk_t start = *startp, next, count = 0, free_count = 0;
+	struct ext4_free_extent ex;
+	void *bitmap;
+	int ret;
+
+	trace_ext4_trim_all_free(sb, group, start, max);
+
+	ret = ext4_mb_load_buddy(sb, group, e4b);
+	if (ret) {
+		ext4_error(sb, "Error in loading buddy "
+				"information for %u", group);
+		return ret;
+	}
+	bitmap = e4b->bd_bitmap;
+
+	ext4_lock_group(sb, group);
+	if (EXT4_MB_GRP_WAS_TRIMMED(e4b->bd_info) &&
+	    minblocks >= atomic_read(&EXT4_SB(sb)->s_last_trim_minblks)) {
+		start = max;
+		goto out;
+	}
+
+	start = (e4b->bd_info->bb_first_free > start) ?
+		e4b->bd_info->bb_first_free : start;
+
+	while (start < max) {
+		if (tb->tb_nr_ranges == MB_TRIM_BATCH_RANGES)
+			break;
+		start = mb_find_next_zero_bit(bitmap, max, start);
+		if (start >= max)
+			break;
+		next = mb_find_next_bit(bitmap, max, start);
+
+		if ((next - start) >= minblocks) {
+			trace_ext4_trim_extent(sb, group, start, next - start);
+			ex.fe_start = start;
+			ex.fe_group = group;
+			ex.fe_len = next - start;
+			/* no one can reuse them while being trimmed */
+			mb_mark_used(e4b, &ex);
+			tb->tb_range[tb->tb_nr_ranges].tr_e4b =
+				tb->tb_nr_groups;
+			tb->tb_range[tb->tb_nr_ranges].tr_start = start;
+			tb->tb_range[tb->tb_nr_ranges].tr_count = next - start;
+			tb->tb_nr_ranges++;
+			tb->tb_stats.ts_extents++;
+			count += next - start;
+		}
+		free_count += next - start;
+		start = next + 1;
+
+		if (fatal_signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+
+		if (need_resched()) {
+			ext4_unlock_group(sb, group);
+			cond_resched();
+			ext4_lock_group(sb, group);
+		}
+
+		/* bb_free does not include the blocks marked above */
+		if ((e4b->bd_info->bb_free + count - free_count) < minblocks) {
+			start = max;
+			break;
+		}
+	}
+
+	if (!ret && start >= max)
+		EXT4_MB_GRP_SET_TRIMMED(e4b->bd_info);
+out:
+	ext4_unlock_group(sb, group);
+	if (tb->tb_nr_ranges > nr_ranges)
+		tb->tb_nr_groups++;
+	else
+		ext4_mb_unload_buddy(e4b);
+
+	*startp = start;
+	tb->tb_stats.ts_blocks += count;
+	return ret ? ret : count;
+}
+
+/*
+ * batched variant of ext4_trim_all_free()
+ */
+static ext4_grpblk_t
+ext4_trim_all_free_batched(struct ext4_trim_batch *tb, ext4_group_t group,
+			   ext4_grpblk_t start, ext4_grpblk_t max,
+			   ext4_grpblk_t minblocks)
+{
+	ext4_grpblk_t ret, count = 0;
+
+	tb->tb_stats.ts_groups++;
+	while (start < max) {
+		if (tb->tb_nr_groups == MB_TRIM_BATCH_GROUPS ||
+		    tb->tb_nr_ranges == MB_TRIM_BATCH_RANGES)
+			ext4_trim_batch_flush(tb);
+		ret = ext4_trim_batch_group(tb, group, &start, max, minblocks);
+		if (ret < 0)
+			return ret;
+		count += ret;
+	}
+
+	ext4_debug("collected %d blocks to trim in the group %d\n",
+		count, group);
+
+	return count;
+}
+
+#endif
+
 /**
  * ext4_trim_fs() -- trim ioctl handle function
  * @sb:			superblock for filesystem
@@ -5148,6 +6163,9 @@ int ext4_trim_fs(struct super_block *sb, struct fstrim_range *range)
 	ext4_fsblk_t first_data_blk =
 			le32_to_cpu(EXT4_SB(sb)->s_es->s_first_data_block);
 	int ret = 0;
+#ifdef CONFIG_EXT4_FS_MB_BATCHED_TRIM
+	struct ext4_trim_batch *tb = NULL;
+#endif
 
 	start = range->start >> sb->s_blocksize_bits;
 	len = range->len >> sb->s_blocksize_bits;
@@ -5173,6 +6191,14 @@ int ext4_trim_fs(struct super_block *sb, struct fstrim_range *range)
 	if (first_group > last_group)
 		return -EINVAL;
 
+#ifdef CONFIG_EXT4_FS_MB_BATCHED_TRIM
+	/* fall back to trimming extent by extent if we cannot get a batch */
+	tb = kzalloc(sizeof(*tb), GFP_NOFS);
+	if (tb) {
+		tb->tb_sb = sb;
+		init_completion(&tb->tb_done);
+	}
+#endif
 	for (group = first_group; group <= last_group; group++) {
 		grp = ext4_get_group_info(sb, group);
 		/* We only do this if the grp has never been initialized */
@@ -5192,6 +6218,20 @@ int ext4_trim_fs(struct super_block *sb, struct fstrim_range *range)
 			last_block = first_block + len;
 		len -= last_block - first_block;
 
+#ifdef CONFIG_EXT4_FS_MB_BATCHED_TRIM
+		cnt = 0;
+		if (tb && EXT4_MB_GRP_WAS_TRIMMED(grp) &&
+		    minlen >= atomic_read(&EXT4_SB(sb)->s_last_trim_minblks)) {
+			tb->tb_stats.ts_skipped++;
+		} else if (tb && grp->bb_free >= minlen) {
+			cnt = ext4_trim_all_free_batched(tb, group, first_block,
+							 last_block, minlen);
+			if (cnt < 0) {
+				ret = cnt;
+				break;
+			}
+		} else
+#endif
 		if (grp->bb_free >= minlen) {
 			cnt = ext4_trim_all_free(sb, group, first_block,
 						last_block, minlen);
@@ -5203,6 +6243,16 @@ int ext4_trim_fs(struct super_block *sb, struct fstrim_range *range)
 		trimmed += cnt;
 		first_block = 0;
 	}
+#ifdef CONFIG_EXT4_FS_MB_BATCHED_TRIM
+	if (tb) {
+		/* also on error, to free the extents marked in use */
+		ext4_trim_batch_flush(tb);
+		spin_lock(&EXT4_SB(sb)->s_trim_stats_lock);
+		EXT4_SB(sb)->s_trim_stats = tb->tb_stats;
+		spin_unlock(&EXT4_SB(sb)->s_trim_stats_lock);
+		kfree(tb);
+	}
+#endif
 	range->len = trimmed * sb->s_blocksize;
 
 	if (!ret)
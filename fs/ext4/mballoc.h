@@ -89,11 +89,55 @@ extern u8 mb_enable_debug;
  */
 #define MB_DEFAULT_ORDER2_REQS		2
 
+#ifdef CONFIG_EXT4_FS_MB_GROUP_INDEX
+/*
+ * default value of group index tunable
+ */
+#define MB_DEFAULT_GROUP_INDEX		1
+
+/*
+ * number of groups taken from a largest free order list at a time
+ */
+#define MB_GROUP_INDEX_BATCH		8
+
+/* orders of the buddy: 0 .. blocksize_bits + 1 */
+#define MB_NUM_ORDERS(sb)		((sb)->s_blocksize_bits + 2)
+#endif
+
+#ifdef CONFIG_EXT4_FS_MB_PREFETCH
+/*
+ * default no. of groups whose block bitmaps are read ahead at once
+ * by the buddy prefetch after mount
+ */
+#define MB_DEFAULT_PREFETCH		32
+#endif
+
 /*
  * default group prealloc size 512 blocks
  */
 #define MB_DEFAULT_GROUP_PREALLOC	512
 
+#ifdef CONFIG_EXT4_FS_MB_BATCHED_TRIM
+/*
+ * FITRIM batch size - free extents are marked in use and collected from
+ * up to MB_TRIM_BATCH_GROUPS groups, before the discards of up to
+ * MB_TRIM_BATCH_RANGES (merged) extents are submitted together
+ */
+#define MB_TRIM_BATCH_RANGES		64
+#define MB_TRIM_BATCH_GROUPS		16
+#endif
+
+#ifdef CONFIG_EXT4_FS_MB_ADAPTIVE_GROUP_PREALLOC
+#define MB_DEFAULT_GROUP_PREALLOC_ADAPT	1
+/*
+ * locality group prealloc size is re-evaluated every MB_LG_ADAPT_WINDOW
+ * group allocations and ranges from mb_group_prealloc to
+ * mb_group_prealloc << MB_LG_PREALLOC_MAX_SHIFT blocks
+ */
+#define MB_LG_ADAPT_WINDOW		64
+#define MB_LG_PREALLOC_MAX_SHIFT	3
+#endif
+
 
 struct ext4_free_data {
 	/* this links the free block information from group_info */
@@ -111,6 +155,11 @@ struct ext4_free_data {
 
 	/* transaction which freed this extent */
 	tid_t	t_tid;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_DISCARD
+
+	/* extent freed from a snapshot file, discarded in a batch */
+	int	snapshot;
+#endif
 };
 
 struct ext4_prealloc_space {
@@ -130,6 +179,9 @@ struct ext4_prealloc_space {
 	unsigned short		pa_type;	/* pa type. inode or group */
 	spinlock_t		*pa_obj_lock;
 	struct inode		*pa_inode;	/* hack, for history only */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_PREALLOC
+	__u32			pa_snapshot_id;	/* snapshot id on creation */
+#endif
 };
 
 enum {
@@ -160,6 +212,12 @@ struct ext4_locality_group {
 	/* list of preallocations */
 	struct list_head	lg_prealloc_list[PREALLOC_TB_SIZE];
 	spinlock_t		lg_prealloc_lock;
+#ifdef CONFIG_EXT4_FS_MB_ADAPTIVE_GROUP_PREALLOC
+	/* protected by lg_mutex */
+	unsigned int		lg_prealloc_shift; /* size is prealloc << shift */
+	unsigned int		lg_hits;	/* requests served by lg pa */
+	unsigned int		lg_misses;	/* requests sent to the buddy */
+#endif
 };
 
 struct ext4_allocation_context {
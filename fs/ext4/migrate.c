@@ -395,7 +395,10 @@ static int ext4_ext_swap_inode_data(handle_t *handle, struct inode *inode,
 
 	/*
 	 * We mark the inode dirty after, because we decrement the
-	 * i_blocks when freeing the indirect meta-data blocks
+	 * i_blocks when freeing the indirect meta-data blocks.
+	 * With an active snapshot, indirect blocks that are in use by the
+	 * snapshot are moved to the snapshot by ext4_free_blocks() and the
+	 * data blocks are moved on write by the extent hooks from now on.
 	 */
 	retval = free_ind_block(handle, inode, i_data);
 	ext4_mark_inode_dirty(handle, inode);
@@ -477,12 +480,35 @@ int ext4_ext_migrate(struct inode *inode)
 				       EXT4_FEATURE_INCOMPAT_EXTENTS) ||
 	    (ext4_test_inode_flag(inode, EXT4_INODE_EXTENTS)))
 		return -EINVAL;
+#ifdef CONFIG_EXT4_FS_INLINE_DATA
+	/* inline data has no blocks to map */
+	if (ext4_has_inline_data(inode))
+		return -EINVAL;
+#endif
 
 	if (S_ISLNK(inode->i_mode) && inode->i_blocks == 0)
 		/*
 		 * don't migrate fast symlink
 		 */
 		return retval;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_MIGRATE
+
+	/* snapshot files have a special indirect map - never migrate them */
+	if (ext4_snapshot_file(inode))
+		return -EPERM;
+
+	/*
+	 * With an active snapshot, writeback of a dirty page, whose block is
+	 * in use by the snapshot, moves the block on write and fails the
+	 * migrate with -EAGAIN.  Writes are blocked by i_mutex, so write
+	 * back the dirty pages before the migrate starts.
+	 */
+	if (ext4_snapshot_has_active(inode->i_sb)) {
+		retval = filemap_write_and_wait(inode->i_mapping);
+		if (retval)
+			return retval;
+	}
+#endif
 
 	handle = ext4_journal_start(inode,
 					EXT4_DATA_TRANS_BLOCKS(inode->i_sb) +
@@ -508,6 +534,14 @@ int ext4_ext_migrate(struct inode *inode)
 	 * when we drop inode reference.
 	 */
 	tmp_inode->i_nlink = 0;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_INHERIT
+	/*
+	 * The extent blocks of tmp_inode are swapped into an indirect mapped
+	 * file, which is never excluded, so they must not be excluded on
+	 * allocation if tmp_inode inherited the flag from the root directory.
+	 */
+	ext4_clear_inode_flag(tmp_inode, EXT4_INODE_EXCLUDED);
+#endif
 
 	ext4_ext_tree_init(handle, tmp_inode);
 	ext4_orphan_add(handle, tmp_inode);
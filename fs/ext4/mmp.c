@@ -3,6 +3,7 @@
 #include <linux/buffer_head.h>
 #include <linux/utsname.h>
 #include <linux/kthread.h>
+#include <linux/blkdev.h>
 
 #include "ext4.h"
 
@@ -79,6 +80,277 @@ void __dump_mmp_msg(struct super_block *sb, struct mmp_struct *mmp,
 		       mmp->mmp_nodename, mmp->mmp_bdevname);
 }
 
+#ifdef CONFIG_EXT4_FS_MMP_SHARED
+/*
+ * A single kmmpd thread updates the MMP blocks of all the mounted file
+ * systems with MMP, instead of one thread per file system. The updates
+ * which are due at about the same time are submitted together under one
+ * block plug, and the update interval of every file system is jittered,
+ * so the updates of many file systems are spread out evenly.
+ *
+ * The MMP block writes are not waited for, so a slow device only delays
+ * the update of its own MMP block. A write which is still in flight when
+ * the next update is due delays that update.
+ */
+static LIST_HEAD(ext4_mmp_list);
+static DEFINE_MUTEX(ext4_mmp_lock);
+static struct task_struct *ext4_mmp_task;
+
+/* Updates due within this slack are submitted together */
+#define EXT4_MMP_SLACK		(HZ / 2)
+
+static void kmmpd_schedule(struct mmpd_data *md)
+{
+	struct ext4_super_block *es = EXT4_SB(md->sb)->s_es;
+	unsigned long interval = le16_to_cpu(es->s_mmp_update_interval) * HZ;
+
+	md->next_update = jiffies + interval - random32() % (interval / 8 + 1);
+}
+
+/*
+ * Update the MMP block of one file system.
+ * Returns 1 if MMP is not needed anymore for the file system.
+ */
+static int kmmpd_update(struct mmpd_data *md)
+{
+	struct super_block *sb = md->sb;
+	struct buffer_head *bh = md->bh;
+	struct ext4_super_block *es = EXT4_SB(sb)->s_es;
+	struct mmp_struct *mmp = (struct mmp_struct *)(bh->b_data);
+	unsigned long diff = jiffies - md->last_update;
+	int retval;
+
+	if (!(le32_to_cpu(es->s_feature_incompat) &
+	    EXT4_FEATURE_INCOMPAT_MMP)) {
+		ext4_warning(sb, "kmmpd being stopped since MMP feature"
+			     " has been disabled.");
+		return 1;
+	}
+
+	if (sb->s_flags & MS_RDONLY) {
+		ext4_warning(sb, "kmmpd being stopped since filesystem "
+			     "has been remounted as readonly.");
+		return 1;
+	}
+
+	if (buffer_locked(bh)) {
+		/* the last update is still in flight */
+		md->next_update = jiffies + HZ;
+		return 0;
+	}
+
+	/*
+	 * Don't spew too many error messages. Print one every
+	 * (s_mmp_update_interval * 60) seconds.
+	 */
+	if (md->seq && !buffer_uptodate(bh) &&
+	    (md->failed_writes++ % 60) == 0)
+		ext4_error(sb, "Error writing to MMP block");
+
+	/*
+	 * We need to make sure that more than mmp_check_interval
+	 * seconds have not passed since writing. If that has happened
+	 * we need to check if the MMP block is as we left it.
+	 */
+	if (md->seq && diff > md->check_interval * HZ) {
+		struct buffer_head *bh_check = NULL;
+		struct mmp_struct *mmp_check;
+
+		retval = read_mmp_block(sb, &bh_check,
+					le64_to_cpu(es->s_mmp_block));
+		if (retval) {
+			ext4_error(sb, "error reading MMP data: %d", retval);
+			if (bh_check)
+				put_bh(bh_check);
+			return 1;
+		}
+
+		mmp_check = (struct mmp_struct *)(bh_check->b_data);
+		if (le32_to_cpu(mmp_check->mmp_seq) != md->seq ||
+		    memcmp(init_utsname()->sysname, mmp_check->mmp_nodename,
+			   sizeof(mmp_check->mmp_nodename))) {
+			dump_mmp_msg(sb, mmp_check,
+				     "Error while updating MMP info. "
+				     "The filesystem seems to have been"
+				     " multiply mounted.");
+			put_bh(bh_check);
+			ext4_error(sb, "abort");
+			return 1;
+		}
+		put_bh(bh_check);
+	}
+
+	/*
+	 * Adjust the mmp_check_interval depending on how much time
+	 * it took for the MMP block to be updated.
+	 */
+	if (md->seq)
+		md->check_interval = max(min(EXT4_MMP_CHECK_MULT * diff / HZ,
+					     EXT4_MMP_MAX_CHECK_INTERVAL),
+					 EXT4_MMP_MIN_CHECK_INTERVAL);
+
+	if (++md->seq > EXT4_MMP_SEQ_MAX)
+		md->seq = 1;
+	mmp->mmp_seq = cpu_to_le32(md->seq);
+	mmp->mmp_time = cpu_to_le64(get_seconds());
+	mmp->mmp_check_interval = cpu_to_le16(md->check_interval);
+	md->last_update = jiffies;
+
+	lock_buffer(bh);
+	set_buffer_uptodate(bh);
+	bh->b_end_io = end_buffer_write_sync;
+	get_bh(bh);
+	submit_bh(WRITE_SYNC, bh);
+
+	kmmpd_schedule(md);
+	return 0;
+}
+
+static void kmmpd_release(struct mmpd_data *md)
+{
+	wait_on_buffer(md->bh);
+	brelse(md->bh);
+	kfree(md);
+}
+
+/*
+ * kmmpd will update the MMP sequence of every file system every
+ * s_mmp_update_interval seconds
+ */
+static int kmmpd(void *data)
+{
+	struct mmpd_data *md, *n;
+	struct blk_plug plug;
+	unsigned long next_wakeup;
+
+	while (!kthread_should_stop()) {
+		next_wakeup = MAX_JIFFY_OFFSET;
+
+		mutex_lock(&ext4_mmp_lock);
+		blk_start_plug(&plug);
+		list_for_each_entry_safe(md, n, &ext4_mmp_list, list) {
+			if (time_before(jiffies + EXT4_MMP_SLACK,
+					md->next_update))
+				goto next;
+			if (kmmpd_update(md)) {
+				list_del(&md->list);
+				EXT4_SB(md->sb)->s_mmp_data = NULL;
+				kmmpd_release(md);
+				continue;
+			}
+next:
+			if (next_wakeup == MAX_JIFFY_OFFSET ||
+			    time_before(md->next_update, next_wakeup))
+				next_wakeup = md->next_update;
+		}
+		blk_finish_plug(&plug);
+		mutex_unlock(&ext4_mmp_lock);
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop()) {
+			__set_current_state(TASK_RUNNING);
+			break;
+		}
+		if (next_wakeup == MAX_JIFFY_OFFSET)
+			schedule();
+		else if (time_before(jiffies, next_wakeup))
+			schedule_timeout(next_wakeup - jiffies);
+		__set_current_state(TASK_RUNNING);
+	}
+	return 0;
+}
+
+/*
+ * Add the file system to the list of file systems updated by kmmpd and
+ * start kmmpd if it is not running.
+ */
+static int kmmpd_register(struct mmpd_data *md)
+{
+	struct super_block *sb = md->sb;
+	struct ext4_super_block *es = EXT4_SB(sb)->s_es;
+	struct mmp_struct *mmp = (struct mmp_struct *)(md->bh->b_data);
+	struct mmpd_data *old;
+	int mmp_update_interval = le16_to_cpu(es->s_mmp_update_interval);
+	int err = 0;
+
+	/*
+	 * Start with the higher mmp_check_interval and reduce it if
+	 * the MMP block is being updated on time.
+	 */
+	md->check_interval = max(EXT4_MMP_CHECK_MULT * mmp_update_interval,
+				 EXT4_MMP_MIN_CHECK_INTERVAL);
+	md->seq = 0;
+	md->failed_writes = 0;
+	md->last_update = jiffies;
+	md->next_update = jiffies;
+	bdevname(md->bh->b_bdev, mmp->mmp_bdevname);
+	memcpy(mmp->mmp_nodename, init_utsname()->sysname,
+	       sizeof(mmp->mmp_nodename));
+
+	mutex_lock(&ext4_mmp_lock);
+	if (!ext4_mmp_task) {
+		ext4_mmp_task = kthread_run(kmmpd, NULL, "kmmpd");
+		if (IS_ERR(ext4_mmp_task)) {
+			err = PTR_ERR(ext4_mmp_task);
+			ext4_mmp_task = NULL;
+			goto out;
+		}
+	}
+	/*
+	 * Remounted read-write before kmmpd noticed the read-only remount.
+	 * The MMP block has just been taken over by a new sequence.
+	 */
+	old = EXT4_SB(sb)->s_mmp_data;
+	if (old) {
+		list_del(&old->list);
+		kmmpd_release(old);
+	}
+	list_add_tail(&md->list, &ext4_mmp_list);
+	EXT4_SB(sb)->s_mmp_data = md;
+	wake_up_process(ext4_mmp_task);
+out:
+	mutex_unlock(&ext4_mmp_lock);
+	return err;
+}
+
+/*
+ * Remove the file system from the kmmpd list and mark the MMP block clean.
+ * Called on unmount.
+ */
+void ext4_stop_mmp(struct super_block *sb)
+{
+	struct mmpd_data *md;
+	struct mmp_struct *mmp;
+
+	mutex_lock(&ext4_mmp_lock);
+	md = EXT4_SB(sb)->s_mmp_data;
+	if (md)
+		list_del(&md->list);
+	EXT4_SB(sb)->s_mmp_data = NULL;
+	mutex_unlock(&ext4_mmp_lock);
+	if (!md)
+		return;
+
+	/*
+	 * Unmount seems to be clean.
+	 */
+	wait_on_buffer(md->bh);
+	mmp = (struct mmp_struct *)(md->bh->b_data);
+	mmp->mmp_seq = cpu_to_le32(EXT4_MMP_SEQ_CLEAN);
+	mmp->mmp_time = cpu_to_le64(get_seconds());
+	write_mmp_block(md->bh);
+	kmmpd_release(md);
+}
+
+/* Called on module unload, when no file system is mounted */
+void ext4_exit_mmp(void)
+{
+	if (ext4_mmp_task)
+		kthread_stop(ext4_mmp_task);
+	ext4_mmp_task = NULL;
+}
+
+#else
 /*
  * kmmpd will update the MMP sequence every s_mmp_update_interval seconds
  */
@@ -206,6 +478,7 @@ failed:
 	brelse(bh);
 	return retval;
 }
+#endif
 
 /*
  * Get a random new sequence number but make sure it is not greater than
@@ -327,6 +600,14 @@ skip:
 	mmpd_data->sb = sb;
 	mmpd_data->bh = bh;
 
+#ifdef CONFIG_EXT4_FS_MMP_SHARED
+	if (kmmpd_register(mmpd_data)) {
+		kfree(mmpd_data);
+		ext4_warning(sb, "Unable to create kmmpd thread for %s.",
+			     sb->s_id);
+		goto failed;
+	}
+#else
 	/*
 	 * Start a kernel thread to update the MMP block periodically.
 	 */
@@ -340,6 +621,7 @@ skip:
 			     sb->s_id);
 		goto failed;
 	}
+#endif
 
 	return 0;
 
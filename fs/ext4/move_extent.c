@@ -671,6 +671,11 @@ mext_replace_branches(handle_t *handle, struct inode *orig_inode,
 
 	/* Protect extent trees against block allocations via delalloc */
 	double_down_write_data_sem(orig_inode, donor_inode);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_NEW_BLOCKS
+	/* swapped blocks are no longer known to be newer than the snapshot */
+	ext4_snapshot_new_reset(orig_inode);
+	ext4_snapshot_new_reset(donor_inode);
+#endif
 
 	/* Get the original extent for the block "orig_off" */
 	*err = get_ext_path(orig_inode, orig_off, &orig_path);
@@ -823,6 +828,17 @@ move_extent_per_page(struct file *o_filp, struct inode *donor_inode,
 		*err = PTR_ERR(handle);
 		return 0;
 	}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_MOVE_EXT
+	/*
+	 * The orig blocks are swapped with the donor blocks below and the
+	 * page data is written to the (new) donor blocks, so the orig blocks
+	 * are not overwritten and should not be moved-on-write in
+	 * write_begin(). They are moved to snapshot without a data copy when
+	 * the donor file blocks are freed.
+	 */
+	if (ext4_handle_valid(handle))
+		handle->h_move_extent = 1;
+#endif
 
 	if (segment_eq(get_fs(), KERNEL_DS))
 		w_flags |= AOP_FLAG_UNINTERRUPTIBLE;
@@ -967,6 +983,27 @@ mext_check_arguments(struct inode *orig_inode,
 	if (IS_IMMUTABLE(donor_inode) || IS_APPEND(donor_inode))
 		return -EPERM;
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_MOVE_EXT
+	/* Snapshot files blocks must not be moved */
+	if (ext4_snapshot_file(orig_inode) || ext4_snapshot_file(donor_inode))
+		return -EPERM;
+
+	/*
+	 * The orig blocks are handed to the donor and moved to snapshot when
+	 * the donor is freed, so both files should be treated the same way by
+	 * the snapshot. The exclude bitmap must also stay in sync with the
+	 * excluded files blocks.
+	 */
+	if (ext4_snapshot_excluded(orig_inode) !=
+	    ext4_snapshot_excluded(donor_inode)) {
+		ext4_debug("ext4 move extent: The argument files should "
+			"both be excluded from snapshot or both not "
+			"[ino:orig %lu, donor %lu]\n",
+			orig_inode->i_ino, donor_inode->i_ino);
+		return -EINVAL;
+	}
+#endif
+
 	/* Ext4 move extent does not support swapfile */
 	if (IS_SWAPFILE(orig_inode) || IS_SWAPFILE(donor_inode)) {
 		ext4_debug("ext4 move extent: The argument files should "
@@ -161,6 +161,10 @@ static struct dx_frame *dx_probe(const struct qstr *d_name,
 				 struct dx_hash_info *hinfo,
 				 struct dx_frame *frame,
 				 int *err);
+#ifdef CONFIG_EXT4_FS_HTREE_READAHEAD
+static void dx_readahead(struct inode *dir, struct dx_entry *entries,
+			 struct dx_entry *at);
+#endif
 static void dx_release(struct dx_frame *frames);
 static int dx_make_map(struct ext4_dir_entry_2 *de, unsigned blocksize,
 		       struct dx_hash_info *hinfo, struct dx_map_entry map[]);
@@ -354,7 +358,7 @@ dx_probe(const struct qstr *d_name, struct inode *dir,
 	struct dx_frame *frame = frame_in;
 	u32 hash;
 
-	frame->bh = NULL;
+	memset(frame_in, 0, EXT4_HTREE_LEVEL * sizeof(frame_in[0]));
 	if (!(bh = ext4_bread (NULL,dir, 0, 0, err)))
 		goto fail;
 	root = (struct dx_root *) bh->b_data;
@@ -383,7 +387,8 @@ dx_probe(const struct qstr *d_name, struct inode *dir,
 		goto fail;
 	}
 
-	if ((indirect = root->info.indirect_levels) > 1) {
+	indirect = root->info.indirect_levels;
+	if (indirect >= ext4_dir_htree_level(dir->i_sb)) {
 		ext4_warning(dir->i_sb, "Unimplemented inode hash depth: %#06x",
 			     root->info.indirect_levels);
 		brelse(bh);
@@ -448,6 +453,13 @@ dx_probe(const struct qstr *d_name, struct inode *dir,
 		frame->entries = entries;
 		frame->at = at;
 		if (!indirect--) return frame;
+#ifdef CONFIG_EXT4_FS_HTREE_READAHEAD
+		/*
+		 * On a cold cache, read the index blocks that follow the one
+		 * we need together with it, for the lookups that will follow.
+		 */
+		dx_readahead(dir, entries, at);
+#endif
 		if (!(bh = ext4_bread (NULL,dir, dx_get_block(at), 0, err)))
 			goto fail2;
 		at = entries = ((struct dx_node *) bh->b_data)->entries;
@@ -474,14 +486,62 @@ fail:
 	return NULL;
 }
 
+#ifdef CONFIG_EXT4_FS_HTREE_READAHEAD
+/*
+ * Read ahead the blocks pointed to by the index entries from @at and on,
+ * but only if the block at @at is not cached.  Once the block at @at is
+ * found cached, the blocks that follow are likely cached too, so callers
+ * on the hot path pay for a single buffer lookup.
+ */
+static void dx_readahead(struct inode *dir, struct dx_entry *entries,
+			 struct dx_entry *at)
+{
+	struct dx_entry *end = entries + dx_get_count(entries);
+	unsigned int nr = EXT4_SB(dir->i_sb)->s_htree_readahead_blks;
+	struct buffer_head *bh;
+	struct blk_plug plug;
+	int err;
+
+	if (!nr || at >= end)
+		return;
+	bh = ext4_getblk(NULL, dir, dx_get_block(at), 0, &err);
+	if (!bh)
+		return;
+	if (buffer_uptodate(bh)) {
+		brelse(bh);
+		return;
+	}
+
+	blk_start_plug(&plug);
+	ll_rw_block(READA | REQ_META | REQ_PRIO, 1, &bh);
+	brelse(bh);
+	while (--nr && ++at < end) {
+		bh = ext4_getblk(NULL, dir, dx_get_block(at), 0, &err);
+		if (!bh)
+			continue;
+		if (!buffer_uptodate(bh))
+			ll_rw_block(READA | REQ_META | REQ_PRIO, 1, &bh);
+		brelse(bh);
+	}
+	blk_finish_plug(&plug);
+}
+
+#endif
 static void dx_release (struct dx_frame *frames)
 {
+	unsigned i, indirect_levels;
+
 	if (frames[0].bh == NULL)
 		return;
 
-	if (((struct dx_root *) frames[0].bh->b_data)->info.indirect_levels)
-		brelse(frames[1].bh);
-	brelse(frames[0].bh);
+	indirect_levels =
+		((struct dx_root *) frames[0].bh->b_data)->info.indirect_levels;
+	for (i = 0; i <= indirect_levels && i < EXT4_HTREE_LEVEL; i++) {
+		if (frames[i].bh == NULL)
+			break;
+		brelse(frames[i].bh);
+		frames[i].bh = NULL;
+	}
 }
 
 /*
@@ -577,6 +637,9 @@ static int htree_dirblock_to_tree(struct file *dir_file,
 							(unsigned long)block));
 	if (!(bh = ext4_bread (NULL, dir, block, 0, &err)))
 		return err;
+#ifdef CONFIG_EXT4_FS_DIR_INODE_READAHEAD
+	ext4_dirblock_inode_readahead(dir, bh);
+#endif
 
 	de = (struct ext4_dir_entry_2 *) bh->b_data;
 	top = (struct ext4_dir_entry_2 *) ((char *) de +
@@ -624,12 +687,15 @@ int ext4_htree_fill_tree(struct file *dir_file, __u32 start_hash,
 {
 	struct dx_hash_info hinfo;
 	struct ext4_dir_entry_2 *de;
-	struct dx_frame frames[2], *frame;
+	struct dx_frame frames[EXT4_HTREE_LEVEL], *frame;
 	struct inode *dir;
 	ext4_lblk_t block;
 	int count = 0;
 	int ret, err;
 	__u32 hashval;
+#ifdef CONFIG_EXT4_FS_READDIR_CACHE
+	int nr_blocks = 0;
+#endif
 
 	dxtrace(printk(KERN_DEBUG "In htree_fill_tree, start hash: %x:%x\n",
 		       start_hash, start_minor_hash));
@@ -668,6 +734,10 @@ int ext4_htree_fill_tree(struct file *dir_file, __u32 start_hash,
 
 	while (1) {
 		block = dx_get_block(frame->at);
+#ifdef CONFIG_EXT4_FS_HTREE_READAHEAD
+		/* stream the leaf blocks in hash order */
+		dx_readahead(dir, frame->entries, frame->at);
+#endif
 		ret = htree_dirblock_to_tree(dir_file, dir, block, &hinfo,
 					     start_hash, start_minor_hash);
 		if (ret < 0) {
@@ -683,6 +753,18 @@ int ext4_htree_fill_tree(struct file *dir_file, __u32 start_hash,
 			err = ret;
 			goto errout;
 		}
+#ifdef CONFIG_EXT4_FS_READDIR_CACHE
+		/*
+		 * Stop if:  (a) there are no more entries, or
+		 * (b) we have inserted at least one entry, read enough
+		 * blocks and the next hash value is not a continuation
+		 */
+		nr_blocks++;
+		if ((ret == 0) ||
+		    (count && nr_blocks >= EXT4_HTREE_FILL_BLOCKS &&
+		     ((hashval & 1) == 0)))
+			break;
+#else
 		/*
 		 * Stop if:  (a) there are no more entries, or
 		 * (b) we have inserted at least one entry and the
@@ -691,6 +773,7 @@ int ext4_htree_fill_tree(struct file *dir_file, __u32 start_hash,
 		if ((ret == 0) ||
 		    (count && ((hashval & 1) == 0)))
 			break;
+#endif
 	}
 	dx_release(frames);
 	dxtrace(printk(KERN_DEBUG "Fill tree: returned %d entries, "
@@ -976,7 +1059,7 @@ static struct buffer_head * ext4_dx_find_entry(struct inode *dir, const struct q
 {
 	struct super_block * sb = dir->i_sb;
 	struct dx_hash_info	hinfo;
-	struct dx_frame frames[2], *frame;
+	struct dx_frame frames[EXT4_HTREE_LEVEL], *frame;
 	struct buffer_head *bh;
 	ext4_lblk_t block;
 	int retval;
@@ -1029,6 +1112,14 @@ static struct dentry *ext4_lookup(struct inode *dir, struct dentry *dentry, stru
 	if (dentry->d_name.len > EXT4_NAME_LEN)
 		return ERR_PTR(-ENAMETOOLONG);
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_AUTOMOUNT
+	/* the virtual .snapshot directory hides a real file by that name */
+	if (EXT4_SNAPSHOTS(dir->i_sb) && dir->i_ino == EXT4_ROOT_INO &&
+	    dentry->d_name.len == sizeof(EXT4_SNAPSHOT_DIR_NAME) - 1 &&
+	    !memcmp(dentry->d_name.name, EXT4_SNAPSHOT_DIR_NAME,
+		    dentry->d_name.len))
+		return ext4_snapshot_dir_lookup(dir, dentry);
+#endif
 	bh = ext4_find_entry(dir, &dentry->d_name, &de);
 	inode = NULL;
 	if (bh) {
@@ -1242,6 +1333,119 @@ errout:
 	return NULL;
 }
 
+#ifdef CONFIG_EXT4_FS_DIR_FREE_HINTS
+/*
+ * Free space hints of linear directory blocks
+ *
+ * Adding an entry to a linear directory reads and parses every block from
+ * the start until one has room.  Remember the largest free record of the
+ * blocks that had no room, so the next insertions skip them without
+ * reading them.  A hint is reset to unknown when an entry is removed from
+ * its block, which is found by the low bits of its block number.
+ * Protected by the directory i_mutex.
+ */
+#define EXT4_DIR_HINT_MAX_BLOCKS	1024
+#define EXT4_DIR_HINT_UNKNOWN		0xffff
+
+struct ext4_dir_hint {
+	__u32	dh_pblk;	/* low bits of the block number */
+	__u16	dh_free;	/* largest free record or unknown */
+};
+
+struct ext4_dir_hints {
+	ext4_lblk_t		dh_blocks;
+	struct ext4_dir_hint	dh_hint[0];
+};
+
+void ext4_dir_hints_free(struct inode *dir)
+{
+	kfree(EXT4_I(dir)->i_dir_hints);
+	EXT4_I(dir)->i_dir_hints = NULL;
+}
+
+/* Returns 0 if @block of @dir is known to have no room for @reclen */
+static int ext4_dir_hint_fits(struct inode *dir, ext4_lblk_t block,
+			      unsigned int reclen)
+{
+	struct ext4_dir_hints *hints = EXT4_I(dir)->i_dir_hints;
+
+	if (!hints || block >= hints->dh_blocks)
+		return 1;
+	return hints->dh_hint[block].dh_free >= reclen;
+}
+
+static void ext4_dir_hint_set(struct inode *dir, ext4_lblk_t block,
+			      struct buffer_head *bh, unsigned int free)
+{
+	struct ext4_dir_hints *hints = EXT4_I(dir)->i_dir_hints;
+	ext4_lblk_t i, old = hints ? hints->dh_blocks : 0;
+
+	if (block >= EXT4_DIR_HINT_MAX_BLOCKS)
+		return;
+	if (block >= old) {
+		ext4_lblk_t blocks = min_t(ext4_lblk_t, EXT4_DIR_HINT_MAX_BLOCKS,
+				max_t(ext4_lblk_t, 2 * old, block + 1));
+
+		hints = krealloc(hints, sizeof(*hints) +
+				 blocks * sizeof(hints->dh_hint[0]), GFP_NOFS);
+		if (!hints)
+			return;
+		for (i = old; i < blocks; i++) {
+			hints->dh_hint[i].dh_pblk = 0;
+			hints->dh_hint[i].dh_free = EXT4_DIR_HINT_UNKNOWN;
+		}
+		hints->dh_blocks = blocks;
+		EXT4_I(dir)->i_dir_hints = hints;
+	}
+	hints->dh_hint[block].dh_pblk = bh->b_blocknr;
+	hints->dh_hint[block].dh_free = min_t(unsigned int, free,
+					      EXT4_DIR_HINT_UNKNOWN - 1);
+}
+
+/* An entry was added to @block of @dir: its free space is unknown */
+static void ext4_dir_hint_reset(struct inode *dir, ext4_lblk_t block)
+{
+	struct ext4_dir_hints *hints = EXT4_I(dir)->i_dir_hints;
+
+	if (hints && block < hints->dh_blocks)
+		hints->dh_hint[block].dh_free = EXT4_DIR_HINT_UNKNOWN;
+}
+
+/* An entry was removed from @bh of @dir: its free space is unknown */
+static void ext4_dir_hint_reset_bh(struct inode *dir, struct buffer_head *bh)
+{
+	struct ext4_dir_hints *hints = EXT4_I(dir)->i_dir_hints;
+	ext4_lblk_t i;
+
+	if (!hints)
+		return;
+	for (i = 0; i < hints->dh_blocks; i++)
+		if (hints->dh_hint[i].dh_pblk == (__u32)bh->b_blocknr)
+			hints->dh_hint[i].dh_free = EXT4_DIR_HINT_UNKNOWN;
+}
+
+/* Returns the largest record that fits in directory block @bh */
+static unsigned int ext4_dirent_max_free(struct inode *dir,
+					 struct buffer_head *bh)
+{
+	unsigned int blocksize = dir->i_sb->s_blocksize;
+	struct ext4_dir_entry_2 *de = (struct ext4_dir_entry_2 *)bh->b_data;
+	unsigned int offset = 0, rlen, free, max = 0;
+
+	while (offset < blocksize) {
+		if (ext4_check_dir_entry(dir, NULL, de, bh, offset))
+			return EXT4_DIR_HINT_UNKNOWN;
+		rlen = ext4_rec_len_from_disk(de->rec_len, blocksize);
+		free = de->inode ? rlen - EXT4_DIR_REC_LEN(de->name_len) : rlen;
+		if (free > max)
+			max = free;
+		de = (struct ext4_dir_entry_2 *)((char *)de + rlen);
+		offset += rlen;
+	}
+	return max;
+}
+
+#endif
 /*
  * Add a new entry into a directory (leaf) block.  If de is non-NULL,
  * it points to a directory entry which is guaranteed to be large
@@ -1340,7 +1544,7 @@ static int make_indexed_dir(handle_t *handle, struct dentry *dentry,
 	int		namelen = dentry->d_name.len;
 	struct buffer_head *bh2;
 	struct dx_root	*root;
-	struct dx_frame	frames[2], *frame;
+	struct dx_frame	frames[EXT4_HTREE_LEVEL], *frame;
 	struct dx_entry *entries;
 	struct ext4_dir_entry_2	*de, *de2;
 	char		*data1, *top;
@@ -1469,18 +1673,35 @@ static int ext4_add_entry(handle_t *handle, struct dentry *dentry,
 	}
 	blocks = dir->i_size >> sb->s_blocksize_bits;
 	for (block = 0; block < blocks; block++) {
+#ifdef CONFIG_EXT4_FS_DIR_FREE_HINTS
+		/* a full single block dir is converted to htree below */
+		if (blocks > 1 && !ext4_dir_hint_fits(dir, block,
+				EXT4_DIR_REC_LEN(dentry->d_name.len)))
+			continue;
+#endif
 		bh = ext4_bread(handle, dir, block, 0, &retval);
 		if(!bh)
 			return retval;
 		retval = add_dirent_to_buf(handle, dentry, inode, NULL, bh);
 		if (retval != -ENOSPC) {
+#ifdef CONFIG_EXT4_FS_DIR_FREE_HINTS
+			if (!retval)
+				ext4_dir_hint_reset(dir, block);
+#endif
 			brelse(bh);
 			return retval;
 		}
 
 		if (blocks == 1 && !dx_fallback &&
-		    EXT4_HAS_COMPAT_FEATURE(sb, EXT4_FEATURE_COMPAT_DIR_INDEX))
+		    EXT4_HAS_COMPAT_FEATURE(sb, EXT4_FEATURE_COMPAT_DIR_INDEX)) {
+#ifdef CONFIG_EXT4_FS_DIR_FREE_HINTS
+			ext4_dir_hints_free(dir);
+#endif
 			return make_indexed_dir(handle, dentry, inode, bh);
+		}
+#ifdef CONFIG_EXT4_FS_DIR_FREE_HINTS
+		ext4_dir_hint_set(dir, block, bh, ext4_dirent_max_free(dir, bh));
+#endif
 		brelse(bh);
 	}
 	bh = ext4_append(handle, dir, &block, &retval);
@@ -1502,15 +1723,19 @@ static int ext4_add_entry(handle_t *handle, struct dentry *dentry,
 static int ext4_dx_add_entry(handle_t *handle, struct dentry *dentry,
 			     struct inode *inode)
 {
-	struct dx_frame frames[2], *frame;
+	struct dx_frame frames[EXT4_HTREE_LEVEL], *frame;
 	struct dx_entry *entries, *at;
 	struct dx_hash_info hinfo;
 	struct buffer_head *bh;
 	struct inode *dir = dentry->d_parent->d_inode;
 	struct super_block *sb = dir->i_sb;
 	struct ext4_dir_entry_2 *de;
+	int restart;
 	int err;
 
+again:
+	restart = 0;
+	bh = NULL;
 	frame = dx_probe(&dentry->d_name, dir, &hinfo, frames, &err);
 	if (!frame)
 		return err;
@@ -1528,6 +1753,7 @@ static int ext4_dx_add_entry(handle_t *handle, struct dentry *dentry,
 	err = add_dirent_to_buf(handle, dentry, inode, NULL, bh);
 	if (err != -ENOSPC)
 		goto cleanup;
+	err = 0;
 
 	/* Block full, should compress but for now just split */
 	dxtrace(printk(KERN_DEBUG "using %u of %u node entries\n",
@@ -1535,18 +1761,37 @@ static int ext4_dx_add_entry(handle_t *handle, struct dentry *dentry,
 	/* Need to split index? */
 	if (dx_get_count(entries) == dx_get_limit(entries)) {
 		ext4_lblk_t newblock;
-		unsigned icount = dx_get_count(entries);
-		int levels = frame - frames;
+		int levels = frame - frames + 1;
+		unsigned icount;
+		int add_level = 1;
 		struct dx_entry *entries2;
 		struct dx_node *node2;
 		struct buffer_head *bh2;
 
-		if (levels && (dx_get_count(frames->entries) ==
-			       dx_get_limit(frames->entries))) {
-			ext4_warning(sb, "Directory index full!");
+		/*
+		 * Split the lowest full index block whose parent has room.
+		 * If that is not the one above the leaf, the path below it
+		 * changes, so split it alone and look the name up again.
+		 */
+		while (frame > frames) {
+			if (dx_get_count((frame - 1)->entries) <
+			    dx_get_limit((frame - 1)->entries)) {
+				add_level = 0;
+				break;
+			}
+			frame--;
+			at = frame->at;
+			entries = frame->entries;
+			restart = 1;
+		}
+		if (add_level && levels == ext4_dir_htree_level(sb)) {
+			ext4_warning(sb, "Directory (ino: %lu) index full, "
+				     "reached max htree level %d",
+				     dir->i_ino, levels);
 			err = -ENOSPC;
 			goto cleanup;
 		}
+		icount = dx_get_count(entries);
 		bh2 = ext4_append (handle, dir, &newblock, &err);
 		if (!(bh2))
 			goto cleanup;
@@ -1559,15 +1804,15 @@ static int ext4_dx_add_entry(handle_t *handle, struct dentry *dentry,
 		err = ext4_journal_get_write_access(handle, frame->bh);
 		if (err)
 			goto journal_error;
-		if (levels) {
+		if (!add_level) {
 			unsigned icount1 = icount/2, icount2 = icount - icount1;
 			unsigned hash2 = dx_get_hash(entries + icount1);
 			dxtrace(printk(KERN_DEBUG "Split index %i/%i\n",
 				       icount1, icount2));
 
-			BUFFER_TRACE(frame->bh, "get_write_access"); /* index root */
+			BUFFER_TRACE(frame->bh, "get_write_access"); /* parent */
 			err = ext4_journal_get_write_access(handle,
-							     frames[0].bh);
+							     (frame - 1)->bh);
 			if (err)
 				goto journal_error;
 
@@ -1583,17 +1828,29 @@ static int ext4_dx_add_entry(handle_t *handle, struct dentry *dentry,
 				frame->entries = entries = entries2;
 				swap(frame->bh, bh2);
 			}
-			dx_insert_block(frames + 0, hash2, newblock);
-			dxtrace(dx_show_index("node", frames[1].entries));
+			dx_insert_block(frame - 1, hash2, newblock);
+			dxtrace(dx_show_index("node", frame->entries));
 			dxtrace(dx_show_index("node",
 			       ((struct dx_node *) bh2->b_data)->entries));
 			err = ext4_handle_dirty_metadata(handle, inode, bh2);
 			if (err)
 				goto journal_error;
 			brelse (bh2);
+			err = ext4_handle_dirty_metadata(handle, inode,
+							 (frame - 1)->bh);
+			if (err)
+				goto journal_error;
+			if (restart) {
+				err = ext4_handle_dirty_metadata(handle, inode,
+								 frame->bh);
+				goto journal_error;
+			}
 		} else {
+			struct dx_root *dxroot;
+
 			dxtrace(printk(KERN_DEBUG
-				       "Creating second level index...\n"));
+				       "Creating index level %d...\n",
+				       levels + 1));
 			memcpy((char *) entries2, (char *) entries,
 			       icount * sizeof(struct dx_entry));
 			dx_set_limit(entries2, dx_node_limit(dir));
@@ -1601,22 +1858,17 @@ static int ext4_dx_add_entry(handle_t *handle, struct dentry *dentry,
 			/* Set up root */
 			dx_set_count(entries, 1);
 			dx_set_block(entries + 0, newblock);
-			((struct dx_root *) frames[0].bh->b_data)->info.indirect_levels = 1;
-
-			/* Add new access path frame */
-			frame = frames + 1;
-			frame->at = at = at - entries + entries2;
-			frame->entries = entries = entries2;
-			frame->bh = bh2;
-			err = ext4_journal_get_write_access(handle,
-							     frame->bh);
+			dxroot = (struct dx_root *) frames[0].bh->b_data;
+			dxroot->info.indirect_levels += 1;
+			err = ext4_handle_dirty_metadata(handle, inode, bh2);
+			brelse(bh2);
 			if (err)
 				goto journal_error;
-		}
-		err = ext4_handle_dirty_metadata(handle, inode, frames[0].bh);
-		if (err) {
-			ext4_std_error(inode->i_sb, err);
-			goto cleanup;
+			err = ext4_handle_dirty_metadata(handle, inode,
+							 frames[0].bh);
+			/* The new level gets split on the next pass */
+			restart = 1;
+			goto journal_error;
 		}
 	}
 	de = do_split(handle, dir, &bh, frame, &hinfo, &err);
@@ -1626,11 +1878,15 @@ static int ext4_dx_add_entry(handle_t *handle, struct dentry *dentry,
 	goto cleanup;
 
 journal_error:
-	ext4_std_error(dir->i_sb, err);
+	if (err)
+		ext4_std_error(dir->i_sb, err);
 cleanup:
 	if (bh)
 		brelse(bh);
 	dx_release(frames);
+	/* The index path changed under us, probe it again */
+	if (restart && err == 0)
+		goto again;
 	return err;
 }
 
@@ -1670,6 +1926,9 @@ static int ext4_delete_entry(handle_t *handle,
 			else
 				de->inode = 0;
 			dir->i_version++;
+#ifdef CONFIG_EXT4_FS_DIR_FREE_HINTS
+			ext4_dir_hint_reset_bh(dir, bh);
+#endif
 			BUFFER_TRACE(bh, "call ext4_handle_dirty_metadata");
 			err = ext4_handle_dirty_metadata(handle, dir, bh);
 			if (unlikely(err)) {
@@ -1762,6 +2021,10 @@ retry:
 	if (!IS_ERR(inode)) {
 		inode->i_op = &ext4_file_inode_operations;
 		inode->i_fop = &ext4_file_operations;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READ_SHARED
+		if (ext4_snapshot_file(inode))
+			inode->i_fop = &ext4_snapfile_operations;
+#endif
 		ext4_set_aops(inode);
 		err = ext4_add_nondir(handle, dentry, inode);
 	}
@@ -1974,6 +2237,90 @@ static int empty_dir(struct inode *inode)
  * At filesystem recovery time, we walk this list deleting unlinked
  * inodes and truncating linked inodes in ext4_orphan_cleanup().
  */
+#ifdef CONFIG_EXT4_FS_ORPHAN_SHORT_LOCK
+/*
+ * s_orphan_lock only protects the in-memory list and the on-disk list
+ * pointers.  Journal write access and inode buffer reads are done before
+ * taking the lock and the buffers are dirtied after releasing it.
+ * Orphan add and delete of the same inode are serialized by the caller
+ * (i_mutex or an inode nobody else can reference).
+ */
+int ext4_orphan_add(handle_t *handle, struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_iloc iloc;
+	int err = 0, rc;
+	int dirty = 0;
+
+	if (!ext4_handle_valid(handle))
+		return 0;
+
+	/* quick check before taking the global s_orphan_lock */
+	if (!list_empty(&EXT4_I(inode)->i_orphan))
+		return 0;
+
+	/*
+	 * Orphan handling is only valid for files with data blocks
+	 * being truncated, or files being unlinked. Note that we either
+	 * hold i_mutex, or the inode can not be referenced from outside,
+	 * so i_nlink should not be bumped due to race
+	 */
+	J_ASSERT((S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode) ||
+		  S_ISLNK(inode->i_mode)) || inode->i_nlink == 0);
+
+	BUFFER_TRACE(sbi->s_sbh, "get_write_access");
+	err = ext4_journal_get_write_access(handle, sbi->s_sbh);
+	if (err)
+		goto out;
+
+	err = ext4_reserve_inode_write(handle, inode, &iloc);
+	if (err)
+		goto out;
+
+	mutex_lock(&sbi->s_orphan_lock);
+	/*
+	 * Due to previous errors inode may be already a part of on-disk
+	 * orphan list. If so skip on-disk list modification.
+	 */
+	if (!NEXT_ORPHAN(inode) || NEXT_ORPHAN(inode) >
+	    (le32_to_cpu(sbi->s_es->s_inodes_count))) {
+		/* Insert this inode at the head of the on-disk orphan list */
+		NEXT_ORPHAN(inode) = le32_to_cpu(sbi->s_es->s_last_orphan);
+		sbi->s_es->s_last_orphan = cpu_to_le32(inode->i_ino);
+		dirty = 1;
+	}
+	list_add(&EXT4_I(inode)->i_orphan, &sbi->s_orphan);
+	mutex_unlock(&sbi->s_orphan_lock);
+
+	if (dirty) {
+		err = ext4_handle_dirty_metadata(handle, NULL, sbi->s_sbh);
+		rc = ext4_mark_iloc_dirty(handle, inode, &iloc);
+		if (!err)
+			err = rc;
+		if (err) {
+			/*
+			 * We can't risk leaving the inode on the in-memory
+			 * orphan list if the on-disk addition failed: stray
+			 * orphan-list entries can cause panics at unmount
+			 * time.  On error, the on-disk orphan list is
+			 * ignored on the next recovery anyway.
+			 */
+			mutex_lock(&sbi->s_orphan_lock);
+			list_del_init(&EXT4_I(inode)->i_orphan);
+			mutex_unlock(&sbi->s_orphan_lock);
+		}
+	} else
+		brelse(iloc.bh);
+
+	jbd_debug(4, "superblock will point to %lu\n", inode->i_ino);
+	jbd_debug(4, "orphan inode %lu will point to %d\n",
+			inode->i_ino, NEXT_ORPHAN(inode));
+out:
+	ext4_std_error(sb, err);
+	return err;
+}
+#else
 int ext4_orphan_add(handle_t *handle, struct inode *inode)
 {
 	struct super_block *sb = inode->i_sb;
@@ -2040,11 +2387,97 @@ out_unlock:
 	ext4_std_error(inode->i_sb, err);
 	return err;
 }
+#endif
 
 /*
  * ext4_orphan_del() removes an unlinked or truncated inode from the list
  * of such inodes stored on disk, because it is finally being cleaned up.
  */
+#ifdef CONFIG_EXT4_FS_ORPHAN_SHORT_LOCK
+int ext4_orphan_del(handle_t *handle, struct inode *inode)
+{
+	struct list_head *prev;
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct ext4_sb_info *sbi = EXT4_SB(inode->i_sb);
+	__u32 ino_next;
+	struct ext4_iloc iloc;
+	int err = 0;
+
+	/* ext4_handle_valid() assumes a valid handle_t pointer */
+	if (handle && !ext4_handle_valid(handle))
+		return 0;
+
+	/* quick check before taking the global s_orphan_lock */
+	if (list_empty(&ei->i_orphan))
+		return 0;
+
+	/*
+	 * If we're on an error path, we may not have a valid
+	 * transaction handle with which to update the orphan list on
+	 * disk, but we still need to remove the inode from the linked
+	 * list in memory.
+	 */
+	if (sbi->s_journal && !handle) {
+		mutex_lock(&sbi->s_orphan_lock);
+		list_del_init(&ei->i_orphan);
+		mutex_unlock(&sbi->s_orphan_lock);
+		return 0;
+	}
+
+	/* read the inode buffer before taking the global s_orphan_lock */
+	err = ext4_reserve_inode_write(handle, inode, &iloc);
+
+	mutex_lock(&sbi->s_orphan_lock);
+	jbd_debug(4, "remove inode %lu from orphan list\n", inode->i_ino);
+
+	prev = ei->i_orphan.prev;
+	list_del_init(&ei->i_orphan);
+	if (err) {
+		mutex_unlock(&sbi->s_orphan_lock);
+		goto out_err;
+	}
+
+	ino_next = NEXT_ORPHAN(inode);
+	if (prev == &sbi->s_orphan) {
+		jbd_debug(4, "superblock will point to %u\n", ino_next);
+		BUFFER_TRACE(sbi->s_sbh, "get_write_access");
+		err = ext4_journal_get_write_access(handle, sbi->s_sbh);
+		if (err) {
+			mutex_unlock(&sbi->s_orphan_lock);
+			goto out_brelse;
+		}
+		sbi->s_es->s_last_orphan = cpu_to_le32(ino_next);
+		mutex_unlock(&sbi->s_orphan_lock);
+		err = ext4_handle_dirty_metadata(handle, NULL, sbi->s_sbh);
+	} else {
+		struct ext4_iloc iloc2;
+		struct inode *i_prev =
+			&list_entry(prev, struct ext4_inode_info, i_orphan)->vfs_inode;
+
+		jbd_debug(4, "orphan inode %lu will point to %u\n",
+			  i_prev->i_ino, ino_next);
+		err = ext4_reserve_inode_write(handle, i_prev, &iloc2);
+		if (err) {
+			mutex_unlock(&sbi->s_orphan_lock);
+			goto out_brelse;
+		}
+		NEXT_ORPHAN(i_prev) = ino_next;
+		err = ext4_mark_iloc_dirty(handle, i_prev, &iloc2);
+		mutex_unlock(&sbi->s_orphan_lock);
+	}
+	if (err)
+		goto out_brelse;
+	NEXT_ORPHAN(inode) = 0;
+	err = ext4_mark_iloc_dirty(handle, inode, &iloc);
+out_err:
+	ext4_std_error(inode->i_sb, err);
+	return err;
+
+out_brelse:
+	brelse(iloc.bh);
+	goto out_err;
+}
+#else
 int ext4_orphan_del(handle_t *handle, struct inode *inode)
 {
 	struct list_head *prev;
@@ -2117,6 +2550,7 @@ out_brelse:
 	brelse(iloc.bh);
 	goto out_err;
 }
+#endif
 
 static int ext4_rmdir(struct inode *dir, struct dentry *dentry)
 {
@@ -306,6 +306,9 @@ static int io_submit_init(struct ext4_io_submit *io,
 	bio->bi_bdev = bh->b_bdev;
 	bio->bi_private = io->io_end = io_end;
 	bio->bi_end_io = ext4_end_bio;
+#ifdef CONFIG_BLK_CGROUP
+	bio->bi_blkcg_id = bh->b_blkcg_id;
+#endif
 
 	io_end->offset = (page->index << PAGE_CACHE_SHIFT) + bh_offset(bh);
 
@@ -337,6 +340,11 @@ static int io_submit_add_bh(struct ext4_io_submit *io,
 		return 0;
 	}
 
+#ifdef CONFIG_BLK_CGROUP
+	/* don't merge buffers charged to different cgroups in one bio */
+	if (io->io_bio && io->io_bio->bi_blkcg_id != bh->b_blkcg_id)
+		goto submit_and_retry;
+#endif
 	if (io->io_bio && bh->b_blocknr != io->io_next_block) {
 submit_and_retry:
 		ext4_io_submit(io);
@@ -359,6 +367,9 @@ submit_and_retry:
 	ret = bio_add_page(io->io_bio, bh->b_page, bh->b_size, bh_offset(bh));
 	if (ret != bh->b_size)
 		goto submit_and_retry;
+#ifdef CONFIG_BLK_CGROUP
+	bh->b_blkcg_id = 0;
+#endif
 	if ((io_end->num_io_pages == 0) ||
 	    (io_end->pages[io_end->num_io_pages-1] != io_page)) {
 		io_end->pages[io_end->num_io_pages++] = io_page;
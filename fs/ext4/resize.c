@@ -49,6 +49,54 @@ void ext4_resize_end(struct super_block *sb)
 #define outside(b, first, last)	((b) < (first) || (b) >= (last))
 #define inside(b, first, last)	((b) >= (first) && (b) < (last))
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RESIZE
+/*
+ * The exclude bitmap of a new group is the first block of the group, which
+ * is not used by the superblock/GDT backups, the bitmaps and the inode table.
+ * Returns 0 if the file system has no exclude bitmap or the group is full.
+ */
+static ext4_fsblk_t new_group_exclude_bitmap(struct super_block *sb,
+		struct ext4_new_group_data *input)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	ext4_fsblk_t start = ext4_group_first_block_no(sb, input->group);
+	ext4_fsblk_t end = start + input->blocks_count;
+	ext4_fsblk_t itend = input->inode_table + sbi->s_itb_per_group;
+	ext4_fsblk_t blk;
+
+	if (!EXT4_HAS_COMPAT_FEATURE(sb, EXT4_FEATURE_COMPAT_EXCLUDE_BITMAP))
+		return 0;
+
+	blk = start;
+	if (ext4_bg_has_super(sb, input->group))
+		blk += 1 + ext4_bg_num_gdb(sb, input->group) +
+			le16_to_cpu(sbi->s_es->s_reserved_gdt_blocks);
+	for (; blk < end; blk++) {
+		if (blk == input->block_bitmap || blk == input->inode_bitmap)
+			continue;
+		if (inside(blk, input->inode_table, itend)) {
+			blk = itend - 1;
+			continue;
+		}
+		return blk;
+	}
+	return 0;
+}
+
+/*
+ * Blocks past the end of the file system at the time that the active snapshot
+ * was taken (i.e. blocks of groups added by resize after snapshot take) are
+ * not in use by the snapshot and don't need to be COWed.
+ */
+static int resize_block_needs_cow(struct super_block *sb, ext4_fsblk_t blk)
+{
+	struct inode *active_snapshot = ext4_snapshot_has_active(sb);
+
+	return active_snapshot && blk < SNAPSHOT_BLOCKS(active_snapshot);
+}
+
+#endif
+
 static int verify_group_input(struct super_block *sb,
 			      struct ext4_new_group_data *input)
 {
@@ -68,6 +116,11 @@ static int verify_group_input(struct super_block *sb,
 
 	input->free_blocks_count = free_blocks_count =
 		input->blocks_count - 2 - overhead - sbi->s_itb_per_group;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RESIZE
+	if (EXT4_HAS_COMPAT_FEATURE(sb, EXT4_FEATURE_COMPAT_EXCLUDE_BITMAP))
+		/* one more block for the exclude bitmap */
+		input->free_blocks_count = --free_blocks_count;
+#endif
 
 	if (test_opt(sb, DEBUG))
 		printk(KERN_DEBUG "EXT4-fs: adding %s group %u: %u blocks "
@@ -128,6 +181,13 @@ static int verify_group_input(struct super_block *sb,
 			     "(%llu-%llu)",
 			     (unsigned long long)input->inode_table,
 			     itend - 1, start, metaend - 1);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RESIZE
+	else if (EXT4_HAS_COMPAT_FEATURE(sb,
+				EXT4_FEATURE_COMPAT_EXCLUDE_BITMAP) &&
+		 !new_group_exclude_bitmap(sb, input))
+		ext4_warning(sb, "No room for exclude bitmap in group %u",
+			     input->group);
+#endif
 	else
 		err = 0;
 	brelse(bh);
@@ -144,7 +204,12 @@ static struct buffer_head *bclean(handle_t *handle, struct super_block *sb,
 	bh = sb_getblk(sb, blk);
 	if (!bh)
 		return ERR_PTR(-EIO);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RESIZE
+	/* new group blocks are not in use by snapshot */
+	if ((err = ext4_journal_get_write_access_exclude(handle, bh))) {
+#else
 	if ((err = ext4_journal_get_write_access(handle, bh))) {
+#endif
 		brelse(bh);
 		bh = ERR_PTR(err);
 	} else {
@@ -224,7 +289,13 @@ static int setup_new_group_blocks(struct super_block *sb,
 			err = -EIO;
 			goto exit_journal;
 		}
-		if ((err = ext4_journal_get_write_access(handle, gdb))) {
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RESIZE
+		/* new group blocks are not in use by snapshot */
+		err = ext4_journal_get_write_access_exclude(handle, gdb);
+#else
+		err = ext4_journal_get_write_access(handle, gdb);
+#endif
+		if (err) {
 			brelse(gdb);
 			goto exit_journal;
 		}
@@ -277,6 +348,15 @@ static int setup_new_group_blocks(struct super_block *sb,
 		goto exit_bh;
 	ext4_set_bits(bh->b_data, input->inode_table - start,
 		      sbi->s_itb_per_group);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RESIZE
+	/* the exclude bitmap is not initialized until first access */
+	block = new_group_exclude_bitmap(sb, input);
+	if (block) {
+		ext4_debug("mark exclude bitmap %#04llx (+%llu)\n", block,
+			   block - start);
+		ext4_set_bit(block - start, bh->b_data);
+	}
+#endif
 
 
 	ext4_mark_bitmap_end(input->blocks_count, sb->s_blocksize * 8,
@@ -602,6 +682,13 @@ static int reserve_backup_gdb(handle_t *handle, struct inode *inode,
 			data = (__le32 *)dind->b_data;
 	}
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_JBD
+	/* the reserved GDT blocks are subsequent - COW them in one go */
+	err = ext4_journal_get_write_access_range(handle, primary,
+						  reserved_gdb);
+	if (err)
+		goto exit_bh;
+#else
 	for (i = 0; i < reserved_gdb; i++) {
 		if ((err = ext4_journal_get_write_access(handle, primary[i]))) {
 			/*
@@ -612,6 +699,7 @@ static int reserve_backup_gdb(handle_t *handle, struct inode *inode,
 			goto exit_bh;
 		}
 	}
+#endif
 
 	if ((err = ext4_reserve_inode_write(handle, inode, &iloc)))
 		goto exit_bh;
@@ -675,6 +763,9 @@ static void update_backups(struct super_block *sb,
 	int rest = sb->s_blocksize - size;
 	handle_t *handle;
 	int err = 0, err2;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RESIZE
+	int cow;
+#endif
 
 	handle = ext4_journal_start_sb(sb, EXT4_MAX_TRANS_DATA);
 	if (IS_ERR(handle)) {
@@ -697,7 +788,18 @@ static void update_backups(struct super_block *sb,
 		    (err = ext4_journal_restart(handle, EXT4_MAX_TRANS_DATA)))
 			break;
 
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RESIZE
+		cow = resize_block_needs_cow(sb, group * bpg + blk_off);
+		if (cow)
+			/*
+			 * test_and_cow() expects an uptodate buffer.
+			 * Read the buffer here to suppress the
+			 * "non uptodate buffer" warning.
+			 */
+			bh = sb_bread(sb, group * bpg + blk_off);
+		else
+			bh = sb_getblk(sb, group * bpg + blk_off);
+#elif defined(CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW)
 		if (ext4_snapshot_has_active(sb))
 			/*
 			 * test_and_cow() expects an uptodate buffer.
@@ -716,8 +818,18 @@ static void update_backups(struct super_block *sb,
 		}
 		ext4_debug("update metadata backup %#04lx\n",
 			  (unsigned long)bh->b_blocknr);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RESIZE
+		if (cow)
+			err = ext4_journal_get_write_access(handle, bh);
+		else
+			/* backup in a group added after snapshot take */
+			err = ext4_journal_get_write_access_exclude(handle, bh);
+		if (err)
+			break;
+#else
 		if ((err = ext4_journal_get_write_access(handle, bh)))
 			break;
+#endif
 		lock_buffer(bh);
 		memcpy(bh->b_data, data, size);
 		if (rest)
@@ -781,7 +893,8 @@ int ext4_group_add(struct super_block *sb, struct ext4_new_group_data *input)
 	gdb_num = input->group / EXT4_DESC_PER_BLOCK(sb);
 	gdb_off = input->group % EXT4_DESC_PER_BLOCK(sb);
 
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
+#if defined(CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP) && \
+	!defined(CONFIG_EXT4_FS_SNAPSHOT_RESIZE)
 	if (EXT4_HAS_COMPAT_FEATURE(sb,
 				EXT4_FEATURE_COMPAT_EXCLUDE_BITMAP)) {
 		ext4_warning(sb, "Can't resize filesystem with exclude bitmap");
@@ -801,6 +914,15 @@ int ext4_group_add(struct super_block *sb, struct ext4_new_group_data *input)
 		return -EINVAL;
 	}
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_META_BG
+	if (EXT4_SNAPSHOTS(sb) && ext4_blocks_count(es) +
+	    input->blocks_count > SNAPSHOT_MAX_BLOCKS) {
+		ext4_warning(sb, "can't resize snapshot file system "
+			     "beyond 2^32 blocks");
+		return -EFBIG;
+	}
+#endif
+
 	if (le32_to_cpu(es->s_inodes_count) + EXT4_INODES_PER_GROUP(sb) <
 	    le32_to_cpu(es->s_inodes_count)) {
 		ext4_warning(sb, "inodes_count overflow");
@@ -903,6 +1025,13 @@ int ext4_group_add(struct super_block *sb, struct ext4_new_group_data *input)
 	ext4_free_blks_set(sb, gdp, input->free_blocks_count);
 	ext4_free_inodes_set(sb, gdp, EXT4_INODES_PER_GROUP(sb));
 	gdp->bg_flags = cpu_to_le16(EXT4_BG_INODE_ZEROED);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RESIZE
+	if (EXT4_HAS_COMPAT_FEATURE(sb, EXT4_FEATURE_COMPAT_EXCLUDE_BITMAP)) {
+		ext4_exclude_bitmap_set(sb, gdp,
+				new_group_exclude_bitmap(sb, input));
+		gdp->bg_flags |= cpu_to_le16(EXT4_BG_EXCLUDE_UNINIT);
+	}
+#endif
 	gdp->bg_checksum = ext4_group_desc_csum(sbi, input->group, gdp);
 
 	/*
@@ -975,6 +1104,9 @@ int ext4_group_add(struct super_block *sb, struct ext4_new_group_data *input)
 			   &sbi->s_flex_groups[flex_group].free_blocks);
 		atomic_add(EXT4_INODES_PER_GROUP(sb),
 			   &sbi->s_flex_groups[flex_group].free_inodes);
+#ifdef CONFIG_EXT4_FS_ORLOV_GROUP_INDEX
+		ext4_flex_index_update(sbi, flex_group);
+#endif
 	}
 
 	ext4_handle_dirty_super(handle, sb);
@@ -1037,6 +1169,14 @@ int ext4_group_extend(struct super_block *sb, struct ext4_super_block *es,
 		return -EINVAL;
 	}
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_META_BG
+	if (EXT4_SNAPSHOTS(sb) && n_blocks_count > SNAPSHOT_MAX_BLOCKS) {
+		ext4_warning(sb, "can't resize snapshot file system "
+			     "beyond 2^32 blocks");
+		return -EFBIG;
+	}
+#endif
+
 	/* Handle the remaining blocks in the last group only. */
 	ext4_get_group_no_and_offset(sb, o_blocks_count, &group, &last);
 
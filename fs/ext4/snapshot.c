@@ -13,9 +13,25 @@
  */
 
 #include <linux/quotaops.h>
+#if defined(CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_FAST) && \
+	defined(CONFIG_EXT4_DEBUG)
+#include <linux/random.h>
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COPY_NOCACHE
+#include <linux/uaccess.h>
+#ifdef CONFIG_EXT4_DEBUG
+#include <linux/vmalloc.h>
+#endif
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_DEBUG_BENCH
+#include <linux/vmalloc.h>
+#endif
 #include "snapshot.h"
 #include "ext4.h"
 #include "mballoc.h"
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS
+#include <trace/events/ext4.h>
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK
 
 #define snapshot_debug_hl(n, f, a...) snapshot_debug_l(n, handle ? \
@@ -61,242 +77,1198 @@ int ext4_snapshot_map_blocks(handle_t *handle, struct inode *inode,
 }
 
 #endif
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
 /*
- * COW helper functions
+ * ext4_snapshot_stats_latency() - account the latency of a snapshot
+ * operation, which started at @start, in the per-CPU histogram of @type.
  */
+void ext4_snapshot_stats_latency(struct super_block *sb,
+				 enum ext4_snapshot_lat type, ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	int bucket = us > 0 ? fls64(us) : 0;
+
+	if (bucket >= EXT4_SNAPSHOT_LAT_BUCKETS)
+		bucket = EXT4_SNAPSHOT_LAT_BUCKETS - 1;
+	this_cpu_inc(EXT4_SB(sb)->s_snapshot_stats->lat[type][bucket]);
+}
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS_LOCK
 /*
- * copy buffer @bh to (locked) snapshot buffer @sbh and mark it uptodate
+ * local_clock() is not synchronized between CPUs, so a task that migrates
+ * while waiting for or holding a lock may see time go backwards.
  */
-static inline void
-__ext4_snapshot_copy_buffer(struct buffer_head *sbh,
-		struct buffer_head *bh)
+static inline u64 ext4_snapshot_lock_delta(u64 now, u64 start)
 {
-	memcpy(sbh->b_data, bh->b_data, SNAPSHOT_BLOCK_SIZE);
-	set_buffer_uptodate(sbh);
+	return (s64)(now - start) > 0 ? now - start : 0;
 }
 
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP
 /*
- * use @mask to clear exclude bitmap bits from block bitmap
- * when creating COW bitmap and mark snapshot buffer @sbh uptodate
+ * ext4_snapshot_stats_lock_wait() - account the acquisition of @lock,
+ * which the caller started to wait for at @start.  @contended is true
+ * if the lock was found busy.  Returns the acquire time for
+ * ext4_snapshot_stats_lock_hold().
  */
-static inline void
-__ext4_snapshot_copy_bitmap(struct buffer_head *sbh,
-		char *dst, const char *src, const char *mask)
+u64 ext4_snapshot_stats_lock_wait(struct super_block *sb,
+				  enum ext4_snapshot_lock lock,
+				  u64 start, int contended)
 {
-	const u32 *ps = (const u32 *)src, *pm = (const u32 *)mask;
-	u32 *pd = (u32 *)dst;
-	int i;
+	struct ext4_snapshot_lock_stats *ls;
+	u64 now = local_clock();
+
+	ls = &get_cpu_ptr(EXT4_SB(sb)->s_snapshot_stats)->lock[lock];
+	ls->acquired++;
+	if (contended)
+		ls->contended++;
+	ls->wait_ns += ext4_snapshot_lock_delta(now, start);
+	put_cpu_ptr(EXT4_SB(sb)->s_snapshot_stats);
+	return now;
+}
 
-	if (mask) {
-		for (i = 0; i < SNAPSHOT_ADDR_PER_BLOCK; i++)
-			*pd++ = *ps++ & ~*pm++;
-	} else
-		memcpy(dst, src, SNAPSHOT_BLOCK_SIZE);
+/*
+ * ext4_snapshot_stats_lock_hold() - account the hold time of @lock,
+ * which was acquired at @acquired and is about to be released.
+ */
+void ext4_snapshot_stats_lock_hold(struct super_block *sb,
+				   enum ext4_snapshot_lock lock, u64 acquired)
+{
+	struct ext4_snapshot_lock_stats *ls;
+	u64 hold = ext4_snapshot_lock_delta(local_clock(), acquired);
+
+	ls = &get_cpu_ptr(EXT4_SB(sb)->s_snapshot_stats)->lock[lock];
+	ls->hold_ns += hold;
+	if (hold > ls->max_hold_ns)
+		ls->max_hold_ns = hold;
+	put_cpu_ptr(EXT4_SB(sb)->s_snapshot_stats);
+}
 
-	set_buffer_uptodate(sbh);
+void __ext4_snapshot_mutex_lock(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	int contended = mutex_is_locked(&sbi->s_snapshot_mutex);
+	u64 start = local_clock();
+
+	mutex_lock(&sbi->s_snapshot_mutex);
+	sbi->s_snapshot_mutex_acquired = ext4_snapshot_stats_lock_wait(sb,
+			EXT4_SNAPSHOT_LOCK_MUTEX, start, contended);
+}
+
+int ext4_snapshot_mutex_trylock(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	if (!mutex_trylock(&sbi->s_snapshot_mutex))
+		return 0;
+	sbi->s_snapshot_mutex_acquired = ext4_snapshot_stats_lock_wait(sb,
+			EXT4_SNAPSHOT_LOCK_MUTEX, local_clock(), 0);
+	return 1;
 }
 
+void ext4_snapshot_mutex_unlock(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	ext4_snapshot_stats_lock_hold(sb, EXT4_SNAPSHOT_LOCK_MUTEX,
+				      sbi->s_snapshot_mutex_acquired);
+	mutex_unlock(&sbi->s_snapshot_mutex);
+}
 #endif
+
 /*
- * ext4_snapshot_complete_cow()
- * Unlock a newly COWed snapshot buffer and complete the COW operation.
- * Optionally, sync the buffer to disk or add it to the current transaction
- * as dirty data.
+ * ext4_snapshot_stats_show() - print the sum of per-CPU snapshot statistics
+ * for the snapshot_stats sysfs attribute.  The sum is not atomic, but each
+ * counter is monotonic, so it is good enough for statistics.
  */
-static inline int
-ext4_snapshot_complete_cow(handle_t *handle, struct inode *snapshot,
-		struct buffer_head *sbh, struct buffer_head *bh, int sync)
+int ext4_snapshot_stats_show(struct ext4_sb_info *sbi, char *buf)
 {
-	int err = 0;
+	static const char * const lat_names[EXT4_SNAPSHOT_LAT_NUM] = {
+		"copy_us", "move_us", "bitmap_us"
+	};
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS_LOCK
+	static const char * const lock_names[EXT4_SNAPSHOT_LOCK_NUM] = {
+		"snapshot_mutex", "group_lock", "i_data_sem"
+	};
+#endif
+	struct ext4_snapshot_cow_stats *stats;
+	unsigned long cow[8] = { 0 };
+	unsigned long lat[EXT4_SNAPSHOT_LAT_NUM][EXT4_SNAPSHOT_LAT_BUCKETS];
+	int cpu, i, j, len;
+
+	memset(lat, 0, sizeof(lat));
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(sbi->s_snapshot_stats, cpu);
+		cow[0] += stats->cow_moved;
+		cow[1] += stats->cow_copied;
+		cow[2] += stats->cow_ok_jh;
+		cow[3] += stats->cow_ok_bitmap;
+		cow[4] += stats->cow_ok_mapped;
+		cow[5] += stats->cow_bitmaps;
+		cow[6] += stats->cow_excluded;
+		cow[7] += stats->cow_bitmap_waits;
+		for (i = 0; i < EXT4_SNAPSHOT_LAT_NUM; i++)
+			for (j = 0; j < EXT4_SNAPSHOT_LAT_BUCKETS; j++)
+				lat[i][j] += stats->lat[i][j];
+	}
 
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_READ
-	/* wait for completion of tracked reads before completing COW */
-	while (bh && buffer_tracked_readers_count(bh) > 0) {
-		snapshot_debug_once(2, "waiting for tracked reads: "
-			"block = [%llu/%llu], "
-			"tracked_readers_count = %d...\n",
-			SNAPSHOT_BLOCK_TUPLE(bh->b_blocknr),
-			buffer_tracked_readers_count(bh));
-		/*
-		 * Quote from LVM snapshot pending_complete() function:
-		 * "Check for conflicting reads. This is extremely improbable,
-		 *  so msleep(1) is sufficient and there is no need for a wait
-		 *  queue." (drivers/md/dm-snap.c).
-		 */
-		msleep(1);
-		/* XXX: Should we fail after N retries? */
+	len = snprintf(buf, PAGE_SIZE, "moved=%lu copied=%lu "
+		       "ok_jh=%lu ok_bitmap=%lu ok_mapped=%lu "
+		       "bitmaps=%lu excluded=%lu bitmap_waits=%lu\n",
+		       cow[0], cow[1], cow[2], cow[3], cow[4], cow[5], cow[6],
+		       cow[7]);
+	/* one line per histogram: <name>: <count of [0]> ... <count of [15]> */
+	for (i = 0; i < EXT4_SNAPSHOT_LAT_NUM; i++) {
+		len += snprintf(buf + len, PAGE_SIZE - len, "%s:",
+				lat_names[i]);
+		for (j = 0; j < EXT4_SNAPSHOT_LAT_BUCKETS; j++)
+			len += snprintf(buf + len, PAGE_SIZE - len, " %lu",
+					lat[i][j]);
+		len += snprintf(buf + len, PAGE_SIZE - len, "\n");
+	}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS_LOCK
+	/* one line per lock: <name>: acquired contended wait hold max_hold */
+	for (i = 0; i < EXT4_SNAPSHOT_LOCK_NUM; i++) {
+		struct ext4_snapshot_lock_stats sum = { 0 };
+
+		for_each_possible_cpu(cpu) {
+			struct ext4_snapshot_lock_stats *ls =
+				&per_cpu_ptr(sbi->s_snapshot_stats,
+					     cpu)->lock[i];
+
+			sum.acquired += ls->acquired;
+			sum.contended += ls->contended;
+			sum.wait_ns += ls->wait_ns;
+			sum.hold_ns += ls->hold_ns;
+			sum.max_hold_ns = max(sum.max_hold_ns,
+					      ls->max_hold_ns);
+		}
+		len += snprintf(buf + len, PAGE_SIZE - len,
+				"%s: acquired=%lu contended=%lu wait_us=%llu "
+				"hold_us=%llu max_hold_us=%llu\n",
+				lock_names[i], sum.acquired, sum.contended,
+				div_u64(sum.wait_ns, NSEC_PER_USEC),
+				div_u64(sum.hold_ns, NSEC_PER_USEC),
+				div_u64(sum.max_hold_ns, NSEC_PER_USEC));
 	}
+#endif
+	return len;
+}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS_RESET
+/*
+ * ext4_snapshot_stats_reset() - zero the per-CPU snapshot statistics.
+ * Events accounted on other CPUs while resetting may be lost, which is
+ * fine for statistics.
+ */
+void ext4_snapshot_stats_reset(struct ext4_sb_info *sbi)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(sbi->s_snapshot_stats, cpu), 0,
+		       sizeof(struct ext4_snapshot_cow_stats));
+}
 
 #endif
-	unlock_buffer(sbh);
-	err = ext4_jbd2_file_inode(handle, snapshot);
-	if (err)
-		goto out;
-	mark_buffer_dirty(sbh);
-	if (sync)
-		sync_dirty_buffer(sbh);
-out:
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW
-	/* COW operation is complete */
-	ext4_snapshot_end_pending_cow(sbh);
 #endif
-	return err;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BUDGET
+/*
+ * COW credits budget of the journal.
+ * The buffer credits consumed by COW operations are accounted per
+ * transaction.  On transaction rollover, they are folded into a moving
+ * average with weight 1/8 per transaction, where transactions without COW
+ * count as zero.  When the average exceeds a quarter of the default max
+ * transaction size (j_maxlen / 4), transactions are throttled to half the
+ * default size and the commit interval is halved.  A COW burst is then
+ * committed and checkpointed in smaller pieces, instead of reserving more
+ * log space than the checkpoint can free and stalling in
+ * __jbd2_log_wait_for_space().  The defaults are restored when the average
+ * drops below 1/16 of the default size.  The gap avoids flapping, because
+ * smaller transactions account fewer COW credits each.
+ * Transactions are never throttled below the largest handle that had to be
+ * fitted by ext4_snapshot_budget_fit(), so a handle that was fitted cannot
+ * be throttled out again before it starts, restarts or extends.
+ */
+#define SNAPSHOT_BUDGET_SHIFT		3
+#define SNAPSHOT_BUDGET_THROTTLE(max)	((max) >> 2)
+#define SNAPSHOT_BUDGET_RESTORE(max)	((max) >> 4)
+
+/*
+ * Apply the current budget state to the journal.  The state is read under
+ * j_state_lock, so concurrent callers cannot leave a stale state behind.
+ */
+static void ext4_snapshot_budget_set(struct super_block *sb,
+				     journal_t *journal)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	int max = journal->j_maxlen / 4;
+	unsigned long interval = sbi->s_commit_interval;
+	int throttle, floor;
+
+	write_lock(&journal->j_state_lock);
+	spin_lock(&sbi->s_snapshot_budget_lock);
+	throttle = sbi->s_snapshot_budget_throttled;
+	floor = sbi->s_snapshot_budget_credits;
+	spin_unlock(&sbi->s_snapshot_budget_lock);
+	if (throttle) {
+		max = clamp(floor, max / 2, max);
+		interval = max_t(unsigned long, interval / 2, HZ);
+	}
+	jbd2_set_max_transaction_buffers(journal, max);
+	journal->j_commit_interval = interval;
+	write_unlock(&journal->j_state_lock);
+	snapshot_debug(2, "%s transactions: max buffers=%d, "
+		       "commit interval=%ums\n",
+		       throttle ? "throttled" : "restored", max,
+		       jiffies_to_msecs(interval));
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CREDITS_ADAPTIVE
 /*
- * ext4_snapshot_copy_buffer_cow()
- * helper function for ext4_snapshot_test_and_cow()
- * copy COWed buffer to new allocated (locked) snapshot buffer
- * add complete the COW operation
+ * A ratio sample of a transaction with less user credits than this is
+ * dominated by the first COW in every block group and is not used.
  */
-static inline int
-ext4_snapshot_copy_buffer_cow(handle_t *handle, struct inode *snapshot,
-				   struct buffer_head *sbh,
-				   struct buffer_head *bh)
+#define SNAPSHOT_COW_MIN_USER		64
+
+/*
+ * ext4_snapshot_cow_factor_reset() - forget the learned COW credits ratio
+ * Called on mount and on snapshot take, when the new active snapshot has
+ * an empty COW bitmap cache and all blocks are going to be COWed again.
+ */
+void ext4_snapshot_cow_factor_reset(struct super_block *sb)
 {
-	__ext4_snapshot_copy_buffer(sbh, bh);
-	return ext4_snapshot_complete_cow(handle, snapshot, sbh, bh, 0);
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	spin_lock(&sbi->s_snapshot_budget_lock);
+	atomic_set(&sbi->s_snapshot_budget_user, 0);
+	sbi->s_snapshot_cow_ratio = 0;
+	sbi->s_snapshot_cow_samples = 0;
+	sbi->s_snapshot_cow_fallback = 0;
+	spin_unlock(&sbi->s_snapshot_budget_lock);
 }
 
 /*
- * ext4_snapshot_copy_buffer()
- * helper function for ext4_snapshot_take()
- * used for initializing pre-allocated snapshot blocks
- * copy buffer to snapshot buffer and sync to disk
- * 'mask' block bitmap with exclude bitmap before copying to snapshot.
+ * ext4_snapshot_cow_factor_sample() - fold the COW/user credits ratio of
+ * the last accounted transaction into the average.
+ * Called under s_snapshot_budget_lock on transaction rollover.  @gap is
+ * the number of transactions without COW in between, whose user credits
+ * are mixed with those of the accounted transaction, so they are dropped.
  */
-void ext4_snapshot_copy_buffer(struct buffer_head *sbh,
-		struct buffer_head *bh, const char *mask)
+static void ext4_snapshot_cow_factor_sample(struct ext4_sb_info *sbi,
+					    tid_t gap)
 {
-	lock_buffer(sbh);
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP
-	if (mask)
-		__ext4_snapshot_copy_bitmap(sbh,
-				sbh->b_data, bh->b_data, mask);
+	unsigned int user = atomic_xchg(&sbi->s_snapshot_budget_user, 0);
+	unsigned int cur = sbi->s_snapshot_budget_cur;
+	unsigned int ratio = sbi->s_snapshot_cow_ratio;
+	unsigned int sample;
+
+	if (gap || !cur || user < SNAPSHOT_COW_MIN_USER)
+		return;
+
+	sample = min_t(u64, ((u64)cur << EXT4_SNAPSHOT_COW_RATIO_SHIFT) / user,
+		       EXT4_COW_CREDITS << EXT4_SNAPSHOT_COW_RATIO_SHIFT);
+	if (!sbi->s_snapshot_cow_samples)
+		ratio = sample;
 	else
-		__ext4_snapshot_copy_buffer(sbh, bh);
-#else
-	__ext4_snapshot_copy_buffer(sbh, bh);
-#endif
-	unlock_buffer(sbh);
-	mark_buffer_dirty(sbh);
-	sync_dirty_buffer(sbh);
+		ratio += (sample >> SNAPSHOT_BUDGET_SHIFT) -
+			(ratio >> SNAPSHOT_BUDGET_SHIFT);
+	sbi->s_snapshot_cow_ratio = ratio;
+	if (sbi->s_snapshot_cow_samples < UINT_MAX)
+		sbi->s_snapshot_cow_samples++;
 }
 
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP
 /*
- * COW bitmap functions
+ * ext4_snapshot_cow_factor_fallback() - a COW operation could not top up
+ * its handle, so the learned ratio underestimates the COW load.
+ * Use the static factor until the next snapshot take.
  */
+void ext4_snapshot_cow_factor_fallback(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	spin_lock(&sbi->s_snapshot_budget_lock);
+	sbi->s_snapshot_cow_fallbacks++;
+	if (!sbi->s_snapshot_cow_fallback &&
+	    sbi->s_snapshot_cow_samples >= EXT4_SNAPSHOT_COW_MIN_SAMPLES)
+		snapshot_debug(1, "COW credits factor %d failed to top up "
+			       "handle - using static factor\n",
+			       ext4_snapshot_cow_factor(sb));
+	sbi->s_snapshot_cow_fallback = 1;
+	spin_unlock(&sbi->s_snapshot_budget_lock);
+}
 
+#endif
 /*
- * ext4_snapshot_init_cow_bitmap() init a new allocated (locked) COW bitmap
- * buffer on first time block group access after snapshot take.
- * COW bitmap is created by masking the block bitmap with exclude bitmap.
+ * ext4_snapshot_budget_init() - reset the COW budget to the journal defaults
+ * Called on mount and remount, when setting the journal parameters.
  */
-static int
-ext4_snapshot_init_cow_bitmap(struct super_block *sb,
-		unsigned int block_group, struct buffer_head *cow_bh)
+void ext4_snapshot_budget_init(struct super_block *sb, journal_t *journal)
 {
-	struct buffer_head *bitmap_bh;
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
-	struct buffer_head *exclude_bitmap_bh = NULL;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	spin_lock(&sbi->s_snapshot_budget_lock);
+	sbi->s_snapshot_budget_cur = 0;
+	sbi->s_snapshot_budget_avg = 0;
+	sbi->s_snapshot_budget_throttled = 0;
+	spin_unlock(&sbi->s_snapshot_budget_lock);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CREDITS_ADAPTIVE
+	ext4_snapshot_cow_factor_reset(sb);
 #endif
-	char *dst, *src, *mask = NULL;
+	ext4_snapshot_budget_set(sb, journal);
+}
 
-	bitmap_bh = ext4_read_block_bitmap(sb, block_group);
-	if (!bitmap_bh)
-		return -EIO;
+/*
+ * ext4_snapshot_budget_account() - account @credits consumed by a COW
+ * operation of @handle and adapt the transaction size on rollover.
+ */
+void ext4_snapshot_budget_account(handle_t *handle, int credits)
+{
+	journal_t *journal = handle->h_transaction->t_journal;
+	struct super_block *sb = journal->j_private;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	tid_t tid = handle->h_transaction->t_tid;
+	unsigned int max = journal->j_maxlen / 4;
+	int throttle = -1;
+	tid_t n;
+
+	if (credits <= 0 && tid == ACCESS_ONCE(sbi->s_snapshot_budget_tid))
+		return;
 
-	src = bitmap_bh->b_data;
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
-	exclude_bitmap_bh = ext4_read_exclude_bitmap(sb, block_group);
-	if (exclude_bitmap_bh)
-		/* mask block bitmap with exclude bitmap */
-		mask = exclude_bitmap_bh->b_data;
+	spin_lock(&sbi->s_snapshot_budget_lock);
+	if (tid != sbi->s_snapshot_budget_tid) {
+		unsigned int avg = sbi->s_snapshot_budget_avg;
+
+		/* fold the last accounted transaction into the average */
+		avg += (sbi->s_snapshot_budget_cur >> SNAPSHOT_BUDGET_SHIFT) -
+			(avg >> SNAPSHOT_BUDGET_SHIFT);
+		/* transactions in between had no COW */
+		for (n = tid - sbi->s_snapshot_budget_tid - 1;
+		     n > 0 && n < 256 && avg; n--)
+			avg -= (avg + (1 << SNAPSHOT_BUDGET_SHIFT) - 1) >>
+				SNAPSHOT_BUDGET_SHIFT;
+		if (sbi->s_snapshot_budget_cur > sbi->s_snapshot_budget_peak)
+			sbi->s_snapshot_budget_peak = sbi->s_snapshot_budget_cur;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CREDITS_ADAPTIVE
+		ext4_snapshot_cow_factor_sample(sbi,
+				tid - sbi->s_snapshot_budget_tid - 1);
 #endif
-	/*
-	 * Another COWing task may be changing this block bitmap
-	 * (allocating active snapshot blocks) while we are trying
-	 * to copy it.  At this point we are guaranteed that the only
-	 * changes to block bitmap are the new active snapshot blocks,
-	 * because before allocating/freeing any other blocks a task
-	 * must first get_write_access() on the bitmap and get here.
-	 */
-	ext4_lock_group(sb, block_group);
+		sbi->s_snapshot_budget_avg = avg;
+		sbi->s_snapshot_budget_tid = tid;
+		sbi->s_snapshot_budget_cur = 0;
+
+		if (!sbi->s_snapshot_budget_throttled &&
+		    avg > SNAPSHOT_BUDGET_THROTTLE(max))
+			throttle = 1;
+		else if (sbi->s_snapshot_budget_throttled &&
+			 avg < SNAPSHOT_BUDGET_RESTORE(max))
+			throttle = 0;
+		if (throttle >= 0)
+			sbi->s_snapshot_budget_throttled = throttle;
+	}
+	if (credits > 0)
+		sbi->s_snapshot_budget_cur += credits;
+	spin_unlock(&sbi->s_snapshot_budget_lock);
 
-	/*
-	 * in the path coming from ext4_snapshot_read_block_bitmap(),
-	 * cow_bh is a user page buffer so it has to be kmapped.
-	 */
-	dst = kmap_atomic(cow_bh->b_page, KM_USER0);
-	__ext4_snapshot_copy_bitmap(cow_bh, dst, src, mask);
-	kunmap_atomic(dst, KM_USER0);
+	if (throttle >= 0)
+		ext4_snapshot_budget_set(sb, journal);
+}
 
-	ext4_unlock_group(sb, block_group);
+/*
+ * ext4_snapshot_budget_fit() - make room for a handle of @credits
+ * A handle that is bigger than the throttled transaction size would fail to
+ * start, restart or extend, so restore the default transaction size and
+ * never throttle below @credits from now on.
+ */
+void ext4_snapshot_budget_fit(struct super_block *sb, int credits)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	int throttled;
+
+	spin_lock(&sbi->s_snapshot_budget_lock);
+	if (credits > sbi->s_snapshot_budget_credits)
+		sbi->s_snapshot_budget_credits = credits;
+	throttled = sbi->s_snapshot_budget_throttled;
+	sbi->s_snapshot_budget_throttled = 0;
+	spin_unlock(&sbi->s_snapshot_budget_lock);
+	if (throttled) {
+		ext4_snapshot_budget_set(sb, sbi->s_journal);
+		snapshot_debug(1, "handle of %d credits restored default "
+			       "transaction size\n", credits);
+	}
+}
 
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
-	brelse(exclude_bitmap_bh);
+/*
+ * ext4_snapshot_budget_show() - print the journal size and COW budget
+ * for the snapshot_journal sysfs attribute.  The journal size is compared
+ * with the min. and recommended journal size for snapshots.  The free log
+ * space and the outstanding credits of the running transaction show how
+ * close the journal is to waiting for log space.
+ */
+int ext4_snapshot_budget_show(struct ext4_sb_info *sbi, char *buf)
+{
+	journal_t *journal = sbi->s_journal;
+	unsigned long free, interval;
+	int max, outstanding = 0;
+
+	if (!journal)
+		return snprintf(buf, PAGE_SIZE, "none\n");
+
+	read_lock(&journal->j_state_lock);
+	free = journal->j_free;
+	max = journal->j_max_transaction_buffers;
+	interval = journal->j_commit_interval;
+	if (journal->j_running_transaction)
+		outstanding = atomic_read(&journal->j_running_transaction->
+					  t_outstanding_credits);
+	read_unlock(&journal->j_state_lock);
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CREDITS_ADAPTIVE
+	return snprintf(buf, PAGE_SIZE, "journal=%u min=%u big=%u "
+			"free=%lu outstanding=%d max_trans=%d commit_ms=%u "
+			"cow_avg=%u cow_peak=%u throttled=%d "
+			"cow_factor=%d cow_samples=%u cow_fallbacks=%u\n",
+			journal->j_maxlen, EXT4_MIN_JOURNAL_BLOCKS,
+			EXT4_BIG_JOURNAL_BLOCKS, free, outstanding, max,
+			jiffies_to_msecs(interval),
+			sbi->s_snapshot_budget_avg,
+			sbi->s_snapshot_budget_peak,
+			sbi->s_snapshot_budget_throttled,
+			ext4_snapshot_cow_factor(journal->j_private),
+			sbi->s_snapshot_cow_samples,
+			sbi->s_snapshot_cow_fallbacks);
+#else
+	return snprintf(buf, PAGE_SIZE, "journal=%u min=%u big=%u "
+			"free=%lu outstanding=%d max_trans=%d commit_ms=%u "
+			"cow_avg=%u cow_peak=%u throttled=%d\n",
+			journal->j_maxlen, EXT4_MIN_JOURNAL_BLOCKS,
+			EXT4_BIG_JOURNAL_BLOCKS, free, outstanding, max,
+			jiffies_to_msecs(interval),
+			sbi->s_snapshot_budget_avg,
+			sbi->s_snapshot_budget_peak,
+			sbi->s_snapshot_budget_throttled);
 #endif
-	brelse(bitmap_bh);
-	return 0;
 }
 
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BYPASS_CREDITS
 /*
- * ext4_snapshot_read_block_bitmap()
- * helper function for ext4_snapshot_get_block()
- * used for fixing the block bitmap user page buffer when
- * reading through to block device.
+ * ext4_snapshot_bypass_credits() - take @nblocks credits from the
+ * transaction pool for the new indirect blocks that map a COW bitmap.
+ * Up to snapshot_bypass_credits indirect blocks per transaction are
+ * journaled with credits added to @handle.  Snapshot blocks are never
+ * COWed, so raw buffer credits are enough.  When the pool is used up or
+ * the transaction cannot be extended, the indirect blocks are synced to
+ * disk, as without journal.
+ * Returns 1 if @handle was extended and 0 if the caller should sync.
  */
-int ext4_snapshot_read_block_bitmap(struct super_block *sb,
-		unsigned int block_group, struct buffer_head *bitmap_bh)
+int ext4_snapshot_bypass_credits(handle_t *handle, int nblocks)
 {
-	int err;
+	struct ext4_sb_info *sbi;
+	tid_t tid;
+	int ok = 0;
 
-	lock_buffer(bitmap_bh);
-	err = ext4_snapshot_init_cow_bitmap(sb, block_group, bitmap_bh);
-	unlock_buffer(bitmap_bh);
-	return err;
+	if (!ext4_handle_valid(handle))
+		return 0;
+
+	sbi = EXT4_SB(handle->h_transaction->t_journal->j_private);
+	tid = handle->h_transaction->t_tid;
+	spin_lock(&sbi->s_snapshot_bypass_lock);
+	if (tid != sbi->s_snapshot_bypass_tid) {
+		sbi->s_snapshot_bypass_tid = tid;
+		sbi->s_snapshot_bypass_used = 0;
+	}
+	if (sbi->s_snapshot_bypass_used + nblocks <=
+	    sbi->s_snapshot_bypass_credits) {
+		sbi->s_snapshot_bypass_used += nblocks;
+		ok = 1;
+	}
+	spin_unlock(&sbi->s_snapshot_bypass_lock);
+	if (!ok)
+		return 0;
+
+	if (jbd2_journal_extend(handle, nblocks)) {
+		/* return the credits to the pool of this transaction */
+		spin_lock(&sbi->s_snapshot_bypass_lock);
+		if (tid == sbi->s_snapshot_bypass_tid)
+			sbi->s_snapshot_bypass_used -= nblocks;
+		spin_unlock(&sbi->s_snapshot_bypass_lock);
+		return 0;
+	}
+	return 1;
+}
+
+#endif
+#if defined(CONFIG_EXT4_FS_SNAPSHOT_RACE_COW_WAITQ) || \
+	defined(CONFIG_EXT4_FS_SNAPSHOT_RACE_BITMAP_WAITQ)
+static int ext4_snapshot_wait_bit_sleep(void *word)
+{
+	io_schedule();
+	return 0;
 }
 
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW_WAITQ
 /*
- * ext4_snapshot_read_cow_bitmap - read COW bitmap from active snapshot
- * @handle:	JBD handle
- * @snapshot:	active snapshot
- * @block_group: block group
- *
- * Reads the COW bitmap block (i.e., the active snapshot copy of block bitmap).
- * Creates the COW bitmap on first access to @block_group after snapshot take.
- * COW bitmap cache is non-persistent, so no need to mark the group descriptor
- * block dirty.  COW bitmap races are handled internally, so no locks are
- * required when calling this function, only a valid @handle.
- *
- * Return COW bitmap buffer on success or NULL in case of failure.
+ * __ext4_snapshot_wait_pending_cow() - wait for pending COW to complete
+ * The waiting task sleeps on the bit wait queue of the 'new' flag of the
+ * snapshot buffer, until it is woken up by ext4_snapshot_end_pending_cow().
+ * The caller should hold a reference on @sbh.
  */
-static struct buffer_head *
-ext4_snapshot_read_cow_bitmap(handle_t *handle, struct inode *snapshot,
-			       unsigned int block_group)
+void __ext4_snapshot_wait_pending_cow(struct buffer_head *sbh,
+		sector_t blocknr)
 {
-	struct super_block *sb = snapshot->i_sb;
-	struct ext4_group_info *grp = ext4_get_group_info(sb, block_group);
-	struct ext4_group_desc *desc;
-	struct buffer_head *cow_bh;
-	ext4_fsblk_t bitmap_blk;
-	ext4_fsblk_t cow_bitmap_blk;
-	int err = 0;
-
-	desc = ext4_get_group_desc(sb, block_group, NULL);
-	if (!desc)
-		return NULL;
-
-	bitmap_blk = ext4_block_bitmap(sb, desc);
+#if defined(CONFIG_EXT4_DEBUG) || defined(CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS)
+	ktime_t start = ktime_get();
+#endif
 
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_BITMAP
+	snapshot_debug_once(2, "waiting for pending cow: "
+			"block = [%llu/%llu]...\n",
+			SNAPSHOT_BLOCK_TUPLE(blocknr));
 	/*
-	 * Handle concurrent COW bitmap operations.
-	 * bg_cow_bitmap has 3 states:
+	 * An unusually long pending COW operation can be caused by
+	 * the debugging function snapshot_test_delay(SNAPTEST_COW)
+	 * and by waiting for tracked reads to complete.
+	 */
+	ext4_snapshot_group_stats_add(sbh->b_bdev->bd_super, blocknr,
+				      EXT4_SNAPSHOT_GROUP_WAIT, 1);
+	wait_on_bit(&sbh->b_state, BH_New, ext4_snapshot_wait_bit_sleep,
+			TASK_UNINTERRUPTIBLE);
+#ifdef CONFIG_EXT4_DEBUG
+	snapshot_wait_hist_add(&snapshot_cow_wait_hist, start);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS
+	trace_ext4_snapshot_wait_pending_cow(sbh, blocknr,
+			ktime_us_delta(ktime_get(), start));
+#endif
+}
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW
+/*
+ * COW helper functions
+ *
+ * COW is done synchronously by the first task to get write access to a
+ * metadata buffer after snapshot take, and not at transaction commit time
+ * from the jbd2 frozen copy of the buffer, because:
+ * - b_frozen_data is the image of the committing transaction, not the
+ *   image of the buffer at snapshot take time.
+ * - mapping the snapshot block must be journalled in the same transaction
+ *   as the first modification, so after a crash the journal replay is
+ *   never left with a modified block which has no snapshot copy.
+ * - the commit thread cannot start a handle on the transaction that it is
+ *   committing, nor wait for log space without risking a deadlock.
+ * Only the snapshot buffer write-out is deferred: the snapshot file is
+ * added to the transaction ordered data list by complete_cow().
+ */
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COPY_NOCACHE
+/*
+ * copy a block to a snapshot buffer, which is written to disk and is not
+ * read again soon, without pulling the destination into the CPU cache.
+ * Architectures with non-temporal user copy share the kernel and user
+ * address space, so the user copy primitive works on kernel buffers.
+ */
+static inline void __ext4_snapshot_copy_nocache(void *dst, const void *src)
+{
+#ifdef ARCH_HAS_NOCACHE_UACCESS
+	__copy_from_user_inatomic_nocache(dst,
+			(__force const void __user *)src, SNAPSHOT_BLOCK_SIZE);
+#else
+	memcpy(dst, src, SNAPSHOT_BLOCK_SIZE);
+#endif
+}
+
+#endif
+/*
+ * copy buffer @bh to (locked) snapshot buffer @sbh and mark it uptodate
+ */
+static inline void
+__ext4_snapshot_copy_buffer(struct buffer_head *sbh,
+		struct buffer_head *bh)
+{
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COPY_NOCACHE
+	__ext4_snapshot_copy_nocache(sbh->b_data, bh->b_data);
+#else
+	memcpy(sbh->b_data, bh->b_data, SNAPSHOT_BLOCK_SIZE);
+#endif
+	set_buffer_uptodate(sbh);
+}
+
+#if defined(CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COPY_NOCACHE) && \
+	defined(CONFIG_EXT4_DEBUG)
+/* size of snapshot copies in one benchmark pass - larger than L2 cache */
+#define SNAPSHOT_COPY_TEST_SIZE		(8 << 20)
+/* size of the working set of a resuming writer - fits in L2 cache */
+#define SNAPSHOT_COPY_TEST_WSET		(256 << 10)
+
+/*
+ * read the working set and return the time it took in nsec
+ */
+static noinline s64 __ext4_snapshot_test_wset(const unsigned long *wset)
+{
+	unsigned long sum = 0;
+	ktime_t start = ktime_get();
+	int i;
+
+	for (i = 0; i < SNAPSHOT_COPY_TEST_WSET / sizeof(long);
+	     i += L1_CACHE_BYTES / sizeof(long))
+		/* volatile read keeps the loop from being optimized away */
+		sum += ACCESS_ONCE(wset[i]);
+	return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+/*
+ * ext4_snapshot_test_copy_nocache() - snapshot copy cache benchmark
+ * For memcpy() and the non-temporal copy, warm up a working set, time
+ * SNAPSHOT_COPY_TEST_SIZE of block copies, like snapshot take does while
+ * the file system is frozen, and then time reading the working set again,
+ * like a writer that resumes after thaw.
+ * Called from debugfs read of ext4/test-copy-nocache.
+ * Returns the length of the report written into @buf.
+ */
+int ext4_snapshot_test_copy_nocache(char *buf, int size)
+{
+	static const char * const names[] = { "memcpy", "nocache" };
+	char *src, *dst;
+	unsigned long *wset;
+	ktime_t start;
+	s64 ns_copy, ns_cold, ns_warm;
+	int i, j, len = 0;
+
+	src = vmalloc(2 * SNAPSHOT_COPY_TEST_SIZE + SNAPSHOT_COPY_TEST_WSET);
+	if (!src)
+		return snprintf(buf, size, "out of memory\n");
+	dst = src + SNAPSHOT_COPY_TEST_SIZE;
+	wset = (unsigned long *)(dst + SNAPSHOT_COPY_TEST_SIZE);
+	memset(src, 0x5a, 2 * SNAPSHOT_COPY_TEST_SIZE +
+	       SNAPSHOT_COPY_TEST_WSET);
+
+	for (j = 0; j < ARRAY_SIZE(names); j++) {
+		__ext4_snapshot_test_wset(wset);
+		ns_warm = __ext4_snapshot_test_wset(wset);
+
+		start = ktime_get();
+		for (i = 0; i < SNAPSHOT_COPY_TEST_SIZE;
+		     i += SNAPSHOT_BLOCK_SIZE) {
+			if (j)
+				__ext4_snapshot_copy_nocache(dst + i, src + i);
+			else
+				memcpy(dst + i, src + i, SNAPSHOT_BLOCK_SIZE);
+		}
+		ns_copy = ktime_to_ns(ktime_sub(ktime_get(), start));
+		ns_cold = __ext4_snapshot_test_wset(wset);
+
+		len += snprintf(buf + len, size - len,
+				"%s: copy %lld ns/block, working set "
+				"%lld ns warm, %lld ns after copy\n",
+				names[j], div_s64(ns_copy,
+				SNAPSHOT_COPY_TEST_SIZE / SNAPSHOT_BLOCK_SIZE),
+				ns_warm, ns_cold);
+		cond_resched();
+	}
+	vfree(src);
+	return len;
+}
+
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP
+/*
+ * use @mask to clear exclude bitmap bits from block bitmap
+ * when creating COW bitmap and mark snapshot buffer @sbh uptodate
+ */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_FAST
+#define SNAPSHOT_BITMAP_WORDS	(SNAPSHOT_BLOCK_SIZE / sizeof(unsigned long))
+
+/*
+ * test if all @mask words are equal to @val
+ */
+static inline int __ext4_snapshot_test_mask(const unsigned long *mask,
+		unsigned long val)
+{
+	int i;
+
+	for (i = 0; i < SNAPSHOT_BITMAP_WORDS; i++)
+		if (mask[i] != val)
+			return 0;
+	return 1;
+}
+
+/*
+ * mask @src with @mask a native word at a time.
+ * the exclude bitmap is usually empty or full, so test for that first
+ * (the test usually fails on the first words if it is not).
+ */
+static void __ext4_snapshot_mask_bitmap(char *dst, const char *src,
+		const char *mask)
+{
+	const unsigned long *ps = (const unsigned long *)src;
+	const unsigned long *pm = (const unsigned long *)mask;
+	unsigned long *pd = (unsigned long *)dst;
+	int i;
+
+	if (__ext4_snapshot_test_mask(pm, 0UL)) {
+		memcpy(dst, src, SNAPSHOT_BLOCK_SIZE);
+		return;
+	}
+	if (__ext4_snapshot_test_mask(pm, ~0UL)) {
+		memset(dst, 0, SNAPSHOT_BLOCK_SIZE);
+		return;
+	}
+	for (i = 0; i < SNAPSHOT_BITMAP_WORDS; i += 4) {
+		pd[i] = ps[i] & ~pm[i];
+		pd[i+1] = ps[i+1] & ~pm[i+1];
+		pd[i+2] = ps[i+2] & ~pm[i+2];
+		pd[i+3] = ps[i+3] & ~pm[i+3];
+	}
+}
+
+#endif
+static inline void
+__ext4_snapshot_copy_bitmap(struct buffer_head *sbh,
+		char *dst, const char *src, const char *mask)
+{
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_FAST
+	if (mask)
+		__ext4_snapshot_mask_bitmap(dst, src, mask);
+	else
+		memcpy(dst, src, SNAPSHOT_BLOCK_SIZE);
+#else
+	const u32 *ps = (const u32 *)src, *pm = (const u32 *)mask;
+	u32 *pd = (u32 *)dst;
+	int i;
+
+	if (mask) {
+		for (i = 0; i < SNAPSHOT_ADDR_PER_BLOCK; i++)
+			*pd++ = *ps++ & ~*pm++;
+	} else
+		memcpy(dst, src, SNAPSHOT_BLOCK_SIZE);
+#endif
+
+	set_buffer_uptodate(sbh);
+}
+#if defined(CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_FAST) && \
+	defined(CONFIG_EXT4_DEBUG)
+
+/*
+ * 32bit word loop, which was used before __ext4_snapshot_mask_bitmap()
+ */
+static noinline void __ext4_snapshot_mask_bitmap_u32(char *dst,
+		const char *src, const char *mask)
+{
+	const u32 *ps = (const u32 *)src, *pm = (const u32 *)mask;
+	u32 *pd = (u32 *)dst;
+	int i;
+
+	for (i = 0; i < SNAPSHOT_ADDR_PER_BLOCK; i++)
+		*pd++ = *ps++ & ~*pm++;
+}
+
+#define SNAPSHOT_BITMAP_TEST_LOOPS	1000
+
+/*
+ * ext4_snapshot_test_copy_bitmap() - COW bitmap masking benchmark
+ * Time SNAPSHOT_BITMAP_TEST_LOOPS masking operations with an empty,
+ * sparse and full exclude bitmap, with the old and new masking code.
+ * Also verifies that both implementations produce the same result.
+ * Called from debugfs read of ext4/test-copy-bitmap.
+ * Returns the length of the report written into @buf.
+ */
+int ext4_snapshot_test_copy_bitmap(char *buf, int size)
+{
+	static const char * const names[] = { "empty", "sparse", "full" };
+	char *src, *mask, *dst, *ref;
+	ktime_t start;
+	s64 ns_old, ns_new;
+	int i, j, len = 0;
+
+	src = kmalloc(4 * SNAPSHOT_BLOCK_SIZE, GFP_KERNEL);
+	if (!src)
+		return snprintf(buf, size, "out of memory\n");
+	mask = src + SNAPSHOT_BLOCK_SIZE;
+	dst = mask + SNAPSHOT_BLOCK_SIZE;
+	ref = dst + SNAPSHOT_BLOCK_SIZE;
+	get_random_bytes(src, SNAPSHOT_BLOCK_SIZE);
+
+	for (j = 0; j < ARRAY_SIZE(names); j++) {
+		memset(mask, j == 2 ? 0xff : 0, SNAPSHOT_BLOCK_SIZE);
+		if (j == 1)
+			/* a few excluded blocks at the end of the group */
+			memset(mask + SNAPSHOT_BLOCK_SIZE - 8, 0x0f, 8);
+
+		start = ktime_get();
+		for (i = 0; i < SNAPSHOT_BITMAP_TEST_LOOPS; i++)
+			__ext4_snapshot_mask_bitmap_u32(ref, src, mask);
+		ns_old = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		start = ktime_get();
+		for (i = 0; i < SNAPSHOT_BITMAP_TEST_LOOPS; i++)
+			__ext4_snapshot_mask_bitmap(dst, src, mask);
+		ns_new = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		len += snprintf(buf + len, size - len,
+				"%s mask: u32 loop %lld ns, "
+				"word loop %lld ns%s\n", names[j],
+				div_s64(ns_old, SNAPSHOT_BITMAP_TEST_LOOPS),
+				div_s64(ns_new, SNAPSHOT_BITMAP_TEST_LOOPS),
+				memcmp(dst, ref, SNAPSHOT_BLOCK_SIZE) ?
+				" - MISMATCH!" : "");
+		cond_resched();
+	}
+	kfree(src);
+	return len;
+}
+#endif
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_READ
+/*
+ * Wait for completion of tracked reads of @bh through @snapshot to the
+ * block device, before @bh is allowed to change.
+ */
+static inline void ext4_snapshot_wait_tracked_reads(struct inode *snapshot,
+		struct buffer_head *bh)
+{
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_READ_RANGE
+	while (bh && ext4_snapshot_tracked_reads_pending(snapshot->i_sb,
+							 bh->b_blocknr)) {
+		snapshot_debug_once(2, "waiting for tracked reads: "
+			"block = [%llu/%llu]...\n",
+			SNAPSHOT_BLOCK_TUPLE(bh->b_blocknr));
+#else
+	while (bh && buffer_tracked_readers_count(bh) > 0) {
+		snapshot_debug_once(2, "waiting for tracked reads: "
+			"block = [%llu/%llu], "
+			"tracked_readers_count = %d...\n",
+			SNAPSHOT_BLOCK_TUPLE(bh->b_blocknr),
+			buffer_tracked_readers_count(bh));
+#endif
+		/*
+		 * Quote from LVM snapshot pending_complete() function:
+		 * "Check for conflicting reads. This is extremely improbable,
+		 *  so msleep(1) is sufficient and there is no need for a wait
+		 *  queue." (drivers/md/dm-snap.c).
+		 */
+		msleep(1);
+		/* XXX: Should we fail after N retries? */
+	}
+}
+
+#endif
+/*
+ * ext4_snapshot_complete_cow()
+ * Unlock a newly COWed snapshot buffer and complete the COW operation.
+ * Optionally, sync the buffer to disk or add it to the current transaction
+ * as dirty data.
+ */
+static inline int
+ext4_snapshot_complete_cow(handle_t *handle, struct inode *snapshot,
+		struct buffer_head *sbh, struct buffer_head *bh, int sync)
+{
+	int err = 0;
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_READ
+	/* wait for completion of tracked reads before completing COW */
+	ext4_snapshot_wait_tracked_reads(snapshot, bh);
+#endif
+	unlock_buffer(sbh);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_ORDERED_RANGE
+	/* order only the snapshot block we COWed bh to */
+	if (bh)
+		err = ext4_jbd2_file_inode_range(handle, snapshot,
+			(loff_t)SNAPSHOT_IBLOCK(bh->b_blocknr) <<
+				snapshot->i_blkbits, sbh->b_size);
+	else
+		err = ext4_jbd2_file_inode(handle, snapshot);
+#else
+	err = ext4_jbd2_file_inode(handle, snapshot);
+#endif
+	if (err)
+		goto out;
+	/* simulate the write of the COWed block by a slow device */
+	snapshot_test_latency(SNAPLAT_COW);
+#if defined(CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_CGROUP) && \
+	defined(CONFIG_BLK_CGROUP)
+	/* charge the write of the copy to the cgroup that triggered COW */
+	sbh->b_blkcg_id = blkio_cgroup_charge_cow(sbh->b_size);
+#endif
+	mark_buffer_dirty(sbh);
+	if (sync)
+		__sync_dirty_buffer(sbh, EXT4_SNAPSHOT_SYNC_WRITE);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+	atomic64_inc(&EXT4_I(snapshot)->i_snapshot_cowed);
+#endif
+	if (bh)
+		ext4_snapshot_group_stats_add(snapshot->i_sb, bh->b_blocknr,
+					      EXT4_SNAPSHOT_GROUP_COW, 1);
+out:
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW
+	/* COW operation is complete */
+	ext4_snapshot_end_pending_cow(sbh);
+#endif
+	return err;
+}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_NUMA
+/*
+ * ext4_snapshot_getblk_local() - get the buffer of a new allocated snapshot
+ * block, with its page allocated on the node of the COWing CPU.
+ * A COW copy is written once by the COWing task right after this call,
+ * so the task memory policy or cpuset page spread should not place it on
+ * a remote node.  The page is added to the block device page cache before
+ * sb_getblk(), which then attaches buffers to the cached page.
+ * Falls back to plain sb_getblk() if the local node has no free pages.
+ */
+struct buffer_head *ext4_snapshot_getblk_local(struct super_block *sb,
+					       ext4_fsblk_t block)
+{
+	struct address_space *mapping = sb->s_bdev->bd_inode->i_mapping;
+	pgoff_t index = block >> (PAGE_CACHE_SHIFT - sb->s_blocksize_bits);
+	gfp_t gfp = (mapping_gfp_mask(mapping) & ~__GFP_FS) | __GFP_MOVABLE;
+	struct page *page;
+
+	if (nr_online_nodes < 2)
+		goto out;
+
+	page = find_get_page(mapping, index);
+	if (!page) {
+		page = alloc_pages_exact_node(numa_node_id(),
+				gfp | __GFP_THISNODE | __GFP_NOWARN, 0);
+		if (!page)
+			goto out;
+		if (!add_to_page_cache_lru(page, mapping, index,
+					   gfp & GFP_RECLAIM_MASK))
+			unlock_page(page);
+	}
+	page_cache_release(page);
+out:
+	return sb_getblk(sb, block);
+}
+
+#endif
+/*
+ * ext4_snapshot_copy_buffer_cow()
+ * helper function for ext4_snapshot_test_and_cow()
+ * copy COWed buffer to new allocated (locked) snapshot buffer
+ * add complete the COW operation
+ */
+static inline int
+ext4_snapshot_copy_buffer_cow(handle_t *handle, struct inode *snapshot,
+				   struct buffer_head *sbh,
+				   struct buffer_head *bh)
+{
+	__ext4_snapshot_copy_buffer(sbh, bh);
+	return ext4_snapshot_complete_cow(handle, snapshot, sbh, bh, 0);
+}
+
+/*
+ * ext4_snapshot_copy_buffer()
+ * helper function for ext4_snapshot_take()
+ * used for initializing pre-allocated snapshot blocks
+ * copy buffer to snapshot buffer and sync to disk
+ * (with CTL_TAKE_PREPARE, snapshot_take() syncs all copies at once)
+ * 'mask' block bitmap with exclude bitmap before copying to snapshot.
+ */
+void ext4_snapshot_copy_buffer(struct buffer_head *sbh,
+		struct buffer_head *bh, const char *mask)
+{
+	lock_buffer(sbh);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP
+	if (mask)
+		__ext4_snapshot_copy_bitmap(sbh,
+				sbh->b_data, bh->b_data, mask);
+	else
+		__ext4_snapshot_copy_buffer(sbh, bh);
+#else
+	__ext4_snapshot_copy_buffer(sbh, bh);
+#endif
+	unlock_buffer(sbh);
+	mark_buffer_dirty(sbh);
+#ifndef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_PREPARE
+	sync_dirty_buffer(sbh);
+#endif
+}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP
+/*
+ * COW bitmap functions
+ */
+
+/*
+ * ext4_snapshot_init_cow_bitmap() init a new allocated (locked) COW bitmap
+ * buffer on first time block group access after snapshot take.
+ * COW bitmap is created by masking the block bitmap with exclude bitmap.
+ */
+static int
+ext4_snapshot_init_cow_bitmap(struct super_block *sb,
+		unsigned int block_group, struct buffer_head *cow_bh)
+{
+	struct buffer_head *bitmap_bh;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
+	struct buffer_head *exclude_bitmap_bh = NULL;
+#endif
+	char *dst, *src, *mask = NULL;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS_LOCK
+	u64 acquired;
+	int contended;
+#endif
+
+	/* simulate the read of the block bitmap by a slow device */
+	snapshot_test_latency(SNAPLAT_BITMAP);
+	bitmap_bh = ext4_read_block_bitmap(sb, block_group);
+	if (!bitmap_bh)
+		return -EIO;
+
+	src = bitmap_bh->b_data;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
+	exclude_bitmap_bh = ext4_read_exclude_bitmap(sb, block_group);
+	if (exclude_bitmap_bh)
+		/* mask block bitmap with exclude bitmap */
+		mask = exclude_bitmap_bh->b_data;
+#endif
+	/*
+	 * Another COWing task may be changing this block bitmap
+	 * (allocating active snapshot blocks) while we are trying
+	 * to copy it.  At this point we are guaranteed that the only
+	 * changes to block bitmap are the new active snapshot blocks,
+	 * because before allocating/freeing any other blocks a task
+	 * must first get_write_access() on the bitmap and get here.
+	 */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS_LOCK
+	contended = spin_is_locked(ext4_group_lock_ptr(sb, block_group));
+	acquired = local_clock();
+	ext4_lock_group(sb, block_group);
+	acquired = ext4_snapshot_stats_lock_wait(sb, EXT4_SNAPSHOT_LOCK_GROUP,
+						 acquired, contended);
+#else
+	ext4_lock_group(sb, block_group);
+#endif
+
+	/*
+	 * in the path coming from ext4_snapshot_read_block_bitmap(),
+	 * cow_bh is a user page buffer so it has to be kmapped.
+	 */
+	dst = kmap_atomic(cow_bh->b_page, KM_USER0);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_SUBPAGE
+	/* the page may hold more than one buffer */
+	__ext4_snapshot_copy_bitmap(cow_bh, dst + bh_offset(cow_bh),
+				    src, mask);
+#else
+	__ext4_snapshot_copy_bitmap(cow_bh, dst, src, mask);
+#endif
+	kunmap_atomic(dst, KM_USER0);
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS_LOCK
+	ext4_snapshot_stats_lock_hold(sb, EXT4_SNAPSHOT_LOCK_GROUP, acquired);
+#endif
+	ext4_unlock_group(sb, block_group);
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
+	brelse(exclude_bitmap_bh);
+#endif
+	brelse(bitmap_bh);
+	return 0;
+}
+
+/*
+ * ext4_snapshot_read_block_bitmap()
+ * helper function for ext4_snapshot_get_block()
+ * used for fixing the block bitmap user page buffer when
+ * reading through to block device.
+ */
+int ext4_snapshot_read_block_bitmap(struct super_block *sb,
+		unsigned int block_group, struct buffer_head *bitmap_bh)
+{
+	int err;
+
+	lock_buffer(bitmap_bh);
+	err = ext4_snapshot_init_cow_bitmap(sb, block_group, bitmap_bh);
+	unlock_buffer(bitmap_bh);
+	return err;
+}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_BITMAP_WAITQ
+/*
+ * Max. no. of times to wait for a pending COW bitmap of a block group.
+ * A wait ends when the COW bitmap cache is initialized or when the task
+ * that was creating the COW bitmap has failed, in which case the waiter
+ * tries to create the COW bitmap itself, so the limit is only reached if
+ * COW bitmap creation keeps failing.
+ */
+#define EXT4_SNAPSHOT_COW_BITMAP_RETRIES	16
+
+/*
+ * Wait on the group wait bit, until the task which is creating the COW
+ * bitmap of @block_group updates the COW bitmap cache.
+ */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS
+static void ext4_snapshot_wait_pending_cow_bitmap(struct super_block *sb,
+		struct ext4_group_info *grp, unsigned int block_group)
+#else
+static void ext4_snapshot_wait_pending_cow_bitmap(struct ext4_group_info *grp,
+		unsigned int block_group)
+#endif
+{
+#if defined(CONFIG_EXT4_DEBUG) || defined(CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS)
+	ktime_t start = ktime_get();
+#endif
+
+	snapshot_debug_once(2, "waiting for pending COW "
+			    "bitmap #%d...\n", block_group);
+	wait_on_bit(&grp->bb_state, EXT4_GROUP_INFO_COW_BITMAP_BIT,
+			ext4_snapshot_wait_bit_sleep, TASK_UNINTERRUPTIBLE);
+#ifdef CONFIG_EXT4_DEBUG
+	snapshot_wait_hist_add(&snapshot_cow_bitmap_wait_hist, start);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS
+	trace_ext4_snapshot_wait_cow_bitmap(sb, block_group,
+			ACCESS_ONCE(grp->bg_cow_bitmap),
+			ktime_us_delta(ktime_get(), start));
+#endif
+}
+
+#endif
+/*
+ * ext4_snapshot_read_cow_bitmap - read COW bitmap from active snapshot
+ * @handle:	JBD handle
+ * @snapshot:	active snapshot
+ * @block_group: block group
+ *
+ * Reads the COW bitmap block (i.e., the active snapshot copy of block bitmap).
+ * Creates the COW bitmap on first access to @block_group after snapshot take.
+ * COW bitmap cache is non-persistent, so no need to mark the group descriptor
+ * block dirty.  COW bitmap races are handled internally, so no locks are
+ * required when calling this function, only a valid @handle.
+ *
+ * Return COW bitmap buffer on success or NULL in case of failure.
+ */
+static struct buffer_head *
+ext4_snapshot_read_cow_bitmap(handle_t *handle, struct inode *snapshot,
+			       unsigned int block_group)
+{
+	struct super_block *sb = snapshot->i_sb;
+	struct ext4_group_info *grp = ext4_get_group_info(sb, block_group);
+	struct ext4_group_desc *desc;
+	struct buffer_head *cow_bh;
+	ext4_fsblk_t bitmap_blk;
+	ext4_fsblk_t cow_bitmap_blk;
+	int err = 0;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_BITMAP_WAITQ
+	int retries = 0;
+#endif
+#if defined(CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS) || defined(CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS)
+	ktime_t start;
+#endif
+
+	desc = ext4_get_group_desc(sb, block_group, NULL);
+	if (!desc)
+		return NULL;
+
+	bitmap_blk = ext4_block_bitmap(sb, desc);
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_BITMAP
+	/*
+	 * Handle concurrent COW bitmap operations.
+	 * bg_cow_bitmap has 3 states:
 	 * = 0 - uninitialized (after mount and after snapshot take).
 	 * = bg_block_bitmap - marks pending COW of block bitmap.
 	 * other - location of initialized COW bitmap block.
@@ -306,13 +1278,27 @@ ext4_snapshot_read_cow_bitmap(handle_t *handle, struct inode *snapshot,
 	 * the COW bitmap block and update COW bitmap cache.  Other tasks will
 	 * busy wait until the COW bitmap cache is in initialized state, before
 	 * reading the COW bitmap block.
+	 * With CONFIG_EXT4_FS_SNAPSHOT_RACE_BITMAP_WAITQ, other tasks sleep on
+	 * the group COW bitmap wait bit instead, which is set together with
+	 * the pending COW state and cleared after the COW bitmap cache is
+	 * updated.
 	 */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_BITMAP_CACHED
+	/* initialized COW bitmap cache can be read without the group lock */
+	if (ext4_snapshot_cow_bitmap_cached(sb, block_group, bitmap_blk))
+		return sb_bread(sb, grp->bg_cow_bitmap);
+#endif
 	do {
 		ext4_lock_group(sb, block_group);
 		cow_bitmap_blk = grp->bg_cow_bitmap;
-		if (cow_bitmap_blk == 0)
+		if (cow_bitmap_blk == 0) {
 			/* mark pending COW of bitmap block */
 			grp->bg_cow_bitmap = bitmap_blk;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_BITMAP_WAITQ
+			set_bit(EXT4_GROUP_INFO_COW_BITMAP_BIT,
+				&grp->bb_state);
+#endif
+		}
 		ext4_unlock_group(sb, block_group);
 
 		if (cow_bitmap_blk == 0) {
@@ -325,6 +1311,21 @@ ext4_snapshot_read_cow_bitmap(handle_t *handle, struct inode *snapshot,
 		}
 		if (cow_bitmap_blk == bitmap_blk) {
 			/* wait for another task to COW bitmap block */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_BITMAP_WAITQ
+			if (++retries > EXT4_SNAPSHOT_COW_BITMAP_RETRIES) {
+				ext4_warning(sb, "gave up waiting for pending "
+					"COW bitmap #%u of snapshot (%u)",
+					block_group, snapshot->i_generation);
+				return NULL;
+			}
+			trace_cow_inc(handle, bitmap_waits);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS
+			ext4_snapshot_wait_pending_cow_bitmap(sb, grp,
+							      block_group);
+#else
+			ext4_snapshot_wait_pending_cow_bitmap(grp, block_group);
+#endif
+#else
 			snapshot_debug_once(2, "waiting for pending COW "
 					    "bitmap #%d...\n", block_group);
 			/*
@@ -333,8 +1334,11 @@ ext4_snapshot_read_cow_bitmap(handle_t *handle, struct inode *snapshot,
 			 * and there is no need for a wait queue.
 			 */
 			msleep(1);
+#endif
 		}
+#ifndef CONFIG_EXT4_FS_SNAPSHOT_RACE_BITMAP_WAITQ
 		/* XXX: Should we fail after N retries? */
+#endif
 	} while (cow_bitmap_blk == 0 || cow_bitmap_blk == bitmap_blk);
 #else
 	ext4_lock_group(sb, block_group);
@@ -344,6 +1348,9 @@ ext4_snapshot_read_cow_bitmap(handle_t *handle, struct inode *snapshot,
 	if (cow_bitmap_blk)
 		return sb_bread(sb, cow_bitmap_blk);
 
+#if defined(CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS) || defined(CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS)
+	start = ktime_get();
+#endif
 	/*
 	 * Try to read cow bitmap block from snapshot file.  If COW bitmap
 	 * is not yet allocated, create the new COW bitmap block.
@@ -373,6 +1380,14 @@ ext4_snapshot_read_cow_bitmap(handle_t *handle, struct inode *snapshot,
 	err = ext4_snapshot_init_cow_bitmap(sb, block_group, cow_bh);
 	if (err)
 		goto out;
+	ext4_snapshot_group_stats_add(sb, bitmap_blk,
+				      EXT4_SNAPSHOT_GROUP_BITMAP, 1);
+#ifdef CONFIG_EXT4_FS_COUNT_FREE_HWEIGHT
+	snapshot_debug(3, "COW bitmap #%u of snapshot (%u): %lu blocks "
+			"in use by snapshot\n", block_group,
+			snapshot->i_generation, EXT4_BLOCKS_PER_GROUP(sb) -
+			ext4_count_free(cow_bh, EXT4_BLOCKS_PER_GROUP(sb) / 8));
+#endif
 	/*
 	 * complete pending COW operation. no need to wait for tracked reads
 	 * of block bitmap, because it is copied directly to page buffer by
@@ -383,6 +1398,13 @@ ext4_snapshot_read_cow_bitmap(handle_t *handle, struct inode *snapshot,
 		goto out;
 
 	trace_cow_inc(handle, bitmaps);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
+	ext4_snapshot_stats_latency(sb, EXT4_SNAPSHOT_LAT_BITMAP, start);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS
+	trace_ext4_snapshot_cow_bitmap_init(sb, block_group, cow_bh->b_blocknr,
+			ktime_us_delta(ktime_get(), start));
+#endif
 out:
 	if (!err && cow_bh) {
 		/* initialized COW bitmap block */
@@ -404,10 +1426,185 @@ out:
 	ext4_lock_group(sb, block_group);
 	grp->bg_cow_bitmap = cow_bitmap_blk;
 	ext4_unlock_group(sb, block_group);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_BITMAP_WAITQ
+	/* wake up the tasks waiting for the pending COW bitmap */
+	clear_bit(EXT4_GROUP_INFO_COW_BITMAP_BIT, &grp->bb_state);
+	smp_mb__after_clear_bit();
+	wake_up_bit(&grp->bb_state, EXT4_GROUP_INFO_COW_BITMAP_BIT);
+#endif
+
+	return cow_bh;
+}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_LOAD_COW_BITMAP
+/*
+ * ext4_snapshot_load_cow_bitmaps - load COW bitmap cache from active snapshot
+ * @sb:		super block
+ * @snapshot:	active snapshot
+ *
+ * The COW bitmap of a block group is the active snapshot copy of the group
+ * block bitmap, so the snapshot block map is the persistent copy of the COW
+ * bitmap cache.  Look up the COW bitmaps of all block groups in the snapshot
+ * block map and initialize the COW bitmap cache, so the first write access
+ * to a block group after mount doesn't have to.
+ * Called from snapshot_load() under sb_lock, on f/s mount.
+ *
+ * Return the number of loaded COW bitmap cache entries or < 0 on error.
+ */
+int ext4_snapshot_load_cow_bitmaps(struct super_block *sb,
+		struct inode *snapshot)
+{
+	ext4_group_t ngroups = ext4_get_groups_count(sb);
+	ext4_fsblk_t snapshot_blocks = SNAPSHOT_BLOCKS(snapshot);
+	struct ext4_group_info *grp;
+	struct ext4_group_desc *desc;
+	ext4_fsblk_t bitmap_blk, cow_bitmap_blk = 0;
+	ext4_group_t i;
+	int err, n = 0;
+
+	for (i = 0; i < ngroups; i++) {
+		desc = ext4_get_group_desc(sb, i, NULL);
+		if (!desc)
+			continue;
+		bitmap_blk = ext4_block_bitmap(sb, desc);
+		if (bitmap_blk >= snapshot_blocks)
+			/* group was added by resize after snapshot take */
+			continue;
+
+		err = ext4_snapshot_map_blocks(NULL, snapshot, bitmap_blk, 1,
+				&cow_bitmap_blk, SNAPMAP_READ);
+		if (err < 0)
+			return err;
+		if (!err)
+			/* COW bitmap was not created yet */
+			continue;
+
+		grp = ext4_get_group_info(sb, i);
+		ext4_lock_group(sb, i);
+		if (!grp->bg_cow_bitmap)
+			grp->bg_cow_bitmap = cow_bitmap_blk;
+		ext4_unlock_group(sb, i);
+		n++;
+		cond_resched();
+	}
+	return n;
+}
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_EXTENTS
+/*
+ * ext4_snapshot_build_cow_extents() builds the in-memory summary of the
+ * COW bitmap of @block_group from the COW bitmap buffer @cow_bh.
+ * Called on the first COW bitmap test after the summary was reset.
+ */
+static void ext4_snapshot_build_cow_extents(struct super_block *sb,
+		unsigned int block_group, struct buffer_head *cow_bh)
+{
+	struct ext4_group_info *grp = ext4_get_group_info(sb, block_group);
+	struct ext4_cow_extent ext[EXT4_COW_EXTENTS_MAX];
+	ext4_grpblk_t max = EXT4_BLOCKS_PER_GROUP(sb);
+	ext4_grpblk_t start, end = 0;
+	int n = 0;
+
+	ext4_lock_group(sb, block_group);
+	if (grp->bg_cow_nr_extents != EXT4_COW_EXTENTS_UNKNOWN)
+		goto out;
+	while (end < max) {
+		start = ext4_find_next_bit(cow_bh->b_data, max, end);
+		if (start >= max)
+			break;
+		if (n == EXT4_COW_EXTENTS_MAX) {
+			n = EXT4_COW_EXTENTS_MANY;
+			break;
+		}
+		end = ext4_find_next_zero_bit(cow_bh->b_data, max, start);
+		ext[n].ce_start = start;
+		ext[n].ce_end = min(end, max);
+		n++;
+	}
+	if (n > 0)
+		memcpy(grp->bg_cow_extents, ext, n * sizeof(ext[0]));
+	grp->bg_cow_nr_extents = n;
+out:
+	ext4_unlock_group(sb, block_group);
+}
+
+/*
+ * ext4_snapshot_test_cow_extents() tests the in-memory summary of the
+ * COW bitmap.  Has the same semantics as ext4_mb_test_bit_range() on the
+ * COW bitmap buffer, but returns < 0 if the summary cannot answer.
+ */
+static int ext4_snapshot_test_cow_extents(struct super_block *sb,
+		unsigned int block_group, ext4_grpblk_t bit, int *maxblocks)
+{
+	struct ext4_group_info *grp = ext4_get_group_info(sb, block_group);
+	struct ext4_cow_extent *ext;
+	int i, n, ret = 0;
+
+	ext4_lock_group(sb, block_group);
+	n = grp->bg_cow_nr_extents;
+	if (n < 0)
+		ret = n;
+	for (i = 0; i < n; i++) {
+		ext = &grp->bg_cow_extents[i];
+		if (bit < ext->ce_start) {
+			/* not in use up to the next extent */
+			*maxblocks = min(*maxblocks, ext->ce_start - bit);
+			break;
+		}
+		if (bit < ext->ce_end) {
+			/* in use up to the end of this extent */
+			*maxblocks = min(*maxblocks, ext->ce_end - bit);
+			ret = 1;
+			break;
+		}
+	}
+	ext4_unlock_group(sb, block_group);
+	return ret;
+}
+
+/* reset the COW bitmap summary after clearing bits in the COW bitmap */
+static inline void ext4_snapshot_reset_cow_extents(struct super_block *sb,
+		unsigned int block_group)
+{
+	ext4_get_group_info(sb, block_group)->bg_cow_nr_extents =
+		EXT4_COW_EXTENTS_UNKNOWN;
+}
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_HANDLE
+/*
+ * ext4_snapshot_handle_cow_bitmap - get COW bitmap via the handle cache
+ * Consecutive tests of a handle usually hit the same block group, so the
+ * handle keeps a reference to the last COW bitmap buffer it read, until
+ * ext4_journal_stop() of the outermost handle.  The COW bitmap location of
+ * a group does not change while handles exist, because the COW bitmap
+ * cache is reset only on snapshot take under journal_lock_updates().
+ *
+ * Returns a referenced COW bitmap buffer or NULL on error.
+ */
+static struct buffer_head *
+ext4_snapshot_handle_cow_bitmap(handle_t *handle, struct inode *snapshot,
+				unsigned int block_group)
+{
+	struct buffer_head *cow_bh = handle->h_cow_bitmap_bh;
+
+	if (cow_bh && handle->h_cow_bitmap_group == block_group) {
+		get_bh(cow_bh);
+		return cow_bh;
+	}
 
+	cow_bh = ext4_snapshot_read_cow_bitmap(handle, snapshot, block_group);
+	if (!cow_bh)
+		return NULL;
+	brelse(handle->h_cow_bitmap_bh);
+	handle->h_cow_bitmap_bh = cow_bh;
+	handle->h_cow_bitmap_group = block_group;
+	get_bh(cow_bh);
 	return cow_bh;
 }
 
+#endif
 /*
  * ext4_snapshot_test_cow_bitmap - test if blocks are in use by snapshot
  * @handle:	JBD handle
@@ -442,9 +1639,31 @@ ext4_snapshot_test_cow_bitmap(handle_t *handle, struct inode *snapshot,
 		 */
 		return 0;
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_EXTENTS
+	/*
+	 * The summary is built from an initialized COW bitmap, so there is
+	 * no need to read the COW bitmap if the summary can answer.
+	 * Excluded blocks in use by snapshot are cleared from the COW bitmap
+	 * buffer below.
+	 */
+	ret = ext4_snapshot_test_cow_extents(snapshot->i_sb, block_group,
+					     bit, maxblocks);
+	if (ret == 0 || (ret > 0 && !excluded))
+		return ret;
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_HANDLE
+	cow_bh = ext4_snapshot_handle_cow_bitmap(handle, snapshot, block_group);
+#else
 	cow_bh = ext4_snapshot_read_cow_bitmap(handle, snapshot, block_group);
+#endif
 	if (!cow_bh)
 		return -EIO;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_EXTENTS
+	if (ret == EXT4_COW_EXTENTS_UNKNOWN)
+		ext4_snapshot_build_cow_extents(snapshot->i_sb, block_group,
+						cow_bh);
+#endif
 	/*
 	 * if the bit is set in the COW bitmap,
 	 * then the block is in use by snapshot
@@ -463,14 +1682,23 @@ ext4_snapshot_test_cow_bitmap(handle_t *handle, struct inode *snapshot,
 		 * Mark that exclude bitmap needs to be fixed and clear blocks
 		 * from COW bitmap.
 		 */
-		EXT4_SET_FLAGS(excluded->i_sb, EXT4_FLAGS_FIX_EXCLUDE);
+		ext4_snapshot_mark_group_fix(handle, excluded->i_sb,
+					     block_group);
 		ext4_warning(excluded->i_sb,
 			"clearing excluded file (ino=%lu) blocks [%d-%d/%lu] "
 			"from COW bitmap! - running fsck to fix exclude bitmap "
 			"is recommended.\n",
 			excluded->i_ino, bit, bit+inuse-1, block_group);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_EXTENTS
+		ext4_lock_group(excluded->i_sb, block_group);
 		for (i = 0; i < inuse; i++)
 			ext4_clear_bit(bit+i, cow_bh->b_data);
+		ext4_snapshot_reset_cow_extents(excluded->i_sb, block_group);
+		ext4_unlock_group(excluded->i_sb, block_group);
+#else
+		for (i = 0; i < inuse; i++)
+			ext4_clear_bit(bit+i, cow_bh->b_data);
+#endif
 		ret = ext4_jbd2_file_inode(handle, snapshot);
 		mark_buffer_dirty(cow_bh);
 	}
@@ -504,6 +1732,9 @@ int ext4_snapshot_test_and_exclude(const char *where, handle_t *handle,
 	ext4_group_t block_group = SNAPSHOT_BLOCK_GROUP(block);
 	ext4_grpblk_t bit = SNAPSHOT_BLOCK_GROUP_OFFSET(block);
 	int err = 0, n = 0, excluded = 0, exclude_uninit;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_CACHE
+	ext4_grpblk_t max;
+#endif
 
 	err = -EIO;
 	gdp = ext4_get_group_desc(sb, block_group, &gdp_bh);
@@ -528,6 +1759,37 @@ int ext4_snapshot_test_and_exclude(const char *where, handle_t *handle,
 			goto out;
 	}
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_CACHE
+	if (count > SNAPSHOT_BLOCKS_PER_GROUP - bit)
+		count = SNAPSHOT_BLOCKS_PER_GROUP - bit;
+	max = bit + count;
+	/*
+	 * Set ranges of clear bits at once under the group lock,
+	 * which also protects clearing of exclude bits on free.
+	 */
+	ext4_lock_group(sb, block_group);
+	while (bit < max) {
+		bit = ext4_find_next_zero_bit(exclude_bitmap_bh->b_data,
+					      max, bit);
+		if (bit >= max)
+			break;
+		if (!exclude) {
+			n = 1;
+			break;
+		}
+		n = ext4_find_next_bit(exclude_bitmap_bh->b_data,
+				       max, bit) - bit;
+		ext4_set_bits(exclude_bitmap_bh->b_data, bit, n);
+		excluded += n;
+		bit += n;
+	}
+	ext4_unlock_group(sb, block_group);
+	if (excluded)
+		snapshot_debug(2, "excluded blocks: %d [%d-%d/%d]\n",
+				excluded, max - count, max - 1, block_group);
+	if (exclude)
+		n = 0;
+#else
 	while (count > 0 && bit < SNAPSHOT_BLOCKS_PER_GROUP) {
 		if (!ext4_set_bit_atomic(sb_bgl_lock(EXT4_SB(sb),
 						block_group),
@@ -545,9 +1807,10 @@ int ext4_snapshot_test_and_exclude(const char *where, handle_t *handle,
 		count--;
 		cond_resched();
 	}
+#endif
 
 	if (n && !exclude) {
-		EXT4_SET_FLAGS(sb, EXT4_FLAGS_FIX_EXCLUDE);
+		ext4_snapshot_mark_group_fix(handle, sb, block_group);
 		ext4_error(sb, where,
 			"snapshot file block [%d/%d] not in exclude bitmap! - "
 			"running fsck to fix exclude bitmap is recommended.\n",
@@ -562,26 +1825,169 @@ int ext4_snapshot_test_and_exclude(const char *where, handle_t *handle,
 		excluded += n;
 	}
 
-	if (exclude && excluded) {
-		err = ext4_handle_dirty_metadata(handle,
-						 NULL, exclude_bitmap_bh);
+	if (exclude && excluded) {
+		err = ext4_handle_dirty_metadata(handle,
+						 NULL, exclude_bitmap_bh);
+		if (err)
+			goto out;
+
+		if (exclude_uninit) {
+			gdp->bg_flags &= cpu_to_le16(~EXT4_BG_EXCLUDE_UNINIT);
+			gdp->bg_checksum = ext4_group_desc_csum(EXT4_SB(sb),
+							        block_group, gdp);
+			err = ext4_handle_dirty_metadata(handle, NULL, gdp_bh);
+		}
+
+		trace_cow_add(handle, excluded, excluded);
+	}
+out:
+	brelse(exclude_bitmap_bh);
+	return err ? err : excluded;
+}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_FIX_GROUP
+/*
+ * ext4_snapshot_mark_group_fix() marks a block group for fsck
+ * @handle:	JBD handle or NULL
+ * @sb:		super block handle
+ * @block_group: group whose exclude or COW bitmap was found inconsistent
+ *
+ * Marks the file system with EXT4_FLAGS_FIX_EXCLUDE and the group descriptor
+ * with EXT4_BG_EXCLUDE_FIX.  EXT4_FLAGS_FIX_GROUPS tells fsck that only the
+ * marked groups need to be checked.  It is set when the first group is
+ * marked and cleared if a group could not be marked.
+ * With a NULL @handle, a new handle is started to mark the group.
+ */
+void ext4_snapshot_mark_group_fix(handle_t *handle, struct super_block *sb,
+		ext4_group_t block_group)
+{
+	struct buffer_head *gdp_bh = NULL;
+	struct ext4_group_desc *gdp;
+	handle_t *own_handle = NULL;
+	int fix_groups, err = -EIO;
+
+	/* groups marked so far are all the groups that need fixing */
+	fix_groups = !EXT4_TEST_FLAGS(sb, EXT4_FLAGS_FIX_EXCLUDE) ||
+		EXT4_TEST_FLAGS(sb, EXT4_FLAGS_FIX_GROUPS);
+	EXT4_SET_FLAGS(sb, EXT4_FLAGS_FIX_EXCLUDE);
+	if (!fix_groups)
+		return;
+
+	gdp = ext4_get_group_desc(sb, block_group, &gdp_bh);
+	if (!gdp)
+		goto out;
+	if (gdp->bg_flags & cpu_to_le16(EXT4_BG_EXCLUDE_FIX)) {
+		err = 0;
+		goto out;
+	}
+
+	if (!handle) {
+		own_handle = ext4_journal_start_sb(sb, 1);
+		if (IS_ERR(own_handle)) {
+			err = PTR_ERR(own_handle);
+			own_handle = NULL;
+			goto out;
+		}
+		handle = own_handle;
+	} else {
+		/* the caller did not reserve a credit for the descriptor */
+		err = ext4_journal_extend(handle, 1);
 		if (err)
 			goto out;
+	}
 
-		if (exclude_uninit) {
-			gdp->bg_flags &= cpu_to_le16(~EXT4_BG_EXCLUDE_UNINIT);
-			gdp->bg_checksum = ext4_group_desc_csum(EXT4_SB(sb),
-							        block_group, gdp);
-			err = ext4_handle_dirty_metadata(handle, NULL, gdp_bh);
-		}
+	err = ext4_journal_get_write_access(handle, gdp_bh);
+	if (err)
+		goto out;
+	ext4_lock_group(sb, block_group);
+	gdp->bg_flags |= cpu_to_le16(EXT4_BG_EXCLUDE_FIX);
+	gdp->bg_checksum = ext4_group_desc_csum(EXT4_SB(sb), block_group, gdp);
+	ext4_unlock_group(sb, block_group);
+	err = ext4_handle_dirty_metadata(handle, NULL, gdp_bh);
+out:
+	if (own_handle)
+		ext4_journal_stop(own_handle);
+	if (err) {
+		/* fsck has to check all groups */
+		EXT4_CLEAR_FLAGS(sb, EXT4_FLAGS_FIX_GROUPS);
+		snapshot_debug(1, "failed to mark group (%u) for fsck "
+			       "(err=%d)\n", block_group, err);
+	} else {
+		EXT4_SET_FLAGS(sb, EXT4_FLAGS_FIX_GROUPS);
+	}
+	ext4_mark_super_dirty(sb);
+}
 
-		trace_cow_add(handle, excluded, excluded);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+/*
+ * ext4_snapshot_exclude_cow_bitmap() clears excluded blocks from COW bitmap
+ * @handle:	JBD handle
+ * @sb:		super block handle
+ * @block:	address of first excluded block
+ * @count:	no. of excluded blocks (in the same block group)
+ *
+ * Blocks of a file that was excluded after the active snapshot was taken
+ * may be set in the COW bitmaps that were already initialized.
+ * COW bitmaps that are initialized later are masked with the exclude bitmap.
+ *
+ * Return values:
+ * = 0 - success
+ * < 0 - error
+ */
+int ext4_snapshot_exclude_cow_bitmap(handle_t *handle,
+		struct super_block *sb, ext4_fsblk_t block, int count)
+{
+	struct inode *active_snapshot = ext4_snapshot_has_active(sb);
+	ext4_group_t block_group = SNAPSHOT_BLOCK_GROUP(block);
+	ext4_grpblk_t bit = SNAPSHOT_BLOCK_GROUP_OFFSET(block);
+	struct ext4_group_info *grp = ext4_get_group_info(sb, block_group);
+	struct ext4_group_desc *desc;
+	struct buffer_head *cow_bh;
+	ext4_fsblk_t cow_bitmap_blk;
+	int i, n = 0, err;
+
+	if (!active_snapshot || block >= SNAPSHOT_BLOCKS(active_snapshot))
+		return 0;
+
+	desc = ext4_get_group_desc(sb, block_group, NULL);
+	if (!desc)
+		return -EIO;
+
+	ext4_lock_group(sb, block_group);
+	cow_bitmap_blk = grp->bg_cow_bitmap;
+	ext4_unlock_group(sb, block_group);
+	/* uninitialized or pending COW bitmap will be masked */
+	if (!cow_bitmap_blk || cow_bitmap_blk == ext4_block_bitmap(sb, desc))
+		return 0;
+
+	cow_bh = sb_bread(sb, cow_bitmap_blk);
+	if (!cow_bh)
+		return -EIO;
+
+	ext4_lock_group(sb, block_group);
+	for (i = 0; i < count; i++)
+		if (ext4_clear_bit(bit + i, cow_bh->b_data))
+			n++;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_EXTENTS
+	if (n)
+		ext4_snapshot_reset_cow_extents(sb, block_group);
+#endif
+	ext4_unlock_group(sb, block_group);
+
+	err = 0;
+	if (n) {
+		snapshot_debug(2, "cleared excluded blocks: %d [%d-%d/%u] "
+				"from COW bitmap\n", n, bit, bit + count - 1,
+				block_group);
+		err = ext4_jbd2_file_inode(handle, active_snapshot);
+		mark_buffer_dirty(cow_bh);
 	}
-out:
-	brelse(exclude_bitmap_bh);
-	return err ? err : excluded;
+	brelse(cow_bh);
+	return err;
 }
 
+#endif
 #endif
 /*
  * COW functions
@@ -654,96 +2060,398 @@ void init_ext4_snapshot_cow_cache(void)
  * 1 - block was COWed in current transaction
  * 0 - block wasn't COWed in current transaction
  */
-static int
-ext4_snapshot_test_cowed(handle_t *handle, struct buffer_head *bh)
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CACHE_LOCKLESS
+/*
+ * The COW tid is read and set atomically.  A reference on the journal head
+ * (taken under the journal head bit lock) keeps it from being freed, so the
+ * journal state lock, which do_get_write_access() holds, is not needed.
+ */
+static int
+ext4_snapshot_test_cowed(handle_t *handle, struct buffer_head *bh)
+{
+	struct journal_head *jh;
+	int cowed;
+
+	if (!cow_cache_enabled())
+		return 0;
+
+	if (!bh || !buffer_jbd(bh))
+		return 0;
+	jh = jbd2_journal_grab_journal_head(bh);
+	if (!jh)
+		return 0;
+	cowed = (ACCESS_ONCE(jh->b_cow_tid) == handle->h_transaction->t_tid);
+	jbd2_journal_put_journal_head(jh);
+	/*
+	 * If block was already COWed in the running transaction,
+	 * we don't need to COW it again.
+	 */
+	return cowed;
+}
+
+static void
+ext4_snapshot_mark_cowed(handle_t *handle, struct buffer_head *bh)
+{
+	struct journal_head *jh;
+	tid_t tid = handle->h_transaction->t_tid;
+	tid_t old;
+
+	if (!cow_cache_enabled())
+		return;
+
+	if (!bh || !buffer_jbd(bh))
+		return;
+	jh = jbd2_journal_grab_journal_head(bh);
+	if (!jh)
+		return;
+	old = ACCESS_ONCE(jh->b_cow_tid);
+	if (old != tid)
+		/*
+		 * this is the first time this block was COWed
+		 * in the running transaction.
+		 * racing COW tasks of the same transaction set the same tid.
+		 */
+		cmpxchg(&jh->b_cow_tid, old, tid);
+	jbd2_journal_put_journal_head(jh);
+}
+#else
+static int
+ext4_snapshot_test_cowed(handle_t *handle, struct buffer_head *bh)
+{
+	struct journal_head *jh;
+
+	if (!cow_cache_enabled())
+		return 0;
+
+	/* check the COW tid in the journal head */
+	if (bh && buffer_jbd(bh)) {
+		jbd_lock_bh_state(bh);
+		jh = bh2jh(bh);
+		if (jh && !test_cow_tid(jh, handle))
+			jh = NULL;
+		jbd_unlock_bh_state(bh);
+		if (jh)
+			/*
+			 * Block was already COWed in the running transaction,
+			 * so we don't need to COW it again.
+			 */
+			return 1;
+	}
+	return 0;
+}
+
+static void
+ext4_snapshot_mark_cowed(handle_t *handle, struct buffer_head *bh)
+{
+	struct journal_head *jh;
+
+	if (!cow_cache_enabled())
+		return;
+
+	if (bh && buffer_jbd(bh)) {
+		jbd_lock_bh_state(bh);
+		jh = bh2jh(bh);
+		if (jh && !test_cow_tid(jh, handle))
+			/*
+			 * this is the first time this block was COWed
+			 * in the running transaction.
+			 * update the COW tid in the journal head
+			 * to mark that this block doesn't need to be COWed.
+			 */
+			set_cow_tid(jh, handle);
+		jbd_unlock_bh_state(bh);
+	}
+}
+#endif
+
+#endif
+/*
+ * Begin COW or move operation.
+ * No locks needed here, because @handle is a per-task struct.
+ */
+static inline void ext4_snapshot_cow_begin(handle_t *handle)
+{
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CREDITS
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CREDITS_LAZY
+	/*
+	 * Top up the handle with the credits of one COW operation, without
+	 * changing its user credits.  jbd2_journal_extend() does not block,
+	 * so it is safe to call it from any COW hook.
+	 */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CREDITS_ADAPTIVE
+	/*
+	 * With the learned COW credits factor, the handle may hold less than
+	 * the worst case credits of one COW operation, so top up to that.
+	 */
+	if (ext4_handle_valid(handle) &&
+	    handle->h_buffer_credits < EXT4_RESERVE_COW_CREDITS &&
+	    jbd2_journal_extend(handle, EXT4_RESERVE_COW_CREDITS -
+				handle->h_buffer_credits)) {
+		ext4_snapshot_cow_factor_fallback(
+			handle->h_transaction->t_journal->j_private);
+#else
+	if (!ext4_handle_has_enough_credits(handle, 1) &&
+	    jbd2_journal_extend(handle, EXT4_RESERVE_COW_CREDITS)) {
+#endif
+#else
+	if (!ext4_handle_has_enough_credits(handle, 1)) {
+#endif
+		/*
+		 * The test above is based on lower limit heuristics of
+		 * user_credits/buffer_credits, which is not always accurate,
+		 * so it is possible that there is no bug here, just another
+		 * false alarm.
+		 */
+		snapshot_debug_hl(1, "warning: insufficient buffer/user "
+				  "credits (%d/%d) for COW operation?\n",
+				  handle->h_buffer_credits,
+				  handle->h_user_credits);
+	}
+#endif
+	snapshot_debug_hl(4, "{\n");
+	handle->h_cowing = 1;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BUDGET
+	handle->h_cow_credits = handle->h_buffer_credits;
+#endif
+}
+
+/*
+ * End COW or move operation.
+ * No locks needed here, because @handle is a per-task struct.
+ */
+static inline void ext4_snapshot_cow_end(const char *where,
+		handle_t *handle, ext4_fsblk_t block, int err)
+{
+	handle->h_cowing = 0;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_DATA
+	handle->h_cow_data = 0;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BUDGET
+	ext4_snapshot_budget_account(handle,
+			handle->h_cow_credits - handle->h_buffer_credits);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS
+	trace_ext4_snapshot_cow_exit(handle->h_transaction->t_journal->j_private,
+				     block, err);
+#endif
+	snapshot_debug_hl(4, "} = %d\n", err);
+	snapshot_debug_hl(4, ".\n");
+	if (err < 0)
+		snapshot_debug(1, "%s(b:%lld/%lld) failed!"
+				" h_ref=%d, err=%d\n", where,
+				SNAPSHOT_BLOCK_TUPLE(block),
+				handle->h_ref, err);
+}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREBUILD
+/*
+ * ext4_snapshot_prebuild_cow_bitmap - create COW bitmap ahead of time
+ * @handle:	JBD handle
+ * @snapshot:	active snapshot
+ * @block_group: block group
+ *
+ * Called from the COW bitmap prebuild thread after snapshot take.
+ *
+ * Return values:
+ * = 1 - COW bitmap of @block_group was created
+ * = 0 - COW bitmap is initialized or is being created by another task
+ * < 0 - error
+ */
+int ext4_snapshot_prebuild_cow_bitmap(handle_t *handle,
+		struct inode *snapshot, unsigned int block_group)
+{
+	struct super_block *sb = snapshot->i_sb;
+	struct ext4_group_info *grp = ext4_get_group_info(sb, block_group);
+	struct buffer_head *cow_bh;
+	int err;
+
+	/* skip groups that were initialized by foreground writers */
+	if (ACCESS_ONCE(grp->bg_cow_bitmap))
+		return 0;
+
+	/* BEGIN COWing */
+	ext4_snapshot_cow_begin(handle);
+	cow_bh = ext4_snapshot_read_cow_bitmap(handle, snapshot, block_group);
+	err = cow_bh ? 1 : -EIO;
+	brelse(cow_bh);
+	/* END COWing */
+	ext4_snapshot_cow_end(__func__, handle,
+			ext4_group_first_block_no(sb, block_group), err);
+	return err;
+}
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_DEDUP
+/*
+ * ext4_snapshot_cow_dedup() tries to move the copy of @block from the
+ * previous snapshot to the active snapshot instead of COWing @bh.
+ * If the previous snapshot copy is identical to @bh, it is also the image of
+ * @block at the time of active snapshot take.  After the move, the previous
+ * snapshot reads @block through the active snapshot, like any other block
+ * that did not change between the two snapshots.
+ * Non-active snapshots are only modified under snapshot_mutex, so the
+ * dedup is skipped if snapshot_mutex cannot be taken without waiting.
+ *
+ * Return values:
+ * = 1 - @block was mapped to active snapshot
+ * = 0 - @block needs to be COWed
+ * < 0 - error
+ */
+static int ext4_snapshot_cow_dedup(handle_t *handle,
+		struct inode *active_snapshot, ext4_fsblk_t block,
+		struct buffer_head *bh)
+{
+	struct super_block *sb = active_snapshot->i_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct inode *prev = NULL;
+	struct buffer_head *pbh = NULL;
+	ext4_lblk_t iblock = SNAPSHOT_IBLOCK(block);
+	ext4_fsblk_t blk;
+	int err = 0;
+
+	if (!sbi->s_snapshot_cow_dedup)
+		return 0;
+	if (!ext4_snapshot_mutex_trylock(sb))
+		return 0;
+
+	/* the previous snapshot is the next one on the list */
+	if (EXT4_I(active_snapshot)->i_snaplist.next != &sbi->s_snapshot_list)
+		prev = &list_entry(EXT4_I(active_snapshot)->i_snaplist.next,
+				   struct ext4_inode_info, i_snaplist)->vfs_inode;
+	if (!prev || ext4_test_inode_flag(prev, EXT4_INODE_SNAPFILE_DELETED))
+		goto out;
+
+	err = ext4_snapshot_map_blocks(handle, prev, iblock, 1, &blk,
+				       SNAPMAP_READ);
+	if (err <= 0)
+		goto out;
+	err = 0;
+	pbh = sb_bread(sb, blk);
+	if (!pbh || memcmp(pbh->b_data, bh->b_data, bh->b_size))
+		goto out;
+
+	/* map the copy to active snapshot before unmapping it from prev */
+	err = ext4_journal_extend(handle, 2);
+	if (err) {
+		err = 0;
+		goto out;
+	}
+	err = ext4_snapshot_set_leaf(handle, active_snapshot, iblock, 0, blk);
+	if (err <= 0)
+		/* no indirect block or mapped by another COWing task */
+		goto out;
+	err = ext4_snapshot_set_leaf(handle, prev, iblock, blk, 0);
+	if (err <= 0) {
+		if (!err)
+			err = -EIO;
+		goto out;
+	}
+	/* drop stale mapping of the copy from prev page cache */
+	invalidate_mapping_pages(prev->i_mapping,
+		iblock >> (PAGE_CACHE_SHIFT - sb->s_blocksize_bits),
+		iblock >> (PAGE_CACHE_SHIFT - sb->s_blocksize_bits));
+	ext4_snapshot_uncharge_blocks(prev, 1);
+	ext4_snapshot_charge_blocks(active_snapshot, 1);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_CACHE
+	/* non active prev mapping changed */
+	ext4_snapshot_list_changed(sb);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_READ
+	/* reads through to block device must not see @bh change */
+	ext4_snapshot_wait_tracked_reads(active_snapshot, bh);
+#endif
+	sbi->s_snapshot_dedup_blocks++;
+	snapshot_debug(3, "block [%llu/%llu] of snapshot (%u) moved to "
+		       "snapshot (%u)\n", SNAPSHOT_BLOCK_TUPLE(blk),
+		       prev->i_generation, active_snapshot->i_generation);
+	err = 1;
+out:
+	brelse(pbh);
+	ext4_snapshot_mutex_unlock(sb);
+	return err;
+}
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_MAP
+/*
+ * ext4_snapshot_cow_map_test() - returns the no. of blocks from @block, up
+ * to @count blocks in the same group, which are known to be mapped in the
+ * active snapshot.  Unlike ext4_snapshot_map_blocks(), it does not take
+ * the active snapshot i_data_sem.
+ */
+static int ext4_snapshot_cow_map_test(struct super_block *sb,
+				      ext4_fsblk_t block, int count)
 {
-	struct journal_head *jh;
+	ext4_group_t group = SNAPSHOT_BLOCK_GROUP(block);
+	ext4_grpblk_t bit = SNAPSHOT_BLOCK_GROUP_OFFSET(block);
+	struct ext4_cow_map *map;
+	int n = 0;
 
-	if (!cow_cache_enabled())
+	if (group >= ext4_get_groups_count(sb))
 		return 0;
-
-	/* check the COW tid in the journal head */
-	if (bh && buffer_jbd(bh)) {
-		jbd_lock_bh_state(bh);
-		jh = bh2jh(bh);
-		if (jh && !test_cow_tid(jh, handle))
-			jh = NULL;
-		jbd_unlock_bh_state(bh);
-		if (jh)
-			/*
-			 * Block was already COWed in the running transaction,
-			 * so we don't need to COW it again.
-			 */
-			return 1;
-	}
-	return 0;
+	rcu_read_lock();
+	map = rcu_dereference(ext4_get_group_info(sb, group)->bg_cow_map);
+	if (map)
+		while (n < count && test_bit(bit + n, map->cm_bits))
+			n++;
+	rcu_read_unlock();
+	return n;
 }
 
-static void
-ext4_snapshot_mark_cowed(handle_t *handle, struct buffer_head *bh)
+/*
+ * ext4_snapshot_cow_map_set() - record that @count blocks from @block are
+ * mapped in the active snapshot and that their COW is complete.
+ * The group map is allocated on first use.  If that fails, the blocks are
+ * just not recorded and the next test looks them up in the snapshot file.
+ */
+static void ext4_snapshot_cow_map_set(struct super_block *sb,
+				      ext4_fsblk_t block, int count)
 {
-	struct journal_head *jh;
+	ext4_group_t group = SNAPSHOT_BLOCK_GROUP(block);
+	ext4_grpblk_t bit = SNAPSHOT_BLOCK_GROUP_OFFSET(block);
+	struct ext4_group_info *grp;
+	struct ext4_cow_map *map, *new;
+	int i;
 
-	if (!cow_cache_enabled())
+	if (group >= ext4_get_groups_count(sb))
+		return;
+	grp = ext4_get_group_info(sb, group);
+again:
+	rcu_read_lock();
+	map = rcu_dereference(grp->bg_cow_map);
+	if (map)
+		for (i = 0; i < count; i++)
+			set_bit(bit + i, map->cm_bits);
+	rcu_read_unlock();
+	if (map)
 		return;
 
-	if (bh && buffer_jbd(bh)) {
-		jbd_lock_bh_state(bh);
-		jh = bh2jh(bh);
-		if (jh && !test_cow_tid(jh, handle))
-			/*
-			 * this is the first time this block was COWed
-			 * in the running transaction.
-			 * update the COW tid in the journal head
-			 * to mark that this block doesn't need to be COWed.
-			 */
-			set_cow_tid(jh, handle);
-		jbd_unlock_bh_state(bh);
+	new = kzalloc(sizeof(*new) + SNAPSHOT_BLOCKS_PER_GROUP / 8, GFP_NOFS);
+	if (!new)
+		return;
+	for (i = 0; i < count; i++)
+		__set_bit(bit + i, new->cm_bits);
+	/* cmpxchg() orders the bits before the publication of the map */
+	if (cmpxchg(&grp->bg_cow_map, NULL, new)) {
+		kfree(new);
+		goto again;
 	}
 }
 
-#endif
 /*
- * Begin COW or move operation.
- * No locks needed here, because @handle is a per-task struct.
+ * ext4_snapshot_cow_map_free() - forget the mapped blocks of @group.
+ * Called on snapshot take under journal_lock_updates() and on umount.
  */
-static inline void ext4_snapshot_cow_begin(handle_t *handle)
+void ext4_snapshot_cow_map_free(struct super_block *sb, ext4_group_t group)
 {
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CREDITS
-	if (!ext4_handle_has_enough_credits(handle, 1)) {
-		/*
-		 * The test above is based on lower limit heuristics of
-		 * user_credits/buffer_credits, which is not always accurate,
-		 * so it is possible that there is no bug here, just another
-		 * false alarm.
-		 */
-		snapshot_debug_hl(1, "warning: insufficient buffer/user "
-				  "credits (%d/%d) for COW operation?\n",
-				  handle->h_buffer_credits,
-				  handle->h_user_credits);
-	}
-#endif
-	snapshot_debug_hl(4, "{\n");
-	handle->h_cowing = 1;
-}
+	struct ext4_cow_map *map;
 
-/*
- * End COW or move operation.
- * No locks needed here, because @handle is a per-task struct.
- */
-static inline void ext4_snapshot_cow_end(const char *where,
-		handle_t *handle, ext4_fsblk_t block, int err)
-{
-	handle->h_cowing = 0;
-	snapshot_debug_hl(4, "} = %d\n", err);
-	snapshot_debug_hl(4, ".\n");
-	if (err < 0)
-		snapshot_debug(1, "%s(b:%lld/%lld) failed!"
-				" h_ref=%d, err=%d\n", where,
-				SNAPSHOT_BLOCK_TUPLE(block),
-				handle->h_ref, err);
+	map = xchg(&ext4_get_group_info(sb, group)->bg_cow_map, NULL);
+	if (map)
+		kfree_rcu(map, cm_rcu);
 }
 
+#endif
 /*
  * ext4_snapshot_test_and_cow - COW metadata block
  * @where:	name of caller function
@@ -767,12 +2475,19 @@ int ext4_snapshot_test_and_cow(const char *where, handle_t *handle,
 	struct buffer_head *sbh = NULL;
 	ext4_fsblk_t blk = 0;
 	int err = 0, clear = 0, count = 1;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
+	ktime_t start;
+#endif
 
 	if (!active_snapshot)
 		/* no active snapshot - no need to COW */
 		return 0;
 
 	ext4_snapshot_trace_cow(where, handle, sb, inode, bh, block, 1, cow);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS
+	trace_ext4_snapshot_cow_enter(sb, inode, block,
+				      SNAPSHOT_BLOCK_GROUP(block), 1, cow);
+#endif
 
 	if (IS_COWING(handle)) {
 		/* avoid recursion on active snapshot updates */
@@ -791,12 +2506,20 @@ int ext4_snapshot_test_and_cow(const char *where, handle_t *handle,
 		snapshot_debug_hl(4, "buffer found in COW cache - "
 				  "skip block cow!\n");
 		trace_cow_inc(handle, ok_jh);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS
+		trace_ext4_snapshot_cow_cached(sb, block, 0, 1);
+#endif
 		return 0;
 	}
 #endif
 
 	/* BEGIN COWing */
 	ext4_snapshot_cow_begin(handle);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_DATA
+	/* a journaled data block is in the page cache of its owner */
+	handle->h_cow_data = inode && bh && bh->b_page &&
+		bh->b_page->mapping == inode->i_mapping;
+#endif
 
 	if (inode)
 		clear = ext4_snapshot_excluded(inode);
@@ -826,6 +2549,15 @@ int ext4_snapshot_test_and_cow(const char *where, handle_t *handle,
 		goto cowed;
 	}
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_MAP
+	/* block is in use by snapshot - was it already COWed? */
+	if (ext4_snapshot_cow_map_test(sb, block, 1)) {
+		trace_cow_inc(handle, ok_mapped);
+		err = 0;
+		goto cowed;
+	}
+
+#endif
 	/* block is in use by snapshot - check if it is mapped */
 	err = ext4_snapshot_map_blocks(handle, active_snapshot, block, 1, &blk,
 					SNAPMAP_READ);
@@ -852,79 +2584,434 @@ int ext4_snapshot_test_and_cow(const char *where, handle_t *handle,
 		snapshot_debug(1, "warning: non uptodate buffer (%lld)"
 				" needs to be copied to active snapshot!\n",
 				block);
-		ll_rw_block(READ, 1, &bh);
+		ll_rw_block(EXT4_SNAPSHOT_COW_READ, 1, &bh);
 		wait_on_buffer(bh);
 		if (!buffer_uptodate(bh))
 			goto out;
 	}
 
-	/* try to allocate snapshot block to make a backup copy */
-	sbh = ext4_getblk(handle, active_snapshot, SNAPSHOT_IBLOCK(block),
-			   SNAPMAP_COW, &err);
-	if (!sbh)
-		goto out;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_DEDUP
+	/* try to share an identical copy with the previous snapshot */
+	err = ext4_snapshot_cow_dedup(handle, active_snapshot, block, bh);
+	if (err < 0)
+		goto out;
+	if (err > 0) {
+		trace_cow_inc(handle, ok_mapped);
+		err = 0;
+		goto cowed;
+	}
+	err = -EIO;
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
+	start = ktime_get();
+#endif
+	/* try to allocate snapshot block to make a backup copy */
+	sbh = ext4_getblk(handle, active_snapshot, SNAPSHOT_IBLOCK(block),
+			   SNAPMAP_COW, &err);
+	if (!sbh)
+		goto out;
+
+	blk = sbh->b_blocknr;
+	if (!err) {
+		/*
+		 * we didn't allocate this block -
+		 * another COWing task must have allocated it
+		 */
+		trace_cow_inc(handle, ok_mapped);
+		goto test_pending_cow;
+	}
+
+	/*
+	 * we allocated this block -
+	 * copy block data to snapshot and complete COW operation
+	 */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW
+	snapshot_debug(3, "COWing block [%llu/%llu] of snapshot "
+			"(%u)...\n",
+			SNAPSHOT_BLOCK_TUPLE(block),
+			active_snapshot->i_generation);
+	/* sleep 1 tunable delay unit */
+	snapshot_test_delay(SNAPTEST_COW);
+#endif
+	err = ext4_snapshot_copy_buffer_cow(handle, active_snapshot,
+			sbh, bh);
+	if (err)
+		goto out;
+	snapshot_debug(3, "block [%lld/%lld] of snapshot (%u) "
+			"mapped to block [%lld/%lld]\n",
+			SNAPSHOT_BLOCK_TUPLE(block),
+			active_snapshot->i_generation,
+			SNAPSHOT_BLOCK_TUPLE(sbh->b_blocknr));
+
+	trace_cow_inc(handle, copied);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
+	ext4_snapshot_stats_latency(sb, EXT4_SNAPSHOT_LAT_COPY, start);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS
+	trace_ext4_snapshot_cow_copied(sb, block, sbh->b_blocknr, 1);
+#endif
+test_pending_cow:
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW
+	if (sbh)
+		/* wait for pending COW to complete */
+		ext4_snapshot_test_pending_cow(sbh, block);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_MAP
+	/* the COW is complete, later tests can skip the lookup */
+	ext4_snapshot_cow_map_set(sb, block, 1);
+#endif
+
+cowed:
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CACHE
+	/* mark the buffer COWed in the current transaction */
+	ext4_snapshot_mark_cowed(handle, bh);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
+	if (clear) {
+		/* mark COWed block in exclude bitmap */
+		clear = ext4_snapshot_exclude_blocks(handle, sb,
+				block, 1);
+		if (clear < 0)
+			err = clear;
+	}
+#endif
+out:
+	brelse(sbh);
+	/* END COWing */
+	ext4_snapshot_cow_end(where, handle, block, err);
+	return err;
+}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_RANGE
+/*
+ * ext4_snapshot_cow_blocks()
+ * helper function for ext4_snapshot_test_and_cow_range()
+ * allocate snapshot blocks for up to @count subsequent source buffers with a
+ * single ext4_map_blocks() call and copy the buffers to snapshot.
+ *
+ * Return values:
+ * > 0 - no. of blocks COWed (or found mapped by another COWing task)
+ * < 0 - error
+ */
+static int
+ext4_snapshot_cow_blocks(handle_t *handle, struct inode *snapshot,
+		ext4_fsblk_t block, struct buffer_head **bhs, int count)
+{
+	struct super_block *sb = snapshot->i_sb;
+	struct ext4_map_blocks map;
+	struct buffer_head *sbh;
+	int i, err;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_PLUG
+	struct blk_plug plug;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
+	ktime_t start;
+#endif
+
+	/* make sure we hold uptodate source buffers */
+	for (i = 0; i < count; i++) {
+		if (!bhs[i] || !buffer_mapped(bhs[i]))
+			return -EIO;
+		if (!buffer_uptodate(bhs[i]))
+			break;
+	}
+	if (i < count) {
+		snapshot_debug(1, "warning: non uptodate buffers (%lld-%lld)"
+				" need to be copied to active snapshot!\n",
+				block, block + count - 1);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_PLUG
+		/* submit the reads of the whole range as one batch */
+		blk_start_plug(&plug);
+		ll_rw_block(EXT4_SNAPSHOT_COW_READ, count, bhs);
+		blk_finish_plug(&plug);
+#else
+		ll_rw_block(EXT4_SNAPSHOT_COW_READ, count, bhs);
+#endif
+		for (i = 0; i < count; i++) {
+			wait_on_buffer(bhs[i]);
+			if (!buffer_uptodate(bhs[i]))
+				return -EIO;
+		}
+	}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
+	start = ktime_get();
+#endif
+	/* try to allocate snapshot blocks to make backup copies */
+	map.m_lblk = SNAPSHOT_IBLOCK(block);
+	map.m_len = count;
+	err = ext4_map_blocks(handle, snapshot, &map, SNAPMAP_COW);
+	if (err <= 0)
+		return err ? err : -EIO;
+	count = err;
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW
+	if (map.m_flags & EXT4_MAP_NEW) {
+		snapshot_debug(3, "COWing blocks [%llu/%llu] - [%llu/%llu] "
+				"of snapshot (%u)...\n",
+				SNAPSHOT_BLOCK_TUPLE(block),
+				SNAPSHOT_BLOCK_TUPLE(block + count - 1),
+				snapshot->i_generation);
+		/* sleep 1 tunable delay unit */
+		snapshot_test_delay(SNAPTEST_COW);
+	}
+#endif
+	for (i = 0; i < count; i++) {
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_NUMA
+		if (map.m_flags & EXT4_MAP_NEW)
+			sbh = ext4_snapshot_getblk_local(sb, map.m_pblk + i);
+		else
+			sbh = sb_getblk(sb, map.m_pblk + i);
+#else
+		sbh = sb_getblk(sb, map.m_pblk + i);
+#endif
+		if (!sbh) {
+			err = -EIO;
+			goto out_cancel;
+		}
+		if (!(map.m_flags & EXT4_MAP_NEW)) {
+			/*
+			 * we didn't allocate these blocks -
+			 * another COWing task must have allocated them
+			 */
+			trace_cow_inc(handle, ok_mapped);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW
+			/* wait for pending COW to complete */
+			ext4_snapshot_test_pending_cow(sbh, block + i);
+#endif
+			brelse(sbh);
+			continue;
+		}
+
+		/*
+		 * we allocated this block -
+		 * copy block data to snapshot and complete COW operation
+		 */
+		lock_buffer(sbh);
+		clear_buffer_uptodate(sbh);
+		err = ext4_snapshot_copy_buffer_cow(handle, snapshot,
+				sbh, bhs[i]);
+		brelse(sbh);
+		if (err) {
+			/* COW of this block was completed with an error */
+			i++;
+			goto out_cancel;
+		}
+		trace_cow_inc(handle, copied);
+	}
+	snapshot_debug(3, "blocks [%lld/%lld] - [%lld/%lld] of snapshot (%u) "
+			"mapped to blocks [%lld/%lld] - [%lld/%lld]\n",
+			SNAPSHOT_BLOCK_TUPLE(block),
+			SNAPSHOT_BLOCK_TUPLE(block + count - 1),
+			snapshot->i_generation,
+			SNAPSHOT_BLOCK_TUPLE(map.m_pblk),
+			SNAPSHOT_BLOCK_TUPLE(map.m_pblk + count - 1));
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
+	if (map.m_flags & EXT4_MAP_NEW)
+		ext4_snapshot_stats_latency(sb, EXT4_SNAPSHOT_LAT_COPY, start);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS
+	if (map.m_flags & EXT4_MAP_NEW)
+		trace_ext4_snapshot_cow_copied(sb, block, map.m_pblk, count);
+#endif
+	return count;
+
+out_cancel:
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW
+	/* cancel the rest of the pending COW operations */
+	if (map.m_flags & EXT4_MAP_NEW)
+		ext4_snapshot_end_pending_cow_range(sb, map.m_pblk + i,
+				count - i);
+#endif
+	return err;
+}
+
+/*
+ * ext4_snapshot_test_and_cow_range - COW subsequent metadata blocks
+ * @where:	name of caller function
+ * @handle:	JBD handle
+ * @inode:	owner of blocks (NULL for global metadata blocks)
+ * @bhs:	buffer heads of metadata blocks
+ * @count:	no. of buffer heads
+ * @cow:	if false, return 1 if any block needs to be COWed
+ *
+ * Split @bhs into runs of physically subsequent blocks in the same block
+ * group.  Each run is tested against the COW bitmap and the snapshot file
+ * mapping once per sub-run with the same state, and all the blocks of a
+ * sub-run that need to be COWed are allocated and copied in one go.
+ * The caller should have reserved COW credits for all @count blocks.
+ *
+ * Return values:
+ * = 1 - some of the blocks need to be COWed
+ * = 0 - all blocks were COWed or don't need to be COWed
+ * < 0 - error
+ */
+int ext4_snapshot_test_and_cow_range(const char *where, handle_t *handle,
+		struct inode *inode, struct buffer_head **bhs, int count,
+		int cow)
+{
+	struct super_block *sb = handle->h_transaction->t_journal->j_private;
+	struct inode *active_snapshot = ext4_snapshot_has_active(sb);
+	struct buffer_head *sbh;
+	ext4_fsblk_t block, blk = 0;
+	int i, j, k, n, m, err = 0, clear = 0;
+
+	if (!active_snapshot)
+		/* no active snapshot - no need to COW */
+		return 0;
+
+	if (count <= 1)
+		return count ? ext4_snapshot_test_and_cow(where, handle,
+				inode, bhs[0]->b_blocknr, bhs[0], cow) : 0;
+
+	block = bhs[0]->b_blocknr;
+	ext4_snapshot_trace_cow(where, handle, sb, inode, bhs[0], block,
+			count, cow);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS
+	trace_ext4_snapshot_cow_enter(sb, inode, block,
+				      SNAPSHOT_BLOCK_GROUP(block), count, cow);
+#endif
+
+	if (IS_COWING(handle)) {
+		/* avoid recursion on active snapshot updates */
+		WARN_ON(inode && inode != active_snapshot);
+		snapshot_debug_hl(4, "active snapshot update - "
+				  "skip blocks cow!\n");
+		return 0;
+	} else if (inode == active_snapshot) {
+		/* active snapshot may only be modified during COW */
+		snapshot_debug_hl(4, "active snapshot access denied!\n");
+		return -EPERM;
+	}
+
+	/* BEGIN COWing */
+	ext4_snapshot_cow_begin(handle);
 
-	blk = sbh->b_blocknr;
-	if (!err) {
+	if (inode)
+		clear = ext4_snapshot_excluded(inode);
+	if (clear < 0) {
 		/*
-		 * we didn't allocate this block -
-		 * another COWing task must have allocated it
+		 * excluded file block access - don't COW and
+		 * mark blocks in exclude bitmap
 		 */
-		trace_cow_inc(handle, ok_mapped);
-		goto test_pending_cow;
+		snapshot_debug_hl(4, "file (%lu) excluded from snapshot - "
+				"mark blocks (%lld) in exclude bitmap\n",
+				inode->i_ino, block);
+		cow = 0;
 	}
 
-	/*
-	 * we allocated this block -
-	 * copy block data to snapshot and complete COW operation
-	 */
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW
-	snapshot_debug(3, "COWing block [%llu/%llu] of snapshot "
-			"(%u)...\n",
-			SNAPSHOT_BLOCK_TUPLE(block),
-			active_snapshot->i_generation);
-	/* sleep 1 tunable delay unit */
-	snapshot_test_delay(SNAPTEST_COW);
+	for (i = 0; i < count; i += n) {
+		block = bhs[i]->b_blocknr;
+		/*
+		 * find the run of subsequent blocks in the same block group,
+		 * which were not COWed in the current transaction
+		 */
+		for (n = 0; i + n < count; n++) {
+			if (n > 0 && (bhs[i+n]->b_blocknr != block + n ||
+				      !SNAPSHOT_BLOCK_GROUP_OFFSET(block + n)))
+				break;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CACHE
+			if (ext4_snapshot_test_cowed(handle, bhs[i+n]))
+				break;
 #endif
-	err = ext4_snapshot_copy_buffer_cow(handle, active_snapshot,
-			sbh, bh);
-	if (err)
-		goto out;
-	snapshot_debug(3, "block [%lld/%lld] of snapshot (%u) "
-			"mapped to block [%lld/%lld]\n",
-			SNAPSHOT_BLOCK_TUPLE(block),
-			active_snapshot->i_generation,
-			SNAPSHOT_BLOCK_TUPLE(sbh->b_blocknr));
+		}
+		if (!n) {
+			/* buffer was COWed in the current transaction */
+			trace_cow_inc(handle, ok_jh);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS
+			trace_ext4_snapshot_cow_cached(sb, block, 0, 1);
+#endif
+			n = 1;
+			continue;
+		}
 
-	trace_cow_inc(handle, copied);
-test_pending_cow:
+		for (j = 0; j < n; j += m) {
+			m = n - j;
+			/* get the COW bitmap and test if blocks are in use */
+			err = ext4_snapshot_test_cow_bitmap(handle,
+					active_snapshot, block + j, &m,
+					clear < 0 ? inode : NULL);
+			if (err < 0)
+				goto out;
+			if (!err) {
+				trace_cow_add(handle, ok_bitmap, m);
+				goto cowed;
+			}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_MAP
+			/* blocks are in use by snapshot - were they COWed? */
+			err = ext4_snapshot_cow_map_test(sb, block + j, m);
+			if (err > 0) {
+				m = err;
+				trace_cow_add(handle, ok_mapped, m);
+				goto cowed;
+			}
+
+#endif
+			/* blocks are in use by snapshot - are they mapped? */
+			err = ext4_snapshot_map_blocks(handle, active_snapshot,
+					block + j, m, &blk, SNAPMAP_READ);
+			if (err < 0)
+				goto out;
+			if (err > 0) {
+				m = err;
+				trace_cow_add(handle, ok_mapped, m);
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW
-	if (sbh)
-		/* wait for pending COW to complete */
-		ext4_snapshot_test_pending_cow(sbh, block);
+				/* wait for pending COW to complete */
+				for (k = 0; k < m; k++) {
+					sbh = sb_find_get_block(sb, blk + k);
+					if (!sbh)
+						continue;
+					ext4_snapshot_test_pending_cow(sbh,
+							block + j + k);
+					brelse(sbh);
+				}
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_MAP
+				ext4_snapshot_cow_map_set(sb, block + j, m);
+#endif
+				goto cowed;
+			}
+
+			/* blocks need to be COWed */
+			err = 1;
+			if (!cow)
+				/* don't COW - we were just checking */
+				goto out;
+
+			err = ext4_snapshot_cow_blocks(handle, active_snapshot,
+					block + j, bhs + i + j, m);
+			if (err < 0)
+				goto out;
+			m = err;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_MAP
+			ext4_snapshot_cow_map_set(sb, block + j, m);
 #endif
-
 cowed:
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CACHE
-	/* mark the buffer COWed in the current transaction */
-	ext4_snapshot_mark_cowed(handle, bh);
+			/* mark the buffers COWed in the current transaction */
+			for (k = 0; k < m; k++)
+				ext4_snapshot_mark_cowed(handle, bhs[i+j+k]);
 #endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
-	if (clear) {
-		/* mark COWed block in exclude bitmap */
-		clear = ext4_snapshot_exclude_blocks(handle, sb,
-				block, 1);
-		if (clear < 0)
-			err = clear;
-	}
+			if (clear) {
+				/* mark COWed blocks in exclude bitmap */
+				err = ext4_snapshot_exclude_blocks(handle, sb,
+						block + j, m);
+				if (err < 0)
+					goto out;
+			}
 #endif
+			err = 0;
+		}
+	}
 out:
-	brelse(sbh);
 	/* END COWing */
 	ext4_snapshot_cow_end(where, handle, block, err);
 	return err;
 }
-
+#endif
 #endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_MOVE
 /*
@@ -951,6 +3038,9 @@ int ext4_snapshot_test_and_move(const char *where, handle_t *handle,
 	int err = 0, count = *maxblocks;
 	int moved_blks = 0;
 	int excluded = 0;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
+	ktime_t start;
+#endif
 
 	if (!active_snapshot)
 		/* no active snapshot - no need to move */
@@ -958,6 +3048,10 @@ int ext4_snapshot_test_and_move(const char *where, handle_t *handle,
 
 	ext4_snapshot_trace_cow(where, handle, sb, inode, NULL, block, count,
 				move);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS
+	trace_ext4_snapshot_move_enter(sb, inode, block,
+				       SNAPSHOT_BLOCK_GROUP(block), count, move);
+#endif
 
 	BUG_ON(IS_COWING(handle) || inode == active_snapshot);
 
@@ -979,6 +3073,13 @@ int ext4_snapshot_test_and_move(const char *where, handle_t *handle,
 			block, &count, excluded ? inode : NULL);
 	if (err < 0)
 		goto out;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+	if (excluded > 0) {
+		/* excluded file blocks are never moved to snapshot */
+		err = 0;
+		goto out;
+	}
+#endif
 #else
 	if (excluded)
 		goto out;
@@ -1028,6 +3129,9 @@ int ext4_snapshot_test_and_move(const char *where, handle_t *handle,
 	 * TODO: if moving fails after some blocks has been moved,
 	 * maybe we need a blockbitmap fsck.
 	 */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
+	start = ktime_get();
+#endif
 	blk = block;
 	while (count) {
 		err = ext4_snapshot_map_blocks(handle, active_snapshot, blk,
@@ -1047,6 +3151,23 @@ int ext4_snapshot_test_and_move(const char *where, handle_t *handle,
 	 */
 	if (inode)
 		dquot_free_block(inode, count);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_CGROUP
+	/* moved blocks are written by the owner, only account for them */
+	blkio_cgroup_charge_cow(count << sb->s_blocksize_bits);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_WRITEBACK
+	/*
+	 * In writeback mode, order only the data of files with moved blocks,
+	 * so the data written to the new blocks is flushed before commit.
+	 */
+	if (inode && EXT4_I(inode)->jinode &&
+	    ext4_should_writeback_data(inode)) {
+		int ret = ext4_jbd2_file_inode(handle, inode);
+
+		if (ret)
+			err = ret;
+	}
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
 	/* mark moved blocks in exclude bitmap */
 	excluded = ext4_snapshot_exclude_blocks(handle, sb, block, count);
@@ -1054,6 +3175,17 @@ int ext4_snapshot_test_and_move(const char *where, handle_t *handle,
 		err = excluded;
 #endif
 	trace_cow_add(handle, moved, count);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+	atomic64_add(count, &EXT4_I(active_snapshot)->i_snapshot_moved);
+#endif
+	ext4_snapshot_group_stats_add(sb, block, EXT4_SNAPSHOT_GROUP_MOVE,
+				      count);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
+	ext4_snapshot_stats_latency(sb, EXT4_SNAPSHOT_LAT_MOVE, start);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS
+	trace_ext4_snapshot_moved(sb, block, block, count);
+#endif
 out:
 	/* END moving */
 	ext4_snapshot_cow_end(where, handle, block, err);
@@ -1062,3 +3194,606 @@ out:
 }
 
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_MOW_GOAL
+/*
+ * ext4_snapshot_mow_goal - get allocation goal for move-on-write
+ * @inode:	owner of the moved blocks
+ * @lblk:	logical address of first moved block
+ * @goal:	goal found by the block map code (near the moved blocks)
+ * @arena:	returns 1 if an arena goal was returned and 0 otherwise
+ *
+ * Logical blocks are divided into aligned rewrite arenas.  The new blocks
+ * of the first move-on-write in an arena are allocated near @goal.
+ * The new blocks of the next moves in the same arena are allocated at the
+ * same offset from the first new blocks, so the new blocks of a file,
+ * which is rewritten in random order, stay contiguous.
+ * Called under down_write(&i_data_sem).
+ */
+ext4_fsblk_t ext4_snapshot_mow_goal(struct inode *inode, ext4_lblk_t lblk,
+				    ext4_fsblk_t goal, int *arena)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct ext4_sb_info *sbi = EXT4_SB(inode->i_sb);
+	ext4_lblk_t start = lblk & ~(EXT4_SNAPSHOT_MOW_ARENA_BLOCKS - 1);
+
+	atomic_inc(&sbi->s_snapshot_mow_allocs);
+	*arena = (ei->i_snapshot_mow_pblk &&
+		  ei->i_snapshot_mow_lblk == start);
+	if (!*arena)
+		return goal;
+
+	atomic_inc(&sbi->s_snapshot_mow_arena);
+	return ei->i_snapshot_mow_pblk + (lblk - start);
+}
+
+/*
+ * ext4_snapshot_mow_allocated - update arena after move-on-write allocation
+ * @inode:	owner of the moved blocks
+ * @lblk:	logical address of first moved block
+ * @goal:	goal returned by ext4_snapshot_mow_goal()
+ * @block:	address of first new block
+ *
+ * The arena goal is rebased on the new blocks, so if the allocator could
+ * not satisfy the goal, the next moves in the arena follow the new blocks.
+ * Called under down_write(&i_data_sem).
+ */
+void ext4_snapshot_mow_allocated(struct inode *inode, ext4_lblk_t lblk,
+				 ext4_fsblk_t goal, ext4_fsblk_t block)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	ext4_lblk_t offset = lblk & (EXT4_SNAPSHOT_MOW_ARENA_BLOCKS - 1);
+
+	if (block == goal)
+		atomic_inc(&EXT4_SB(inode->i_sb)->s_snapshot_mow_hits);
+
+	if (block < offset) {
+		ei->i_snapshot_mow_pblk = 0;
+		return;
+	}
+	ei->i_snapshot_mow_lblk = lblk - offset;
+	ei->i_snapshot_mow_pblk = block - offset;
+}
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_NEW_BLOCKS
+/*
+ * ext4_snapshot_new_allocated - record blocks allocated after snapshot take
+ * @inode:	owner of the new blocks
+ * @lblk:	logical address of first new block
+ * @len:	no. of new blocks
+ *
+ * Blocks allocated while a snapshot is active were free when it was taken,
+ * so they are not in use by the snapshot.  One range of such blocks is kept
+ * per inode and tagged with the active snapshot id, so it is forgotten on
+ * the next snapshot take.  An adjacent or overlapping range is merged with
+ * it, otherwise the larger range is kept.  This serves the common cases of
+ * a preallocated file and of a file that is written sequentially.
+ * Called under down_write(&i_data_sem).
+ */
+void ext4_snapshot_new_allocated(struct inode *inode, ext4_lblk_t lblk,
+				 unsigned int len)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	__u32 id = le32_to_cpu(EXT4_SB(inode->i_sb)->s_es->s_snapshot_id);
+	u64 start = ei->i_snapshot_new_lblk;
+	u64 end = start + ei->i_snapshot_new_len;
+
+	if (ei->i_snapshot_new_id == id && ei->i_snapshot_new_len) {
+		if (lblk <= end && (u64)lblk + len >= start) {
+			start = min_t(u64, start, lblk);
+			end = max_t(u64, end, (u64)lblk + len);
+			if (end - start <= (ext4_lblk_t)-1) {
+				ei->i_snapshot_new_lblk = start;
+				ei->i_snapshot_new_len = end - start;
+			}
+			return;
+		}
+		if (ei->i_snapshot_new_len >= len)
+			return;
+	}
+	ei->i_snapshot_new_id = id;
+	ei->i_snapshot_new_lblk = lblk;
+	ei->i_snapshot_new_len = len;
+}
+
+/*
+ * ext4_snapshot_new_blocks - check if blocks were allocated after snapshot
+ * take
+ *
+ * Returns 1 if blocks @lblk..@lblk+@len-1 of @inode are all in the range
+ * recorded by ext4_snapshot_new_allocated() for the active snapshot, so they
+ * need no move-on-write.
+ */
+int ext4_snapshot_new_blocks(struct inode *inode, ext4_lblk_t lblk,
+			     unsigned int len)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	__u32 id = le32_to_cpu(EXT4_SB(inode->i_sb)->s_es->s_snapshot_id);
+	int ret;
+
+	down_read(&ei->i_data_sem);
+	ret = ei->i_snapshot_new_len && ei->i_snapshot_new_id == id &&
+		lblk >= ei->i_snapshot_new_lblk &&
+		(u64)lblk + len <= (u64)ei->i_snapshot_new_lblk +
+		ei->i_snapshot_new_len;
+	up_read(&ei->i_data_sem);
+	return ret;
+}
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_PACKED
+/*
+ * ext4_snapshot_cow_zone - get the start of a new snapshot allocation zone
+ *
+ * The zone starts at the flex group (or block group without flex_bg) with
+ * the most free blocks, so the snapshot copies have room to be packed.
+ */
+static ext4_fsblk_t ext4_snapshot_cow_zone(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	ext4_group_t i, best = 0, ngroups = ext4_get_groups_count(sb);
+	struct ext4_group_desc *gdp;
+	int log_flex = sbi->s_log_groups_per_flex;
+	long free, best_free = -1;
+
+	if (log_flex) {
+		for (i = 0; i <= (ngroups - 1) >> log_flex; i++) {
+			free = atomic_read(&sbi->s_flex_groups[i].free_blocks);
+			if (free > best_free) {
+				best_free = free;
+				best = i;
+			}
+		}
+		return ext4_group_first_block_no(sb, best << log_flex);
+	}
+
+	for (i = 0; i < ngroups; i++) {
+		gdp = ext4_get_group_desc(sb, i, NULL);
+		if (!gdp)
+			continue;
+		free = ext4_free_blks_count(sb, gdp);
+		if (free > best_free) {
+			best_free = free;
+			best = i;
+		}
+	}
+	return ext4_group_first_block_no(sb, best);
+}
+
+/*
+ * ext4_snapshot_cow_goal - get allocation goal for snapshot copies
+ * @inode:	active snapshot
+ * @goal:	goal found by the block map code (near the source blocks)
+ *
+ * Returns the next block of the snapshot allocation zone, which is chosen
+ * on the first copy to the snapshot.
+ * Called under down_write(&i_data_sem).
+ */
+ext4_fsblk_t ext4_snapshot_cow_goal(struct inode *inode, ext4_fsblk_t goal)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+
+	if (!EXT4_SB(inode->i_sb)->s_snapshot_cow_packed)
+		return goal;
+
+	if (!ei->i_snapshot_cow_goal)
+		ei->i_snapshot_cow_goal = ext4_snapshot_cow_zone(inode->i_sb);
+	return ei->i_snapshot_cow_goal;
+}
+
+/*
+ * ext4_snapshot_cow_allocated - advance zone after snapshot copy allocation
+ * @inode:	active snapshot
+ * @block:	address of first new block
+ * @count:	number of new blocks
+ *
+ * If the allocator could not satisfy the goal, the zone follows the new
+ * blocks.
+ * Called under down_write(&i_data_sem).
+ */
+void ext4_snapshot_cow_allocated(struct inode *inode, ext4_fsblk_t block,
+				 int count)
+{
+	if (EXT4_SB(inode->i_sb)->s_snapshot_cow_packed)
+		EXT4_I(inode)->i_snapshot_cow_goal = block + count;
+}
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_DEBUG_BENCH
+/* max. blocks of every kind collected for the COW benchmark */
+#define SNAPSHOT_BENCH_BLOCKS		1024
+/* max. runs of blocks in use by snapshot for the move benchmark */
+#define SNAPSHOT_BENCH_RUNS		64
+#define SNAPSHOT_BENCH_RUN_MAX		512
+/* max. block groups with an initialized COW bitmap */
+#define SNAPSHOT_BENCH_GROUPS		64
+
+/* COW benchmark state */
+struct ext4_snapshot_bench {
+	struct inode *snapshot;		/* active snapshot */
+	struct inode *inode;		/* owner of tested moved blocks */
+	struct buffer_head *itable_bh;	/* journalled block for cache hits */
+	/* blocks not in use by snapshot */
+	ext4_fsblk_t free[SNAPSHOT_BENCH_BLOCKS];
+	int nfree;
+	/* blocks in use by snapshot and not yet COWed */
+	ext4_fsblk_t inuse[SNAPSHOT_BENCH_BLOCKS];
+	struct buffer_head *inuse_bh[SNAPSHOT_BENCH_BLOCKS];
+	int ninuse;
+	atomic_t ncopied;		/* inuse blocks taken for COW */
+	/* start of runs of SNAPSHOT_BENCH_RUN_MAX blocks in use */
+	ext4_fsblk_t runs[SNAPSHOT_BENCH_RUNS];
+	int nruns;
+	int run_len;			/* blocks per move test */
+	ext4_group_t groups[SNAPSHOT_BENCH_GROUPS];
+	int ngroups;
+};
+
+/*
+ * test if @block is a bitmap or inode table block of group @gdp.
+ * the COW benchmark doesn't copy those blocks, because a copy of a block
+ * bitmap in the active snapshot is the COW bitmap.
+ */
+static int ext4_snapshot_bench_meta(struct super_block *sb,
+		struct ext4_group_desc *gdp, ext4_fsblk_t block)
+{
+	ext4_fsblk_t itable = ext4_inode_table(sb, gdp);
+
+	if (block >= itable && block < itable + EXT4_SB(sb)->s_itb_per_group)
+		return 1;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
+	if (block == ext4_exclude_bitmap(sb, gdp))
+		return 1;
+#endif
+	return block == ext4_block_bitmap(sb, gdp) ||
+		block == ext4_inode_bitmap(sb, gdp);
+}
+
+/*
+ * collect blocks of @group for the COW benchmark from its COW bitmap.
+ * @flex_meta is set for the first group of a flex group, which holds the
+ * bitmaps of all the groups in the flex group - its blocks in use are
+ * only used for the move test, which doesn't move them.
+ */
+static void ext4_snapshot_bench_scan_group(handle_t *handle,
+		struct ext4_snapshot_bench *b, ext4_group_t group,
+		struct ext4_group_desc *gdp, struct buffer_head *cow_bh,
+		int flex_meta)
+{
+	struct super_block *sb = b->snapshot->i_sb;
+	ext4_fsblk_t first = ext4_group_first_block_no(sb, group);
+	ext4_fsblk_t blocks = ext4_blocks_count(EXT4_SB(sb)->s_es) - first;
+	ext4_fsblk_t block, mapped;
+	ext4_grpblk_t bit, run, max = EXT4_BLOCKS_PER_GROUP(sb);
+	int i;
+
+	if (blocks < max)
+		max = blocks;
+	b->groups[b->ngroups++] = group;
+	for (bit = 0; bit < max; bit += run) {
+		run = 1;
+		if (!ext4_test_bit(bit, cow_bh->b_data)) {
+			if (b->nfree < SNAPSHOT_BENCH_BLOCKS)
+				b->free[b->nfree++] = first + bit;
+			continue;
+		}
+		while (bit + run < max && run < SNAPSHOT_BENCH_RUN_MAX &&
+		       ext4_test_bit(bit + run, cow_bh->b_data))
+			run++;
+		if (run == SNAPSHOT_BENCH_RUN_MAX &&
+		    b->nruns < SNAPSHOT_BENCH_RUNS) {
+			b->runs[b->nruns++] = first + bit;
+			continue;
+		}
+		if (flex_meta)
+			continue;
+		for (i = 0; i < run && b->ninuse < SNAPSHOT_BENCH_BLOCKS; i++) {
+			block = first + bit + i;
+			if (ext4_snapshot_bench_meta(sb, gdp, block) ||
+			    ext4_snapshot_map_blocks(handle, b->snapshot, block,
+						     1, &mapped, SNAPMAP_READ))
+				continue;
+			b->inuse[b->ninuse++] = block;
+		}
+	}
+}
+
+/*
+ * collect blocks for the COW benchmark from the first block groups.
+ * reading the COW bitmaps initializes them for the COW bitmap benchmark.
+ */
+static int ext4_snapshot_bench_scan(struct super_block *sb,
+		struct ext4_snapshot_bench *b)
+{
+	ext4_group_t group, ngroups = ext4_get_groups_count(sb);
+	int flex_groups = ext4_flex_bg_size(EXT4_SB(sb));
+	struct ext4_group_desc *gdp;
+	struct buffer_head *cow_bh;
+	handle_t *handle;
+	int err;
+
+	if (!EXT4_HAS_INCOMPAT_FEATURE(sb, EXT4_FEATURE_INCOMPAT_FLEX_BG))
+		flex_groups = 1;
+
+	for (group = 0; group < ngroups && b->ngroups < SNAPSHOT_BENCH_GROUPS;
+	     group++) {
+		gdp = ext4_get_group_desc(sb, group, NULL);
+		if (!gdp)
+			continue;
+		handle = ext4_journal_start_sb(sb, 1);
+		if (IS_ERR(handle))
+			return PTR_ERR(handle);
+		cow_bh = ext4_snapshot_read_cow_bitmap(handle, b->snapshot,
+						       group);
+		if (cow_bh) {
+			ext4_snapshot_bench_scan_group(handle, b, group, gdp,
+				cow_bh, flex_groups > 1 &&
+				(group % flex_groups) == 0);
+			brelse(cow_bh);
+		}
+		err = ext4_journal_stop(handle);
+		if (err)
+			return err;
+		if (b->nfree == SNAPSHOT_BENCH_BLOCKS &&
+		    b->ninuse == SNAPSHOT_BENCH_BLOCKS &&
+		    b->nruns == SNAPSHOT_BENCH_RUNS)
+			break;
+		cond_resched();
+	}
+	return 0;
+}
+
+/* COW of a block, which is not in use by snapshot */
+static int ext4_snapshot_bench_cow_miss(struct snapshot_bench_case *bc,
+		handle_t *handle, int thread, int i)
+{
+	struct ext4_snapshot_bench *b = bc->private;
+	ext4_fsblk_t block = b->free[(thread + i) % b->nfree];
+	int err;
+
+	err = ext4_snapshot_test_and_cow(__func__, handle, NULL, block,
+					 NULL, 0);
+	return err < 0 ? err : 0;
+}
+
+/* COW of a block, which needs to be copied to snapshot */
+static int ext4_snapshot_bench_cow_copy(struct snapshot_bench_case *bc,
+		handle_t *handle, int thread, int i)
+{
+	struct ext4_snapshot_bench *b = bc->private;
+	int n = atomic_inc_return(&b->ncopied) - 1;
+	int err;
+
+	if (n >= b->ninuse)
+		return 1;
+	err = ext4_snapshot_test_and_cow(__func__, handle, NULL, b->inuse[n],
+					 b->inuse_bh[n], 1);
+	return err < 0 ? err : 0;
+}
+
+/* COW of a block, which is already mapped in snapshot */
+static int ext4_snapshot_bench_cow_mapped(struct snapshot_bench_case *bc,
+		handle_t *handle, int thread, int i)
+{
+	struct ext4_snapshot_bench *b = bc->private;
+	int n = min(atomic_read(&b->ncopied), b->ninuse);
+	int err;
+
+	if (!n)
+		return 1;
+	err = ext4_snapshot_test_and_cow(__func__, handle, NULL,
+					 b->inuse[(thread + i) % n], NULL, 0);
+	return err < 0 ? err : 0;
+}
+
+/* get write access to the inode table block to mark it COWed */
+static int ext4_snapshot_bench_cow_hit_prepare(struct snapshot_bench_case *bc,
+		int thread)
+{
+	struct ext4_snapshot_bench *b = bc->private;
+	handle_t *handle;
+	int err, ret;
+
+	handle = ext4_journal_start_sb(bc->sb, 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	err = ext4_journal_get_write_access(handle, b->itable_bh);
+	ret = ext4_journal_stop(handle);
+	return err ? err : ret;
+}
+
+/* COW of a block, which was COWed in the running transaction */
+static int ext4_snapshot_bench_cow_hit(struct snapshot_bench_case *bc,
+		handle_t *handle, int thread, int i)
+{
+	struct ext4_snapshot_bench *b = bc->private;
+	int err;
+
+	err = ext4_snapshot_test_and_cow(__func__, handle, NULL,
+					 b->itable_bh->b_blocknr,
+					 b->itable_bh, 1);
+	return err < 0 ? err : 0;
+}
+
+/* move test of a run of blocks in use by snapshot */
+static int ext4_snapshot_bench_move(struct snapshot_bench_case *bc,
+		handle_t *handle, int thread, int i)
+{
+	struct ext4_snapshot_bench *b = bc->private;
+	int count = b->run_len;
+	int err;
+
+	err = ext4_snapshot_test_and_move(__func__, handle, b->inode,
+					  b->runs[(thread + i) % b->nruns],
+					  &count, 0);
+	return err < 0 ? err : 0;
+}
+
+/* read of an initialized COW bitmap */
+static int ext4_snapshot_bench_bitmap(struct snapshot_bench_case *bc,
+		handle_t *handle, int thread, int i)
+{
+	struct ext4_snapshot_bench *b = bc->private;
+	struct buffer_head *cow_bh;
+
+	cow_bh = ext4_snapshot_read_cow_bitmap(handle, b->snapshot,
+				b->groups[(thread + i) % b->ngroups]);
+	if (!cow_bh)
+		return -EIO;
+	brelse(cow_bh);
+	return 0;
+}
+
+/*
+ * reset the COW bitmap cache of the thread's group, like snapshot take
+ * does, under journal_lock_updates(), because the cache is read without
+ * the group lock.
+ */
+static int ext4_snapshot_bench_bitmap_cold_prepare(
+		struct snapshot_bench_case *bc, int thread)
+{
+	struct ext4_snapshot_bench *b = bc->private;
+	journal_t *journal = EXT4_SB(bc->sb)->s_journal;
+	ext4_group_t group = b->groups[thread % b->ngroups];
+	struct ext4_group_info *grp = ext4_get_group_info(bc->sb, group);
+
+	jbd2_journal_lock_updates(journal);
+	ext4_lock_group(bc->sb, group);
+	grp->bg_cow_bitmap = 0;
+	ext4_unlock_group(bc->sb, group);
+	jbd2_journal_unlock_updates(journal);
+	return 0;
+}
+
+/* read of an uninitialized COW bitmap, like after mount */
+static int ext4_snapshot_bench_bitmap_cold(struct snapshot_bench_case *bc,
+		handle_t *handle, int thread, int i)
+{
+	struct ext4_snapshot_bench *b = bc->private;
+	struct buffer_head *cow_bh;
+
+	cow_bh = ext4_snapshot_read_cow_bitmap(handle, b->snapshot,
+				b->groups[thread % b->ngroups]);
+	if (!cow_bh)
+		return -EIO;
+	brelse(cow_bh);
+	return 0;
+}
+
+static int ext4_snapshot_bench_run(struct snapshot_bench_case *bc,
+		const char *name, int ops, int batch, int credits,
+		int (*prepare)(struct snapshot_bench_case *, int),
+		int (*op)(struct snapshot_bench_case *, handle_t *, int, int),
+		char *buf, int size)
+{
+	bc->name = name;
+	bc->ops = ops;
+	bc->batch = batch;
+	bc->credits = credits;
+	bc->prepare = prepare;
+	bc->op = op;
+	return snapshot_bench_run(bc, buf, size);
+}
+
+/*
+ * ext4_snapshot_bench_cow() - snapshot COW primitives benchmark
+ * Time ext4_snapshot_test_and_cow() of blocks not in use by snapshot,
+ * of blocks that need to be copied, of blocks mapped in snapshot and of
+ * blocks in the COW cache, ext4_snapshot_test_and_move() of runs of blocks
+ * in use by snapshot and ext4_snapshot_read_cow_bitmap() with initialized
+ * and uninitialized COW bitmap cache.
+ * The copied blocks remain in the active snapshot.  The move test doesn't
+ * move blocks, because there is no file to move them from.
+ * Called from debugfs read of ext4/test-snapshot-bench.
+ * Returns the length of the report written into @buf.
+ */
+int ext4_snapshot_bench_cow(struct super_block *sb, char *buf, int size)
+{
+	static const int run_lens[] = { 1, 8, 64, SNAPSHOT_BENCH_RUN_MAX };
+	struct snapshot_bench_case bc = { .sb = sb };
+	struct ext4_snapshot_bench *b;
+	struct ext4_group_desc *gdp;
+	char names[ARRAY_SIZE(run_lens)][32];
+	int i, ops, err, len = 0;
+
+	b = vzalloc(sizeof(*b));
+	if (!b)
+		return scnprintf(buf, size, "out of memory\n");
+	bc.private = b;
+
+	/* keep the active snapshot from changing during the benchmark */
+	ext4_snapshot_mutex_lock(sb);
+	b->snapshot = ext4_snapshot_has_active(sb);
+	if (!b->snapshot) {
+		len = scnprintf(buf, size, "no active snapshot\n");
+		goto out;
+	}
+	b->inode = sb->s_root->d_inode;
+	err = ext4_snapshot_bench_scan(sb, b);
+	if (err) {
+		len = scnprintf(buf, size, "scan error %d\n", err);
+		goto out;
+	}
+	for (i = 0; i < b->ninuse; i++) {
+		b->inuse_bh[i] = sb_bread(sb, b->inuse[i]);
+		if (!b->inuse_bh[i])
+			break;
+	}
+	b->ninuse = i;
+	gdp = ext4_get_group_desc(sb, b->groups[0], NULL);
+	if (gdp)
+		b->itable_bh = sb_bread(sb, ext4_inode_table(sb, gdp));
+	if (!b->nfree || !b->ninuse || !b->itable_bh) {
+		len = scnprintf(buf, size, "not enough blocks to test - "
+				"%d free and %d in use by snapshot\n",
+				b->nfree, b->ninuse);
+		goto out;
+	}
+
+	len += ext4_snapshot_bench_run(&bc, "test_and_cow bitmap miss",
+				       0, 256, 1, NULL,
+				       ext4_snapshot_bench_cow_miss,
+				       buf + len, size - len);
+	len += ext4_snapshot_bench_run(&bc, "test_and_cow cache hit",
+				       0, 256, 1,
+				       ext4_snapshot_bench_cow_hit_prepare,
+				       ext4_snapshot_bench_cow_hit,
+				       buf + len, size - len);
+	/* every thread count copies fresh blocks */
+	ops = b->ninuse / (2 * max_t(int, snapshot_bench_threads, 1));
+	len += ext4_snapshot_bench_run(&bc, "test_and_cow copied",
+				       max(ops, 1), 8, 8, NULL,
+				       ext4_snapshot_bench_cow_copy,
+				       buf + len, size - len);
+	len += ext4_snapshot_bench_run(&bc, "test_and_cow mapped",
+				       0, 256, 1, NULL,
+				       ext4_snapshot_bench_cow_mapped,
+				       buf + len, size - len);
+	for (i = 0; i < ARRAY_SIZE(run_lens) && b->nruns; i++) {
+		snprintf(names[i], sizeof(names[i]), "test_and_move run %d",
+			 run_lens[i]);
+		b->run_len = run_lens[i];
+		len += ext4_snapshot_bench_run(&bc, names[i], 0, 256, 1,
+					       NULL, ext4_snapshot_bench_move,
+					       buf + len, size - len);
+	}
+	len += ext4_snapshot_bench_run(&bc, "read_cow_bitmap warm",
+				       0, 256, 1, NULL,
+				       ext4_snapshot_bench_bitmap,
+				       buf + len, size - len);
+	/* every op waits for all running handles to reset the cache */
+	len += ext4_snapshot_bench_run(&bc, "read_cow_bitmap cold",
+				       256, 1, 1,
+				       ext4_snapshot_bench_bitmap_cold_prepare,
+				       ext4_snapshot_bench_bitmap_cold,
+				       buf + len, size - len);
+out:
+	ext4_snapshot_mutex_unlock(sb);
+	for (i = 0; i < b->ninuse; i++)
+		brelse(b->inuse_bh[i]);
+	brelse(b->itable_bh);
+	vfree(b);
+	return len;
+}
+
+#endif
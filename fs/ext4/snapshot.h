@@ -17,6 +17,15 @@
 
 #include <linux/version.h>
 #include <linux/delay.h>
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_RCU
+#include <linux/srcu.h>
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_IOPRIO
+#include <linux/ioprio.h>
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_MOVE_QUOTA
+#include <linux/quotaops.h>
+#endif
+#endif
 #include "ext4.h"
 #include "snapshot_debug.h"
 
@@ -31,9 +40,26 @@
  * 4k: 32k blocks_per_group = 32 IND (4k) blocks = 32 groups per DIND
  * 8k: 64k blocks_per_group = 32 IND (8k) blocks = 64 groups per DIND
  * 16k: 128k blocks_per_group = 32 IND (16k) blocks = 128 groups per DIND
+ *
+ * Snapshot files are indirect mapped on purpose, even on extent mapped file
+ * systems (see ext4_new_inode()).  The snapshot image address space spans the
+ * entire file system, so the block group -> IND blocks layout above lets
+ * snapshot shrink/merge/cleanup, snapshot dump and fsck walk and free the
+ * snapshot blocks of a single block group without searching a tree, and lets
+ * the COW path allocate snapshot blocks without splitting extent tree nodes
+ * (which would in turn have to be COWed) in the middle of a COW operation.
+ * The lookup depth is bounded by the DIND/TIND layout and the cost of walking
+ * it is amortized by mapping runs of blocks (ext4_snapshot_map_blocks()) and
+ * by the COW bitmap and COW journal caches.
  */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_SUBPAGE
+/* snapshot block size is independent of the system page size */
+#define SNAPSHOT_BLOCK_SIZE_BITS	12
+#define SNAPSHOT_BLOCK_SIZE		(1 << SNAPSHOT_BLOCK_SIZE_BITS)
+#else
 #define SNAPSHOT_BLOCK_SIZE		PAGE_SIZE
 #define SNAPSHOT_BLOCK_SIZE_BITS	PAGE_SHIFT
+#endif
 #define SNAPSHOT_ADDR_PER_BLOCK_BITS	(SNAPSHOT_BLOCK_SIZE_BITS - 2)
 #define	SNAPSHOT_ADDR_PER_BLOCK		(1 << SNAPSHOT_ADDR_PER_BLOCK_BITS)
 #define SNAPSHOT_DIR_BLOCKS		EXT4_NDIR_BLOCKS
@@ -60,6 +86,33 @@
 #define SNAPSHOT_DIND_BLOCK_GROUPS				\
 	(1 << SNAPSHOT_DIND_BLOCK_GROUPS_BITS)
 
+/*
+ * Chunks of snapshot blocks for parallel cleanup workers.  The blocks of a
+ * chunk are mapped by a single double indirect branch of the snapshot files
+ * (the DIND tree or a branch of a TIND block), so workers of different chunks
+ * never modify the same indirect block.  Huge snapshot files map snapshot
+ * block 0 with the first DIND branch (see ext4_block_to_path()).  Otherwise,
+ * the DIND branch starts at SNAPSHOT_BLOCK_OFFSET, and the direct and IND
+ * mapped blocks before it are chunk 0.
+ */
+#define SNAPSHOT_CHUNK_BLOCKS_BITS	(SNAPSHOT_ADDR_PER_BLOCK_BITS * 2)
+#define SNAPSHOT_CHUNK_BLOCKS					\
+	((ext4_fsblk_t)1 << SNAPSHOT_CHUNK_BLOCKS_BITS)
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_HUGE
+#define SNAPSHOT_CHUNK_BASE		SNAPSHOT_CHUNK_BLOCKS
+#else
+#define SNAPSHOT_CHUNK_BASE		((ext4_fsblk_t)SNAPSHOT_BLOCK_OFFSET)
+#endif
+/* first block of chunk @n */
+#define SNAPSHOT_CHUNK_START(n)					\
+	((n) ? SNAPSHOT_CHUNK_BASE +				\
+	 ((ext4_fsblk_t)(n) - 1) * SNAPSHOT_CHUNK_BLOCKS : 0)
+/* chunk of block @block */
+#define SNAPSHOT_BLOCK_CHUNK(block)				\
+	((block) < SNAPSHOT_CHUNK_BASE ? 0 :			\
+	 (((block) - SNAPSHOT_CHUNK_BASE) >>			\
+	  SNAPSHOT_CHUNK_BLOCKS_BITS) + 1)
+
 /*
  * A snapshot file maps physical block addresses in the snapshot image
  * to logical block offsets in the snapshot file. Even though the mapping
@@ -68,6 +121,10 @@
  */
 #define SNAPSHOT_BLOCK(iblock)	((ext4_fsblk_t)(iblock))
 #define SNAPSHOT_IBLOCK(block)	(ext4_lblk_t)((block))
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_META_BG
+/* max. file system blocks that can be mapped by a snapshot file */
+#define SNAPSHOT_MAX_BLOCKS	((ext4_fsblk_t)1 << 32)
+#endif
 
 
 
@@ -167,6 +224,14 @@ extern int ext4_snapshot_map_blocks(handle_t *handle, struct inode *inode,
 				     ext4_fsblk_t block,
 				     unsigned long maxblocks,
 				     ext4_fsblk_t *mapped, int cmd);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_NUMA
+extern struct buffer_head *ext4_snapshot_getblk_local(struct super_block *sb,
+						      ext4_fsblk_t block);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_MAP
+extern void ext4_snapshot_cow_map_free(struct super_block *sb,
+				       ext4_group_t group);
+#endif
 /* helper function for ext4_snapshot_take() */
 extern void ext4_snapshot_copy_buffer(struct buffer_head *sbh,
 					   struct buffer_head *bh,
@@ -175,6 +240,117 @@ extern void ext4_snapshot_copy_buffer(struct buffer_head *sbh,
 extern int ext4_snapshot_read_block_bitmap(struct super_block *sb,
 		unsigned int block_group, struct buffer_head *bitmap_bh);
 
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
+/* latency histogram buckets: [0] < 1us, [n] < 2^n us, last is unbounded */
+#define EXT4_SNAPSHOT_LAT_BUCKETS	16
+
+enum ext4_snapshot_lat {
+	EXT4_SNAPSHOT_LAT_COPY,		/* COW copy of blocks */
+	EXT4_SNAPSHOT_LAT_MOVE,		/* move-on-write of blocks */
+	EXT4_SNAPSHOT_LAT_BITMAP,	/* COW bitmap init */
+	EXT4_SNAPSHOT_LAT_NUM
+};
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS_LOCK
+enum ext4_snapshot_lock {
+	EXT4_SNAPSHOT_LOCK_MUTEX,	/* snapshot_mutex */
+	EXT4_SNAPSHOT_LOCK_GROUP,	/* group lock in COW bitmap init */
+	EXT4_SNAPSHOT_LOCK_DATA_SEM,	/* active snapshot i_data_sem */
+	EXT4_SNAPSHOT_LOCK_NUM
+};
+
+/*
+ * Per-CPU wait and hold time of a snapshot lock (nsec).
+ * contended is sampled before taking the lock, so it is only a hint.
+ */
+struct ext4_snapshot_lock_stats {
+	unsigned long acquired;		/* times the lock was taken */
+	unsigned long contended;	/* times the lock was found busy */
+	u64 wait_ns;			/* total time waiting for the lock */
+	u64 hold_ns;			/* total time holding the lock */
+	u64 max_hold_ns;		/* longest time holding the lock */
+};
+
+#endif
+/*
+ * Per-CPU snapshot statistics of a file system.
+ * The cow_* counters match the h_cow_* handle debug counters.
+ */
+struct ext4_snapshot_cow_stats {
+	unsigned long cow_moved;	/* blocks moved to snapshot */
+	unsigned long cow_copied;	/* blocks copied to snapshot */
+	unsigned long cow_ok_jh;	/* blocks already COWed in transaction */
+	unsigned long cow_ok_bitmap;	/* blocks not set in COW bitmap */
+	unsigned long cow_ok_mapped;	/* blocks already mapped in snapshot */
+	unsigned long cow_bitmaps;	/* COW bitmaps created */
+	unsigned long cow_excluded;	/* blocks set in exclude bitmap */
+	unsigned long cow_bitmap_waits;	/* waits for pending COW bitmap */
+	unsigned long lat[EXT4_SNAPSHOT_LAT_NUM][EXT4_SNAPSHOT_LAT_BUCKETS];
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS_LOCK
+	struct ext4_snapshot_lock_stats lock[EXT4_SNAPSHOT_LOCK_NUM];
+#endif
+};
+
+extern void ext4_snapshot_stats_latency(struct super_block *sb,
+					enum ext4_snapshot_lat type,
+					ktime_t start);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS_LOCK
+extern u64 ext4_snapshot_stats_lock_wait(struct super_block *sb,
+					 enum ext4_snapshot_lock lock,
+					 u64 start, int contended);
+extern void ext4_snapshot_stats_lock_hold(struct super_block *sb,
+					  enum ext4_snapshot_lock lock,
+					  u64 acquired);
+extern void __ext4_snapshot_mutex_lock(struct super_block *sb);
+extern int ext4_snapshot_mutex_trylock(struct super_block *sb);
+extern void ext4_snapshot_mutex_unlock(struct super_block *sb);
+#endif
+extern int ext4_snapshot_stats_show(struct ext4_sb_info *sbi, char *buf);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS_RESET
+extern void ext4_snapshot_stats_reset(struct ext4_sb_info *sbi);
+#endif
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_GROUP_STATS
+extern const struct file_operations ext4_snapshot_seq_groups_fops;
+
+/*
+ * ext4_snapshot_group_stats_add() adds @count events of type @stat to the
+ * snapshot counters of the group of @block.
+ */
+static inline void ext4_snapshot_group_stats_add(struct super_block *sb,
+		ext4_fsblk_t block, enum ext4_snapshot_group_stat stat,
+		int count)
+{
+	ext4_group_t group;
+
+	ext4_get_group_no_and_offset(sb, block, &group, NULL);
+	atomic_add(count, &ext4_get_group_info(sb, group)->
+			   bg_snapshot_stats[stat]);
+}
+#else
+#define ext4_snapshot_group_stats_add(sb, block, stat, count) \
+	do {} while (0)
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BUDGET
+extern void ext4_snapshot_budget_init(struct super_block *sb,
+				      journal_t *journal);
+extern void ext4_snapshot_budget_account(handle_t *handle, int credits);
+extern void ext4_snapshot_budget_fit(struct super_block *sb, int credits);
+extern int ext4_snapshot_budget_show(struct ext4_sb_info *sbi, char *buf);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CREDITS_ADAPTIVE
+extern void ext4_snapshot_cow_factor_reset(struct super_block *sb);
+extern void ext4_snapshot_cow_factor_fallback(struct super_block *sb);
+#endif
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BYPASS_CREDITS
+/* default max. journaled COW bitmap indirect blocks per transaction */
+#define EXT4_DEF_SNAPSHOT_BYPASS_CREDITS	64
+
+extern int ext4_snapshot_bypass_credits(handle_t *handle, int nblocks);
+
 #endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW
 extern int ext4_snapshot_test_and_cow(const char *where,
@@ -191,6 +367,27 @@ extern int ext4_snapshot_test_and_cow(const char *where,
 #else
 #define ext4_snapshot_cow(handle, inode, block, bh, cow) 0
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_LOAD_COW_BITMAP
+extern int ext4_snapshot_load_cow_bitmaps(struct super_block *sb,
+		struct inode *snapshot);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREBUILD
+extern int ext4_snapshot_prebuild_cow_bitmap(handle_t *handle,
+		struct inode *snapshot, unsigned int block_group);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_RANGE
+extern int ext4_snapshot_test_and_cow_range(const char *where,
+		handle_t *handle, struct inode *inode,
+		struct buffer_head **bhs, int count, int cow);
+
+/*
+ * test if subsequent metadata blocks should be COWed
+ * and if they should, copy the blocks to the active snapshot
+ */
+#define ext4_snapshot_cow_range(handle, inode, bhs, count, cow)	\
+	ext4_snapshot_test_and_cow_range(__func__, handle, inode,	\
+			bhs, count, cow)
+#endif
 
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_MOVE
 extern int ext4_snapshot_test_and_move(const char *where,
@@ -207,11 +404,92 @@ extern int ext4_snapshot_test_and_move(const char *where,
 #else
 #define ext4_snapshot_move(handle, inode, block, pcount, move) (0)
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_MOW_GOAL
+/* move-on-write arena size in logical blocks */
+#define EXT4_SNAPSHOT_MOW_ARENA_BITS	11
+#define EXT4_SNAPSHOT_MOW_ARENA_BLOCKS	(1 << EXT4_SNAPSHOT_MOW_ARENA_BITS)
+
+extern ext4_fsblk_t ext4_snapshot_mow_goal(struct inode *inode,
+		ext4_lblk_t lblk, ext4_fsblk_t goal, int *arena);
+extern void ext4_snapshot_mow_allocated(struct inode *inode,
+		ext4_lblk_t lblk, ext4_fsblk_t goal, ext4_fsblk_t block);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_NEW_BLOCKS
+extern void ext4_snapshot_new_allocated(struct inode *inode,
+		ext4_lblk_t lblk, unsigned int len);
+extern int ext4_snapshot_new_blocks(struct inode *inode,
+		ext4_lblk_t lblk, unsigned int len);
+
+/* forget the new blocks of @inode, called under down_write(&i_data_sem) */
+static inline void ext4_snapshot_new_reset(struct inode *inode)
+{
+	EXT4_I(inode)->i_snapshot_new_len = 0;
+}
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_PACKED
+extern ext4_fsblk_t ext4_snapshot_cow_goal(struct inode *inode,
+		ext4_fsblk_t goal);
+extern void ext4_snapshot_cow_allocated(struct inode *inode,
+		ext4_fsblk_t block, int count);
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_IOPRIO
+/* I/O priority of snapshot cleanup and COW bitmap prebuild threads */
+#define EXT4_SNAPSHOT_BG_IOPRIO	\
+	IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, (IOPRIO_BE_NR - 1))
+/*
+ * synchronous COW writes are waited for by a foreground task.
+ * they only need to complete before the transaction that depends on
+ * them commits, and the commit block write flushes the device cache,
+ * so no REQ_FLUSH or REQ_FUA here: on devices without FUA support,
+ * REQ_FUA would be emulated with one more cache flush per write.
+ */
+#define EXT4_SNAPSHOT_SYNC_WRITE	(WRITE_SYNC | REQ_META)
+#define EXT4_SNAPSHOT_COW_READ		(READ | REQ_META)
+
+static inline void ext4_snapshot_set_bg_ioprio(void)
+{
+	set_task_ioprio(current, EXT4_SNAPSHOT_BG_IOPRIO);
+}
+#else
+#define EXT4_SNAPSHOT_SYNC_WRITE	WRITE_SYNC
+#define EXT4_SNAPSHOT_COW_READ		READ
+#define ext4_snapshot_set_bg_ioprio()
+#endif
 
 /*
  * Block access functions
  */
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_FAST
+#include <linux/jump_label.h>
+
+/*
+ * Jump label symbols are not exported to modules, so the global
+ * "any active snapshot" branch is only used by a built-in ext4.
+ */
+#if !defined(MODULE) || !defined(HAVE_JUMP_LABEL)
+#define EXT4_SNAPSHOT_ACTIVE_KEY
+extern struct jump_label_key ext4_snapshot_active_key;
+#endif
+
+/*
+ * tests if block access hooks may return early, because @sb has no
+ * active snapshot.  The global jump label is enabled only while some
+ * mounted file system has an active snapshot.
+ * active snapshot is only changed under journal_lock_updates(),
+ * so the test result never changes during a transaction.
+ */
+static inline int ext4_snapshot_hooks_off(struct super_block *sb)
+{
+#ifdef EXT4_SNAPSHOT_ACTIVE_KEY
+	if (!static_branch(&ext4_snapshot_active_key))
+		return 1;
+#endif
+	return likely(!EXT4_SB(sb)->s_active_snapshot);
+}
+#endif
+
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_JBD
 /*
  * get_write_access() is called before writing to a metadata block
@@ -228,12 +506,53 @@ static inline int ext4_snapshot_get_write_access(handle_t *handle,
 	struct super_block *sb;
 
 	sb = handle->h_transaction->t_journal->j_private;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_FAST
+	if (ext4_snapshot_hooks_off(sb))
+#else
 	if (!EXT4_SNAPSHOTS(sb))
+#endif
 		return 0;
 
 	return ext4_snapshot_cow(handle, inode, bh->b_blocknr, bh, 1);
 }
 
+/*
+ * get_write_access_range() is called before writing to @count metadata
+ * blocks, which are usually physically subsequent (i.e. GDT blocks)
+ *
+ * Return values:
+ * = 0 - blocks were COWed or don't need to be COWed
+ * < 0 - error
+ */
+static inline int ext4_snapshot_get_write_access_range(handle_t *handle,
+		struct inode *inode, struct buffer_head **bhs, int count)
+{
+	struct super_block *sb;
+#ifndef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_RANGE
+	int i, err;
+#endif
+
+	sb = handle->h_transaction->t_journal->j_private;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_FAST
+	if (ext4_snapshot_hooks_off(sb))
+#else
+	if (!EXT4_SNAPSHOTS(sb))
+#endif
+		return 0;
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_RANGE
+	return ext4_snapshot_cow_range(handle, inode, bhs, count, 1);
+#else
+	for (i = 0; i < count; i++) {
+		err = ext4_snapshot_cow(handle, inode, bhs[i]->b_blocknr,
+				bhs[i], 1);
+		if (err)
+			return err;
+	}
+	return 0;
+#endif
+}
+
 /*
  * get_create_access() is called after allocating a new metadata block
  *
@@ -248,9 +567,19 @@ static inline int ext4_snapshot_get_create_access(handle_t *handle,
 	int err;
 
 	sb = handle->h_transaction->t_journal->j_private;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_FAST
+	if (ext4_snapshot_hooks_off(sb))
+#else
 	if (!EXT4_SNAPSHOTS(sb))
+#endif
 		return 0;
 
+#if defined(CONFIG_EXT4_FS_SNAPSHOT_HOOKS_JBD_CREATE) && \
+	!defined(CONFIG_EXT4_DEBUG)
+	/* block was just allocated from free space by mballoc */
+	if (bh->b_blocknr - handle->h_alloc_start < handle->h_alloc_len)
+		return 0;
+#endif
 	/* Should block be COWed? */
 	err = ext4_snapshot_cow(handle, NULL, bh->b_blocknr, bh, 0);
 	/*
@@ -266,6 +595,23 @@ static inline int ext4_snapshot_get_create_access(handle_t *handle,
 
 #endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_BITMAP
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_BITMAP_CACHED
+/*
+ * Test if the COW bitmap of @group is initialized (i.e. not zero and not
+ * pending COW of the block bitmap @bitmap_blk).  The initialized state is
+ * only reset under journal_lock_updates() on snapshot take, so it can be
+ * tested without the group lock during a transaction.
+ */
+static inline int ext4_snapshot_cow_bitmap_cached(struct super_block *sb,
+		ext4_group_t group, ext4_fsblk_t bitmap_blk)
+{
+	unsigned long cow_bitmap_blk =
+		ACCESS_ONCE(ext4_get_group_info(sb, group)->bg_cow_bitmap);
+
+	return cow_bitmap_blk && cow_bitmap_blk != bitmap_blk;
+}
+
+#endif
 /*
  * get_bitmap_access() is called before modifying a block bitmap.
  * this call initializes the COW bitmap for @group.
@@ -278,7 +624,11 @@ static inline int ext4_snapshot_get_bitmap_access(handle_t *handle,
 		struct super_block *sb, ext4_group_t group,
 		struct buffer_head *bh)
 {
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_FAST
+	if (ext4_snapshot_hooks_off(sb))
+#else
 	if (!EXT4_SNAPSHOTS(sb))
+#endif
 		return 0;
 	/*
 	 * With flex_bg, block bitmap may reside in a different group than
@@ -286,7 +636,12 @@ static inline int ext4_snapshot_get_bitmap_access(handle_t *handle,
 	 * 1. init the COW bitmap for @group by testing
 	 *    if the first block in the group should be COWed
 	 */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_BITMAP_CACHED
+	if (EXT4_HAS_INCOMPAT_FEATURE(sb, EXT4_FEATURE_INCOMPAT_FLEX_BG) &&
+	    !ext4_snapshot_cow_bitmap_cached(sb, group, bh->b_blocknr)) {
+#else
 	if (EXT4_HAS_INCOMPAT_FEATURE(sb, EXT4_FEATURE_INCOMPAT_FLEX_BG)) {
+#endif
 		int err = ext4_snapshot_cow(handle, NULL,
 				ext4_group_first_block_no(sb, group),
 				NULL, 0);
@@ -324,7 +679,11 @@ static inline int ext4_snapshot_get_move_access(handle_t *handle,
 						ext4_fsblk_t block,
 						int *pcount, int move)
 {
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_FAST
+	if (ext4_snapshot_hooks_off(inode->i_sb))
+#else
 	if (!EXT4_SNAPSHOTS(inode->i_sb))
+#endif
 		return 0;
 
 	return ext4_snapshot_move(handle, inode, block, pcount, move);
@@ -353,7 +712,11 @@ static inline int ext4_snapshot_get_delete_access(handle_t *handle,
 	struct super_block *sb;
 
 	sb = handle->h_transaction->t_journal->j_private;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_FAST
+	if (ext4_snapshot_hooks_off(sb))
+#else
 	if (!EXT4_SNAPSHOTS(sb))
+#endif
 		return 0;
 
 	return ext4_snapshot_move(handle, inode, block, pcount, 1);
@@ -363,6 +726,17 @@ static inline int ext4_snapshot_get_delete_access(handle_t *handle,
 extern int ext4_snapshot_test_and_exclude(const char *where, handle_t *handle,
 		struct super_block *sb, ext4_fsblk_t block, int maxblocks,
 		int exclude);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+extern int ext4_snapshot_exclude_cow_bitmap(handle_t *handle,
+		struct super_block *sb, ext4_fsblk_t block, int count);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_FIX_GROUP
+extern void ext4_snapshot_mark_group_fix(handle_t *handle,
+		struct super_block *sb, ext4_group_t block_group);
+#else
+#define ext4_snapshot_mark_group_fix(handle, sb, block_group) \
+	EXT4_SET_FLAGS(sb, EXT4_FLAGS_FIX_EXCLUDE)
+#endif
 
 /*
  * ext4_snapshot_exclude_blocks() - exclude snapshot blocks
@@ -404,6 +778,127 @@ extern void ext4_snapshot_get_flags(struct inode *inode, struct file *filp);
 extern int ext4_snapshot_set_flags(handle_t *handle, struct inode *inode,
 				    unsigned int flags);
 extern int ext4_snapshot_take(struct inode *inode);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+extern int ext4_snapshot_exclude_file(struct inode *inode);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_INHERIT
+extern int ext4_snapshot_exclude_dir(struct inode *inode);
+#endif
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_DIFF
+extern int ext4_snapshot_diff(struct inode *inode,
+			      struct ext4_snapshot_diff __user *udiff);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_SEND
+extern int ext4_snapshot_send(struct inode *inode,
+			      struct ext4_snapshot_send __user *usend);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_REVERT
+extern int ext4_snapshot_revert(struct super_block *sb);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_CONVERT
+extern int ext4_snapshot_convert(struct super_block *sb);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_GROUP
+extern int ext4_snapshot_take_group(struct file *filp,
+				    struct ext4_snapshot_group __user *ugroup);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+extern int ext4_snapshot_get_stats(struct inode *inode,
+				   struct ext4_snapshot_stats __user *ustats);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_QUERY
+extern int ext4_snapshot_query(struct super_block *sb,
+			       struct ext4_snapshot_query __user *uquery);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_ASYNC
+extern void ext4_snapshot_take_work(struct work_struct *work);
+extern int ext4_snapshot_take_async(struct file *filp,
+				    struct ext4_snapshot_take __user *utake);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_SCHED
+/* interval for sampling the journal commit rate */
+#define EXT4_SNAPSHOT_SCHED_POLL	(10*HZ)
+/* default max. journal commits per poll interval of an idle file system */
+#define EXT4_DEF_SNAPSHOT_SCHED_IDLE	1
+
+extern void ext4_snapshot_sched_work(struct work_struct *work);
+extern void ext4_snapshot_start_sched(struct super_block *sb);
+extern void ext4_snapshot_stop_sched(struct super_block *sb);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_TRACK
+extern s64 ext4_snapshot_meta_blocks_estimate(struct super_block *sb);
+#endif
+#ifndef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS_LOCK
+#define __ext4_snapshot_mutex_lock(sb) \
+	mutex_lock(&EXT4_SB(sb)->s_snapshot_mutex)
+#define ext4_snapshot_mutex_trylock(sb) \
+	mutex_trylock(&EXT4_SB(sb)->s_snapshot_mutex)
+#define ext4_snapshot_mutex_unlock(sb) \
+	mutex_unlock(&EXT4_SB(sb)->s_snapshot_mutex)
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC
+/* snapshot cleanup thread state bits */
+#define SNAPSHOT_CLEANUP_PENDING	0	/* cleanup was requested */
+#define SNAPSHOT_CLEANUP_RUNNING	1	/* cleanup pass is running */
+#define SNAPSHOT_CLEANUP_YIELDED	2	/* cleanup pass was interrupted */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_EVICT
+#define SNAPSHOT_CLEANUP_EVICT		3	/* free space below watermark */
+
+/* default eviction watermark in percent of file system blocks */
+#define EXT4_DEF_SNAPSHOT_EVICT_RATIO	2
+/* min. interval between eviction passes */
+#define EXT4_SNAPSHOT_EVICT_INTERVAL	HZ
+#endif
+
+extern void ext4_snapshot_start_cleanup(struct super_block *sb);
+extern int ext4_snapshot_wake_cleanup(struct super_block *sb);
+extern void ext4_snapshot_stop_cleanup(struct super_block *sb);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_EVICT
+/*
+ * Returns true if free space is below the snapshot eviction watermark,
+ * which is snapshot_evict_ratio percent of the file system blocks.
+ */
+static inline int ext4_snapshot_evict_needed(struct ext4_sb_info *sbi,
+					     s64 free_blocks)
+{
+	unsigned int ratio = sbi->s_snapshot_evict_ratio;
+
+	return ratio && free_blocks * 100 <
+		(s64)ext4_blocks_count(sbi->s_es) * ratio;
+}
+
+/*
+ * Wake up the cleanup thread to evict snapshots, because free space is
+ * below the watermark.  Called from block allocation, so it only sets
+ * a state bit and wakes up the thread at most once per eviction interval.
+ */
+static inline void ext4_snapshot_wake_evict(struct ext4_sb_info *sbi)
+{
+	struct task_struct *task = sbi->s_snapshot_cleanup;
+
+	if (task && time_after_eq(jiffies, sbi->s_snapshot_evict_next) &&
+	    !test_and_set_bit(SNAPSHOT_CLEANUP_EVICT,
+			      &sbi->s_snapshot_cleanup_state))
+		wake_up_process(task);
+}
+#endif
+
+/*
+ * Snapshot control tasks count themselves as snapshot_mutex waiters,
+ * so the snapshot cleanup thread can yield the mutex to them.
+ */
+static inline void ext4_snapshot_mutex_lock(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	atomic_inc(&sbi->s_snapshot_mutex_waiters);
+	__ext4_snapshot_mutex_lock(sb);
+	atomic_dec(&sbi->s_snapshot_mutex_waiters);
+}
+#else
+#define ext4_snapshot_mutex_lock(sb) \
+	__ext4_snapshot_mutex_lock(sb)
+#endif
 #endif
 
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE
@@ -414,19 +909,92 @@ extern int ext4_snapshot_load(struct super_block *sb,
 		struct ext4_super_block *es, int read_only);
 extern int ext4_snapshot_update(struct super_block *sb, int cleanup,
 		int read_only);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_UPDATE_INCREMENTAL
+extern int ext4_snapshot_update_inode(struct inode *inode, int cleanup);
+#else
+#define ext4_snapshot_update_inode(inode, cleanup)		\
+	ext4_snapshot_update((inode)->i_sb, (cleanup), 0)
+#endif
 extern void ext4_snapshot_destroy(struct super_block *sb);
 #endif
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_RCU
+/* protects read through walks of the in-memory snapshot lists */
+extern struct srcu_struct ext4_snapshot_list_srcu;
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_BDEV
+/* snapshot_inode.c */
+extern int ext4_snapshot_add_bdev(struct inode *inode);
+extern int ext4_snapshot_remove_bdev(struct inode *inode, int force);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_CLONE
+extern int ext4_snapshot_clone(struct inode *inode,
+			       struct ext4_snapshot_clone __user *uclone);
+#endif
+extern int init_ext4_snapshot_bdev(void);
+extern void exit_ext4_snapshot_bdev(void);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_AUTOMOUNT
+extern struct dentry *ext4_snapshot_dir_lookup(struct inode *dir,
+		struct dentry *dentry);
+/* super.c */
+extern struct file_system_type ext4_snapshot_fs_type;
+
+#define EXT4_SNAPSHOT_DIR_NAME	".snapshot"
+#endif
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_CACHE
+/* extents.c */
+extern int ext4_init_ext_cache(void);
+extern void ext4_exit_ext_cache(void);
+
+#endif
 static inline int init_ext4_snapshot(void)
 {
+	int err = 0;
+
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CACHE
 	init_ext4_snapshot_cow_cache();
 #endif
-	return 0;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_CACHE
+	err = ext4_init_ext_cache();
+	if (err)
+		return err;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_RCU
+	err = init_srcu_struct(&ext4_snapshot_list_srcu);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_CACHE
+	if (err)
+		ext4_exit_ext_cache();
+#endif
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_BDEV
+	if (!err) {
+		err = init_ext4_snapshot_bdev();
+		if (err) {
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_RCU
+			cleanup_srcu_struct(&ext4_snapshot_list_srcu);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_CACHE
+			ext4_exit_ext_cache();
+#endif
+		}
+	}
+#endif
+	return err;
 }
 
 static inline void exit_ext4_snapshot(void)
 {
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_BDEV
+	exit_ext4_snapshot_bdev();
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_RCU
+	cleanup_srcu_struct(&ext4_snapshot_list_srcu);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_CACHE
+	ext4_exit_ext_cache();
+#endif
 }
 
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_SHRINK
@@ -436,6 +1004,14 @@ extern int ext4_snapshot_shrink_blocks(handle_t *handle, struct inode *inode,
 		struct buffer_head *cow_bh,
 		int shrink, int *pmapped);
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_DIFF
+extern int ext4_snapshot_diff_blocks(struct inode *inode,
+		ext4_lblk_t iblock, unsigned long maxblocks, int *pmapped);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_FIEMAP
+extern int ext4_snapshot_fiemap(struct inode *inode,
+		struct fiemap_extent_info *fieinfo, __u64 start, __u64 len);
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_MERGE
 extern int ext4_snapshot_merge_blocks(handle_t *handle,
 		struct inode *src, struct inode *dst,
@@ -458,6 +1034,19 @@ static inline int ext4_snapshot_list(struct inode *inode)
 	return ext4_test_inode_snapstate(inode, EXT4_SNAPSTATE_LIST);
 }
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_CACHE
+/*
+ * Invalidate the read through cache of all snapshots.
+ * Called under snapshot_mutex after changing the snapshot list or after
+ * changing the mapping of a non active snapshot (merge, dedup).
+ */
+static inline void ext4_snapshot_list_changed(struct super_block *sb)
+{
+	/* write the snapshot list before writing list generation */
+	smp_wmb();
+	EXT4_SB(sb)->s_snapshot_list_gen++;
+}
+#endif
 
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE
 /*
@@ -482,9 +1071,27 @@ static inline int ext4_snapshot_excluded(struct inode *inode)
 	/* snapshot files are 'ignored' */
 	if (ext4_snapshot_file(inode))
 		return -1;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+	/* files marked by the snapshot exclude ioctl are 'excluded' */
+	if (ext4_test_inode_flag(inode, EXT4_INODE_EXCLUDED))
+		return 1;
+#endif
 	return 0;
 }
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+/*
+ * ext4_snapshot_exclude_pending():
+ * Checks if the blocks of an excluded file are being bulk excluded, or if
+ * bulk exclude was interrupted, so some of them may not have been marked
+ * in exclude bitmap yet.
+ */
+static inline int ext4_snapshot_exclude_pending(struct inode *inode)
+{
+	return inode &&
+		ext4_test_inode_flag(inode, EXT4_INODE_EXCLUDE_PENDING);
+}
+#endif
 
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE
 /* tests if the file system has an active snapshot */
@@ -515,6 +1122,43 @@ static inline int ext4_snapshot_is_active(struct inode *inode)
 	return (inode == EXT4_SB(inode->i_sb)->s_active_snapshot);
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_MOVE_QUOTA
+/*
+ * ext4_snapshot_charge_blocks() - account blocks mapped to snapshot file
+ * @inode:	snapshot file
+ * @count:	no. of blocks moved into the snapshot file
+ *
+ * With sysfs snapshot_charge_quota cleared, the blocks are only added to
+ * the snapshot file size (i_blocks) and the snapshot file owner's quota
+ * is left alone, so move-on-write does not update two dquots per write.
+ */
+static inline void ext4_snapshot_charge_blocks(struct inode *inode,
+		qsize_t count)
+{
+	if (EXT4_SB(inode->i_sb)->s_snapshot_charge_quota) {
+		dquot_alloc_block_nofail(inode, count);
+		return;
+	}
+	inode_add_bytes(inode, count << inode->i_blkbits);
+	mark_inode_dirty_sync(inode);
+}
+
+static inline void ext4_snapshot_uncharge_blocks(struct inode *inode,
+		qsize_t count)
+{
+	if (EXT4_SB(inode->i_sb)->s_snapshot_charge_quota) {
+		dquot_free_block(inode, count);
+		return;
+	}
+	inode_sub_bytes(inode, count << inode->i_blkbits);
+	mark_inode_dirty_sync(inode);
+}
+#else
+#define ext4_snapshot_charge_blocks(inode, count)	\
+	dquot_alloc_block_nofail((inode), (count))
+#define ext4_snapshot_uncharge_blocks(inode, count)	\
+	dquot_free_block((inode), (count))
+#endif
 
 #define SNAPSHOT_TRANSACTION_ID(sb)				\
 	((EXT4_I(EXT4_SB(sb)->s_active_snapshot))->i_datasync_tid)
@@ -581,9 +1225,19 @@ static inline void ext4_snapshot_end_pending_cow(struct buffer_head *sbh)
 	 * indicates that the COW operation is complete.
 	 */
 	clear_buffer_new(sbh);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW_WAITQ
+	/* wake up the tasks waiting for the pending COW to complete */
+	smp_mb__after_clear_bit();
+	wake_up_bit(&sbh->b_state, BH_New);
+#endif
 	/* we no longer need to keep the buffer in cache */
 	put_bh(sbh);
 }
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW_WAITQ
+
+extern void __ext4_snapshot_wait_pending_cow(struct buffer_head *sbh,
+						sector_t blocknr);
+#endif
 
 /*
  * Test for pending COW operation and wait for its completion.
@@ -591,6 +1245,11 @@ static inline void ext4_snapshot_end_pending_cow(struct buffer_head *sbh)
 static inline void ext4_snapshot_test_pending_cow(struct buffer_head *sbh,
 						sector_t blocknr)
 {
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW_WAITQ
+	if (buffer_new(sbh))
+		/* wait for pending COW to complete */
+		__ext4_snapshot_wait_pending_cow(sbh, blocknr);
+#else
 	while (buffer_new(sbh)) {
 		/* wait for pending COW to complete */
 		snapshot_debug_once(2, "waiting for pending cow: "
@@ -612,8 +1271,53 @@ static inline void ext4_snapshot_test_pending_cow(struct buffer_head *sbh,
 		msleep(1);
 		/* XXX: Should we fail after N retries? */
 	}
+#endif
+}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_RANGE
+
+/*
+ * Start pending COW operations on @count subsequent snapshot blocks,
+ * which were allocated by a single multi-block COW get_blocks_handle().
+ * Returns the number of pending COW operations started.
+ */
+static inline int ext4_snapshot_start_pending_cow_range(
+		struct super_block *sb, sector_t blocknr, int count)
+{
+	struct buffer_head *sbh;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		sbh = sb_getblk(sb, blocknr + i);
+		if (!sbh)
+			break;
+		ext4_snapshot_start_pending_cow(sbh);
+		brelse(sbh);
+	}
+	return i;
+}
+
+/*
+ * End pending COW operations on @count subsequent snapshot blocks.
+ * Called on failure to connect the new snapshot blocks to the inode
+ * or on failure to complete the multi-block COW operation.
+ */
+static inline void ext4_snapshot_end_pending_cow_range(
+		struct super_block *sb, sector_t blocknr, int count)
+{
+	struct buffer_head *sbh;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		sbh = sb_find_get_block(sb, blocknr + i);
+		if (!sbh)
+			continue;
+		if (buffer_new(sbh))
+			ext4_snapshot_end_pending_cow(sbh);
+		brelse(sbh);
+	}
 }
 #endif
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_READ
 /*
  * A tracked reader takes 0x10000 reference counts on the block device buffer.
@@ -643,7 +1347,16 @@ static inline int buffer_tracked_readers_count(struct buffer_head *bdev_bh)
 /* buffer.c */
 extern int start_buffer_tracked_read(struct buffer_head *bh);
 extern void cancel_buffer_tracked_read(struct buffer_head *bh);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_READ_RANGE
+extern int ext4_snapshot_tracked_reads_pending(struct super_block *sb,
+		ext4_fsblk_t block);
+#endif
 extern int ext4_read_full_page(struct page *page, get_block_t *get_block);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READAHEAD
+extern int ext4_read_full_pages(struct address_space *mapping,
+		struct list_head *pages, unsigned nr_pages,
+		get_block_t *get_block);
+#endif
 
 #ifdef CONFIG_EXT4_DEBUG
 extern void __ext4_trace_bh_count(const char *fn, struct buffer_head *bh);
@@ -715,9 +1428,11 @@ ext4_sb_find_get_block(const char *fn, struct super_block *sb, sector_t block)
 #define ext4_snapshot_set_flags(handle, inode, flags) (0)
 #define ext4_snapshot_take(inode) (0)
 #define ext4_snapshot_update(inode_i_sb, cleanup, zero) (0)
+#define ext4_snapshot_update_inode(inode, cleanup) (0)
 #define ext4_snapshot_has_active(sb) (NULL)
 #define ext4_snapshot_get_bitmap_access(handle, sb, grp, bh) (0)
 #define ext4_snapshot_get_write_access(handle, inode, bh) (0)
+#define ext4_snapshot_get_write_access_range(handle, inode, bhs, count) (0)
 #define ext4_snapshot_get_create_access(handle, bh) (0)
 #define ext4_snapshot_excluded(ac_inode) (0)
 #define ext4_snapshot_get_delete_access(handle, inode, block, pcount) (0)
@@ -23,6 +23,7 @@
 #include <linux/blkdev.h>
 #include <linux/file.h>
 #include <linux/quotaops.h>
+#include <linux/sort.h>
 #include <linux/highmem.h>
 #include <linux/module.h>
 #include <linux/writeback.h>
@@ -109,6 +110,224 @@ void __ext4_trace_bh_count(const char *fn, struct buffer_head *bh)
 }
 #endif
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_READ_RANGE
+/*
+ * Tracked read ranges.
+ * Instead of taking a tracked reader reference on the block device buffer of
+ * every block read through, a reader task registers the block in a tracked
+ * read range, which holds a bitmap of the pending blocks in a window of up to
+ * BITS_PER_LONG blocks from the first block of the range.
+ * Ranges are owned by the reader task that started them and are only extended
+ * by their owner, so a COWing task never waits for blocks of another reader,
+ * which has not yet submitted its read.
+ * A range is linked on the file system tracked reads list while it has
+ * pending blocks and is freed by the last block completion.
+ * The snapshot page buffer holds a reference to the range in b_private.
+ * The tracked reads list lock is taken from I/O completion context.
+ */
+struct ext4_tracked_read_range {
+	struct list_head	list;
+	struct task_struct	*owner;
+	ext4_fsblk_t		start;
+	unsigned long		pending;	/* bitmap of pending blocks */
+};
+
+static inline int tracked_read_range_contains(
+		struct ext4_tracked_read_range *range, ext4_fsblk_t block)
+{
+	return block >= range->start &&
+		block - range->start < BITS_PER_LONG &&
+		test_bit(block - range->start, &range->pending);
+}
+
+/* sb of snapshot page buffer */
+static inline struct ext4_sb_info *tracked_read_sbi(struct buffer_head *bh)
+{
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READ_SHARED
+	/* page less buffer of shared block read on a mounted file system */
+	if (!bh->b_page)
+		return EXT4_SB(bh->b_bdev->bd_super);
+#endif
+	return EXT4_SB(bh->b_page->mapping->host->i_sb);
+}
+
+/*
+ * find a range of the current task, which can track the block.
+ * a block that is already pending in the range (e.g. a block read by another
+ * snapshot, whose read was submitted by the current task) needs a new range.
+ * called under tracked reads list lock.
+ */
+static struct ext4_tracked_read_range *
+find_tracked_read_range(struct ext4_sb_info *sbi, ext4_fsblk_t block)
+{
+	struct ext4_tracked_read_range *range;
+
+	list_for_each_entry(range, &sbi->s_tracked_reads, list) {
+		if (range->owner != current)
+			continue;
+		if (block < range->start ||
+		    block - range->start >= BITS_PER_LONG)
+			continue;
+		if (!test_bit(block - range->start, &range->pending))
+			return range;
+	}
+	return NULL;
+}
+
+/*
+ * put tracked read range
+ * clear the buffer's pending bit and free the range after the last one.
+ * called for canceled tracked reads and on I/O completion.
+ */
+static void put_tracked_read_range(struct buffer_head *bh)
+{
+	struct ext4_sb_info *sbi = tracked_read_sbi(bh);
+	struct ext4_tracked_read_range *range = bh->b_private;
+	unsigned long flags;
+
+	BUG_ON(!range);
+	BUG_ON(!tracked_read_range_contains(range, bh->b_blocknr));
+	bh->b_private = NULL;
+	spin_lock_irqsave(&sbi->s_tracked_reads_lock, flags);
+	__clear_bit(bh->b_blocknr - range->start, &range->pending);
+	if (range->pending)
+		range = NULL;
+	else
+		list_del(&range->list);
+	spin_unlock_irqrestore(&sbi->s_tracked_reads_lock, flags);
+	kfree(range);
+}
+
+/*
+ * ext4_snapshot_tracked_reads_pending()
+ * called by the COWing task before completing COW of @block.
+ * returns true if @block is pending read through by any reader task.
+ */
+int ext4_snapshot_tracked_reads_pending(struct super_block *sb,
+		ext4_fsblk_t block)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_tracked_read_range *range;
+	unsigned long flags;
+	int pending = 0;
+
+	if (list_empty(&sbi->s_tracked_reads))
+		return 0;
+
+	spin_lock_irqsave(&sbi->s_tracked_reads_lock, flags);
+	list_for_each_entry(range, &sbi->s_tracked_reads, list) {
+		if (tracked_read_range_contains(range, block)) {
+			pending = 1;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&sbi->s_tracked_reads_lock, flags);
+	return pending;
+}
+
+/*
+ * start buffer tracked read
+ * called from inside get_block()
+ * mark the block pending in a tracked read range of the current task
+ * and set buffer tracked read flag
+ */
+int start_buffer_tracked_read(struct buffer_head *bh)
+{
+	struct ext4_sb_info *sbi = tracked_read_sbi(bh);
+	struct ext4_tracked_read_range *range, *new = NULL;
+	unsigned long flags;
+
+	BUG_ON(buffer_tracked_read(bh));
+	BUG_ON(!buffer_mapped(bh));
+	BUG_ON(bh->b_private);
+
+	for (;;) {
+		spin_lock_irqsave(&sbi->s_tracked_reads_lock, flags);
+		range = find_tracked_read_range(sbi, bh->b_blocknr);
+		if (!range && new) {
+			/* start a new range at this block */
+			range = new;
+			new = NULL;
+			range->owner = current;
+			range->start = bh->b_blocknr;
+			range->pending = 0;
+			list_add(&range->list, &sbi->s_tracked_reads);
+		}
+		if (range) {
+			__set_bit(bh->b_blocknr - range->start,
+				  &range->pending);
+			bh->b_private = range;
+			set_buffer_tracked_read(bh);
+		}
+		spin_unlock_irqrestore(&sbi->s_tracked_reads_lock, flags);
+		if (range)
+			break;
+		new = kmalloc(sizeof(*new), GFP_NOFS);
+		if (!new)
+			return -ENOMEM;
+	}
+	/* range was found without allocating a new one */
+	kfree(new);
+	return 0;
+}
+
+/*
+ * cancel buffer tracked read
+ * called for tracked read that was started but was not submitted
+ * clear the block pending bit in the tracked read range
+ * and clear buffer tracked read flag
+ */
+void cancel_buffer_tracked_read(struct buffer_head *bh)
+{
+	BUG_ON(!buffer_tracked_read(bh));
+	BUG_ON(!buffer_mapped(bh));
+
+	put_tracked_read_range(bh);
+	clear_buffer_tracked_read(bh);
+	clear_buffer_mapped(bh);
+}
+
+/*
+ * prepare buffer tracked read
+ * the tracked read range was registered by start_buffer_tracked_read()
+ */
+static void prepare_buffer_tracked_read(struct buffer_head *bh)
+{
+	BUG_ON(!buffer_tracked_read(bh));
+	BUG_ON(!buffer_mapped(bh));
+	BUG_ON(!bh->b_private);
+#ifndef CONFIG_EXT4_FS_SNAPSHOT_FILE_SUBPAGE
+	/* tracked read doesn't work with multiple buffers per page */
+	BUG_ON(bh->b_this_page != bh);
+#endif
+}
+
+/*
+ * submit buffer tracked read
+ */
+static int submit_buffer_tracked_read(struct buffer_head *bh)
+{
+	prepare_buffer_tracked_read(bh);
+	submit_bh(READ, bh);
+	return 0;
+}
+
+/*
+ * end buffer tracked read
+ * complete submitted tracked read
+ */
+static void end_buffer_tracked_read(struct buffer_head *bh)
+{
+	BUG_ON(!buffer_tracked_read(bh));
+	/*
+	 * clear the buffer mapping to make sure
+	 * that get_block() will always be called
+	 */
+	clear_buffer_mapped(bh);
+	clear_buffer_tracked_read(bh);
+	put_tracked_read_range(bh);
+}
+#else
 /*
  * start buffer tracked read
  * called from inside get_block()
@@ -158,11 +377,19 @@ void cancel_buffer_tracked_read(struct buffer_head *bh)
 	put_bh(bdev_bh);
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READAHEAD
+/*
+ * prepare buffer tracked read
+ * save a reference to buffer cache entry before submitting I/O
+ */
+static void prepare_buffer_tracked_read(struct buffer_head *bh)
+#else
 /*
  * submit buffer tracked read
  * save a reference to buffer cache entry and submit I/O
  */
 static int submit_buffer_tracked_read(struct buffer_head *bh)
+#endif
 {
 	struct buffer_head *bdev_bh;
 	BUG_ON(!buffer_tracked_read(bh));
@@ -180,9 +407,24 @@ static int submit_buffer_tracked_read(struct buffer_head *bh)
 	ext4_trace_bh_count(bdev_bh);
 	/* override page buffers list with reference to buffer cache entry */
 	bh->b_this_page = bdev_bh;
+#ifndef CONFIG_EXT4_FS_SNAPSHOT_FILE_READAHEAD
+	submit_bh(READ, bh);
+	return 0;
+#endif
+}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READAHEAD
+/*
+ * submit buffer tracked read
+ * save a reference to buffer cache entry and submit I/O
+ */
+static int submit_buffer_tracked_read(struct buffer_head *bh)
+{
+	prepare_buffer_tracked_read(bh);
 	submit_bh(READ, bh);
 	return 0;
 }
+#endif
 
 /*
  * end buffer tracked read
@@ -204,6 +446,7 @@ static void end_buffer_tracked_read(struct buffer_head *bh)
 	put_bh_tracked_reader(bdev_bh);
 	put_bh(bdev_bh);
 }
+#endif
 
 #endif
 /*
@@ -387,8 +630,16 @@ int ext4_read_full_page(struct page *page, get_block_t *get_block)
 	for (i = 0; i < nr; i++) {
 		bh = arr[i];
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_READ
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_SUBPAGE
+		/* submit the tracked reads of all the page buffers */
+		if (buffer_tracked_read(bh)) {
+			submit_buffer_tracked_read(bh);
+			continue;
+		}
+#else
 		if (buffer_tracked_read(bh))
 			return submit_buffer_tracked_read(bh);
+#endif
 #endif
 		if (buffer_uptodate(bh))
 			end_buffer_async_read(bh, 1);
@@ -397,3 +648,213 @@ int ext4_read_full_page(struct page *page, get_block_t *get_block)
 	}
 	return 0;
 }
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READAHEAD
+
+/*
+ * I/O completion handler for ext4_read_full_pages() - complete every
+ * page buffer in the bio, like end_io of a submitted buffer head would.
+ */
+static void end_bio_async_read(struct bio *bio, int err)
+{
+	const int uptodate = test_bit(BIO_UPTODATE, &bio->bi_flags);
+	struct bio_vec *bvec = bio->bi_io_vec + bio->bi_vcnt - 1;
+
+	do {
+		/* one buffer per page (the page buffers list may be overridden) */
+		struct buffer_head *bh = page_buffers(bvec->bv_page);
+
+		if (--bvec >= bio->bi_io_vec)
+			prefetchw(&bvec->bv_page->flags);
+		bh->b_end_io(bh, uptodate);
+	} while (bvec >= bio->bi_io_vec);
+	bio_put(bio);
+}
+
+static struct bio *ext4_read_bio_alloc(struct buffer_head *bh,
+				       unsigned nr_pages)
+{
+	struct bio *bio;
+
+	nr_pages = min_t(unsigned, nr_pages, bio_get_nr_vecs(bh->b_bdev));
+	bio = bio_alloc(GFP_NOFS, max_t(unsigned, nr_pages, 1));
+	bio->bi_sector = bh->b_blocknr * (bh->b_size >> 9);
+	bio->bi_bdev = bh->b_bdev;
+	bio->bi_end_io = end_bio_async_read;
+	return bio;
+}
+
+/*
+ * Map the single buffer of a new page with get_block().
+ * Returns the buffer locked for async read, or NULL if the page
+ * was completed without I/O.
+ */
+static struct buffer_head *ext4_read_map_page(struct page *page,
+					      get_block_t *get_block)
+{
+	struct inode *inode = page->mapping->host;
+	sector_t iblock, lblock;
+	struct buffer_head *bh;
+	unsigned int blocksize;
+	int err = 0;
+
+	blocksize = 1 << inode->i_blkbits;
+	create_empty_buffers(page, blocksize, 0);
+	bh = page_buffers(page);
+
+	iblock = (sector_t)page->index;
+	lblock = (i_size_read(inode)+blocksize-1) >> inode->i_blkbits;
+	if (iblock < lblock) {
+		err = get_block(inode, iblock, bh, 0);
+		if (err)
+			SetPageError(page);
+	}
+	if (!buffer_mapped(bh)) {
+		zero_user(page, 0, blocksize);
+		if (!err)
+			set_buffer_uptodate(bh);
+	}
+	/* get_block() might have updated the buffer synchronously */
+	if (!buffer_mapped(bh) || buffer_uptodate(bh)) {
+		if (!PageError(page))
+			SetPageUptodate(page);
+		unlock_page(page);
+		return NULL;
+	}
+
+	lock_buffer(bh);
+	mark_buffer_async_read(bh);
+	/*
+	 * Check for uptodateness inside the buffer lock in case another
+	 * process reading the underlying blockdev brought it uptodate.
+	 */
+	if (!buffer_tracked_read(bh) && buffer_uptodate(bh)) {
+		end_buffer_async_read(bh, 1);
+		return NULL;
+	}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_READ
+	if (buffer_tracked_read(bh))
+		prepare_buffer_tracked_read(bh);
+#endif
+	return bh;
+}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READAHEAD_SORT
+static int ext4_read_bh_cmp(const void *a, const void *b)
+{
+	sector_t x = (*(struct buffer_head **)a)->b_blocknr;
+	sector_t y = (*(struct buffer_head **)b)->b_blocknr;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Read the mapped page buffers of a read ahead window in disk order.
+ * Snapshot blocks of subsequent pages are scattered between snapshot
+ * copies, older snapshots and read through blocks, so physically
+ * subsequent blocks are often not logically subsequent.
+ */
+static void ext4_read_sorted_bhs(struct buffer_head **bhs, unsigned nr_bhs)
+{
+	struct bio *bio = NULL;
+	sector_t next_block = 0;
+	unsigned i;
+
+	sort(bhs, nr_bhs, sizeof(*bhs), ext4_read_bh_cmp, NULL);
+	for (i = 0; i < nr_bhs; i++) {
+		struct buffer_head *bh = bhs[i];
+
+		if (bio && (bh->b_blocknr != next_block ||
+			    bh->b_bdev != bio->bi_bdev ||
+			    !bio_add_page(bio, bh->b_page, bh->b_size, 0))) {
+			submit_bio(READ, bio);
+			bio = NULL;
+		}
+		if (!bio) {
+			bio = ext4_read_bio_alloc(bh, nr_bhs - i);
+			if (!bio_add_page(bio, bh->b_page, bh->b_size, 0))
+				BUG();
+		}
+		next_block = bh->b_blocknr + 1;
+	}
+	if (bio)
+		submit_bio(READ, bio);
+}
+
+#endif
+/*
+ * Read ahead function for snapshot files, based on mpage_readpages().
+ * Each page has a single buffer head (block size == page size), which is
+ * mapped by get_block() and completed by end_buffer_async_read(), exactly
+ * like in ext4_read_full_page(), so tracked reads are preserved.
+ * Buffers of physically subsequent blocks are read with a single bio.
+ * Pages of file systems with block size < page size are read one by one.
+ */
+int ext4_read_full_pages(struct address_space *mapping,
+		struct list_head *pages, unsigned nr_pages,
+		get_block_t *get_block)
+{
+	struct inode *inode = mapping->host;
+	struct bio *bio = NULL;
+	sector_t next_block = 0;
+	unsigned page_idx;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READAHEAD_SORT
+	struct buffer_head **bhs;
+	unsigned nr_bhs = 0;
+
+	/* map the whole window first and then read it in disk order */
+	bhs = kmalloc(nr_pages * sizeof(*bhs), GFP_NOFS);
+#endif
+
+	for (page_idx = 0; page_idx < nr_pages; page_idx++) {
+		struct page *page = list_entry(pages->prev, struct page, lru);
+		struct buffer_head *bh;
+
+		prefetchw(&page->flags);
+		list_del(&page->lru);
+		if (add_to_page_cache_lru(page, mapping,
+					  page->index, GFP_KERNEL))
+			goto next_page;
+
+		if (inode->i_blkbits != PAGE_CACHE_SHIFT ||
+		    page_has_buffers(page)) {
+			ext4_read_full_page(page, get_block);
+			goto next_page;
+		}
+
+		bh = ext4_read_map_page(page, get_block);
+		if (!bh)
+			goto next_page;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READAHEAD_SORT
+		if (bhs) {
+			bhs[nr_bhs++] = bh;
+			goto next_page;
+		}
+#endif
+
+		if (bio && (bh->b_blocknr != next_block ||
+			    bh->b_bdev != bio->bi_bdev ||
+			    !bio_add_page(bio, page, bh->b_size, 0))) {
+			submit_bio(READ, bio);
+			bio = NULL;
+		}
+		if (!bio) {
+			bio = ext4_read_bio_alloc(bh, nr_pages - page_idx);
+			if (!bio_add_page(bio, page, bh->b_size, 0))
+				BUG();
+		}
+		next_block = bh->b_blocknr + 1;
+next_page:
+		page_cache_release(page);
+	}
+	BUG_ON(!list_empty(pages));
+	if (bio)
+		submit_bio(READ, bio);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READAHEAD_SORT
+	if (bhs) {
+		ext4_read_sorted_bhs(bhs, nr_bhs);
+		kfree(bhs);
+	}
+#endif
+	return 0;
+}
+#endif
@@ -13,8 +13,36 @@
  */
 
 #include <linux/statfs.h>
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_GROUP_STATS
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREBUILD
+#include <linux/kthread.h>
+#include <linux/backing-dev.h>
+#endif
 #include "ext4_jbd2.h"
 #include "snapshot.h"
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS
+#include <trace/events/ext4.h>
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+#include "ext4_extents.h"
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_SEND
+#include <linux/file.h>
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_REVERT
+#include <linux/sort.h>
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_ASYNC
+#include <linux/eventfd.h>
+#include <linux/mount.h>
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_SCHED
+#include <linux/namei.h>
+#include <linux/random.h>
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE
 
 /*
@@ -49,6 +77,14 @@
  * fields on that struct (i.e. h_cowing, h_cow_*).
  */
 
+#ifdef EXT4_SNAPSHOT_ACTIVE_KEY
+/*
+ * ext4_snapshot_active_key is enabled while any mounted file system has an
+ * active snapshot (see ext4_snapshot_hooks_off()).
+ */
+struct jump_label_key ext4_snapshot_active_key = JUMP_LABEL_INIT;
+
+#endif
 /*
  * ext4_snapshot_set_active - set the current active snapshot
  * First, if current active snapshot exists, it is deactivated.
@@ -76,6 +112,9 @@ static int ext4_snapshot_set_active(struct super_block *sb,
 	/* point of no return - replace old with new snapshot */
 	if (old) {
 		ext4_clear_inode_snapstate(old, EXT4_SNAPSTATE_ACTIVE);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_WB_PRIO
+		old->i_flags &= ~S_WB_PRIO;
+#endif
 		snapshot_debug(1, "snapshot (%u) deactivated\n",
 			       old->i_generation);
 		/* remove old active snapshot reference */
@@ -106,10 +145,23 @@ static int ext4_snapshot_set_active(struct super_block *sb,
 		/* ACTIVE implies LIST */
 		ext4_set_inode_snapstate(inode, EXT4_SNAPSTATE_LIST);
 		ext4_set_inode_snapstate(inode, EXT4_SNAPSTATE_ACTIVE);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_WB_PRIO
+		/* COW copies in its page cache are ordered data of commits */
+		inode->i_flags |= S_WB_PRIO;
+#endif
 		snapshot_debug(1, "snapshot (%u) activated\n",
 			       inode->i_generation);
 	}
+#ifdef EXT4_SNAPSHOT_ACTIVE_KEY
+	/* no transaction handles exist, so flipping the hooks is safe */
+	if (!old)
+		jump_label_inc(&ext4_snapshot_active_key);
+	EXT4_SB(sb)->s_active_snapshot = inode;
+	if (!inode)
+		jump_label_dec(&ext4_snapshot_active_key);
+#else
 	EXT4_SB(sb)->s_active_snapshot = inode;
+#endif
 
 	return 0;
 }
@@ -126,16 +178,467 @@ static void ext4_snapshot_reset_bitmap_cache(struct super_block *sb)
 {
 	struct ext4_group_info *grp;
 	int i;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_GROUP_STATS
+	int j;
+#endif
 
 	for (i = 0; i < EXT4_SB(sb)->s_groups_count; i++) {
 		grp = ext4_get_group_info(sb, i);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREBUILD
+		/* remember which groups were COWed by the previous snapshot */
+		if (grp->bg_cow_bitmap)
+			set_bit(EXT4_GROUP_INFO_COW_ACTIVE_BIT, &grp->bb_state);
+		else
+			clear_bit(EXT4_GROUP_INFO_COW_ACTIVE_BIT,
+				  &grp->bb_state);
+#endif
 		grp->bg_cow_bitmap = 0;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_EXTENTS
+		grp->bg_cow_nr_extents = EXT4_COW_EXTENTS_UNKNOWN;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_MAP
+		/* nothing is mapped in the new active snapshot yet */
+		ext4_snapshot_cow_map_free(sb, i);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_GROUP_STATS
+		/* count the events of the new snapshot */
+		for (j = 0; j < EXT4_SNAPSHOT_GROUP_STATS; j++)
+			atomic_set(&grp->bg_snapshot_stats[j], 0);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_CACHE
+		/* unpin exclude bitmaps of groups that are no longer hot */
+		ext4_put_exclude_bitmap(sb, i);
+#endif
 		cond_resched();
 	}
 }
 #else
 #define ext4_snapshot_reset_bitmap_cache(sb, init) 0
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREBUILD
+/*
+ * COW bitmap prebuild thread
+ *
+ * After snapshot take, the COW bitmap of a block group is created by the
+ * first task to COW a block in that group.  The prebuild thread creates
+ * the COW bitmaps in the background, so foreground writers find them
+ * ready in the COW bitmap cache.  Groups that were COWed during the
+ * lifetime of the previous snapshot are likely to be written to soon,
+ * so they are prebuilt first.
+ */
+
+/* sleep time after creating a COW bitmap */
+#define EXT4_SNAPSHOT_PREBUILD_DELAY_MSEC	10
+
+/*
+ * Create the COW bitmap of @block_group in its own transaction.
+ * Returns 1 if COW bitmap was created, 0 if skipped and < 0 on error.
+ */
+static int ext4_snapshot_prebuild_group(struct super_block *sb,
+		struct inode *snapshot, ext4_group_t block_group)
+{
+	handle_t *handle;
+	int err, ret;
+
+	handle = ext4_journal_start_sb(sb, 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	err = ext4_snapshot_prebuild_cow_bitmap(handle, snapshot, block_group);
+	ret = ext4_journal_stop(handle);
+	if (err >= 0 && ret)
+		err = ret;
+	return err;
+}
+
+/*
+ * Don't compete with foreground I/O - back off while the block device
+ * is congested and then sleep a while.
+ */
+static void ext4_snapshot_prebuild_throttle(struct super_block *sb)
+{
+	while (!kthread_should_stop() &&
+	       (bdi_read_congested(sb->s_bdi) ||
+		bdi_write_congested(sb->s_bdi)))
+		congestion_wait(BLK_RW_ASYNC, HZ/10);
+
+	if (!kthread_should_stop())
+		schedule_timeout_interruptible(
+			msecs_to_jiffies(EXT4_SNAPSHOT_PREBUILD_DELAY_MSEC));
+}
+
+/*
+ * The active snapshot cannot change while the thread is running, because
+ * the thread is stopped before the active snapshot is changed.
+ */
+static int ext4_snapshot_prebuild_thread(void *data)
+{
+	struct super_block *sb = data;
+	struct inode *snapshot = ext4_snapshot_has_active(sb);
+	ext4_group_t ngroups = ext4_get_groups_count(sb);
+	ext4_group_t i;
+	int active, pass, err = 0, nbuilt = 0;
+
+	/* don't compete with foreground I/O */
+	ext4_snapshot_set_bg_ioprio();
+	/* pass 0 - previously COWed groups, pass 1 - the rest of the groups */
+	for (pass = 0; snapshot && pass < 2; pass++) {
+		for (i = 0; i < ngroups; i++) {
+			if (kthread_should_stop())
+				goto out;
+			active = test_bit(EXT4_GROUP_INFO_COW_ACTIVE_BIT,
+				&ext4_get_group_info(sb, i)->bb_state);
+			if (pass ? active : !active)
+				continue;
+
+			err = ext4_snapshot_prebuild_group(sb, snapshot, i);
+			if (err < 0)
+				goto out;
+			if (err > 0) {
+				nbuilt++;
+				ext4_snapshot_prebuild_throttle(sb);
+			}
+			cond_resched();
+		}
+	}
+out:
+	snapshot_debug(1, "%d COW bitmaps of snapshot (%u) prebuilt "
+			"(err=%d)\n", nbuilt,
+			snapshot ? snapshot->i_generation : 0, err);
+
+	/* wait for ext4_snapshot_stop_prebuild() */
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+	return 0;
+}
+
+/*
+ * Start the COW bitmap prebuild thread.
+ * Called from snapshot_take() under snapshot_mutex.
+ * Failure to start the thread is not an error.
+ */
+static void ext4_snapshot_start_prebuild(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct task_struct *task;
+
+#ifdef CONFIG_EXT4_DEBUG
+	if (!cow_bitmap_prebuild_enabled)
+		return;
+#endif
+	if (sbi->s_snapshot_prebuild || !ext4_snapshot_has_active(sb))
+		return;
+
+	task = kthread_run(ext4_snapshot_prebuild_thread, sb,
+			   "ext4-snapbm/%s", sb->s_id);
+	if (IS_ERR(task)) {
+		snapshot_debug(1, "failed to start COW bitmap prebuild "
+				"thread (err=%ld)\n", PTR_ERR(task));
+		return;
+	}
+	sbi->s_snapshot_prebuild = task;
+}
+
+/*
+ * Stop the COW bitmap prebuild thread.
+ * Called before changing the active snapshot under snapshot_mutex
+ * and before freeze_super(), because the thread may be waiting for
+ * a journal handle, or from snapshot_destroy() on umount.
+ */
+static void ext4_snapshot_stop_prebuild(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	if (!sbi->s_snapshot_prebuild)
+		return;
+
+	kthread_stop(sbi->s_snapshot_prebuild);
+	sbi->s_snapshot_prebuild = NULL;
+}
+#else
+#define ext4_snapshot_start_prebuild(sb)
+#define ext4_snapshot_stop_prebuild(sb)
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC
+/*
+ * Snapshot cleanup thread
+ *
+ * Snapshot delete marks the snapshot deleted and wakes up the cleanup
+ * thread, which shrinks, merges and removes the deleted snapshots.
+ * The cleanup runs under snapshot_mutex, but the parallel shrink and merge
+ * jobs of the cleanup thread stop when a snapshot control task is waiting
+ * for snapshot_mutex or on umount, and the thread resumes the cleanup after
+ * the waiters have released the mutex.
+ */
+
+/* sleep time after yielding snapshot_mutex */
+#define EXT4_SNAPSHOT_CLEANUP_YIELD_MSEC	100
+/* interval for checking if the parallel jobs should yield */
+#define SNAPSHOT_CLEANUP_POLL			(HZ/10)
+
+static inline int ext4_snapshot_in_cleanup(struct super_block *sb)
+{
+	return current == EXT4_SB(sb)->s_snapshot_cleanup;
+}
+
+/*
+ * Returns true if the cleanup pass of the cleanup thread should stop,
+ * because a snapshot control task is waiting for snapshot_mutex or because
+ * the thread is being stopped.
+ */
+static int ext4_snapshot_cleanup_yield(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	if (!ext4_snapshot_in_cleanup(sb))
+		return 0;
+	if (!atomic_read(&sbi->s_snapshot_mutex_waiters) &&
+	    !kthread_should_stop())
+		return 0;
+	set_bit(SNAPSHOT_CLEANUP_YIELDED, &sbi->s_snapshot_cleanup_state);
+	return 1;
+}
+
+/*
+ * Don't compete with foreground I/O - stop the transaction handle while the
+ * block device is congested, so the cleanup doesn't hold back the running
+ * transaction, and restart the handle after backing off.
+ * Returns 0 on success and <0 on error (with *@handle set to NULL).
+ */
+static int ext4_snapshot_cleanup_throttle(handle_t **handle,
+		struct inode *inode)
+{
+	struct backing_dev_info *bdi = inode->i_sb->s_bdi;
+	int err;
+
+	if (!bdi_read_congested(bdi) && !bdi_write_congested(bdi))
+		return 0;
+
+	err = ext4_journal_stop(*handle);
+	*handle = NULL;
+	if (err)
+		return err;
+
+	congestion_wait(BLK_RW_ASYNC, HZ/10);
+
+	*handle = ext4_journal_start(inode, EXT4_MAX_TRANS_DATA);
+	if (IS_ERR(*handle)) {
+		err = PTR_ERR(*handle);
+		*handle = NULL;
+	}
+	return err;
+}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_EVICT
+/*
+ * ext4_snapshot_evict - evict snapshots while free space is low
+ *
+ * While free space is below the eviction watermark, mark the oldest
+ * snapshot which is not enabled nor in use by an enabled snapshot as
+ * deleted and run a cleanup pass to shrink and remove it.  The active
+ * snapshot is the newest, so it is evicted last.  Every eviction is
+ * logged, because it discards a snapshot the admin did not delete.
+ * Called from the cleanup thread under snapshot_mutex.
+ * Returns 0 on success and <0 on error.
+ */
+static int ext4_snapshot_evict(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_inode_info *ei;
+	struct inode *inode;
+	handle_t *handle;
+	s64 free_blocks;
+	int err = 0;
+
+	while (!ext4_snapshot_cleanup_yield(sb)) {
+		free_blocks =
+			percpu_counter_sum_positive(&sbi->s_freeblocks_counter) -
+			percpu_counter_sum_positive(&sbi->s_dirtyblocks_counter);
+		if (!ext4_snapshot_evict_needed(sbi, free_blocks))
+			break;
+
+		/* find the oldest snapshot that may be evicted */
+		inode = NULL;
+		list_for_each_entry_reverse(ei, &sbi->s_snapshot_list,
+					    i_snaplist) {
+			if (ext4_test_inode_flag(&ei->vfs_inode,
+					EXT4_INODE_SNAPFILE_DELETED) ||
+			    ext4_test_inode_snapstate(&ei->vfs_inode,
+					EXT4_SNAPSTATE_ENABLED) ||
+			    ext4_test_inode_snapstate(&ei->vfs_inode,
+					EXT4_SNAPSTATE_INUSE))
+				continue;
+			inode = &ei->vfs_inode;
+			break;
+		}
+		if (!inode) {
+			snapshot_debug(1, "no snapshot to evict with %lld "
+				       "free blocks\n", free_blocks);
+			break;
+		}
+
+		handle = ext4_journal_start(inode, 1);
+		if (IS_ERR(handle)) {
+			err = PTR_ERR(handle);
+			break;
+		}
+		ext4_set_inode_flag(inode, EXT4_INODE_SNAPFILE_DELETED);
+		err = ext4_mark_inode_dirty(handle, inode);
+		ext4_journal_stop(handle);
+		if (err)
+			break;
+
+		sbi->s_snapshot_evictions++;
+		ext4_msg(sb, KERN_WARNING, "evicted snapshot (%u) with %lld "
+			 "free blocks below %u%% watermark",
+			 inode->i_generation, free_blocks,
+			 sbi->s_snapshot_evict_ratio);
+
+		/* shrink and remove the evicted snapshot */
+		err = ext4_snapshot_update(sb, 1, 0);
+		if (err)
+			break;
+	}
+	/* don't let allocations wake us up again right away */
+	sbi->s_snapshot_evict_next = jiffies + EXT4_SNAPSHOT_EVICT_INTERVAL;
+	return err;
+}
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_COMPACT
+static int ext4_snapshot_compact(struct super_block *sb);
+#endif
+static int ext4_snapshot_cleanup_thread(void *data)
+{
+	struct super_block *sb = data;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	unsigned long *state = &sbi->s_snapshot_cleanup_state;
+	int err;
+
+	/* don't compete with foreground I/O */
+	ext4_snapshot_set_bg_ioprio();
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_EVICT
+		if ((!test_bit(SNAPSHOT_CLEANUP_PENDING, state) &&
+		     !test_bit(SNAPSHOT_CLEANUP_EVICT, state)) ||
+		    (sb->s_flags & MS_RDONLY)) {
+#else
+		if (!test_bit(SNAPSHOT_CLEANUP_PENDING, state) ||
+		    (sb->s_flags & MS_RDONLY)) {
+#endif
+			/* wait for ext4_snapshot_wake_cleanup() */
+			if (!kthread_should_stop())
+				schedule();
+			__set_current_state(TASK_RUNNING);
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+		clear_bit(SNAPSHOT_CLEANUP_PENDING, state);
+		clear_bit(SNAPSHOT_CLEANUP_YIELDED, state);
+
+		__ext4_snapshot_mutex_lock(sb);
+		set_bit(SNAPSHOT_CLEANUP_RUNNING, state);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_EVICT
+		err = 0;
+		if (test_and_clear_bit(SNAPSHOT_CLEANUP_EVICT, state))
+			err = ext4_snapshot_evict(sb);
+		if (!err)
+			err = ext4_snapshot_update(sb, 1, 0);
+#else
+		err = ext4_snapshot_update(sb, 1, 0);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_COMPACT
+		if (!err)
+			err = ext4_snapshot_compact(sb);
+#endif
+		clear_bit(SNAPSHOT_CLEANUP_RUNNING, state);
+		ext4_snapshot_mutex_unlock(sb);
+		sbi->s_snapshot_cleanup_err = err;
+
+		if (test_bit(SNAPSHOT_CLEANUP_YIELDED, state)) {
+			/* resume cleanup after the mutex waiters are done */
+			set_bit(SNAPSHOT_CLEANUP_PENDING, state);
+			schedule_timeout_interruptible(msecs_to_jiffies(
+					EXT4_SNAPSHOT_CLEANUP_YIELD_MSEC));
+			continue;
+		}
+		sbi->s_snapshot_cleanup_passes++;
+		snapshot_debug(1, "snapshot cleanup pass (%u) completed "
+			       "(err=%d)\n", sbi->s_snapshot_cleanup_passes,
+			       err);
+	}
+	return 0;
+}
+
+/*
+ * Start the snapshot cleanup thread with a pending cleanup pass, to resume
+ * the cleanup of snapshots that were deleted before umount.
+ * Called from ext4_fill_super() after snapshot_load().
+ * Failure to start the thread is not an error - snapshots are cleaned up
+ * synchronously by snapshot delete.
+ */
+void ext4_snapshot_start_cleanup(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct task_struct *task;
+
+	if (sbi->s_snapshot_cleanup)
+		return;
+
+	task = kthread_create(ext4_snapshot_cleanup_thread, sb,
+			      "ext4-snapcl/%s", sb->s_id);
+	if (IS_ERR(task)) {
+		snapshot_debug(1, "failed to start snapshot cleanup "
+				"thread (err=%ld)\n", PTR_ERR(task));
+		return;
+	}
+	sbi->s_snapshot_cleanup = task;
+	set_bit(SNAPSHOT_CLEANUP_PENDING, &sbi->s_snapshot_cleanup_state);
+	wake_up_process(task);
+}
+
+/*
+ * Request a cleanup pass from the snapshot cleanup thread.
+ * Called from snapshot delete under snapshot_mutex and from ext4_remount().
+ * Returns 1 if the cleanup thread was woken up and 0 if it isn't running.
+ */
+int ext4_snapshot_wake_cleanup(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	if (!sbi->s_snapshot_cleanup)
+		return 0;
+
+	set_bit(SNAPSHOT_CLEANUP_PENDING, &sbi->s_snapshot_cleanup_state);
+	wake_up_process(sbi->s_snapshot_cleanup);
+	return 1;
+}
+
+/*
+ * Stop the snapshot cleanup thread.
+ * Called from ext4_put_super() before snapshot_destroy() and before sb_lock
+ * is taken, because the cleanup pass may be waiting for sb_lock.
+ * An interrupted cleanup pass is resumed on the next mount.
+ */
+void ext4_snapshot_stop_cleanup(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	if (!sbi->s_snapshot_cleanup)
+		return;
+
+	kthread_stop(sbi->s_snapshot_cleanup);
+	sbi->s_snapshot_cleanup = NULL;
+}
+#else
+#define SNAPSHOT_CLEANUP_POLL	HZ
+#define ext4_snapshot_cleanup_yield(sb)	(0)
+#endif
 
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST
 /*
@@ -181,8 +684,14 @@ static int ext4_inode_list_add(handle_t *handle, struct inode *inode,
 
 	/* Only add to the head of the in-memory list if all the
 	 * previous operations succeeded. */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_RCU
+	/* publish the inode to read through walks of the list */
+	if (!err)
+		list_add_rcu(&EXT4_I(inode)->i_orphan, s_list);
+#else
 	if (!err)
 		list_add(&EXT4_I(inode)->i_orphan, s_list);
+#endif
 
 	snapshot_debug(4, "last_%s will point to inode %lu\n",
 			name, inode->i_ino);
@@ -197,10 +706,20 @@ out_unlock:
 static int ext4_snapshot_list_add(handle_t *handle, struct inode *inode)
 {
 	struct ext4_sb_info *sbi = EXT4_SB(inode->i_sb);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_CACHE
+	int err;
+
+	err = ext4_inode_list_add(handle, inode, &NEXT_SNAPSHOT(inode),
+			&sbi->s_es->s_snapshot_list,
+			&sbi->s_snapshot_list, "snapshot");
+	ext4_snapshot_list_changed(inode->i_sb);
+	return err;
+#else
 
 	return ext4_inode_list_add(handle, inode, &NEXT_SNAPSHOT(inode),
 			&sbi->s_es->s_snapshot_list,
 			&sbi->s_snapshot_list, "snapshot");
+#endif
 }
 
 #define NEXT_INODE_OFFSET (((char *)inode)-((char *)i_next))
@@ -293,10 +812,20 @@ out_brelse:
 static int ext4_snapshot_list_del(handle_t *handle, struct inode *inode)
 {
 	struct ext4_sb_info *sbi = EXT4_SB(inode->i_sb);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_CACHE
+	int err;
+
+	err = ext4_inode_list_del(handle, inode, &NEXT_SNAPSHOT(inode),
+			&sbi->s_es->s_snapshot_list,
+			&sbi->s_snapshot_list, "snapshot");
+	ext4_snapshot_list_changed(inode->i_sb);
+	return err;
+#else
 
 	return ext4_inode_list_del(handle, inode, &NEXT_SNAPSHOT(inode),
 			&sbi->s_es->s_snapshot_list,
 			&sbi->s_snapshot_list, "snapshot");
+#endif
 }
 
 
@@ -523,6 +1052,57 @@ static inline int ext4_snapshot_preallocate(handle_t *handle,
 	brelse(bh);
 	return err;
 }
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREALLOC
+/*
+ * ext4_snapshot_preallocate_ind - Pre-allocates the indirect blocks that map
+ * the block groups which were COWed during the lifetime of the active
+ * snapshot, so the first COWs after take do not allocate and journal them.
+ * The indirect blocks are allocated with contiguous goals, so the map of
+ * the new snapshot is laid out sequentially.
+ * helper function for snapshot_create().
+ */
+static int ext4_snapshot_preallocate_ind(handle_t *handle,
+		struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	ext4_group_t group, ngroups = ext4_get_groups_count(sb);
+	unsigned int max = sbi->s_snapshot_prealloc_groups, n = 0;
+	ext4_fsblk_t blk, end, goal = 0;
+	int nind = 0, err = 0;
+
+	for (group = 0; group < ngroups && n < max; group++) {
+		/* COW bitmap was created - group was written to recently */
+		if (!ext4_get_group_info(sb, group)->bg_cow_bitmap)
+			continue;
+		n++;
+		blk = ext4_group_first_block_no(sb, group);
+		end = min_t(ext4_fsblk_t, ext4_blocks_count(sbi->s_es),
+			    blk + EXT4_BLOCKS_PER_GROUP(sb));
+		for (; blk < end; blk += SNAPSHOT_ADDR_PER_BLOCK) {
+			err = extend_or_restart_transaction_inode(handle,
+					inode, EXT4_DATA_TRANS_BLOCKS(sb));
+			if (err)
+				goto out;
+			err = ext4_snapshot_map_ind(handle, inode,
+					SNAPSHOT_IBLOCK(blk), &goal);
+			if (err < 0)
+				goto out;
+			nind += err;
+			cond_resched();
+		}
+	}
+	err = 0;
+out:
+	snapshot_debug(2, "pre-allocated %d indirect blocks of %u groups "
+		       "for snapshot (%u) (err=%d)\n", nind, n,
+		       inode->i_generation, err);
+	/* running out of space for preallocation is not an error */
+	return err == -ENOSPC ? 0 : err;
+}
+
+#endif
 #endif
 
 static ext4_fsblk_t ext4_get_inode_block(struct super_block *sb,
@@ -571,6 +1151,10 @@ static int ext4_snapshot_create(struct inode *inode)
 	int i, err, ret;
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_INIT
 	int count, ntind;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_META_BG
+	ext4_fsblk_t block;
+	int n;
+#endif
 	const long double_blocks = (1 << (2 * SNAPSHOT_ADDR_PER_BLOCK_BITS));
 	struct ext4_group_desc *desc;
 	unsigned long ino;
@@ -710,6 +1294,14 @@ static int ext4_snapshot_create(struct inode *inode)
 				ntind, inode->i_generation);
 		goto out_handle;
 	}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREALLOC
+	/* COW bitmaps of the active snapshot tell which groups are hot */
+	if (active_snapshot) {
+		err = ext4_snapshot_preallocate_ind(handle, inode);
+		if (err)
+			goto out_handle;
+	}
+#endif
 
 	/* allocate super block and group descriptors for snapshot */
 	count = sbi->s_gdb_count + 1;
@@ -719,8 +1311,24 @@ static int ext4_snapshot_create(struct inode *inode)
 				EXT4_DATA_TRANS_BLOCKS(sb));
 		if (err)
 			goto out_handle;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_META_BG
+		/*
+		 * with meta_bg, group descriptor blocks are not stored right
+		 * after the super block, so map each run of contiguous blocks
+		 * at its location.
+		 */
+		block = i ? sbi->s_group_desc[i - 1]->b_blocknr :
+			sbi->s_sbh->b_blocknr;
+		for (n = 1; i + n < count; n++)
+			if (sbi->s_group_desc[i + n - 1]->b_blocknr !=
+					block + n)
+				break;
+		err = ext4_snapshot_map_blocks(handle, inode, block, n,
+						NULL, SNAPMAP_WRITE);
+#else
 		err = ext4_snapshot_map_blocks(handle, inode, i, count - i,
 						NULL, SNAPMAP_WRITE);
+#endif
 	}
 	if (err <= 0) {
 		snapshot_debug(1, "failed to allocate super block and %d "
@@ -893,17 +1501,354 @@ static char *copy_inode_block_name[COPY_INODE_BLOCKS_NUM] = {
 	"inode bitmap",
 	"inode table"
 };
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_PREPARE
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_PREFETCH
+
+/* GDT blocks are followed by up to 4 blocks per inode */
+#define SNAPSHOT_PREFETCH_INODE_BLOCKS	(COPY_INODE_BLOCKS_NUM + 1)
+
+/*
+ * ext4_snapshot_take_prefetch_inode() - add the block numbers of the
+ * bitmap and inode table blocks of @inode to @blocks and the block number of
+ * the exclude bitmap to @exclude, without reading the blocks.
+ * Returns the inode table block number.
+ */
+static ext4_fsblk_t ext4_snapshot_take_prefetch_inode(struct inode *inode,
+		ext4_fsblk_t prev_inode_blk, ext4_fsblk_t *blocks, int *n,
+		ext4_fsblk_t *exclude, int *nexclude)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned long ipg = EXT4_INODES_PER_GROUP(sb);
+	ext4_group_t block_group = (inode->i_ino - 1) / ipg;
+	struct ext4_group_desc *desc;
+	ext4_fsblk_t inode_blk;
+
+	desc = ext4_get_group_desc(sb, block_group, NULL);
+	if (!desc)
+		return prev_inode_blk;
+	inode_blk = ext4_inode_table(sb, desc) +
+		((inode->i_ino - 1) % ipg) / EXT4_SB(sb)->s_inodes_per_block;
+	if (inode_blk == prev_inode_blk)
+		return inode_blk;
+
+	blocks[(*n)++] = ext4_block_bitmap(sb, desc);
+	blocks[(*n)++] = ext4_inode_bitmap(sb, desc);
+	blocks[(*n)++] = inode_blk;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
+	/* uninitialized exclude bitmap is not read from disk */
+	if (ext4_exclude_bitmap(sb, desc) &&
+	    !(desc->bg_flags & cpu_to_le16(EXT4_BG_EXCLUDE_UNINIT)))
+		exclude[(*nexclude)++] = ext4_exclude_bitmap(sb, desc);
 #endif
+	return inode_blk;
+}
 
 /*
- * ext4_snapshot_take() makes a new snapshot file
- * into the active snapshot
+ * ext4_snapshot_take_prepare() - prepare phase of snapshot take
+ * @snapshot:	new snapshot to prepare
  *
- * this function calls journal_lock_updates()
- * and should not be called during a journal transaction
- * Called from ext4_ioctl() under i_mutex and snapshot_mutex
+ * Find all the blocks that are copied to the new snapshot by
+ * ext4_snapshot_take() and submit their reads as one plugged batch
+ * of readahead.  Map the snapshot copies, while the reads are in flight,
+ * and wait for the reads to complete, so the commit phase under
+ * freeze_super() finds all blocks in the buffer cache and doesn't wait
+ * for I/O.  Failure is not an error - the commit phase reads and maps the
+ * blocks again.
+ * Called from ext4_snapshot_take() under snapshot_mutex before
+ * freeze_super().
  */
-int ext4_snapshot_take(struct inode *inode)
+static void ext4_snapshot_take_prepare(struct inode *snapshot)
+{
+	struct super_block *sb = snapshot->i_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST
+	struct list_head *l;
+#endif
+	struct buffer_head *bh;
+	struct blk_plug plug;
+	ext4_fsblk_t *blocks, *exclude, prev_inode_blk = 0;
+	int i, n = 0, nexclude = 0, ninodes = 1;
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_FIX
+	/* root inode and snapshot list */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST
+	list_for_each(l, &sbi->s_snapshot_list)
+		ninodes++;
+#else
+	ninodes++;
+#endif
+#endif
+	blocks = kmalloc((sbi->s_gdb_count +
+			  ninodes * SNAPSHOT_PREFETCH_INODE_BLOCKS) *
+			 sizeof(*blocks), GFP_NOFS);
+	if (!blocks)
+		return;
+	exclude = blocks + sbi->s_gdb_count + ninodes * COPY_INODE_BLOCKS_NUM;
+
+	for (i = 0; i < sbi->s_gdb_count; i++)
+		blocks[n++] = sbi->s_group_desc[i]->b_blocknr;
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_FIX
+	/* start with root inode and continue with snapshot list */
+	prev_inode_blk = ext4_snapshot_take_prefetch_inode(sb->s_root->d_inode,
+			prev_inode_blk, blocks, &n, exclude, &nexclude);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST
+	list_for_each(l, &sbi->s_snapshot_list)
+		prev_inode_blk = ext4_snapshot_take_prefetch_inode(
+				&list_entry(l, struct ext4_inode_info,
+					    i_snaplist)->vfs_inode,
+				prev_inode_blk, blocks, &n,
+				exclude, &nexclude);
+#else
+	ext4_snapshot_take_prefetch_inode(snapshot, prev_inode_blk,
+			blocks, &n, exclude, &nexclude);
+#endif
+#else
+	ext4_snapshot_take_prefetch_inode(snapshot, prev_inode_blk,
+			blocks, &n, exclude, &nexclude);
+#endif
+
+	/* submit all reads at once */
+	blk_start_plug(&plug);
+	for (i = 0; i < n; i++)
+		sb_breadahead(sb, blocks[i]);
+	for (i = 0; i < nexclude; i++)
+		sb_breadahead(sb, exclude[i]);
+	blk_finish_plug(&plug);
+
+	/* map the pre-allocated snapshot copies while reads are in flight */
+	for (i = 0; i < n; i++) {
+		int err;
+
+		bh = ext4_getblk(NULL, snapshot, SNAPSHOT_IBLOCK(blocks[i]),
+				SNAPMAP_READ, &err);
+		brelse(bh);
+		cond_resched();
+	}
+
+	/* wait for the reads to complete */
+	for (i = 0; i < n + nexclude; i++) {
+		bh = sb_find_get_block(sb, i < n ? blocks[i] :
+				       exclude[i - n]);
+		if (!bh)
+			continue;
+		wait_on_buffer(bh);
+		brelse(bh);
+	}
+
+	snapshot_debug(3, "snapshot (%u) take: prefetched %d blocks\n",
+		       snapshot->i_generation, n + nexclude);
+	kfree(blocks);
+}
+#else
+
+/*
+ * ext4_snapshot_take_prepare_block() - read block @blk and map its
+ * pre-allocated copy in @snapshot
+ */
+static void ext4_snapshot_take_prepare_block(struct inode *snapshot,
+		ext4_fsblk_t blk)
+{
+	struct buffer_head *bh, *sbh;
+	int err;
+
+	bh = sb_bread(snapshot->i_sb, blk);
+	sbh = ext4_getblk(NULL, snapshot, SNAPSHOT_IBLOCK(blk),
+			SNAPMAP_READ, &err);
+	brelse(sbh);
+	brelse(bh);
+}
+
+/*
+ * ext4_snapshot_take_prepare() - prepare phase of snapshot take
+ * @snapshot:	new snapshot to prepare
+ *
+ * Read the blocks that are copied to the new snapshot by
+ * ext4_snapshot_take() and map their snapshot copies, so the commit
+ * phase under freeze_super() finds them in the buffer cache and doesn't
+ * wait for I/O.  Failure is not an error - the commit phase reads and
+ * maps the blocks again.
+ * Called from ext4_snapshot_take() under snapshot_mutex before
+ * freeze_super().
+ */
+static void ext4_snapshot_take_prepare(struct inode *snapshot)
+{
+	struct super_block *sb = snapshot->i_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST
+	struct list_head *l = &sbi->s_snapshot_list;
+#endif
+	struct inode *curr_inode;
+	struct ext4_group_desc *desc;
+	struct ext4_iloc iloc;
+	ext4_fsblk_t prev_inode_blk = 0;
+	int i;
+
+	for (i = 0; i < sbi->s_gdb_count; i++)
+		ext4_snapshot_take_prepare_block(snapshot,
+				sbi->s_group_desc[i]->b_blocknr);
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_FIX
+	/* start with root inode and continue with snapshot list */
+	curr_inode = sb->s_root->d_inode;
+#else
+	curr_inode = snapshot;
+#endif
+	while (curr_inode) {
+		iloc.block_group = 0;
+		if (!ext4_get_inode_loc(curr_inode, &iloc)) {
+			desc = ext4_get_group_desc(sb, iloc.block_group, NULL);
+			if (desc && iloc.bh->b_blocknr != prev_inode_blk) {
+				prev_inode_blk = iloc.bh->b_blocknr;
+				ext4_snapshot_take_prepare_block(snapshot,
+						ext4_block_bitmap(sb, desc));
+				ext4_snapshot_take_prepare_block(snapshot,
+						ext4_inode_bitmap(sb, desc));
+				ext4_snapshot_take_prepare_block(snapshot,
+						iloc.bh->b_blocknr);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
+				brelse(ext4_read_exclude_bitmap(sb,
+						iloc.block_group));
+#endif
+			}
+			brelse(iloc.bh);
+		}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_FIX
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST
+		l = l->next;
+		curr_inode = (l == &sbi->s_snapshot_list) ? NULL :
+			&list_entry(l, struct ext4_inode_info,
+				    i_snaplist)->vfs_inode;
+#else
+		curr_inode = (curr_inode == snapshot) ? NULL : snapshot;
+#endif
+#else
+		curr_inode = NULL;
+#endif
+		cond_resched();
+	}
+}
+#endif
+#endif
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_TRACK
+#define AVG_DIR_RECORD_SIZE_BITS 6 /* 64 bytes */
+#define AVG_INODES_PER_DIR_BLOCK \
+	(SNAPSHOT_BLOCK_SIZE_BITS - AVG_DIR_RECORD_SIZE_BITS)
+
+/*
+ * ext4_snapshot_meta_blocks_estimate() - estimate the metadata blocks in use
+ * Used to initialize the metadata blocks counter on mount, which is then
+ * updated by block allocation and free.  Estimate is based on:
+ * 1 indirect block per 1K blocks in use
+ * +1 directory block per directory
+ * +1 directory block per X inodes in use (avg. dir record size of 64 bytes)
+ * Called from ext4_fill_super() after the free blocks and inodes counters
+ * have been initialized.
+ */
+s64 ext4_snapshot_meta_blocks_estimate(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	s64 used_blocks = ext4_blocks_count(sbi->s_es) -
+		percpu_counter_sum_positive(&sbi->s_freeblocks_counter);
+	s64 used_inodes = le32_to_cpu(sbi->s_es->s_inodes_count) -
+		percpu_counter_sum_positive(&sbi->s_freeinodes_counter);
+
+	return (max_t(s64, used_blocks, 0) >> SNAPSHOT_ADDR_PER_BLOCK_BITS) +
+		percpu_counter_sum_positive(&sbi->s_dirs_counter) +
+		(max_t(s64, used_inodes, 0) >> AVG_INODES_PER_DIR_BLOCK);
+}
+
+/*
+ * ext4_snapshot_reserve_blocks() - calculate the snapshot reserve in O(1)
+ * Maximum disk space for snapshot file future use is:
+ * +1 data block per fs metadata block in use (to copy metadata blocks)
+ * +1 data block per group bitmaps and inode table block (to copy them)
+ * +1 data block per group descriptors block (to copy GDT)
+ * +1 indirect block per 1K fs blocks (to map moved and copied blocks)
+ * +1 double indirect block per 1M fs blocks (to map the indirect blocks)
+ * Metadata blocks that are allocated after take are not copied to the
+ * snapshot, so the reserve is an upper bound for the snapshot lifetime.
+ *
+ * Journaled data blocks are also COWed, but the copies are charged to
+ * the free space outside of the reserve, like move-on-write allocations.
+ */
+static u64 ext4_snapshot_reserve_blocks(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	u64 blocks_count = ext4_blocks_count(sbi->s_es);
+
+	return percpu_counter_read_positive(&sbi->s_meta_blocks_counter) +
+		(u64)ext4_get_groups_count(sb) * (2 + sbi->s_itb_per_group) +
+		sbi->s_gdb_count +
+		(blocks_count >> SNAPSHOT_ADDR_PER_BLOCK_BITS) +
+		(blocks_count >> (2 * SNAPSHOT_ADDR_PER_BLOCK_BITS)) + 1;
+}
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_JOURNAL_FREEZE
+/*
+ * ext4_snapshot_freeze() - freeze the file system for snapshot take
+ * @journal_only:	only block new handles and flush the journal
+ *
+ * In ordered mode, a journal commit writes the data of the allocated
+ * blocks before the metadata that references them, so a flushed journal
+ * leaves a consistent image on disk for the snapshot.  With @journal_only,
+ * the dirty page cache is not written back as it is by freeze_super().
+ * bd_fsfreeze_mutex is held until thaw, so freeze_bdev() callers wait for
+ * the take to complete.
+ */
+static void ext4_snapshot_freeze(struct super_block *sb, int journal_only)
+{
+	journal_t *journal = EXT4_SB(sb)->s_journal;
+	int err;
+
+	if (!journal_only) {
+		freeze_super(sb);
+		return;
+	}
+
+	mutex_lock(&sb->s_bdev->bd_fsfreeze_mutex);
+	jbd2_journal_lock_updates(journal);
+	err = jbd2_journal_flush(journal);
+	if (err)
+		snapshot_debug(1, "failed to flush journal before snapshot "
+			       "take (err=%d)\n", err);
+}
+
+static void ext4_snapshot_thaw(struct super_block *sb, int journal_only)
+{
+	if (!journal_only) {
+		thaw_super(sb);
+		return;
+	}
+
+	jbd2_journal_unlock_updates(EXT4_SB(sb)->s_journal);
+	mutex_unlock(&sb->s_bdev->bd_fsfreeze_mutex);
+}
+#else
+#define ext4_snapshot_freeze(sb, journal_only)	freeze_super(sb)
+#define ext4_snapshot_thaw(sb, journal_only)	thaw_super(sb)
+#endif
+
+/*
+ * ext4_snapshot_take() makes a new snapshot file
+ * into the active snapshot
+ *
+ * this function calls journal_lock_updates()
+ * and should not be called during a journal transaction
+ * Called from ext4_ioctl() under i_mutex and snapshot_mutex
+ *
+ * For a group take (@group is set), the caller has already stopped the COW
+ * bitmap prebuild, prepared the snapshot and frozen the file system, and it
+ * thaws the file system and starts the prebuild after the take.
+ */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_GROUP
+static int __ext4_snapshot_take(struct inode *inode, int group)
+#else
+int ext4_snapshot_take(struct inode *inode)
+#endif
 {
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST
 	struct list_head *list = &EXT4_SB(inode->i_sb)->s_snapshot_list;
@@ -934,8 +1879,21 @@ int ext4_snapshot_take(struct inode *inode)
 	int err = -EIO;
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE
 	u64 snapshot_r_blocks;
+#ifndef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_TRACK
 	struct kstatfs statfs;
 #endif
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_PREPARE
+	ktime_t start = ktime_get(), now;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_JOURNAL_FREEZE
+	int journal_freeze = sbi->s_snapshot_take_journal_freeze;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_SCHED
+	/* the scheduler holds s_umount, so it cannot freeze_super() */
+	if (sbi->s_snapshot_sched_task == current)
+		journal_freeze = 1;
+#endif
 
 	if (!sbi->s_sbh)
 		goto out_err;
@@ -964,7 +1922,17 @@ int ext4_snapshot_take(struct inode *inode)
 	}
 
 	err = -EIO;
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_TRACK
+	snapshot_r_blocks = ext4_snapshot_reserve_blocks(sb);
+
+	/* verify enough free space before taking the snapshot */
+	if (percpu_counter_read_positive(&sbi->s_freeblocks_counter) -
+	    percpu_counter_read_positive(&sbi->s_dirtyblocks_counter) <
+	    (s64)snapshot_r_blocks) {
+		err = -ENOSPC;
+		goto out_err;
+	}
+#elif defined(CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE)
 	/* update fs statistics to calculate snapshot reserved space */
 	if (ext4_statfs_sb(sb, &statfs)) {
 		snapshot_debug(1, "failed to statfs before snapshot (%u) "
@@ -989,8 +1957,8 @@ int ext4_snapshot_take(struct inode *inode)
 	 * will trigger an ext4_error(). Hopefully, error behavior is set to
 	 * remount-ro, so snapshot will not be corrupted.
 	 *
-	 * XXX: reserved space may be too small in data jounaling mode,
-	 *      which is currently not supported.
+	 * Journaled data blocks are also COWed, but the copies are charged
+	 * to the free space outside of the reserve.
 	 */
 #define AVG_DIR_RECORD_SIZE_BITS 6 /* 64 bytes */
 #define AVG_INODES_PER_DIR_BLOCK \
@@ -1008,11 +1976,42 @@ int ext4_snapshot_take(struct inode *inode)
 	}
 #endif
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_PREPARE
+	/* read and map all blocks that are copied under freeze */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_GROUP
+	if (!group)
+#endif
+	ext4_snapshot_take_prepare(inode);
+	now = ktime_get();
+	sbi->s_snapshot_take_prepare_us = ktime_us_delta(now, start);
+	start = now;
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_GROUP
+	if (!group) {
+		/* stop prebuilding COW bitmaps of the previous snapshot */
+		ext4_snapshot_stop_prebuild(sb);
+		/*
+		 * flush journal to disk and clear the RECOVER flag
+		 * before taking the snapshot
+		 */
+		ext4_snapshot_freeze(sb, journal_freeze);
+	}
+#else
+	/* stop prebuilding COW bitmaps of the previous snapshot */
+	ext4_snapshot_stop_prebuild(sb);
+
 	/*
 	 * flush journal to disk and clear the RECOVER flag
 	 * before taking the snapshot
 	 */
-	freeze_super(sb);
+	ext4_snapshot_freeze(sb, journal_freeze);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_PREPARE
+	now = ktime_get();
+	sbi->s_snapshot_take_freeze_us = ktime_us_delta(now, start);
+	start = now;
+#endif
 	lock_super(sb);
 
 #ifdef CONFIG_EXT4_DEBUG
@@ -1122,7 +2121,9 @@ fix_inode_copy:
 	memset(raw_inode->i_block, 0, sizeof(raw_inode->i_block));
 	unlock_buffer(sbh);
 	mark_buffer_dirty(sbh);
+#ifndef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_PREPARE
 	sync_dirty_buffer(sbh);
+#endif
 
 next_inode:
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST
@@ -1150,6 +2151,12 @@ next_inode:
 	 */
 	lock_buffer(es_bh);
 	memcpy(es_bh->b_data, sbi->s_sbh->b_data, sb->s_blocksize);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_JOURNAL_FREEZE
+	if (journal_freeze)
+		/* the journal was flushed, but RECOVER is still set on disk */
+		es->s_feature_incompat &=
+			cpu_to_le32(~EXT4_FEATURE_INCOMPAT_RECOVER);
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_FIX
 	/* set the IS_SNAPSHOT flag to signal fsck this is a snapshot */
 	es->s_flags |= cpu_to_le32(EXT4_FLAGS_IS_SNAPSHOT);
@@ -1163,7 +2170,18 @@ next_inode:
 	set_buffer_uptodate(es_bh);
 	unlock_buffer(es_bh);
 	mark_buffer_dirty(es_bh);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_PREPARE
+	/*
+	 * write all the snapshot copies at once, before the snapshot becomes
+	 * active.  the file system was synced by freeze_super(), so the dirty
+	 * snapshot copies are the only dirty buffers of the block device.
+	 */
+	err = sync_blockdev(sb->s_bdev);
+	if (err)
+		goto out_unlockfs;
+#else
 	sync_dirty_buffer(es_bh);
+#endif
 
 #endif
 
@@ -1171,50 +2189,2492 @@ next_inode:
 	SNAPSHOT_SET_DISABLED(inode);
 	/* reset COW bitmap cache */
 	ext4_snapshot_reset_bitmap_cache(sb);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CREDITS_ADAPTIVE
+	/* learn the COW credits factor of the new snapshot */
+	ext4_snapshot_cow_factor_reset(sb);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+	/* start counting the blocks of the new snapshot */
+	atomic64_set(&EXT4_I(inode)->i_snapshot_cowed, 0);
+	atomic64_set(&EXT4_I(inode)->i_snapshot_moved, 0);
+	atomic64_set(&EXT4_I(inode)->i_snapshot_merged, 0);
+	EXT4_I(inode)->i_snapshot_stats_partial = 0;
+#endif
 	/* set as in-memory active snapshot */
 	err = ext4_snapshot_set_active(sb, inode);
 	if (err)
 		goto out_unlockfs;
 
-	/* set as on-disk active snapshot */
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE
-	sbi->s_es->s_snapshot_r_blocks_count = cpu_to_le64(snapshot_r_blocks);
-#endif
+	/* set as on-disk active snapshot */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE
+	sbi->s_es->s_snapshot_r_blocks_count = cpu_to_le64(snapshot_r_blocks);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_TRACK
+	percpu_counter_set(&sbi->s_snapshot_r_blocks_counter,
+			   snapshot_r_blocks);
+#endif
+
+	sbi->s_es->s_snapshot_id =
+		cpu_to_le32(le32_to_cpu(sbi->s_es->s_snapshot_id) + 1);
+	if (sbi->s_es->s_snapshot_id == 0)
+		/* 0 is not a valid snapshot id */
+		sbi->s_es->s_snapshot_id = cpu_to_le32(1);
+	sbi->s_es->s_snapshot_inum = cpu_to_le32(inode->i_ino);
+	ext4_snapshot_set_tid(sb);
+
+	err = 0;
+out_unlockfs:
+	unlock_super(sb);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_PREPARE
+	now = ktime_get();
+	sbi->s_snapshot_take_commit_us = ktime_us_delta(now, start);
+	start = now;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_GROUP
+	if (!group)
+#endif
+	ext4_snapshot_thaw(sb, journal_freeze);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_PREPARE
+	sbi->s_snapshot_take_thaw_us = ktime_us_delta(ktime_get(), start);
+	snapshot_debug(1, "snapshot (%u) take latency (usec): prepare=%llu "
+		       "freeze=%llu commit=%llu thaw=%llu\n",
+		       inode->i_generation, sbi->s_snapshot_take_prepare_us,
+		       sbi->s_snapshot_take_freeze_us,
+		       sbi->s_snapshot_take_commit_us,
+		       sbi->s_snapshot_take_thaw_us);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS
+	trace_ext4_snapshot_take(sb, inode->i_generation,
+				 sbi->s_snapshot_take_prepare_us,
+				 sbi->s_snapshot_take_freeze_us,
+				 sbi->s_snapshot_take_commit_us,
+				 sbi->s_snapshot_take_thaw_us, err);
+#endif
+#endif
+
+	if (err)
+		goto out_err;
+
+	snapshot_debug(1, "snapshot (%u) has been taken\n",
+			inode->i_generation);
+	/* prebuild COW bitmaps of the new active snapshot */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_GROUP
+	if (!group)
+#endif
+	ext4_snapshot_start_prebuild(sb);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_DUMP
+	ext4_snapshot_dump(5, inode);
+#endif
+
+out_err:
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
+	brelse(exclude_bitmap_bh);
+#endif
+	brelse(es_bh);
+	brelse(sbh);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_INIT
+	for (i = 0; i < COPY_INODE_BLOCKS_NUM; i++)
+		brelse(bhs[i]);
+#endif
+	return err;
+}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_GROUP
+int ext4_snapshot_take(struct inode *inode)
+{
+	return __ext4_snapshot_take(inode, 0);
+}
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+/* max. no. of extents to exclude per transaction */
+#define EXT4_SNAPSHOT_EXCLUDE_BATCH	16
+
+/*
+ * ext4_snapshot_exclude_file() marks all blocks of a regular file in
+ * exclude bitmap, so they will not be COWed or moved to snapshot.
+ * The file is flagged excluded first, so new blocks allocated to the file
+ * are excluded on allocation, and then the existing extents are walked in
+ * small transactions, one leaf at a time, under down_read(&i_data_sem).
+ * The file is also flagged exclude pending until the walk is complete, so
+ * freeing a block of the file, that was not yet marked in exclude bitmap,
+ * is not considered an error, even if the walk was interrupted or failed.
+ * If interrupted by a fatal signal, the walk can be resumed by calling
+ * again.  It resumes from where it stopped, unless another file was
+ * excluded in between, in which case it starts over (marking blocks in
+ * exclude bitmap again is harmless).
+ * Only one file can be excluded at a time per file system.
+ * Called from ext4_ioctl() without i_mutex.
+ */
+int ext4_snapshot_exclude_file(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	handle_t *handle;
+	ext4_lblk_t lblk = 0;
+	int credits, excluded, pending, err = 0;
+
+	if (cmpxchg(&sbi->s_snapshot_exclude_ino, 0, inode->i_ino) != 0)
+		return -EBUSY;
+
+	mutex_lock(&inode->i_mutex);
+	if (!ext4_test_inode_flag(inode, EXT4_INODE_EXCLUDED)) {
+		handle = ext4_journal_start(inode, 1);
+		if (IS_ERR(handle)) {
+			err = PTR_ERR(handle);
+			mutex_unlock(&inode->i_mutex);
+			goto out;
+		}
+		ext4_set_inode_flag(inode, EXT4_INODE_EXCLUDED);
+		ext4_set_inode_flag(inode, EXT4_INODE_EXCLUDE_PENDING);
+		inode->i_ctime = ext4_current_time(inode);
+		err = ext4_mark_inode_dirty(handle, inode);
+		ext4_journal_stop(handle);
+	}
+	pending = ext4_test_inode_flag(inode, EXT4_INODE_EXCLUDE_PENDING);
+	mutex_unlock(&inode->i_mutex);
+	if (err)
+		goto out;
+
+	if (pending && sbi->s_snapshot_exclude_resume_ino == inode->i_ino) {
+		/* resume the interrupted walk */
+		lblk = sbi->s_snapshot_exclude_lblk;
+	} else {
+		sbi->s_snapshot_exclude_lblk = 0;
+		sbi->s_snapshot_exclude_blocks = 0;
+	}
+	sbi->s_snapshot_exclude_resume_ino = inode->i_ino;
+
+	/* path blocks (<= 5) and extents may each span 2 block groups */
+	credits = (EXT4_SNAPSHOT_EXCLUDE_BATCH + 5) * 4;
+	while (lblk != EXT_MAX_BLOCKS) {
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+		handle = ext4_journal_start(inode, credits);
+		if (IS_ERR(handle)) {
+			err = PTR_ERR(handle);
+			break;
+		}
+		down_read(&EXT4_I(inode)->i_data_sem);
+		excluded = ext4_ext_exclude_blocks(handle, inode, &lblk,
+						   EXT4_SNAPSHOT_EXCLUDE_BATCH);
+		up_read(&EXT4_I(inode)->i_data_sem);
+		err = ext4_journal_stop(handle);
+		if (excluded < 0)
+			err = excluded;
+		if (err)
+			break;
+		sbi->s_snapshot_exclude_lblk = lblk;
+		sbi->s_snapshot_exclude_blocks += excluded;
+		cond_resched();
+	}
+	if (err)
+		goto out;
+
+	sbi->s_snapshot_exclude_resume_ino = 0;
+	if (pending) {
+		/* all blocks of the file are now marked in exclude bitmap */
+		mutex_lock(&inode->i_mutex);
+		handle = ext4_journal_start(inode, 1);
+		if (IS_ERR(handle)) {
+			err = PTR_ERR(handle);
+		} else {
+			ext4_clear_inode_flag(inode,
+					      EXT4_INODE_EXCLUDE_PENDING);
+			err = ext4_mark_inode_dirty(handle, inode);
+			ext4_journal_stop(handle);
+		}
+		mutex_unlock(&inode->i_mutex);
+	}
+	if (!err)
+		snapshot_debug(1, "file (%lu) excluded %llu blocks\n",
+			       inode->i_ino, sbi->s_snapshot_exclude_blocks);
+out:
+	sbi->s_snapshot_exclude_ino = 0;
+	return err;
+}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_INHERIT
+
+/*
+ * ext4_snapshot_exclude_dir() flags a directory excluded from snapshots.
+ * Directory blocks are never excluded, but new files and directories
+ * created in an excluded directory inherit the flag in ext4_new_inode(),
+ * so the blocks of new files are excluded on allocation.
+ * Existing files in the directory are not excluded.
+ * Called from ext4_ioctl() without i_mutex.
+ */
+int ext4_snapshot_exclude_dir(struct inode *inode)
+{
+	handle_t *handle;
+	int err = 0;
+
+	mutex_lock(&inode->i_mutex);
+	if (!ext4_test_inode_flag(inode, EXT4_INODE_EXCLUDED)) {
+		handle = ext4_journal_start(inode, 1);
+		if (IS_ERR(handle)) {
+			err = PTR_ERR(handle);
+			goto out;
+		}
+		ext4_set_inode_flag(inode, EXT4_INODE_EXCLUDED);
+		inode->i_ctime = ext4_current_time(inode);
+		err = ext4_mark_inode_dirty(handle, inode);
+		ext4_journal_stop(handle);
+	}
+	if (!err)
+		snapshot_debug(1, "directory (%lu) excluded\n", inode->i_ino);
+out:
+	mutex_unlock(&inode->i_mutex);
+	return err;
+}
+#endif
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_DIFF
+/* max. no. of extents to collect under snapshot_mutex */
+#define EXT4_SNAPSHOT_DIFF_BATCH \
+	(PAGE_SIZE / sizeof(struct ext4_snapshot_diff_extent))
+
+/*
+ * ext4_snapshot_diff() lists the blocks that changed after snapshot @inode
+ * was taken.  The snapshot file maps exactly the blocks that were COWed or
+ * moved to it, while it was the active snapshot, and blocks of deleted newer
+ * snapshots that were merged into it.  These are the blocks that changed
+ * between this snapshot and the next snapshot on the list (or the current
+ * file system, if this is the active snapshot).
+ * Note that blocks that were not in use when the snapshot was taken are not
+ * COWed when they are allocated later, so they are not listed.  A backup
+ * tool should also compare the block bitmaps of the two snapshot images.
+ *
+ * Mapped ranges of the snapshot file, starting at block @udiff->sd_start,
+ * are copied to @udiff->sd_extents[] in ascending block order.  On return,
+ * @udiff->sd_mapped is the number of filled extents and @udiff->sd_start is
+ * the block to resume the scan from, or the snapshot size when done.
+ * Extents are collected in batches under snapshot_mutex, which prevents
+ * snapshot merge and cleanup from changing the snapshot file, and are copied
+ * to user space with no locks held.
+ * Called from ext4_ioctl() without i_mutex.
+ */
+int ext4_snapshot_diff(struct inode *inode,
+		       struct ext4_snapshot_diff __user *udiff)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext4_snapshot_diff diff;
+	struct ext4_snapshot_diff_extent *ext;
+	ext4_fsblk_t start, end;
+	unsigned int filled = 0, n;
+	int len, mapped, err = 0;
+
+	if (copy_from_user(&diff, udiff, sizeof(diff)))
+		return -EFAULT;
+
+	ext = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!ext)
+		return -ENOMEM;
+
+	start = diff.sd_start;
+	end = SNAPSHOT_BLOCKS(inode);
+	while (start < end && filled < diff.sd_count && !err) {
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+
+		n = 0;
+		ext4_snapshot_mutex_lock(sb);
+		if (!ext4_snapshot_list(inode)) {
+			/* snapshot was deleted */
+			err = -ENOENT;
+			goto unlock;
+		}
+		down_read(&EXT4_I(inode)->i_data_sem);
+		while (start < end) {
+			len = ext4_snapshot_diff_blocks(inode,
+					SNAPSHOT_IBLOCK(start), end - start,
+					&mapped);
+			if (len <= 0) {
+				err = len ? len : -EIO;
+				break;
+			}
+			if (mapped && n &&
+			    ext[n-1].de_start + ext[n-1].de_len == start) {
+				/* extend the last extent */
+				ext[n-1].de_len += len;
+			} else if (mapped) {
+				if (n == EXT4_SNAPSHOT_DIFF_BATCH ||
+				    filled + n == diff.sd_count)
+					/* no more room - resume from here */
+					break;
+				ext[n].de_start = start;
+				ext[n].de_len = len;
+				n++;
+			}
+			start += len;
+		}
+		up_read(&EXT4_I(inode)->i_data_sem);
+unlock:
+		ext4_snapshot_mutex_unlock(sb);
+
+		if (n && copy_to_user(udiff->sd_extents + filled, ext,
+				      n * sizeof(*ext)))
+			err = -EFAULT;
+		filled += n;
+		cond_resched();
+	}
+	kfree(ext);
+
+	snapshot_debug(4, "snapshot (%u) diff: %u extents, next block=%llu"
+		       ", err=%d\n", inode->i_generation, filled,
+		       (unsigned long long)start, err);
+	if (put_user(start, &udiff->sd_start) ||
+	    put_user(filled, &udiff->sd_mapped))
+		return -EFAULT;
+	return err;
+}
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_SEND
+/*
+ * ext4_snapshot_send_bitmap() reads the block bitmap of @group, as it was
+ * when @snapshot was taken, from the snapshot image into @buf.
+ * Groups that were added to the file system after the snapshot was taken
+ * are read as empty.
+ * Called under snapshot_mutex.
+ */
+static int ext4_snapshot_send_bitmap(struct inode *snapshot,
+				     ext4_group_t group, char *buf)
+{
+	struct super_block *sb = snapshot->i_sb;
+	struct ext4_group_desc *desc;
+	struct page *page;
+	ext4_lblk_t iblock;
+
+	if (ext4_group_first_block_no(sb, group) >= SNAPSHOT_BLOCKS(snapshot)) {
+		memset(buf, 0, sb->s_blocksize);
+		return 0;
+	}
+	desc = ext4_get_group_desc(sb, group, NULL);
+	if (!desc)
+		return -EIO;
+	iblock = SNAPSHOT_IBLOCK(ext4_block_bitmap(sb, desc));
+	page = read_mapping_page(snapshot->i_mapping,
+			iblock >> (PAGE_CACHE_SHIFT - sb->s_blocksize_bits),
+			NULL);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	memcpy(buf, kmap(page) + ((iblock << sb->s_blocksize_bits) &
+				   ~PAGE_CACHE_MASK), sb->s_blocksize);
+	kunmap(page);
+	page_cache_release(page);
+	return 0;
+}
+
+/*
+ * ext4_snapshot_send_group() marks in @changed the blocks of @group that
+ * differ between the images of snapshot @inode and of the older snapshot
+ * @base.  These are the blocks that were COWed or moved to @base or to
+ * the snapshots between @base and @inode, and the blocks that were free
+ * in @base and are in use in @inode.  @bitmap is a scratch buffer of one
+ * block.
+ * Called under snapshot_mutex.
+ */
+static int ext4_snapshot_send_group(struct inode *inode, struct inode *base,
+				    ext4_group_t group, char *changed,
+				    char *bitmap)
+{
+	struct super_block *sb = inode->i_sb;
+	struct list_head *l = &EXT4_I(inode)->i_snaplist;
+	struct inode *snapshot;
+	ext4_fsblk_t first = ext4_group_first_block_no(sb, group);
+	ext4_fsblk_t end = min_t(ext4_fsblk_t, SNAPSHOT_BLOCKS(inode),
+				 first + EXT4_BLOCKS_PER_GROUP(sb));
+	ext4_fsblk_t block;
+	int len, mapped, err;
+
+	/* blocks in use in @inode and free in @base */
+	err = ext4_snapshot_send_bitmap(inode, group, changed);
+	if (!err)
+		err = ext4_snapshot_send_bitmap(base, group, bitmap);
+	if (err)
+		return err;
+	bitmap_andnot((unsigned long *)changed, (unsigned long *)changed,
+		      (unsigned long *)bitmap, EXT4_BLOCKS_PER_GROUP(sb));
+	/* snapshot take always changes the super block */
+	if (group == 0)
+		ext4_set_bit(0, changed);
+
+	/* blocks that changed while older snapshots were active */
+	do {
+		l = l->next;
+		snapshot = &list_entry(l, struct ext4_inode_info,
+				       i_snaplist)->vfs_inode;
+		down_read(&EXT4_I(snapshot)->i_data_sem);
+		for (block = first; block < end; block += len) {
+			len = ext4_snapshot_diff_blocks(snapshot,
+					SNAPSHOT_IBLOCK(block), end - block,
+					&mapped);
+			if (len <= 0) {
+				err = len ? len : -EIO;
+				break;
+			}
+			if (mapped)
+				ext4_set_bits(changed, block - first, len);
+		}
+		up_read(&EXT4_I(snapshot)->i_data_sem);
+	} while (!err && snapshot != base);
+	return err;
+}
+
+/*
+ * ext4_snapshot_send_check() verifies that @inode and @base are still on
+ * the snapshot list and that @base is older than @inode.
+ * Called under snapshot_mutex.
+ */
+static int ext4_snapshot_send_check(struct inode *inode, struct inode *base)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(inode->i_sb);
+	struct list_head *l;
+
+	if (!ext4_snapshot_list(inode) || !ext4_snapshot_list(base))
+		return -ENOENT;
+	/* older snapshots follow @inode on the list */
+	for (l = EXT4_I(inode)->i_snaplist.next; l != &sbi->s_snapshot_list;
+	     l = l->next)
+		if (l == &EXT4_I(base)->i_snaplist)
+			return 0;
+	return -EINVAL;
+}
+
+/*
+ * ext4_snapshot_send() lists the blocks that differ between the image of
+ * snapshot @inode and the image of an older snapshot, whose file is
+ * @usend->ss_base_fd.  A replica of the older image is brought up to date
+ * by writing these blocks, read from snapshot @inode file, to the replica.
+ * Unlike ext4_snapshot_diff(), the list includes the blocks that were
+ * allocated after the older snapshot was taken.  Those are found from the
+ * block bitmaps of the snapshot images, so only the metadata of the
+ * snapshots is read, and never the data blocks of the file system.
+ *
+ * Changed ranges, starting at block @usend->ss_start, are copied to
+ * @usend->ss_extents[] in ascending block order.  On return,
+ * @usend->ss_mapped is the number of filled extents and @usend->ss_start
+ * is the block to resume from, or the snapshot size when done.
+ * Every block group is scanned under snapshot_mutex, which prevents
+ * snapshot merge and cleanup from changing the snapshot files, and its
+ * extents are copied to user space with no locks held.
+ * Called from ext4_ioctl() without i_mutex.
+ */
+int ext4_snapshot_send(struct inode *inode,
+		       struct ext4_snapshot_send __user *usend)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext4_snapshot_send send;
+	struct ext4_snapshot_diff_extent *ext;
+	struct file *base_file;
+	struct inode *base;
+	char *changed, *bitmap;
+	ext4_fsblk_t start, end, first;
+	ext4_group_t group;
+	ext4_grpblk_t i, j, max;
+	unsigned int filled = 0, n;
+	int err = 0;
+
+	if (copy_from_user(&send, usend, sizeof(send)))
+		return -EFAULT;
+	if (send.ss_flags)
+		return -EINVAL;
+
+	base_file = fget(send.ss_base_fd);
+	if (!base_file)
+		return -EBADF;
+	base = base_file->f_dentry->d_inode;
+	if (base->i_sb != sb || !ext4_snapshot_file(base) || base == inode) {
+		err = -EINVAL;
+		goto out_fput;
+	}
+
+	ext = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	changed = kmalloc(2 * sb->s_blocksize, GFP_KERNEL);
+	if (!ext || !changed) {
+		err = -ENOMEM;
+		goto out;
+	}
+	bitmap = changed + sb->s_blocksize;
+
+	start = max_t(ext4_fsblk_t, send.ss_start,
+		      le32_to_cpu(EXT4_SB(sb)->s_es->s_first_data_block));
+	end = SNAPSHOT_BLOCKS(inode);
+	while (start < end && filled < send.ss_count) {
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+
+		ext4_get_group_no_and_offset(sb, start, &group, &i);
+		first = ext4_group_first_block_no(sb, group);
+		max = min_t(ext4_fsblk_t, end - first,
+			    EXT4_BLOCKS_PER_GROUP(sb));
+		ext4_snapshot_mutex_lock(sb);
+		err = ext4_snapshot_send_check(inode, base);
+		if (!err)
+			err = ext4_snapshot_send_group(inode, base, group,
+						       changed, bitmap);
+		ext4_snapshot_mutex_unlock(sb);
+		if (err)
+			break;
+
+		n = 0;
+		while (i < max && filled + n < send.ss_count &&
+		       n < PAGE_SIZE / sizeof(*ext)) {
+			i = ext4_find_next_bit(changed, max, i);
+			if (i >= max)
+				break;
+			j = ext4_find_next_zero_bit(changed, max, i);
+			ext[n].de_start = first + i;
+			ext[n].de_len = j - i;
+			n++;
+			i = j;
+		}
+		start = first + i;
+
+		if (n && copy_to_user(usend->ss_extents + filled, ext,
+				      n * sizeof(*ext))) {
+			err = -EFAULT;
+			break;
+		}
+		filled += n;
+		cond_resched();
+	}
+
+	snapshot_debug(4, "snapshot (%u) send from (%u): %u extents, "
+		       "next block=%llu, err=%d\n", inode->i_generation,
+		       base->i_generation, filled,
+		       (unsigned long long)start, err);
+	if (put_user(start, &usend->ss_start) ||
+	    put_user(filled, &usend->ss_mapped))
+		err = -EFAULT;
+out:
+	kfree(changed);
+	kfree(ext);
+out_fput:
+	fput(base_file);
+	return err;
+}
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_REVERT
+/*
+ * Revert of the file system to the active snapshot:
+ *
+ * The active snapshot file maps every block that was changed after the
+ * snapshot was taken, either to a copy of the block before the change
+ * (COW) or to the block itself (MOW).  Reverting copies the COWed blocks
+ * back to their place, returns the moved blocks to the file system and
+ * resets the snapshot file, so it becomes an empty snapshot of the reverted
+ * file system.  The work is in proportion to the number of changed blocks.
+ *
+ * The block bitmaps, group descriptors and superblock are not copied back
+ * as is:
+ * - The copy of a block bitmap in the snapshot is the COW bitmap, which
+ *   has the blocks allocated when the snapshot was taken, except for
+ *   snapshot blocks.  The reverted bitmap is the COW bitmap plus the
+ *   blocks of the other snapshots, which are found by walking the block
+ *   maps of the other snapshot files.  The reverted exclude bitmap has
+ *   only the blocks of the other snapshots.
+ * - Only the inode counters of group descriptors are copied back.  The
+ *   block counters are computed from the reverted block bitmaps.
+ * - Only the orphan list head of the superblock is copied back.
+ * - The raw inodes of snapshot files, journal and resize inodes are not
+ *   copied back.  Snapshot files that were removed after the snapshot was
+ *   taken are freed in the reverted inode bitmap.
+ *
+ * The blocks of files excluded from snapshots are neither in the COW
+ * bitmap nor copied to the snapshot, so a file system with excluded files
+ * cannot be reverted.  The revert is refused, before anything is written,
+ * if there are excluded blocks that are not snapshot blocks, or if the
+ * snapshot has a copy of an inode of an excluded file.
+ */
+enum {
+	REVERT_BLOCK_BITMAP = 1,
+	REVERT_INODE_BITMAP,
+	REVERT_EXCLUDE_BITMAP,
+	REVERT_INODE_TABLE,
+	REVERT_GROUP_DESC,
+	REVERT_SUPER,
+};
+
+struct ext4_snapshot_revert_meta {
+	ext4_fsblk_t	rm_start;	/* first block */
+	unsigned int	rm_len;		/* no. of blocks */
+	unsigned int	rm_type;	/* REVERT_* */
+	ext4_group_t	rm_group;	/* described (first) block group */
+};
+
+struct ext4_snapshot_revert {
+	struct super_block *r_sb;
+	struct inode	*r_snapshot;	/* the active snapshot */
+	struct ext4_snapshot_revert_meta *r_meta; /* sorted by rm_start */
+	int		r_nmeta;
+	unsigned long	**r_owned;	/* per group blocks of the snapshot */
+	unsigned long	**r_others;	/* per group blocks of other snapshots */
+	ext4_fsblk_t	*r_cow_bitmap;	/* per group COW bitmap copy */
+	unsigned long	*r_dirty;	/* groups with changed descriptor */
+	unsigned long	r_copied;	/* blocks copied back */
+	unsigned long	r_moved;	/* blocks returned in place */
+};
+
+static int ext4_snapshot_revert_cmp(const void *a, const void *b)
+{
+	const struct ext4_snapshot_revert_meta *ma = a, *mb = b;
+
+	if (ma->rm_start == mb->rm_start)
+		return 0;
+	return ma->rm_start < mb->rm_start ? -1 : 1;
+}
+
+static void ext4_snapshot_revert_add_meta(struct ext4_snapshot_revert *rv,
+		ext4_fsblk_t start, unsigned int len, unsigned int type,
+		ext4_group_t group)
+{
+	struct ext4_snapshot_revert_meta *m = &rv->r_meta[rv->r_nmeta++];
+
+	m->rm_start = start;
+	m->rm_len = len;
+	m->rm_type = type;
+	m->rm_group = group;
+}
+
+/*
+ * List the blocks of the file system metadata, which need special handling
+ * on revert, sorted by block number.
+ */
+static int ext4_snapshot_revert_build_meta(struct ext4_snapshot_revert *rv)
+{
+	struct super_block *sb = rv->r_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	ext4_group_t group, ngroups = ext4_get_groups_count(sb);
+	struct ext4_group_desc *gdp;
+	ext4_fsblk_t blk;
+	unsigned long i;
+
+	rv->r_meta = ext4_kvzalloc((4 * ngroups + sbi->s_gdb_count + 1) *
+				   sizeof(*rv->r_meta), GFP_KERNEL);
+	if (!rv->r_meta)
+		return -ENOMEM;
+
+	for (group = 0; group < ngroups; group++) {
+		gdp = ext4_get_group_desc(sb, group, NULL);
+		if (!gdp)
+			return -EIO;
+		ext4_snapshot_revert_add_meta(rv, ext4_block_bitmap(sb, gdp),
+					      1, REVERT_BLOCK_BITMAP, group);
+		ext4_snapshot_revert_add_meta(rv, ext4_inode_bitmap(sb, gdp),
+					      1, REVERT_INODE_BITMAP, group);
+		blk = ext4_exclude_bitmap(sb, gdp);
+		if (blk)
+			ext4_snapshot_revert_add_meta(rv, blk, 1,
+					REVERT_EXCLUDE_BITMAP, group);
+		ext4_snapshot_revert_add_meta(rv, ext4_inode_table(sb, gdp),
+					      sbi->s_itb_per_group,
+					      REVERT_INODE_TABLE, group);
+	}
+	for (i = 0; i < sbi->s_gdb_count; i++)
+		ext4_snapshot_revert_add_meta(rv,
+				sbi->s_group_desc[i]->b_blocknr, 1,
+				REVERT_GROUP_DESC,
+				i << EXT4_DESC_PER_BLOCK_BITS(sb));
+	ext4_snapshot_revert_add_meta(rv, sbi->s_sbh->b_blocknr, 1,
+				      REVERT_SUPER, 0);
+
+	sort(rv->r_meta, rv->r_nmeta, sizeof(*rv->r_meta),
+	     ext4_snapshot_revert_cmp, NULL);
+	return 0;
+}
+
+static struct ext4_snapshot_revert_meta *
+ext4_snapshot_revert_find_meta(struct ext4_snapshot_revert *rv,
+			       ext4_fsblk_t block)
+{
+	struct ext4_snapshot_revert_meta *m;
+	int lo = 0, hi = rv->r_nmeta - 1, mid;
+
+	/* find the last metadata range that starts at or before @block */
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (rv->r_meta[mid].rm_start <= block)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	if (hi < 0)
+		return NULL;
+	m = &rv->r_meta[hi];
+	return block < m->rm_start + m->rm_len ? m : NULL;
+}
+
+/*
+ * Mark @block and the blocks it points to, down @depth levels of indirect
+ * blocks, in the per group bitmaps @owned.
+ */
+static int ext4_snapshot_revert_own(struct ext4_snapshot_revert *rv,
+		unsigned long **owned, ext4_fsblk_t block, int depth)
+{
+	struct super_block *sb = rv->r_sb;
+	struct buffer_head *bh;
+	ext4_group_t group;
+	ext4_grpblk_t bit;
+	__le32 *p;
+	int i, err = 0;
+
+	if (block >= ext4_blocks_count(EXT4_SB(sb)->s_es))
+		return -EIO;
+	ext4_get_group_no_and_offset(sb, block, &group, &bit);
+	if (!owned[group]) {
+		owned[group] = kzalloc(sb->s_blocksize, GFP_KERNEL);
+		if (!owned[group])
+			return -ENOMEM;
+	}
+	ext4_set_bit(bit, owned[group]);
+	if (!depth)
+		return 0;
+
+	bh = sb_bread(sb, block);
+	if (!bh)
+		return -EIO;
+	p = (__le32 *)bh->b_data;
+	for (i = 0; !err && i < EXT4_ADDR_PER_BLOCK(sb); i++)
+		if (p[i])
+			err = ext4_snapshot_revert_own(rv, owned,
+					le32_to_cpu(p[i]), depth - 1);
+	brelse(bh);
+	cond_resched();
+	return err;
+}
+
+/* mark all blocks of snapshot file @inode in the per group bitmaps @owned */
+static int ext4_snapshot_revert_own_all(struct ext4_snapshot_revert *rv,
+		struct inode *inode, unsigned long **owned)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	int i, depth, err;
+
+	for (i = 0; i < EXT4_N_BLOCKS; i++) {
+		if (!ei->i_data[i])
+			continue;
+		if (i == EXT4_IND_BLOCK)
+			depth = 1;
+		else if (i == EXT4_DIND_BLOCK)
+			depth = 2;
+		else if (i == EXT4_TIND_BLOCK)
+			depth = 3;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_HUGE
+		else if (i < EXT4_SNAPSHOT_EXTRA_TIND_BLOCKS)
+			/* extra tind blocks in-place of direct blocks */
+			depth = 3;
+#endif
+		else
+			depth = 0;
+		err = ext4_snapshot_revert_own(rv, owned,
+				le32_to_cpu(ei->i_data[i]), depth);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/*
+ * Mark the blocks of the snapshots on the on-disk snapshot list, other than
+ * the active snapshot, in the per group bitmaps of other snapshots' blocks.
+ */
+static int ext4_snapshot_revert_others(struct ext4_snapshot_revert *rv)
+{
+	struct super_block *sb = rv->r_sb;
+	__u32 ino = le32_to_cpu(EXT4_SB(sb)->s_es->s_snapshot_list);
+	unsigned long n = 0;
+	struct inode *inode;
+	int err = 0;
+
+	while (!err && ino) {
+		/* a loop in the snapshot list can't be longer than this */
+		if (n++ > le32_to_cpu(EXT4_SB(sb)->s_es->s_inodes_count))
+			return -EIO;
+		if (ino == rv->r_snapshot->i_ino) {
+			ino = NEXT_SNAPSHOT(rv->r_snapshot);
+			continue;
+		}
+		inode = ext4_orphan_get(sb, ino);
+		if (IS_ERR(inode))
+			return PTR_ERR(inode);
+		if (ext4_snapshot_file(inode))
+			err = ext4_snapshot_revert_own_all(rv, inode,
+							   rv->r_others);
+		else
+			err = -EIO;
+		ino = NEXT_SNAPSHOT(inode);
+		iput(inode);
+	}
+	return err;
+}
+
+/*
+ * Check that all excluded blocks of @group are snapshot blocks, i.e. that
+ * there are no blocks of excluded files in @group.
+ */
+static int ext4_snapshot_revert_check_group(struct ext4_snapshot_revert *rv,
+					    ext4_group_t group)
+{
+	struct super_block *sb = rv->r_sb;
+	struct buffer_head *exclude_bh;
+	struct ext4_group_desc *gdp;
+	unsigned long *exclude;
+	unsigned long *owned = rv->r_owned[group];
+	unsigned long *others = rv->r_others[group];
+	unsigned long e;
+	int i, err = 0;
+
+	gdp = ext4_get_group_desc(sb, group, NULL);
+	if (!gdp)
+		return -EIO;
+	if (!ext4_exclude_bitmap(sb, gdp) ||
+	    (gdp->bg_flags & cpu_to_le16(EXT4_BG_EXCLUDE_UNINIT)))
+		return 0;
+	exclude_bh = sb_bread(sb, ext4_exclude_bitmap(sb, gdp));
+	if (!exclude_bh)
+		return -EIO;
+	exclude = (unsigned long *)exclude_bh->b_data;
+	for (i = 0; i < sb->s_blocksize / sizeof(long); i++) {
+		e = exclude[i];
+		if (owned)
+			e &= ~owned[i];
+		if (others)
+			e &= ~others[i];
+		if (e) {
+			ext4_msg(sb, KERN_ERR, "cannot revert to snapshot "
+				 "with blocks of excluded files in group %u",
+				 group);
+			err = -EINVAL;
+			break;
+		}
+	}
+	brelse(exclude_bh);
+	return err;
+}
+
+/* copy block @src over block @dst */
+static int ext4_snapshot_revert_copy(struct super_block *sb,
+				     ext4_fsblk_t dst, ext4_fsblk_t src)
+{
+	struct buffer_head *sbh, *bh;
+
+	sbh = sb_bread(sb, src);
+	if (!sbh)
+		return -EIO;
+	bh = sb_getblk(sb, dst);
+	if (!bh) {
+		brelse(sbh);
+		return -EIO;
+	}
+	lock_buffer(bh);
+	memcpy(bh->b_data, sbh->b_data, sb->s_blocksize);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	brelse(sbh);
+	return 0;
+}
+
+/*
+ * Copy back the inode counters of the group descriptors in group descriptor
+ * block @m from its copy @src.
+ */
+static int ext4_snapshot_revert_desc(struct ext4_snapshot_revert *rv,
+		struct ext4_snapshot_revert_meta *m, ext4_fsblk_t src)
+{
+	struct super_block *sb = rv->r_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	ext4_group_t group, ngroups = ext4_get_groups_count(sb);
+	struct ext4_group_desc *gdp, *old;
+	struct buffer_head *sbh;
+	int i, free_inodes, used_dirs;
+
+	sbh = sb_bread(sb, src);
+	if (!sbh)
+		return -EIO;
+	for (i = 0; i < EXT4_DESC_PER_BLOCK(sb); i++) {
+		group = m->rm_group + i;
+		if (group >= ngroups)
+			break;
+		gdp = ext4_get_group_desc(sb, group, NULL);
+		old = (struct ext4_group_desc *)
+			(sbh->b_data + i * EXT4_DESC_SIZE(sb));
+		free_inodes = ext4_free_inodes_count(sb, old) -
+			ext4_free_inodes_count(sb, gdp);
+		used_dirs = ext4_used_dirs_count(sb, old) -
+			ext4_used_dirs_count(sb, gdp);
+		ext4_free_inodes_set(sb, gdp, ext4_free_inodes_count(sb, old));
+		ext4_used_dirs_set(sb, gdp, ext4_used_dirs_count(sb, old));
+		ext4_itable_unused_set(sb, gdp,
+				       ext4_itable_unused_count(sb, old));
+		gdp->bg_flags &= ~cpu_to_le16(EXT4_BG_INODE_UNINIT);
+		gdp->bg_flags |= old->bg_flags &
+			cpu_to_le16(EXT4_BG_INODE_UNINIT);
+		if (sbi->s_log_groups_per_flex)
+			ext4_flex_add(sbi, ext4_flex_group(sbi, group),
+				      free_inodes, 0, used_dirs);
+		__set_bit(group, rv->r_dirty);
+	}
+	brelse(sbh);
+	return 0;
+}
+
+/*
+ * Copy back inode table block @block of group @m->rm_group from its copy
+ * @src, keeping the current raw inodes of snapshot files and of the journal
+ * and resize inodes.  Snapshot files that were removed after the active
+ * snapshot was taken are freed.
+ */
+static int ext4_snapshot_revert_itable(struct ext4_snapshot_revert *rv,
+		struct ext4_snapshot_revert_meta *m, ext4_fsblk_t block,
+		ext4_fsblk_t src)
+{
+	struct super_block *sb = rv->r_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct buffer_head *sbh, *bh, *bitmap_bh = NULL;
+	struct ext4_group_desc *gdp;
+	struct ext4_inode *raw, *old;
+	unsigned long ino, journal_ino = le32_to_cpu(sbi->s_es->s_journal_inum);
+	int i, index, err = 0;
+
+	sbh = sb_bread(sb, src);
+	bh = sb_bread(sb, block);
+	if (!sbh || !bh) {
+		err = -EIO;
+		goto out;
+	}
+	gdp = ext4_get_group_desc(sb, m->rm_group, NULL);
+
+	lock_buffer(bh);
+	for (i = 0; i < sbi->s_inodes_per_block; i++) {
+		index = (block - m->rm_start) * sbi->s_inodes_per_block + i;
+		ino = m->rm_group * EXT4_INODES_PER_GROUP(sb) + index + 1;
+		raw = (struct ext4_inode *)(bh->b_data +
+					    i * EXT4_INODE_SIZE(sb));
+		old = (struct ext4_inode *)(sbh->b_data +
+					    i * EXT4_INODE_SIZE(sb));
+		if (ino == journal_ino || ino == EXT4_RESIZE_INO ||
+		    (le32_to_cpu(raw->i_flags) & EXT4_SNAPFILE_FL))
+			continue;
+		memcpy(raw, old, EXT4_INODE_SIZE(sb));
+		if (!(le32_to_cpu(old->i_flags) & EXT4_SNAPFILE_FL))
+			continue;
+
+		/* snapshot file was removed after the snapshot was taken */
+		raw->i_links_count = 0;
+		raw->i_dtime = cpu_to_le32(get_seconds());
+		if (!bitmap_bh) {
+			bitmap_bh = sb_bread(sb, ext4_inode_bitmap(sb, gdp));
+			if (!bitmap_bh) {
+				err = -EIO;
+				break;
+			}
+		}
+		if (ext4_clear_bit(index, bitmap_bh->b_data)) {
+			ext4_free_inodes_set(sb, gdp,
+					ext4_free_inodes_count(sb, gdp) + 1);
+			if (sbi->s_log_groups_per_flex)
+				ext4_flex_add(sbi,
+					ext4_flex_group(sbi, m->rm_group),
+					1, 0, 0);
+			__set_bit(m->rm_group, rv->r_dirty);
+			mark_buffer_dirty(bitmap_bh);
+		}
+	}
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+out:
+	brelse(bitmap_bh);
+	brelse(bh);
+	brelse(sbh);
+	return err;
+}
+
+/*
+ * Check that the copy @src of an inode table block has no inodes of
+ * excluded files, whose blocks were not in use when the snapshot was taken.
+ */
+static int ext4_snapshot_revert_check_itable(struct ext4_snapshot_revert *rv,
+					     ext4_fsblk_t src)
+{
+	struct super_block *sb = rv->r_sb;
+	struct buffer_head *sbh;
+	struct ext4_inode *old;
+	int i, err = 0;
+
+	sbh = sb_bread(sb, src);
+	if (!sbh)
+		return -EIO;
+	for (i = 0; i < EXT4_SB(sb)->s_inodes_per_block; i++) {
+		old = (struct ext4_inode *)(sbh->b_data +
+					    i * EXT4_INODE_SIZE(sb));
+		if (S_ISREG(le16_to_cpu(old->i_mode)) &&
+		    (le32_to_cpu(old->i_flags) & EXT4_EXCLUDED_FL) &&
+		    (old->i_blocks_lo || old->i_blocks_high)) {
+			ext4_msg(sb, KERN_ERR, "cannot revert to snapshot "
+				 "with inodes of excluded files");
+			err = -EINVAL;
+			break;
+		}
+	}
+	brelse(sbh);
+	return err;
+}
+
+/*
+ * Revert block @block, which is mapped to block @src in the active snapshot.
+ * Pass 0 only checks that the revert is possible and writes nothing.
+ * Inode table blocks are reverted in the 2nd pass, after the inode bitmaps.
+ */
+static int ext4_snapshot_revert_block(struct ext4_snapshot_revert *rv,
+		ext4_fsblk_t block, ext4_fsblk_t src, int pass)
+{
+	struct super_block *sb = rv->r_sb;
+	struct ext4_snapshot_revert_meta *m;
+	struct ext4_super_block *es;
+	struct buffer_head *sbh;
+	int err;
+
+	if (block == src) {
+		/* moved block is returned to the file system in place */
+		if (pass == 1)
+			rv->r_moved++;
+		return 0;
+	}
+
+	m = ext4_snapshot_revert_find_meta(rv, block);
+	if (m && m->rm_type == REVERT_INODE_TABLE) {
+		if (pass == 0)
+			return ext4_snapshot_revert_check_itable(rv, src);
+		if (pass != 2)
+			return 0;
+		err = ext4_snapshot_revert_itable(rv, m, block, src);
+		if (!err)
+			rv->r_copied++;
+		return err;
+	}
+	if (pass != 1)
+		return 0;
+
+	switch (m ? m->rm_type : 0) {
+	case REVERT_BLOCK_BITMAP:
+		/* the COW bitmap is applied by ext4_snapshot_revert_group() */
+		rv->r_cow_bitmap[m->rm_group] = src;
+		return 0;
+	case REVERT_EXCLUDE_BITMAP:
+		return 0;
+	case REVERT_GROUP_DESC:
+		return ext4_snapshot_revert_desc(rv, m, src);
+	case REVERT_SUPER:
+		sbh = sb_bread(sb, src);
+		if (!sbh)
+			return -EIO;
+		es = (struct ext4_super_block *)(sbh->b_data +
+			((char *)EXT4_SB(sb)->s_es - EXT4_SB(sb)->s_sbh->b_data));
+		EXT4_SB(sb)->s_es->s_last_orphan = es->s_last_orphan;
+		brelse(sbh);
+		return 0;
+	}
+
+	err = ext4_snapshot_revert_copy(sb, block, src);
+	if (!err)
+		rv->r_copied++;
+	return err;
+}
+
+/*
+ * Walk the blocks mapped by the active snapshot in ascending order and
+ * revert them.  Holes are skipped a whole branch at a time.
+ */
+static int ext4_snapshot_revert_pass(struct ext4_snapshot_revert *rv,
+				     int pass)
+{
+	struct inode *inode = rv->r_snapshot;
+	ext4_fsblk_t block = 0, end = SNAPSHOT_BLOCKS(inode), mapped;
+	int n, len, mapped_range, err = 0;
+
+	while (block < end) {
+		down_read(&EXT4_I(inode)->i_data_sem);
+		len = ext4_snapshot_diff_blocks(inode, SNAPSHOT_IBLOCK(block),
+						end - block, &mapped_range);
+		up_read(&EXT4_I(inode)->i_data_sem);
+		if (len <= 0)
+			return len ? len : -EIO;
+		if (!mapped_range) {
+			block += len;
+			continue;
+		}
+		while (len > 0) {
+			n = ext4_snapshot_map_blocks(NULL, inode, block, len,
+						     &mapped, 0);
+			if (n <= 0)
+				return n ? n : -EIO;
+			len -= n;
+			for (; n > 0; n--, block++, mapped++) {
+				err = ext4_snapshot_revert_block(rv, block,
+							mapped, pass);
+				if (err)
+					return err;
+			}
+		}
+		cond_resched();
+	}
+	return 0;
+}
+
+/*
+ * Write the reverted block and exclude bitmaps of @group and update the
+ * block counters of its descriptor.
+ */
+static int ext4_snapshot_revert_group(struct ext4_snapshot_revert *rv,
+				      ext4_group_t group)
+{
+	struct super_block *sb = rv->r_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct buffer_head *bitmap_bh, *exclude_bh = NULL, *cow_bh = NULL;
+	struct ext4_group_desc *gdp;
+	unsigned long *bitmap, *exclude = NULL, *cow = NULL;
+	unsigned long *owned = rv->r_owned[group];
+	unsigned long *others = rv->r_others[group];
+	unsigned long o;
+	int i, free, err = 0;
+
+	gdp = ext4_get_group_desc(sb, group, NULL);
+	if (!gdp)
+		return -EIO;
+	/* no block was ever allocated in an uninitialized group */
+	if ((gdp->bg_flags & cpu_to_le16(EXT4_BG_BLOCK_UNINIT)) &&
+	    !rv->r_cow_bitmap[group])
+		return 0;
+
+	bitmap_bh = sb_bread(sb, ext4_block_bitmap(sb, gdp));
+	if (!bitmap_bh)
+		return -EIO;
+	bitmap = (unsigned long *)bitmap_bh->b_data;
+	if (ext4_exclude_bitmap(sb, gdp) &&
+	    !(gdp->bg_flags & cpu_to_le16(EXT4_BG_EXCLUDE_UNINIT))) {
+		exclude_bh = sb_bread(sb, ext4_exclude_bitmap(sb, gdp));
+		if (!exclude_bh) {
+			err = -EIO;
+			goto out;
+		}
+		exclude = (unsigned long *)exclude_bh->b_data;
+	}
+	if (rv->r_cow_bitmap[group]) {
+		cow_bh = sb_bread(sb, rv->r_cow_bitmap[group]);
+		if (!cow_bh) {
+			err = -EIO;
+			goto out;
+		}
+		cow = (unsigned long *)cow_bh->b_data;
+	}
+
+	lock_buffer(bitmap_bh);
+	for (i = 0; i < sb->s_blocksize / sizeof(long); i++) {
+		/* blocks in use when the snapshot was taken */
+		if (cow)
+			bitmap[i] = cow[i];
+		else if (owned)
+			bitmap[i] &= ~owned[i];
+		/* blocks of the other snapshots */
+		o = others ? others[i] : 0;
+		bitmap[i] |= o;
+		if (exclude)
+			exclude[i] = o;
+	}
+	unlock_buffer(bitmap_bh);
+	mark_buffer_dirty(bitmap_bh);
+	if (exclude_bh)
+		mark_buffer_dirty(exclude_bh);
+
+	free = ext4_count_free(bitmap_bh, EXT4_BLOCKS_PER_GROUP(sb) / 8);
+	if (sbi->s_log_groups_per_flex)
+		ext4_flex_add(sbi, ext4_flex_group(sbi, group), 0,
+			      free - ext4_free_blks_count(sb, gdp), 0);
+	ext4_free_blks_set(sb, gdp, free);
+	gdp->bg_flags &= ~cpu_to_le16(EXT4_BG_BLOCK_UNINIT);
+	__set_bit(group, rv->r_dirty);
+out:
+	brelse(cow_bh);
+	brelse(exclude_bh);
+	brelse(bitmap_bh);
+	return err;
+}
+
+/*
+ * ext4_snapshot_revert() reverts the file system to the active snapshot and
+ * leaves the active snapshot empty.
+ * Called from ext4_fill_super() with the 'snapshot_revert' mount option,
+ * after journal recovery and before the file system is accessible, so no
+ * inode other than the journal inode is in use and the block allocator is
+ * not initialized.  Blocks are written in place and not journaled.  The
+ * file system is marked with errors until all blocks are written, so fsck
+ * is forced if the revert is interrupted.
+ */
+int ext4_snapshot_revert(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_super_block *es = sbi->s_es;
+	struct ext4_snapshot_revert rv;
+	ext4_group_t group, ngroups = ext4_get_groups_count(sb);
+	struct ext4_iloc iloc;
+	__u16 state = le16_to_cpu(es->s_state);
+	int i, err;
+
+	if (!le32_to_cpu(es->s_snapshot_inum)) {
+		ext4_msg(sb, KERN_ERR, "no active snapshot to revert to");
+		return -ENOENT;
+	}
+	memset(&rv, 0, sizeof(rv));
+	rv.r_sb = sb;
+	rv.r_snapshot = ext4_iget(sb, le32_to_cpu(es->s_snapshot_inum));
+	if (IS_ERR(rv.r_snapshot)) {
+		err = PTR_ERR(rv.r_snapshot);
+		rv.r_snapshot = NULL;
+		goto out;
+	}
+	err = -EINVAL;
+	if (!ext4_snapshot_file(rv.r_snapshot)) {
+		ext4_msg(sb, KERN_ERR, "active snapshot inode %lu is not "
+			 "a snapshot file", rv.r_snapshot->i_ino);
+		goto out;
+	}
+	if (SNAPSHOT_BLOCKS(rv.r_snapshot) != ext4_blocks_count(es)) {
+		ext4_msg(sb, KERN_ERR, "file system was resized after "
+			 "snapshot (%u) was taken", rv.r_snapshot->i_generation);
+		goto out;
+	}
+
+	err = -ENOMEM;
+	rv.r_owned = ext4_kvzalloc(ngroups * sizeof(*rv.r_owned), GFP_KERNEL);
+	rv.r_others = ext4_kvzalloc(ngroups * sizeof(*rv.r_others),
+				    GFP_KERNEL);
+	rv.r_cow_bitmap = ext4_kvzalloc(ngroups * sizeof(*rv.r_cow_bitmap),
+					GFP_KERNEL);
+	rv.r_dirty = ext4_kvzalloc(BITS_TO_LONGS(ngroups) * sizeof(long),
+				   GFP_KERNEL);
+	if (!rv.r_owned || !rv.r_others || !rv.r_cow_bitmap || !rv.r_dirty)
+		goto out;
+	err = ext4_snapshot_revert_build_meta(&rv);
+	if (!err)
+		err = ext4_snapshot_revert_own_all(&rv, rv.r_snapshot,
+						   rv.r_owned);
+	if (!err)
+		err = ext4_snapshot_revert_others(&rv);
+	/* refuse to revert a file system with excluded files */
+	for (group = 0; !err && group < ngroups; group++)
+		err = ext4_snapshot_revert_check_group(&rv, group);
+	if (!err)
+		err = ext4_snapshot_revert_pass(&rv, 0);
+	if (err)
+		goto out;
+
+	/* force fsck if the revert does not complete */
+	es->s_state = cpu_to_le16(state | EXT4_ERROR_FS);
+	mark_buffer_dirty(sbi->s_sbh);
+	err = sync_dirty_buffer(sbi->s_sbh);
+	if (err)
+		goto out;
+
+	err = ext4_snapshot_revert_pass(&rv, 1);
+	if (!err)
+		err = ext4_snapshot_revert_pass(&rv, 2);
+	for (group = 0; !err && group < ngroups; group++)
+		if (rv.r_owned[group] || rv.r_others[group] ||
+		    rv.r_cow_bitmap[group])
+			err = ext4_snapshot_revert_group(&rv, group);
+	if (err)
+		goto out;
+	for_each_set_bit(group, rv.r_dirty, ngroups) {
+		struct buffer_head *gdp_bh;
+		struct ext4_group_desc *gdp;
+
+		gdp = ext4_get_group_desc(sb, group, &gdp_bh);
+		gdp->bg_checksum = ext4_group_desc_csum(sbi, group, gdp);
+		mark_buffer_dirty(gdp_bh);
+	}
+
+	/* the snapshot is now an empty snapshot of the reverted file system */
+	err = ext4_get_inode_loc(rv.r_snapshot, &iloc);
+	if (err)
+		goto out;
+	lock_buffer(iloc.bh);
+	for (i = 0; i < EXT4_N_BLOCKS; i++) {
+		EXT4_I(rv.r_snapshot)->i_data[i] = 0;
+		ext4_raw_inode(&iloc)->i_block[i] = 0;
+	}
+	ext4_raw_inode(&iloc)->i_blocks_lo = 0;
+	ext4_raw_inode(&iloc)->i_blocks_high = 0;
+	rv.r_snapshot->i_blocks = 0;
+	unlock_buffer(iloc.bh);
+	mark_buffer_dirty(iloc.bh);
+	brelse(iloc.bh);
+
+	err = sync_blockdev(sb->s_bdev);
+	if (err)
+		goto out;
+	es->s_state = cpu_to_le16(state);
+	mark_buffer_dirty(sbi->s_sbh);
+	err = sync_dirty_buffer(sbi->s_sbh);
+	ext4_msg(sb, KERN_INFO, "reverted to snapshot (%u): %lu blocks "
+		 "copied, %lu blocks moved back", rv.r_snapshot->i_generation,
+		 rv.r_copied, rv.r_moved);
+out:
+	if (rv.r_owned) {
+		for (group = 0; group < ngroups; group++)
+			kfree(rv.r_owned[group]);
+		ext4_kvfree(rv.r_owned);
+	}
+	if (rv.r_others) {
+		for (group = 0; group < ngroups; group++)
+			kfree(rv.r_others[group]);
+		ext4_kvfree(rv.r_others);
+	}
+	ext4_kvfree(rv.r_cow_bitmap);
+	ext4_kvfree(rv.r_dirty);
+	ext4_kvfree(rv.r_meta);
+	iput(rv.r_snapshot);
+	return err;
+}
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_CONVERT
+/*
+ * Conversion of next3 snapshots:
+ *
+ * next3 and ext4 snapshot files have the same block map (the snapshot image
+ * starts at the first double indirect block and the extra triple indirect
+ * blocks replace the first direct blocks), the on-disk snapshot list is
+ * stored in the same inode and super block fields and the dynamic snapshot
+ * flags are not stored on-disk by either, so the snapshot files, the active
+ * snapshot and its COW bitmaps are used as they are.
+ *
+ * The only on-disk difference is where the exclude bitmaps are found.
+ * next3 maps the exclude bitmap of block group N at the (N+1)th block of the
+ * double indirect branch of the exclude inode.  ext4 records it in the group
+ * descriptor, where the next3 descriptor has reserved (zero) space.
+ * An exclude bitmap outside its block group is relocated, because ext4 does
+ * not accept that without flex_bg.  A missing exclude bitmap is allocated
+ * and the file system is marked for fsck to fix it.
+ */
+
+/* set (@use) or clear the bit of @block in its block bitmap */
+static int ext4_snapshot_convert_mark(struct super_block *sb,
+				      ext4_fsblk_t block, int use)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct buffer_head *bitmap_bh, *gdp_bh;
+	struct ext4_group_desc *gdp;
+	ext4_group_t group;
+	ext4_grpblk_t bit;
+	int changed, delta = use ? -1 : 1;
+
+	ext4_get_group_no_and_offset(sb, block, &group, &bit);
+	gdp = ext4_get_group_desc(sb, group, &gdp_bh);
+	if (!gdp)
+		return -EIO;
+	bitmap_bh = sb_bread(sb, ext4_block_bitmap(sb, gdp));
+	if (!bitmap_bh)
+		return -EIO;
+	lock_buffer(bitmap_bh);
+	if (use)
+		changed = !ext4_set_bit(bit, bitmap_bh->b_data);
+	else
+		changed = ext4_clear_bit(bit, bitmap_bh->b_data);
+	unlock_buffer(bitmap_bh);
+	if (changed) {
+		mark_buffer_dirty(bitmap_bh);
+		if (sbi->s_log_groups_per_flex)
+			ext4_flex_add(sbi, ext4_flex_group(sbi, group), 0,
+				      delta, 0);
+		ext4_free_blks_set(sb, gdp,
+				   ext4_free_blks_count(sb, gdp) + delta);
+		gdp->bg_checksum = ext4_group_desc_csum(sbi, group, gdp);
+		mark_buffer_dirty(gdp_bh);
+	}
+	brelse(bitmap_bh);
+	return 0;
+}
+
+/* allocate a block in @group, returns 0 if the group is full */
+static ext4_fsblk_t ext4_snapshot_convert_alloc(struct super_block *sb,
+						ext4_group_t group)
+{
+	struct buffer_head *bitmap_bh;
+	struct ext4_group_desc *gdp;
+	ext4_fsblk_t block;
+	ext4_grpblk_t bit;
+
+	gdp = ext4_get_group_desc(sb, group, NULL);
+	if (!gdp)
+		return 0;
+	bitmap_bh = sb_bread(sb, ext4_block_bitmap(sb, gdp));
+	if (!bitmap_bh)
+		return 0;
+	bit = ext4_find_next_zero_bit(bitmap_bh->b_data,
+				      EXT4_BLOCKS_PER_GROUP(sb), 0);
+	brelse(bitmap_bh);
+	if (bit >= EXT4_BLOCKS_PER_GROUP(sb))
+		return 0;
+	block = ext4_group_first_block_no(sb, group) + bit;
+	if (block >= ext4_blocks_count(EXT4_SB(sb)->s_es) ||
+	    ext4_snapshot_convert_mark(sb, block, 1))
+		return 0;
+	return block;
+}
+
+/*
+ * Record the next3 exclude bitmap @block of @group in the group descriptor.
+ * Returns 1 if the exclude bitmap was relocated or allocated.
+ */
+static int ext4_snapshot_convert_group(struct super_block *sb,
+				       ext4_group_t group, ext4_fsblk_t block)
+{
+	struct ext4_super_block *es = EXT4_SB(sb)->s_es;
+	struct buffer_head *gdp_bh, *bh, *old_bh = NULL;
+	struct ext4_group_desc *gdp;
+	ext4_fsblk_t first, last, new;
+	int relocated = 0;
+
+	gdp = ext4_get_group_desc(sb, group, &gdp_bh);
+	if (!gdp)
+		return -EIO;
+	if (EXT4_HAS_INCOMPAT_FEATURE(sb, EXT4_FEATURE_INCOMPAT_FLEX_BG)) {
+		first = le32_to_cpu(es->s_first_data_block);
+		last = ext4_blocks_count(es) - 1;
+	} else {
+		first = ext4_group_first_block_no(sb, group);
+		last = first + EXT4_BLOCKS_PER_GROUP(sb) - 1;
+		if (last >= ext4_blocks_count(es))
+			last = ext4_blocks_count(es) - 1;
+	}
+	if (block >= first && block <= last)
+		goto set;
+
+	new = ext4_snapshot_convert_alloc(sb, group);
+	if (!new) {
+		ext4_msg(sb, KERN_ERR, "no space for exclude bitmap "
+			 "of group %u", group);
+		return -ENOSPC;
+	}
+	if (block && block < ext4_blocks_count(es)) {
+		old_bh = sb_bread(sb, block);
+		if (!old_bh)
+			return -EIO;
+	}
+	bh = sb_getblk(sb, new);
+	if (!bh) {
+		brelse(old_bh);
+		return -EIO;
+	}
+	lock_buffer(bh);
+	if (old_bh)
+		memcpy(bh->b_data, old_bh->b_data, sb->s_blocksize);
+	else
+		memset(bh->b_data, 0, sb->s_blocksize);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	if (old_bh) {
+		brelse(old_bh);
+		if (ext4_snapshot_convert_mark(sb, block, 0))
+			return -EIO;
+	} else {
+		/* the excluded blocks of this group are unknown */
+		EXT4_SET_FLAGS(sb, EXT4_FLAGS_FIX_EXCLUDE);
+	}
+	snapshot_debug(1, "exclude bitmap of group %u moved from %llu to "
+		       "%llu\n", group, block, new);
+	block = new;
+	relocated = 1;
+set:
+	ext4_exclude_bitmap_set(sb, gdp, block);
+	gdp->bg_checksum = ext4_group_desc_csum(EXT4_SB(sb), group, gdp);
+	mark_buffer_dirty(gdp_bh);
+	return relocated;
+}
+
+/*
+ * ext4_snapshot_convert() converts a next3 file system with snapshots to
+ * ext4.
+ * Called from ext4_fill_super() with the 'snapshot_convert' mount option,
+ * after journal recovery and before snapshots are loaded, under the same
+ * rules as ext4_snapshot_revert().  The file system is marked with errors
+ * until all blocks are written, so fsck is forced if the conversion is
+ * interrupted.
+ */
+int ext4_snapshot_convert(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_super_block *es = sbi->s_es;
+	ext4_group_t group, ngroups = ext4_get_groups_count(sb);
+	int ptrs = EXT4_ADDR_PER_BLOCK(sb);
+	struct buffer_head *dind_bh = NULL, *ind_bh = NULL;
+	struct ext4_inode_info *ei;
+	struct inode *inode;
+	struct ext4_iloc iloc;
+	ext4_fsblk_t block;
+	__le32 *ind;
+	__u16 state = le16_to_cpu(es->s_state);
+	int i, relocated = 0, err;
+
+	if (!EXT4_HAS_COMPAT_FEATURE(sb, EXT4_FEATURE_COMPAT_EXCLUDE_INODE)) {
+		ext4_msg(sb, KERN_INFO, "no next3 exclude inode to convert");
+		return 0;
+	}
+	if (EXT4_HAS_COMPAT_FEATURE(sb, EXT4_FEATURE_COMPAT_EXCLUDE_BITMAP)) {
+		ext4_msg(sb, KERN_ERR, "file system has both exclude_inode "
+			 "and exclude_bitmap features");
+		return -EINVAL;
+	}
+
+	inode = ext4_iget(sb, EXT4_EXCLUDE_INO);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+	ei = EXT4_I(inode);
+	/* a healthy exclude inode has blocks only on the DIND branch */
+	err = -EIO;
+	for (i = 0; i < EXT4_N_BLOCKS; i++)
+		if (i != EXT4_DIND_BLOCK && ei->i_data[i])
+			break;
+	if (i < EXT4_N_BLOCKS || ngroups > ptrs * ptrs) {
+		ext4_msg(sb, KERN_ERR, "bad next3 exclude inode");
+		goto out;
+	}
+	if (ei->i_data[EXT4_DIND_BLOCK]) {
+		dind_bh = sb_bread(sb, le32_to_cpu(ei->i_data[EXT4_DIND_BLOCK]));
+		if (!dind_bh)
+			goto out;
+	}
+
+	/* force fsck if the conversion does not complete */
+	es->s_state = cpu_to_le16(state | EXT4_ERROR_FS);
+	mark_buffer_dirty(sbi->s_sbh);
+	err = sync_dirty_buffer(sbi->s_sbh);
+	if (err)
+		goto out;
+
+	for (group = 0; group < ngroups; group++) {
+		if (group % ptrs == 0) {
+			/* move on to the next indirect block */
+			brelse(ind_bh);
+			ind_bh = NULL;
+			ind = (__le32 *)(dind_bh ? dind_bh->b_data : NULL);
+			if (ind && ind[group / ptrs]) {
+				ind_bh = sb_bread(sb,
+					le32_to_cpu(ind[group / ptrs]));
+				if (!ind_bh) {
+					err = -EIO;
+					goto out;
+				}
+			}
+		}
+		ind = (__le32 *)(ind_bh ? ind_bh->b_data : NULL);
+		block = ind ? le32_to_cpu(ind[group % ptrs]) : 0;
+		err = ext4_snapshot_convert_group(sb, group, block);
+		if (err < 0)
+			goto out;
+		relocated += err;
+		cond_resched();
+	}
+
+	/*
+	 * Free the exclude inode indirect blocks, including those next3
+	 * allocated for the groups that the file system may grow to.
+	 * The exclude bitmaps are now owned by the group descriptors.
+	 */
+	err = 0;
+	if (dind_bh) {
+		ind = (__le32 *)dind_bh->b_data;
+		for (i = 0; !err && i < ptrs; i++)
+			if (ind[i])
+				err = ext4_snapshot_convert_mark(sb,
+						le32_to_cpu(ind[i]), 0);
+		if (!err)
+			err = ext4_snapshot_convert_mark(sb,
+						dind_bh->b_blocknr, 0);
+		if (err)
+			goto out;
+	}
+	err = ext4_get_inode_loc(inode, &iloc);
+	if (err)
+		goto out;
+	lock_buffer(iloc.bh);
+	for (i = 0; i < EXT4_N_BLOCKS; i++) {
+		ei->i_data[i] = 0;
+		ext4_raw_inode(&iloc)->i_block[i] = 0;
+	}
+	ext4_raw_inode(&iloc)->i_blocks_lo = 0;
+	ext4_raw_inode(&iloc)->i_blocks_high = 0;
+	ext4_isize_set(ext4_raw_inode(&iloc), 0);
+	inode->i_blocks = 0;
+	i_size_write(inode, 0);
+	ei->i_disksize = 0;
+	unlock_buffer(iloc.bh);
+	mark_buffer_dirty(iloc.bh);
+	brelse(iloc.bh);
+
+	EXT4_CLEAR_COMPAT_FEATURE(sb, EXT4_FEATURE_COMPAT_EXCLUDE_INODE);
+	EXT4_SET_COMPAT_FEATURE(sb, EXT4_FEATURE_COMPAT_EXCLUDE_BITMAP);
+	err = sync_blockdev(sb->s_bdev);
+	if (err)
+		goto out;
+	es->s_state = cpu_to_le16(state);
+	mark_buffer_dirty(sbi->s_sbh);
+	err = sync_dirty_buffer(sbi->s_sbh);
+	ext4_msg(sb, KERN_INFO, "converted next3 snapshots: exclude bitmaps "
+		 "of %u groups (%d relocated)", ngroups, relocated);
+	if (EXT4_TEST_FLAGS(sb, EXT4_FLAGS_FIX_EXCLUDE))
+		ext4_msg(sb, KERN_WARNING, "some exclude bitmaps were "
+			 "missing - run fsck");
+out:
+	brelse(ind_bh);
+	brelse(dind_bh);
+	iput(inode);
+	return err;
+}
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+/*
+ * ext4_snapshot_fill_stats() reports the space held by snapshot @inode from
+ * counters that are updated by COW, move and merge, and from the blocks
+ * count of the snapshot file, which is updated by shrink and merge.
+ * Delete of the oldest snapshot frees all its blocks.  Blocks of a newer
+ * snapshot may be needed by older snapshots and merged into them on
+ * delete, which cannot be known without scanning, so the freed blocks are
+ * reported as 0 with the EXT4_SNAPSHOT_STATS_SHARED flag.
+ * Called under snapshot_mutex for a snapshot on the list.
+ */
+static void ext4_snapshot_fill_stats(struct inode *inode,
+				     struct ext4_snapshot_stats *stats)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode), *older;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->ss_id = inode->i_generation;
+	stats->ss_blocks = inode->i_blocks >> (inode->i_blkbits - 9);
+	stats->ss_cowed = atomic64_read(&ei->i_snapshot_cowed);
+	stats->ss_moved = atomic64_read(&ei->i_snapshot_moved);
+	stats->ss_merged = atomic64_read(&ei->i_snapshot_merged);
+	if (ei->i_snapshot_stats_partial)
+		stats->ss_flags |= EXT4_SNAPSHOT_STATS_PARTIAL;
+
+	/* older snapshots are closer to the list tail */
+	older = ei;
+	list_for_each_entry_continue(older,
+				     &EXT4_SB(inode->i_sb)->s_snapshot_list,
+				     i_snaplist) {
+		if (!ext4_test_inode_flag(&older->vfs_inode,
+					  EXT4_INODE_SNAPFILE_DELETED)) {
+			stats->ss_flags |= EXT4_SNAPSHOT_STATS_SHARED;
+			break;
+		}
+	}
+	if (!(stats->ss_flags & EXT4_SNAPSHOT_STATS_SHARED))
+		stats->ss_freeable = stats->ss_blocks;
+}
+
+/*
+ * ext4_snapshot_get_stats() reports the space held by snapshot @inode.
+ * Called from ext4_ioctl() without i_mutex.
+ */
+int ext4_snapshot_get_stats(struct inode *inode,
+			    struct ext4_snapshot_stats __user *ustats)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext4_snapshot_stats stats;
+	int err = 0;
+
+	ext4_snapshot_mutex_lock(sb);
+	if (ext4_snapshot_list(inode))
+		ext4_snapshot_fill_stats(inode, &stats);
+	else
+		err = -EINVAL;
+	ext4_snapshot_mutex_unlock(sb);
+	if (!err && copy_to_user(ustats, &stats, sizeof(stats)))
+		err = -EFAULT;
+	return err;
+}
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_QUERY
+/*
+ * ext4_snapshot_query_flags() returns the snapshot state flags of @inode,
+ * as ext4_snapshot_get_flags() would report them on lsattr of the
+ * snapshot file, without a file of the snapshot and without updating the
+ * in-memory state.
+ * Called under snapshot_mutex.
+ */
+static unsigned int ext4_snapshot_query_flags(struct inode *inode)
+{
+	unsigned int flags = ext4_get_snapstate_flags(inode);
+	struct dentry *dentry;
+
+	flags &= ~(1UL<<EXT4_SNAPSTATE_OPEN | 1UL<<EXT4_SNAPSTATE_DELETED |
+		   1UL<<EXT4_SNAPSTATE_SHRUNK);
+	/* snapshot has no hard links - 1 count is our own reference */
+	dentry = d_find_alias(inode);
+	if (dentry) {
+		if (dentry->d_count > 1)
+			flags |= 1UL<<EXT4_SNAPSTATE_OPEN;
+		dput(dentry);
+	}
+	if (ext4_test_inode_flag(inode, EXT4_INODE_SNAPFILE_DELETED))
+		flags |= 1UL<<EXT4_SNAPSTATE_DELETED;
+	if (ext4_test_inode_flag(inode, EXT4_INODE_SNAPFILE_SHRUNK))
+		flags |= 1UL<<EXT4_SNAPSTATE_SHRUNK;
+	return flags;
+}
+
+/*
+ * ext4_snapshot_query() reports the state, size, progress and space
+ * counters of up to @uquery->sq_count snapshots on the snapshot list,
+ * newest first, in @uquery->sq_info[] and returns the number of snapshots
+ * on the list in @uquery->sq_count, so monitoring does not need to open
+ * and ioctl every snapshot file.
+ * The entries are collected under snapshot_mutex, which serializes them
+ * with take, update and cleanup, and copied to user after it is released.
+ * Called from ext4_ioctl() on any file of the file system.
+ */
+int ext4_snapshot_query(struct super_block *sb,
+			struct ext4_snapshot_query __user *uquery)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_snapshot_query query;
+	struct ext4_snapshot_info *info = NULL, *si;
+	struct ext4_inode_info *ei;
+	struct inode *inode;
+	__u32 n = 0, max;
+	int err = 0;
+
+	if (copy_from_user(&query, uquery, sizeof(query)))
+		return -EFAULT;
+	if (query.sq_flags)
+		return -EINVAL;
+
+	max = min_t(__u32, query.sq_count, EXT4_SNAPSHOT_QUERY_MAX);
+	if (max) {
+		info = kcalloc(max, sizeof(*info), GFP_KERNEL);
+		if (!info)
+			return -ENOMEM;
+	}
+
+	ext4_snapshot_mutex_lock(sb);
+	list_for_each_entry(ei, &sbi->s_snapshot_list, i_snaplist) {
+		if (n++ >= max)
+			continue;
+		inode = &ei->vfs_inode;
+		si = &info[n - 1];
+		si->si_ino = inode->i_ino;
+		si->si_flags = ext4_snapshot_query_flags(inode);
+		si->si_size = SNAPSHOT_SIZE(inode);
+		si->si_progress = SNAPSHOT_PROGRESS(inode);
+		ext4_snapshot_fill_stats(inode, &si->si_stats);
+	}
+	ext4_snapshot_mutex_unlock(sb);
+
+	if (put_user(n, &uquery->sq_count) ||
+	    (info && copy_to_user(uquery->sq_info, info,
+				  min(n, max) * sizeof(*info))))
+		err = -EFAULT;
+	kfree(info);
+	return err;
+}
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_GROUP_STATS
+/*
+ * /proc/fs/ext4/<dev>/snapshot_groups shows the snapshot events in every
+ * block group since the last snapshot take, one line per group, in the
+ * format of /proc/fs/ext4/<dev>/mb_groups, so hot groups stand out.
+ */
+static void *ext4_snapshot_seq_groups_start(struct seq_file *seq,
+					    loff_t *pos)
+{
+	struct super_block *sb = seq->private;
+
+	if (*pos < 0 || *pos >= ext4_get_groups_count(sb))
+		return NULL;
+	return (void *) ((unsigned long) *pos + 1);
+}
+
+static void *ext4_snapshot_seq_groups_next(struct seq_file *seq, void *v,
+					   loff_t *pos)
+{
+	++*pos;
+	return ext4_snapshot_seq_groups_start(seq, pos);
+}
+
+static int ext4_snapshot_seq_groups_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	ext4_group_t group = (ext4_group_t) ((unsigned long) v) - 1;
+	struct ext4_group_info *grp = ext4_get_group_info(sb, group);
+
+	if (group == 0)
+		seq_printf(seq, "#%-5s: %-10s %-10s %-7s %-10s\n",
+			   "group", "cowed", "moved", "bitmap", "waits");
+	seq_printf(seq, "#%-5u: %-10u %-10u %-7u %-10u\n", group,
+		   atomic_read(&grp->bg_snapshot_stats[EXT4_SNAPSHOT_GROUP_COW]),
+		   atomic_read(&grp->bg_snapshot_stats[EXT4_SNAPSHOT_GROUP_MOVE]),
+		   atomic_read(&grp->bg_snapshot_stats[EXT4_SNAPSHOT_GROUP_BITMAP]),
+		   atomic_read(&grp->bg_snapshot_stats[EXT4_SNAPSHOT_GROUP_WAIT]));
+	return 0;
+}
+
+static void ext4_snapshot_seq_groups_stop(struct seq_file *seq, void *v)
+{
+}
+
+static const struct seq_operations ext4_snapshot_seq_groups_ops = {
+	.start  = ext4_snapshot_seq_groups_start,
+	.next   = ext4_snapshot_seq_groups_next,
+	.stop   = ext4_snapshot_seq_groups_stop,
+	.show   = ext4_snapshot_seq_groups_show,
+};
+
+static int ext4_snapshot_seq_groups_open(struct inode *inode,
+					 struct file *file)
+{
+	int rc;
+
+	rc = seq_open(file, &ext4_snapshot_seq_groups_ops);
+	if (rc == 0) {
+		struct seq_file *m = file->private_data;
+		m->private = PDE(inode)->data;
+	}
+	return rc;
+}
+
+const struct file_operations ext4_snapshot_seq_groups_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ext4_snapshot_seq_groups_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= seq_release,
+};
+
+#endif
+#if defined(CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_ASYNC) || \
+	defined(CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_GROUP)
+/*
+ * ext4_snapshot_take_create() sets the list flag of a snapshot file,
+ * which creates the snapshot, as EXT4_IOC_SETSNAPFLAGS does before
+ * snapshot_take().
+ * Called under i_mutex and snapshot_mutex.
+ */
+static int ext4_snapshot_take_create(struct inode *inode)
+{
+	handle_t *handle;
+	struct ext4_iloc iloc;
+	int err;
+
+	handle = ext4_journal_start(inode, 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	err = ext4_reserve_inode_write(handle, inode, &iloc);
+	if (!err) {
+		err = ext4_snapshot_set_flags(handle, inode,
+				ext4_get_snapstate_flags(inode) |
+				1UL<<EXT4_SNAPSTATE_LIST);
+		if (!err)
+			err = ext4_mark_iloc_dirty(handle, inode, &iloc);
+		else
+			brelse(iloc.bh);
+	}
+	ext4_journal_stop(handle);
+	return err;
+}
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_ASYNC
+/*
+ * Asynchronous snapshot take.
+ * EXT4_IOC_SNAPSHOT_TAKE_ASYNC queues a take request with a ticket and
+ * returns.  The requests of a file system are run in queue order by a single
+ * work item, which does what EXT4_IOC_SETSNAPFLAGS does when setting the
+ * list flag: snapshot_{set_flags,take,update}() under snapshot_mutex.
+ * A request holds write access to the mount and a reference to the snapshot
+ * inode until it completes, so the file system cannot be remounted read-only
+ * or unmounted under a queued take.
+ */
+struct ext4_snapshot_take_req {
+	struct list_head list;
+	struct inode *inode;
+	struct vfsmount *mnt;
+	struct eventfd_ctx *eventfd;
+	__u64 ticket;
+};
+
+static int ext4_snapshot_take_queued(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	int err, ret;
+
+	mutex_lock(&inode->i_mutex);
+	if (ext4_snapshot_list(inode)) {
+		/* snapshot was taken since the request was queued */
+		mutex_unlock(&inode->i_mutex);
+		return -EEXIST;
+	}
+
+	/* same lock order as EXT4_IOC_SETSNAPFLAGS */
+	ext4_snapshot_mutex_lock(sb);
+	err = ext4_snapshot_take_create(inode);
+	if (!err)
+		err = ext4_snapshot_take(inode);
+	/* update snapshots list even if take failed */
+	ret = ext4_snapshot_update_inode(inode, 0);
+	if (!err)
+		err = ret;
+	ext4_snapshot_mutex_unlock(sb);
+	mutex_unlock(&inode->i_mutex);
+	return err;
+}
+
+/*
+ * Run the queued take requests of a file system in ticket order.
+ * The work is only scheduled by the request that finds the queue empty and
+ * it runs until the queue is empty again, so it is never pending without a
+ * queued request.  The mount reference of the last request is dropped last,
+ * because it may be the last reference to the file system.
+ */
+void ext4_snapshot_take_work(struct work_struct *work)
+{
+	struct ext4_sb_info *sbi = container_of(work, struct ext4_sb_info,
+						s_snapshot_take_work);
+	struct ext4_snapshot_take_req *req;
+	struct vfsmount *mnt;
+	int err, last;
+
+	do {
+		spin_lock(&sbi->s_snapshot_take_lock);
+		req = list_first_entry(&sbi->s_snapshot_take_list,
+				       struct ext4_snapshot_take_req, list);
+		spin_unlock(&sbi->s_snapshot_take_lock);
+
+		err = ext4_snapshot_take_queued(req->inode);
+		snapshot_debug(1, "snapshot (%u) async take ticket (%llu) "
+			       "completed (err=%d)\n",
+			       req->inode->i_generation,
+			       (unsigned long long)req->ticket, err);
+		iput(req->inode);
+
+		spin_lock(&sbi->s_snapshot_take_lock);
+		list_del(&req->list);
+		sbi->s_snapshot_take_done = req->ticket;
+		sbi->s_snapshot_take_err = err;
+		last = list_empty(&sbi->s_snapshot_take_list);
+		spin_unlock(&sbi->s_snapshot_take_lock);
+
+		if (req->eventfd) {
+			eventfd_signal(req->eventfd, 1);
+			eventfd_ctx_put(req->eventfd);
+		}
+		mnt = req->mnt;
+		kfree(req);
+		mnt_drop_write(mnt);
+		mntput(mnt);
+	} while (!last);
+}
+
+/*
+ * ext4_snapshot_take_async() queues the take of a created snapshot file
+ * and returns the ticket of the request in @utake->st_ticket.
+ * Called from ext4_ioctl().
+ */
+int ext4_snapshot_take_async(struct file *filp,
+			     struct ext4_snapshot_take __user *utake)
+{
+	struct inode *inode = filp->f_dentry->d_inode;
+	struct ext4_sb_info *sbi = EXT4_SB(inode->i_sb);
+	struct ext4_snapshot_take take;
+	struct ext4_snapshot_take_req *req;
+	int err, first;
+
+	if (copy_from_user(&take, utake, sizeof(take)))
+		return -EFAULT;
+	if (take.st_flags)
+		return -EINVAL;
+	if (ext4_snapshot_list(inode))
+		return -EEXIST;
+
+	req = kzalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+	if (take.st_eventfd >= 0) {
+		req->eventfd = eventfd_ctx_fdget(take.st_eventfd);
+		if (IS_ERR(req->eventfd)) {
+			err = PTR_ERR(req->eventfd);
+			goto out_free;
+		}
+	}
+	err = mnt_want_write(filp->f_path.mnt);
+	if (err)
+		goto out_eventfd;
+	req->mnt = mntget(filp->f_path.mnt);
+	req->inode = igrab(inode);
+
+	spin_lock(&sbi->s_snapshot_take_lock);
+	req->ticket = take.st_ticket = ++sbi->s_snapshot_take_queued;
+	first = list_empty(&sbi->s_snapshot_take_list);
+	list_add_tail(&req->list, &sbi->s_snapshot_take_list);
+	spin_unlock(&sbi->s_snapshot_take_lock);
+	/* from here on, the request may be completed and freed */
+	if (first)
+		schedule_work(&sbi->s_snapshot_take_work);
+
+	snapshot_debug(1, "snapshot (%u) async take queued with ticket "
+		       "(%llu)\n", inode->i_generation,
+		       (unsigned long long)take.st_ticket);
+	if (put_user(take.st_ticket, &utake->st_ticket))
+		return -EFAULT;
+	return 0;
+
+out_eventfd:
+	if (req->eventfd)
+		eventfd_ctx_put(req->eventfd);
+out_free:
+	kfree(req);
+	return err;
+}
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_SCHED
+/*
+ * Periodic snapshot scheduler.
+ * A delayed work item polls the schedule of a file system every
+ * EXT4_SNAPSHOT_SCHED_POLL and samples the journal commit rate.  The next
+ * snapshot is due snapshot_sched_interval seconds after the newest snapshot
+ * was created, plus a random delay of up to snapshot_sched_jitter seconds,
+ * so file systems that were configured together don't take together.
+ * From then on, the snapshot is taken on the first poll with no more than
+ * snapshot_sched_idle journal commits, or at the end of the jitter window.
+ * Snapshots are created in the snapshot directory snapshot_sched_dir,
+ * which is a directory with the snapshot file flag, and taken like queued
+ * async takes.  The poll holds s_umount for read, so the file system
+ * cannot be remounted read-only or unmounted under the take, and the take
+ * freezes only the journal, because freeze_super() needs s_umount.
+ */
+
+/* no creation time in small inodes */
+#define ext4_snapshot_sched_ctime(inode)		\
+	(EXT4_I(inode)->i_crtime.tv_sec ? :		\
+	 (inode)->i_ctime.tv_sec)
+
+/*
+ * Create a snapshot file in the snapshot directory, named after the
+ * current time.  On success, returns the new file with a reference
+ * in *@inodep and the directory entry of the file.
+ */
+static struct dentry *ext4_snapshot_sched_create(struct super_block *sb,
+						 struct inode **inodep)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct inode *dir;
+	struct dentry *parent, *dentry;
+	struct tm tm;
+	char name[32];
+	int len, err;
+
+	dir = ext4_iget(sb, sbi->s_snapshot_sched_dir);
+	if (IS_ERR(dir))
+		return ERR_CAST(dir);
+	if (!S_ISDIR(dir->i_mode) ||
+	    !ext4_test_inode_flag(dir, EXT4_INODE_SNAPFILE)) {
+		iput(dir);
+		return ERR_PTR(-ENOTDIR);
+	}
+	/* consumes the reference to dir */
+	parent = d_obtain_alias(dir);
+	if (IS_ERR(parent))
+		return parent;
+
+	time_to_tm(get_seconds(), 0, &tm);
+	len = snprintf(name, sizeof(name), "%04ld%02d%02d-%02d%02d%02d",
+		       tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+		       tm.tm_hour, tm.tm_min, tm.tm_sec);
+
+	mutex_lock_nested(&dir->i_mutex, I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, parent, len);
+	if (IS_ERR(dentry))
+		goto out;
+	if (dentry->d_inode)
+		err = -EEXIST;
+	else
+		err = vfs_create(dir, dentry, S_IFREG | S_IRUSR, NULL);
+	if (err) {
+		dput(dentry);
+		dentry = ERR_PTR(err);
+		goto out;
+	}
+	*inodep = igrab(dentry->d_inode);
+out:
+	mutex_unlock(&dir->i_mutex);
+	dput(parent);
+	return dentry;
+}
+
+/*
+ * Create a snapshot file and take it.  The file of a failed take is
+ * removed.
+ */
+static int ext4_snapshot_sched_take(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct inode *inode = NULL, *dir;
+	struct dentry *dentry;
+	int err;
+
+	dentry = ext4_snapshot_sched_create(sb, &inode);
+	if (IS_ERR(dentry))
+		return PTR_ERR(dentry);
+
+	sbi->s_snapshot_sched_task = current;
+	err = ext4_snapshot_take_queued(inode);
+	sbi->s_snapshot_sched_task = NULL;
+	if (err) {
+		dir = dentry->d_parent->d_inode;
+		mutex_lock_nested(&dir->i_mutex, I_MUTEX_PARENT);
+		/* not a snapshot on the list, so it may be unlinked */
+		if (dentry->d_inode == inode && !ext4_snapshot_list(inode))
+			vfs_unlink(dir, dentry);
+		mutex_unlock(&dir->i_mutex);
+	}
+	snapshot_debug(1, "snapshot (%u) scheduled take completed (err=%d)\n",
+		       inode->i_generation, err);
+	iput(inode);
+	dput(dentry);
+	return err;
+}
+
+/*
+ * Mark the oldest snapshots beyond the retention count and the snapshots
+ * older than the retention age as deleted, and leave the rest of the job
+ * to the cleanup thread.  The active snapshot and snapshots that are
+ * enabled or in use by enabled snapshots are not expired.
+ */
+static int ext4_snapshot_sched_expire(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	unsigned int keep = sbi->s_snapshot_sched_keep;
+	unsigned int max_age = sbi->s_snapshot_sched_max_age;
+	struct ext4_inode_info *ei;
+	struct inode *inode;
+	handle_t *handle;
+	unsigned long now = get_seconds();
+	int live = 0, expired = 0, err = 0;
+
+	if (!keep && !max_age)
+		return 0;
+
+	ext4_snapshot_mutex_lock(sb);
+	list_for_each_entry(ei, &sbi->s_snapshot_list, i_snaplist)
+		if (!ext4_test_inode_flag(&ei->vfs_inode,
+					  EXT4_INODE_SNAPFILE_DELETED))
+			live++;
+
+	/* oldest snapshot first */
+	list_for_each_entry_reverse(ei, &sbi->s_snapshot_list, i_snaplist) {
+		inode = &ei->vfs_inode;
+		if (ext4_test_inode_flag(inode, EXT4_INODE_SNAPFILE_DELETED))
+			continue;
+		if (!(keep && live > keep) &&
+		    !(max_age && now - ext4_snapshot_sched_ctime(inode) >=
+		      max_age))
+			/* newer snapshots are not expired either */
+			break;
+		if (ext4_snapshot_is_active(inode) ||
+		    ext4_test_inode_snapstate(inode, EXT4_SNAPSTATE_ENABLED) ||
+		    ext4_test_inode_snapstate(inode, EXT4_SNAPSTATE_INUSE))
+			continue;
+
+		handle = ext4_journal_start(inode, 1);
+		if (IS_ERR(handle)) {
+			err = PTR_ERR(handle);
+			break;
+		}
+		ext4_set_inode_flag(inode, EXT4_INODE_SNAPFILE_DELETED);
+		err = ext4_mark_inode_dirty(handle, inode);
+		ext4_journal_stop(handle);
+		if (err)
+			break;
+		snapshot_debug(1, "snapshot (%u) expired by scheduler\n",
+			       inode->i_generation);
+		sbi->s_snapshot_sched_expired++;
+		expired++;
+		live--;
+	}
+	/* shrink and remove expired snapshots in the background */
+	if (expired && !ext4_snapshot_wake_cleanup(sb)) {
+		int ret = ext4_snapshot_update(sb, 1, 0);
+
+		if (!err)
+			err = ret;
+	}
+	ext4_snapshot_mutex_unlock(sb);
+	return err;
+}
+
+/*
+ * Take a snapshot if it is due and the file system is idle or the jitter
+ * window is over.  @commits is the no. of journal commits since the last
+ * poll.  Called under s_umount.
+ */
+static void ext4_snapshot_sched_run(struct super_block *sb,
+				    unsigned int commits)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	unsigned int interval = sbi->s_snapshot_sched_interval;
+	unsigned int jitter = sbi->s_snapshot_sched_jitter;
+	unsigned long now = get_seconds(), last, due;
+	struct inode *active;
+	int err;
+
+	ext4_snapshot_mutex_lock(sb);
+	active = sbi->s_active_snapshot;
+	last = active ? ext4_snapshot_sched_ctime(active) : 0;
+	ext4_snapshot_mutex_unlock(sb);
+
+	if (!last && !sbi->s_snapshot_sched_last)
+		/* no snapshots - schedule the first one from now */
+		sbi->s_snapshot_sched_last = now;
+	/* the last scheduled take, or a newer manual take */
+	last = max(last, sbi->s_snapshot_sched_last);
+	due = last + interval;
+	if (jitter)
+		due += sbi->s_snapshot_sched_delay % jitter;
+	if (now < due)
+		return;
+	if (commits > sbi->s_snapshot_sched_idle && now < due + jitter)
+		/* wait for the file system to be idle */
+		return;
+
+	err = ext4_snapshot_sched_take(sb);
+	sbi->s_snapshot_sched_err = err;
+	/* on failure, retry on the next interval */
+	sbi->s_snapshot_sched_last = now;
+	sbi->s_snapshot_sched_delay = random32();
+	if (err) {
+		ext4_msg(sb, KERN_WARNING, "scheduled snapshot take "
+			 "failed (err=%d)", err);
+		return;
+	}
+	sbi->s_snapshot_sched_taken++;
+}
+
+void ext4_snapshot_sched_work(struct work_struct *work)
+{
+	struct ext4_sb_info *sbi = container_of(work, struct ext4_sb_info,
+						s_snapshot_sched_work.work);
+	struct super_block *sb = sbi->s_snapshot_sched_sb;
+	tid_t tid = sbi->s_journal->j_commit_sequence;
+	unsigned int commits = tid - sbi->s_snapshot_sched_tid;
+
+	sbi->s_snapshot_sched_tid = tid;
+	if (!sbi->s_snapshot_sched_interval && !sbi->s_snapshot_sched_keep &&
+	    !sbi->s_snapshot_sched_max_age)
+		goto out;
+	/* umount and remount wait for the poll, never the other way */
+	if (!down_read_trylock(&sb->s_umount))
+		goto out;
+	if (!(sb->s_flags & MS_RDONLY) && sb->s_frozen == SB_UNFROZEN) {
+		if (sbi->s_snapshot_sched_interval &&
+		    sbi->s_snapshot_sched_dir)
+			ext4_snapshot_sched_run(sb, commits);
+		ext4_snapshot_sched_expire(sb);
+	}
+	up_read(&sb->s_umount);
+out:
+	schedule_delayed_work(&sbi->s_snapshot_sched_work,
+			      EXT4_SNAPSHOT_SCHED_POLL);
+}
+
+/*
+ * Start polling the snapshot schedule.
+ * Called from ext4_fill_super() after snapshot_load().
+ */
+void ext4_snapshot_start_sched(struct super_block *sb)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+
+	sbi->s_snapshot_sched_tid = sbi->s_journal->j_commit_sequence;
+	sbi->s_snapshot_sched_delay = random32();
+	schedule_delayed_work(&sbi->s_snapshot_sched_work,
+			      EXT4_SNAPSHOT_SCHED_POLL);
+}
+
+/*
+ * Stop polling the snapshot schedule.
+ * Called from ext4_put_super() under s_umount, so a running poll has
+ * either completed its take or will not start one.
+ */
+void ext4_snapshot_stop_sched(struct super_block *sb)
+{
+	cancel_delayed_work_sync(&EXT4_SB(sb)->s_snapshot_sched_work);
+}
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_GROUP
+/*
+ * Snapshot group take.
+ * Takes snapshots of several file systems at the same point in time.
+ * The members are locked in super block address order, so concurrent
+ * group takes cannot deadlock.  All members are synced and prepared before
+ * any of them is frozen, so the sync under freeze_super() has little left
+ * to write, and the active snapshot is switched on all members while they
+ * are all frozen.  If a member fails to freeze or to take, the remaining
+ * members are not taken and the error is returned; snapshots that were
+ * already taken are kept.
+ */
+#define snapshot_group_inode(file)	((file)->f_dentry->d_inode)
+#define snapshot_group_sb(file)		(snapshot_group_inode(file)->i_sb)
+
+static void ext4_snapshot_group_sort(struct file **files, int n)
+{
+	struct file *file;
+	int i, j;
+
+	for (i = 1; i < n; i++) {
+		file = files[i];
+		for (j = i; j > 0 && snapshot_group_sb(files[j - 1]) >
+			     snapshot_group_sb(file); j--)
+			files[j] = files[j - 1];
+		files[j] = file;
+	}
+}
+
+/*
+ * ext4_snapshot_take_group() takes the snapshot file @filp and the
+ * snapshot files in @ugroup->sg_fds[] together.
+ * Called from ext4_ioctl().
+ */
+int ext4_snapshot_take_group(struct file *filp,
+			     struct ext4_snapshot_group __user *ugroup)
+{
+	struct super_block *sb = snapshot_group_sb(filp);
+	struct file *files[EXT4_SNAPSHOT_GROUP_MAX];
+	struct ext4_snapshot_group group;
+	struct inode *inode;
+	int n = 0, nwrite = 0, nlocked = 0, nfrozen = 0, ntaken = 0;
+	int i, fd, err = 0, ret;
+
+	if (copy_from_user(&group, ugroup, sizeof(group)))
+		return -EFAULT;
+	if (group.sg_flags || group.sg_count >= EXT4_SNAPSHOT_GROUP_MAX)
+		return -EINVAL;
 
-	sbi->s_es->s_snapshot_id =
-		cpu_to_le32(le32_to_cpu(sbi->s_es->s_snapshot_id) + 1);
-	if (sbi->s_es->s_snapshot_id == 0)
-		/* 0 is not a valid snapshot id */
-		sbi->s_es->s_snapshot_id = cpu_to_le32(1);
-	sbi->s_es->s_snapshot_inum = cpu_to_le32(inode->i_ino);
-	ext4_snapshot_set_tid(sb);
+	get_file(filp);
+	files[n++] = filp;
+	for (i = 0; i < group.sg_count; i++) {
+		if (get_user(fd, &ugroup->sg_fds[i])) {
+			err = -EFAULT;
+			goto out_put;
+		}
+		files[n] = fget(fd);
+		if (!files[n]) {
+			err = -EBADF;
+			goto out_put;
+		}
+		inode = snapshot_group_inode(files[n++]);
+		if (inode->i_sb->s_op != sb->s_op ||
+		    !EXT4_SNAPSHOTS(inode->i_sb) ||
+		    !ext4_snapshot_file(inode)) {
+			err = -EINVAL;
+			goto out_put;
+		}
+	}
 
-	err = 0;
-out_unlockfs:
-	unlock_super(sb);
-	thaw_super(sb);
+	ext4_snapshot_group_sort(files, n);
+	for (i = 1; i < n; i++) {
+		/* one snapshot per file system */
+		if (snapshot_group_sb(files[i]) ==
+		    snapshot_group_sb(files[i - 1])) {
+			err = -EINVAL;
+			goto out_put;
+		}
+	}
 
-	if (err)
-		goto out_err;
+	for (nwrite = 0; nwrite < n; nwrite++) {
+		err = mnt_want_write(files[nwrite]->f_path.mnt);
+		if (err)
+			goto out_drop_write;
+	}
 
-	snapshot_debug(1, "snapshot (%u) has been taken\n",
-			inode->i_generation);
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_DUMP
-	ext4_snapshot_dump(5, inode);
-#endif
+	/* create all snapshots - same lock order as EXT4_IOC_SETSNAPFLAGS */
+	for (nlocked = 0; nlocked < n; nlocked++) {
+		inode = snapshot_group_inode(files[nlocked]);
+		mutex_lock(&inode->i_mutex);
+		ext4_snapshot_mutex_lock(inode->i_sb);
+		if (ext4_snapshot_list(inode))
+			err = -EEXIST;
+		else
+			err = ext4_snapshot_take_create(inode);
+		if (err) {
+			nlocked++;
+			goto out_update;
+		}
+	}
 
-out_err:
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
-	brelse(exclude_bitmap_bh);
-#endif
-	brelse(es_bh);
-	brelse(sbh);
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_INIT
-	for (i = 0; i < COPY_INODE_BLOCKS_NUM; i++)
-		brelse(bhs[i]);
+	/* sync and prepare all members before freezing any of them */
+	for (i = 0; i < n; i++) {
+		inode = snapshot_group_inode(files[i]);
+		/* stop prebuilding COW bitmaps of the previous snapshot */
+		ext4_snapshot_stop_prebuild(inode->i_sb);
+		sync_filesystem(inode->i_sb);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_PREPARE
+		ext4_snapshot_take_prepare(inode);
 #endif
+	}
+
+	for (nfrozen = 0; nfrozen < n; nfrozen++) {
+		err = freeze_super(snapshot_group_sb(files[nfrozen]));
+		if (err)
+			goto out_thaw;
+	}
+	for (ntaken = 0; ntaken < n; ntaken++) {
+		err = __ext4_snapshot_take(snapshot_group_inode(files[ntaken]),
+					   1);
+		if (err)
+			break;
+	}
+out_thaw:
+	for (i = 0; i < nfrozen; i++)
+		thaw_super(snapshot_group_sb(files[i]));
+	/* prebuild COW bitmaps of the new active snapshots */
+	for (i = 0; i < ntaken; i++)
+		ext4_snapshot_start_prebuild(snapshot_group_sb(files[i]));
+	snapshot_debug(1, "group take of %d snapshots: %d taken (err=%d)\n",
+		       n, ntaken, err);
+out_update:
+	while (nlocked-- > 0) {
+		inode = snapshot_group_inode(files[nlocked]);
+		/* update snapshots list even if take failed */
+		ret = ext4_snapshot_update_inode(inode, 0);
+		if (!err)
+			err = ret;
+		ext4_snapshot_mutex_unlock(inode->i_sb);
+		mutex_unlock(&inode->i_mutex);
+	}
+out_drop_write:
+	while (nwrite-- > 0)
+		mnt_drop_write(files[nwrite]->f_path.mnt);
+out_put:
+	while (n-- > 0)
+		fput(files[n]);
 	return err;
 }
+#endif
 
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP
 /*
@@ -1291,6 +4751,12 @@ static int ext4_snapshot_enable(struct inode *inode)
 	 */
 	SNAPSHOT_SET_ENABLED(inode);
 	ext4_set_inode_snapstate(inode, EXT4_SNAPSTATE_ENABLED);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_BDEV
+	/* the snapshot file can still be loop mounted without the device */
+	if (ext4_snapshot_add_bdev(inode))
+		snapshot_debug(1, "failed to export snapshot (%u) "
+			       "as block device\n", inode->i_generation);
+#endif
 
 	/* Don't need i_size_read because we hold i_mutex */
 	snapshot_debug(4, "setting snapshot (%u) i_size to (%lld)\n",
@@ -1319,6 +4785,15 @@ static int ext4_snapshot_disable(struct inode *inode)
 		return -EPERM;
 	}
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_BDEV
+	if (ext4_snapshot_remove_bdev(inode, 0)) {
+		snapshot_debug(1, "disable of snapshot (%u) with open "
+			       "block device is not permitted\n",
+			       inode->i_generation);
+		return -EBUSY;
+	}
+
+#endif
 	/* reset i_size and invalidate page cache */
 	SNAPSHOT_SET_DISABLED(inode);
 	ext4_clear_inode_snapstate(inode, EXT4_SNAPSTATE_ENABLED);
@@ -1371,6 +4846,9 @@ static int ext4_snapshot_remove(struct inode *inode)
 	handle_t *handle;
 	struct ext4_sb_info *sbi;
 	int err = 0, ret;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_RCU
+	int list_ref = 0;
+#endif
 
 	/* elevate ref count until final cleanup */
 	if (!igrab(inode))
@@ -1416,8 +4894,13 @@ static int ext4_snapshot_remove(struct inode *inode)
 	err = ext4_snapshot_list_del(handle, inode);
 	if (err)
 		goto out_handle;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_RCU
+	/* remove snapshot list reference after transaction and grace period */
+	list_ref = 1;
+#else
 	/* remove snapshot list reference - taken on snapshot_create() */
 	iput(inode);
+#endif
 #else
 	lock_super(inode->i_sb);
 	err = ext4_journal_get_write_access(handle, sbi->s_sbh);
@@ -1445,6 +4928,18 @@ out_handle:
 	ret = ext4_journal_stop(handle);
 	if (!err)
 		err = ret;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_RCU
+	if (list_ref) {
+		/*
+		 * Wait for read through walks, which may have found this
+		 * snapshot on the list, before dropping the list reference.
+		 * Not under the transaction, because a reader may wait for
+		 * a pending COW, which may wait for the transaction to commit.
+		 */
+		synchronize_srcu(&ext4_snapshot_list_srcu);
+		iput(inode);
+	}
+#endif
 	if (err)
 		goto out_err;
 
@@ -1538,12 +5033,395 @@ static int ext4_snapshot_shrink_range(handle_t *handle,
 						  i_snaplist)->vfs_inode;
 		if (inode == end)
 			break;
+#ifndef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_SHRINK_PARALLEL
 		/* indicate shrink progress via i_size */
 		SNAPSHOT_SET_PROGRESS(inode, SNAPSHOT_BLOCK(iblock));
+#endif
 	}
 	return count;
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_SHRINK_PARALLEL
+/*
+ * Parallel and resumable snapshot shrink.
+ * The file system blocks range is split into chunks of block groups, which
+ * are aligned to double indirect branches (SNAPSHOT_CHUNK_START()),
+ * so workers that shrink different chunks free blocks from different
+ * indirect blocks.  Each worker pulls the next chunk and shrinks it with its
+ * own transaction handles.
+ * The shrink checkpoint is the first block group of the first chunk, which
+ * was not completely shrunk.  It is stored in all the deleted snapshot inodes
+ * of the group, in a transaction that is started after the shrunk chunks
+ * transactions, and shrink resumes from the lowest stored checkpoint.
+ * A newly deleted snapshot has no checkpoint, so it forces a complete shrink
+ * of the group it is in.  Shrunk snapshots have no checkpoint either, but
+ * they are not shrunk again, so their checkpoint is ignored.
+ */
+#define SNAPSHOT_SHRINK_MAX_WORKERS	8
+
+struct ext4_snapshot_shrink_job {
+	struct inode		*start;
+	struct inode		*end;
+	ext4_fsblk_t		snapshot_blocks; /* blocks in-use by @start */
+	ext4_fsblk_t		blocks_count;
+	unsigned long		nr_chunks;
+	atomic_long_t		next_chunk;	/* next chunk to shrink */
+	atomic_long_t		shrunk;		/* shrunk blocks (progress) */
+	struct mutex		lock;		/* protects fields below: */
+	unsigned long		*done_chunks;	/* bitmap of shrunk chunks */
+	unsigned long		checkpoint;	/* first non shrunk chunk */
+	atomic_t		workers;	/* running workers */
+	struct completion	done;
+	int			stop;		/* shrink did not complete */
+	int			err;		/* first worker error */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC
+	int			throttle;	/* back off on congestion */
+#endif
+};
+
+struct ext4_snapshot_shrink_worker {
+	struct work_struct		work;
+	struct ext4_snapshot_shrink_job	*job;
+};
+
+/*
+ * ext4_snapshot_shrink_checkpoint - store shrink checkpoint in the deleted
+ * snapshots between @start and @end.
+ * Called with job lock held.
+ */
+static int ext4_snapshot_shrink_checkpoint(struct inode *start,
+		struct inode *end, __u32 group)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(start->i_sb);
+	struct list_head *l;
+	handle_t *handle;
+	int err = 0, ret;
+
+	handle = ext4_journal_start(start, EXT4_MAX_TRANS_DATA);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	/* iterate on (@start < snapshot < @end) */
+	list_for_each_prev(l, &EXT4_I(start)->i_snaplist) {
+		struct inode *inode;
+
+		if (l == &sbi->s_snapshot_list)
+			break;
+		inode = &list_entry(l, struct ext4_inode_info,
+				    i_snaplist)->vfs_inode;
+		if (inode == end)
+			break;
+		if (!ext4_test_inode_flag(inode, EXT4_INODE_SNAPFILE_DELETED) ||
+		    ext4_test_inode_flag(inode, EXT4_INODE_SNAPFILE_SHRUNK))
+			continue;
+		err = extend_or_restart_transaction(handle, 1);
+		if (err)
+			break;
+		EXT4_I(inode)->i_snapshot_shrink_group = group;
+		err = ext4_mark_inode_dirty(handle, inode);
+		if (err)
+			break;
+	}
+
+	ret = ext4_journal_stop(handle);
+	if (!err)
+		err = ret;
+	snapshot_debug(3, "snapshot (%u-%u) shrink checkpoint: "
+		       "block group = %u, err = %d\n", start->i_generation,
+		       end->i_generation, group, err);
+	return err;
+}
+
+/*
+ * ext4_snapshot_shrink_resume - find the shrink checkpoint of the deleted
+ * snapshots between @start and @end.
+ * Returns the block group to resume shrinking from.
+ */
+static __u32 ext4_snapshot_shrink_resume(struct inode *start,
+		struct inode *end)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(start->i_sb);
+	struct list_head *l;
+	__u32 group = (__u32)-1;
+
+	/* iterate on (@start < snapshot < @end) */
+	list_for_each_prev(l, &EXT4_I(start)->i_snaplist) {
+		struct inode *inode;
+
+		if (l == &sbi->s_snapshot_list)
+			break;
+		inode = &list_entry(l, struct ext4_inode_info,
+				    i_snaplist)->vfs_inode;
+		if (inode == end)
+			break;
+		/* only snapshots that are shrunk now have a checkpoint */
+		if (!ext4_test_inode_flag(inode, EXT4_INODE_SNAPFILE_DELETED) ||
+		    ext4_test_inode_flag(inode, EXT4_INODE_SNAPFILE_SHRUNK))
+			continue;
+		group = min(group, EXT4_I(inode)->i_snapshot_shrink_group);
+	}
+	return group == (__u32)-1 ? 0 : group;
+}
+
+/*
+ * ext4_snapshot_shrink_chunk - shrink a chunk of blocks in deleted snapshots
+ * Returns 0 on success, >0 if the chunk shrink did not complete
+ * and <0 on error.
+ */
+static int ext4_snapshot_shrink_chunk(struct ext4_snapshot_shrink_job *job,
+		ext4_fsblk_t block, unsigned long count)
+{
+	struct inode *start = job->start, *end = job->end;
+	struct ext4_sb_info *sbi = EXT4_SB(start->i_sb);
+	struct buffer_head cow_bitmap, *cow_bh = NULL;
+	long block_group = SNAPSHOT_BLOCK_GROUP(block) - 1;
+	ext4_fsblk_t bg_boundary = (ext4_fsblk_t)(block_group + 1) *
+		SNAPSHOT_BLOCKS_PER_GROUP;
+	handle_t *handle;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_PLUG
+	struct blk_plug plug;
+#endif
+	int err, ret;
+
+	/* start large truncate transaction that will be extended/restarted */
+	handle = ext4_journal_start(start, EXT4_MAX_TRANS_DATA);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_PLUG
+	/* batch the indirect and COW bitmap reads of the chunk */
+	blk_start_plug(&plug);
+#endif
+
+	while (count > 0 && !ACCESS_ONCE(job->stop)) {
+		while (block >= bg_boundary) {
+			/* reset COW bitmap cache */
+			cow_bitmap.b_state = 0;
+			cow_bitmap.b_blocknr = 0;
+			cow_bh = &cow_bitmap;
+			bg_boundary += SNAPSHOT_BLOCKS_PER_GROUP;
+			block_group++;
+			if (block >= job->snapshot_blocks)
+				/*
+				 * Past last snapshot block group - pass NULL
+				 * cow_bh to ext4_snapshot_shrink_range().
+				 * This will cause snapshots after resize to
+				 * shrink to the size of @start snapshot.
+				 */
+				cow_bh = NULL;
+			cond_resched();
+		}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC
+		if (job->throttle) {
+			err = ext4_snapshot_cleanup_throttle(&handle, start);
+			if (err)
+				goto out;
+		}
+#endif
+		err = extend_or_restart_transaction(handle,
+						    EXT4_MAX_TRANS_DATA);
+		if (err)
+			goto out;
+
+		err = ext4_snapshot_shrink_range(handle, start, end,
+					      SNAPSHOT_IBLOCK(block), count,
+					      cow_bh);
+
+		snapshot_debug(3, "snapshot (%u-%u) shrink: "
+				"block = 0x%llu, count = 0x%lx, err = 0x%x\n",
+				start->i_generation, end->i_generation,
+				block, count, err);
+
+		if (buffer_mapped(&cow_bitmap) && buffer_new(&cow_bitmap)) {
+			snapshot_debug(2, "snapshot (%u-%u) shrink: "
+				"block group = %ld/%u, "
+				"COW bitmap = [%llu/%llu]\n",
+				start->i_generation, end->i_generation,
+				block_group, sbi->s_groups_count,
+				SNAPSHOT_BLOCK_TUPLE(cow_bitmap.b_blocknr));
+			clear_buffer_new(&cow_bitmap);
+		}
+
+		if (err <= 0) {
+			err = err ? err : 1;
+			goto out;
+		}
+
+		block += err;
+		count -= err;
+		atomic_long_add(err, &job->shrunk);
+	}
+	err = job->stop;
+out:
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_PLUG
+	blk_finish_plug(&plug);
+#endif
+	if (handle) {
+		ret = ext4_journal_stop(handle);
+		if (!err)
+			err = ret;
+	}
+	return err;
+}
+
+/*
+ * ext4_snapshot_shrink_chunk_done - mark a chunk shrunk and advance
+ * and store the shrink checkpoint over all subsequent shrunk chunks.
+ * Called after the chunk transaction handle was stopped.
+ */
+static int ext4_snapshot_shrink_chunk_done(struct ext4_snapshot_shrink_job *job,
+		unsigned long chunk)
+{
+	unsigned long checkpoint;
+	int err = 0;
+
+	mutex_lock(&job->lock);
+	set_bit(chunk, job->done_chunks);
+	checkpoint = find_next_zero_bit(job->done_chunks, job->nr_chunks,
+					job->checkpoint);
+	/* the last checkpoint is stored when marking the snapshots shrunk */
+	if (checkpoint > job->checkpoint && checkpoint < job->nr_chunks) {
+		err = ext4_snapshot_shrink_checkpoint(job->start, job->end,
+			SNAPSHOT_BLOCK_GROUP(SNAPSHOT_CHUNK_START(checkpoint)));
+		if (!err)
+			job->checkpoint = checkpoint;
+	}
+	mutex_unlock(&job->lock);
+	return err;
+}
+
+static void ext4_snapshot_shrink_work(struct work_struct *work)
+{
+	struct ext4_snapshot_shrink_worker *worker =
+		container_of(work, struct ext4_snapshot_shrink_worker, work);
+	struct ext4_snapshot_shrink_job *job = worker->job;
+	ext4_fsblk_t block, end;
+	unsigned long chunk;
+	int err = 0;
+
+	while (!err && !ACCESS_ONCE(job->stop)) {
+		chunk = atomic_long_inc_return(&job->next_chunk) - 1;
+		if (chunk >= job->nr_chunks)
+			break;
+		block = SNAPSHOT_CHUNK_START(chunk);
+		end = min_t(ext4_fsblk_t, SNAPSHOT_CHUNK_START(chunk + 1),
+			    job->blocks_count);
+		if (!block)
+			block = 1; /* skip super block */
+		err = ext4_snapshot_shrink_chunk(job, block, end - block);
+		if (!err)
+			err = ext4_snapshot_shrink_chunk_done(job, chunk);
+	}
+
+	if (err) {
+		/* stop other workers and report the first error */
+		if (err < 0)
+			cmpxchg(&job->err, 0, err);
+		job->stop = 1;
+	}
+	if (atomic_dec_and_test(&job->workers))
+		complete(&job->done);
+}
+
+/*
+ * ext4_snapshot_shrink_parallel - shrink deleted snapshots with parallel
+ * workers, resuming from the stored shrink checkpoint.
+ * @start:	latest non-deleted snapshot before deleted snapshots group
+ * @end:	first non-deleted snapshot after deleted snapshots group
+ *
+ * Called from ext4_snapshot_shrink() under snapshot_mutex.
+ * Returns 0 on success, >0 if shrink did not complete and <0 on error.
+ */
+static int ext4_snapshot_shrink_parallel(struct inode *start,
+		struct inode *end)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(start->i_sb);
+	struct ext4_snapshot_shrink_worker *workers = NULL;
+	struct ext4_snapshot_shrink_job job;
+	ext4_fsblk_t resume;
+	struct list_head *l;
+	int i, nr_workers, err = -ENOMEM;
+
+	memset(&job, 0, sizeof(job));
+	job.start = start;
+	job.end = end;
+	/* blocks beyond the size of @start are not in-use by @start */
+	job.snapshot_blocks = SNAPSHOT_BLOCKS(start);
+	job.blocks_count = ext4_blocks_count(sbi->s_es);
+	job.nr_chunks = SNAPSHOT_BLOCK_CHUNK(job.blocks_count - 1) + 1;
+	mutex_init(&job.lock);
+	init_completion(&job.done);
+
+	/* resume from the chunk of the stored checkpoint */
+	resume = (ext4_fsblk_t)ext4_snapshot_shrink_resume(start, end) <<
+		SNAPSHOT_BLOCKS_PER_GROUP_BITS;
+	job.checkpoint = min_t(ext4_fsblk_t, job.nr_chunks,
+			       SNAPSHOT_BLOCK_CHUNK(resume));
+	atomic_long_set(&job.next_chunk, job.checkpoint);
+	atomic_long_set(&job.shrunk, SNAPSHOT_CHUNK_START(job.checkpoint));
+	if (job.checkpoint >= job.nr_chunks)
+		return 0;
+	if (ext4_snapshot_cleanup_yield(start->i_sb))
+		return 1;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC
+	job.throttle = ext4_snapshot_in_cleanup(start->i_sb);
+#endif
+
+	job.done_chunks = kcalloc(BITS_TO_LONGS(job.nr_chunks),
+				  sizeof(unsigned long), GFP_KERNEL);
+	if (!job.done_chunks)
+		goto out;
+	for (i = 0; i < job.checkpoint; i++)
+		set_bit(i, job.done_chunks);
+
+	nr_workers = min_t(unsigned long, job.nr_chunks - job.checkpoint,
+			   min_t(int, num_online_cpus(),
+				 SNAPSHOT_SHRINK_MAX_WORKERS));
+	workers = kcalloc(nr_workers, sizeof(*workers), GFP_KERNEL);
+	if (!workers)
+		goto out;
+
+	snapshot_debug(3, "snapshot (%u-%u) shrink: chunks = %lu, "
+		       "resume chunk = %lu, workers = %d\n",
+		       start->i_generation, end->i_generation,
+		       job.nr_chunks, job.checkpoint, nr_workers);
+
+	atomic_set(&job.workers, nr_workers);
+	for (i = 0; i < nr_workers; i++) {
+		workers[i].job = &job;
+		INIT_WORK(&workers[i].work, ext4_snapshot_shrink_work);
+		queue_work(system_unbound_wq, &workers[i].work);
+	}
+
+	/* indicate shrink progress via i_size of (@start < snapshot < @end) */
+	do {
+		i = wait_for_completion_timeout(&job.done,
+						SNAPSHOT_CLEANUP_POLL);
+		if (!i && ext4_snapshot_cleanup_yield(start->i_sb))
+			/* let the workers finish their current chunk */
+			job.stop = 1;
+		list_for_each_prev(l, &EXT4_I(start)->i_snaplist) {
+			struct inode *inode;
+
+			if (l == &sbi->s_snapshot_list)
+				break;
+			inode = &list_entry(l, struct ext4_inode_info,
+					    i_snaplist)->vfs_inode;
+			if (inode == end)
+				break;
+			SNAPSHOT_SET_PROGRESS(inode,
+					atomic_long_read(&job.shrunk));
+		}
+	} while (!i);
+
+	err = job.err ? job.err : job.stop;
+out:
+	kfree(workers);
+	kfree(job.done_chunks);
+	return err;
+}
+
+#endif
 /*
  * ext4_snapshot_shrink - free unused blocks from deleted snapshot files
  * @handle: JBD handle for this transaction
@@ -1562,14 +5440,20 @@ static int ext4_snapshot_shrink(struct inode *start, struct inode *end,
 {
 	struct list_head *l;
 	handle_t *handle;
+#ifndef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_SHRINK_PARALLEL
 	struct buffer_head cow_bitmap, *cow_bh = NULL;
+#endif
 	ext4_fsblk_t block = 1; /* skip super block */
 	struct ext4_sb_info *sbi = EXT4_SB(start->i_sb);
+#ifndef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_SHRINK_PARALLEL
 	/* blocks beyond the size of @start are not in-use by @start */
 	ext4_fsblk_t snapshot_blocks = SNAPSHOT_BLOCKS(start);
+#endif
 	unsigned long count = ext4_blocks_count(sbi->s_es) - block;
+#ifndef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_SHRINK_PARALLEL
 	long block_group = -1;
 	ext4_fsblk_t bg_boundary = 0;
+#endif
 	int err, ret;
 
 	snapshot_debug(3, "snapshot (%u-%u) shrink: "
@@ -1577,6 +5461,21 @@ static int ext4_snapshot_shrink(struct inode *start, struct inode *end,
 			start->i_generation, end->i_generation,
 			count, need_shrink);
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_SHRINK_PARALLEL
+	err = ext4_snapshot_shrink_parallel(start, end);
+	if (err) {
+		/* shrink failed (<0) or did not complete (>0) */
+		snapshot_debug(1, "snapshot (%u-%u) shrink: "
+			       "need_shrink=%d(>0!), err=%d\n",
+			       start->i_generation, end->i_generation,
+			       need_shrink, err);
+		return err < 0 ? err : 0;
+	}
+
+	handle = ext4_journal_start(start, EXT4_MAX_TRANS_DATA);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+#else
 	/* start large truncate transaction that will be extended/restarted */
 	handle = ext4_journal_start(start, EXT4_MAX_TRANS_DATA);
 	if (IS_ERR(handle))
@@ -1631,6 +5530,7 @@ static int ext4_snapshot_shrink(struct inode *start, struct inode *end,
 		block += err;
 		count -= err;
 	}
+#endif
 
 	/* marks need_shrink snapshots shrunk */
 	err = extend_or_restart_transaction(handle, need_shrink);
@@ -1657,6 +5557,10 @@ static int ext4_snapshot_shrink(struct inode *start, struct inode *end,
 			/* mark snapshot shrunk */
 			err = ext4_reserve_inode_write(handle, inode, &iloc);
 			ext4_set_inode_flag(inode, EXT4_INODE_SNAPFILE_SHRUNK);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_SHRINK_PARALLEL
+			/* shrunk snapshot has no shrink checkpoint */
+			EXT4_I(inode)->i_snapshot_shrink_group = 0;
+#endif
 			if (!err)
 				ext4_mark_iloc_dirty(handle, inode, &iloc);
 			if (--need_shrink <= 0)
@@ -1679,6 +5583,214 @@ out_err:
 
 #endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_MERGE
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_MERGE_PARALLEL
+/*
+ * Parallel snapshot merge.
+ * The merged blocks range is split into chunks of block groups, which are
+ * aligned to double indirect branches (SNAPSHOT_CHUNK_START()).  All
+ * indirect blocks that map a chunk, except for the shared double/tripple
+ * indirect tree roots, map no other chunks, so workers that merge different
+ * chunks modify different indirect blocks and different pointers in the tree
+ * roots.  Write access to the shared tree roots is serialized by JBD and
+ * the inodes blocks usage is updated under the quota and inode locks.
+ * Each worker pulls the next chunk to merge, merges it with its own
+ * transaction handles and adds the merged blocks to the merge progress.
+ */
+#define SNAPSHOT_MERGE_MAX_WORKERS	8
+
+struct ext4_snapshot_merge_job {
+	struct inode		*src;
+	struct inode		*dst;
+	ext4_fsblk_t		end;		/* end of merged range */
+	atomic_long_t		next_chunk;	/* next chunk to merge */
+	atomic_long_t		merged;		/* merged blocks (progress) */
+	atomic_t		workers;	/* running workers */
+	struct completion	done;
+	int			stop;		/* merge did not complete */
+	int			err;		/* first worker error */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC
+	int			throttle;	/* back off on congestion */
+#endif
+};
+
+struct ext4_snapshot_merge_worker {
+	struct work_struct		work;
+	struct ext4_snapshot_merge_job	*job;
+};
+
+/*
+ * ext4_snapshot_merge_chunk - merge a chunk of blocks from job src to dst
+ * Returns 0 on success, >0 if the chunk merge did not complete
+ * and <0 on error.
+ */
+static int ext4_snapshot_merge_chunk(struct ext4_snapshot_merge_job *job,
+		ext4_fsblk_t block, unsigned long count)
+{
+	struct inode *src = job->src, *dst = job->dst;
+	handle_t *handle;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_PLUG
+	struct blk_plug plug;
+#endif
+	int err, ret;
+
+	/* start large transaction that will be extended/restarted */
+	handle = ext4_journal_start(src, EXT4_MAX_TRANS_DATA);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_PLUG
+	/* batch the indirect block reads of the chunk */
+	blk_start_plug(&plug);
+#endif
+
+	while (count > 0 && !ACCESS_ONCE(job->stop)) {
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC
+		if (job->throttle) {
+			err = ext4_snapshot_cleanup_throttle(&handle, src);
+			if (err)
+				goto out;
+		}
+#endif
+		/* we modify one indirect block and the inode itself
+		 * for both the source and destination inodes */
+		err = extend_or_restart_transaction(handle, 4);
+		if (err)
+			goto out;
+
+		err = ext4_snapshot_merge_blocks(handle, src, dst,
+					 SNAPSHOT_IBLOCK(block), count);
+
+		snapshot_debug(3, "snapshot (%u) -> snapshot (%u) "
+			       "merge: block = 0x%llu, count = 0x%lx, "
+			       "err = 0x%x\n", src->i_generation,
+			       dst->i_generation, block, count, err);
+
+		if (err <= 0) {
+			err = err ? err : 1;
+			goto out;
+		}
+		if (err > count)
+			err = count;
+
+		block += err;
+		count -= err;
+		atomic_long_add(err, &job->merged);
+		cond_resched();
+	}
+	err = 0;
+out:
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_PLUG
+	blk_finish_plug(&plug);
+#endif
+	if (handle) {
+		ret = ext4_journal_stop(handle);
+		if (!err)
+			err = ret;
+	}
+	return err;
+}
+
+static void ext4_snapshot_merge_work(struct work_struct *work)
+{
+	struct ext4_snapshot_merge_worker *worker =
+		container_of(work, struct ext4_snapshot_merge_worker, work);
+	struct ext4_snapshot_merge_job *job = worker->job;
+	ext4_fsblk_t block, end;
+	unsigned long chunk;
+	int err = 0;
+
+	while (!err && !ACCESS_ONCE(job->stop)) {
+		chunk = atomic_long_inc_return(&job->next_chunk) - 1;
+		block = SNAPSHOT_CHUNK_START(chunk);
+		if (block >= job->end)
+			break;
+		end = min_t(ext4_fsblk_t, SNAPSHOT_CHUNK_START(chunk + 1),
+			    job->end);
+		if (!block)
+			block = 1; /* skip super block */
+		err = ext4_snapshot_merge_chunk(job, block, end - block);
+	}
+
+	if (err) {
+		/* stop other workers and report the first error */
+		if (err < 0)
+			cmpxchg(&job->err, 0, err);
+		job->stop = 1;
+	}
+	if (atomic_dec_and_test(&job->workers))
+		complete(&job->done);
+}
+
+/*
+ * ext4_snapshot_merge_parallel - merge blocks from @src to @dst snapshot
+ * @src:	deleted and shrunk snapshot to merge
+ * @dst:	latest non-deleted snapshot before @src
+ *
+ * Merge all blocks of @src that are in-use by @dst with parallel workers and
+ * export the merge progress via @src i_size, while waiting for the workers.
+ * Called from ext4_snapshot_merge() under snapshot_mutex.
+ * Returns 0 on success, >0 if merge did not complete and <0 on error.
+ */
+static int ext4_snapshot_merge_parallel(struct inode *src, struct inode *dst)
+{
+	struct ext4_snapshot_merge_worker *workers;
+	struct ext4_snapshot_merge_job job;
+	ext4_fsblk_t chunks;
+	int i, nr_workers;
+
+	memset(&job, 0, sizeof(job));
+	job.src = src;
+	job.dst = dst;
+	/* blocks beyond the size of @dst are not in-use by @dst */
+	job.end = SNAPSHOT_BLOCKS(dst);
+	atomic_long_set(&job.next_chunk, 0);
+	atomic_long_set(&job.merged, 0);
+	init_completion(&job.done);
+	if (job.end <= 1)
+		return 0;
+	if (ext4_snapshot_cleanup_yield(src->i_sb))
+		return 1;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC
+	job.throttle = ext4_snapshot_in_cleanup(src->i_sb);
+#endif
+
+	chunks = SNAPSHOT_BLOCK_CHUNK(job.end - 1) + 1;
+	nr_workers = min_t(ext4_fsblk_t, chunks,
+			   min_t(int, num_online_cpus(),
+				 SNAPSHOT_MERGE_MAX_WORKERS));
+	workers = kcalloc(nr_workers, sizeof(*workers), GFP_KERNEL);
+	if (!workers)
+		return -ENOMEM;
+
+	snapshot_debug(3, "snapshot (%u) -> snapshot (%u) merge: "
+		       "chunks = %llu, workers = %d\n", src->i_generation,
+		       dst->i_generation, chunks, nr_workers);
+
+	atomic_set(&job.workers, nr_workers);
+	for (i = 0; i < nr_workers; i++) {
+		workers[i].job = &job;
+		INIT_WORK(&workers[i].work, ext4_snapshot_merge_work);
+		queue_work(system_unbound_wq, &workers[i].work);
+	}
+
+	/* indicate merge progress via i_size */
+	while (!wait_for_completion_timeout(&job.done,
+					    SNAPSHOT_CLEANUP_POLL)) {
+		if (ext4_snapshot_cleanup_yield(src->i_sb))
+			/* let the workers finish their current chunk */
+			job.stop = 1;
+		SNAPSHOT_SET_PROGRESS(src, 1 + atomic_long_read(&job.merged));
+	}
+	SNAPSHOT_SET_PROGRESS(src, 1 + atomic_long_read(&job.merged));
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_CACHE
+	/* workers may have raced on the list generation update */
+	ext4_snapshot_list_changed(src->i_sb);
+#endif
+
+	kfree(workers);
+	return job.err ? job.err : job.stop;
+}
+
+#endif
 /*
  * ext4_snapshot_merge - merge deleted snapshots
  * @handle: JBD handle for this transaction
@@ -1709,14 +5821,28 @@ static int ext4_snapshot_merge(struct inode *start, struct inode *end,
 		struct inode *inode = &list_entry(l, struct ext4_inode_info,
 						  i_snaplist)->vfs_inode;
 
+#ifndef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_MERGE_PARALLEL
 		ext4_fsblk_t block = 1; /* skip super block */
 		/* blocks beyond the size of @start are not in-use by @start */
 		unsigned long count = SNAPSHOT_BLOCKS(start) - block;
+#endif
 
 		if (n == &sbi->s_snapshot_list || inode == end ||
 		    !(ext4_test_inode_flag(inode, EXT4_INODE_SNAPFILE_SHRUNK)))
 			break;
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_MERGE_PARALLEL
+		err = ext4_snapshot_merge_parallel(inode, start);
+		if (err) {
+			/* merge failed (<0) or did not complete (>0) */
+			if (err > 0)
+				err = 0;
+			goto out_err;
+		}
+
+		/* reset i_size that was used as progress indicator */
+		SNAPSHOT_SET_DISABLED(inode);
+#else
 		/* start large transaction that will be extended/restarted */
 		handle = ext4_journal_start(inode, EXT4_MAX_TRANS_DATA);
 		if (IS_ERR(handle))
@@ -1754,6 +5880,7 @@ static int ext4_snapshot_merge(struct inode *start, struct inode *end,
 		handle = NULL;
 		if (err)
 			goto out_err;
+#endif
 
 		/* we finished moving all blocks of interest from 'inode'
 		 * into 'start' so it is now safe to remove 'inode' from the
@@ -1846,11 +5973,243 @@ static int ext4_snapshot_cleanup(struct inode *inode, struct inode *used_by,
 }
 
 #endif
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_COMPACT
+/*
+ * Snapshot compaction
+ *
+ * A cold snapshot is an old snapshot that is not enabled and not in-use by
+ * an older enabled snapshot, so there are no readers of its blocks.
+ * The copy of a block in a cold snapshot is not needed if the image of the
+ * block in the newer snapshots is identical: without the copy, the snapshot
+ * reads the block through the newer snapshots.  If the newer snapshot is
+ * deleted later, its copy is in-use by the cold snapshot, so it is not
+ * shrunk but merged into the cold snapshot.
+ */
+
+/* journal credits for freeing one snapshot copy */
+#define EXT4_SNAPSHOT_COMPACT_CREDITS	8
+
+/*
+ * Returns true if @inode is a cold snapshot that was not compacted yet.
+ * Called under snapshot_mutex.
+ */
+static int ext4_snapshot_compact_needed(struct inode *inode)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(inode->i_sb);
+	/* no creation time in small inodes */
+	time_t ctime = EXT4_I(inode)->i_crtime.tv_sec ? :
+		inode->i_ctime.tv_sec;
+
+	if (!sbi->s_snapshot_compact_age ||
+	    ext4_test_inode_state(inode, EXT4_STATE_COMPACTED) ||
+	    ext4_snapshot_is_active(inode) ||
+	    ext4_test_inode_flag(inode, EXT4_INODE_SNAPFILE_DELETED) ||
+	    ext4_test_inode_snapstate(inode, EXT4_SNAPSTATE_ENABLED) ||
+	    ext4_test_inode_snapstate(inode, EXT4_SNAPSTATE_INUSE))
+		return 0;
+	return get_seconds() - ctime >= sbi->s_snapshot_compact_age;
+}
+
+/*
+ * ext4_snapshot_compact_blocks - free copies that are identical to the image
+ * of the same blocks in newer snapshots
+ * @handle:	JBD handle for this transaction
+ * @inode:	cold snapshot we are compacting
+ * @iblock:	first block of a mapped range
+ * @count:	no. of blocks in the mapped range
+ *
+ * Copies of block bitmaps are kept, because shrink looks up the COW bitmap
+ * of a block group in the snapshot copy of the block bitmap.
+ * Called from ext4_snapshot_compact_one() under snapshot_mutex.
+ * Returns the no. of freed blocks and <0 on error.
+ */
+static int ext4_snapshot_compact_blocks(handle_t *handle, struct inode *inode,
+		ext4_lblk_t iblock, int count)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext4_group_desc *desc;
+	struct buffer_head *bh, *nbh;
+	struct list_head *l;
+	ext4_fsblk_t block, blk, nblk;
+	int i, same, err, freed = 0;
+
+	for (i = 0; i < count; i++, iblock++) {
+		block = SNAPSHOT_BLOCK(iblock);
+		desc = ext4_get_group_desc(sb, SNAPSHOT_BLOCK_GROUP(block),
+					   NULL);
+		if (!desc || block == ext4_block_bitmap(sb, desc))
+			continue;
+		err = ext4_snapshot_map_blocks(NULL, inode, block, 1, &blk,
+					       SNAPMAP_READ);
+		if (err < 0)
+			return err;
+		if (!err)
+			continue;
+
+		/* find the image of block in newer snapshots */
+		nblk = 0;
+		for (l = EXT4_I(inode)->i_snaplist.prev;
+		     !nblk && l != &EXT4_SB(sb)->s_snapshot_list; l = l->prev) {
+			err = ext4_snapshot_map_blocks(NULL,
+				&list_entry(l, struct ext4_inode_info,
+					    i_snaplist)->vfs_inode,
+				block, 1, &nblk, SNAPMAP_READ);
+			if (err < 0)
+				return err;
+			if (!err)
+				nblk = 0;
+		}
+		if (!nblk)
+			/* the image is on the block device and may change */
+			continue;
+
+		bh = sb_bread(sb, blk);
+		nbh = sb_bread(sb, nblk);
+		same = bh && nbh && !memcmp(bh->b_data, nbh->b_data,
+					    bh->b_size);
+		brelse(bh);
+		brelse(nbh);
+		if (!same)
+			continue;
+
+		err = extend_or_restart_transaction(handle,
+				EXT4_SNAPSHOT_COMPACT_CREDITS);
+		if (err)
+			return err;
+		err = ext4_snapshot_set_leaf(handle, inode, iblock, blk, 0);
+		if (err < 0)
+			return err;
+		if (!err)
+			continue;
+		ext4_free_blocks(handle, inode, NULL, blk, 1,
+				 EXT4_FREE_BLOCKS_FORGET);
+		freed++;
+	}
+	return freed;
+}
+
+/*
+ * ext4_snapshot_compact_one - free the copies of a cold snapshot that are
+ * identical to the image of the same blocks in newer snapshots
+ * Called from ext4_snapshot_compact() under snapshot_mutex.
+ * Returns 0 when done, >0 if compaction yielded and <0 on error.
+ */
+static int ext4_snapshot_compact_one(struct inode *inode)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(inode->i_sb);
+	ext4_lblk_t iblock = SNAPSHOT_IBLOCK(1); /* skip super block */
+	ext4_lblk_t end = SNAPSHOT_IBLOCK(SNAPSHOT_BLOCKS(inode));
+	handle_t *handle;
+	int n, mapped, err = 0, freed = 0;
+
+	handle = ext4_journal_start(inode, EXT4_MAX_TRANS_DATA);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	while (iblock < end) {
+		if (ext4_snapshot_cleanup_yield(inode->i_sb)) {
+			err = 1;
+			break;
+		}
+		down_read(&EXT4_I(inode)->i_data_sem);
+		n = ext4_snapshot_diff_blocks(inode, iblock, end - iblock,
+					      &mapped);
+		up_read(&EXT4_I(inode)->i_data_sem);
+		if (n <= 0) {
+			err = n ? n : -EIO;
+			break;
+		}
+		if (mapped) {
+			err = ext4_snapshot_compact_blocks(handle, inode,
+							   iblock, n);
+			if (err < 0)
+				break;
+			freed += err;
+			err = 0;
+		}
+		iblock += n;
+		cond_resched();
+	}
+
+	sbi->s_snapshot_compacted_blocks += freed;
+	snapshot_debug(1, "snapshot (%u) compact: freed %d blocks "
+		       "(err=%d)\n", inode->i_generation, freed, err);
+	n = ext4_journal_stop(handle);
+	return err ? err : n;
+}
+
+/*
+ * ext4_snapshot_compact - compact all cold snapshots
+ * Called from the snapshot cleanup thread under snapshot_mutex.
+ * Returns 0 on success (or if compaction yielded) and <0 on error.
+ */
+static int ext4_snapshot_compact(struct super_block *sb)
+{
+	struct list_head *l;
+	struct inode *inode;
+	int err;
+
+	/* iterate from oldest snapshot to the active snapshot */
+	for (l = EXT4_SB(sb)->s_snapshot_list.prev;
+	     l != &EXT4_SB(sb)->s_snapshot_list; l = l->prev) {
+		inode = &list_entry(l, struct ext4_inode_info,
+				    i_snaplist)->vfs_inode;
+		if (ext4_snapshot_is_active(inode))
+			break;
+		if (!ext4_snapshot_compact_needed(inode))
+			continue;
+		err = ext4_snapshot_compact_one(inode);
+		if (err)
+			return err > 0 ? 0 : err;
+		ext4_set_inode_state(inode, EXT4_STATE_COMPACTED);
+	}
+	return 0;
+}
+
 #endif
 /*
  * Snapshot constructor/destructor
  */
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_LOAD_FAST
+/*
+ * ext4_snapshot_load_readahead() reads ahead the inode table blocks in front
+ * of snapshot inode @ino.  Older snapshots are usually allocated before newer
+ * ones in the snapshots directory group, so the next snapshots on the list
+ * are found in the read ahead window.
+ * Returns the first inode number covered by the read ahead window.
+ */
+static unsigned long ext4_snapshot_load_readahead(struct super_block *sb,
+						  unsigned long ino)
+{
+	int inodes_per_block = EXT4_BLOCK_SIZE(sb) / EXT4_INODE_SIZE(sb);
+	struct ext4_iloc iloc;
+	struct blk_plug plug;
+	ext4_fsblk_t block;
+	unsigned long n, i;
+
+	block = ext4_get_inode_block(sb, ino, &iloc);
+	if (!block)
+		return ino;
+
+	/* inode table blocks from start of group up to and including block */
+	n = ((ino - 1) % EXT4_INODES_PER_GROUP(sb)) / inodes_per_block + 1;
+	n = min_t(unsigned long, n, EXT4_SNAPSHOT_LOAD_READAHEAD);
+	snapshot_debug(3, "read ahead %lu inode table blocks [%llu-%llu] of "
+		       "group (%u)\n", n, block - n + 1, block,
+		       iloc.block_group);
+
+	blk_start_plug(&plug);
+	for (i = n; i > 0; i--)
+		sb_breadahead(sb, block - i + 1);
+	blk_finish_plug(&plug);
+	/* first inode in window = first inode in block - (n - 1) blocks */
+	return ino - (ino - 1) % inodes_per_block -
+		(n - 1) * inodes_per_block;
+}
+
+#endif
 /*
  * ext4_snapshot_load - load the on-disk snapshot list to memory.
  * Start with last (or active) snapshot and continue to older snapshots.
@@ -1869,6 +6228,9 @@ int ext4_snapshot_load(struct super_block *sb, struct ext4_super_block *es,
 	__u32 load_ino = le32_to_cpu(es->s_snapshot_list);
 	int err = 0, num = 0, snapshot_id = 0;
 	int has_active = 0;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_LOAD_FAST
+	unsigned long ra_start = 0, ra_end = 0;
+#endif
 
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST
 	if (!list_empty(&EXT4_SB(sb)->s_snapshot_list)) {
@@ -1889,6 +6251,13 @@ int ext4_snapshot_load(struct super_block *sb, struct ext4_super_block *es,
 	while (load_ino) {
 		struct inode *inode;
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_LOAD_FAST
+		if (load_ino < ra_start || load_ino > ra_end) {
+			/* next snapshot is out of read ahead window */
+			ra_start = ext4_snapshot_load_readahead(sb, load_ino);
+			ra_end = load_ino;
+		}
+#endif
 		inode = ext4_orphan_get(sb, load_ino);
 		if (IS_ERR(inode)) {
 			err = PTR_ERR(inode);
@@ -1953,9 +6322,31 @@ int ext4_snapshot_load(struct super_block *sb, struct ext4_super_block *es,
 	}
 
 	if (num > 0) {
+#if defined(CONFIG_EXT4_FS_SNAPSHOT_CTL_LOAD_FAST) && \
+	defined(CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC)
+		/*
+		 * Don't remove snapshots of a failed take during mount.
+		 * The cleanup thread is started with a pending cleanup pass
+		 * at the end of mount and will remove them.
+		 */
+		if (!read_only)
+			set_bit(SNAPSHOT_CLEANUP_PENDING,
+				&EXT4_SB(sb)->s_snapshot_cleanup_state);
+#endif
 		err = ext4_snapshot_update(sb, 0, read_only);
 		snapshot_debug(1, "%d snapshots loaded\n", num);
 	}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_LOAD_COW_BITMAP
+	if (!err && has_active) {
+		struct inode *active_snapshot = ext4_snapshot_has_active(sb);
+		/* warm up COW bitmap cache - failure is not an error */
+		int n = ext4_snapshot_load_cow_bitmaps(sb, active_snapshot);
+
+		snapshot_debug(1, "%d COW bitmaps of snapshot (%u) "
+				"loaded (err=%d)\n", max(n, 0),
+				active_snapshot->i_generation, min(n, 0));
+	}
+#endif
 	return err;
 }
 
@@ -1973,11 +6364,15 @@ void ext4_snapshot_destroy(struct super_block *sb)
 	list_for_each_safe(l, n, &EXT4_SB(sb)->s_snapshot_list) {
 		struct inode *inode = &list_entry(l, struct ext4_inode_info,
 						  i_snaplist)->vfs_inode;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_BDEV
+		ext4_snapshot_remove_bdev(inode, 1);
+#endif
 		list_del_init(&EXT4_I(inode)->i_snaplist);
 		/* remove snapshot list reference */
 		iput(inode);
 	}
 #endif
+	ext4_snapshot_stop_prebuild(sb);
 	/* deactivate in-memory active snapshot - cannot fail */
 	(void) ext4_snapshot_set_active(sb, NULL);
 }
@@ -1989,6 +6384,7 @@ void ext4_snapshot_destroy(struct super_block *sb)
  * @read_only: if true, don't remove snapshot after failed take.
  *
  * Called from ext4_ioctl() under snapshot_mutex.
+ * Called from the snapshot cleanup thread under snapshot_mutex.
  * Called from snapshot_load() under sb_lock with @cleanup=0.
  * Returns 0 on success and <0 on error.
  */
@@ -2009,6 +6405,9 @@ int ext4_snapshot_update(struct super_block *sb, int cleanup, int read_only)
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP
 	int need_shrink = 0;
 	int need_merge = 0;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_COMPACT
+	int need_compact = 0;
 #endif
 	int err = 0;
 
@@ -2042,7 +6441,15 @@ update_snapshot:
 	 * no active snapshot means failed first snapshot take.
 	 */
 	if (found_active || !active_snapshot) {
+#if defined(CONFIG_EXT4_FS_SNAPSHOT_CTL_LOAD_FAST) && \
+	defined(CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC)
+		/* leave removal to a pending cleanup pass */
+		if (!read_only && (cleanup ||
+		    !test_bit(SNAPSHOT_CLEANUP_PENDING,
+			      &EXT4_SB(sb)->s_snapshot_cleanup_state)))
+#else
 		if (!read_only)
+#endif
 			err = ext4_snapshot_remove(inode);
 		goto prev_snapshot;
 	}
@@ -2092,6 +6499,10 @@ update_snapshot:
 	} else
 		SNAPSHOT_SET_DISABLED(inode);
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_COMPACT
+	if (!cleanup && !read_only && ext4_snapshot_compact_needed(inode))
+		need_compact = 1;
+#endif
 prev_snapshot:
 	if (err)
 		return err;
@@ -2099,6 +6510,11 @@ prev_snapshot:
 	if (prev != &EXT4_SB(sb)->s_snapshot_list)
 		goto update_snapshot;
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_COMPACT
+	if (need_compact)
+		/* compact cold snapshots in the background */
+		ext4_snapshot_wake_cleanup(sb);
+#endif
 
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL
 	if (!active_snapshot || !cleanup || used_by)
@@ -2108,15 +6524,29 @@ prev_snapshot:
 	deleted = ext4_test_inode_flag(active_snapshot,
 				       EXT4_INODE_SNAPFILE_DELETED);
 	if (deleted && igrab(active_snapshot)) {
+		ext4_snapshot_stop_prebuild(sb);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC
+		/*
+		 * lock journal updates before deactivating snapshot.
+		 * the cleanup thread cannot freeze_super(), because umount
+		 * holds s_umount while waiting for the cleanup thread to stop.
+		 */
+		jbd2_journal_lock_updates(EXT4_SB(sb)->s_journal);
+#else
 		/* lock journal updates before deactivating snapshot */
 		freeze_super(sb);
+#endif
 		lock_super(sb);
 		/* deactivate in-memory active snapshot - cannot fail */
 		(void) ext4_snapshot_set_active(sb, NULL);
 		/* clear on-disk active snapshot */
 		EXT4_SB(sb)->s_es->s_snapshot_inum = 0;
 		unlock_super(sb);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC
+		jbd2_journal_unlock_updates(EXT4_SB(sb)->s_journal);
+#else
 		thaw_super(sb);
+#endif
 		/* remove unused deleted active snapshot */
 		err = ext4_snapshot_remove(active_snapshot);
 		/* drop the refcount to 0 */
@@ -2125,4 +6555,124 @@ prev_snapshot:
 #endif
 	return err;
 }
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_UPDATE_INCREMENTAL
+
+/*
+ * ext4_snapshot_update_inuse - propagate the INUSE flag to newer snapshots
+ * @inode: snapshot whose ENABLED or INUSE state has changed
+ *
+ * A snapshot is in-use if any older snapshot is enabled, so the INUSE flag
+ * of a newer snapshot only depends on the INUSE and ENABLED flags of its
+ * older neighbour.  Stop at the first newer snapshot whose INUSE flag is
+ * already correct, because the snapshots newer than it are correct as well.
+ * Returns true if one of the updated snapshots needs compaction.
+ * Called under snapshot_mutex.
+ */
+static int ext4_snapshot_update_inuse(struct inode *inode)
+{
+	struct list_head *l = &EXT4_I(inode)->i_snaplist;
+	struct list_head *head = &EXT4_SB(inode->i_sb)->s_snapshot_list;
+	int inuse, need_compact = 0;
+
+	inuse = ext4_test_inode_snapstate(inode, EXT4_SNAPSTATE_INUSE) ||
+		ext4_test_inode_snapstate(inode, EXT4_SNAPSTATE_ENABLED);
+	/* iterate to newer snapshots */
+	for (l = l->prev; l != head; l = l->prev) {
+		inode = &list_entry(l, struct ext4_inode_info,
+				    i_snaplist)->vfs_inode;
+		if (!ext4_test_inode_snapstate(inode,
+					       EXT4_SNAPSTATE_INUSE) == !inuse)
+			break;
+		if (inuse)
+			ext4_set_inode_snapstate(inode, EXT4_SNAPSTATE_INUSE);
+		else
+			ext4_clear_inode_snapstate(inode, EXT4_SNAPSTATE_INUSE);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_COMPACT
+		if (ext4_snapshot_compact_needed(inode))
+			need_compact = 1;
+#endif
+		if (ext4_test_inode_snapstate(inode, EXT4_SNAPSTATE_ENABLED))
+			inuse = 1;
+	}
+	return need_compact;
+}
+
+/*
+ * ext4_snapshot_update_inode - update snapshots status after an operation
+ * on a single snapshot.
+ * @inode: snapshot that was taken, enabled, disabled or deleted.
+ * @cleanup: if true, shrink/merge/cleanup all snapshots marked for deletion.
+ *
+ * Only @inode and its neighbours on the snapshot list are updated, instead
+ * of iterating the entire snapshot list with ext4_snapshot_update().
+ * Cleanup and removal of snapshots after a failed take still walk the list.
+ *
+ * Called from ext4_ioctl() and snapshot take under snapshot_mutex.
+ * Returns 0 on success and <0 on error.
+ */
+int ext4_snapshot_update_inode(struct inode *inode, int cleanup)
+{
+	struct super_block *sb = inode->i_sb;
+	struct list_head *head = &EXT4_SB(sb)->s_snapshot_list;
+	struct list_head *l = &EXT4_I(inode)->i_snaplist;
+	struct inode *active_snapshot = ext4_snapshot_has_active(sb);
+	struct inode *older = NULL;
+	int need_compact = 0;
+
+	/*
+	 * snapshots later than active (failed take) should be removed.
+	 * no active snapshot means failed first snapshot take.
+	 */
+	if (cleanup || !active_snapshot || head->next !=
+	    &EXT4_I(active_snapshot)->i_snaplist ||
+	    !ext4_snapshot_list(inode) || list_empty(l))
+		return ext4_snapshot_update(sb, cleanup, 0);
+
+	/* all snapshots on the list have the LIST flag */
+	ext4_set_inode_snapstate(inode, EXT4_SNAPSTATE_LIST);
+	/* set the 'No_Dump' flag on all snapshots */
+	ext4_set_inode_flag(inode, EXT4_INODE_NODUMP);
+
+	if (l->next != head)
+		older = &list_entry(l->next, struct ext4_inode_info,
+				    i_snaplist)->vfs_inode;
+	if (inode == active_snapshot) {
+		ext4_set_inode_snapstate(inode, EXT4_SNAPSTATE_ACTIVE);
+		if (older) {
+			/* the previous active snapshot after take */
+			ext4_clear_inode_snapstate(older,
+						   EXT4_SNAPSTATE_ACTIVE);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_COMPACT
+			if (ext4_snapshot_compact_needed(older))
+				need_compact = 1;
+#endif
+		}
+	}
+
+	if (older && (ext4_test_inode_snapstate(older, EXT4_SNAPSTATE_INUSE) ||
+		      ext4_test_inode_snapstate(older, EXT4_SNAPSTATE_ENABLED)))
+		/* snapshot is in use by an older enabled snapshot */
+		ext4_set_inode_snapstate(inode, EXT4_SNAPSTATE_INUSE);
+	else
+		/* snapshot is not in use by older enabled snapshots */
+		ext4_clear_inode_snapstate(inode, EXT4_SNAPSTATE_INUSE);
+
+	if (!ext4_test_inode_snapstate(inode, EXT4_SNAPSTATE_ENABLED))
+		SNAPSHOT_SET_DISABLED(inode);
+
+	if (ext4_snapshot_update_inuse(inode))
+		need_compact = 1;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_COMPACT
+	/* the oldest snapshot is the first to get cold */
+	if (ext4_snapshot_compact_needed(inode) ||
+	    ext4_snapshot_compact_needed(&list_entry(head->prev,
+			struct ext4_inode_info, i_snaplist)->vfs_inode))
+		need_compact = 1;
+	if (need_compact)
+		/* compact cold snapshots in the background */
+		ext4_snapshot_wake_cleanup(sb);
+#endif
+	return 0;
+}
+#endif
 #endif
@@ -16,6 +16,12 @@
 #include <linux/module.h>
 #include <linux/proc_fs.h>
 #include <linux/debugfs.h>
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_DEBUG_BENCH
+#include <linux/kthread.h>
+#include <linux/fs_struct.h>
+#include <linux/vmalloc.h>
+#include "ext4_jbd2.h"
+#endif
 #include "snapshot.h"
 
 #if defined(CONFIG_EXT4_FS_SNAPSHOT) && defined(CONFIG_EXT4_DEBUG)
@@ -50,6 +56,9 @@ u8 snapshot_enable_debug __read_mostly = 1;
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CACHE
 u8 cow_cache_enabled __read_mostly = 1;
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREBUILD
+u8 cow_bitmap_prebuild_enabled __read_mostly = 1;
+#endif
 
 static struct dentry *snapshot_debug;
 static struct dentry *snapshot_version;
@@ -57,6 +66,37 @@ static struct dentry *snapshot_test[SNAPSHOT_TESTS_NUM];
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CACHE
 static struct dentry *cow_cache;
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREBUILD
+static struct dentry *cow_bitmap_prebuild;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW_WAITQ
+struct snapshot_wait_hist snapshot_cow_wait_hist;
+static struct dentry *cow_wait_hist;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_BITMAP_WAITQ
+struct snapshot_wait_hist snapshot_cow_bitmap_wait_hist;
+static struct dentry *cow_bitmap_wait_hist;
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_DEBUG_LATENCY
+/* simulated device latency per COW operation */
+static const char *snapshot_latency_names[SNAPSHOT_LATENCY_NUM] = {
+	/* write of a COWed block */
+	"test-cow-latency-usec",
+	/* read of the block bitmap for a new COW bitmap */
+	"test-bitmap-latency-usec",
+};
+
+u32 snapshot_test_latency_usec[SNAPSHOT_LATENCY_NUM] __read_mostly = {0};
+static struct dentry *snapshot_latency[SNAPSHOT_LATENCY_NUM];
+static struct dentry *snapshot_latency_stats;
+
+/* injected latencies and the time they added to critical sections */
+static struct {
+	atomic_t count;
+	atomic64_t usec;
+} snapshot_latency_added[SNAPSHOT_LATENCY_NUM];
+#endif
 
 static char snapshot_version_str[] = EXT4_SNAPSHOT_VERSION;
 static struct debugfs_blob_wrapper snapshot_version_blob = {
@@ -64,6 +104,376 @@ static struct debugfs_blob_wrapper snapshot_version_blob = {
 	.size = sizeof(snapshot_version_str)
 };
 
+#if defined(CONFIG_EXT4_FS_SNAPSHOT_RACE_COW_WAITQ) || \
+	defined(CONFIG_EXT4_FS_SNAPSHOT_RACE_BITMAP_WAITQ)
+/*
+ * snapshot_wait_hist_add - account a wait time in histogram
+ * Bucket i counts waits of [2^(i-1), 2^i) usec and the last bucket
+ * counts all the longer waits.
+ */
+void snapshot_wait_hist_add(struct snapshot_wait_hist *hist, ktime_t start)
+{
+	s64 usec = ktime_us_delta(ktime_get(), start);
+	int i = 0;
+
+	while (usec > 0 && i < SNAPSHOT_WAIT_HIST_NUM - 1) {
+		usec >>= 1;
+		i++;
+	}
+	atomic_inc(&hist->count[i]);
+}
+
+static int snapshot_wait_hist_open(struct inode *inode, struct file *file)
+{
+	file->private_data = inode->i_private;
+	return 0;
+}
+
+/*
+ * Sample output:
+ *       0 usec: 0
+ *       1 usec: 3
+ *     2-3 usec: 12
+ *     ...
+ * 262144- usec: 0
+ */
+static ssize_t snapshot_wait_hist_read(struct file *file, char __user *buf,
+				       size_t count, loff_t *ppos)
+{
+	struct snapshot_wait_hist *hist = file->private_data;
+	char str[SNAPSHOT_WAIT_HIST_NUM * 32];
+	int i, len = 0;
+
+	for (i = 0; i < SNAPSHOT_WAIT_HIST_NUM; i++) {
+		unsigned long from = i ? 1UL << (i - 1) : 0;
+		unsigned long to = i ? (1UL << i) - 1 : 0;
+
+		if (i == SNAPSHOT_WAIT_HIST_NUM - 1)
+			len += snprintf(str + len, sizeof(str) - len,
+					"%7lu- usec: %u\n", from,
+					atomic_read(&hist->count[i]));
+		else if (from < to)
+			len += snprintf(str + len, sizeof(str) - len,
+					"%7lu-%lu usec: %u\n", from, to,
+					atomic_read(&hist->count[i]));
+		else
+			len += snprintf(str + len, sizeof(str) - len,
+					"%7lu usec: %u\n", from,
+					atomic_read(&hist->count[i]));
+	}
+	return simple_read_from_buffer(buf, count, ppos, str, len);
+}
+
+/* any write to the histogram file resets the histogram */
+static ssize_t snapshot_wait_hist_write(struct file *file,
+					const char __user *buf,
+					size_t count, loff_t *ppos)
+{
+	struct snapshot_wait_hist *hist = file->private_data;
+	int i;
+
+	for (i = 0; i < SNAPSHOT_WAIT_HIST_NUM; i++)
+		atomic_set(&hist->count[i], 0);
+	return count;
+}
+
+static const struct file_operations snapshot_wait_hist_fops = {
+	.open		= snapshot_wait_hist_open,
+	.read		= snapshot_wait_hist_read,
+	.write		= snapshot_wait_hist_write,
+	.llseek		= default_llseek,
+};
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_DEBUG_LATENCY
+
+/*
+ * __snapshot_test_latency - sleep for the simulated latency of operation @i
+ * and account the time actually added to the critical section.
+ */
+void __snapshot_test_latency(int i)
+{
+	unsigned long usec = snapshot_test_latency_usec[i];
+	ktime_t start = ktime_get();
+
+	usleep_range(usec, usec);
+	atomic_inc(&snapshot_latency_added[i].count);
+	atomic64_add(ktime_us_delta(ktime_get(), start),
+		     &snapshot_latency_added[i].usec);
+}
+
+/*
+ * Sample output:
+ * test-cow-latency-usec: 1024 times, 2061312 usec added
+ * test-bitmap-latency-usec: 12 times, 24354 usec added
+ */
+static ssize_t snapshot_latency_stats_read(struct file *file,
+		char __user *buf, size_t count, loff_t *ppos)
+{
+	char str[SNAPSHOT_LATENCY_NUM * 80];
+	int i, len = 0;
+
+	for (i = 0; i < SNAPSHOT_LATENCY_NUM; i++)
+		len += snprintf(str + len, sizeof(str) - len,
+				"%s: %u times, %lld usec added\n",
+				snapshot_latency_names[i],
+				atomic_read(&snapshot_latency_added[i].count),
+				(long long)atomic64_read(
+					&snapshot_latency_added[i].usec));
+	return simple_read_from_buffer(buf, count, ppos, str, len);
+}
+
+/* any write to the stats file resets the stats */
+static ssize_t snapshot_latency_stats_write(struct file *file,
+		const char __user *buf, size_t count, loff_t *ppos)
+{
+	int i;
+
+	for (i = 0; i < SNAPSHOT_LATENCY_NUM; i++) {
+		atomic_set(&snapshot_latency_added[i].count, 0);
+		atomic64_set(&snapshot_latency_added[i].usec, 0);
+	}
+	return count;
+}
+
+static const struct file_operations snapshot_latency_stats_fops = {
+	.read		= snapshot_latency_stats_read,
+	.write		= snapshot_latency_stats_write,
+	.llseek		= default_llseek,
+};
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_FAST
+
+static struct dentry *test_copy_bitmap;
+
+/* every read from start of file runs the COW bitmap masking benchmark */
+static ssize_t snapshot_test_copy_bitmap_read(struct file *file,
+		char __user *buf, size_t count, loff_t *ppos)
+{
+	char str[256];
+	int len;
+
+	if (*ppos)
+		return 0;
+	len = ext4_snapshot_test_copy_bitmap(str, sizeof(str));
+	return simple_read_from_buffer(buf, count, ppos, str, len);
+}
+
+static const struct file_operations snapshot_test_copy_bitmap_fops = {
+	.read		= snapshot_test_copy_bitmap_read,
+	.llseek		= default_llseek,
+};
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COPY_NOCACHE
+
+static struct dentry *test_copy_nocache;
+
+/* every read from start of file runs the snapshot copy cache benchmark */
+static ssize_t snapshot_test_copy_nocache_read(struct file *file,
+		char __user *buf, size_t count, loff_t *ppos)
+{
+	char str[256];
+	int len;
+
+	if (*ppos)
+		return 0;
+	len = ext4_snapshot_test_copy_nocache(str, sizeof(str));
+	return simple_read_from_buffer(buf, count, ppos, str, len);
+}
+
+static const struct file_operations snapshot_test_copy_nocache_fops = {
+	.read		= snapshot_test_copy_nocache_read,
+	.llseek		= default_llseek,
+};
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_DEBUG_BENCH
+
+/* threads and ops per thread of every snapshot microbenchmark case */
+#define SNAPSHOT_BENCH_THREADS_MAX	64
+#define SNAPSHOT_BENCH_REPORT_SIZE	(16 << 10)
+
+u8 snapshot_bench_threads __read_mostly = 4;
+u32 snapshot_bench_ops __read_mostly = 10000;
+static struct dentry *test_bench_threads;
+static struct dentry *test_bench_ops;
+static struct dentry *test_snapshot_bench;
+
+struct snapshot_bench_thread {
+	struct snapshot_bench_case *bc;
+	struct completion *start;
+	struct completion done;
+	int thread;
+	int ops;	/* max. ops on start, ops done on completion */
+	s64 ns;		/* time spent in ops */
+	int err;
+};
+
+static int snapshot_bench_thread_fn(void *arg)
+{
+	struct snapshot_bench_thread *bt = arg;
+	struct snapshot_bench_case *bc = bt->bc;
+	handle_t *handle = NULL;
+	ktime_t start;
+	int i = 0, j, err = 0, ret;
+
+	wait_for_completion(bt->start);
+	while (i < bt->ops && !err) {
+		if (bc->prepare) {
+			err = bc->prepare(bc, bt->thread);
+			if (err)
+				break;
+		}
+		if (bc->credits) {
+			handle = ext4_journal_start_sb(bc->sb, bc->credits);
+			if (IS_ERR(handle)) {
+				err = PTR_ERR(handle);
+				break;
+			}
+		}
+		start = ktime_get();
+		for (j = 0; j < bc->batch && i < bt->ops; j++, i++) {
+			err = bc->op(bc, handle, bt->thread, i);
+			if (err)
+				break;
+		}
+		bt->ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+		if (bc->credits) {
+			ret = ext4_journal_stop(handle);
+			if (!err)
+				err = ret;
+		}
+		cond_resched();
+	}
+	bt->ops = i;
+	/* running out of ops is not an error */
+	bt->err = err < 0 ? err : 0;
+	complete(&bt->done);
+	return 0;
+}
+
+/*
+ * snapshot_bench_run() - run a snapshot microbenchmark case
+ * Start 1, 2, 4.. snapshot_bench_threads threads together and report the
+ * average time per op and the total ops per second for every thread count.
+ * Returns the length of the report written into @buf.
+ *
+ * Sample output:
+ * test_and_cow mapped        1 threads:      412 ns/op    2421307 ops/sec
+ * test_and_cow mapped        2 threads:      436 ns/op    4556611 ops/sec
+ */
+int snapshot_bench_run(struct snapshot_bench_case *bc, char *buf, int size)
+{
+	struct snapshot_bench_thread *bt;
+	struct task_struct *task;
+	struct completion start;
+	ktime_t wall;
+	s64 ns, ns_wall;
+	int nthreads, ops, done, err = 0, len = 0;
+	int i, n, started;
+
+	nthreads = clamp_t(int, snapshot_bench_threads, 1,
+			   SNAPSHOT_BENCH_THREADS_MAX);
+	/* the total ops count must not overflow */
+	ops = min_t(u32, snapshot_bench_ops,
+		    INT_MAX / SNAPSHOT_BENCH_THREADS_MAX);
+	if (bc->ops && bc->ops < ops)
+		ops = bc->ops;
+	bt = kcalloc(nthreads, sizeof(*bt), GFP_KERNEL);
+	if (!bt)
+		return scnprintf(buf, size, "%s: out of memory\n", bc->name);
+
+	for (n = 1; n <= nthreads && !err; n *= 2) {
+		init_completion(&start);
+		for (started = 0; started < n; started++) {
+			bt[started].bc = bc;
+			bt[started].start = &start;
+			init_completion(&bt[started].done);
+			bt[started].thread = started;
+			bt[started].ops = ops;
+			bt[started].ns = 0;
+			bt[started].err = 0;
+			task = kthread_run(snapshot_bench_thread_fn,
+					   &bt[started], "snapbench/%d",
+					   started);
+			if (IS_ERR(task)) {
+				err = PTR_ERR(task);
+				break;
+			}
+		}
+		wall = ktime_get();
+		complete_all(&start);
+		ns = done = 0;
+		for (i = 0; i < started; i++) {
+			wait_for_completion(&bt[i].done);
+			ns += bt[i].ns;
+			done += bt[i].ops;
+			if (!err)
+				err = bt[i].err;
+		}
+		ns_wall = ktime_to_ns(ktime_sub(ktime_get(), wall));
+		if (err || !done)
+			break;
+		len += scnprintf(buf + len, size - len,
+				 "%-26s %2d threads: %8lld ns/op %10lld "
+				 "ops/sec\n", bc->name, n, div_s64(ns, done),
+				 div64_s64((s64)done * NSEC_PER_SEC,
+					   max_t(s64, ns_wall, 1)));
+	}
+	if (err)
+		len += scnprintf(buf + len, size - len,
+				 "%-26s %2d threads: error %d\n",
+				 bc->name, n, err);
+	else if (n == 1)
+		len += scnprintf(buf + len, size - len,
+				 "%-26s no ops to run\n", bc->name);
+	kfree(bt);
+	return len;
+}
+
+/*
+ * every read from start of file runs the snapshot microbenchmarks on the
+ * file system of the working directory of the reader
+ */
+static ssize_t snapshot_test_bench_read(struct file *file,
+		char __user *buf, size_t count, loff_t *ppos)
+{
+	struct super_block *sb;
+	struct path pwd;
+	char *str;
+	ssize_t ret;
+	int len;
+
+	if (*ppos)
+		return 0;
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	get_fs_pwd(current->fs, &pwd);
+	sb = pwd.dentry->d_sb;
+	ret = -EINVAL;
+	if (!ext4_sb_is_ext4(sb) || !EXT4_SNAPSHOTS(sb))
+		goto out_path;
+	ret = -EROFS;
+	if (sb->s_flags & MS_RDONLY)
+		goto out_path;
+	ret = -ENOMEM;
+	str = vmalloc(SNAPSHOT_BENCH_REPORT_SIZE);
+	if (!str)
+		goto out_path;
+
+	len = ext4_snapshot_bench_cow(sb, str, SNAPSHOT_BENCH_REPORT_SIZE);
+	len += ext4_snapshot_bench_read_through(sb, str + len,
+					SNAPSHOT_BENCH_REPORT_SIZE - len);
+	ret = simple_read_from_buffer(buf, count, ppos, str, len);
+	vfree(str);
+out_path:
+	path_put(&pwd);
+	return ret;
+}
+
+static const struct file_operations snapshot_test_bench_fops = {
+	.read		= snapshot_test_bench_read,
+	.llseek		= default_llseek,
+};
+#endif
 
 /*
  * ext4_snapshot_create_debugfs_entry - register ext4 snapshot debug hooks
@@ -85,11 +495,60 @@ void ext4_snapshot_create_debugfs_entry(struct dentry *debugfs_dir)
 					      S_IRUGO|S_IWUSR,
 					      debugfs_dir,
 					      &snapshot_enable_test[i]);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_DEBUG_LATENCY
+	for (i = 0; i < SNAPSHOT_LATENCY_NUM; i++)
+		snapshot_latency[i] = debugfs_create_u32(
+					      snapshot_latency_names[i],
+					      S_IRUGO|S_IWUSR, debugfs_dir,
+					      &snapshot_test_latency_usec[i]);
+	snapshot_latency_stats = debugfs_create_file("test-latency-stats",
+					      S_IRUGO|S_IWUSR, debugfs_dir,
+					      NULL,
+					      &snapshot_latency_stats_fops);
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CACHE
 	cow_cache = debugfs_create_u8("cow-cache", S_IRUGO|S_IWUSR,
 					   debugfs_dir,
 					   &cow_cache_enabled);
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_FAST
+	test_copy_bitmap = debugfs_create_file("test-copy-bitmap", S_IRUSR,
+					       debugfs_dir, NULL,
+					       &snapshot_test_copy_bitmap_fops);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COPY_NOCACHE
+	test_copy_nocache = debugfs_create_file("test-copy-nocache", S_IRUSR,
+						debugfs_dir, NULL,
+						&snapshot_test_copy_nocache_fops);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_DEBUG_BENCH
+	test_bench_threads = debugfs_create_u8("test-bench-threads",
+					       S_IRUGO|S_IWUSR, debugfs_dir,
+					       &snapshot_bench_threads);
+	test_bench_ops = debugfs_create_u32("test-bench-ops",
+					    S_IRUGO|S_IWUSR, debugfs_dir,
+					    &snapshot_bench_ops);
+	test_snapshot_bench = debugfs_create_file("test-snapshot-bench",
+						  S_IRUSR, debugfs_dir, NULL,
+						  &snapshot_test_bench_fops);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREBUILD
+	cow_bitmap_prebuild = debugfs_create_u8("cow-bitmap-prebuild",
+					   S_IRUGO|S_IWUSR, debugfs_dir,
+					   &cow_bitmap_prebuild_enabled);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW_WAITQ
+	cow_wait_hist = debugfs_create_file("cow-wait-hist", S_IRUGO|S_IWUSR,
+					    debugfs_dir,
+					    &snapshot_cow_wait_hist,
+					    &snapshot_wait_hist_fops);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_BITMAP_WAITQ
+	cow_bitmap_wait_hist = debugfs_create_file("cow-bitmap-wait-hist",
+					    S_IRUGO|S_IWUSR, debugfs_dir,
+					    &snapshot_cow_bitmap_wait_hist,
+					    &snapshot_wait_hist_fops);
+#endif
 }
 
 /*
@@ -100,9 +559,44 @@ void ext4_snapshot_remove_debugfs_entry(void)
 {
 	int i;
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_FAST
+	if (test_copy_bitmap)
+		debugfs_remove(test_copy_bitmap);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COPY_NOCACHE
+	if (test_copy_nocache)
+		debugfs_remove(test_copy_nocache);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_DEBUG_BENCH
+	if (test_snapshot_bench)
+		debugfs_remove(test_snapshot_bench);
+	if (test_bench_ops)
+		debugfs_remove(test_bench_ops);
+	if (test_bench_threads)
+		debugfs_remove(test_bench_threads);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREBUILD
+	if (cow_bitmap_prebuild)
+		debugfs_remove(cow_bitmap_prebuild);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_BITMAP_WAITQ
+	if (cow_bitmap_wait_hist)
+		debugfs_remove(cow_bitmap_wait_hist);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW_WAITQ
+	if (cow_wait_hist)
+		debugfs_remove(cow_wait_hist);
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CACHE
 	if (cow_cache)
 		debugfs_remove(cow_cache);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_DEBUG_LATENCY
+	if (snapshot_latency_stats)
+		debugfs_remove(snapshot_latency_stats);
+	for (i = 0; i < SNAPSHOT_LATENCY_NUM; i++)
+		if (snapshot_latency[i])
+			debugfs_remove(snapshot_latency[i]);
 #endif
 	for (i = 0; i < SNAPSHOT_TESTS_NUM && i < SNAPSHOT_TEST_NAMES; i++)
 		if (snapshot_test[i])
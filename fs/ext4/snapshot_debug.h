@@ -17,6 +17,7 @@
 
 #if defined(CONFIG_EXT4_FS_SNAPSHOT) && defined(CONFIG_EXT4_DEBUG)
 #include <linux/delay.h>
+#include <linux/ktime.h>
 
 #define SNAPSHOT_INDENT_MAX 4
 #define SNAPSHOT_INDENT_STR "\t\t\t\t"
@@ -32,6 +33,31 @@ extern const char *snapshot_indent;
 extern u8 snapshot_enable_debug;
 extern u16 snapshot_enable_test[SNAPSHOT_TESTS_NUM];
 extern u8 cow_cache_enabled;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREBUILD
+extern u8 cow_bitmap_prebuild_enabled;
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_DEBUG_LATENCY
+#define SNAPLAT_COW	0
+#define SNAPLAT_BITMAP	1
+#define SNAPSHOT_LATENCY_NUM	2
+
+extern u32 snapshot_test_latency_usec[SNAPSHOT_LATENCY_NUM];
+extern void __snapshot_test_latency(int i);
+
+/*
+ * Simulate device latency inside a COW critical section.
+ * Unlike snapshot_test_delay(), the sleep is not cut short by signals,
+ * so the added latency is repeatable.
+ */
+#define snapshot_test_latency(i)				\
+	do {							\
+		if (snapshot_test_latency_usec[i])		\
+			__snapshot_test_latency(i);		\
+	} while (0)
+#else
+#define snapshot_test_latency(i)
+#endif
 
 #define snapshot_test_delay(i)		     \
 	do {							       \
@@ -80,6 +106,68 @@ extern u8 cow_cache_enabled;
 		}							\
 	} while (0)
 
+/*
+ * Wait time histogram - wait times are accounted in log2(usec) buckets
+ */
+#define SNAPSHOT_WAIT_HIST_NUM	20
+
+struct snapshot_wait_hist {
+	atomic_t count[SNAPSHOT_WAIT_HIST_NUM];
+};
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW_WAITQ
+extern struct snapshot_wait_hist snapshot_cow_wait_hist;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_BITMAP_WAITQ
+extern struct snapshot_wait_hist snapshot_cow_bitmap_wait_hist;
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_FAST
+extern int ext4_snapshot_test_copy_bitmap(char *buf, int size);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COPY_NOCACHE
+extern int ext4_snapshot_test_copy_nocache(char *buf, int size);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_DEBUG_BENCH
+
+/*
+ * Snapshot microbenchmark case - snapshot_bench_run() runs @op up to
+ * snapshot_bench_ops times in each of 1, 2, 4.. snapshot_bench_threads
+ * threads.  The ops are run in batches of @batch ops under a journal handle
+ * with @credits user credits (no handle if @credits is 0).  Only the time
+ * spent in @op is counted as op latency.
+ */
+struct snapshot_bench_case {
+	const char *name;
+	struct super_block *sb;
+	int ops;		/* max. ops per thread (0 - no limit) */
+	int batch;		/* ops per journal handle */
+	int credits;		/* user credits per journal handle */
+	/* called before every batch without a handle (optional) */
+	int (*prepare)(struct snapshot_bench_case *bc, int thread);
+	/* returns 0 on success, > 0 if out of ops and < 0 on error */
+	int (*op)(struct snapshot_bench_case *bc, handle_t *handle,
+		  int thread, int i);
+	void *private;
+};
+
+extern u8 snapshot_bench_threads;
+extern u32 snapshot_bench_ops;
+extern int snapshot_bench_run(struct snapshot_bench_case *bc,
+			      char *buf, int size);
+extern int ext4_sb_is_ext4(struct super_block *sb);
+extern int ext4_snapshot_bench_cow(struct super_block *sb,
+				   char *buf, int size);
+extern int ext4_snapshot_bench_read_through(struct super_block *sb,
+					    char *buf, int size);
+#endif
+
+#if defined(CONFIG_EXT4_FS_SNAPSHOT_RACE_COW_WAITQ) || \
+	defined(CONFIG_EXT4_FS_SNAPSHOT_RACE_BITMAP_WAITQ)
+extern void snapshot_wait_hist_add(struct snapshot_wait_hist *hist,
+				   ktime_t start);
+#endif
+
 extern void ext4_snapshot_create_debugfs_entry(struct dentry *debugfs_dir);
 extern void ext4_snapshot_remove_debugfs_entry(void);
 
@@ -87,6 +175,7 @@ extern void ext4_snapshot_remove_debugfs_entry(void);
 #define snapshot_enable_debug (0)
 #define snapshot_test_delay(i)
 #define snapshot_test_delay_progress(i, from, to, max)
+#define snapshot_test_latency(i)
 #define snapshot_debug(n, f, a...)
 #define snapshot_debug_l(n, l, f, a...)
 #define snapshot_debug_once(n, f, a...)
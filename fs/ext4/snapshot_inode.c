@@ -26,6 +26,26 @@
 #include <linux/mpage.h>
 #include <linux/namei.h>
 #include <linux/uio.h>
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_READAHEAD
+#include <linux/blkdev.h>
+#include <linux/sort.h>
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_SPLICE_SHARED
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_BDEV
+#include <linux/blkdev.h>
+#include <linux/genhd.h>
+#include <linux/idr.h>
+#include <linux/highmem.h>
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_CLONE
+#include <linux/file.h>
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_AUTOMOUNT
+#include <linux/mount.h>
+#endif
 #include <linux/bio.h>
 #include <linux/workqueue.h>
 #include <linux/kernel.h>
@@ -96,7 +116,152 @@ static int ext4_snapshot_blks_to_skip(struct inode *inode, ext4_lblk_t i_block,
 	count -= i_block;
 	return count < maxblocks ? count : maxblocks;
 }
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_READAHEAD
+
+static int ext4_snapshot_cmp_blocks(const void *a, const void *b)
+{
+	ext4_fsblk_t x = *(const ext4_fsblk_t *)a;
+	ext4_fsblk_t y = *(const ext4_fsblk_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * ext4_snapshot_readahead_array - read ahead an array of indirect blocks
+ * @inode:	snapshot inode
+ * @first:	array of block numbers
+ * @last:	points immediately past the end of array
+ *
+ * Submits the reads of the blocks sorted by physical address under a plug,
+ * so the walk of the tree below them finds them in the buffer cache.
+ */
+static void ext4_snapshot_readahead_array(struct inode *inode,
+					  __le32 *first, __le32 *last)
+{
+	struct super_block *sb = inode->i_sb;
+	ext4_fsblk_t *blocks, nr;
+	struct blk_plug plug;
+	__le32 *p;
+	int i, n = 0;
+
+	blocks = kmalloc((last - first) * sizeof(*blocks), GFP_NOFS);
+	blk_start_plug(&plug);
+	for (p = first; p < last; p++) {
+		nr = le32_to_cpu(*p);
+		if (!nr || !ext4_data_block_valid(EXT4_SB(sb), nr, 1))
+			continue;
+		if (blocks)
+			blocks[n++] = nr;
+		else
+			/* no memory to sort - read ahead in tree order */
+			sb_breadahead(sb, nr);
+	}
+	if (blocks) {
+		sort(blocks, n, sizeof(*blocks), ext4_snapshot_cmp_blocks,
+		     NULL);
+		for (i = 0; i < n; i++)
+			sb_breadahead(sb, blocks[i]);
+		kfree(blocks);
+	}
+	blk_finish_plug(&plug);
+}
+
+/*
+ * ext4_snapshot_readahead_ind - read ahead the indirect blocks that map
+ * @maxblocks blocks from @iblock, up to the end of their parent block.
+ * Called at the start of every indirect block range, so shrink and merge of
+ * cold snapshots read the next level of the tree in one batch, instead of
+ * one indirect block at a time.
+ */
+static void ext4_snapshot_readahead_ind(struct inode *inode,
+		ext4_lblk_t iblock, unsigned long maxblocks,
+		int *offsets, int depth)
+{
+	int ptrs = EXT4_ADDR_PER_BLOCK(inode->i_sb);
+	int ptrs_bits = EXT4_ADDR_PER_BLOCK_BITS(inode->i_sb);
+	Indirect chain[4], *partial;
+	__le32 *first, *last;
+	unsigned long n;
+	int err;
+
+	if (depth < 3 || offsets[depth - 1])
+		return;
+
+	partial = ext4_get_branch(inode, depth - 1, offsets, chain, &err);
+	if (err)
+		return;
+	if (!partial) {
+		partial = chain + depth - 2;
+		first = partial->p;
+		last = (__le32 *)partial->bh->b_data + ptrs;
+		n = (maxblocks + ptrs - 1) >> ptrs_bits;
+		if (n < last - first)
+			last = first + n;
+		ext4_snapshot_readahead_array(inode, first, last);
+	}
+	while (partial > chain) {
+		brelse(partial->bh);
+		partial--;
+	}
+}
+
+#endif
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_DIFF
+/*
+ * ext4_snapshot_diff_blocks - find the range of mapped blocks or the hole
+ * at offset @iblock of snapshot @inode
+ * @inode:	snapshot inode
+ * @iblock:	inode offset to first data block to look at
+ * @maxblocks:	max number of data blocks to look at
+ * @pmapped:	return 1 for a range of mapped blocks and 0 for a hole
+ *
+ * Holes are skipped a whole branch at a time.  A mapped range ends at the
+ * first hole or at the boundary of the indirect block.
+ * Called from ext4_snapshot_diff() under snapshot_mutex and
+ * down_read(&i_data_sem).
+ * Returns the length of the range and <0 on error.
+ */
+int ext4_snapshot_diff_blocks(struct inode *inode,
+		ext4_lblk_t iblock, unsigned long maxblocks, int *pmapped)
+{
+	int offsets[4];
+	Indirect chain[4], *partial;
+	int err, blocks_to_boundary, depth, count = 0;
+
+	depth = ext4_block_to_path(inode, iblock, offsets, &blocks_to_boundary);
+	if (depth < 3)
+		/* snapshot blocks are mapped with double and tripple
+		   indirect blocks */
+		return -EIO;
+
+	partial = ext4_get_branch(inode, depth, offsets, chain, &err);
+	if (err)
+		goto out;
+
+	if (partial) {
+		/* hole - count the number of blocks to skip */
+		*pmapped = 0;
+		count = ext4_snapshot_blks_to_skip(inode, iblock, maxblocks,
+						   chain, depth, offsets,
+						   (partial - chain));
+	} else {
+		/* data block mapped - count mapped blocks upto boundary */
+		*pmapped = 1;
+		partial = chain + depth - 1;
+		while (count < maxblocks && count <= blocks_to_boundary &&
+		       *(partial->p + count))
+			count++;
+	}
+out:
+	while (partial > chain) {
+		brelse(partial->bh);
+		partial--;
+	}
+	return err ? err : count;
+}
 
+#endif
 /*
  * ext4_snapshot_shrink_blocks - free unused blocks from deleted snapshot
  * @handle: JBD handle for this transaction
@@ -147,6 +312,9 @@ int ext4_snapshot_shrink_blocks(handle_t *handle, struct inode *inode,
 	if (!desc)
 		return -EIO;
 	block_bitmap = ext4_block_bitmap(inode->i_sb, desc);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_READAHEAD
+	ext4_snapshot_readahead_ind(inode, iblock, maxblocks, offsets, depth);
+#endif
 	partial = ext4_get_branch(inode, depth, offsets, chain, &err);
 	if (err)
 		return err;
@@ -355,6 +523,10 @@ static int ext4_snapshot_count_branches(struct inode *inode,
 		struct buffer_head *bh = NULL;
 		int addr_per_block = EXT4_ADDR_PER_BLOCK(inode->i_sb);
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_READAHEAD
+		/* read the whole next level before descending */
+		ext4_snapshot_readahead_array(inode, first, last);
+#endif
 		p = last;
 		while (--p >= first) {
 			nr = le32_to_cpu(*p);
@@ -484,6 +656,10 @@ int ext4_snapshot_merge_blocks(handle_t *handle,
 
 	memset(D, 0, sizeof(D));
 	memset(S, 0, sizeof(S));
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_READAHEAD
+	ext4_snapshot_readahead_ind(dst, iblock, maxblocks, offsets, depth);
+	ext4_snapshot_readahead_ind(src, iblock, maxblocks, offsets, depth);
+#endif
 	pD = ext4_get_branch(dst, depth, offsets, D, &err);
 	kd = (pD ? pD - D : depth - 1);
 	if (err)
@@ -517,7 +693,16 @@ int ext4_snapshot_merge_blocks(handle_t *handle,
 	/* compute max branches that can be moved */
 	data_ptrs_bits = ptrs_bits * (depth - kd - 1);
 	data_ptrs_mask = (1 << data_ptrs_bits) - 1;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_MERGE_PARALLEL
+	/*
+	 * don't move branches beyond the merged range - they may belong to
+	 * the range of another merge worker
+	 */
+	max_ptrs = (((iblock & data_ptrs_mask) + maxblocks - 1) >>
+		    data_ptrs_bits) + 1;
+#else
 	max_ptrs = (maxblocks >> data_ptrs_bits) + 1;
+#endif
 	if (max_ptrs > ptrs-offsets[kd])
 		max_ptrs = ptrs-offsets[kd];
 
@@ -542,8 +727,15 @@ int ext4_snapshot_merge_blocks(handle_t *handle,
 			       dst->i_generation, iblock,
 			       count, kd, depth, moved);
 		/* update src and dst inodes blocks usage */
-		dquot_free_block(src, moved);
-		dquot_alloc_block_nofail(dst, moved);
+		ext4_snapshot_uncharge_blocks(src, moved);
+		ext4_snapshot_charge_blocks(dst, moved);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+		atomic64_add(moved, &EXT4_I(dst)->i_snapshot_merged);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_CACHE
+		/* holes in non active dst were filled */
+		ext4_snapshot_list_changed(dst->i_sb);
+#endif
 		err = ext4_handle_dirty_metadata(handle, NULL, pD->bh);
 		if (err)
 			goto out;
@@ -566,6 +758,15 @@ out:
 	return err < maxblocks ? err : maxblocks;
 }
 
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_RCU
+/*
+ * Read through walks of the snapshot list hold ext4_snapshot_list_srcu.
+ * The snapshot inodes on the list are pinned by the list references, which
+ * are dropped after a grace period when a snapshot is removed from the list.
+ */
+struct srcu_struct ext4_snapshot_list_srcu;
+
 #endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READ
 /*
@@ -628,7 +829,10 @@ static int ext4_snapshot_get_block_access(struct inode *inode,
 {
 	struct ext4_inode_info *ei = EXT4_I(inode);
 	unsigned long flags = ext4_get_snapstate_flags(inode);
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_RCU
+	struct list_head *prev = srcu_dereference(ei->i_snaplist.prev,
+						  &ext4_snapshot_list_srcu);
+#elif defined(CONFIG_EXT4_FS_SNAPSHOT_LIST_READ)
 	struct list_head *prev = ei->i_snaplist.prev;
 #endif
 
@@ -667,6 +871,153 @@ static int ext4_snapshot_get_block_access(struct inode *inode,
 #endif
 }
 
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_FIEMAP
+/*
+ * ext4_snapshot_fiemap_resolve - find where a range of snapshot image blocks
+ * is read from
+ * @inode:	snapshot inode
+ * @iblock:	inode offset to first block of range
+ * @maxblocks:	max length of range
+ * @pblk:	return physical block of range
+ * @pflags:	return FIEMAP extent flags of range
+ *
+ * Follows the read through path of ext4_snapshot_read_through(): a hole in
+ * a snapshot reads through to the newer snapshot and a hole in the active
+ * snapshot reads through to the block device.
+ * Returns the length of the range that is read from the same place and
+ * <0 on error.
+ */
+static int ext4_snapshot_fiemap_resolve(struct inode *inode,
+		ext4_lblk_t iblock, unsigned long maxblocks,
+		ext4_fsblk_t *pblk, u32 *pflags)
+{
+	struct inode *snapshot, *prev_snapshot;
+	struct ext4_map_blocks map;
+	int len, mapped, err;
+
+retry:
+	snapshot = inode;
+	*pflags = FIEMAP_EXTENT_MERGED;
+	while (1) {
+		err = ext4_snapshot_get_block_access(snapshot, &prev_snapshot);
+		if (err < 0)
+			return err;
+		down_read(&EXT4_I(snapshot)->i_data_sem);
+		len = ext4_snapshot_diff_blocks(snapshot, iblock, maxblocks,
+						&mapped);
+		up_read(&EXT4_I(snapshot)->i_data_sem);
+		if (len <= 0)
+			return len ? len : -EIO;
+		maxblocks = len;
+		if (mapped)
+			break;
+		if (!prev_snapshot) {
+			/* hole in active snapshot - read through to bdev */
+			*pblk = SNAPSHOT_BLOCK(iblock);
+			*pflags |= FIEMAP_EXTENT_SHARED | FIEMAP_EXTENT_UNKNOWN;
+			return len;
+		}
+		/* hole in snapshot - read through to newer snapshot */
+		*pflags |= FIEMAP_EXTENT_SHARED;
+		snapshot = prev_snapshot;
+	}
+
+	map.m_lblk = iblock;
+	map.m_len = maxblocks;
+	err = ext4_map_blocks(NULL, snapshot, &map, 0);
+	if (!err)
+		/* blocks were merged to another snapshot - try again */
+		goto retry;
+	if (err > 0)
+		*pblk = map.m_pblk;
+	return err;
+}
+
+/*
+ * ext4_snapshot_fiemap - FIEMAP of snapshot file
+ * Reports the snapshot image layout with read through semantics:
+ * - blocks copied to this snapshot: no flags
+ * - blocks moved to this snapshot: no flags (and fe_physical == fe_logical)
+ * - holes that read through to a newer snapshot: FIEMAP_EXTENT_SHARED
+ * - holes that read through to the block device: FIEMAP_EXTENT_SHARED and
+ *   FIEMAP_EXTENT_UNKNOWN, because the block may be COWed at any time
+ * All extents have FIEMAP_EXTENT_MERGED, as for other indirect mapped files.
+ * The snapshot list is read without snapshot_mutex, with the same reasoning
+ * as ext4_snapshot_get_block_access(), and no locks are held when extents
+ * are copied to user space.
+ */
+int ext4_snapshot_fiemap(struct inode *inode,
+		struct fiemap_extent_info *fieinfo, __u64 start, __u64 len)
+{
+	unsigned int bits = inode->i_blkbits;
+	/* snapshot image may span 2^32 blocks */
+	ext4_fsblk_t iblock, last, ext_lblk = 0;
+	ext4_fsblk_t pblk, ext_pblk = 0;
+	u64 size = (u64)SNAPSHOT_BLOCKS(inode) << bits;
+	u32 flags, ext_flags = 0;
+	int n, ext_len = 0, err = 0;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_RCU
+	int idx;
+#endif
+
+	if (fiemap_check_flags(fieinfo, FIEMAP_FLAG_SYNC))
+		return -EBADR;
+
+	if (start >= size)
+		return 0;
+	if (len > size - start)
+		len = size - start;
+	iblock = start >> bits;
+	last = (start + len + (1 << bits) - 1) >> bits;
+
+	while (iblock < last) {
+		if (fatal_signal_pending(current))
+			return -EINTR;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_RCU
+		idx = srcu_read_lock(&ext4_snapshot_list_srcu);
+#endif
+		n = ext4_snapshot_fiemap_resolve(inode, SNAPSHOT_IBLOCK(iblock),
+						 last - iblock, &pblk, &flags);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_RCU
+		srcu_read_unlock(&ext4_snapshot_list_srcu, idx);
+#endif
+		if (n < 0)
+			return n;
+		if (ext_len && flags == ext_flags &&
+		    ext_pblk + ext_len == pblk) {
+			/* extend pending extent */
+			ext_len += n;
+		} else {
+			if (ext_len) {
+				err = fiemap_fill_next_extent(fieinfo,
+						(u64)ext_lblk << bits,
+						(u64)ext_pblk << bits,
+						(u64)ext_len << bits,
+						ext_flags);
+				if (err)
+					/* 1 means extents array is full */
+					return err < 0 ? err : 0;
+			}
+			ext_lblk = iblock;
+			ext_pblk = pblk;
+			ext_len = n;
+			ext_flags = flags;
+		}
+		iblock += n;
+		cond_resched();
+	}
+
+	if (ext_len) {
+		if ((u64)iblock << bits >= size)
+			ext_flags |= FIEMAP_EXTENT_LAST;
+		err = fiemap_fill_next_extent(fieinfo, (u64)ext_lblk << bits,
+					      (u64)ext_pblk << bits,
+					      (u64)ext_len << bits, ext_flags);
+	}
+	return err < 0 ? err : 0;
+}
+
 #endif
 #ifdef CONFIG_EXT4_DEBUG
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READ
@@ -726,6 +1077,132 @@ static int ext4_snapshot_get_blockdev_access(struct super_block *sb,
 	return err;
 }
 #endif
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_CACHE
+/*
+ * Snapshot read through cache:
+ * Blocks are only added to the active snapshot, so a hole in a non active
+ * snapshot is never filled, as long as the snapshot list is not changed.
+ * Snapshot merge, which fills holes of a non active snapshot, and COW dedup
+ * change the list generation as well.
+ * After a read through from a snapshot is resolved, the number of older
+ * snapshots that were found unmapped (the skip count) is stored per snapshot
+ * block in a radix tree.  The next read through of the same block skips
+ * those snapshots without mapping them.  The active snapshot is never skipped.
+ *
+ * Cached entries are tagged with the snapshot list generation, which is
+ * incremented on every snapshot list change, so a stale cache is simply
+ * ignored and then flushed on the next insert.
+ * Lookup is done under RCU and insert under the cache mutex.
+ */
+#define SNAPSHOT_READ_CACHE_MAX		(1 << 18)
+
+struct ext4_snapshot_read_cache {
+	struct mutex		lock;
+	struct radix_tree_root	tree;	/* iblock -> skip count */
+	unsigned int		gen;	/* snapshot list generation */
+	unsigned long		count;	/* no. of cached entries */
+};
+
+static inline unsigned int ext4_snapshot_list_gen(struct super_block *sb)
+{
+	unsigned int gen = ACCESS_ONCE(EXT4_SB(sb)->s_snapshot_list_gen);
+
+	/* read list generation before reading the snapshot list */
+	smp_rmb();
+	return gen;
+}
+
+static void ext4_snapshot_flush_read_cache(
+		struct ext4_snapshot_read_cache *cache)
+{
+	void **slots[16];
+	unsigned long indices[16];
+	unsigned long index = 0;
+	unsigned int i, n;
+
+	while ((n = radix_tree_gang_lookup_slot(&cache->tree, slots, indices,
+						index, ARRAY_SIZE(slots)))) {
+		for (i = 0; i < n; i++)
+			radix_tree_delete(&cache->tree, indices[i]);
+		index = indices[n - 1] + 1;
+	}
+	cache->count = 0;
+}
+
+/*
+ * Returns the no. of snapshots that can be skipped on read through
+ * from @inode to the block @iblock or 0 if not cached.
+ */
+static int ext4_snapshot_lookup_read_cache(struct inode *inode,
+		sector_t iblock, unsigned int gen)
+{
+	struct ext4_snapshot_read_cache *cache;
+	void *entry = NULL;
+
+	cache = ACCESS_ONCE(EXT4_I(inode)->i_snapshot_read_cache);
+	if (!cache || ACCESS_ONCE(cache->gen) != gen)
+		return 0;
+
+	rcu_read_lock();
+	entry = radix_tree_lookup(&cache->tree, iblock);
+	rcu_read_unlock();
+	return (unsigned long)entry >> RADIX_TREE_EXCEPTIONAL_SHIFT;
+}
+
+static void ext4_snapshot_insert_read_cache(struct inode *inode,
+		sector_t iblock, unsigned int gen, int skip)
+{
+	struct ext4_inode_info *ei = EXT4_I(inode);
+	struct ext4_snapshot_read_cache *cache;
+	void *entry;
+
+	cache = ACCESS_ONCE(ei->i_snapshot_read_cache);
+	if (!cache) {
+		cache = kzalloc(sizeof(*cache), GFP_NOFS);
+		if (!cache)
+			return;
+		mutex_init(&cache->lock);
+		INIT_RADIX_TREE(&cache->tree, GFP_NOFS);
+		cache->gen = gen;
+		if (cmpxchg(&ei->i_snapshot_read_cache, NULL, cache)) {
+			kfree(cache);
+			cache = ei->i_snapshot_read_cache;
+		}
+	}
+
+	entry = (void *)(((unsigned long)skip << RADIX_TREE_EXCEPTIONAL_SHIFT) |
+			 RADIX_TREE_EXCEPTIONAL_ENTRY);
+	mutex_lock(&cache->lock);
+	/* snapshot list changed during read through? */
+	if (gen != ext4_snapshot_list_gen(inode->i_sb))
+		goto out;
+	if (cache->gen != gen || cache->count >= SNAPSHOT_READ_CACHE_MAX) {
+		ext4_snapshot_flush_read_cache(cache);
+		cache->gen = gen;
+	}
+	radix_tree_delete(&cache->tree, iblock);
+	if (!radix_tree_insert(&cache->tree, iblock, entry))
+		cache->count++;
+out:
+	mutex_unlock(&cache->lock);
+}
+
+/*
+ * ext4_snapshot_free_read_cache - called from ext4_clear_inode()
+ */
+void ext4_snapshot_free_read_cache(struct inode *inode)
+{
+	struct ext4_snapshot_read_cache *cache;
+
+	cache = EXT4_I(inode)->i_snapshot_read_cache;
+	if (!cache)
+		return;
+	EXT4_I(inode)->i_snapshot_read_cache = NULL;
+	ext4_snapshot_flush_read_cache(cache);
+	kfree(cache);
+}
+
 #endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READ
 
@@ -735,8 +1212,13 @@ static int ext4_snapshot_get_blockdev_access(struct super_block *sb,
  * On read of active snapshot, an unmapped block is a peephole to the block
  * device.  On first block write, the peephole is filled forever.
  */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_RCU
+static int __ext4_snapshot_read_through(struct inode *inode, sector_t iblock,
+				      struct buffer_head *bh_result)
+#else
 static int ext4_snapshot_read_through(struct inode *inode, sector_t iblock,
 				      struct buffer_head *bh_result)
+#endif
 {
 	int err;
 	struct ext4_map_blocks map;
@@ -744,6 +1226,13 @@ static int ext4_snapshot_read_through(struct inode *inode, sector_t iblock,
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW
 	struct buffer_head *sbh = NULL;
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_CACHE
+	struct inode *snapshot = inode;
+	unsigned int gen = ext4_snapshot_list_gen(inode->i_sb);
+	int cached, skip, skipped = 0;
+
+	cached = skip = ext4_snapshot_lookup_read_cache(inode, iblock, gen);
+#endif
 
 	map.m_lblk = iblock;
 	map.m_pblk = 0;
@@ -757,6 +1246,17 @@ get_block:
 	err = ext4_snapshot_get_block_access(inode, &prev_snapshot);
 	if (err < 0)
 		return err;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_CACHE
+	if (skip > 0 && prev_snapshot) {
+		/* cached hole in non active snapshot - skip to prev snapshot */
+		skip--;
+		skipped++;
+		inode = prev_snapshot;
+		goto get_block;
+	}
+	/* never skip the active snapshot */
+	skip = 0;
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_READ
 	if (!prev_snapshot) {
 		/*
@@ -795,9 +1295,16 @@ get_block:
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ
 	if (!err && prev_snapshot) {
 		/* hole in snapshot - check again with prev snapshot */
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_CACHE
+		skipped++;
+#endif
 		inode = prev_snapshot;
 		goto get_block;
 	}
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_CACHE
+	if (skipped != cached)
+		ext4_snapshot_insert_read_cache(snapshot, iblock, gen, skipped);
 #endif
 	if (!err)
 		/* hole in active snapshot - read though to block device */
@@ -807,6 +1314,11 @@ get_block:
 	bh_result->b_state = (bh_result->b_state & ~EXT4_MAP_FLAGS) |
 		map.m_flags;
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READ_SHARED
+	/* no snapshot page to copy to on shared block read */
+	if (!bh_result->b_page)
+		return 0;
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_COW
 	/*
 	 * On read of active snapshot, a mapped block may belong to a non
@@ -850,6 +1362,90 @@ get_block:
 #endif
 	return 0;
 }
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_RCU
+
+static int ext4_snapshot_read_through(struct inode *inode, sector_t iblock,
+				      struct buffer_head *bh_result)
+{
+	int idx, err;
+
+	idx = srcu_read_lock(&ext4_snapshot_list_srcu);
+	err = __ext4_snapshot_read_through(inode, iblock, bh_result);
+	srcu_read_unlock(&ext4_snapshot_list_srcu, idx);
+	return err;
+}
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_DEBUG_BENCH
+/* max. depth of snapshot list to read through */
+#define SNAPSHOT_BENCH_DEPTH_MAX	8
+
+/*
+ * read through of a block of the last block group.  those blocks are the
+ * least likely to be in use, so most reads go through all the newer
+ * snapshots to the block device.
+ */
+static int ext4_snapshot_bench_read_through_op(struct snapshot_bench_case *bc,
+		handle_t *handle, int thread, int i)
+{
+	struct inode *inode = bc->private;
+	struct super_block *sb = inode->i_sb;
+	ext4_fsblk_t first = ext4_group_first_block_no(sb,
+					ext4_get_groups_count(sb) - 1);
+	ext4_grpblk_t count = min_t(ext4_fsblk_t, EXT4_BLOCKS_PER_GROUP(sb),
+			ext4_blocks_count(EXT4_SB(sb)->s_es) - first);
+	struct buffer_head bh;
+	int err;
+
+	memset(&bh, 0, sizeof(bh));
+	bh.b_size = sb->s_blocksize;
+	err = ext4_snapshot_read_through(inode,
+			SNAPSHOT_IBLOCK(first + (thread * 97 + i) % count), &bh);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_READ
+	/* nothing is read from the block device */
+	if (buffer_tracked_read(&bh))
+		cancel_buffer_tracked_read(&bh);
+#endif
+	return err < 0 ? err : 0;
+}
+
+/*
+ * ext4_snapshot_bench_read_through() - snapshot read through benchmark
+ * Time ext4_snapshot_read_through() of every snapshot on the list, from the
+ * active snapshot (depth 0) to older snapshots, which read through the
+ * holes in all the newer snapshots.
+ * Called from debugfs read of ext4/test-snapshot-bench.
+ * Returns the length of the report written into @buf.
+ */
+int ext4_snapshot_bench_read_through(struct super_block *sb,
+				     char *buf, int size)
+{
+	struct snapshot_bench_case bc = {
+		.sb = sb,
+		.batch = 256,
+		.op = ext4_snapshot_bench_read_through_op,
+	};
+	struct ext4_inode_info *ei;
+	char name[32];
+	int depth = 0, len = 0;
+
+	/* keep the snapshot list from changing during the benchmark */
+	ext4_snapshot_mutex_lock(sb);
+	list_for_each_entry(ei, &EXT4_SB(sb)->s_snapshot_list, i_snaplist) {
+		if (depth >= SNAPSHOT_BENCH_DEPTH_MAX)
+			break;
+		snprintf(name, sizeof(name), "read_through depth %d", depth);
+		bc.name = name;
+		bc.private = &ei->vfs_inode;
+		len += snapshot_bench_run(&bc, buf + len, size - len);
+		depth++;
+	}
+	ext4_snapshot_mutex_unlock(sb);
+	if (!depth)
+		len = scnprintf(buf, size, "no snapshots to read through\n");
+	return len;
+}
+
+#endif
 
 /*
  * Check if @block is a bitmap block of @group.
@@ -989,4 +1585,1319 @@ int ext4_snapshot_readpage(struct file *file, struct page *page)
 	/* do read I/O with buffer heads to enable tracked reads */
 	return ext4_read_full_page(page, ext4_snapshot_get_block);
 }
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READAHEAD
+
+int ext4_snapshot_readpages(struct file *file, struct address_space *mapping,
+			    struct list_head *pages, unsigned nr_pages)
+{
+	/* do read I/O with buffer heads to enable tracked reads */
+	return ext4_read_full_pages(mapping, pages, nr_pages,
+				    ext4_snapshot_get_block);
+}
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_READ_SHARED
+
+/*
+ * ext4_snapshot_read_shared - copy out a snapshot block shared with the
+ * file system directly from the block device buffer cache.
+ * A read through block of the active snapshot, which is cached and journaled
+ * by the file system, is copied to the user buffer without populating the
+ * snapshot page cache with a second copy of the block.
+ * A journaled buffer is known to be coherent with the file system, unlike a
+ * clean block device buffer, whose block may have been reallocated for data.
+ * The block is tracked while it is copied, so a COW of the block waits for
+ * the copy to complete before the block can be modified.
+ *
+ * Returns the no. of bytes copied, or 0 if the block is not shared, not cached
+ * or already cached in the snapshot page cache, in which case the caller
+ * should read the snapshot page.
+ */
+static ssize_t ext4_snapshot_read_shared(struct inode *inode,
+		char __user *buf, size_t count, loff_t pos)
+{
+	struct super_block *sb = inode->i_sb;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_SUBPAGE
+	unsigned int offset = pos & (sb->s_blocksize - 1);
+	sector_t iblock = pos >> inode->i_blkbits;
+#else
+	unsigned int offset = pos & ~PAGE_CACHE_MASK;
+#endif
+	pgoff_t index = pos >> PAGE_CACHE_SHIFT;
+	struct buffer_head bh, *bdev_bh;
+	struct page *page;
+	ext4_group_t group;
+	ssize_t copied = 0;
+	char *kaddr;
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_SUBPAGE
+	/* copy out at most one block of a multi block page */
+	if (count > sb->s_blocksize - offset)
+		count = sb->s_blocksize - offset;
+#else
+	if (inode->i_blkbits != PAGE_CACHE_SHIFT)
+		return 0;
+#endif
+
+	page = find_get_page(inode->i_mapping, index);
+	if (page) {
+		page_cache_release(page);
+		return 0;
+	}
+
+	/* page less buffer head for read through */
+	memset(&bh, 0, sizeof(bh));
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_SUBPAGE
+	bh.b_size = sb->s_blocksize;
+	if (ext4_snapshot_read_through(inode, iblock, &bh) < 0)
+#else
+	bh.b_size = PAGE_CACHE_SIZE;
+	if (ext4_snapshot_read_through(inode, index, &bh) < 0)
+#endif
+		return 0;
+	if (!buffer_tracked_read(&bh))
+		return 0;
+
+	/* bitmap blocks are fixed or zeroed on snapshot readpage() */
+	if (ext4_snapshot_is_bitmap(sb, bh.b_blocknr, &group))
+		goto out;
+
+	bdev_bh = __find_get_block(sb->s_bdev, bh.b_blocknr, bh.b_size);
+	if (!bdev_bh)
+		goto out;
+	if (buffer_uptodate(bdev_bh) && buffer_jbd(bdev_bh)) {
+		/* kmap_atomic() disables page faults while we track the read */
+		kaddr = kmap_atomic(bdev_bh->b_page, KM_USER0);
+		copied = count - __copy_to_user_inatomic(buf,
+				kaddr + bh_offset(bdev_bh) + offset, count);
+		kunmap_atomic(kaddr, KM_USER0);
+	}
+	brelse(bdev_bh);
+out:
+	cancel_buffer_tracked_read(&bh);
+	return copied;
+}
+
+/*
+ * ext4_snapshot_file_read - read() of snapshot files
+ * Blocks shared with the file system are copied out of the block device
+ * buffer cache and all other blocks are read via the snapshot page cache.
+ */
+ssize_t ext4_snapshot_file_read(struct file *filp, char __user *buf,
+				size_t len, loff_t *ppos)
+{
+	struct inode *inode = filp->f_mapping->host;
+	ssize_t ret, copied = 0;
+	loff_t isize;
+	size_t count;
+
+	while (len > 0) {
+		isize = i_size_read(inode);
+		if (*ppos >= isize)
+			break;
+		count = min_t(size_t, len,
+			      PAGE_CACHE_SIZE - (*ppos & ~PAGE_CACHE_MASK));
+		if (count > isize - *ppos)
+			count = isize - *ppos;
+
+		ret = ext4_snapshot_read_shared(inode, buf, count, *ppos);
+		if (ret > 0)
+			*ppos += ret;
+		else
+			ret = do_sync_read(filp, buf, count, ppos);
+		if (ret <= 0) {
+			if (!copied)
+				copied = ret;
+			break;
+		}
+		copied += ret;
+		buf += ret;
+		len -= ret;
+	}
+	if (copied > 0)
+		file_accessed(filp);
+	return copied;
+}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_SPLICE_SHARED
+
+static const struct pipe_buf_operations ext4_snapshot_pipe_buf_ops = {
+	.can_merge = 0,
+	.map = generic_pipe_buf_map,
+	.unmap = generic_pipe_buf_unmap,
+	.confirm = generic_pipe_buf_confirm,
+	.release = generic_pipe_buf_release,
+	.steal = generic_pipe_buf_steal,
+	.get = generic_pipe_buf_get,
+};
+
+static void ext4_snapshot_spd_release(struct splice_pipe_desc *spd,
+				      unsigned int i)
+{
+	__free_page(spd->pages[i]);
+}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_SPLICE_BATCH
+/* fill a whole default size pipe per call with shared blocks */
+#define EXT4_SNAPSHOT_SPLICE_PAGES	PIPE_DEF_BUFFERS
+#else
+#define EXT4_SNAPSHOT_SPLICE_PAGES	1
+#endif
+
+/*
+ * ext4_snapshot_file_splice_read - splice_read() of snapshot files
+ * The loop driver reads its backing file with splice_read(), one page at a
+ * time.  A block shared with the file system, which is cached and journaled
+ * in the block device buffer cache, is copied to a temporary page, which is
+ * freed when the pipe buffer is released, so the snapshot page cache is not
+ * populated with a second copy of the block.  All other blocks are spliced
+ * from the snapshot page cache.
+ * sendfile() asks for much more than a page per call, so up to
+ * EXT4_SNAPSHOT_SPLICE_PAGES consecutive shared blocks are copied and
+ * spliced at once.  A run of blocks that are not shared is spliced from the
+ * snapshot page cache by generic_file_splice_read(), which reads it ahead
+ * with large bios via ext4_snapshot_readpages().
+ */
+ssize_t ext4_snapshot_file_splice_read(struct file *in, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct inode *inode = in->f_mapping->host;
+	struct page *pages[EXT4_SNAPSHOT_SPLICE_PAGES];
+	struct partial_page partial[EXT4_SNAPSHOT_SPLICE_PAGES];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.flags = flags,
+		.ops = &ext4_snapshot_pipe_buf_ops,
+		.spd_release = ext4_snapshot_spd_release,
+	};
+	loff_t isize = i_size_read(inode);
+	loff_t pos = *ppos;
+	mm_segment_t old_fs;
+	struct page *page;
+	unsigned int nr_pages = 0;
+	size_t count;
+	ssize_t ret;
+
+	while (len > 0 && nr_pages < EXT4_SNAPSHOT_SPLICE_PAGES &&
+	       pos < isize) {
+		count = min_t(size_t, len,
+			      PAGE_CACHE_SIZE - (pos & ~PAGE_CACHE_MASK));
+		if (count > isize - pos)
+			count = isize - pos;
+
+		page = alloc_page(GFP_USER);
+		if (!page)
+			break;
+
+		old_fs = get_fs();
+		set_fs(get_ds());
+		/* The cast to a user pointer is valid due to the set_fs() */
+		ret = ext4_snapshot_read_shared(inode,
+				(char __user *)page_address(page), count, pos);
+		set_fs(old_fs);
+		if (ret <= 0) {
+			/* not shared - splice from snapshot page cache */
+			__free_page(page);
+			break;
+		}
+
+		pages[nr_pages] = page;
+		partial[nr_pages].offset = 0;
+		partial[nr_pages].len = ret;
+		nr_pages++;
+		pos += ret;
+		len -= ret;
+		if (ret < count)
+			/* copied one block of a multi block page */
+			break;
+	}
+
+	if (!nr_pages) {
+		if (*ppos >= isize)
+			return 0;
+		return generic_file_splice_read(in, ppos, pipe, len, flags);
+	}
+
+	spd.nr_pages = nr_pages;
+	ret = splice_to_pipe(pipe, &spd);
+	if (ret > 0) {
+		*ppos += ret;
+		file_accessed(in);
+	}
+	return ret;
+}
+#endif
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_BDEV
+
+/*
+ * Snapshot block device:
+ * An enabled snapshot is exported as a read-only block device, which reads
+ * the snapshot image without a loop device on top of the snapshot file.
+ * A bio of one snapshot block is resolved with the read through logic of
+ * the snapshot file and remapped to the block that holds the image block
+ * (in the snapshot, in a newer snapshot or on the block device), so the
+ * data is read directly into the bio pages and is not cached twice.
+ * A read through to the block device is tracked until the remapped bio
+ * completes, exactly like a read through from the snapshot page cache.
+ * Bios that cannot be remapped (block bitmaps, which need to be fixed,
+ * exclude bitmaps, COWed blocks that are not yet on disk and bios that
+ * cross a block boundary) are copied from the snapshot page cache.
+ */
+struct ext4_snapshot_bdev {
+	struct inode		*inode;		/* snapshot inode */
+	struct request_queue	*queue;
+	struct gendisk		*disk;
+	int			index;		/* disk minor */
+	struct rw_semaphore	lock;		/* read locked by bio mapping */
+	int			dead;		/* device is being removed */
+	atomic_t		inflight;	/* remapped bios in flight */
+	wait_queue_head_t	wait;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_CLONE
+	struct file		*clone;		/* overlay file of writable clone */
+	struct list_head	list;		/* on snapshot clones list */
+	gfp_t			old_gfp_mask;	/* of overlay file mapping */
+	struct workqueue_struct	*wq;
+	struct work_struct	work;		/* clone bios worker */
+	spinlock_t		bio_lock;
+	struct bio_list		bios;		/* queued clone bios */
+#endif
+};
+
+/* remapped snapshot bio */
+struct ext4_snapshot_bio {
+	struct ext4_snapshot_bdev	*dev;
+	struct bio			*bio;	/* original bio */
+	struct buffer_head		bh;	/* read through buffer */
+};
+
+static int ext4_snapshot_bdev_major;
+static DEFINE_IDA(ext4_snapshot_bdev_ida);
+
+static const struct block_device_operations ext4_snapshot_bdev_fops = {
+	.owner		= THIS_MODULE,
+};
+
+/* don't let bios cross a snapshot block boundary */
+static int ext4_snapshot_bdev_merge_bvec(struct request_queue *q,
+		struct bvec_merge_data *bvm, struct bio_vec *biovec)
+{
+	unsigned int block_sectors = queue_logical_block_size(q) >> 9;
+	int max;
+
+	max = ((block_sectors - (bvm->bi_sector & (block_sectors - 1))) << 9) -
+		bvm->bi_size;
+	if (max < 0)
+		max = 0;
+	/* always allow the first page of a bio */
+	if (max <= biovec->bv_len && bvm->bi_size == 0)
+		return biovec->bv_len;
+	return max;
+}
+
+static void ext4_snapshot_bdev_end_io(struct bio *clone, int err)
+{
+	struct ext4_snapshot_bio *sbio = clone->bi_private;
+	struct ext4_snapshot_bdev *dev = sbio->dev;
+
+	if (buffer_tracked_read(&sbio->bh))
+		cancel_buffer_tracked_read(&sbio->bh);
+	bio_put(clone);
+	bio_endio(sbio->bio, err);
+	kfree(sbio);
+	if (atomic_dec_and_test(&dev->inflight))
+		wake_up(&dev->wait);
+}
+
+/*
+ * Remap a bio of one snapshot block to the block that holds it.
+ * Returns 0 if the bio was submitted, 1 if the bio needs to be copied from
+ * the snapshot page cache and <0 on error.
+ */
+static int ext4_snapshot_bdev_remap(struct ext4_snapshot_bdev *dev,
+		struct bio *bio)
+{
+	struct inode *inode = dev->inode;
+	struct super_block *sb = inode->i_sb;
+	unsigned int sector_bits = inode->i_blkbits - 9;
+	sector_t iblock = bio->bi_sector >> sector_bits;
+	unsigned int offset = bio->bi_sector & ((1 << sector_bits) - 1);
+	struct ext4_snapshot_bio *sbio;
+	struct buffer_head *bh, *sbh;
+	struct bio *clone;
+	ext4_group_t group;
+	int err;
+
+	if ((offset << 9) + bio->bi_size > sb->s_blocksize)
+		return 1;
+
+	sbio = kzalloc(sizeof(*sbio), GFP_NOIO);
+	if (!sbio)
+		return -ENOMEM;
+	sbio->dev = dev;
+	sbio->bio = bio;
+	/* page less buffer head for read through */
+	bh = &sbio->bh;
+	bh->b_size = sb->s_blocksize;
+	err = ext4_snapshot_read_through(inode, SNAPSHOT_IBLOCK(iblock), bh);
+	if (err < 0)
+		goto out;
+
+	err = 1;
+	if (!buffer_mapped(bh))
+		goto out;
+	if (buffer_tracked_read(bh)) {
+		/* bitmap blocks are fixed or zeroed on snapshot readpage() */
+		if (ext4_snapshot_is_bitmap(sb, bh->b_blocknr, &group))
+			goto out_cancel;
+	} else if (bh->b_blocknr != SNAPSHOT_BLOCK(iblock)) {
+		/* the COWed copy of the block may not be on disk yet */
+		sbh = sb_find_get_block(sb, bh->b_blocknr);
+		if (sbh) {
+			int pending = !buffer_uptodate(sbh) ||
+				buffer_dirty(sbh) || buffer_locked(sbh) ||
+				buffer_jbd(sbh);
+
+			brelse(sbh);
+			if (pending)
+				goto out;
+		}
+	}
+
+	clone = bio_clone(bio, GFP_NOIO);
+	if (!clone) {
+		err = -ENOMEM;
+		goto out_cancel;
+	}
+	clone->bi_bdev = sb->s_bdev;
+	clone->bi_sector = ((sector_t)bh->b_blocknr << sector_bits) + offset;
+	clone->bi_end_io = ext4_snapshot_bdev_end_io;
+	clone->bi_private = sbio;
+	atomic_inc(&dev->inflight);
+	generic_make_request(clone);
+	return 0;
+
+out_cancel:
+	if (buffer_tracked_read(bh))
+		cancel_buffer_tracked_read(bh);
+out:
+	kfree(sbio);
+	return err;
+}
+
+/*
+ * Copy @len bytes at @pos of @mapping to @offset of @dst.
+ * The copied range must not cross a page boundary.
+ */
+static int ext4_snapshot_bdev_read_page(struct address_space *mapping,
+		loff_t pos, struct page *dst, unsigned int offset,
+		unsigned int len)
+{
+	struct page *page;
+	char *from, *to;
+
+	page = read_mapping_page(mapping, pos >> PAGE_CACHE_SHIFT, NULL);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	from = kmap_atomic(page, KM_USER0);
+	to = kmap_atomic(dst, KM_USER1);
+	memcpy(to + offset, from + (pos & ~PAGE_CACHE_MASK), len);
+	kunmap_atomic(to, KM_USER1);
+	kunmap_atomic(from, KM_USER0);
+	flush_dcache_page(dst);
+	page_cache_release(page);
+	return 0;
+}
+
+/*
+ * Copy a bio from the snapshot page cache and complete it.
+ */
+static int ext4_snapshot_bdev_copy(struct ext4_snapshot_bdev *dev,
+		struct bio *bio)
+{
+	struct address_space *mapping = dev->inode->i_mapping;
+	loff_t pos = (loff_t)bio->bi_sector << 9;
+	unsigned int len, done;
+	struct bio_vec *bvec;
+	int i, err;
+
+	bio_for_each_segment(bvec, bio, i) {
+		for (done = 0; done < bvec->bv_len; done += len) {
+			len = min_t(unsigned int, bvec->bv_len - done,
+				    PAGE_CACHE_SIZE - (pos & ~PAGE_CACHE_MASK));
+			err = ext4_snapshot_bdev_read_page(mapping, pos,
+					bvec->bv_page, bvec->bv_offset + done,
+					len);
+			if (err)
+				return err;
+			pos += len;
+		}
+	}
+	bio_endio(bio, 0);
+	return 0;
+}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_CLONE
+
+/*
+ * Writable snapshot clone:
+ * A clone of an enabled snapshot is exported as a writable block device
+ * (/dev/ext4cloneN), which stores its writes in an overlay file, i.e., a
+ * sparse regular file on the snapshot file system.  An image block that
+ * is mapped (or delayed) in the overlay file was written to the clone and
+ * is read from the overlay file.  Other image blocks are read through to
+ * the snapshot, so a new clone takes no space and the overlay file grows
+ * with the blocks written to the clone.  Blocks of the overlay file are
+ * allocated by the regular write path, so they are moved on write to the
+ * active snapshot, unless the overlay file is excluded from snapshots.
+ * Clone bios are handled in order by a worker, because writes to the
+ * overlay file may block on the file system.
+ */
+
+/*
+ * Returns 1 if @lblk was written to the overlay file @clone, 0 if it was
+ * not and <0 on error.
+ */
+static int ext4_snapshot_clone_written(struct inode *clone, ext4_lblk_t lblk)
+{
+	unsigned int bits = PAGE_CACHE_SHIFT - clone->i_blkbits;
+	struct ext4_map_blocks map;
+	struct buffer_head *bh;
+	struct page *page;
+	int i, written = 0;
+
+	/* delayed allocation blocks are only marked in the page buffers */
+	page = find_lock_page(clone->i_mapping, lblk >> bits);
+	if (page) {
+		if (page_has_buffers(page)) {
+			bh = page_buffers(page);
+			for (i = lblk & ((1 << bits) - 1); i > 0; i--)
+				bh = bh->b_this_page;
+			written = buffer_mapped(bh) || buffer_delay(bh);
+		}
+		unlock_page(page);
+		page_cache_release(page);
+		if (written)
+			return 1;
+	}
+
+	map.m_lblk = lblk;
+	map.m_len = 1;
+	written = ext4_map_blocks(NULL, clone, &map, 0);
+	return written > 0 ? 1 : written;
+}
+
+/*
+ * Write @len bytes at @offset of @src to @pos of the overlay file.
+ * The written range must not cross a block boundary.
+ * Called under overlay file i_mutex.
+ */
+static int ext4_snapshot_clone_write(struct ext4_snapshot_bdev *dev,
+		loff_t pos, struct page *src, unsigned int offset,
+		unsigned int len)
+{
+	struct file *file = dev->clone;
+	struct address_space *mapping = file->f_mapping;
+	struct page *page;
+	void *fsdata;
+	char *from, *to;
+	int err;
+
+	err = pagecache_write_begin(file, mapping, pos, len, 0,
+				    &page, &fsdata);
+	if (err)
+		return err;
+	from = kmap_atomic(src, KM_USER0);
+	to = kmap_atomic(page, KM_USER1);
+	memcpy(to + (pos & ~PAGE_CACHE_MASK), from + offset, len);
+	kunmap_atomic(to, KM_USER1);
+	kunmap_atomic(from, KM_USER0);
+	flush_dcache_page(page);
+	err = pagecache_write_end(file, mapping, pos, len, len, page, fsdata);
+	if (err < 0)
+		return err;
+	return err == len ? 0 : -EIO;
+}
+
+/*
+ * Copy image block @lblk from the snapshot to the overlay file, before it
+ * is partly written, unless it was already written to the clone.
+ * Called under overlay file i_mutex.
+ */
+static int ext4_snapshot_clone_fill(struct ext4_snapshot_bdev *dev,
+		ext4_lblk_t lblk)
+{
+	struct inode *inode = dev->inode;
+	loff_t pos = (loff_t)lblk << inode->i_blkbits;
+	struct page *page;
+	int err;
+
+	err = ext4_snapshot_clone_written(dev->clone->f_mapping->host, lblk);
+	if (err)
+		return err < 0 ? err : 0;
+
+	page = read_mapping_page(inode->i_mapping, pos >> PAGE_CACHE_SHIFT,
+				 NULL);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	err = ext4_snapshot_clone_write(dev, pos, page,
+			pos & ~PAGE_CACHE_MASK, inode->i_sb->s_blocksize);
+	page_cache_release(page);
+	return err;
+}
+
+static int ext4_snapshot_clone_write_bio(struct ext4_snapshot_bdev *dev,
+		struct bio *bio)
+{
+	struct inode *clone = dev->clone->f_mapping->host;
+	unsigned int blocksize = dev->inode->i_sb->s_blocksize;
+	loff_t pos = (loff_t)bio->bi_sector << 9;
+	unsigned int len, done;
+	struct bio_vec *bvec;
+	int i, err = 0;
+
+	mutex_lock(&clone->i_mutex);
+	file_update_time(dev->clone);
+	bio_for_each_segment(bvec, bio, i) {
+		for (done = 0; done < bvec->bv_len; done += len) {
+			len = min_t(unsigned int, bvec->bv_len - done,
+				    blocksize - (pos & (blocksize - 1)));
+			if (len < blocksize)
+				err = ext4_snapshot_clone_fill(dev,
+						pos >> clone->i_blkbits);
+			if (!err)
+				err = ext4_snapshot_clone_write(dev, pos,
+						bvec->bv_page,
+						bvec->bv_offset + done, len);
+			if (err)
+				goto out;
+			pos += len;
+		}
+	}
+out:
+	mutex_unlock(&clone->i_mutex);
+	return err;
+}
+
+static int ext4_snapshot_clone_read_bio(struct ext4_snapshot_bdev *dev,
+		struct bio *bio)
+{
+	struct address_space *mapping = dev->clone->f_mapping;
+	unsigned int blocksize = dev->inode->i_sb->s_blocksize;
+	loff_t pos = (loff_t)bio->bi_sector << 9;
+	unsigned int len, done;
+	struct bio_vec *bvec;
+	int i, err;
+
+	bio_for_each_segment(bvec, bio, i) {
+		for (done = 0; done < bvec->bv_len; done += len) {
+			len = min_t(unsigned int, bvec->bv_len - done,
+				    blocksize - (pos & (blocksize - 1)));
+			err = ext4_snapshot_clone_written(mapping->host,
+					pos >> mapping->host->i_blkbits);
+			if (err < 0)
+				return err;
+			err = ext4_snapshot_bdev_read_page(err ? mapping :
+					dev->inode->i_mapping, pos,
+					bvec->bv_page, bvec->bv_offset + done,
+					len);
+			if (err)
+				return err;
+			pos += len;
+		}
+	}
+	bio_endio(bio, 0);
+	return 0;
+}
+
+/*
+ * Handle a clone bio.
+ * Returns 0 if the bio was completed or submitted and <0 on error.
+ */
+static int ext4_snapshot_clone_bio(struct ext4_snapshot_bdev *dev,
+		struct bio *bio)
+{
+	struct inode *clone = dev->clone->f_mapping->host;
+	unsigned int sector_bits = clone->i_blkbits - 9;
+	sector_t last = bio->bi_sector + (bio->bi_size >> 9) - 1;
+	int err;
+
+	if (bio->bi_rw & REQ_FLUSH) {
+		err = vfs_fsync(dev->clone, 0);
+		if (err)
+			return err;
+	}
+	if (!bio->bi_size) {
+		bio_endio(bio, 0);
+		return 0;
+	}
+
+	if (bio_data_dir(bio) == WRITE) {
+		err = ext4_snapshot_clone_write_bio(dev, bio);
+		if (!err && (bio->bi_rw & REQ_FUA))
+			err = vfs_fsync(dev->clone, 0);
+		if (!err)
+			bio_endio(bio, 0);
+		return err;
+	}
+
+	if ((bio->bi_sector >> sector_bits) == (last >> sector_bits)) {
+		/* remap a block that was not written to the clone */
+		err = ext4_snapshot_clone_written(clone,
+				bio->bi_sector >> sector_bits);
+		if (err < 0)
+			return err;
+		if (!err) {
+			err = ext4_snapshot_bdev_remap(dev, bio);
+			if (err > 0)
+				err = ext4_snapshot_bdev_copy(dev, bio);
+			return err;
+		}
+	}
+	return ext4_snapshot_clone_read_bio(dev, bio);
+}
+
+static void ext4_snapshot_clone_work(struct work_struct *work)
+{
+	struct ext4_snapshot_bdev *dev =
+		container_of(work, struct ext4_snapshot_bdev, work);
+	struct bio *bio;
+	int err;
+
+	for (;;) {
+		spin_lock_irq(&dev->bio_lock);
+		bio = bio_list_pop(&dev->bios);
+		spin_unlock_irq(&dev->bio_lock);
+		if (!bio)
+			break;
+
+		down_read(&dev->lock);
+		err = dev->dead ? -EIO : ext4_snapshot_clone_bio(dev, bio);
+		up_read(&dev->lock);
+		if (err)
+			bio_endio(bio, err);
+	}
+}
+#endif
+
+static int ext4_snapshot_bdev_make_request(struct request_queue *q,
+		struct bio *bio)
+{
+	struct ext4_snapshot_bdev *dev = q->queuedata;
+	int err = -EIO;
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_CLONE
+	if (dev->clone) {
+		spin_lock_irq(&dev->bio_lock);
+		bio_list_add(&dev->bios, bio);
+		spin_unlock_irq(&dev->bio_lock);
+		queue_work(dev->wq, &dev->work);
+		return 0;
+	}
+#endif
+	if (bio_data_dir(bio) == WRITE) {
+		bio_endio(bio, -EROFS);
+		return 0;
+	}
+	if (!bio->bi_size) {
+		bio_endio(bio, 0);
+		return 0;
+	}
+
+	down_read(&dev->lock);
+	if (!dev->dead) {
+		err = ext4_snapshot_bdev_remap(dev, bio);
+		if (err > 0)
+			err = ext4_snapshot_bdev_copy(dev, bio);
+	}
+	up_read(&dev->lock);
+	if (err)
+		bio_endio(bio, err);
+	return 0;
+}
+
+/*
+ * Allocate a snapshot block device named @name with the disk minor.
+ * The caller sets up the device and adds the disk.
+ */
+static struct ext4_snapshot_bdev *ext4_snapshot_bdev_alloc(struct inode *inode,
+		const char *name)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext4_snapshot_bdev *dev;
+	struct gendisk *disk;
+	int err = -ENOMEM;
+
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+	if (!dev)
+		return ERR_PTR(-ENOMEM);
+	init_rwsem(&dev->lock);
+	atomic_set(&dev->inflight, 0);
+	init_waitqueue_head(&dev->wait);
+
+	dev->index = ida_simple_get(&ext4_snapshot_bdev_ida, 0,
+				    1 << MINORBITS, GFP_KERNEL);
+	if (dev->index < 0) {
+		err = dev->index;
+		goto out_free;
+	}
+
+	dev->queue = blk_alloc_queue(GFP_KERNEL);
+	if (!dev->queue)
+		goto out_ida;
+	dev->queue->queuedata = dev;
+	blk_queue_make_request(dev->queue, ext4_snapshot_bdev_make_request);
+	blk_queue_merge_bvec(dev->queue, ext4_snapshot_bdev_merge_bvec);
+	blk_queue_logical_block_size(dev->queue, sb->s_blocksize);
+	blk_queue_max_hw_sectors(dev->queue,
+			max_t(unsigned int, sb->s_blocksize,
+			      PAGE_CACHE_SIZE) >> 9);
+
+	disk = alloc_disk(1);
+	if (!disk)
+		goto out_queue;
+	disk->major = ext4_snapshot_bdev_major;
+	disk->first_minor = dev->index;
+	disk->fops = &ext4_snapshot_bdev_fops;
+	disk->private_data = dev;
+	disk->queue = dev->queue;
+	snprintf(disk->disk_name, DISK_NAME_LEN, name, dev->index);
+	set_capacity(disk, SNAPSHOT_BLOCKS(inode) << (inode->i_blkbits - 9));
+	dev->disk = disk;
+	return dev;
+
+out_queue:
+	blk_cleanup_queue(dev->queue);
+out_ida:
+	ida_simple_remove(&ext4_snapshot_bdev_ida, dev->index);
+out_free:
+	kfree(dev);
+	return ERR_PTR(err);
+}
+
+/* Returns non zero if the snapshot block device is open */
+static int ext4_snapshot_bdev_busy(struct ext4_snapshot_bdev *dev)
+{
+	struct block_device *bdev;
+	int busy = 0;
+
+	bdev = bdget_disk(dev->disk, 0);
+	if (bdev) {
+		busy = bdev->bd_openers;
+		bdput(bdev);
+	}
+	return busy;
+}
+
+/*
+ * Fail new bios of a snapshot block device, wait for remapped bios to
+ * complete and free the device.
+ */
+static void ext4_snapshot_bdev_free(struct ext4_snapshot_bdev *dev)
+{
+	down_write(&dev->lock);
+	dev->dead = 1;
+	up_write(&dev->lock);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_CLONE
+	if (dev->wq)
+		/* fail queued clone bios */
+		flush_workqueue(dev->wq);
+#endif
+	wait_event(dev->wait, !atomic_read(&dev->inflight));
+
+	del_gendisk(dev->disk);
+	blk_cleanup_queue(dev->queue);
+	put_disk(dev->disk);
+	ida_simple_remove(&ext4_snapshot_bdev_ida, dev->index);
+	iput(dev->inode);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_CLONE
+	if (dev->clone) {
+		destroy_workqueue(dev->wq);
+		mapping_set_gfp_mask(dev->clone->f_mapping, dev->old_gfp_mask);
+		fput(dev->clone);
+	}
+#endif
+	kfree(dev);
+}
+
+/*
+ * ext4_snapshot_add_bdev - export snapshot as a block device
+ * Called from ext4_snapshot_enable() under i_mutex and snapshot_mutex
+ */
+int ext4_snapshot_add_bdev(struct inode *inode)
+{
+	struct ext4_snapshot_bdev *dev;
+
+	if (EXT4_I(inode)->i_snapshot_bdev)
+		return 0;
+
+	dev = ext4_snapshot_bdev_alloc(inode, "ext4snap%d");
+	if (IS_ERR(dev))
+		return PTR_ERR(dev);
+	set_disk_ro(dev->disk, 1);
+	dev->inode = igrab(inode);
+	EXT4_I(inode)->i_snapshot_bdev = dev;
+	add_disk(dev->disk);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_AUTOMOUNT
+	/* invalidate cached .snapshot entries */
+	EXT4_SB(inode->i_sb)->s_snapshot_dir_gen++;
+#endif
+
+	ext4_msg(inode->i_sb, KERN_INFO, "snapshot (%u) exported as %s",
+		 inode->i_generation, dev->disk->disk_name);
+	return 0;
+}
+
+/*
+ * ext4_snapshot_remove_bdev - remove snapshot block device
+ * @inode:	snapshot inode
+ * @force:	remove the device even if it is open
+ *
+ * Called from ext4_snapshot_disable() under i_mutex and snapshot_mutex.
+ * Called from ext4_snapshot_destroy() with @force on umount.
+ * Returns -EBUSY if the device is open and @force is not set.
+ */
+int ext4_snapshot_remove_bdev(struct inode *inode, int force)
+{
+	struct ext4_snapshot_bdev *dev = EXT4_I(inode)->i_snapshot_bdev;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_CLONE
+	struct ext4_snapshot_bdev *clone, *n;
+#endif
+
+	if (!force && dev && ext4_snapshot_bdev_busy(dev))
+		return -EBUSY;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_CLONE
+	if (!force)
+		list_for_each_entry(clone, &EXT4_I(inode)->i_snapshot_clones,
+				    list)
+			if (ext4_snapshot_bdev_busy(clone))
+				return -EBUSY;
+	/* clones read through to the snapshot, so remove them with it */
+	list_for_each_entry_safe(clone, n, &EXT4_I(inode)->i_snapshot_clones,
+				 list) {
+		list_del(&clone->list);
+		ext4_snapshot_bdev_free(clone);
+	}
+#endif
+
+	if (!dev)
+		return 0;
+
+	EXT4_I(inode)->i_snapshot_bdev = NULL;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_AUTOMOUNT
+	/* invalidate cached .snapshot entries */
+	EXT4_SB(inode->i_sb)->s_snapshot_dir_gen++;
+#endif
+	ext4_snapshot_bdev_free(dev);
+	return 0;
+}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_AUTOMOUNT
+
+/*
+ * .snapshot directory:
+ * A virtual directory at the file system root presents every enabled
+ * snapshot as a subdirectory, named after the snapshot id.  The snapshot
+ * subdirectory is an automount point: the first access mounts the snapshot
+ * block device read-only on it, so paths inside the snapshot are resolved
+ * by the normal dcache and inode cache of the snapshot mount.  Unused
+ * snapshot mounts expire and are unmounted with the file system.
+ * Entries are cached in the dcache until the set of exported snapshots
+ * changes (s_snapshot_dir_gen).
+ */
+
+/* unmount a snapshot after 2 idle periods */
+#define EXT4_SNAPSHOT_AUTOMOUNT_EXPIRE	(60 * HZ)
+/* no. of snapshot ids read under snapshot_mutex by one readdir step */
+#define EXT4_SNAPSHOT_DIR_BATCH		32
+
+static LIST_HEAD(ext4_snapshot_automounts);
+static void ext4_snapshot_expire_automounts(struct work_struct *work);
+static DECLARE_DELAYED_WORK(ext4_snapshot_expire_work,
+			    ext4_snapshot_expire_automounts);
+
+static void ext4_snapshot_expire_automounts(struct work_struct *work)
+{
+	mark_mounts_for_expiry(&ext4_snapshot_automounts);
+	if (!list_empty(&ext4_snapshot_automounts))
+		schedule_delayed_work(&ext4_snapshot_expire_work,
+				      EXT4_SNAPSHOT_AUTOMOUNT_EXPIRE);
+}
+
+/*
+ * Returns the exported snapshot with snapshot id @id.
+ * Called under snapshot_mutex.
+ */
+static struct inode *ext4_snapshot_dir_find(struct super_block *sb,
+		unsigned int id)
+{
+	struct ext4_inode_info *ei;
+
+	list_for_each_entry(ei, &EXT4_SB(sb)->s_snapshot_list, i_snaplist)
+		if (ei->vfs_inode.i_generation == id && ei->i_snapshot_bdev)
+			return &ei->vfs_inode;
+	return NULL;
+}
+
+static struct vfsmount *ext4_snapshot_d_automount(struct path *path)
+{
+	struct super_block *sb = path->dentry->d_sb;
+	unsigned int id = (unsigned long)path->dentry->d_inode->i_private;
+	char name[DISK_NAME_LEN];
+	struct inode *inode;
+	struct vfsmount *mnt;
+
+	ext4_snapshot_mutex_lock(sb);
+	inode = ext4_snapshot_dir_find(sb, id);
+	if (inode)
+		strlcpy(name, EXT4_I(inode)->i_snapshot_bdev->disk->disk_name,
+			sizeof(name));
+	ext4_snapshot_mutex_unlock(sb);
+	if (!inode)
+		return ERR_PTR(-ENOENT);
+
+	mnt = vfs_kern_mount(&ext4_snapshot_fs_type, MS_RDONLY, name, NULL);
+	if (IS_ERR(mnt))
+		return mnt;
+	snapshot_debug(1, "snapshot (%u) mounted on .snapshot/%u\n", id, id);
+	mntget(mnt); /* prevent immediate expiration */
+	mnt_set_expiry(mnt, &ext4_snapshot_automounts);
+	schedule_delayed_work(&ext4_snapshot_expire_work,
+			      EXT4_SNAPSHOT_AUTOMOUNT_EXPIRE);
+	return mnt;
+}
+
+/* lockless, so lookups in .snapshot do not drop out of RCU path walk */
+static int ext4_snapshot_d_revalidate(struct dentry *dentry,
+		struct nameidata *nd)
+{
+	return dentry->d_time ==
+		ACCESS_ONCE(EXT4_SB(dentry->d_sb)->s_snapshot_dir_gen);
+}
+
+static const struct dentry_operations ext4_snapshot_dentry_operations = {
+	.d_revalidate	= ext4_snapshot_d_revalidate,
+	.d_automount	= ext4_snapshot_d_automount,
+};
+
+static const struct inode_operations ext4_snapshot_mntpt_inode_operations = {
+};
+
+static struct dentry *ext4_snapshot_dir_lookup_id(struct inode *dir,
+		struct dentry *dentry, struct nameidata *nd)
+{
+	struct super_block *sb = dir->i_sb;
+	struct inode *snapshot, *inode;
+	unsigned int gen, id;
+	char *end;
+
+	id = simple_strtoul((const char *)dentry->d_name.name, &end, 10);
+	if (!id || *end || dentry->d_name.name[0] == '0')
+		return ERR_PTR(-ENOENT);
+
+	inode = new_inode(sb);
+	if (!inode)
+		return ERR_PTR(-ENOMEM);
+
+	ext4_snapshot_mutex_lock(sb);
+	gen = EXT4_SB(sb)->s_snapshot_dir_gen;
+	snapshot = ext4_snapshot_dir_find(sb, id);
+	if (snapshot) {
+		inode->i_ino = snapshot->i_ino;
+		inode->i_uid = snapshot->i_uid;
+		inode->i_gid = snapshot->i_gid;
+		inode->i_mtime = inode->i_atime = inode->i_ctime =
+			snapshot->i_ctime;
+	}
+	ext4_snapshot_mutex_unlock(sb);
+	if (!snapshot) {
+		iput(inode);
+		/* don't cache a negative entry */
+		return ERR_PTR(-ENOENT);
+	}
+
+	inode->i_mode = S_IFDIR | S_IRUGO | S_IXUGO;
+	inode->i_op = &ext4_snapshot_mntpt_inode_operations;
+	inode->i_fop = &simple_dir_operations;
+	inode->i_flags |= S_AUTOMOUNT;
+	inode->i_private = (void *)(unsigned long)id;
+
+	dentry->d_time = gen;
+	d_set_d_op(dentry, &ext4_snapshot_dentry_operations);
+	d_add(dentry, inode);
+	return NULL;
+}
+
+static int ext4_snapshot_dir_readdir(struct file *filp, void *dirent,
+		filldir_t filldir)
+{
+	struct inode *dir = filp->f_path.dentry->d_inode;
+	struct super_block *sb = dir->i_sb;
+	unsigned int id[EXT4_SNAPSHOT_DIR_BATCH];
+	unsigned long ino[EXT4_SNAPSHOT_DIR_BATCH];
+	struct ext4_inode_info *ei;
+	char name[16];
+	loff_t skip;
+	int i, n;
+
+	if (filp->f_pos == 0) {
+		if (filldir(dirent, ".", 1, 0, dir->i_ino, DT_DIR) < 0)
+			return 0;
+		filp->f_pos++;
+	}
+	if (filp->f_pos == 1) {
+		if (filldir(dirent, "..", 2, 1, EXT4_ROOT_INO, DT_DIR) < 0)
+			return 0;
+		filp->f_pos++;
+	}
+
+	do {
+		/* don't call filldir() under snapshot_mutex */
+		n = 0;
+		skip = filp->f_pos - 2;
+		ext4_snapshot_mutex_lock(sb);
+		list_for_each_entry(ei, &EXT4_SB(sb)->s_snapshot_list,
+				    i_snaplist) {
+			if (!ei->i_snapshot_bdev || skip-- > 0)
+				continue;
+			id[n] = ei->vfs_inode.i_generation;
+			ino[n] = ei->vfs_inode.i_ino;
+			if (++n == EXT4_SNAPSHOT_DIR_BATCH)
+				break;
+		}
+		ext4_snapshot_mutex_unlock(sb);
+
+		for (i = 0; i < n; i++) {
+			int len = snprintf(name, sizeof(name), "%u", id[i]);
+
+			if (filldir(dirent, name, len, filp->f_pos, ino[i],
+				    DT_DIR) < 0)
+				return 0;
+			filp->f_pos++;
+		}
+	} while (n == EXT4_SNAPSHOT_DIR_BATCH);
+	return 0;
+}
+
+static const struct inode_operations ext4_snapshot_dir_inode_operations = {
+	.lookup		= ext4_snapshot_dir_lookup_id,
+};
+
+static const struct file_operations ext4_snapshot_dir_operations = {
+	.llseek		= generic_file_llseek,
+	.read		= generic_read_dir,
+	.readdir	= ext4_snapshot_dir_readdir,
+};
+
+/*
+ * ext4_snapshot_dir_lookup - lookup the .snapshot directory
+ * Called from ext4_lookup() for .snapshot in the root directory.
+ */
+struct dentry *ext4_snapshot_dir_lookup(struct inode *dir,
+		struct dentry *dentry)
+{
+	struct inode *inode;
+
+	inode = new_inode(dir->i_sb);
+	if (!inode)
+		return ERR_PTR(-ENOMEM);
+	/* the last inode number, which is never a snapshot inode */
+	inode->i_ino = ~0U;
+	inode->i_mode = S_IFDIR | S_IRUGO | S_IXUGO;
+	inode->i_uid = dir->i_uid;
+	inode->i_gid = dir->i_gid;
+	inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME_SEC;
+	inode->i_op = &ext4_snapshot_dir_inode_operations;
+	inode->i_fop = &ext4_snapshot_dir_operations;
+	inode->i_nlink = 2;
+	d_add(dentry, inode);
+	return NULL;
+}
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_CLONE
+
+/*
+ * Clear the snapshot image flag in the super block of a new clone, so the
+ * clone can be mounted read-write, and clear the needs recovery flag, like
+ * a frozen snapshot take does, because the image journal is not replayed.
+ */
+static int ext4_snapshot_clone_fix_super(struct ext4_snapshot_bdev *dev)
+{
+	struct file *file = dev->clone;
+	struct inode *clone = file->f_mapping->host;
+	loff_t pos = EXT4_MIN_BLOCK_SIZE;
+	struct ext4_super_block *es;
+	struct page *page;
+	void *fsdata;
+	int err;
+
+	mutex_lock(&clone->i_mutex);
+	/* a super block in the overlay file belongs to an older clone */
+	err = ext4_snapshot_clone_written(clone, pos >> clone->i_blkbits);
+	if (err)
+		goto out;
+	err = ext4_snapshot_clone_fill(dev, pos >> clone->i_blkbits);
+	if (err)
+		goto out;
+
+	err = pagecache_write_begin(file, file->f_mapping, pos, sizeof(*es),
+				    0, &page, &fsdata);
+	if (err)
+		goto out;
+	es = kmap(page) + (pos & ~PAGE_CACHE_MASK);
+	es->s_flags &= cpu_to_le32(~EXT4_FLAGS_IS_SNAPSHOT);
+	es->s_feature_incompat &=
+		cpu_to_le32(~EXT4_FEATURE_INCOMPAT_RECOVER);
+	kunmap(page);
+	flush_dcache_page(page);
+	err = pagecache_write_end(file, file->f_mapping, pos, sizeof(*es),
+				  sizeof(*es), page, fsdata);
+out:
+	mutex_unlock(&clone->i_mutex);
+	return err < 0 ? err : 0;
+}
+
+/*
+ * Export a writable clone of snapshot @inode with overlay file @file.
+ * Called under snapshot_mutex.
+ */
+static int ext4_snapshot_add_clone(struct inode *inode, struct file *file)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(inode->i_sb);
+	struct address_space *mapping = file->f_mapping;
+	struct ext4_snapshot_bdev *dev;
+	struct ext4_inode_info *ei;
+	int err;
+
+	/* an overlay file can store the writes of a single clone */
+	list_for_each_entry(ei, &sbi->s_snapshot_list, i_snaplist)
+		list_for_each_entry(dev, &ei->i_snapshot_clones, list)
+			if (dev->clone->f_mapping == mapping)
+				return -EBUSY;
+
+	dev = ext4_snapshot_bdev_alloc(inode, "ext4clone%d");
+	if (IS_ERR(dev))
+		return PTR_ERR(dev);
+	dev->inode = igrab(inode);
+	spin_lock_init(&dev->bio_lock);
+	bio_list_init(&dev->bios);
+	INIT_WORK(&dev->work, ext4_snapshot_clone_work);
+	blk_queue_flush(dev->queue, REQ_FLUSH | REQ_FUA);
+	/* clone writes must not recurse into the clone file system */
+	dev->old_gfp_mask = mapping_gfp_mask(mapping);
+	mapping_set_gfp_mask(mapping,
+			dev->old_gfp_mask & ~(__GFP_IO|__GFP_FS));
+	get_file(file);
+	dev->clone = file;
+
+	err = ext4_snapshot_clone_fix_super(dev);
+	if (!err) {
+		dev->wq = create_singlethread_workqueue(dev->disk->disk_name);
+		if (!dev->wq)
+			err = -ENOMEM;
+	}
+	if (err) {
+		mapping_set_gfp_mask(mapping, dev->old_gfp_mask);
+		fput(file);
+		iput(dev->inode);
+		put_disk(dev->disk);
+		blk_cleanup_queue(dev->queue);
+		ida_simple_remove(&ext4_snapshot_bdev_ida, dev->index);
+		kfree(dev);
+		return err;
+	}
+
+	list_add_tail(&dev->list, &EXT4_I(inode)->i_snapshot_clones);
+	add_disk(dev->disk);
+	ext4_msg(inode->i_sb, KERN_INFO, "snapshot (%u) cloned as %s",
+		 inode->i_generation, dev->disk->disk_name);
+	return dev->index;
+}
+
+/*
+ * ext4_snapshot_clone() adds a writable clone of snapshot @inode, whose
+ * writes are stored in the overlay file @uclone->sc_fd, and returns the
+ * clone device minor in @uclone->sc_index, or removes clone
+ * @uclone->sc_index with the EXT4_SNAPSHOT_CLONE_REMOVE flag.
+ * Called from ext4_ioctl() without i_mutex.
+ */
+int ext4_snapshot_clone(struct inode *inode,
+			struct ext4_snapshot_clone __user *uclone)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext4_snapshot_clone clone;
+	struct ext4_snapshot_bdev *dev;
+	struct inode *overlay;
+	struct file *file;
+	int err;
+
+	if (copy_from_user(&clone, uclone, sizeof(clone)))
+		return -EFAULT;
+	if (clone.sc_flags & ~EXT4_SNAPSHOT_CLONE_REMOVE)
+		return -EINVAL;
+
+	if (clone.sc_flags & EXT4_SNAPSHOT_CLONE_REMOVE) {
+		err = -ENOENT;
+		ext4_snapshot_mutex_lock(sb);
+		list_for_each_entry(dev, &EXT4_I(inode)->i_snapshot_clones,
+				    list) {
+			if (dev->index != clone.sc_index)
+				continue;
+			err = -EBUSY;
+			if (ext4_snapshot_bdev_busy(dev))
+				break;
+			list_del(&dev->list);
+			ext4_snapshot_bdev_free(dev);
+			err = 0;
+			break;
+		}
+		ext4_snapshot_mutex_unlock(sb);
+		return err;
+	}
+
+	file = fget(clone.sc_fd);
+	if (!file)
+		return -EBADF;
+	overlay = file->f_mapping->host;
+	err = -EINVAL;
+	if (overlay->i_sb != sb || !S_ISREG(overlay->i_mode) ||
+	    ext4_snapshot_file(overlay))
+		goto out_fput;
+	err = -EBADF;
+	if (!(file->f_mode & FMODE_WRITE))
+		goto out_fput;
+
+	ext4_snapshot_mutex_lock(sb);
+	err = -EINVAL;
+	if (ext4_test_inode_snapstate(inode, EXT4_SNAPSTATE_ENABLED))
+		err = ext4_snapshot_add_clone(inode, file);
+	ext4_snapshot_mutex_unlock(sb);
+	if (err < 0)
+		goto out_fput;
+
+	clone.sc_index = err;
+	err = 0;
+	if (copy_to_user(uclone, &clone, sizeof(clone)))
+		err = -EFAULT;
+out_fput:
+	fput(file);
+	return err;
+}
+#endif
+
+int init_ext4_snapshot_bdev(void)
+{
+	ext4_snapshot_bdev_major = register_blkdev(0, "ext4snap");
+	if (ext4_snapshot_bdev_major < 0)
+		return ext4_snapshot_bdev_major;
+	return 0;
+}
+
+void exit_ext4_snapshot_bdev(void)
+{
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_AUTOMOUNT
+	cancel_delayed_work_sync(&ext4_snapshot_expire_work);
+#endif
+	unregister_blkdev(ext4_snapshot_bdev_major, "ext4snap");
+	ida_destroy(&ext4_snapshot_bdev_ida);
+}
+#endif
 #endif
@@ -46,6 +46,7 @@
 
 #include "ext4.h"
 #include "ext4_jbd2.h"
+#include "ext4_extents.h"
 #include "xattr.h"
 #include "acl.h"
 #include "mballoc.h"
@@ -226,6 +227,17 @@ void ext4_inode_bitmap_set(struct super_block *sb,
 		bg->bg_inode_bitmap_hi = cpu_to_le32(blk >> 32);
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RESIZE
+void ext4_exclude_bitmap_set(struct super_block *sb,
+			     struct ext4_group_desc *bg, ext4_fsblk_t blk)
+{
+	bg->bg_exclude_bitmap_lo = cpu_to_le32((u32)blk);
+	if (EXT4_DESC_SIZE(sb) >= EXT4_MIN_DESC_SIZE_64BIT)
+		bg->bg_exclude_bitmap_hi = cpu_to_le32(blk >> 32);
+}
+
+#endif
+
 void ext4_inode_table_set(struct super_block *sb,
 			  struct ext4_group_desc *bg, ext4_fsblk_t blk)
 {
@@ -351,7 +363,12 @@ handle_t *ext4_journal_start_sb(struct super_block *sb, int nblocks)
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CREDITS
 
 	credits = EXT4_SNAPSHOTS(sb) ?
-		EXT4_SNAPSHOT_START_TRANS_BLOCKS(nblocks) : nblocks;
+		ext4_snapshot_start_trans_blocks(sb, nblocks) : nblocks;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BUDGET
+	if (unlikely(credits > journal->j_max_transaction_buffers) &&
+	    EXT4_SNAPSHOTS(sb))
+		ext4_snapshot_budget_fit(sb, credits);
+#endif
 	handle = jbd2_journal_start(journal, credits);
 	if (EXT4_SNAPSHOTS(sb) && !IS_ERR(handle)) {
 		if (handle->h_ref == 1) {
@@ -388,6 +405,24 @@ int __ext4_journal_stop(const char *where, unsigned int line, handle_t *handle)
 	}
 	sb = handle->h_transaction->t_journal->j_private;
 	err = handle->h_err;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_CREDITS_ADAPTIVE
+	/* account the user credits consumed by the outermost handle */
+	if (handle->h_ref == 1 && EXT4_SNAPSHOTS(sb) &&
+	    ext4_snapshot_has_active(sb)) {
+		int used = (int)handle->h_base_credits -
+			(int)handle->h_user_credits;
+
+		if (used > 0)
+			atomic_add(used, &EXT4_SB(sb)->s_snapshot_budget_user);
+	}
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_BITMAP_HANDLE
+	/* release the COW bitmap cached by the outermost handle */
+	if (handle->h_ref == 1 && handle->h_cow_bitmap_bh) {
+		brelse(handle->h_cow_bitmap_bh);
+		handle->h_cow_bitmap_bh = NULL;
+	}
+#endif
 	rc = jbd2_journal_stop(handle);
 
 	if (!err)
@@ -926,6 +961,23 @@ static void ext4_put_super(struct super_block *sb)
 	int i, err;
 
 	ext4_unregister_li_request(sb);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_SCHED
+	if (EXT4_SNAPSHOTS(sb))
+		ext4_snapshot_stop_sched(sb);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC
+	/* stop cleanup thread before sb_lock and snapshot_destroy() */
+	if (EXT4_SNAPSHOTS(sb))
+		ext4_snapshot_stop_cleanup(sb);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE_ASYNC
+	/* MS_ACTIVE is clear, so the reaped inodes are evicted on iput() */
+	if (sbi->s_snapshot_reap_wq) {
+		flush_workqueue(sbi->s_snapshot_reap_wq);
+		destroy_workqueue(sbi->s_snapshot_reap_wq);
+		sbi->s_snapshot_reap_wq = NULL;
+	}
+#endif
 	dquot_disable(sb, -1, DQUOT_USAGE_ENABLED | DQUOT_LIMITS_ENABLED);
 
 	flush_workqueue(sbi->dio_unwritten_wq);
@@ -945,6 +997,10 @@ static void ext4_put_super(struct super_block *sb)
 		if (err < 0)
 			ext4_abort(sb, "Couldn't clean up the journal");
 	}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_DISCARD
+	/* return blocks freed by the last commits to the buddy cache */
+	flush_work_sync(&sbi->s_snapshot_discard_work);
+#endif
 
 	del_timer(&sbi->s_err_report);
 	ext4_release_system_zone(sb);
@@ -966,10 +1022,20 @@ static void ext4_put_super(struct super_block *sb)
 		brelse(sbi->s_group_desc[i]);
 	ext4_kvfree(sbi->s_group_desc);
 	ext4_kvfree(sbi->s_flex_groups);
+#ifdef CONFIG_EXT4_FS_FLEX_COUNTERS_PCPU
+	free_percpu(sbi->s_flex_deltas);
+#endif
 	percpu_counter_destroy(&sbi->s_freeblocks_counter);
 	percpu_counter_destroy(&sbi->s_freeinodes_counter);
 	percpu_counter_destroy(&sbi->s_dirs_counter);
 	percpu_counter_destroy(&sbi->s_dirtyblocks_counter);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_TRACK
+	percpu_counter_destroy(&sbi->s_meta_blocks_counter);
+	percpu_counter_destroy(&sbi->s_snapshot_r_blocks_counter);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
+	free_percpu(sbi->s_snapshot_stats);
+#endif
 	brelse(sbi->s_sbh);
 #ifdef CONFIG_QUOTA
 	for (i = 0; i < MAXQUOTAS; i++)
@@ -995,8 +1061,12 @@ static void ext4_put_super(struct super_block *sb)
 		invalidate_bdev(sbi->journal_bdev);
 		ext4_blkdev_remove(sbi);
 	}
+#ifdef CONFIG_EXT4_FS_MMP_SHARED
+	ext4_stop_mmp(sb);
+#else
 	if (sbi->s_mmp_tsk)
 		kthread_stop(sbi->s_mmp_tsk);
+#endif
 	sb->s_fs_info = NULL;
 	/*
 	 * Now that we are completely done shutting down the
@@ -1025,6 +1095,12 @@ static struct inode *ext4_alloc_inode(struct super_block *sb)
 	ei->vfs_inode.i_version = 1;
 	ei->vfs_inode.i_data.writeback_index = 0;
 	memset(&ei->i_cached_extent, 0, sizeof(struct ext4_ext_cache));
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_CACHE
+	ei->i_extent_cache = RB_ROOT;
+	INIT_LIST_HEAD(&ei->i_extent_cache_lru);
+	INIT_LIST_HEAD(&ei->i_extent_cache_list);
+	ei->i_extent_cache_nr = 0;
+#endif
 	INIT_LIST_HEAD(&ei->i_prealloc_list);
 	spin_lock_init(&ei->i_prealloc_lock);
 	ei->i_reserved_data_blocks = 0;
@@ -1043,14 +1119,108 @@ static struct inode *ext4_alloc_inode(struct super_block *sb)
 	ei->i_datasync_tid = 0;
 	atomic_set(&ei->i_ioend_count, 0);
 	atomic_set(&ei->i_aiodio_unwritten, 0);
+#ifdef CONFIG_EXT4_FS_DIR_FREE_HINTS
+	ei->i_dir_hints = NULL;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_CACHE
+	ei->i_snapshot_read_cache = NULL;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_BDEV
+	ei->i_snapshot_bdev = NULL;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_CLONE
+	INIT_LIST_HEAD(&ei->i_snapshot_clones);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_SHRINK_PARALLEL
+	ei->i_snapshot_shrink_group = 0;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_MOW_GOAL
+	ei->i_snapshot_mow_lblk = 0;
+	ei->i_snapshot_mow_pblk = 0;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_NEW_BLOCKS
+	ei->i_snapshot_new_len = 0;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_PACKED
+	ei->i_snapshot_cow_goal = 0;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_STATS
+	atomic64_set(&ei->i_snapshot_cowed, 0);
+	atomic64_set(&ei->i_snapshot_moved, 0);
+	atomic64_set(&ei->i_snapshot_merged, 0);
+	ei->i_snapshot_stats_partial = 1;
+#endif
 
 	return &ei->vfs_inode;
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE_ASYNC
+struct ext4_reap_work {
+	struct work_struct work;
+	struct inode *inode;
+};
+
+static void ext4_reap_worker(struct work_struct *work)
+{
+	struct ext4_reap_work *rw =
+		container_of(work, struct ext4_reap_work, work);
+	struct inode *inode = rw->inode;
+
+	kfree(rw);
+	ext4_reap_inode(inode, EXT4_SNAPSHOT_REAP_STEP);
+	/* the next drop of this inode is final */
+	ext4_set_inode_state(inode, EXT4_STATE_REAPED);
+	iput(inode);
+}
+
+/*
+ * ext4_defer_delete() - defer the delete of a large unlinked file
+ *
+ * Called from ext4_drop_inode() under inode->i_lock on the last iput().
+ * While a snapshot is active, deleting a large file moves all its blocks
+ * to snapshot, so hand the delete over to the reap workqueue, instead of
+ * blocking the task that dropped the last reference.
+ * Returns 1 if the delete was deferred and the inode should be kept.
+ */
+static int ext4_defer_delete(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct ext4_reap_work *rw;
+	unsigned int limit = sbi->s_snapshot_reap_blocks;
+
+	if (inode->i_nlink || !S_ISREG(inode->i_mode) || is_bad_inode(inode))
+		return 0;
+	if (!limit || !sbi->s_snapshot_reap_wq ||
+	    (sb->s_flags & (MS_RDONLY|MS_ACTIVE)) != MS_ACTIVE)
+		return 0;
+	if (ext4_test_inode_state(inode, EXT4_STATE_REAPED) ||
+	    ext4_snapshot_file(inode) || ext4_snapshot_excluded(inode) ||
+	    !ext4_snapshot_has_active(sb))
+		return 0;
+	if ((inode->i_blocks >> (inode->i_blkbits - 9)) < limit)
+		return 0;
+
+	rw = kmalloc(sizeof(*rw), GFP_ATOMIC);
+	if (!rw)
+		return 0;
+	INIT_WORK(&rw->work, ext4_reap_worker);
+	rw->inode = inode;
+	/* i_lock is held, so take the worker reference with __iget() */
+	__iget(inode);
+	queue_work(sbi->s_snapshot_reap_wq, &rw->work);
+	return 1;
+}
+
+#endif
 static int ext4_drop_inode(struct inode *inode)
 {
 	int drop = generic_drop_inode(inode);
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE_ASYNC
+	if (drop && ext4_defer_delete(inode))
+		drop = 0;
+#endif
 	trace_ext4_drop_inode(inode, drop);
 	return drop;
 }
@@ -1117,6 +1287,15 @@ void ext4_clear_inode(struct inode *inode)
 		jbd2_free_inode(EXT4_I(inode)->jinode);
 		EXT4_I(inode)->jinode = NULL;
 	}
+#ifdef CONFIG_EXT4_FS_DIR_FREE_HINTS
+	ext4_dir_hints_free(inode);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST_READ_CACHE
+	ext4_snapshot_free_read_cache(inode);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_EXTENT_CACHE
+	ext4_ext_invalidate_cache(inode);
+#endif
 }
 
 static inline void ext4_show_quota_options(struct seq_file *seq,
@@ -1240,6 +1419,10 @@ static int ext4_show_options(struct seq_file *seq, struct vfsmount *vfs)
 		seq_puts(seq, ",journal_async_commit");
 	else if (test_opt(sb, JOURNAL_CHECKSUM))
 		seq_puts(seq, ",journal_checksum");
+#ifdef CONFIG_EXT4_FS_JOURNAL_CSUM_CRC32C
+	if (test_opt2(sb, JOURNAL_CSUM_CRC32C))
+		seq_puts(seq, ",journal_checksum=crc32c");
+#endif
 	if (test_opt(sb, I_VERSION))
 		seq_puts(seq, ",i_version");
 	if (!test_opt(sb, DELALLOC) &&
@@ -1437,6 +1620,18 @@ static const struct super_operations ext4_nojournal_sops = {
 #endif
 	.bdev_try_to_free_page = bdev_try_to_free_page,
 };
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_DEBUG_BENCH
+
+/*
+ * ext4_sb_is_ext4() - test if @sb is an ext4 super block.
+ * Called from debugfs benchmarks, which get the super block from the
+ * working directory of the reader.
+ */
+int ext4_sb_is_ext4(struct super_block *sb)
+{
+	return sb->s_op == &ext4_sops || sb->s_op == &ext4_nojournal_sops;
+}
+#endif
 
 static const struct export_operations ext4_export_ops = {
 	.fh_to_dentry = ext4_fh_to_dentry,
@@ -1465,6 +1660,15 @@ enum {
 	Opt_dioread_nolock, Opt_dioread_lock,
 	Opt_discard, Opt_nodiscard,
 	Opt_init_inode_table, Opt_noinit_inode_table,
+#ifdef CONFIG_EXT4_FS_JOURNAL_CSUM_CRC32C
+	Opt_journal_checksum_crc32c,
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_REVERT
+	Opt_snapshot_revert,
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_CONVERT
+	Opt_snapshot_convert,
+#endif
 };
 
 static const match_table_t tokens = {
@@ -1498,6 +1702,9 @@ static const match_table_t tokens = {
 	{Opt_journal_update, "journal=update"},
 	{Opt_journal_dev, "journal_dev=%u"},
 	{Opt_journal_checksum, "journal_checksum"},
+#ifdef CONFIG_EXT4_FS_JOURNAL_CSUM_CRC32C
+	{Opt_journal_checksum_crc32c, "journal_checksum=crc32c"},
+#endif
 	{Opt_journal_async_commit, "journal_async_commit"},
 	{Opt_abort, "abort"},
 	{Opt_data_journal, "data=journal"},
@@ -1540,6 +1747,12 @@ static const match_table_t tokens = {
 	{Opt_init_inode_table, "init_itable=%u"},
 	{Opt_init_inode_table, "init_itable"},
 	{Opt_noinit_inode_table, "noinit_itable"},
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_REVERT
+	{Opt_snapshot_revert, "snapshot_revert"},
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_CONVERT
+	{Opt_snapshot_convert, "snapshot_convert"},
+#endif
 	{Opt_err, NULL},
 };
 
@@ -1769,6 +1982,12 @@ static int parse_options(char *options, struct super_block *sb,
 		case Opt_journal_checksum:
 			set_opt(sb, JOURNAL_CHECKSUM);
 			break;
+#ifdef CONFIG_EXT4_FS_JOURNAL_CSUM_CRC32C
+		case Opt_journal_checksum_crc32c:
+			set_opt(sb, JOURNAL_CHECKSUM);
+			set_opt2(sb, JOURNAL_CSUM_CRC32C);
+			break;
+#endif
 		case Opt_journal_async_commit:
 			set_opt(sb, JOURNAL_ASYNC_COMMIT);
 			set_opt(sb, JOURNAL_CHECKSUM);
@@ -2030,6 +2249,16 @@ set_qf_format:
 		case Opt_noinit_inode_table:
 			clear_opt(sb, INIT_INODE_TABLE);
 			break;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_REVERT
+		case Opt_snapshot_revert:
+			set_opt2(sb, SNAPSHOT_REVERT);
+			break;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_CONVERT
+		case Opt_snapshot_convert:
+			set_opt2(sb, SNAPSHOT_CONVERT);
+			break;
+#endif
 		default:
 			ext4_msg(sb, KERN_ERR,
 			       "Unrecognized mount option \"%s\" "
@@ -2124,6 +2353,94 @@ static int ext4_setup_super(struct super_block *sb, struct ext4_super_block *es,
 	return res;
 }
 
+#ifdef CONFIG_EXT4_FS_FLEX_COUNTERS_PCPU
+#ifdef CONFIG_EXT4_FS_ORLOV_GROUP_INDEX
+/*
+ * ext4_flex_index_update() - move flex group @flex to the list of the
+ * order of its free inodes, if the order has changed.
+ */
+void ext4_flex_index_update(struct ext4_sb_info *sbi, ext4_group_t flex)
+{
+	struct flex_groups *fg = &sbi->s_flex_groups[flex];
+	int order = fls(max(atomic_read(&fg->free_inodes), 0));
+
+	if (order == ACCESS_ONCE(fg->free_inodes_order))
+		return;
+	spin_lock(&sbi->s_flex_free_inodes_lock);
+	if (order != fg->free_inodes_order) {
+		list_move_tail(&fg->free_inodes_node,
+			       &sbi->s_flex_free_inodes[order]);
+		fg->free_inodes_order = order;
+	}
+	spin_unlock(&sbi->s_flex_free_inodes_lock);
+}
+
+#endif
+static void ext4_flex_fold(struct ext4_sb_info *sbi, struct ext4_flex_delta *d)
+{
+	struct flex_groups *fg = &sbi->s_flex_groups[d->fd_flex - 1];
+
+	if (d->fd_free_inodes) {
+		atomic_add(d->fd_free_inodes, &fg->free_inodes);
+#ifdef CONFIG_EXT4_FS_ORLOV_GROUP_INDEX
+		ext4_flex_index_update(sbi, d->fd_flex - 1);
+#endif
+	}
+	if (d->fd_free_blocks)
+		atomic_add(d->fd_free_blocks, &fg->free_blocks);
+	if (d->fd_used_dirs)
+		atomic_add(d->fd_used_dirs, &fg->used_dirs);
+	d->fd_free_inodes = d->fd_free_blocks = d->fd_used_dirs = 0;
+}
+
+/*
+ * ext4_flex_add() - update the counters of flex group @flex
+ * MOW and COW allocations concentrate in the flex groups of their
+ * sources, so updating the shared atomics on every allocation bounces
+ * their cache lines between all CPUs.  Accumulate the updates in a
+ * per-CPU delta and fold it into the shared counters in batches.
+ */
+void ext4_flex_add(struct ext4_sb_info *sbi, ext4_group_t flex,
+		   int free_inodes, int free_blocks, int used_dirs)
+{
+	struct ext4_flex_deltas *deltas;
+	struct ext4_flex_delta *d;
+
+	deltas = get_cpu_ptr(sbi->s_flex_deltas);
+	d = &deltas->slot[flex % EXT4_FLEX_DELTA_SLOTS];
+	if (d->fd_flex != flex + 1) {
+		if (d->fd_flex)
+			ext4_flex_fold(sbi, d);
+		d->fd_flex = flex + 1;
+	}
+	d->fd_free_inodes += free_inodes;
+	d->fd_free_blocks += free_blocks;
+	d->fd_used_dirs += used_dirs;
+	if (abs(d->fd_free_inodes) >= EXT4_FLEX_DELTA_BATCH ||
+	    abs(d->fd_used_dirs) >= EXT4_FLEX_DELTA_BATCH ||
+	    abs(d->fd_free_blocks) >= EXT4_FLEX_DELTA_BLOCKS_BATCH)
+		ext4_flex_fold(sbi, d);
+	put_cpu_ptr(sbi->s_flex_deltas);
+}
+
+/*
+ * ext4_flex_fold_local() - fold this CPU's delta of flex group @flex
+ * Called before the Orlov allocator reads the counters of @flex, so that
+ * the decisions of a task see at least its own recent allocations.
+ */
+void ext4_flex_fold_local(struct ext4_sb_info *sbi, ext4_group_t flex)
+{
+	struct ext4_flex_deltas *deltas;
+	struct ext4_flex_delta *d;
+
+	deltas = get_cpu_ptr(sbi->s_flex_deltas);
+	d = &deltas->slot[flex % EXT4_FLEX_DELTA_SLOTS];
+	if (d->fd_flex == flex + 1)
+		ext4_flex_fold(sbi, d);
+	put_cpu_ptr(sbi->s_flex_deltas);
+}
+
+#endif
 static int ext4_fill_flex_info(struct super_block *sb)
 {
 	struct ext4_sb_info *sbi = EXT4_SB(sb);
@@ -2153,6 +2470,14 @@ static int ext4_fill_flex_info(struct super_block *sb)
 			 flex_group_count);
 		goto failed;
 	}
+#ifdef CONFIG_EXT4_FS_FLEX_COUNTERS_PCPU
+	sbi->s_flex_deltas = alloc_percpu(struct ext4_flex_deltas);
+	if (sbi->s_flex_deltas == NULL) {
+		ext4_msg(sb, KERN_ERR, "not enough memory for flex group "
+			 "counters");
+		goto failed;
+	}
+#endif
 
 	for (i = 0; i < sbi->s_groups_count; i++) {
 		gdp = ext4_get_group_desc(sb, i, NULL);
@@ -2165,6 +2490,20 @@ static int ext4_fill_flex_info(struct super_block *sb)
 		atomic_add(ext4_used_dirs_count(sb, gdp),
 			   &sbi->s_flex_groups[flex_group].used_dirs);
 	}
+#ifdef CONFIG_EXT4_FS_ORLOV_GROUP_INDEX
+
+	spin_lock_init(&sbi->s_flex_free_inodes_lock);
+	for (i = 0; i < EXT4_FLEX_FREE_ORDERS; i++)
+		INIT_LIST_HEAD(&sbi->s_flex_free_inodes[i]);
+	for (i = 0; i < flex_group_count; i++) {
+		INIT_LIST_HEAD(&sbi->s_flex_groups[i].free_inodes_node);
+		sbi->s_flex_groups[i].free_inodes_order = -1;
+	}
+	/* flex groups added by online resize are listed when added */
+	for (i = 0; i <= ext4_flex_group(sbi, sbi->s_groups_count - 1); i++)
+		ext4_flex_index_update(sbi, i);
+	sbi->s_orlov_group_index = 1;
+#endif
 
 	return 1;
 failed:
@@ -2181,7 +2520,11 @@ __le16 ext4_group_desc_csum(struct ext4_sb_info *sbi, __u32 block_group,
 		int offset = offsetof(struct ext4_group_desc, bg_checksum);
 		__le32 le_group = cpu_to_le32(block_group);
 
+#ifdef CONFIG_EXT4_FS_GDT_CSUM_SEED
+		crc = sbi->s_csum_seed;
+#else
 		crc = crc16(~0, sbi->s_es->s_uuid, sizeof(sbi->s_es->s_uuid));
+#endif
 		crc = crc16(crc, (__u8 *)&le_group, sizeof(le_group));
 		crc = crc16(crc, (__u8 *)gdp, offset);
 		offset += sizeof(gdp->bg_checksum); /* skip checksum */
@@ -2220,6 +2563,9 @@ static int ext4_check_descriptors(struct super_block *sb,
 	ext4_fsblk_t inode_table;
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
 	ext4_fsblk_t exclude_bitmap;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_FIX_GROUP
+	ext4_group_t fix_groups = 0;
 #endif
 	int flexbg_flag = 0;
 	ext4_group_t i, grp = sbi->s_groups_count;
@@ -2278,6 +2624,10 @@ static int ext4_check_descriptors(struct super_block *sb,
 				return 0;
 			}
 		}
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_FIX_GROUP
+		if (gdp->bg_flags & cpu_to_le16(EXT4_BG_EXCLUDE_FIX))
+			fix_groups++;
 #endif
 		ext4_lock_group(sb, i);
 		if (!ext4_group_desc_csum_verify(sbi, i, gdp)) {
@@ -2300,6 +2650,13 @@ static int ext4_check_descriptors(struct super_block *sb,
 	}
 	if (NULL != first_not_zeroed)
 		*first_not_zeroed = grp;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_FIX_GROUP
+	if (EXT4_TEST_FLAGS(sb, EXT4_FLAGS_FIX_EXCLUDE))
+		ext4_msg(sb, KERN_WARNING, "exclude bitmap needs fixing - "
+			 "run fsck (%s%u groups marked)",
+			 EXT4_TEST_FLAGS(sb, EXT4_FLAGS_FIX_GROUPS) ?
+			 "" : "full check, ", fix_groups);
+#endif
 
 	ext4_free_blocks_count_set(sbi->s_es, ext4_count_free_blocks(sb));
 	sbi->s_es->s_free_inodes_count =cpu_to_le32(ext4_count_free_inodes(sb));
@@ -2661,6 +3018,148 @@ static ssize_t extent_cache_misses_show(struct ext4_attr *a,
 	return snprintf(buf, PAGE_SIZE, "%lu\n", sbi->extent_cache_misses);
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_PREPARE
+static ssize_t snapshot_take_latency_show(struct ext4_attr *a,
+					  struct ext4_sb_info *sbi, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "prepare=%llu freeze=%llu "
+			"commit=%llu thaw=%llu\n",
+			sbi->s_snapshot_take_prepare_us,
+			sbi->s_snapshot_take_freeze_us,
+			sbi->s_snapshot_take_commit_us,
+			sbi->s_snapshot_take_thaw_us);
+}
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC
+static ssize_t snapshot_cleanup_show(struct ext4_attr *a,
+				     struct ext4_sb_info *sbi, char *buf)
+{
+	unsigned long *state = &sbi->s_snapshot_cleanup_state;
+	const char *s = "idle";
+
+	if (!sbi->s_snapshot_cleanup)
+		s = "stopped";
+	else if (test_bit(SNAPSHOT_CLEANUP_RUNNING, state))
+		s = "running";
+	else if (test_bit(SNAPSHOT_CLEANUP_PENDING, state))
+		s = "pending";
+	/* state, completed cleanup passes and last cleanup pass error */
+	return snprintf(buf, PAGE_SIZE, "%s %u %d\n", s,
+			sbi->s_snapshot_cleanup_passes,
+			sbi->s_snapshot_cleanup_err);
+}
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_MOW_GOAL
+static ssize_t snapshot_mow_alloc_show(struct ext4_attr *a,
+				       struct ext4_sb_info *sbi, char *buf)
+{
+	/* move-on-write allocations, arena goal allocations and goal hits */
+	return snprintf(buf, PAGE_SIZE, "allocs=%d arena=%d hits=%d\n",
+			atomic_read(&sbi->s_snapshot_mow_allocs),
+			atomic_read(&sbi->s_snapshot_mow_arena),
+			atomic_read(&sbi->s_snapshot_mow_hits));
+}
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
+static ssize_t snapshot_stats_show(struct ext4_attr *a,
+				   struct ext4_sb_info *sbi, char *buf)
+{
+	return ext4_snapshot_stats_show(sbi, buf);
+}
+
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS_RESET
+static ssize_t snapshot_stats_store(struct ext4_attr *a,
+				    struct ext4_sb_info *sbi,
+				    const char *buf, size_t count)
+{
+	unsigned long t;
+
+	if (parse_strtoul(buf, 0, &t))
+		return -EINVAL;
+
+	ext4_snapshot_stats_reset(sbi);
+	return count;
+}
+
+#endif
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_ASYNC
+static ssize_t snapshot_take_show(struct ext4_attr *a,
+				  struct ext4_sb_info *sbi, char *buf)
+{
+	__u64 queued, done;
+	int err;
+
+	spin_lock(&sbi->s_snapshot_take_lock);
+	queued = sbi->s_snapshot_take_queued;
+	done = sbi->s_snapshot_take_done;
+	err = sbi->s_snapshot_take_err;
+	spin_unlock(&sbi->s_snapshot_take_lock);
+	return snprintf(buf, PAGE_SIZE, "queued=%llu done=%llu err=%d\n",
+			(unsigned long long)queued,
+			(unsigned long long)done, err);
+}
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_SCHED
+static ssize_t snapshot_sched_show(struct ext4_attr *a,
+				   struct ext4_sb_info *sbi, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "taken=%u expired=%u err=%d\n",
+			sbi->s_snapshot_sched_taken,
+			sbi->s_snapshot_sched_expired,
+			sbi->s_snapshot_sched_err);
+}
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BUDGET
+static ssize_t snapshot_journal_show(struct ext4_attr *a,
+				     struct ext4_sb_info *sbi, char *buf)
+{
+	return ext4_snapshot_budget_show(sbi, buf);
+}
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+static ssize_t snapshot_exclude_show(struct ext4_attr *a,
+				     struct ext4_sb_info *sbi, char *buf)
+{
+	/* file being excluded, resume offset and blocks excluded so far */
+	return snprintf(buf, PAGE_SIZE, "ino=%lu lblk=%u blocks=%llu\n",
+			sbi->s_snapshot_exclude_ino,
+			sbi->s_snapshot_exclude_lblk,
+			sbi->s_snapshot_exclude_blocks);
+}
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_SHRINK
+static ssize_t exclude_bitmap_cache_show(struct ext4_attr *a,
+					 struct ext4_sb_info *sbi, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%d\n",
+			atomic_read(&sbi->s_exclude_bh_pinned));
+}
+
+#endif
+#ifdef CONFIG_EXT4_FS_MB_BATCHED_TRIM
+static ssize_t trim_stats_show(struct ext4_attr *a,
+			       struct ext4_sb_info *sbi, char *buf)
+{
+	struct ext4_trim_stats ts;
+
+	spin_lock(&sbi->s_trim_stats_lock);
+	ts = sbi->s_trim_stats;
+	spin_unlock(&sbi->s_trim_stats_lock);
+	return snprintf(buf, PAGE_SIZE, "groups=%lu skipped=%lu extents=%lu "
+			"discards=%lu blocks=%llu\n", ts.ts_groups,
+			ts.ts_skipped, ts.ts_extents, ts.ts_discards,
+			ts.ts_blocks);
+}
+
+#endif
 static ssize_t inode_readahead_blks_store(struct ext4_attr *a,
 					  struct ext4_sb_info *sbi,
 					  const char *buf, size_t count)
@@ -2720,16 +3219,117 @@ EXT4_RO_ATTR(session_write_kbytes);
 EXT4_RO_ATTR(lifetime_write_kbytes);
 EXT4_RO_ATTR(extent_cache_hits);
 EXT4_RO_ATTR(extent_cache_misses);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_PREPARE
+EXT4_RO_ATTR(snapshot_take_latency);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC
+EXT4_RO_ATTR(snapshot_cleanup);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_MOW_GOAL
+EXT4_RO_ATTR(snapshot_mow_alloc);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+EXT4_RO_ATTR(snapshot_exclude);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_SHRINK
+EXT4_RO_ATTR(exclude_bitmap_cache);
+EXT4_RW_ATTR_SBI_UI(exclude_bitmap_cache_max, s_exclude_bh_max);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS_RESET
+EXT4_RW_ATTR(snapshot_stats);
+#else
+EXT4_RO_ATTR(snapshot_stats);
+#endif
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BUDGET
+EXT4_RO_ATTR(snapshot_journal);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_ASYNC
+EXT4_RO_ATTR(snapshot_take);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_SCHED
+EXT4_RO_ATTR(snapshot_sched);
+#endif
+#ifdef CONFIG_EXT4_FS_MB_BATCHED_TRIM
+EXT4_RO_ATTR(trim_stats);
+#endif
 EXT4_ATTR_OFFSET(inode_readahead_blks, 0644, sbi_ui_show,
 		 inode_readahead_blks_store, s_inode_readahead_blks);
 EXT4_RW_ATTR_SBI_UI(inode_goal, s_inode_goal);
+#ifdef CONFIG_EXT4_FS_HTREE_READAHEAD
+EXT4_RW_ATTR_SBI_UI(htree_readahead_blks, s_htree_readahead_blks);
+#endif
+#ifdef CONFIG_EXT4_FS_DIR_INODE_READAHEAD
+EXT4_RW_ATTR_SBI_UI(dir_inode_readahead, s_dir_inode_readahead);
+#endif
 EXT4_RW_ATTR_SBI_UI(mb_stats, s_mb_stats);
 EXT4_RW_ATTR_SBI_UI(mb_max_to_scan, s_mb_max_to_scan);
 EXT4_RW_ATTR_SBI_UI(mb_min_to_scan, s_mb_min_to_scan);
 EXT4_RW_ATTR_SBI_UI(mb_order2_req, s_mb_order2_reqs);
 EXT4_RW_ATTR_SBI_UI(mb_stream_req, s_mb_stream_request);
 EXT4_RW_ATTR_SBI_UI(mb_group_prealloc, s_mb_group_prealloc);
+#ifdef CONFIG_EXT4_FS_MB_GROUP_INDEX
+EXT4_RW_ATTR_SBI_UI(mb_group_index, s_mb_group_index);
+#endif
+#ifdef CONFIG_EXT4_FS_ORLOV_GROUP_INDEX
+EXT4_RW_ATTR_SBI_UI(orlov_group_index, s_orlov_group_index);
+#endif
+#ifdef CONFIG_EXT4_FS_MB_PREFETCH
+EXT4_RW_ATTR_SBI_UI(mb_prefetch, s_mb_prefetch);
+#endif
+#ifdef CONFIG_EXT4_FS_MB_ADAPTIVE_GROUP_PREALLOC
+EXT4_RW_ATTR_SBI_UI(mb_group_prealloc_adapt, s_mb_group_prealloc_adapt);
+#endif
 EXT4_RW_ATTR_SBI_UI(max_writeback_mb_bump, s_max_writeback_mb_bump);
+#ifdef CONFIG_EXT4_FS_STATFS_CACHE
+EXT4_RW_ATTR_SBI_UI(statfs_cache_ms, s_statfs_cache_ms);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE_ASYNC
+EXT4_RW_ATTR_SBI_UI(snapshot_reap_blocks, s_snapshot_reap_blocks);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREALLOC
+EXT4_RW_ATTR_SBI_UI(snapshot_prealloc_groups, s_snapshot_prealloc_groups);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_EVICT
+EXT4_RW_ATTR_SBI_UI(snapshot_evict_ratio, s_snapshot_evict_ratio);
+EXT4_ATTR_OFFSET(snapshot_evictions, 0444, sbi_ui_show, NULL,
+		 s_snapshot_evictions);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_COMPACT
+EXT4_RW_ATTR_SBI_UI(snapshot_compact_age, s_snapshot_compact_age);
+EXT4_ATTR_OFFSET(snapshot_compacted_blocks, 0444, sbi_ui_show, NULL,
+		 s_snapshot_compacted_blocks);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_PACKED
+EXT4_RW_ATTR_SBI_UI(snapshot_cow_packed, s_snapshot_cow_packed);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_DEDUP
+EXT4_RW_ATTR_SBI_UI(snapshot_cow_dedup, s_snapshot_cow_dedup);
+EXT4_ATTR_OFFSET(snapshot_dedup_blocks, 0444, sbi_ui_show, NULL,
+		 s_snapshot_dedup_blocks);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_MOVE_QUOTA
+EXT4_RW_ATTR_SBI_UI(snapshot_charge_quota, s_snapshot_charge_quota);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_JOURNAL_FREEZE
+EXT4_RW_ATTR_SBI_UI(snapshot_take_journal_freeze,
+		    s_snapshot_take_journal_freeze);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BYPASS_CREDITS
+EXT4_RW_ATTR_SBI_UI(snapshot_bypass_credits, s_snapshot_bypass_credits);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_DISCARD
+EXT4_RW_ATTR_SBI_UI(snapshot_discard_rate, s_snapshot_discard_rate);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_SCHED
+EXT4_RW_ATTR_SBI_UI(snapshot_sched_dir, s_snapshot_sched_dir);
+EXT4_RW_ATTR_SBI_UI(snapshot_sched_interval, s_snapshot_sched_interval);
+EXT4_RW_ATTR_SBI_UI(snapshot_sched_jitter, s_snapshot_sched_jitter);
+EXT4_RW_ATTR_SBI_UI(snapshot_sched_idle, s_snapshot_sched_idle);
+EXT4_RW_ATTR_SBI_UI(snapshot_sched_keep, s_snapshot_sched_keep);
+EXT4_RW_ATTR_SBI_UI(snapshot_sched_max_age, s_snapshot_sched_max_age);
+#endif
 
 static struct attribute *ext4_attrs[] = {
 	ATTR_LIST(delayed_allocation_blocks),
@@ -2739,13 +3339,104 @@ static struct attribute *ext4_attrs[] = {
 	ATTR_LIST(extent_cache_misses),
 	ATTR_LIST(inode_readahead_blks),
 	ATTR_LIST(inode_goal),
+#ifdef CONFIG_EXT4_FS_HTREE_READAHEAD
+	ATTR_LIST(htree_readahead_blks),
+#endif
+#ifdef CONFIG_EXT4_FS_DIR_INODE_READAHEAD
+	ATTR_LIST(dir_inode_readahead),
+#endif
 	ATTR_LIST(mb_stats),
 	ATTR_LIST(mb_max_to_scan),
 	ATTR_LIST(mb_min_to_scan),
 	ATTR_LIST(mb_order2_req),
 	ATTR_LIST(mb_stream_req),
 	ATTR_LIST(mb_group_prealloc),
+#ifdef CONFIG_EXT4_FS_MB_GROUP_INDEX
+	ATTR_LIST(mb_group_index),
+#endif
+#ifdef CONFIG_EXT4_FS_ORLOV_GROUP_INDEX
+	ATTR_LIST(orlov_group_index),
+#endif
+#ifdef CONFIG_EXT4_FS_MB_PREFETCH
+	ATTR_LIST(mb_prefetch),
+#endif
+#ifdef CONFIG_EXT4_FS_MB_ADAPTIVE_GROUP_PREALLOC
+	ATTR_LIST(mb_group_prealloc_adapt),
+#endif
+#ifdef CONFIG_EXT4_FS_MB_BATCHED_TRIM
+	ATTR_LIST(trim_stats),
+#endif
 	ATTR_LIST(max_writeback_mb_bump),
+#ifdef CONFIG_EXT4_FS_STATFS_CACHE
+	ATTR_LIST(statfs_cache_ms),
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE_ASYNC
+	ATTR_LIST(snapshot_reap_blocks),
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREALLOC
+	ATTR_LIST(snapshot_prealloc_groups),
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_EVICT
+	ATTR_LIST(snapshot_evict_ratio),
+	ATTR_LIST(snapshot_evictions),
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_COMPACT
+	ATTR_LIST(snapshot_compact_age),
+	ATTR_LIST(snapshot_compacted_blocks),
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_PACKED
+	ATTR_LIST(snapshot_cow_packed),
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_DEDUP
+	ATTR_LIST(snapshot_cow_dedup),
+	ATTR_LIST(snapshot_dedup_blocks),
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_MOVE_QUOTA
+	ATTR_LIST(snapshot_charge_quota),
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_JOURNAL_FREEZE
+	ATTR_LIST(snapshot_take_journal_freeze),
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BYPASS_CREDITS
+	ATTR_LIST(snapshot_bypass_credits),
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_DISCARD
+	ATTR_LIST(snapshot_discard_rate),
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_PREPARE
+	ATTR_LIST(snapshot_take_latency),
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC
+	ATTR_LIST(snapshot_cleanup),
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_MOW_GOAL
+	ATTR_LIST(snapshot_mow_alloc),
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BULK
+	ATTR_LIST(snapshot_exclude),
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP_SHRINK
+	ATTR_LIST(exclude_bitmap_cache),
+	ATTR_LIST(exclude_bitmap_cache_max),
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
+	ATTR_LIST(snapshot_stats),
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BUDGET
+	ATTR_LIST(snapshot_journal),
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_ASYNC
+	ATTR_LIST(snapshot_take),
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_SCHED
+	ATTR_LIST(snapshot_sched_dir),
+	ATTR_LIST(snapshot_sched_interval),
+	ATTR_LIST(snapshot_sched_jitter),
+	ATTR_LIST(snapshot_sched_idle),
+	ATTR_LIST(snapshot_sched_keep),
+	ATTR_LIST(snapshot_sched_max_age),
+	ATTR_LIST(snapshot_sched),
+#endif
 	NULL,
 };
 
@@ -2852,6 +3543,15 @@ static int ext4_feature_set_ok(struct super_block *sb, int readonly)
 #ifdef CONFIG_EXT4_FS_SNAPSHOT
 	/* Enforce snapshots requirements: */
 	if (EXT4_SNAPSHOTS(sb)) {
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_META_BG
+		if (ext4_blocks_count(EXT4_SB(sb)->s_es) >
+				SNAPSHOT_MAX_BLOCKS) {
+			ext4_msg(sb, KERN_ERR,
+				"has_snapshot feature cannot be used with "
+				"more than 2^32 blocks");
+			return 0;
+		}
+#else
 		if (EXT4_HAS_INCOMPAT_FEATURE(sb,
 					EXT4_FEATURE_INCOMPAT_META_BG|
 					EXT4_FEATURE_INCOMPAT_64BIT)) {
@@ -2860,6 +3560,19 @@ static int ext4_feature_set_ok(struct super_block *sb, int readonly)
 				"features: meta_bg, 64bit");
 			return 0;
 		}
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_CONVERT
+		if (EXT4_HAS_COMPAT_FEATURE(sb,
+					EXT4_FEATURE_COMPAT_EXCLUDE_INODE)) {
+			/* conversion is done by ext4_fill_super() */
+			if (test_opt2(sb, SNAPSHOT_CONVERT) && !sb->s_root)
+				return 1;
+			ext4_msg(sb, KERN_ERR,
+				"next3 snapshots must be converted "
+				"with the snapshot_convert mount option");
+			return 0;
+		}
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_EXCLUDE_BITMAP
 		if (!EXT4_HAS_COMPAT_FEATURE(sb,
 					EXT4_FEATURE_COMPAT_EXCLUDE_BITMAP)) {
@@ -2966,6 +3679,39 @@ static int ext4_run_li_request(struct ext4_li_request *elr)
 	if (group == ngroups)
 		ret = 1;
 
+#ifdef CONFIG_EXT4_FS_LAZYINIT_BATCH
+	if (!ret) {
+		ext4_group_t end = group + ext4_flex_bg_size(EXT4_SB(sb));
+
+		/*
+		 * Zero out the inode tables up to the end of the flex group
+		 * in one run. With flex_bg they are contiguous on disk, so
+		 * the zeroouts are issued as one sequential stream, and a
+		 * single cache flush is needed for the whole batch.
+		 */
+		end -= end % ext4_flex_bg_size(EXT4_SB(sb));
+		if (end > ngroups)
+			end = ngroups;
+		timeout = jiffies;
+		do {
+			ret = ext4_init_inode_table(sb, group, 0);
+		} while (!ret && ++group < end);
+		if (elr->lr_timeout == 0)
+			blkdev_issue_flush(sb->s_bdev, GFP_NOFS, NULL);
+		/*
+		 * Pace the next run by the time this one took, so lazyinit
+		 * backs off when it competes with foreground I/O. The
+		 * average keeps a single slow run from stalling it.
+		 */
+		timeout = (jiffies - timeout) * elr->lr_sbi->s_li_wait_mult;
+		if (elr->lr_timeout == 0)
+			elr->lr_timeout = timeout;
+		else
+			elr->lr_timeout = (elr->lr_timeout * 3 + timeout) / 4;
+		elr->lr_next_sched = jiffies + elr->lr_timeout;
+		elr->lr_next_group = group;
+	}
+#else
 	if (!ret) {
 		timeout = jiffies;
 		ret = ext4_init_inode_table(sb, group,
@@ -2978,6 +3724,7 @@ static int ext4_run_li_request(struct ext4_li_request *elr)
 		elr->lr_next_sched = jiffies + elr->lr_timeout;
 		elr->lr_next_group = group + 1;
 	}
+#endif
 
 	return ret;
 }
@@ -3319,6 +4066,12 @@ static int ext4_fill_super(struct super_block *sb, void *data, int silent)
 	sbi->s_resuid = EXT4_DEF_RESUID;
 	sbi->s_resgid = EXT4_DEF_RESGID;
 	sbi->s_inode_readahead_blks = EXT4_DEF_INODE_READAHEAD_BLKS;
+#ifdef CONFIG_EXT4_FS_HTREE_READAHEAD
+	sbi->s_htree_readahead_blks = EXT4_DEF_HTREE_READAHEAD_BLKS;
+#endif
+#ifdef CONFIG_EXT4_FS_DIR_INODE_READAHEAD
+	sbi->s_dir_inode_readahead = 1;
+#endif
 	sbi->s_sb_block = sb_block;
 	if (sb->s_bdev->bd_part)
 		sbi->s_sectors_written_start =
@@ -3475,7 +4228,16 @@ static int ext4_fill_super(struct super_block *sb, void *data, int silent)
 
 	blocksize = BLOCK_SIZE << le32_to_cpu(es->s_log_block_size);
 
-#ifdef CONFIG_EXT4_FS_SNAPSHOT
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_SUBPAGE
+	/* Enforce snapshots blocksize == snapshot block size */
+	if (EXT4_SNAPSHOTS(sb) && blocksize != SNAPSHOT_BLOCK_SIZE) {
+		ext4_msg(sb, KERN_ERR,
+				"snapshots require that filesystem blocksize "
+				"(%d) be equal to snapshot block size (%d)",
+				blocksize, SNAPSHOT_BLOCK_SIZE);
+		goto failed_mount;
+	}
+#elif defined(CONFIG_EXT4_FS_SNAPSHOT)
 	/* Enforce snapshots blocksize == pagesize */
 	if (EXT4_SNAPSHOTS(sb) && blocksize != PAGE_SIZE) {
 		ext4_msg(sb, KERN_ERR,
@@ -3687,6 +4449,10 @@ static int ext4_fill_super(struct super_block *sb, void *data, int silent)
 			goto failed_mount2;
 		}
 	}
+#ifdef CONFIG_EXT4_FS_GDT_CSUM_SEED
+	/* the UUID can only be changed while the fs is unmounted */
+	sbi->s_csum_seed = crc16(~0, es->s_uuid, sizeof(es->s_uuid));
+#endif
 	if (!ext4_check_descriptors(sb, &first_not_zeroed)) {
 		ext4_msg(sb, KERN_ERR, "group descriptors corrupted!");
 		goto failed_mount2;
@@ -3720,6 +4486,20 @@ static int ext4_fill_super(struct super_block *sb, void *data, int silent)
 	if (!err) {
 		err = percpu_counter_init(&sbi->s_dirtyblocks_counter, 0);
 	}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_TRACK
+	if (!err)
+		err = percpu_counter_init(&sbi->s_meta_blocks_counter, 0);
+	if (!err)
+		err = percpu_counter_init(&sbi->s_snapshot_r_blocks_counter,
+				le64_to_cpu(es->s_snapshot_r_blocks_count));
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
+	if (!err) {
+		sbi->s_snapshot_stats = alloc_percpu(struct ext4_snapshot_cow_stats);
+		if (!sbi->s_snapshot_stats)
+			err = -ENOMEM;
+	}
+#endif
 	if (err) {
 		ext4_msg(sb, KERN_ERR, "insufficient memory");
 		goto failed_mount3;
@@ -3727,6 +4507,26 @@ static int ext4_fill_super(struct super_block *sb, void *data, int silent)
 
 	sbi->s_stripe = ext4_get_stripe_size(sbi);
 	sbi->s_max_writeback_mb_bump = 128;
+#ifdef CONFIG_EXT4_FS_STATFS_CACHE
+	spin_lock_init(&sbi->s_statfs_cache.lock);
+	sbi->s_statfs_cache_ms = EXT4_DEF_STATFS_CACHE_MS;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE_ASYNC
+	sbi->s_snapshot_reap_blocks = EXT4_DEF_SNAPSHOT_REAP_BLOCKS;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_PREALLOC
+	sbi->s_snapshot_prealloc_groups = EXT4_DEF_SNAPSHOT_PREALLOC_GROUPS;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_EVICT
+	sbi->s_snapshot_evict_ratio = EXT4_DEF_SNAPSHOT_EVICT_RATIO;
+	sbi->s_snapshot_evict_next = jiffies;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_COW_PACKED
+	sbi->s_snapshot_cow_packed = 1;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_BLOCK_MOVE_QUOTA
+	sbi->s_snapshot_charge_quota = 1;
+#endif
 
 	/*
 	 * set up enough so that it can read an inode
@@ -3747,6 +4547,9 @@ static int ext4_fill_super(struct super_block *sb, void *data, int silent)
 	INIT_LIST_HEAD(&sbi->s_orphan); /* unlinked but open files */
 	mutex_init(&sbi->s_orphan_lock);
 	sbi->s_resize_flags = 0;
+#ifdef CONFIG_EXT4_FS_FSYNC_BATCH
+	atomic_set(&sbi->s_fsync_waiters, 0);
+#endif
 
 	sb->s_root = NULL;
 
@@ -3756,6 +4559,34 @@ static int ext4_fill_super(struct super_block *sb, void *data, int silent)
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_LIST
 	INIT_LIST_HEAD(&sbi->s_snapshot_list); /* snapshot files */
 #endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_RACE_READ_RANGE
+	spin_lock_init(&sbi->s_tracked_reads_lock);
+	INIT_LIST_HEAD(&sbi->s_tracked_reads);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BUDGET
+	spin_lock_init(&sbi->s_snapshot_budget_lock);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BYPASS_CREDITS
+	spin_lock_init(&sbi->s_snapshot_bypass_lock);
+	sbi->s_snapshot_bypass_credits = EXT4_DEF_SNAPSHOT_BYPASS_CREDITS;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_DISCARD
+	spin_lock_init(&sbi->s_snapshot_discard_lock);
+	INIT_LIST_HEAD(&sbi->s_snapshot_discard_list);
+	INIT_WORK(&sbi->s_snapshot_discard_work, ext4_snapshot_discard_work);
+	sbi->s_snapshot_discard_rate = EXT4_DEF_SNAPSHOT_DISCARD_RATE;
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_TAKE_ASYNC
+	spin_lock_init(&sbi->s_snapshot_take_lock);
+	INIT_LIST_HEAD(&sbi->s_snapshot_take_list);
+	INIT_WORK(&sbi->s_snapshot_take_work, ext4_snapshot_take_work);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_SCHED
+	INIT_DELAYED_WORK(&sbi->s_snapshot_sched_work,
+			  ext4_snapshot_sched_work);
+	sbi->s_snapshot_sched_sb = sb;
+	sbi->s_snapshot_sched_idle = EXT4_DEF_SNAPSHOT_SCHED_IDLE;
+#endif
 
 #endif
 	needs_recovery = (es->s_last_orphan != 0 ||
@@ -3808,6 +4639,15 @@ static int ext4_fill_super(struct super_block *sb, void *data, int silent)
 				JBD2_FEATURE_COMPAT_CHECKSUM, 0,
 				JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT);
 	}
+#ifdef CONFIG_EXT4_FS_JOURNAL_CSUM_CRC32C
+	/* the journal was recovered above, so it is safe to switch */
+	if (test_opt2(sb, JOURNAL_CSUM_CRC32C))
+		jbd2_journal_set_features(sbi->s_journal, 0, 0,
+				JBD2_FEATURE_INCOMPAT_CSUM_CRC32C);
+	else
+		jbd2_journal_clear_features(sbi->s_journal, 0, 0,
+				JBD2_FEATURE_INCOMPAT_CSUM_CRC32C);
+#endif
 
 	/* We have now updated the journal if required, so we can
 	 * validate the data journaling mode. */
@@ -3837,6 +4677,34 @@ static int ext4_fill_super(struct super_block *sb, void *data, int silent)
 	}
 	set_task_ioprio(sbi->s_journal->j_task, journal_ioprio);
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_CONVERT
+	/* convert next3 snapshots before the snapshots are loaded */
+	if (test_opt2(sb, SNAPSHOT_CONVERT)) {
+		clear_opt2(sb, SNAPSHOT_CONVERT);
+		if (sb->s_flags & MS_RDONLY) {
+			ext4_msg(sb, KERN_ERR, "snapshot_convert requires "
+				 "read-write mount");
+			goto failed_mount_wq;
+		}
+		if (ext4_snapshot_convert(sb))
+			goto failed_mount_wq;
+	}
+
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_REVERT
+	/* revert to the active snapshot before any inode is read */
+	if (test_opt2(sb, SNAPSHOT_REVERT)) {
+		clear_opt2(sb, SNAPSHOT_REVERT);
+		if (sb->s_flags & MS_RDONLY) {
+			ext4_msg(sb, KERN_ERR, "snapshot_revert requires "
+				 "read-write mount");
+			goto failed_mount_wq;
+		}
+		if (ext4_snapshot_revert(sb))
+			goto failed_mount_wq;
+	}
+
+#endif
 	/*
 	 * The journal may have updated the bg summary counts, so we
 	 * need to update the global counters.
@@ -3848,9 +4716,38 @@ static int ext4_fill_super(struct super_block *sb, void *data, int silent)
 	percpu_counter_set(&sbi->s_dirs_counter,
 			   ext4_count_dirs(sb));
 	percpu_counter_set(&sbi->s_dirtyblocks_counter, 0);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_TRACK
+	percpu_counter_set(&sbi->s_meta_blocks_counter,
+			   ext4_snapshot_meta_blocks_estimate(sb));
+#endif
 
 no_journal:
-#ifdef CONFIG_EXT4_FS_SNAPSHOT
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_WRITEBACK
+	/*
+	 * Snapshot COW runs inside jbd2 handles (COW credits, the
+	 * cowing flag and the COWed-in-transaction cache all live in
+	 * the handle), and no-journal handles skip the snapshot hooks,
+	 * so writing to a snapshot volume without a journal would
+	 * silently corrupt its snapshots.
+	 */
+	if (EXT4_SNAPSHOTS(sb) && !(sb->s_flags & MS_RDONLY) &&
+		!EXT4_SB(sb)->s_journal) {
+		ext4_msg(sb, KERN_ERR,
+				"snapshots require a journal for read-write "
+				"mounts, mount read-only to access snapshots");
+		goto failed_mount_wq;
+	}
+#ifndef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_DATA
+	/* Enforce journal ordered or writeback mode with snapshots */
+	if (EXT4_SNAPSHOTS(sb) && !(sb->s_flags & MS_RDONLY) &&
+		test_opt(sb, DATA_FLAGS) == EXT4_MOUNT_JOURNAL_DATA) {
+		ext4_msg(sb, KERN_ERR,
+				"snapshots require journal ordered or "
+				"writeback mode");
+		goto failed_mount_wq;
+	}
+#endif
+#elif defined(CONFIG_EXT4_FS_SNAPSHOT)
 	/* Enforce journal ordered mode with snapshots */
 	if (EXT4_SNAPSHOTS(sb) && !(sb->s_flags & MS_RDONLY) &&
 		(!EXT4_SB(sb)->s_journal ||
@@ -3871,6 +4768,12 @@ no_journal:
 		printk(KERN_ERR "EXT4-fs: failed to create DIO workqueue\n");
 		goto failed_mount_wq;
 	}
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE_ASYNC
+	/* without a workqueue, large files are deleted on last iput() */
+	if (EXT4_SNAPSHOTS(sb))
+		sbi->s_snapshot_reap_wq =
+			alloc_workqueue("ext4-reap", WQ_UNBOUND, 1);
+#endif
 
 	/*
 	 * The jbd2_journal_load will have done any necessary log recovery,
@@ -3983,6 +4886,9 @@ no_journal:
 		ext4_msg(sb, KERN_INFO, "recovery complete");
 		ext4_mark_recovery_complete(sb, es);
 	}
+#ifdef CONFIG_EXT4_FS_MB_PREFETCH
+	ext4_mb_prefetch_start(sb);
+#endif
 	if (EXT4_SB(sb)->s_journal) {
 		if (test_opt(sb, DATA_FLAGS) == EXT4_MOUNT_JOURNAL_DATA)
 			descr = " journalled data mode";
@@ -4000,6 +4906,15 @@ no_journal:
 	if (es->s_error_count)
 		mod_timer(&sbi->s_err_report, jiffies + 300*HZ); /* 5 minutes */
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC
+	/* resume cleanup of snapshots deleted before umount */
+	if (EXT4_SNAPSHOTS(sb))
+		ext4_snapshot_start_cleanup(sb);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_SCHED
+	if (EXT4_SNAPSHOTS(sb))
+		ext4_snapshot_start_sched(sb);
+#endif
 	kfree(orig_data);
 	return 0;
 
@@ -4012,6 +4927,11 @@ failed_mount4:
 	iput(root);
 	sb->s_root = NULL;
 	ext4_msg(sb, KERN_ERR, "mount failed");
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE_ASYNC
+	if (sbi->s_snapshot_reap_wq)
+		destroy_workqueue(sbi->s_snapshot_reap_wq);
+	sbi->s_snapshot_reap_wq = NULL;
+#endif
 	destroy_workqueue(EXT4_SB(sb)->dio_unwritten_wq);
 failed_mount_wq:
 	ext4_release_system_zone(sb);
@@ -4023,12 +4943,26 @@ failed_mount3:
 	del_timer(&sbi->s_err_report);
 	if (sbi->s_flex_groups)
 		ext4_kvfree(sbi->s_flex_groups);
+#ifdef CONFIG_EXT4_FS_FLEX_COUNTERS_PCPU
+	free_percpu(sbi->s_flex_deltas);
+#endif
 	percpu_counter_destroy(&sbi->s_freeblocks_counter);
 	percpu_counter_destroy(&sbi->s_freeinodes_counter);
 	percpu_counter_destroy(&sbi->s_dirs_counter);
 	percpu_counter_destroy(&sbi->s_dirtyblocks_counter);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_TRACK
+	percpu_counter_destroy(&sbi->s_meta_blocks_counter);
+	percpu_counter_destroy(&sbi->s_snapshot_r_blocks_counter);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_STATS
+	free_percpu(sbi->s_snapshot_stats);
+#endif
+#ifdef CONFIG_EXT4_FS_MMP_SHARED
+	ext4_stop_mmp(sb);
+#else
 	if (sbi->s_mmp_tsk)
 		kthread_stop(sbi->s_mmp_tsk);
+#endif
 failed_mount2:
 	for (i = 0; i < db_count; i++)
 		brelse(sbi->s_group_desc[i]);
@@ -4064,6 +4998,10 @@ static void ext4_init_journal_params(struct super_block *sb, journal_t *journal)
 	journal->j_commit_interval = sbi->s_commit_interval;
 	journal->j_min_batch_time = sbi->s_min_batch_time;
 	journal->j_max_batch_time = sbi->s_max_batch_time;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BUDGET
+	if (EXT4_SNAPSHOTS(sb))
+		ext4_snapshot_budget_init(sb, journal);
+#endif
 
 	write_lock(&journal->j_state_lock);
 	if (test_opt(sb, BARRIER))
@@ -4124,11 +5062,19 @@ static journal_t *ext4_get_journal(struct super_block *sb,
 	if (EXT4_SNAPSHOTS(sb) &&
 			(journal_inode->i_size >> EXT4_BLOCK_SIZE_BITS(sb)) <
 			EXT4_BIG_JOURNAL_BLOCKS) {
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_BUDGET
+		ext4_msg(sb, KERN_WARNING, "journal is not big enough "
+			"(%lld < %u) for snapshots - COW bursts may stall "
+			"on log space, see snapshot_journal in sysfs",
+			journal_inode->i_size >> EXT4_BLOCK_SIZE_BITS(sb),
+			EXT4_BIG_JOURNAL_BLOCKS);
+#else
 		snapshot_debug(1, "warning: journal is not big enough "
 			"(%lld < %u) - this might affect concurrent "
 			"filesystem writers performance!\n",
 			journal_inode->i_size >> EXT4_BLOCK_SIZE_BITS(sb),
 			EXT4_BIG_JOURNAL_BLOCKS);
+#endif
 	}
 
 #endif
@@ -4377,6 +5323,13 @@ static int ext4_commit_super(struct super_block *sb, int sync)
 	es->s_free_inodes_count =
 		cpu_to_le32(percpu_counter_sum_positive(
 				&EXT4_SB(sb)->s_freeinodes_counter));
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_TRACK
+	if (ext4_snapshot_active(EXT4_SB(sb)))
+		/* store the reserve that was not consumed yet */
+		es->s_snapshot_r_blocks_count =
+			cpu_to_le64(percpu_counter_sum_positive(
+				&EXT4_SB(sb)->s_snapshot_r_blocks_counter));
+#endif
 	sb->s_dirt = 0;
 	BUFFER_TRACE(sbh, "marking dirty");
 	mark_buffer_dirty(sbh);
@@ -4677,6 +5630,14 @@ static int ext4_remount(struct super_block *sb, int *flags, char *data)
 			 * to disable replay of the journal when we next remount
 			 */
 			sb->s_flags |= MS_RDONLY;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_DELETE_ASYNC
+			/*
+			 * Pending deferred deletes stop on MS_RDONLY and are
+			 * completed by orphan cleanup on next read-write mount.
+			 */
+			if (sbi->s_snapshot_reap_wq)
+				flush_workqueue(sbi->s_snapshot_reap_wq);
+#endif
 
 			/*
 			 * OK, test if we are remounting a valid rw partition
@@ -4763,6 +5724,11 @@ static int ext4_remount(struct super_block *sb, int *flags, char *data)
 		ext4_register_li_request(sb, first_not_zeroed);
 	}
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CLEANUP_ASYNC
+	/* resume cleanup of deleted snapshots on read-write remount */
+	if (EXT4_SNAPSHOTS(sb) && !(sb->s_flags & MS_RDONLY))
+		ext4_snapshot_wake_cleanup(sb);
+#endif
 	ext4_setup_system_zone(sb);
 	if (sbi->s_journal == NULL)
 		ext4_commit_super(sb, 1);
@@ -4805,6 +5771,49 @@ restore_opts:
 	return err;
 }
 
+#ifdef CONFIG_EXT4_FS_STATFS_CACHE
+/*
+ * Return the counter sums reported by statfs. They are summed again when
+ * they are older than s_statfs_cache_ms, or when the approximate count
+ * of free blocks shows that they moved by more than 1/1024 of the file
+ * system since they were summed.
+ */
+static void ext4_statfs_counters(struct ext4_sb_info *sbi,
+				 struct ext4_statfs_cache *sc)
+{
+	struct ext4_statfs_cache *c = &sbi->s_statfs_cache;
+	s64 delta, thresh;
+
+	thresh = max_t(s64, ext4_blocks_count(sbi->s_es) >> 10,
+		       2 * percpu_counter_batch * num_online_cpus());
+
+	spin_lock(&c->lock);
+	delta = percpu_counter_read(&sbi->s_freeblocks_counter) -
+		c->freeblocks;
+	if (!c->valid || abs64(delta) > thresh ||
+	    time_after(jiffies, c->stamp +
+		       msecs_to_jiffies(sbi->s_statfs_cache_ms))) {
+		c->freeblocks = percpu_counter_sum_positive(
+				&sbi->s_freeblocks_counter);
+		c->dirtyblocks = percpu_counter_sum_positive(
+				&sbi->s_dirtyblocks_counter);
+		c->freeinodes = percpu_counter_sum_positive(
+				&sbi->s_freeinodes_counter);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE
+		c->dirs = percpu_counter_sum_positive(&sbi->s_dirs_counter);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_TRACK
+		c->snapshot_r_blocks = percpu_counter_sum_positive(
+				&sbi->s_snapshot_r_blocks_counter);
+#endif
+		c->stamp = jiffies;
+		c->valid = 1;
+	}
+	*sc = *c;
+	spin_unlock(&c->lock);
+}
+
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE
 static int ext4_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
@@ -4822,6 +5831,11 @@ static int ext4_statfs(struct dentry *dentry, struct kstatfs *buf)
 	struct ext4_super_block *es = sbi->s_es;
 	u64 fsid;
 	s64 bfree;
+#ifdef CONFIG_EXT4_FS_STATFS_CACHE
+	struct ext4_statfs_cache sc;
+
+	ext4_statfs_counters(sbi, &sc);
+#endif
 
 	if (test_opt(sb, MINIX_DF)) {
 		sbi->s_overhead_last = 0;
@@ -4865,14 +5879,32 @@ static int ext4_statfs(struct dentry *dentry, struct kstatfs *buf)
 	buf->f_type = EXT4_SUPER_MAGIC;
 	buf->f_bsize = sb->s_blocksize;
 	buf->f_blocks = ext4_blocks_count(es) - sbi->s_overhead_last;
+#ifdef CONFIG_EXT4_FS_STATFS_CACHE
+	bfree = sc.freeblocks - sc.dirtyblocks;
+#else
 	bfree = percpu_counter_sum_positive(&sbi->s_freeblocks_counter) -
 		       percpu_counter_sum_positive(&sbi->s_dirtyblocks_counter);
+#endif
 	/* prevent underflow in case that few free space is available */
 	buf->f_bfree = max_t(s64, bfree, 0);
 	buf->f_bavail = buf->f_bfree - ext4_r_blocks_count(es);
 	if (buf->f_bfree < ext4_r_blocks_count(es))
 		buf->f_bavail = 0;
-#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE_TRACK
+	if (ext4_snapshot_active(sbi)) {
+#ifdef CONFIG_EXT4_FS_STATFS_CACHE
+		s64 snapshot_r_blocks = sc.snapshot_r_blocks;
+#else
+		s64 snapshot_r_blocks = percpu_counter_sum_positive(
+				&sbi->s_snapshot_r_blocks_counter);
+#endif
+
+		if (buf->f_bfree < ext4_r_blocks_count(es) + snapshot_r_blocks)
+			buf->f_bavail = 0;
+		else
+			buf->f_bavail -= snapshot_r_blocks;
+	}
+#elif defined(CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE)
 	if (ext4_snapshot_active(sbi)) {
 		if (buf->f_bfree < ext4_r_blocks_count(es) +
 				le64_to_cpu(es->s_snapshot_r_blocks_count))
@@ -4881,11 +5913,21 @@ static int ext4_statfs(struct dentry *dentry, struct kstatfs *buf)
 			buf->f_bavail -=
 				le64_to_cpu(es->s_snapshot_r_blocks_count);
 	}
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_CTL_RESERVE
+#ifdef CONFIG_EXT4_FS_STATFS_CACHE
+	buf->f_spare[0] = sc.dirs;
+#else
 	buf->f_spare[0] = percpu_counter_sum_positive(&sbi->s_dirs_counter);
+#endif
 	buf->f_spare[1] = sbi->s_overhead_last;
 #endif
 	buf->f_files = le32_to_cpu(es->s_inodes_count);
+#ifdef CONFIG_EXT4_FS_STATFS_CACHE
+	buf->f_ffree = sc.freeinodes;
+#else
 	buf->f_ffree = percpu_counter_sum_positive(&sbi->s_freeinodes_counter);
+#endif
 	buf->f_namelen = EXT4_NAME_LEN;
 	fsid = le64_to_cpup((void *)es->s_uuid) ^
 	       le64_to_cpup((void *)es->s_uuid + sizeof(u64));
@@ -5178,6 +6220,34 @@ static struct dentry *ext4_mount(struct file_system_type *fs_type, int flags,
 	return mount_bdev(fs_type, flags, dev_name, data, ext4_fill_super);
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_FILE_AUTOMOUNT
+/*
+ * Snapshots under .snapshot are mounted by the kernel on the snapshot block
+ * device, which need not have a device node, so look the device up by its
+ * disk name.  The snapshot image is mounted read-only without its journal.
+ */
+static struct dentry *ext4_snapshot_mount(struct file_system_type *fs_type,
+		int flags, const char *dev_name, void *data)
+{
+	char options[] = "noload";
+	dev_t dev = blk_lookup_devt(dev_name, 0);
+
+	if (!dev)
+		return ERR_PTR(-ENODEV);
+	return mount_bdev_dev(fs_type, flags | MS_RDONLY, dev, options,
+			      ext4_fill_super);
+}
+
+/* not registered - only used to automount snapshots */
+struct file_system_type ext4_snapshot_fs_type = {
+	.owner		= THIS_MODULE,
+	.name		= "ext4",
+	.mount		= ext4_snapshot_mount,
+	.kill_sb	= kill_block_super,
+	.fs_flags	= FS_REQUIRES_DEV,
+};
+#endif
+
 #if !defined(CONFIG_EXT2_FS) && !defined(CONFIG_EXT2_FS_MODULE) && defined(CONFIG_EXT4_USE_FOR_EXT23)
 static inline void register_as_ext2(void)
 {
@@ -5368,6 +6438,9 @@ static void __exit ext4_exit_fs(void)
 	exit_ext4_snapshot();
 #endif
 	ext4_destroy_lazyinit_thread();
+#ifdef CONFIG_EXT4_FS_MMP_SHARED
+	ext4_exit_mmp();
+#endif
 	unregister_as_ext2();
 	unregister_as_ext3();
 	unregister_filesystem(&ext4_fs_type);
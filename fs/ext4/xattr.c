@@ -462,6 +462,21 @@ static void ext4_xattr_update_super_block(handle_t *handle,
 	}
 }
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_XATTR
+/*
+ * Test if the xattr block BH is in use by snapshot and was not COWed yet,
+ * so modifying it would copy it to snapshot.
+ */
+static int
+ext4_xattr_snapshot_cow(handle_t *handle, struct inode *inode,
+			struct buffer_head *bh)
+{
+	if (!ext4_handle_valid(handle) || !EXT4_SNAPSHOTS(inode->i_sb))
+		return 0;
+	return ext4_snapshot_cow(handle, NULL, bh->b_blocknr, bh, 0);
+}
+
+#endif
 /*
  * Release the xattr block BH: If the reference count is > 1, decrement
  * it; otherwise free the block.
@@ -474,6 +489,15 @@ ext4_xattr_release_block(handle_t *handle, struct inode *inode,
 	int error = 0;
 
 	ce = mb_cache_entry_get(ext4_xattr_cache, bh->b_bdev, bh->b_blocknr);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_XATTR
+	/*
+	 * No new reference to the block can be taken while we hold its cache
+	 * entry (or if it is not cached). Freeing the last reference does not
+	 * modify the block, so don't get write access, which would copy the
+	 * block to snapshot before ext4_free_blocks() moves it there.
+	 */
+	if (BHDR(bh)->h_refcount != cpu_to_le32(1))
+#endif
 	error = ext4_journal_get_write_access(handle, bh);
 	if (error)
 		goto out;
@@ -695,6 +719,9 @@ ext4_xattr_block_set(handle_t *handle, struct inode *inode,
 	struct ext4_xattr_search *s = &bs->s;
 	struct mb_cache_entry *ce = NULL;
 	int error = 0;
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_XATTR
+	int clone = 0;
+#endif
 
 #define header(x) ((struct ext4_xattr_header *)(x))
 
@@ -703,12 +730,30 @@ ext4_xattr_block_set(handle_t *handle, struct inode *inode,
 	if (s->base) {
 		ce = mb_cache_entry_get(ext4_xattr_cache, bs->bh->b_bdev,
 					bs->bh->b_blocknr);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_XATTR
+		/*
+		 * Modifying a block in use by snapshot would copy it to
+		 * snapshot. Clone it instead (or share an identical block from
+		 * the cache), so the old block is moved to snapshot without a
+		 * copy when its last reference is released.
+		 */
+		clone = ext4_xattr_snapshot_cow(handle, inode, bs->bh);
+		if (clone < 0) {
+			error = clone;
+			goto cleanup;
+		}
+		if (!clone)
+#endif
 		error = ext4_journal_get_write_access(handle, bs->bh);
 		if (error)
 			goto cleanup;
 		lock_buffer(bs->bh);
 
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_XATTR
+		if (header(s->base)->h_refcount == cpu_to_le32(1) && !clone) {
+#else
 		if (header(s->base)->h_refcount == cpu_to_le32(1)) {
+#endif
 			if (ce) {
 				mb_cache_entry_free(ce);
 				ce = NULL;
@@ -735,12 +780,20 @@ ext4_xattr_block_set(handle_t *handle, struct inode *inode,
 			int offset = (char *)s->here - bs->bh->b_data;
 
 			unlock_buffer(bs->bh);
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_XATTR
+			/* no write access was taken on a block to clone */
+			if (clone)
+				goto clone_block;
+#endif
 #ifdef CONFIG_EXT4_FS_SNAPSHOT_JOURNAL_RELEASE
 			error = ext4_handle_release_buffer(handle, bs->bh);
 			if (error)
 				goto cleanup;
 #else
 			ext4_handle_release_buffer(handle, bs->bh);
+#endif
+#ifdef CONFIG_EXT4_FS_SNAPSHOT_HOOKS_XATTR
+clone_block:
 #endif
 			if (ce) {
 				mb_cache_entry_release(ce);
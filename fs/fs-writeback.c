@@ -291,6 +291,23 @@ out:
 	return moved;
 }
 
+/*
+ * Move the S_WB_PRIO inodes of @queue to its tail, so they are written
+ * back before all other inodes that were queued for io.  The file system
+ * sets S_WB_PRIO on inodes whose writeback holds up a journal commit.
+ */
+static void move_prio_inodes(struct list_head *queue)
+{
+	LIST_HEAD(tmp);
+	struct list_head *pos, *node;
+
+	list_for_each_safe(pos, node, queue) {
+		if (IS_WB_PRIO(wb_inode(pos)))
+			list_move_tail(pos, &tmp);
+	}
+	list_splice_tail(&tmp, queue);
+}
+
 /*
  * Queue all expired dirty inodes for io, eldest first.
  * Before
@@ -308,6 +325,7 @@ static void queue_io(struct bdi_writeback *wb, unsigned long *older_than_this)
 	assert_spin_locked(&wb->list_lock);
 	list_splice_init(&wb->b_more_io, &wb->b_io);
 	moved = move_expired_inodes(&wb->b_dirty, &wb->b_io, older_than_this);
+	move_prio_inodes(&wb->b_io);
 	trace_writeback_queue_io(wb, older_than_this, moved);
 }
 
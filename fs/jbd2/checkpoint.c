@@ -113,6 +113,47 @@ static int __try_to_free_cp_buf(struct journal_head *jh)
 	return ret;
 }
 
+/*
+ * __jbd2_log_start_checkpoint: kick background checkpointing if the log
+ * is filling up, so that __jbd2_log_wait_for_space() rarely has to
+ * checkpoint synchronously.
+ *
+ * Called under j_state_lock.
+ */
+void __jbd2_log_start_checkpoint(journal_t *journal)
+{
+	if (__jbd2_log_space_left(journal) < jbd2_checkpoint_watermark(journal))
+		queue_work(system_long_wq, &journal->j_checkpoint_work);
+}
+
+/*
+ * jbd2_checkpoint_work: checkpoint the oldest transactions until free log
+ * space is back above the watermark.  The buffers of each transaction
+ * are submitted in plugged batches by jbd2_log_do_checkpoint().
+ */
+void jbd2_checkpoint_work(struct work_struct *work)
+{
+	journal_t *journal = container_of(work, journal_t, j_checkpoint_work);
+	int need;
+
+	while (!is_journal_aborted(journal)) {
+		mutex_lock(&journal->j_checkpoint_mutex);
+		read_lock(&journal->j_state_lock);
+		spin_lock(&journal->j_list_lock);
+		need = journal->j_checkpoint_transactions != NULL &&
+			__jbd2_log_space_left(journal) <
+				jbd2_checkpoint_watermark(journal);
+		spin_unlock(&journal->j_list_lock);
+		read_unlock(&journal->j_state_lock);
+		if (need && jbd2_log_do_checkpoint(journal) < 0)
+			need = 0;
+		mutex_unlock(&journal->j_checkpoint_mutex);
+		if (!need)
+			break;
+		cond_resched();
+	}
+}
+
 /*
  * __jbd2_log_wait_for_space: wait until there is space in the journal.
  *
@@ -722,7 +763,7 @@ int __jbd2_journal_remove_checkpoint(struct journal_head *jh)
 				    transaction->t_tid, stats);
 
 	__jbd2_journal_drop_transaction(journal, transaction);
-	kfree(transaction);
+	kfree_rcu(transaction, t_rcu);
 
 	/* Just in case anybody was waiting for more transactions to be
            checkpointed... */
@@ -27,6 +27,7 @@
 #include <linux/bio.h>
 #include <linux/blkdev.h>
 #include <linux/bitops.h>
+#include <linux/completion.h>
 #include <trace/events/jbd2.h>
 #include <asm/system.h>
 
@@ -43,6 +44,100 @@ static void journal_end_buffer_io_sync(struct buffer_head *bh, int uptodate)
 	unlock_buffer(bh);
 }
 
+/*
+ * Log buffers written by one bio, completed with their own b_end_io.
+ */
+struct jbd2_log_bio {
+	int			lb_nr;
+	struct buffer_head	*lb_bhs[0];
+};
+
+static void journal_end_log_bio(struct bio *bio, int err)
+{
+	struct jbd2_log_bio *lb = bio->bi_private;
+	int uptodate = test_bit(BIO_UPTODATE, &bio->bi_flags);
+	int i;
+
+	for (i = 0; i < lb->lb_nr; i++)
+		lb->lb_bhs[i]->b_end_io(lb->lb_bhs[i], uptodate);
+	kfree(lb);
+	bio_put(bio);
+}
+
+/*
+ * Write the first @nr locked log buffers of @bhs, which map consecutive
+ * blocks, with a single bio.  Returns the number of buffers submitted,
+ * which is less than @nr if the queue limits do not allow a bigger bio.
+ * Falls back to submit_bh() if there is no memory for the bio.
+ */
+static int journal_submit_log_run(struct buffer_head **bhs, int nr)
+{
+	struct jbd2_log_bio *lb;
+	struct buffer_head *bh = bhs[0];
+	struct bio *bio;
+	int i;
+
+	if (nr == 1)
+		goto single;
+	lb = kmalloc(sizeof(*lb) + nr * sizeof(lb->lb_bhs[0]), GFP_NOFS);
+	if (!lb)
+		goto single;
+
+	bio = bio_alloc(GFP_NOFS, nr);
+	bio->bi_sector = bh->b_blocknr * (bh->b_size >> 9);
+	bio->bi_bdev = bh->b_bdev;
+	bio->bi_end_io = journal_end_log_bio;
+	bio->bi_private = lb;
+	for (i = 0; i < nr; i++) {
+		bh = bhs[i];
+		if (bio_add_page(bio, bh->b_page, bh->b_size,
+				 bh_offset(bh)) != bh->b_size)
+			break;
+		/* Only clear out a write error when rewriting */
+		if (test_set_buffer_req(bh))
+			clear_buffer_write_io_error(bh);
+		lb->lb_bhs[i] = bh;
+	}
+	if (!i) {
+		bio_put(bio);
+		kfree(lb);
+		goto single;
+	}
+	lb->lb_nr = i;
+	submit_bio(WRITE_SYNC, bio);
+	return i;
+
+single:
+	submit_bh(WRITE_SYNC, bhs[0]);
+	return 1;
+}
+
+/*
+ * Write the locked log buffers @wbuf[0..@bufs).  jbd2_journal_next_log_block()
+ * hands out mostly consecutive log blocks, so pack every run of
+ * consecutive blocks into one multi-page bio instead of relying on the
+ * block layer to merge one request per buffer, which does not help on
+ * devices with high per-request overhead.
+ */
+static void journal_submit_log_bufs(struct buffer_head **wbuf, int bufs)
+{
+	struct buffer_head *bh;
+	int i = 0, n;
+
+	while (i < bufs) {
+		bh = wbuf[i];
+		for (n = 1; i + n < bufs && n < BIO_MAX_PAGES; n++) {
+			struct buffer_head *next = wbuf[i + n];
+
+			if (next->b_bdev != bh->b_bdev ||
+			    next->b_size != bh->b_size ||
+			    next->b_blocknr != bh->b_blocknr + n)
+				break;
+		}
+		i += journal_submit_log_run(wbuf + i, n);
+	}
+}
+
 /*
  * When an ext4 file is truncated, it is possible that some pages are not
  * successfully freed, because they are attached to a committing transaction.
@@ -125,7 +220,7 @@ static int journal_submit_commit_record(journal_t *journal,
 
 	if (JBD2_HAS_COMPAT_FEATURE(journal,
 				    JBD2_FEATURE_COMPAT_CHECKSUM)) {
-		tmp->h_chksum_type 	= JBD2_CRC32_CHKSUM;
+		tmp->h_chksum_type 	= jbd2_chksum_type(journal);
 		tmp->h_chksum_size 	= JBD2_CRC32_CHKSUM_SIZE;
 		tmp->h_chksum[0] 	= cpu_to_be32(crc32_sum);
 	}
@@ -140,6 +235,9 @@ static int journal_submit_commit_record(journal_t *journal,
 	    !JBD2_HAS_INCOMPAT_FEATURE(journal,
 				       JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT))
 		ret = submit_bh(WRITE_SYNC | WRITE_FLUSH_FUA, bh);
+	else if (journal->j_flags & JBD2_BARRIER)
+		/* see journal_submit_flush() */
+		ret = submit_bh(WRITE_SYNC | WRITE_FUA, bh);
 	else
 		ret = submit_bh(WRITE_SYNC, bh);
 
@@ -167,20 +265,56 @@ static int journal_wait_on_commit_record(journal_t *journal,
 	return ret;
 }
 
+static void journal_end_flush_bio(struct bio *bio, int err)
+{
+	if (err)
+		clear_bit(BIO_UPTODATE, &bio->bi_flags);
+	complete(bio->bi_private);
+	bio_put(bio);
+}
+
+/*
+ * With async commit, the commit record is checksummed and is written
+ * with FUA together with the log blocks, so only the log blocks need the
+ * cache flush and it does not have to wait for the commit record.  Issue
+ * the flush as soon as the log blocks are written, so that its latency
+ * overlaps the commit record write instead of being added to it.
+ * Returns NULL if the device cannot take a flush.
+ */
+static struct bio *journal_submit_flush(journal_t *journal,
+					struct completion *wait)
+{
+	struct request_queue *q = bdev_get_queue(journal->j_dev);
+	struct bio *bio;
+
+	if (!journal->j_dev->bd_disk || !q || !q->make_request_fn)
+		return NULL;
+
+	bio = bio_alloc(GFP_NOFS, 0);
+	bio->bi_end_io = journal_end_flush_bio;
+	bio->bi_bdev = journal->j_dev;
+	bio->bi_private = wait;
+	bio_get(bio);
+	submit_bio(WRITE_FLUSH, bio);
+	return bio;
+}
+
 /*
  * write the filemap data using writepage() address_space_operations.
  * We don't do block allocation here even for delalloc. We don't
  * use writepages() because with dealyed allocation we may be doing
  * block allocation in writepages().
  */
-static int journal_submit_inode_data_buffers(struct address_space *mapping)
+static int journal_submit_inode_data_buffers(struct address_space *mapping,
+					     loff_t dirty_start,
+					     loff_t dirty_end)
 {
 	int ret;
 	struct writeback_control wbc = {
 		.sync_mode =  WB_SYNC_ALL,
 		.nr_to_write = mapping->nrpages * 2,
-		.range_start = 0,
-		.range_end = i_size_read(mapping->host),
+		.range_start = dirty_start,
+		.range_end = min(dirty_end, i_size_read(mapping->host)),
 	};
 
 	ret = generic_writepages(mapping, &wbc);
@@ -201,10 +335,13 @@ static int journal_submit_data_buffers(journal_t *journal,
 	struct jbd2_inode *jinode;
 	int err, ret = 0;
 	struct address_space *mapping;
+	loff_t dirty_start, dirty_end;
 
 	spin_lock(&journal->j_list_lock);
 	list_for_each_entry(jinode, &commit_transaction->t_inode_list, i_list) {
 		mapping = jinode->i_vfs_inode->i_mapping;
+		dirty_start = jinode->i_dirty_start;
+		dirty_end = jinode->i_dirty_end;
 		set_bit(__JI_COMMIT_RUNNING, &jinode->i_flags);
 		spin_unlock(&journal->j_list_lock);
 		/*
@@ -214,7 +351,8 @@ static int journal_submit_data_buffers(journal_t *journal,
 		 * only allocated blocks here.
 		 */
 		trace_jbd2_submit_inode_data(jinode->i_vfs_inode);
-		err = journal_submit_inode_data_buffers(mapping);
+		err = journal_submit_inode_data_buffers(mapping, dirty_start,
+							dirty_end);
 		if (!ret)
 			ret = err;
 		spin_lock(&journal->j_list_lock);
@@ -237,13 +375,17 @@ static int journal_finish_inode_data_buffers(journal_t *journal,
 {
 	struct jbd2_inode *jinode, *next_i;
 	int err, ret = 0;
+	loff_t dirty_start, dirty_end;
 
 	/* For locking, see the comment in journal_submit_data_buffers() */
 	spin_lock(&journal->j_list_lock);
 	list_for_each_entry(jinode, &commit_transaction->t_inode_list, i_list) {
+		dirty_start = jinode->i_dirty_start;
+		dirty_end = jinode->i_dirty_end;
 		set_bit(__JI_COMMIT_RUNNING, &jinode->i_flags);
 		spin_unlock(&journal->j_list_lock);
-		err = filemap_fdatawait(jinode->i_vfs_inode->i_mapping);
+		err = filemap_fdatawait_range(jinode->i_vfs_inode->i_mapping,
+					      dirty_start, dirty_end);
 		if (err) {
 			/*
 			 * Because AS_EIO is cleared by
@@ -273,6 +415,8 @@ static int journal_finish_inode_data_buffers(journal_t *journal,
 				&jinode->i_transaction->t_inode_list);
 		} else {
 			jinode->i_transaction = NULL;
+			jinode->i_dirty_start = 0;
+			jinode->i_dirty_end = 0;
 		}
 	}
 	spin_unlock(&journal->j_list_lock);
@@ -280,14 +424,15 @@ static int journal_finish_inode_data_buffers(journal_t *journal,
 	return ret;
 }
 
-static __u32 jbd2_checksum_data(__u32 crc32_sum, struct buffer_head *bh)
+static __u32 jbd2_checksum_data(journal_t *journal, __u32 crc32_sum,
+				struct buffer_head *bh)
 {
 	struct page *page = bh->b_page;
 	char *addr;
 	__u32 checksum;
 
 	addr = kmap_atomic(page, KM_USER0);
-	checksum = crc32_be(crc32_sum,
+	checksum = jbd2_chksum(journal, crc32_sum,
 		(void *)(addr + offset_in_page(bh->b_data)), bh->b_size);
 	kunmap_atomic(addr, KM_USER0);
 
@@ -302,6 +447,26 @@ static void write_tag_block(int tag_bytes, journal_block_tag_t *tag,
 		tag->t_blocknr_high = cpu_to_be32((block >> 31) >> 1);
 }
 
+/*
+ * Account one committed transaction in the journal's histograms.
+ * Called under j_history_lock.
+ */
+static void jbd2_hist_add_run_stats(struct jbd2_stats_hist_s *hist,
+				    struct transaction_run_stats_s *run,
+				    u64 commit_time)
+{
+	hist->h_running[jbd2_hist_bucket(
+			jiffies_to_msecs(run->rs_running))]++;
+	hist->h_locked[jbd2_hist_bucket(jiffies_to_msecs(run->rs_locked))]++;
+	hist->h_flushing[jbd2_hist_bucket(
+			jiffies_to_msecs(run->rs_flushing))]++;
+	hist->h_logging[jbd2_hist_bucket(
+			jiffies_to_msecs(run->rs_logging))]++;
+	hist->h_commit[jbd2_hist_bucket(div_u64(commit_time, 1000))]++;
+	hist->h_handles[jbd2_hist_bucket(run->rs_handle_count)]++;
+	hist->h_blocks[jbd2_hist_bucket(run->rs_blocks)]++;
+}
+
 /*
  * jbd2_journal_commit_transaction
  *
@@ -329,6 +494,8 @@ void jbd2_journal_commit_transaction(journal_t *journal)
 	int i, to_free = 0;
 	int tag_bytes = journal_tag_bytes(journal);
 	struct buffer_head *cbh = NULL; /* For transactional checksums */
+	struct bio *flush_bio = NULL;	/* For async commit */
+	DECLARE_COMPLETION_ONSTACK(flush_wait);
 	__u32 crc32_sum = ~0;
 	struct blk_plug plug;
 
@@ -357,6 +524,11 @@ void jbd2_journal_commit_transaction(journal_t *journal)
 
 	write_lock(&journal->j_state_lock);
 	commit_transaction->t_state = T_LOCKED;
+	/*
+	 * Pairs with smp_mb() in start_this_handle_fast(): either the
+	 * handle sees T_LOCKED, or we see its t_updates increment.
+	 */
+	smp_mb();
 
 	trace_jbd2_commit_locking(journal, commit_transaction);
 	stats.run.rs_wait = commit_transaction->t_max_wait;
@@ -411,7 +583,8 @@ void jbd2_journal_commit_transaction(journal_t *journal)
 			struct buffer_head *bh = jh2bh(jh);
 
 			jbd_lock_bh_state(bh);
-			jbd2_free(jh->b_committed_data, bh->b_size);
+			jbd2_journal_free_frozen(journal, jh->b_committed_data,
+						 bh->b_size);
 			jh->b_committed_data = NULL;
 			jbd_unlock_bh_state(bh);
 		}
@@ -458,8 +631,9 @@ void jbd2_journal_commit_transaction(journal_t *journal)
 		jbd2_journal_abort(journal, err);
 
 	blk_start_plug(&plug);
-	jbd2_journal_write_revoke_records(journal, commit_transaction,
-					  WRITE_SYNC);
+	stats.run.rs_revokes =
+		jbd2_journal_write_revoke_records(journal, commit_transaction,
+						  WRITE_SYNC);
 	blk_finish_plug(&plug);
 
 	jbd_debug(3, "JBD: commit phase 2\n");
@@ -641,16 +815,16 @@ start_journal_io:
 				 */
 				if (JBD2_HAS_COMPAT_FEATURE(journal,
 					JBD2_FEATURE_COMPAT_CHECKSUM)) {
-					crc32_sum =
-					    jbd2_checksum_data(crc32_sum, bh);
+					crc32_sum = jbd2_checksum_data(journal,
+							crc32_sum, bh);
 				}
 
 				lock_buffer(bh);
 				clear_buffer_dirty(bh);
 				set_buffer_uptodate(bh);
 				bh->b_end_io = journal_end_buffer_io_sync;
-				submit_bh(WRITE_SYNC, bh);
 			}
+			journal_submit_log_bufs(wbuf, bufs);
 			cond_resched();
 			stats.run.rs_blocks_logged += bufs;
 
@@ -798,6 +972,12 @@ wait_for_iobuf:
 		/* AKPM: bforget here */
 	}
 
+	/* All log blocks are written: start flushing them */
+	if (JBD2_HAS_INCOMPAT_FEATURE(journal,
+				      JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT) &&
+	    journal->j_flags & JBD2_BARRIER)
+		flush_bio = journal_submit_flush(journal, &flush_wait);
+
 	if (err)
 		jbd2_journal_abort(journal, err);
 
@@ -816,10 +996,9 @@ wait_for_iobuf:
 	}
 	if (cbh)
 		err = journal_wait_on_commit_record(journal, cbh);
-	if (JBD2_HAS_INCOMPAT_FEATURE(journal,
-				      JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT) &&
-	    journal->j_flags & JBD2_BARRIER) {
-		blkdev_issue_flush(journal->j_dev, GFP_KERNEL, NULL);
+	if (flush_bio) {
+		wait_for_completion(&flush_wait);
+		bio_put(flush_bio);
 	}
 
 	if (err)
@@ -875,7 +1054,8 @@ restart_loop:
 		 * its triggers if they exist, so we can clear that too.
 		 */
 		if (jh->b_committed_data) {
-			jbd2_free(jh->b_committed_data, bh->b_size);
+			jbd2_journal_free_frozen(journal, jh->b_committed_data,
+						 bh->b_size);
 			jh->b_committed_data = NULL;
 			if (jh->b_frozen_data) {
 				jh->b_committed_data = jh->b_frozen_data;
@@ -883,7 +1063,8 @@ restart_loop:
 				jh->b_frozen_triggers = NULL;
 			}
 		} else if (jh->b_frozen_data) {
-			jbd2_free(jh->b_frozen_data, bh->b_size);
+			jbd2_journal_free_frozen(journal, jh->b_frozen_data,
+						 bh->b_size);
 			jh->b_frozen_data = NULL;
 			jh->b_frozen_triggers = NULL;
 		}
@@ -981,10 +1162,13 @@ restart_loop:
 	trace_jbd2_run_stats(journal->j_fs_dev->bd_dev,
 			     commit_transaction->t_tid, &stats.run);
 
+	commit_time = ktime_to_ns(ktime_sub(ktime_get(), start_time));
+
 	/*
 	 * Calculate overall stats
 	 */
 	spin_lock(&journal->j_history_lock);
+	jbd2_hist_add_run_stats(&journal->j_hist, &stats.run, commit_time);
 	journal->j_stats.ts_tid++;
 	journal->j_stats.run.rs_wait += stats.run.rs_wait;
 	journal->j_stats.run.rs_running += stats.run.rs_running;
@@ -994,13 +1178,13 @@ restart_loop:
 	journal->j_stats.run.rs_handle_count += stats.run.rs_handle_count;
 	journal->j_stats.run.rs_blocks += stats.run.rs_blocks;
 	journal->j_stats.run.rs_blocks_logged += stats.run.rs_blocks_logged;
+	journal->j_stats.run.rs_revokes += stats.run.rs_revokes;
 	spin_unlock(&journal->j_history_lock);
 
 	commit_transaction->t_state = T_FINISHED;
 	J_ASSERT(commit_transaction == journal->j_committing_transaction);
 	journal->j_commit_sequence = commit_transaction->t_tid;
 	journal->j_committing_transaction = NULL;
-	commit_time = ktime_to_ns(ktime_sub(ktime_get(), start_time));
 
 	/*
 	 * weight the commit time higher than the average time so we don't
@@ -1035,14 +1219,21 @@ restart_loop:
 	}
 	spin_unlock(&journal->j_list_lock);
 
+	read_lock(&journal->j_state_lock);
+	__jbd2_log_start_checkpoint(journal);
+	read_unlock(&journal->j_state_lock);
+
 	if (journal->j_commit_callback)
 		journal->j_commit_callback(journal, commit_transaction);
 
+	/* prepare frozen data buffers for the next transaction */
+	jbd2_journal_refill_frozen(journal);
+
 	trace_jbd2_end_commit(journal, commit_transaction);
 	jbd_debug(1, "JBD: commit %d complete, head %d\n",
 		  journal->j_commit_sequence, journal->j_tail_sequence);
 	if (to_free)
-		kfree(commit_transaction);
+		kfree_rcu(commit_transaction, t_rcu);
 
 	wake_up(&journal->j_wait_done_commit);
 }
@@ -42,8 +42,10 @@
 #include <linux/log2.h>
 #include <linux/vmalloc.h>
 #include <linux/backing-dev.h>
+#include <linux/blkdev.h>
 #include <linux/bitops.h>
 #include <linux/ratelimit.h>
+#include <linux/hrtimer.h>
 
 #define CREATE_TRACE_POINTS
 #include <trace/events/jbd2.h>
@@ -83,6 +85,7 @@ EXPORT_SYMBOL(jbd2_journal_ack_err);
 EXPORT_SYMBOL(jbd2_journal_clear_err);
 EXPORT_SYMBOL(jbd2_log_wait_commit);
 EXPORT_SYMBOL(jbd2_log_start_commit);
+EXPORT_SYMBOL(jbd2_log_batch_commit);
 EXPORT_SYMBOL(jbd2_journal_start_commit);
 EXPORT_SYMBOL(jbd2_journal_force_commit_nested);
 EXPORT_SYMBOL(jbd2_journal_wipe);
@@ -91,14 +94,18 @@ EXPORT_SYMBOL(jbd2_journal_invalidatepage);
 EXPORT_SYMBOL(jbd2_journal_try_to_free_buffers);
 EXPORT_SYMBOL(jbd2_journal_force_commit);
 EXPORT_SYMBOL(jbd2_journal_file_inode);
+EXPORT_SYMBOL(jbd2_journal_file_inode_range);
 EXPORT_SYMBOL(jbd2_journal_init_jbd_inode);
 EXPORT_SYMBOL(jbd2_journal_release_jbd_inode);
 EXPORT_SYMBOL(jbd2_journal_begin_ordered_truncate);
 EXPORT_SYMBOL(jbd2_inode_cache);
+EXPORT_SYMBOL(jbd2_journal_grab_journal_head);
+EXPORT_SYMBOL(jbd2_journal_put_journal_head);
 
 static int journal_convert_superblock_v1(journal_t *, journal_superblock_t *);
 static void __journal_abort_soft (journal_t *journal, int errno);
 static int jbd2_journal_create_slab(size_t slab_size);
+static void jbd2_journal_destroy_frozen(journal_t *journal);
 
 /*
  * Helper function used to manage commit timeouts
@@ -373,14 +380,16 @@ repeat:
 		char *tmp;
 
 		jbd_unlock_bh_state(bh_in);
-		tmp = jbd2_alloc(bh_in->b_size, GFP_NOFS);
+		tmp = jbd2_journal_alloc_frozen(transaction->t_journal,
+						bh_in->b_size, GFP_NOFS);
 		if (!tmp) {
 			jbd2_journal_put_journal_head(new_jh);
 			return -ENOMEM;
 		}
 		jbd_lock_bh_state(bh_in);
 		if (jh_in->b_frozen_data) {
-			jbd2_free(tmp, bh_in->b_size);
+			jbd2_journal_free_frozen(transaction->t_journal, tmp,
+					 bh_in->b_size);
 			goto repeat;
 		}
 
@@ -518,6 +527,46 @@ int jbd2_log_start_commit(journal_t *journal, tid_t tid)
 	return ret;
 }
 
+/*
+ * Group commit for callers which are about to force a commit of the
+ * running transaction from outside a handle, e.g. fsync.  If the
+ * transaction is younger than the average commit time, sleep for the
+ * difference (bounded by j_min_batch_time and j_max_batch_time) so that
+ * other syncing tasks can add their updates and share the commit and
+ * its cache flush.  This is the same heuristic jbd2_journal_stop() uses
+ * for synchronous handles.  The caller decides whether batching is
+ * worthwhile at all.
+ */
+void jbd2_log_batch_commit(journal_t *journal, tid_t tid)
+{
+	transaction_t *transaction;
+	u64 commit_time, trans_time;
+
+	read_lock(&journal->j_state_lock);
+	transaction = journal->j_running_transaction;
+	if (!transaction || transaction->t_tid != tid) {
+		/* Already committing (or committed): nothing to batch */
+		read_unlock(&journal->j_state_lock);
+		return;
+	}
+	commit_time = journal->j_average_commit_time;
+	trans_time = ktime_to_ns(ktime_sub(ktime_get(),
+					   transaction->t_start_time));
+	read_unlock(&journal->j_state_lock);
+
+	commit_time = max_t(u64, commit_time,
+			    1000*journal->j_min_batch_time);
+	commit_time = min_t(u64, commit_time,
+			    1000*journal->j_max_batch_time);
+
+	if (trans_time < commit_time) {
+		ktime_t expires = ktime_add_ns(ktime_get(),
+					       commit_time - trans_time);
+		set_current_state(TASK_UNINTERRUPTIBLE);
+		schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+	}
+}
+
 /*
  * Force and wait upon a commit if the calling process is not within
  * transaction.  This is used for forcing out undo-protected data which contains
@@ -649,6 +698,11 @@ int jbd2_log_wait_commit(journal_t *journal, tid_t tid)
 				  tid, journal->j_commit_sequence);
 		wake_up(&journal->j_wait_commit);
 		read_unlock(&journal->j_state_lock);
+		/*
+		 * Don't let the elevator of the fs device idle on us while
+		 * the commit runs; j_dev may be an external journal device.
+		 */
+		elv_yield(bdev_get_queue(journal->j_fs_dev));
 		wait_event(journal->j_wait_done_commit,
 				!tid_gt(tid, journal->j_commit_sequence));
 		read_lock(&journal->j_state_lock);
@@ -747,10 +801,32 @@ struct journal_head *jbd2_journal_get_descriptor_buffer(journal_t *journal)
 struct jbd2_stats_proc_session {
 	journal_t *journal;
 	struct transaction_stats_s *stats;
+	struct jbd2_stats_hist_s *hist;
+	__u32 handle_wait[JBD2_HIST_BUCKETS];
 	int start;
 	int max;
 };
 
+static void jbd2_seq_hist_show(struct seq_file *seq, const char *name,
+			       __u32 *hist)
+{
+	int i;
+
+	seq_printf(seq, "  %-14s", name);
+	for (i = 0; i < JBD2_HIST_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		if (i == 0)
+			seq_printf(seq, " 0:%u", hist[i]);
+		else if (i == JBD2_HIST_BUCKETS - 1)
+			seq_printf(seq, " %lu+:%u", 1UL << (i - 1), hist[i]);
+		else
+			seq_printf(seq, " %lu-%lu:%u", 1UL << (i - 1),
+				   (1UL << i) - 1, hist[i]);
+	}
+	seq_putc(seq, '\n');
+}
+
 static void *jbd2_seq_info_start(struct seq_file *seq, loff_t *pos)
 {
 	return *pos ? NULL : SEQ_START_TOKEN;
@@ -790,6 +866,23 @@ static int jbd2_seq_info_show(struct seq_file *seq, void *v)
 	    s->stats->run.rs_blocks / s->stats->ts_tid);
 	seq_printf(seq, "  %lu logged blocks per transaction\n",
 	    s->stats->run.rs_blocks_logged / s->stats->ts_tid);
+	seq_printf(seq, "  %lu revoke records per transaction\n",
+	    s->stats->run.rs_revokes / s->stats->ts_tid);
+	seq_printf(seq, "  %d revoke hash buckets\n",
+	    jbd2_journal_revoke_hash_size(s->journal));
+	seq_printf(seq, "  %d of %d pooled frozen buffers, %lu hits, "
+		   "%lu misses\n", s->journal->j_frozen_count,
+		   s->journal->j_frozen_target, s->journal->j_frozen_hits,
+		   s->journal->j_frozen_misses);
+	seq_printf(seq, "histograms (range:transactions):\n");
+	jbd2_seq_hist_show(seq, "running ms", s->hist->h_running);
+	jbd2_seq_hist_show(seq, "locked ms", s->hist->h_locked);
+	jbd2_seq_hist_show(seq, "flushing ms", s->hist->h_flushing);
+	jbd2_seq_hist_show(seq, "logging ms", s->hist->h_logging);
+	jbd2_seq_hist_show(seq, "commit us", s->hist->h_commit);
+	jbd2_seq_hist_show(seq, "handles", s->hist->h_handles);
+	jbd2_seq_hist_show(seq, "blocks", s->hist->h_blocks);
+	jbd2_seq_hist_show(seq, "handle wait ms", s->handle_wait);
 	return 0;
 }
 
@@ -808,7 +901,7 @@ static int jbd2_seq_info_open(struct inode *inode, struct file *file)
 {
 	journal_t *journal = PDE(inode)->data;
 	struct jbd2_stats_proc_session *s;
-	int rc, size;
+	int rc, size, i;
 
 	s = kmalloc(sizeof(*s), GFP_KERNEL);
 	if (s == NULL)
@@ -819,16 +912,26 @@ static int jbd2_seq_info_open(struct inode *inode, struct file *file)
 		kfree(s);
 		return -ENOMEM;
 	}
+	s->hist = kmalloc(sizeof(struct jbd2_stats_hist_s), GFP_KERNEL);
+	if (s->hist == NULL) {
+		kfree(s->stats);
+		kfree(s);
+		return -ENOMEM;
+	}
 	spin_lock(&journal->j_history_lock);
 	memcpy(s->stats, &journal->j_stats, size);
+	memcpy(s->hist, &journal->j_hist, sizeof(struct jbd2_stats_hist_s));
 	s->journal = journal;
 	spin_unlock(&journal->j_history_lock);
+	for (i = 0; i < JBD2_HIST_BUCKETS; i++)
+		s->handle_wait[i] = atomic_read(&journal->j_handle_wait_hist[i]);
 
 	rc = seq_open(file, &jbd2_seq_info_ops);
 	if (rc == 0) {
 		struct seq_file *m = file->private_data;
 		m->private = s;
 	} else {
+		kfree(s->hist);
 		kfree(s->stats);
 		kfree(s);
 	}
@@ -840,6 +943,7 @@ static int jbd2_seq_info_release(struct inode *inode, struct file *file)
 {
 	struct seq_file *seq = file->private_data;
 	struct jbd2_stats_proc_session *s = seq->private;
+	kfree(s->hist);
 	kfree(s->stats);
 	kfree(s);
 	return seq_release(inode, file);
@@ -896,6 +1000,7 @@ static journal_t * journal_init_common (void)
 	init_waitqueue_head(&journal->j_wait_updates);
 	mutex_init(&journal->j_barrier);
 	mutex_init(&journal->j_checkpoint_mutex);
+	INIT_WORK(&journal->j_checkpoint_work, jbd2_checkpoint_work);
 	spin_lock_init(&journal->j_revoke_lock);
 	spin_lock_init(&journal->j_list_lock);
 	rwlock_init(&journal->j_state_lock);
@@ -915,6 +1020,8 @@ static journal_t * journal_init_common (void)
 	}
 
 	spin_lock_init(&journal->j_history_lock);
+	spin_lock_init(&journal->j_frozen_lock);
+	atomic_set(&journal->j_frozen_copies, 0);
 
 	return journal;
 }
@@ -1369,6 +1476,9 @@ int jbd2_journal_destroy(journal_t *journal)
 	if (journal->j_running_transaction)
 		jbd2_journal_commit_transaction(journal);
 
+	/* No more commits, so background checkpointing is not rearmed */
+	cancel_work_sync(&journal->j_checkpoint_work);
+
 	/* Force any old transactions to disk */
 
 	/* Totally anal locking here... */
@@ -1405,6 +1515,7 @@ int jbd2_journal_destroy(journal_t *journal)
 		iput(journal->j_inode);
 	if (journal->j_revoke)
 		jbd2_journal_destroy_revoke(journal);
+	jbd2_journal_destroy_frozen(journal);
 	kfree(journal->j_wbuf);
 	kfree(journal);
 
@@ -1999,6 +2110,108 @@ void jbd2_free(void *ptr, size_t size)
 	kmem_cache_free(get_slab(size), ptr);
 };
 
+/*
+ * Frozen data buffers pool
+ *
+ * Right after a snapshot is taken, COW and commit copy out the same hot
+ * metadata buffers, so every transaction allocates and frees many frozen
+ * and committed data copies.  Serve the copies of j_blocksize from a per
+ * journal pool, which is refilled from process context after every commit
+ * to twice the average number of copies per transaction.  Buffers of the
+ * pool are allocated with jbd2_alloc(), so they may always be released
+ * with jbd2_free().
+ */
+void *jbd2_journal_alloc_frozen(journal_t *journal, size_t size, gfp_t flags)
+{
+	void *ptr = NULL;
+
+	if (size != journal->j_blocksize)
+		return jbd2_alloc(size, flags);
+
+	atomic_inc(&journal->j_frozen_copies);
+	spin_lock(&journal->j_frozen_lock);
+	if (journal->j_frozen_pool) {
+		ptr = journal->j_frozen_pool;
+		journal->j_frozen_pool = *(void **)ptr;
+		journal->j_frozen_count--;
+		journal->j_frozen_hits++;
+	} else {
+		journal->j_frozen_misses++;
+	}
+	spin_unlock(&journal->j_frozen_lock);
+	if (!ptr)
+		ptr = jbd2_alloc(size, flags);
+	return ptr;
+}
+
+void jbd2_journal_free_frozen(journal_t *journal, void *ptr, size_t size)
+{
+	if (size == journal->j_blocksize) {
+		spin_lock(&journal->j_frozen_lock);
+		if (journal->j_frozen_count < journal->j_frozen_target) {
+			*(void **)ptr = journal->j_frozen_pool;
+			journal->j_frozen_pool = ptr;
+			journal->j_frozen_count++;
+			ptr = NULL;
+		}
+		spin_unlock(&journal->j_frozen_lock);
+		if (!ptr)
+			return;
+	}
+	jbd2_free(ptr, size);
+}
+
+/*
+ * Fold the copies of the last committed transaction into the average and
+ * resize the pool.  Called by the commit thread, so it may sleep.
+ */
+void jbd2_journal_refill_frozen(journal_t *journal)
+{
+	unsigned int copies = atomic_xchg(&journal->j_frozen_copies, 0);
+	void *ptr, *drop = NULL;
+	int target;
+
+	if (likely(journal->j_frozen_avg))
+		journal->j_frozen_avg = (copies + journal->j_frozen_avg*3) / 4;
+	else
+		journal->j_frozen_avg = copies;
+	target = min_t(int, 2 * journal->j_frozen_avg, JBD2_FROZEN_POOL_MAX);
+
+	spin_lock(&journal->j_frozen_lock);
+	journal->j_frozen_target = target;
+	while (journal->j_frozen_count > target) {
+		ptr = journal->j_frozen_pool;
+		journal->j_frozen_pool = *(void **)ptr;
+		journal->j_frozen_count--;
+		*(void **)ptr = drop;
+		drop = ptr;
+	}
+	spin_unlock(&journal->j_frozen_lock);
+	while (drop) {
+		ptr = drop;
+		drop = *(void **)ptr;
+		jbd2_free(ptr, journal->j_blocksize);
+	}
+
+	while (ACCESS_ONCE(journal->j_frozen_count) < target) {
+		ptr = jbd2_alloc(journal->j_blocksize, GFP_NOFS | __GFP_NOWARN);
+		if (!ptr)
+			break;
+		jbd2_journal_free_frozen(journal, ptr, journal->j_blocksize);
+	}
+}
+
+static void jbd2_journal_destroy_frozen(journal_t *journal)
+{
+	void *ptr;
+
+	while ((ptr = journal->j_frozen_pool)) {
+		journal->j_frozen_pool = *(void **)ptr;
+		jbd2_free(ptr, journal->j_blocksize);
+	}
+	journal->j_frozen_count = 0;
+}
+
 /*
  * Journal_head storage management
  */
@@ -2012,10 +2225,15 @@ static int journal_init_jbd2_journal_head_cache(void)
 	int retval;
 
 	J_ASSERT(jbd2_journal_head_cache == NULL);
+	/*
+	 * jbd2_write_access_granted() looks at journal heads under
+	 * rcu_read_lock() only, so their memory must stay a journal head
+	 * during the RCU grace period.
+	 */
 	jbd2_journal_head_cache = kmem_cache_create("jbd2_journal_head",
 				sizeof(struct journal_head),
 				0,		/* offset */
-				SLAB_TEMPORARY,	/* flags */
+				SLAB_TEMPORARY | SLAB_DESTROY_BY_RCU,
 				NULL);		/* ctor */
 	retval = 0;
 	if (!jbd2_journal_head_cache) {
@@ -2215,6 +2433,8 @@ void jbd2_journal_init_jbd_inode(struct jbd2_inode *jinode, struct inode *inode)
 	jinode->i_next_transaction = NULL;
 	jinode->i_vfs_inode = inode;
 	jinode->i_flags = 0;
+	jinode->i_dirty_start = 0;
+	jinode->i_dirty_end = 0;
 	INIT_LIST_HEAD(&jinode->i_list);
 }
 
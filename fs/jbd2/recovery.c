@@ -21,8 +21,18 @@
 #include <linux/jbd2.h>
 #include <linux/errno.h>
 #include <linux/crc32.h>
+#include <linux/blkdev.h>
 #endif
 
+/*
+ * Revoke blocks of the transaction being scanned are remembered here and
+ * only applied once its commit block has been found (and verified), so
+ * that the scan pass can build the revoke table without a second pass
+ * over the log.  Transactions with more revoke blocks than this fall
+ * back to a separate revoke pass.
+ */
+#define JBD2_SCAN_REVOKE_BLOCKS 16
+
 /*
  * Maintain information about the progress of the recovery job, so that
  * the different passes can carry information between them.
@@ -35,6 +45,12 @@ struct recovery_info
 	int		nr_replays;
 	int		nr_revokes;
 	int		nr_revoke_hits;
+
+	/* Revoke records collected by the scan pass */
+	int		scan_revokes;
+	int		revoke_overflow;
+	int		nr_revoke_blocks;
+	unsigned long	revoke_blocks[JBD2_SCAN_REVOKE_BLOCKS];
 };
 
 enum passtype {PASS_SCAN, PASS_REVOKE, PASS_REPLAY};
@@ -42,6 +58,7 @@ static int do_one_pass(journal_t *journal,
 				struct recovery_info *info, enum passtype pass);
 static int scan_revoke_records(journal_t *, struct buffer_head *,
 				tid_t, struct recovery_info *);
+static int scan_revoke_blocks(journal_t *, tid_t, struct recovery_info *);
 
 #ifdef __KERNEL__
 
@@ -60,23 +77,29 @@ static void journal_brelse_array(struct buffer_head *b[], int n)
  * all.  Recovery is basically one long sequential read, so make sure we
  * do the IO in reasonably large chunks.
  *
- * This is not so critical that we need to be enormously clever about
- * the readahead size, though.  128K is a purely arbitrary, good-enough
- * fixed value.
+ * A large journal is replayed much faster when the next chunk of the
+ * log is already being read while the current one is processed, so
+ * jread() restarts readahead every half window (see JBD2_RA_BLOCKS),
+ * keeping at least half a window of reads in flight.  The requests are
+ * plugged so that the MAXBUF sized batches merge into large I/Os.
  */
 
 #define MAXBUF 8
+#define JBD2_RA_BYTES	(1024 * 1024)
+#define JBD2_RA_BLOCKS(journal)	(JBD2_RA_BYTES / (journal)->j_blocksize)
+
 static int do_readahead(journal_t *journal, unsigned int start)
 {
 	int err;
 	unsigned int max, nbufs, next;
 	unsigned long long blocknr;
 	struct buffer_head *bh;
+	struct blk_plug plug;
 
 	struct buffer_head * bufs[MAXBUF];
 
-	/* Do up to 128K of readahead */
-	max = start + (128 * 1024 / journal->j_blocksize);
+	/* Do up to JBD2_RA_BYTES of readahead */
+	max = start + JBD2_RA_BLOCKS(journal);
 	if (max > journal->j_maxlen)
 		max = journal->j_maxlen;
 
@@ -84,6 +107,7 @@ static int do_readahead(journal_t *journal, unsigned int start)
 	 * a time to the block device IO layer. */
 
 	nbufs = 0;
+	blk_start_plug(&plug);
 
 	for (next = start; next < max; next++) {
 		err = jbd2_journal_bmap(journal, next, &blocknr);
@@ -118,6 +142,7 @@ static int do_readahead(journal_t *journal, unsigned int start)
 failed:
 	if (nbufs)
 		journal_brelse_array(bufs, nbufs);
+	blk_finish_plug(&plug);
 	return err;
 }
 
@@ -161,6 +186,11 @@ static int jread(struct buffer_head **bhp, journal_t *journal,
 			do_readahead(journal, offset);
 		wait_on_buffer(bh);
 	}
+#ifdef __KERNEL__
+	else if (!(offset & (JBD2_RA_BLOCKS(journal) / 2 - 1)))
+		/* Keep the readahead window ahead of the log scan */
+		do_readahead(journal, offset);
+#endif
 
 	if (!buffer_uptodate(bh)) {
 		printk (KERN_ERR "JBD: Failed to read block at offset %u\n",
@@ -220,7 +250,9 @@ do {									\
  * Recovery is done in three passes.  In the first pass, we look for the
  * end of the log.  In the second, we assemble the list of revoke
  * blocks.  In the third and final pass, we replay any un-revoked blocks
- * in the log.
+ * in the log.  The revoke list is normally assembled by the first pass
+ * as each commit block is found, and the second pass is only needed if
+ * a transaction had too many revoke blocks to remember.
  */
 int jbd2_journal_recover(journal_t *journal)
 {
@@ -245,8 +277,9 @@ int jbd2_journal_recover(journal_t *journal)
 		return 0;
 	}
 
+	info.scan_revokes = 1;
 	err = do_one_pass(journal, &info, PASS_SCAN);
-	if (!err)
+	if (!err && info.revoke_overflow)
 		err = do_one_pass(journal, &info, PASS_REVOKE);
 	if (!err)
 		err = do_one_pass(journal, &info, PASS_REPLAY);
@@ -331,7 +364,8 @@ static int calc_chksums(journal_t *journal, struct buffer_head *bh,
 
 	num_blks = count_tags(journal, bh);
 	/* Calculate checksum of the descriptor block. */
-	*crc32_sum = crc32_be(*crc32_sum, (void *)bh->b_data, bh->b_size);
+	*crc32_sum = jbd2_chksum(journal, *crc32_sum, (void *)bh->b_data,
+				 bh->b_size);
 
 	for (i = 0; i < num_blks; i++) {
 		io_block = (*next_log_block)++;
@@ -342,8 +376,8 @@ static int calc_chksums(journal_t *journal, struct buffer_head *bh,
 				"%lu in log\n", err, io_block);
 			return 1;
 		} else {
-			*crc32_sum = crc32_be(*crc32_sum, (void *)obh->b_data,
-				     obh->b_size);
+			*crc32_sum = jbd2_chksum(journal, *crc32_sum,
+					(void *)obh->b_data, obh->b_size);
 		}
 		put_bh(obh);
 	}
@@ -354,7 +388,7 @@ static int do_one_pass(journal_t *journal,
 			struct recovery_info *info, enum passtype pass)
 {
 	unsigned int		first_commit_ID, next_commit_ID;
-	unsigned long		next_log_block;
+	unsigned long		next_log_block, this_log_block;
 	int			err, success = 0;
 	journal_superblock_t *	sb;
 	journal_header_t *	tmp;
@@ -412,6 +446,7 @@ static int do_one_pass(journal_t *journal,
 		 * record. */
 
 		jbd_debug(3, "JBD: checking block %ld\n", next_log_block);
+		this_log_block = next_log_block;
 		err = jread(&bh, journal, next_log_block);
 		if (err)
 			goto failed;
@@ -614,7 +649,8 @@ static int do_one_pass(journal_t *journal,
 				}
 
 				if (crc32_sum == found_chksum &&
-				    cbh->h_chksum_type == JBD2_CRC32_CHKSUM &&
+				    cbh->h_chksum_type ==
+						jbd2_chksum_type(journal) &&
 				    cbh->h_chksum_size ==
 						JBD2_CRC32_CHKSUM_SIZE)
 				       chksum_seen = 1;
@@ -648,10 +684,32 @@ static int do_one_pass(journal_t *journal,
 				crc32_sum = ~0;
 			}
 			brelse(bh);
+			/* The transaction is complete: its revoke records
+			 * can now be trusted. */
+			if (pass == PASS_SCAN && info->scan_revokes &&
+			    !info->end_transaction) {
+				err = scan_revoke_blocks(journal,
+							 next_commit_ID, info);
+				if (err)
+					goto failed;
+			}
+			info->nr_revoke_blocks = 0;
 			next_commit_ID++;
 			continue;
 
 		case JBD2_REVOKE_BLOCK:
+			/* Remember where the revoke blocks of the current
+			 * transaction are until its commit block is seen. */
+			if (pass == PASS_SCAN && info->scan_revokes) {
+				if (info->nr_revoke_blocks <
+				    JBD2_SCAN_REVOKE_BLOCKS)
+					info->revoke_blocks[
+					    info->nr_revoke_blocks++] =
+						this_log_block;
+				else
+					info->revoke_overflow = 1;
+			}
+
 			/* If we aren't in the REVOKE pass, then we can
 			 * just skip over this block. */
 			if (pass != PASS_REVOKE) {
@@ -704,6 +762,28 @@ static int do_one_pass(journal_t *journal,
 }
 
 
+/*
+ * Scan the revoke blocks remembered by the scan pass for a transaction
+ * whose commit block has been found.
+ */
+static int scan_revoke_blocks(journal_t *journal, tid_t sequence,
+			      struct recovery_info *info)
+{
+	struct buffer_head *bh;
+	int i, err;
+
+	for (i = 0; i < info->nr_revoke_blocks; i++) {
+		err = jread(&bh, journal, info->revoke_blocks[i]);
+		if (err)
+			return err;
+		err = scan_revoke_records(journal, bh, sequence, info);
+		brelse(bh);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
 /* Scan a revoke record, marking all blocks mentioned as revoked. */
 
 static int scan_revoke_records(journal_t *journal, struct buffer_head *bh,
@@ -69,7 +69,9 @@
  * All users operating on the hash table belonging to the running transaction
  * have a handle to the transaction. Therefore they are safe from kjournald
  * switching hash tables under them. For operations on the lists of entries in
- * the hash table j_revoke_lock is used.
+ * the hash table j_revoke_lock is used.  The running table grows (see
+ * revoke_table_grow()) when it holds too many records, so the bucket array
+ * and its size may also only be looked at under j_revoke_lock.
  *
  * Finally, also replay code uses the hash tables but at this moment no one else
  * can touch them (filesystem isn't mounted yet) and hence no locking is
@@ -89,6 +91,7 @@
 #include <linux/bio.h>
 #endif
 #include <linux/log2.h>
+#include <linux/hash.h>
 
 static struct kmem_cache *jbd2_revoke_record_cache;
 static struct kmem_cache *jbd2_revoke_table_cache;
@@ -108,13 +111,21 @@ struct jbd2_revoke_record_s
 /* The revoke table is just a simple hash table of revoke records. */
 struct jbd2_revoke_table_s
 {
-	/* It is conceivable that we might want a larger hash table
-	 * for recovery.  Must be a power of two. */
+	/* Starts at the size given to jbd2_journal_init_revoke() and
+	 * doubles when the table gets loaded.  Must be a power of two. */
 	int		  hash_size;
 	int		  hash_shift;
+	int		  nr_records;
 	struct list_head *hash_table;
 };
 
+/*
+ * Grow the table when it holds more than 1 << JOURNAL_REVOKE_LOAD_SHIFT
+ * records per bucket, up to JOURNAL_REVOKE_MAX_HASH buckets.
+ */
+#define JOURNAL_REVOKE_LOAD_SHIFT	1
+#define JOURNAL_REVOKE_MAX_HASH		(1 << 16)
+
 
 #ifdef __KERNEL__
 static void write_one_revoke_record(journal_t *, transaction_t *,
@@ -125,23 +136,62 @@ static void flush_descriptor(journal_t *, struct journal_head *, int, int);
 
 /* Utility functions to maintain the revoke table */
 
-/* Borrowed from buffer.c: this is a tried and tested block hash function */
-static inline int hash(journal_t *journal, unsigned long long block)
+/*
+ * The table size is not fixed, so use a multiplicative hash that spreads
+ * any number of low bits evenly.
+ */
+static inline int hash(struct jbd2_revoke_table_s *table,
+		       unsigned long long block)
 {
-	struct jbd2_revoke_table_s *table = journal->j_revoke;
-	int hash_shift = table->hash_shift;
-	int hash = (int)block ^ (int)((block >> 31) >> 1);
+	return hash_64(block, table->hash_shift);
+}
+
+/*
+ * Double the size of the running revoke table and rehash its records.
+ * The new bucket array is allocated before taking j_revoke_lock, so
+ * give up quietly if the allocation fails or someone else got there
+ * first.
+ */
+static void revoke_table_grow(journal_t *journal,
+			      struct jbd2_revoke_table_s *table, int old_size)
+{
+	struct jbd2_revoke_record_s *record, *next;
+	struct list_head *new_table, *old_table;
+	int new_size = old_size << 1;
+	int i;
+
+	new_table = kmalloc(new_size * sizeof(struct list_head),
+			    GFP_NOFS | __GFP_NOWARN);
+	if (!new_table)
+		return;
+	for (i = 0; i < new_size; i++)
+		INIT_LIST_HEAD(&new_table[i]);
 
-	return ((hash << (hash_shift - 6)) ^
-		(hash >> 13) ^
-		(hash << (hash_shift - 12))) & (table->hash_size - 1);
+	spin_lock(&journal->j_revoke_lock);
+	if (table->hash_size != old_size) {
+		spin_unlock(&journal->j_revoke_lock);
+		kfree(new_table);
+		return;
+	}
+	old_table = table->hash_table;
+	table->hash_table = new_table;
+	table->hash_size = new_size;
+	table->hash_shift++;
+	for (i = 0; i < old_size; i++)
+		list_for_each_entry_safe(record, next, &old_table[i], hash)
+			list_move(&record->hash,
+				  &new_table[hash(table, record->blocknr)]);
+	spin_unlock(&journal->j_revoke_lock);
+	kfree(old_table);
+	jbd_debug(1, "revoke table grown to %d buckets\n", new_size);
 }
 
 static int insert_revoke_hash(journal_t *journal, unsigned long long blocknr,
 			      tid_t seq)
 {
-	struct list_head *hash_list;
+	struct jbd2_revoke_table_s *table = journal->j_revoke;
 	struct jbd2_revoke_record_s *record;
+	int grow_from = 0;
 
 repeat:
 	record = kmem_cache_alloc(jbd2_revoke_record_cache, GFP_NOFS);
@@ -150,10 +200,16 @@ repeat:
 
 	record->sequence = seq;
 	record->blocknr = blocknr;
-	hash_list = &journal->j_revoke->hash_table[hash(journal, blocknr)];
 	spin_lock(&journal->j_revoke_lock);
-	list_add(&record->hash, hash_list);
+	list_add(&record->hash,
+		 &table->hash_table[hash(table, blocknr)]);
+	if (++table->nr_records >
+	    (table->hash_size << JOURNAL_REVOKE_LOAD_SHIFT) &&
+	    table->hash_size < JOURNAL_REVOKE_MAX_HASH)
+		grow_from = table->hash_size;
 	spin_unlock(&journal->j_revoke_lock);
+	if (grow_from)
+		revoke_table_grow(journal, table, grow_from);
 	return 0;
 
 oom:
@@ -169,12 +225,12 @@ oom:
 static struct jbd2_revoke_record_s *find_revoke_record(journal_t *journal,
 						      unsigned long long blocknr)
 {
+	struct jbd2_revoke_table_s *table = journal->j_revoke;
 	struct list_head *hash_list;
 	struct jbd2_revoke_record_s *record;
 
-	hash_list = &journal->j_revoke->hash_table[hash(journal, blocknr)];
-
 	spin_lock(&journal->j_revoke_lock);
+	hash_list = &table->hash_table[hash(table, blocknr)];
 	record = (struct jbd2_revoke_record_s *) hash_list->next;
 	while (&(record->hash) != hash_list) {
 		if (record->blocknr == blocknr) {
@@ -239,6 +295,7 @@ static struct jbd2_revoke_table_s *jbd2_journal_init_revoke_table(int hash_size)
 
 	table->hash_size = hash_size;
 	table->hash_shift = shift;
+	table->nr_records = 0;
 	table->hash_table =
 		kmalloc(hash_size * sizeof(struct list_head), GFP_KERNEL);
 	if (!table->hash_table) {
@@ -450,6 +507,7 @@ int jbd2_journal_cancel_revoke(handle_t *handle, struct journal_head *jh)
 				  "blocknr %llu\n", (unsigned long long)bh->b_blocknr);
 			spin_lock(&journal->j_revoke_lock);
 			list_del(&record->hash);
+			journal->j_revoke->nr_records--;
 			spin_unlock(&journal->j_revoke_lock);
 			kmem_cache_free(jbd2_revoke_record_cache, record);
 			did_revoke = 1;
@@ -493,13 +551,15 @@ void jbd2_journal_switch_revoke_table(journal_t *journal)
 
 	for (i = 0; i < journal->j_revoke->hash_size; i++)
 		INIT_LIST_HEAD(&journal->j_revoke->hash_table[i]);
+	journal->j_revoke->nr_records = 0;
 }
 
 /*
  * Write revoke records to the journal for all entries in the current
- * revoke hash, deleting the entries as we go.
+ * revoke hash, deleting the entries as we go.  Returns the number of
+ * records written.
  */
-void jbd2_journal_write_revoke_records(journal_t *journal,
+int jbd2_journal_write_revoke_records(journal_t *journal,
 				       transaction_t *transaction,
 				       int write_op)
 {
@@ -533,7 +593,9 @@ void jbd2_journal_write_revoke_records(journal_t *journal,
 	}
 	if (descriptor)
 		flush_descriptor(journal, descriptor, offset, write_op);
+	revoke->nr_records = 0;
 	jbd_debug(1, "Wrote %d revoke records\n", count);
+	return count;
 }
 
 /*
@@ -711,4 +773,16 @@ void jbd2_journal_clear_revoke(journal_t *journal)
 			kmem_cache_free(jbd2_revoke_record_cache, record);
 		}
 	}
+	revoke->nr_records = 0;
+}
+
+/* Number of buckets of the running revoke table, for statistics */
+int jbd2_journal_revoke_hash_size(journal_t *journal)
+{
+	int size;
+
+	spin_lock(&journal->j_revoke_lock);
+	size = journal->j_revoke->hash_size;
+	spin_unlock(&journal->j_revoke_lock);
+	return size;
 }
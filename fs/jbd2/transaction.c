@@ -28,6 +28,7 @@
 #include <linux/hrtimer.h>
 #include <linux/backing-dev.h>
 #include <linux/module.h>
+#include <trace/events/jbd2.h>
 
 static void __jbd2_journal_temp_unlink_buffer(struct journal_head *jh);
 static void __jbd2_journal_unfile_buffer(struct journal_head *jh);
@@ -66,11 +67,13 @@ jbd2_get_transaction(journal_t *journal, transaction_t *transaction)
 	journal->j_commit_timer.expires = round_jiffies_up(transaction->t_expires);
 	add_timer(&journal->j_commit_timer);
 
-	J_ASSERT(journal->j_running_transaction == NULL);
-	journal->j_running_transaction = transaction;
 	transaction->t_max_wait = 0;
 	transaction->t_start = jiffies;
 
+	J_ASSERT(journal->j_running_transaction == NULL);
+	/* start_this_handle_fast() looks it up without j_state_lock */
+	rcu_assign_pointer(journal->j_running_transaction, transaction);
+
 	return transaction;
 }
 
@@ -82,6 +85,25 @@ jbd2_get_transaction(journal_t *journal, transaction_t *transaction)
  * of that one update.
  */
 
+/*
+ * Account a handle which had to wait for the transaction (a locked
+ * transaction, log space or a commit) in the journal's wait histogram.
+ * Handles that got in without sleeping are not counted, so the hot
+ * path does not touch the shared counters.
+ */
+static inline void jbd2_account_handle_wait(journal_t *journal,
+					    transaction_t *transaction,
+					    unsigned long ts)
+{
+	unsigned int wait = jiffies_to_msecs(jbd2_time_diff(ts, jiffies));
+
+	if (!wait)
+		return;
+	atomic_inc(&journal->j_handle_wait_hist[jbd2_hist_bucket(wait)]);
+	trace_jbd2_handle_wait(journal->j_fs_dev->bd_dev, transaction->t_tid,
+			       wait);
+}
+
 /*
  * Update transaction's maximum wait time, if debugging is enabled.
  *
@@ -107,6 +129,67 @@ static inline void update_t_max_wait(transaction_t *transaction,
 #endif
 }
 
+/*
+ * start_this_handle_fast: try to join the running transaction without
+ * taking j_state_lock.
+ *
+ * This only succeeds when the running transaction is T_RUNNING, there is
+ * no barrier, the credits fit and an earlier handle already passed the log
+ * space check for this transaction (that check only changes when a new
+ * transaction starts committing, which locks this one first, or when
+ * jbd2_set_max_transaction_buffers() raises the max).  t_updates
+ * is raised before the state is tested, so that the committing thread
+ * and jbd2_journal_lock_updates() either see the update or the handle
+ * sees their state change and backs off to the slow path.
+ * Preemption is disabled to keep a backed off t_updates increment short.
+ */
+static int start_this_handle_fast(journal_t *journal, handle_t *handle,
+				  int nblocks)
+{
+	transaction_t *transaction;
+	int needed;
+
+	preempt_disable();
+	rcu_read_lock();
+	transaction = rcu_dereference(journal->j_running_transaction);
+	if (!transaction || !ACCESS_ONCE(transaction->t_log_space_ok) ||
+	    transaction->t_state != T_RUNNING ||
+	    (journal->j_flags & JBD2_ABORT) || journal->j_errno)
+		goto out;
+
+	atomic_inc(&transaction->t_updates);
+	smp_mb();
+	if (transaction->t_state != T_RUNNING || journal->j_barrier_count ||
+	    journal->j_running_transaction != transaction)
+		goto out_updates;
+
+	needed = atomic_add_return(nblocks,
+				   &transaction->t_outstanding_credits);
+	if (needed > journal->j_max_transaction_buffers) {
+		atomic_sub(nblocks, &transaction->t_outstanding_credits);
+		goto out_updates;
+	}
+
+	handle->h_transaction = transaction;
+	atomic_inc(&transaction->t_handle_count);
+	rcu_read_unlock();
+	preempt_enable();
+	jbd_debug(4, "Handle %p given %d credits (total %d)\n",
+		  handle, nblocks, needed);
+	return 1;
+
+out_updates:
+	if (atomic_dec_and_test(&transaction->t_updates)) {
+		wake_up(&journal->j_wait_updates);
+		if (journal->j_barrier_count)
+			wake_up(&journal->j_wait_transaction_locked);
+	}
+out:
+	rcu_read_unlock();
+	preempt_enable();
+	return 0;
+}
+
 /*
  * start_this_handle: Given a handle, deal with any locking or stalling
  * needed to make sure that there is enough journal space for the handle
@@ -130,6 +213,11 @@ static int start_this_handle(journal_t *journal, handle_t *handle,
 		return -ENOSPC;
 	}
 
+	if (start_this_handle_fast(journal, handle, nblocks)) {
+		lock_map_acquire(&handle->h_lockdep_map);
+		return 0;
+	}
+
 alloc_transaction:
 	if (!journal->j_running_transaction) {
 		new_transaction = kzalloc(sizeof(*new_transaction), gfp_mask);
@@ -268,11 +356,13 @@ repeat:
 		write_unlock(&journal->j_state_lock);
 		goto repeat;
 	}
+	transaction->t_log_space_ok = 1;
 
 	/* OK, account for the buffers that this operation expects to
 	 * use and add the handle to the running transaction. 
 	 */
 	update_t_max_wait(transaction, ts);
+	jbd2_account_handle_wait(journal, transaction, ts);
 	handle->h_transaction = transaction;
 	atomic_inc(&transaction->t_updates);
 	atomic_inc(&transaction->t_handle_count);
@@ -507,6 +597,8 @@ void jbd2_journal_lock_updates(journal_t *journal)
 
 	write_lock(&journal->j_state_lock);
 	++journal->j_barrier_count;
+	/* Pairs with smp_mb() in start_this_handle_fast() */
+	smp_mb();
 
 	/* Wait until there are no running updates */
 	while (1) {
@@ -736,8 +828,9 @@ repeat:
 				JBUFFER_TRACE(jh, "allocate memory for buffer");
 				jbd_unlock_bh_state(bh);
 				frozen_buffer =
-					jbd2_alloc(jh2bh(jh)->b_size,
-							 GFP_NOFS);
+					jbd2_journal_alloc_frozen(journal,
+							jh2bh(jh)->b_size,
+							GFP_NOFS);
 				if (!frozen_buffer) {
 					printk(KERN_EMERG
 					       "%s: OOM for frozen_buffer\n",
@@ -804,7 +897,7 @@ done:
 
 out:
 	if (unlikely(frozen_buffer))	/* It's usually NULL */
-		jbd2_free(frozen_buffer, bh->b_size);
+		jbd2_journal_free_frozen(journal, frozen_buffer, bh->b_size);
 
 	JBUFFER_TRACE(jh, "exit");
 	return error;
@@ -821,11 +914,58 @@ out:
  * because we're write()ing a buffer which is also part of a shared mapping.
  */
 
+/*
+ * jbd2_write_access_granted: check, without taking any lock, whether the
+ * buffer is already part of the handle's transaction, in which case there
+ * is nothing for do_get_write_access() to do.
+ *
+ * The journal head may be freed and reused while we look at it, but its
+ * memory stays a journal head under rcu_read_lock().  A journal head that
+ * is attached to the running transaction stays attached to the same
+ * buffer until that transaction commits, so after the transaction test,
+ * we only need to recheck that the journal head still belongs to @bh.
+ */
+static int jbd2_write_access_granted(handle_t *handle, struct buffer_head *bh)
+{
+	struct journal_head *jh;
+	int ret = 0;
+
+	/* dirty buffers need the special handling of do_get_write_access() */
+	if (buffer_dirty(bh))
+		return 0;
+
+	rcu_read_lock();
+	if (!buffer_jbd(bh))
+		goto out;
+	jh = ACCESS_ONCE(bh->b_private);
+	if (!jh)
+		goto out;
+	if (jh->b_transaction != handle->h_transaction &&
+	    jh->b_next_transaction != handle->h_transaction)
+		goto out;
+	/*
+	 * Read b_bh after the transaction tests, to detect a journal head
+	 * that was freed, reused and attached while we were testing.
+	 * Also keeps the caller's access to @bh after the tests.
+	 */
+	smp_mb();
+	if (unlikely(jh->b_bh != bh))
+		goto out;
+	ret = 1;
+out:
+	rcu_read_unlock();
+	return ret;
+}
+
 int jbd2_journal_get_write_access(handle_t *handle, struct buffer_head *bh)
 {
-	struct journal_head *jh = jbd2_journal_add_journal_head(bh);
+	struct journal_head *jh;
 	int rc;
 
+	if (jbd2_write_access_granted(handle, bh))
+		return 0;
+
+	jh = jbd2_journal_add_journal_head(bh);
 	/* We do not want to get caught playing with fields which the
 	 * log thread also manipulates.  Make sure that the buffer
 	 * completes any outstanding IO before proceeding. */
@@ -876,7 +1016,6 @@ int jbd2_journal_get_create_access(handle_t *handle, struct buffer_head *bh)
 	 * reused here.
 	 */
 	jbd_lock_bh_state(bh);
-	spin_lock(&journal->j_list_lock);
 	J_ASSERT_JH(jh, (jh->b_transaction == transaction ||
 		jh->b_transaction == NULL ||
 		(jh->b_transaction == journal->j_committing_transaction &&
@@ -899,15 +1038,19 @@ int jbd2_journal_get_create_access(handle_t *handle, struct buffer_head *bh)
 		jh->b_modified = 0;
 
 		JBUFFER_TRACE(jh, "file as BJ_Reserved");
+		/* j_list_lock only to file the buffer, not for the checks */
+		spin_lock(&journal->j_list_lock);
 		__jbd2_journal_file_buffer(jh, transaction, BJ_Reserved);
+		spin_unlock(&journal->j_list_lock);
 	} else if (jh->b_transaction == journal->j_committing_transaction) {
 		/* first access by this transaction */
 		jh->b_modified = 0;
 
 		JBUFFER_TRACE(jh, "set next transaction");
+		spin_lock(&journal->j_list_lock);
 		jh->b_next_transaction = transaction;
+		spin_unlock(&journal->j_list_lock);
 	}
-	spin_unlock(&journal->j_list_lock);
 	jbd_unlock_bh_state(bh);
 
 	/*
@@ -969,7 +1112,9 @@ int jbd2_journal_get_undo_access(handle_t *handle, struct buffer_head *bh)
 
 repeat:
 	if (!jh->b_committed_data) {
-		committed_data = jbd2_alloc(jh2bh(jh)->b_size, GFP_NOFS);
+		committed_data = jbd2_journal_alloc_frozen(
+				handle->h_transaction->t_journal,
+				jh2bh(jh)->b_size, GFP_NOFS);
 		if (!committed_data) {
 			printk(KERN_EMERG "%s: No memory for committed data\n",
 				__func__);
@@ -996,7 +1141,8 @@ repeat:
 out:
 	jbd2_journal_put_journal_head(jh);
 	if (unlikely(committed_data))
-		jbd2_free(committed_data, bh->b_size);
+		jbd2_journal_free_frozen(handle->h_transaction->t_journal,
+					 committed_data, bh->b_size);
 	return err;
 }
 
@@ -1071,6 +1217,18 @@ int jbd2_journal_dirty_metadata(handle_t *handle, struct buffer_head *bh)
 	if (is_handle_aborted(handle))
 		goto out;
 
+	/*
+	 * Lockless fastpath: a buffer that was already modified and filed
+	 * as metadata of the running transaction stays so while we hold a
+	 * handle.  A stale read only sends us into the locked path below.
+	 */
+	if (ACCESS_ONCE(jh->b_modified) &&
+	    ACCESS_ONCE(jh->b_transaction) == transaction &&
+	    ACCESS_ONCE(jh->b_jlist) == BJ_Metadata) {
+		JBUFFER_TRACE(jh, "lockless fastpath");
+		goto out;
+	}
+
 	jbd_lock_bh_state(bh);
 
 	if (jh->b_modified == 0) {
@@ -2113,9 +2271,12 @@ void jbd2_journal_refile_buffer(journal_t *journal, struct journal_head *jh)
 }
 
 /*
- * File inode in the inode list of the handle's transaction
+ * File inode in the inode list of the handle's transaction, so that the
+ * commit writes out its ordered data in [start_byte, end_byte].
  */
-int jbd2_journal_file_inode(handle_t *handle, struct jbd2_inode *jinode)
+static int __jbd2_journal_file_inode(handle_t *handle,
+				     struct jbd2_inode *jinode,
+				     loff_t start_byte, loff_t end_byte)
 {
 	transaction_t *transaction = handle->h_transaction;
 	journal_t *journal = transaction->t_journal;
@@ -2137,14 +2298,27 @@ int jbd2_journal_file_inode(handle_t *handle, struct jbd2_inode *jinode)
 	 * because if jinode->i_transaction == transaction, commit code
 	 * cannot touch the transaction because we hold reference to it,
 	 * and if jinode->i_next_transaction == transaction, commit code
-	 * will only file the inode where we want it.
+	 * will only file the inode where we want it.  The dirty range only
+	 * grows while the inode is on the transaction, so if it already
+	 * covers ours there is nothing to do.
 	 */
-	if (jinode->i_transaction == transaction ||
-	    jinode->i_next_transaction == transaction)
+	if ((jinode->i_transaction == transaction ||
+	     jinode->i_next_transaction == transaction) &&
+	    jinode->i_dirty_end &&
+	    jinode->i_dirty_start <= start_byte &&
+	    jinode->i_dirty_end >= end_byte)
 		return 0;
 
 	spin_lock(&journal->j_list_lock);
 
+	if (jinode->i_dirty_end) {
+		jinode->i_dirty_start = min(jinode->i_dirty_start, start_byte);
+		jinode->i_dirty_end = max(jinode->i_dirty_end, end_byte);
+	} else {
+		jinode->i_dirty_start = start_byte;
+		jinode->i_dirty_end = end_byte;
+	}
+
 	if (jinode->i_transaction == transaction ||
 	    jinode->i_next_transaction == transaction)
 		goto done;
@@ -2175,6 +2349,24 @@ done:
 	return 0;
 }
 
+int jbd2_journal_file_inode(handle_t *handle, struct jbd2_inode *jinode)
+{
+	return __jbd2_journal_file_inode(handle, jinode, 0, LLONG_MAX);
+}
+
+/*
+ * Like jbd2_journal_file_inode(), but the commit only writes out and
+ * waits on @length bytes of data from @start instead of the whole file.
+ */
+int jbd2_journal_file_inode_range(handle_t *handle, struct jbd2_inode *jinode,
+				  loff_t start, loff_t length)
+{
+	if (!length)
+		return 0;
+	return __jbd2_journal_file_inode(handle, jinode, start,
+					 start + length - 1);
+}
+
 /*
  * File truncate and transaction commit interact with each other in a
  * non-trivial way.  If a transaction writing data block A is
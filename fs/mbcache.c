@@ -20,10 +20,11 @@
  * and may also be in the lru list. An invalid entry is not in any hashes
  * or lists.
  *
- * A valid cache entry is only in the lru list if no handles refer to it.
- * Invalid cache entries will be freed when the last handle to the cache
- * entry is released. Entries that cannot be freed immediately are put
- * back on the lru list.
+ * A valid cache entry is put on the lru list when the last handle to it
+ * is released, and stays there while it is looked up again: the lru list
+ * is maintained lazily, and entries that are found in use when the list is
+ * scanned are rotated to its tail instead. Invalid cache entries will be
+ * freed when the last handle to the cache entry is released.
  */
 
 #include <linux/kernel.h>
@@ -57,6 +58,9 @@
 
 #define MB_CACHE_WRITER ((unsigned short)~0U >> 1)
 
+/* Max lru list entries scanned for an entry to evict on allocation */
+#define MB_CACHE_ALLOC_SCAN 32
+
 static DECLARE_WAIT_QUEUE_HEAD(mb_cache_queue);
 		
 MODULE_AUTHOR("Andreas Gruenbacher <a.gruenbacher@computer.org>");
@@ -77,14 +81,21 @@ EXPORT_SYMBOL(mb_cache_entry_find_next);
 #endif
 
 /*
- * Global data: list of all mbcache's, lru list, and a spinlock for
- * accessing cache data structures on SMP machines. The lru list is
- * global across all mbcaches.
+ * Global data: list of all mbcache's, lru list, and the spinlocks
+ * protecting them. The lru list is global across all mbcaches.
+ *
+ * Each hash bucket of a cache has its own spinlock. The block hash lock of
+ * an entry (chosen by its device and block number) protects the entry's
+ * state (e_used, e_queued, lru list membership) and its block hash chain;
+ * the index hash lock protects the index hash chain. Locks nest in the
+ * order index hash lock -> block hash lock -> mb_cache_lru_lock. Scanners
+ * of the lru list only ever trylock the hash locks.
  */
 
 static LIST_HEAD(mb_cache_list);
 static LIST_HEAD(mb_cache_lru_list);
 static DEFINE_SPINLOCK(mb_cache_spinlock);
+static DEFINE_SPINLOCK(mb_cache_lru_lock);
 
 /*
  * What the mbcache registers as to get shrunk dynamically.
@@ -98,6 +109,57 @@ static struct shrinker mb_cache_shrinker = {
 	.seeks = DEFAULT_SEEKS,
 };
 
+static inline unsigned int
+__mb_cache_block_bucket(struct mb_cache *cache, struct block_device *bdev,
+			sector_t block)
+{
+	return hash_long((unsigned long)bdev + (block & 0xffffffff),
+			 cache->c_bucket_bits);
+}
+
+static inline unsigned int
+__mb_cache_index_bucket(struct mb_cache *cache, unsigned int key)
+{
+	return hash_long(key, cache->c_bucket_bits);
+}
+
+static inline spinlock_t *
+__mb_cache_entry_block_lock(struct mb_cache_entry *ce)
+{
+	struct mb_cache *cache = ce->e_cache;
+
+	return &cache->c_block_locks[__mb_cache_block_bucket(cache,
+					ce->e_bdev, ce->e_block)];
+}
+
+static inline spinlock_t *
+__mb_cache_entry_index_lock(struct mb_cache_entry *ce)
+{
+	struct mb_cache *cache = ce->e_cache;
+
+	return &cache->c_index_locks[__mb_cache_index_bucket(cache,
+					ce->e_index.o_key)];
+}
+
+/*
+ * Trylock both hash locks of an entry found on the lru list, which is held
+ * locked by the caller.
+ */
+static int
+__mb_cache_entry_trylock(struct mb_cache_entry *ce, spinlock_t **index_lock,
+			 spinlock_t **block_lock)
+{
+	*index_lock = __mb_cache_entry_index_lock(ce);
+	*block_lock = __mb_cache_entry_block_lock(ce);
+	if (!spin_trylock(*index_lock))
+		return 0;
+	if (!spin_trylock(*block_lock)) {
+		spin_unlock(*index_lock);
+		return 0;
+	}
+	return 1;
+}
+
 static inline int
 __mb_cache_entry_is_hashed(struct mb_cache_entry *ce)
 {
@@ -127,8 +189,9 @@ __mb_cache_entry_forget(struct mb_cache_entry *ce, gfp_t gfp_mask)
 
 
 static void
-__mb_cache_entry_release_unlock(struct mb_cache_entry *ce)
-	__releases(mb_cache_spinlock)
+__mb_cache_entry_release_unlock(struct mb_cache_entry *ce,
+				spinlock_t *block_lock)
+	__releases(block_lock)
 {
 	/* Wake up all processes queuing for this cache entry. */
 	if (ce->e_queued)
@@ -139,17 +202,93 @@ __mb_cache_entry_release_unlock(struct mb_cache_entry *ce)
 	if (!(ce->e_used || ce->e_queued)) {
 		if (!__mb_cache_entry_is_hashed(ce))
 			goto forget;
-		mb_assert(list_empty(&ce->e_lru_list));
-		list_add_tail(&ce->e_lru_list, &mb_cache_lru_list);
+		if (list_empty(&ce->e_lru_list)) {
+			spin_lock(&mb_cache_lru_lock);
+			list_add_tail(&ce->e_lru_list, &mb_cache_lru_list);
+			spin_unlock(&mb_cache_lru_lock);
+		}
 	}
-	spin_unlock(&mb_cache_spinlock);
+	spin_unlock(block_lock);
 	return;
 forget:
-	spin_unlock(&mb_cache_spinlock);
+	spin_unlock(block_lock);
 	__mb_cache_entry_forget(ce, GFP_KERNEL);
 }
 
 
+/*
+ * __mb_cache_lru_isolate()
+ *
+ * Scans up to @nr_to_scan entries on the lru list (of @cache only, unless
+ * @cache is NULL; entries of other caches are skipped and not counted),
+ * unhashes the unused ones and moves them to @free_list.
+ * Entries that are in use or whose hash locks are contended are rotated to
+ * the tail of the lru list. Called with mb_cache_lru_lock held.
+ */
+static void
+__mb_cache_lru_isolate(struct mb_cache *cache, int nr_to_scan,
+		       struct list_head *free_list)
+{
+	struct mb_cache_entry *ce, *tmp;
+	spinlock_t *index_lock, *block_lock;
+
+	list_for_each_entry_safe(ce, tmp, &mb_cache_lru_list, e_lru_list) {
+		if (cache && ce->e_cache != cache)
+			continue;
+		if (nr_to_scan-- <= 0)
+			break;
+		if (!__mb_cache_entry_trylock(ce, &index_lock, &block_lock)) {
+			list_move_tail(&ce->e_lru_list, &mb_cache_lru_list);
+			continue;
+		}
+		if (ce->e_used || ce->e_queued) {
+			list_move_tail(&ce->e_lru_list, &mb_cache_lru_list);
+		} else {
+			list_move_tail(&ce->e_lru_list, free_list);
+			__mb_cache_entry_unhash(ce);
+		}
+		spin_unlock(block_lock);
+		spin_unlock(index_lock);
+	}
+}
+
+
+/*
+ * __mb_cache_lru_remove()
+ *
+ * Unhashes all unused entries on the lru list that belong to @cache or to
+ * @bdev and moves them to @free_list. Unlike __mb_cache_lru_isolate(), this
+ * does not give up on contended entries but retries until the whole list
+ * has been processed.
+ */
+static void
+__mb_cache_lru_remove(struct mb_cache *cache, struct block_device *bdev,
+		      struct list_head *free_list)
+{
+	struct mb_cache_entry *ce, *tmp;
+	spinlock_t *index_lock, *block_lock;
+
+again:
+	spin_lock(&mb_cache_lru_lock);
+	list_for_each_entry_safe(ce, tmp, &mb_cache_lru_list, e_lru_list) {
+		if (ce->e_cache != cache && ce->e_bdev != bdev)
+			continue;
+		if (!__mb_cache_entry_trylock(ce, &index_lock, &block_lock)) {
+			spin_unlock(&mb_cache_lru_lock);
+			cpu_relax();
+			goto again;
+		}
+		if (!(ce->e_used || ce->e_queued)) {
+			list_move_tail(&ce->e_lru_list, free_list);
+			__mb_cache_entry_unhash(ce);
+		}
+		spin_unlock(block_lock);
+		spin_unlock(index_lock);
+	}
+	spin_unlock(&mb_cache_lru_lock);
+}
+
+
 /*
  * mb_cache_shrink_fn()  memory pressure callback
  *
@@ -172,14 +311,12 @@ mb_cache_shrink_fn(struct shrinker *shrink, struct shrink_control *sc)
 	gfp_t gfp_mask = sc->gfp_mask;
 
 	mb_debug("trying to free %d entries", nr_to_scan);
-	spin_lock(&mb_cache_spinlock);
-	while (nr_to_scan-- && !list_empty(&mb_cache_lru_list)) {
-		struct mb_cache_entry *ce =
-			list_entry(mb_cache_lru_list.next,
-				   struct mb_cache_entry, e_lru_list);
-		list_move_tail(&ce->e_lru_list, &free_list);
-		__mb_cache_entry_unhash(ce);
+	if (nr_to_scan) {
+		spin_lock(&mb_cache_lru_lock);
+		__mb_cache_lru_isolate(NULL, nr_to_scan, &free_list);
+		spin_unlock(&mb_cache_lru_lock);
 	}
+	spin_lock(&mb_cache_spinlock);
 	list_for_each_entry(cache, &mb_cache_list, c_cache_list) {
 		mb_debug("cache %s (%d)", cache->c_name,
 			  atomic_read(&cache->c_entry_count));
@@ -210,7 +347,7 @@ mb_cache_create(const char *name, int bucket_bits)
 	int n, bucket_count = 1 << bucket_bits;
 	struct mb_cache *cache = NULL;
 
-	cache = kmalloc(sizeof(struct mb_cache), GFP_KERNEL);
+	cache = kzalloc(sizeof(struct mb_cache), GFP_KERNEL);
 	if (!cache)
 		return NULL;
 	cache->c_name = name;
@@ -228,11 +365,23 @@ mb_cache_create(const char *name, int bucket_bits)
 		goto fail;
 	for (n=0; n<bucket_count; n++)
 		INIT_LIST_HEAD(&cache->c_index_hash[n]);
+	cache->c_block_locks = kmalloc(bucket_count * sizeof(spinlock_t),
+				       GFP_KERNEL);
+	if (!cache->c_block_locks)
+		goto fail;
+	for (n=0; n<bucket_count; n++)
+		spin_lock_init(&cache->c_block_locks[n]);
+	cache->c_index_locks = kmalloc(bucket_count * sizeof(spinlock_t),
+				       GFP_KERNEL);
+	if (!cache->c_index_locks)
+		goto fail;
+	for (n=0; n<bucket_count; n++)
+		spin_lock_init(&cache->c_index_locks[n]);
 	cache->c_entry_cache = kmem_cache_create(name,
 		sizeof(struct mb_cache_entry), 0,
 		SLAB_RECLAIM_ACCOUNT|SLAB_MEM_SPREAD, NULL);
 	if (!cache->c_entry_cache)
-		goto fail2;
+		goto fail;
 
 	/*
 	 * Set an upper limit on the number of cache entries so that the hash
@@ -245,10 +394,10 @@ mb_cache_create(const char *name, int bucket_bits)
 	spin_unlock(&mb_cache_spinlock);
 	return cache;
 
-fail2:
-	kfree(cache->c_index_hash);
-
 fail:
+	kfree(cache->c_index_locks);
+	kfree(cache->c_block_locks);
+	kfree(cache->c_index_hash);
 	kfree(cache->c_block_hash);
 	kfree(cache);
 	return NULL;
@@ -270,16 +419,7 @@ mb_cache_shrink(struct block_device *bdev)
 	LIST_HEAD(free_list);
 	struct list_head *l, *ltmp;
 
-	spin_lock(&mb_cache_spinlock);
-	list_for_each_safe(l, ltmp, &mb_cache_lru_list) {
-		struct mb_cache_entry *ce =
-			list_entry(l, struct mb_cache_entry, e_lru_list);
-		if (ce->e_bdev == bdev) {
-			list_move_tail(&ce->e_lru_list, &free_list);
-			__mb_cache_entry_unhash(ce);
-		}
-	}
-	spin_unlock(&mb_cache_spinlock);
+	__mb_cache_lru_remove(NULL, bdev, &free_list);
 	list_for_each_safe(l, ltmp, &free_list) {
 		__mb_cache_entry_forget(list_entry(l, struct mb_cache_entry,
 						   e_lru_list), GFP_KERNEL);
@@ -300,15 +440,8 @@ mb_cache_destroy(struct mb_cache *cache)
 	LIST_HEAD(free_list);
 	struct list_head *l, *ltmp;
 
+	__mb_cache_lru_remove(cache, NULL, &free_list);
 	spin_lock(&mb_cache_spinlock);
-	list_for_each_safe(l, ltmp, &mb_cache_lru_list) {
-		struct mb_cache_entry *ce =
-			list_entry(l, struct mb_cache_entry, e_lru_list);
-		if (ce->e_cache == cache) {
-			list_move_tail(&ce->e_lru_list, &free_list);
-			__mb_cache_entry_unhash(ce);
-		}
-	}
 	list_del(&cache->c_cache_list);
 	spin_unlock(&mb_cache_spinlock);
 
@@ -325,6 +458,8 @@ mb_cache_destroy(struct mb_cache *cache)
 
 	kmem_cache_destroy(cache->c_entry_cache);
 
+	kfree(cache->c_index_locks);
+	kfree(cache->c_block_locks);
 	kfree(cache->c_index_hash);
 	kfree(cache->c_block_hash);
 	kfree(cache);
@@ -341,28 +476,28 @@ mb_cache_destroy(struct mb_cache *cache)
 struct mb_cache_entry *
 mb_cache_entry_alloc(struct mb_cache *cache, gfp_t gfp_flags)
 {
-	struct mb_cache_entry *ce = NULL;
+	LIST_HEAD(free_list);
+	struct mb_cache_entry *ce, *tmp;
 
 	if (atomic_read(&cache->c_entry_count) >= cache->c_max_entries) {
-		spin_lock(&mb_cache_spinlock);
-		if (!list_empty(&mb_cache_lru_list)) {
-			ce = list_entry(mb_cache_lru_list.next,
-					struct mb_cache_entry, e_lru_list);
-			list_del_init(&ce->e_lru_list);
-			__mb_cache_entry_unhash(ce);
-		}
-		spin_unlock(&mb_cache_spinlock);
-	}
-	if (!ce) {
-		ce = kmem_cache_alloc(cache->c_entry_cache, gfp_flags);
-		if (!ce)
-			return NULL;
-		atomic_inc(&cache->c_entry_count);
-		INIT_LIST_HEAD(&ce->e_lru_list);
-		INIT_LIST_HEAD(&ce->e_block_list);
-		ce->e_cache = cache;
-		ce->e_queued = 0;
+		/* Make room by evicting an unused entry of this cache. */
+		spin_lock(&mb_cache_lru_lock);
+		__mb_cache_lru_isolate(cache, MB_CACHE_ALLOC_SCAN, &free_list);
+		spin_unlock(&mb_cache_lru_lock);
+		list_for_each_entry_safe(ce, tmp, &free_list, e_lru_list)
+			__mb_cache_entry_forget(ce, gfp_flags);
 	}
+	ce = kmem_cache_alloc(cache->c_entry_cache, gfp_flags);
+	if (!ce)
+		return NULL;
+	atomic_inc(&cache->c_entry_count);
+	INIT_LIST_HEAD(&ce->e_lru_list);
+	INIT_LIST_HEAD(&ce->e_block_list);
+	ce->e_cache = cache;
+	ce->e_queued = 0;
+	ce->e_bdev = NULL;
+	ce->e_block = 0;
+	ce->e_index.o_key = 0;
 	ce->e_used = 1 + MB_CACHE_WRITER;
 	return ce;
 }
@@ -387,29 +522,30 @@ mb_cache_entry_insert(struct mb_cache_entry *ce, struct block_device *bdev,
 		      sector_t block, unsigned int key)
 {
 	struct mb_cache *cache = ce->e_cache;
-	unsigned int bucket;
+	unsigned int bucket, index_bucket;
 	struct list_head *l;
 	int error = -EBUSY;
 
-	bucket = hash_long((unsigned long)bdev + (block & 0xffffffff), 
-			   cache->c_bucket_bits);
-	spin_lock(&mb_cache_spinlock);
+	mb_assert(!__mb_cache_entry_is_hashed(ce));
+	bucket = __mb_cache_block_bucket(cache, bdev, block);
+	index_bucket = __mb_cache_index_bucket(cache, key);
+	spin_lock(&cache->c_index_locks[index_bucket]);
+	spin_lock(&cache->c_block_locks[bucket]);
 	list_for_each_prev(l, &cache->c_block_hash[bucket]) {
 		struct mb_cache_entry *ce =
 			list_entry(l, struct mb_cache_entry, e_block_list);
 		if (ce->e_bdev == bdev && ce->e_block == block)
 			goto out;
 	}
-	__mb_cache_entry_unhash(ce);
 	ce->e_bdev = bdev;
 	ce->e_block = block;
 	list_add(&ce->e_block_list, &cache->c_block_hash[bucket]);
 	ce->e_index.o_key = key;
-	bucket = hash_long(key, cache->c_bucket_bits);
-	list_add(&ce->e_index.o_list, &cache->c_index_hash[bucket]);
+	list_add(&ce->e_index.o_list, &cache->c_index_hash[index_bucket]);
 	error = 0;
 out:
-	spin_unlock(&mb_cache_spinlock);
+	spin_unlock(&cache->c_block_locks[bucket]);
+	spin_unlock(&cache->c_index_locks[index_bucket]);
 	return error;
 }
 
@@ -424,8 +560,10 @@ out:
 void
 mb_cache_entry_release(struct mb_cache_entry *ce)
 {
-	spin_lock(&mb_cache_spinlock);
-	__mb_cache_entry_release_unlock(ce);
+	spinlock_t *block_lock = __mb_cache_entry_block_lock(ce);
+
+	spin_lock(block_lock);
+	__mb_cache_entry_release_unlock(ce, block_lock);
 }
 
 
@@ -438,10 +576,19 @@ mb_cache_entry_release(struct mb_cache_entry *ce)
 void
 mb_cache_entry_free(struct mb_cache_entry *ce)
 {
-	spin_lock(&mb_cache_spinlock);
-	mb_assert(list_empty(&ce->e_lru_list));
+	spinlock_t *index_lock = __mb_cache_entry_index_lock(ce);
+	spinlock_t *block_lock = __mb_cache_entry_block_lock(ce);
+
+	spin_lock(index_lock);
+	spin_lock(block_lock);
 	__mb_cache_entry_unhash(ce);
-	__mb_cache_entry_release_unlock(ce);
+	if (!list_empty(&ce->e_lru_list)) {
+		spin_lock(&mb_cache_lru_lock);
+		list_del_init(&ce->e_lru_list);
+		spin_unlock(&mb_cache_lru_lock);
+	}
+	spin_unlock(index_lock);
+	__mb_cache_entry_release_unlock(ce, block_lock);
 }
 
 
@@ -458,34 +605,32 @@ mb_cache_entry_get(struct mb_cache *cache, struct block_device *bdev,
 		   sector_t block)
 {
 	unsigned int bucket;
+	spinlock_t *block_lock;
 	struct list_head *l;
 	struct mb_cache_entry *ce;
 
-	bucket = hash_long((unsigned long)bdev + (block & 0xffffffff),
-			   cache->c_bucket_bits);
-	spin_lock(&mb_cache_spinlock);
+	bucket = __mb_cache_block_bucket(cache, bdev, block);
+	block_lock = &cache->c_block_locks[bucket];
+	spin_lock(block_lock);
 	list_for_each(l, &cache->c_block_hash[bucket]) {
 		ce = list_entry(l, struct mb_cache_entry, e_block_list);
 		if (ce->e_bdev == bdev && ce->e_block == block) {
 			DEFINE_WAIT(wait);
 
-			if (!list_empty(&ce->e_lru_list))
-				list_del_init(&ce->e_lru_list);
-
 			while (ce->e_used > 0) {
 				ce->e_queued++;
 				prepare_to_wait(&mb_cache_queue, &wait,
 						TASK_UNINTERRUPTIBLE);
-				spin_unlock(&mb_cache_spinlock);
+				spin_unlock(block_lock);
 				schedule();
-				spin_lock(&mb_cache_spinlock);
+				spin_lock(block_lock);
 				ce->e_queued--;
 			}
 			finish_wait(&mb_cache_queue, &wait);
 			ce->e_used += 1 + MB_CACHE_WRITER;
 
 			if (!__mb_cache_entry_is_hashed(ce)) {
-				__mb_cache_entry_release_unlock(ce);
+				__mb_cache_entry_release_unlock(ce, block_lock);
 				return NULL;
 			}
 			goto cleanup;
@@ -494,24 +639,32 @@ mb_cache_entry_get(struct mb_cache *cache, struct block_device *bdev,
 	ce = NULL;
 
 cleanup:
-	spin_unlock(&mb_cache_spinlock);
+	spin_unlock(block_lock);
 	return ce;
 }
 
 #if !defined(MB_CACHE_INDEXES_COUNT) || (MB_CACHE_INDEXES_COUNT > 0)
 
+/*
+ * Called with the index hash lock held, which is released before return.
+ * A matching entry is pinned by taking its block hash lock before the
+ * index hash lock is dropped: it cannot be unhashed without both.
+ */
 static struct mb_cache_entry *
 __mb_cache_entry_find(struct list_head *l, struct list_head *head,
-		      struct block_device *bdev, unsigned int key)
+		      struct block_device *bdev, unsigned int key,
+		      spinlock_t *index_lock)
+	__releases(index_lock)
 {
 	while (l != head) {
 		struct mb_cache_entry *ce =
 			list_entry(l, struct mb_cache_entry, e_index.o_list);
 		if (ce->e_bdev == bdev && ce->e_index.o_key == key) {
+			spinlock_t *block_lock = __mb_cache_entry_block_lock(ce);
 			DEFINE_WAIT(wait);
 
-			if (!list_empty(&ce->e_lru_list))
-				list_del_init(&ce->e_lru_list);
+			spin_lock(block_lock);
+			spin_unlock(index_lock);
 
 			/* Incrementing before holding the lock gives readers
 			   priority over writers. */
@@ -520,22 +673,23 @@ __mb_cache_entry_find(struct list_head *l, struct list_head *head,
 				ce->e_queued++;
 				prepare_to_wait(&mb_cache_queue, &wait,
 						TASK_UNINTERRUPTIBLE);
-				spin_unlock(&mb_cache_spinlock);
+				spin_unlock(block_lock);
 				schedule();
-				spin_lock(&mb_cache_spinlock);
+				spin_lock(block_lock);
 				ce->e_queued--;
 			}
 			finish_wait(&mb_cache_queue, &wait);
 
 			if (!__mb_cache_entry_is_hashed(ce)) {
-				__mb_cache_entry_release_unlock(ce);
-				spin_lock(&mb_cache_spinlock);
+				__mb_cache_entry_release_unlock(ce, block_lock);
 				return ERR_PTR(-EAGAIN);
 			}
+			spin_unlock(block_lock);
 			return ce;
 		}
 		l = l->next;
 	}
+	spin_unlock(index_lock);
 	return NULL;
 }
 
@@ -556,15 +710,14 @@ struct mb_cache_entry *
 mb_cache_entry_find_first(struct mb_cache *cache, struct block_device *bdev,
 			  unsigned int key)
 {
-	unsigned int bucket = hash_long(key, cache->c_bucket_bits);
+	unsigned int bucket = __mb_cache_index_bucket(cache, key);
+	spinlock_t *index_lock = &cache->c_index_locks[bucket];
 	struct list_head *l;
-	struct mb_cache_entry *ce;
 
-	spin_lock(&mb_cache_spinlock);
+	spin_lock(index_lock);
 	l = cache->c_index_hash[bucket].next;
-	ce = __mb_cache_entry_find(l, &cache->c_index_hash[bucket], bdev, key);
-	spin_unlock(&mb_cache_spinlock);
-	return ce;
+	return __mb_cache_entry_find(l, &cache->c_index_hash[bucket], bdev,
+				     key, index_lock);
 }
 
 
@@ -591,14 +744,17 @@ mb_cache_entry_find_next(struct mb_cache_entry *prev,
 			 struct block_device *bdev, unsigned int key)
 {
 	struct mb_cache *cache = prev->e_cache;
-	unsigned int bucket = hash_long(key, cache->c_bucket_bits);
+	unsigned int bucket = __mb_cache_index_bucket(cache, key);
+	spinlock_t *index_lock = &cache->c_index_locks[bucket];
 	struct list_head *l;
 	struct mb_cache_entry *ce;
 
-	spin_lock(&mb_cache_spinlock);
+	/* prev is in use, so it stays hashed until it is released below */
+	spin_lock(index_lock);
 	l = prev->e_index.o_list.next;
-	ce = __mb_cache_entry_find(l, &cache->c_index_hash[bucket], bdev, key);
-	__mb_cache_entry_release_unlock(prev);
+	ce = __mb_cache_entry_find(l, &cache->c_index_hash[bucket], bdev,
+				   key, index_lock);
+	mb_cache_entry_release(prev);
 	return ce;
 }
 
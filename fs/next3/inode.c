@@ -514,6 +514,45 @@ static next3_fsblk_t next3_find_goal(struct inode *inode, long block,
 	return next3_find_near(inode, partial);
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MOVE_RSV
+/**
+ *	next3_find_rsv_goal - prefer the inode's reservation window.
+ *	@inode: owner
+ *	@goal: goal block returned by next3_find_goal()
+ *
+ *	On move-on-write, next3_find_goal() returns a goal near the block that
+ *	is being moved to snapshot.  The blocks around it are either in use by
+ *	the file or reserved in the file's window, so the allocation would
+ *	either discard the file's window or fragment the free space around it.
+ *	If the inode has a reservation window and @goal is outside of it,
+ *	return the next block in the window instead.
+ *
+ *	Caller must hold truncate_mutex of @inode, which protects its window.
+ */
+static next3_fsblk_t next3_find_rsv_goal(struct inode *inode,
+		next3_fsblk_t goal)
+{
+	struct next3_block_alloc_info *block_i;
+	struct next3_reserve_window *rsv;
+	next3_fsblk_t next;
+
+	block_i = NEXT3_I(inode)->i_block_alloc_info;
+	if (!block_i || !block_i->rsv_window_node.rsv_goal_size)
+		return goal;
+	rsv = &block_i->rsv_window_node.rsv_window;
+	if (rsv->_rsv_end == NEXT3_RESERVE_WINDOW_NOT_ALLOCATED)
+		return goal;
+	if (goal >= rsv->_rsv_start && goal <= rsv->_rsv_end)
+		return goal;
+	/* continue from the last block allocated in the window */
+	next = block_i->last_alloc_physical_block + 1;
+	if (next > rsv->_rsv_start && next <= rsv->_rsv_end)
+		return next;
+	return rsv->_rsv_start;
+}
+
+#endif
+
 /**
  *	next3_blks_to_allocate: Look up the block map and count the number
  *	of direct blocks need to be allocated for the given branch.
@@ -1586,6 +1625,14 @@ retry:
 		next3_init_block_alloc_info(inode);
 
 	goal = next3_find_goal(inode, iblock, partial);
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_BLOCK_MOVE_RSV
+	/*
+	 * Replacing a block that is moved to snapshot or mapping a moved
+	 * block into snapshot - allocate from the inode's own window.
+	 */
+	if (*(partial->p) || SNAPMAP_ISMOVE(create))
+		goal = next3_find_rsv_goal(inode, goal);
+#endif
 
 	/* the number of blocks need to allocate for [d,t]indirect blocks */
 	indirect_blks = (chain + depth) - partial - 1;
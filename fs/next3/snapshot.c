@@ -970,6 +970,9 @@ int next3_snapshot_test_and_cow(const char *where, handle_t *handle,
 	struct buffer_head *sbh = NULL;
 	next3_fsblk_t block = bh->b_blocknr, blk = 0;
 	int err = 0, clear = 0;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_FILES_NOZERO
+	int zeroed = 0;
+#endif
 
 	if (!active_snapshot)
 		/* no active snapshot - no need to COW */
@@ -1097,7 +1100,21 @@ int next3_snapshot_test_and_cow(const char *where, handle_t *handle,
 	/* sleep 1 tunable delay unit */
 	snapshot_test_delay(SNAPTEST_COW);
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_FILES_NOZERO
+	if (clear) {
+		/*
+		 * excluded file data would be zeroed right after the copy -
+		 * write the new snapshot block only once, with zeros
+		 */
+		memset(sbh->b_data, 0, SNAPSHOT_BLOCK_SIZE);
+		set_buffer_uptodate(sbh);
+		err = next3_snapshot_complete_cow(handle, sbh, bh, 0);
+		zeroed = 1;
+	} else
+		err = next3_snapshot_copy_buffer_cow(handle, sbh, bh);
+#else
 	err = next3_snapshot_copy_buffer_cow(handle, sbh, bh);
+#endif
 	if (err)
 		goto out;
 	snapshot_debug(3, "block [%lu/%lu] of snapshot (%u) "
@@ -1114,7 +1131,11 @@ test_pending_cow:
 		next3_snapshot_test_pending_cow(sbh, block);
 #endif
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_FILES
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_FILES_NOZERO
+	if (clear && blk && !zeroed) {
+#else
 	if (clear && blk) {
+#endif
 		/*
 		 * XXX: Experimental code
 		 * zero out snapshot block data
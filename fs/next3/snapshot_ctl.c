@@ -15,6 +15,9 @@
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_CTL_RESERVE
 #include <linux/statfs.h>
 #endif
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_INODE_RA
+#include <linux/blkdev.h>
+#endif
 #include "snapshot.h"
 
 #ifdef CONFIG_NEXT3_FS_SNAPSHOT_FILE
@@ -1867,6 +1870,36 @@ out:
 	return exclude_bitmap;
 }
 
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_INODE_RA
+/*
+ * next3_exclude_inode_readahead - readahead exclude inode indirect blocks
+ * @inode:	exclude inode
+ * @max_groups:	number of block groups to cover
+ *
+ * Helper function for next3_snapshot_init_bitmap_cache().
+ * Submit reads of all allocated IND branch blocks under a single plug, so
+ * the following next3_exclude_inode_bread() calls find them in cache.
+ */
+static void next3_exclude_inode_readahead(struct inode *inode, int max_groups)
+{
+	int n = DIV_ROUND_UP(max_groups, SNAPSHOT_ADDR_PER_BLOCK);
+	struct buffer_head *bh;
+	struct blk_plug plug;
+	int i, err;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < n; i++) {
+		bh = next3_getblk(NULL, inode, NEXT3_IND_BLOCK + i, 0, &err);
+		if (!bh)
+			continue;
+		if (!buffer_uptodate(bh))
+			ll_rw_block(READ_META, 1, &bh);
+		brelse(bh);
+	}
+	blk_finish_plug(&plug);
+}
+
+#endif
 /*
  * next3_snapshot_init_bitmap_cache():
  *
@@ -1885,6 +1918,9 @@ static int next3_snapshot_init_bitmap_cache(struct super_block *sb, int create)
 	struct next3_sb_info *sbi = NEXT3_SB(sb);
 	handle_t *handle = NULL;
 	struct inode *inode;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_INODE_RA
+	struct buffer_head *ind_bh = NULL;
+#endif
 	__le32 exclude_bitmap = 0;
 	int grp, max_groups = sbi->s_groups_count;
 	int err = 0, ret;
@@ -1941,9 +1977,33 @@ static int next3_snapshot_init_bitmap_cache(struct super_block *sb, int create)
 	 * allocate indirect blocks for all reserved block groups.
 	 */
 	err = -EIO;
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_INODE_RA
+	next3_exclude_inode_readahead(inode, max_groups);
+#endif
 	for (grp = 0; grp < max_groups; grp++, gi++) {
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_INODE_RA
+		if (grp % SNAPSHOT_ADDR_PER_BLOCK == 0) {
+			/* move on to the next indirect block */
+			brelse(ind_bh);
+			ind_bh = next3_exclude_inode_bread(NULL, inode, grp, 0);
+		}
+		exclude_bitmap = 0;
+		if (ind_bh && grp < sbi->s_groups_count)
+			exclude_bitmap = ((__le32 *)ind_bh->b_data)
+				[grp % SNAPSHOT_ADDR_PER_BLOCK];
+		if (create && (!ind_bh ||
+			       (!exclude_bitmap && grp < sbi->s_groups_count))) {
+			/* allocate missing exclude bitmap or indirect block */
+			exclude_bitmap = next3_exclude_inode_getblk(handle,
+					inode, grp, create);
+			if (!ind_bh)
+				ind_bh = next3_exclude_inode_bread(NULL, inode,
+						grp, 0);
+		}
+#else
 		exclude_bitmap = next3_exclude_inode_getblk(handle, inode, grp,
 				create);
+#endif
 		cond_resched();
 		if (create && grp >= sbi->s_groups_count)
 			/* only allocating indirect blocks with getblk above */
@@ -1969,6 +2029,9 @@ static int next3_snapshot_init_bitmap_cache(struct super_block *sb, int create)
 	NEXT3_I(inode)->i_disksize = i_size;
 	err = next3_mark_inode_dirty(handle, inode);
 out:
+#ifdef CONFIG_NEXT3_FS_SNAPSHOT_EXCLUDE_INODE_RA
+	brelse(ind_bh);
+#endif
 	if (handle) {
 		ret = next3_journal_stop(handle);
 		if (!err)
@@ -922,22 +922,14 @@ static int test_bdev_super(struct super_block *s, void *data)
 	return (void *)s->s_bdev == data;
 }
 
-struct dentry *mount_bdev(struct file_system_type *fs_type,
-	int flags, const char *dev_name, void *data,
+/* mount the file system on @bdev, which was opened with @mode */
+static struct dentry *__mount_bdev(struct file_system_type *fs_type,
+	int flags, struct block_device *bdev, fmode_t mode, void *data,
 	int (*fill_super)(struct super_block *, void *, int))
 {
-	struct block_device *bdev;
 	struct super_block *s;
-	fmode_t mode = FMODE_READ | FMODE_EXCL;
 	int error = 0;
 
-	if (!(flags & MS_RDONLY))
-		mode |= FMODE_WRITE;
-
-	bdev = blkdev_get_by_path(dev_name, mode, fs_type);
-	if (IS_ERR(bdev))
-		return ERR_CAST(bdev);
-
 	/*
 	 * once the super is inserted into the list by sget, s_umount
 	 * will protect the lockfs code from trying to start a snapshot
@@ -997,8 +989,45 @@ error_bdev:
 error:
 	return ERR_PTR(error);
 }
+
+struct dentry *mount_bdev(struct file_system_type *fs_type,
+	int flags, const char *dev_name, void *data,
+	int (*fill_super)(struct super_block *, void *, int))
+{
+	struct block_device *bdev;
+	fmode_t mode = FMODE_READ | FMODE_EXCL;
+
+	if (!(flags & MS_RDONLY))
+		mode |= FMODE_WRITE;
+
+	bdev = blkdev_get_by_path(dev_name, mode, fs_type);
+	if (IS_ERR(bdev))
+		return ERR_CAST(bdev);
+	return __mount_bdev(fs_type, flags, bdev, mode, data, fill_super);
+}
 EXPORT_SYMBOL(mount_bdev);
 
+/*
+ * Like mount_bdev(), for file systems that the kernel mounts on a block
+ * device it knows by number, which may have no device node.
+ */
+struct dentry *mount_bdev_dev(struct file_system_type *fs_type,
+	int flags, dev_t dev, void *data,
+	int (*fill_super)(struct super_block *, void *, int))
+{
+	struct block_device *bdev;
+	fmode_t mode = FMODE_READ | FMODE_EXCL;
+
+	if (!(flags & MS_RDONLY))
+		mode |= FMODE_WRITE;
+
+	bdev = blkdev_get_by_dev(dev, mode, fs_type);
+	if (IS_ERR(bdev))
+		return ERR_CAST(bdev);
+	return __mount_bdev(fs_type, flags, bdev, mode, data, fill_super);
+}
+EXPORT_SYMBOL(mount_bdev_dev);
+
 void kill_block_super(struct super_block *sb)
 {
 	struct block_device *bdev = sb->s_bdev;
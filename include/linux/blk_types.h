@@ -61,6 +61,11 @@ struct bio {
 
 	unsigned int		bi_comp_cpu;	/* completion CPU */
 
+#ifdef CONFIG_BLK_CGROUP
+	/* css id of the blkio cgroup to charge, 0 for the submitting task */
+	unsigned short		bi_blkcg_id;
+#endif
+
 	atomic_t		bi_cnt;		/* pin count */
 
 	struct bio_vec		*bi_io_vec;	/* the actual vec list */
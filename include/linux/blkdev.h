@@ -1176,6 +1176,8 @@ static inline uint64_t rq_io_start_time_ns(struct request *req)
 {
         return req->io_start_time_ns;
 }
+
+extern unsigned short blkio_cgroup_charge_cow(unsigned int bytes);
 #else
 static inline void set_start_time_ns(struct request *req) {}
 static inline void set_io_start_time_ns(struct request *req) {}
@@ -1187,6 +1189,11 @@ static inline uint64_t rq_io_start_time_ns(struct request *req)
 {
 	return 0;
 }
+
+static inline unsigned short blkio_cgroup_charge_cow(unsigned int bytes)
+{
+	return 0;
+}
 #endif
 
 #ifdef CONFIG_BLK_DEV_THROTTLING
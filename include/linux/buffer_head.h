@@ -72,6 +72,10 @@ struct buffer_head {
 	struct address_space *b_assoc_map;	/* mapping this buffer is
 						   associated with */
 	atomic_t b_count;		/* users using this buffer_head */
+#ifdef CONFIG_BLK_CGROUP
+	unsigned short b_blkcg_id;	/* blkio cgroup to charge the next
+					   write to (see submit_bh) */
+#endif
 };
 
 /*
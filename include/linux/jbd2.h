@@ -30,7 +30,9 @@
 #include <linux/bit_spinlock.h>
 #include <linux/mutex.h>
 #include <linux/timer.h>
+#include <linux/workqueue.h>
 #include <linux/slab.h>
+#include <linux/rcupdate.h>
 #endif
 
 #define journal_oom_retry 1
@@ -73,6 +75,9 @@ extern u8 jbd2_journal_enable_debug;
 extern void *jbd2_alloc(size_t size, gfp_t flags);
 extern void jbd2_free(void *ptr, size_t size);
 
+/* Upper limit of the preallocated frozen data buffers pool */
+#define JBD2_FROZEN_POOL_MAX	256
+
 #define JBD2_MIN_JOURNAL_BLOCKS 1024
 
 #ifdef __KERNEL__
@@ -147,6 +152,7 @@ typedef struct journal_header_s
 #define JBD2_CRC32_CHKSUM   1
 #define JBD2_MD5_CHKSUM     2
 #define JBD2_SHA1_CHKSUM    3
+#define JBD2_CRC32C_CHKSUM  4
 
 #define JBD2_CRC32_CHKSUM_SIZE 4
 
@@ -263,18 +269,30 @@ typedef struct journal_superblock_s
 #define JBD2_FEATURE_INCOMPAT_REVOKE		0x00000001
 #define JBD2_FEATURE_INCOMPAT_64BIT		0x00000002
 #define JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT	0x00000004
+#define JBD2_FEATURE_INCOMPAT_CSUM_CRC32C	0x00000100
+
+#ifdef CONFIG_JBD2_CSUM_CRC32C
+#define JBD2_KNOWN_INCOMPAT_CSUM_CRC32C	JBD2_FEATURE_INCOMPAT_CSUM_CRC32C
+#else
+#define JBD2_KNOWN_INCOMPAT_CSUM_CRC32C	0
+#endif
 
 /* Features known to this kernel version: */
 #define JBD2_KNOWN_COMPAT_FEATURES	JBD2_FEATURE_COMPAT_CHECKSUM
 #define JBD2_KNOWN_ROCOMPAT_FEATURES	0
 #define JBD2_KNOWN_INCOMPAT_FEATURES	(JBD2_FEATURE_INCOMPAT_REVOKE | \
 					JBD2_FEATURE_INCOMPAT_64BIT | \
-					JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT)
+					JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT | \
+					JBD2_KNOWN_INCOMPAT_CSUM_CRC32C)
 
 #ifdef __KERNEL__
 
 #include <linux/fs.h>
 #include <linux/sched.h>
+#include <linux/crc32.h>
+#ifdef CONFIG_JBD2_CSUM_CRC32C
+#include <linux/crc32c.h>
+#endif
 
 #define J_ASSERT(assert)	BUG_ON(!(assert))
 
@@ -396,6 +414,12 @@ struct jbd2_inode {
 
 	/* Flags of inode [j_list_lock] */
 	unsigned long i_flags;
+
+	/* Byte range of ordered data (inclusive) that the commit has to
+	 * write out; i_dirty_end == 0 means none yet.  Whole file unless
+	 * the filesystem filed the inode with a range. [j_list_lock] */
+	loff_t i_dirty_start;
+	loff_t i_dirty_end;
 };
 
 struct jbd2_revoke_table_s;
@@ -436,6 +460,8 @@ struct jbd2_journal_handle
 	unsigned int	h_jdata:1;	/* force data journaling */
 	unsigned int	h_aborted:1;	/* fatal error on handle */
 	unsigned int	h_cowing:1;	/* COWing block to snapshot */
+	unsigned int	h_move_extent:1; /* swapping extents, no move-on-write */
+	unsigned int	h_cow_data:1;	/* COWing a journaled data block */
 
 	/* Number of buffers requested by user:
 	 * (before adding the COW credits factor) */
@@ -445,6 +471,16 @@ struct jbd2_journal_handle
 	 * (counts only buffers dirtied when !h_cowing) */
 	unsigned int	h_user_credits:14;
 
+	/* Buffer credits at the start of the current COW operation */
+	int			h_cow_credits;
+
+	/* Last extent allocated with this handle (not in use by snapshot) */
+	unsigned long long	h_alloc_start;
+	unsigned int		h_alloc_len;
+
+	/* COW bitmap buffer of the last block group tested by the handle */
+	struct buffer_head	*h_cow_bitmap_bh;
+	unsigned int		h_cow_bitmap_group;
 
 #ifdef CONFIG_DEBUG_LOCK_ALLOC
 	struct lockdep_map	h_lockdep_map;
@@ -460,6 +496,7 @@ struct jbd2_journal_handle
 	unsigned int h_cow_ok_mapped;/* blocks already mapped in snapshot */
 	unsigned int h_cow_bitmaps; /* COW bitmaps created */
 	unsigned int h_cow_excluded; /* blocks set in exclude bitmap */
+	unsigned int h_cow_bitmap_waits; /* waits for pending COW bitmap */
 #endif
 };
 
@@ -663,6 +700,19 @@ struct transaction_s
 	/* Disk flush needs to be sent to fs partition [no locking] */
 	int			t_need_data_flush;
 
+	/*
+	 * A handle passed the log space check of start_this_handle() for
+	 * this transaction, so later handles may join it without taking
+	 * j_state_lock. [j_state_lock]
+	 */
+	int			t_log_space_ok;
+
+	/*
+	 * Transactions are freed after an RCU grace period, because handles
+	 * look up the running transaction under rcu_read_lock() only.
+	 */
+	struct rcu_head		t_rcu;
+
 	/*
 	 * For use by the filesystem to store fs-specific data
 	 * structures associated with the transaction
@@ -680,6 +730,7 @@ struct transaction_run_stats_s {
 	__u32			rs_handle_count;
 	__u32			rs_blocks;
 	__u32			rs_blocks_logged;
+	__u32			rs_revokes;
 };
 
 struct transaction_stats_s {
@@ -687,6 +738,28 @@ struct transaction_stats_s {
 	struct transaction_run_stats_s run;
 };
 
+/*
+ * Log2 histograms of per-transaction commit statistics.  Bucket 0 counts
+ * zero values, bucket n values in [2^(n-1), 2^n); the last bucket also
+ * takes everything larger.
+ */
+#define JBD2_HIST_BUCKETS	16
+
+struct jbd2_stats_hist_s {
+	__u32			h_running[JBD2_HIST_BUCKETS];	/* ms */
+	__u32			h_locked[JBD2_HIST_BUCKETS];	/* ms */
+	__u32			h_flushing[JBD2_HIST_BUCKETS];	/* ms */
+	__u32			h_logging[JBD2_HIST_BUCKETS];	/* ms */
+	__u32			h_commit[JBD2_HIST_BUCKETS];	/* us */
+	__u32			h_handles[JBD2_HIST_BUCKETS];
+	__u32			h_blocks[JBD2_HIST_BUCKETS];
+};
+
+static inline int jbd2_hist_bucket(unsigned long value)
+{
+	return min_t(int, fls_long(value), JBD2_HIST_BUCKETS - 1);
+}
+
 static inline unsigned long
 jbd2_time_diff(unsigned long start, unsigned long end)
 {
@@ -722,6 +795,7 @@ jbd2_time_diff(unsigned long start, unsigned long end)
  * @j_wait_commit: Wait queue to trigger commit
  * @j_wait_updates: Wait queue to wait for updates to complete
  * @j_checkpoint_mutex: Mutex for locking against concurrent checkpoints
+ * @j_checkpoint_work: Background checkpointing ahead of log space demand
  * @j_head: Journal head - identifies the first unused block in the journal
  * @j_tail: Journal tail - identifies the oldest still-used block in the
  *  journal.
@@ -765,6 +839,9 @@ jbd2_time_diff(unsigned long start, unsigned long end)
  * @j_history_lock: Protect the transactions statistics history
  * @j_proc_entry: procfs entry for the jbd statistics directory
  * @j_stats: Overall statistics
+ * @j_hist: Histograms of the per-transaction statistics
+ * @j_handle_wait_hist: Histogram of handle start waits (ms), for handles
+ *  which had to wait at least a jiffy
  * @j_private: An opaque pointer to fs-private information.
  */
 
@@ -841,6 +918,12 @@ struct journal_s
 	/* Semaphore for locking against concurrent checkpoints */
 	struct mutex		j_checkpoint_mutex;
 
+	/*
+	 * Checkpoints old transactions in the background once free log
+	 * space drops below jbd2_checkpoint_watermark().
+	 */
+	struct work_struct	j_checkpoint_work;
+
 	/*
 	 * List of buffer heads used by the checkpoint routine.  This
 	 * was moved from jbd2_log_do_checkpoint() to reduce stack
@@ -963,6 +1046,21 @@ struct journal_s
 	struct buffer_head	**j_wbuf;
 	int			j_wbufsize;
 
+	/*
+	 * Pool of preallocated frozen and committed data buffers of
+	 * j_blocksize, refilled after commit to twice the average number of
+	 * copies per transaction.  Free buffers are chained through their
+	 * first word.  [j_frozen_lock]
+	 */
+	spinlock_t		j_frozen_lock;
+	void			*j_frozen_pool;
+	int			j_frozen_count;
+	int			j_frozen_target;
+	unsigned int		j_frozen_avg;
+	atomic_t		j_frozen_copies;
+	unsigned long		j_frozen_hits;
+	unsigned long		j_frozen_misses;
+
 	/*
 	 * this is the pid of hte last person to run a synchronous operation
 	 * through the journal
@@ -993,6 +1091,8 @@ struct journal_s
 	spinlock_t		j_history_lock;
 	struct proc_dir_entry	*j_proc_entry;
 	struct transaction_stats_s j_stats;
+	struct jbd2_stats_hist_s j_hist;
+	atomic_t		j_handle_wait_hist[JBD2_HIST_BUCKETS];
 
 	/* Failed journal commit ID */
 	unsigned int		j_failed_commit;
@@ -1031,6 +1131,11 @@ extern void __journal_free_buffer(struct journal_head *bh);
 extern void jbd2_journal_file_buffer(struct journal_head *, transaction_t *, int);
 extern void __journal_clean_data_list(transaction_t *transaction);
 
+/* Frozen data buffers */
+extern void *jbd2_journal_alloc_frozen(journal_t *, size_t, gfp_t);
+extern void jbd2_journal_free_frozen(journal_t *, void *, size_t);
+extern void jbd2_journal_refill_frozen(journal_t *);
+
 /* Log buffer allocation */
 extern struct journal_head * jbd2_journal_get_descriptor_buffer(journal_t *);
 int jbd2_journal_next_log_block(journal_t *, unsigned long long *);
@@ -1154,6 +1259,9 @@ extern int	   jbd2_journal_clear_err  (journal_t *);
 extern int	   jbd2_journal_bmap(journal_t *, unsigned long, unsigned long long *);
 extern int	   jbd2_journal_force_commit(journal_t *);
 extern int	   jbd2_journal_file_inode(handle_t *handle, struct jbd2_inode *inode);
+extern int	   jbd2_journal_file_inode_range(handle_t *handle,
+						 struct jbd2_inode *inode,
+						 loff_t start, loff_t length);
 extern int	   jbd2_journal_begin_ordered_truncate(journal_t *journal,
 				struct jbd2_inode *inode, loff_t new_size);
 extern void	   jbd2_journal_init_jbd_inode(struct jbd2_inode *jinode, struct inode *inode);
@@ -1206,8 +1314,9 @@ extern int	   jbd2_journal_init_revoke_caches(void);
 extern void	   jbd2_journal_destroy_revoke(journal_t *);
 extern int	   jbd2_journal_revoke (handle_t *, unsigned long long, struct buffer_head *);
 extern int	   jbd2_journal_cancel_revoke(handle_t *, struct journal_head *);
-extern void	   jbd2_journal_write_revoke_records(journal_t *,
+extern int	   jbd2_journal_write_revoke_records(journal_t *,
 						     transaction_t *, int);
+extern int	   jbd2_journal_revoke_hash_size(journal_t *);
 
 /* Recovery revoke support */
 extern int	jbd2_journal_set_revoke(journal_t *, unsigned long long, tid_t);
@@ -1225,6 +1334,7 @@ extern void	jbd2_journal_switch_revoke_table(journal_t *journal);
 int __jbd2_log_space_left(journal_t *); /* Called with journal locked */
 int jbd2_log_start_commit(journal_t *journal, tid_t tid);
 int __jbd2_log_start_commit(journal_t *journal, tid_t tid);
+void jbd2_log_batch_commit(journal_t *journal, tid_t tid);
 int jbd2_journal_start_commit(journal_t *journal, tid_t *tid);
 int jbd2_journal_force_commit_nested(journal_t *journal);
 int jbd2_log_wait_commit(journal_t *journal, tid_t tid);
@@ -1232,6 +1342,8 @@ int jbd2_log_do_checkpoint(journal_t *journal);
 int jbd2_trans_will_send_data_barrier(journal_t *journal, tid_t tid);
 
 void __jbd2_log_wait_for_space(journal_t *journal);
+void __jbd2_log_start_checkpoint(journal_t *journal);
+void jbd2_checkpoint_work(struct work_struct *work);
 extern void __jbd2_journal_drop_transaction(journal_t *, transaction_t *);
 extern int jbd2_cleanup_journal_tail(journal_t *);
 
@@ -1304,6 +1416,56 @@ static inline int jbd_space_needed(journal_t *journal)
 	return nblocks;
 }
 
+/*
+ * Free log space below which old transactions are checkpointed in the
+ * background: a quarter of the log above the point where new handles
+ * have to wait for a checkpoint.  Must be called under j_state_lock.
+ */
+static inline int jbd2_checkpoint_watermark(journal_t *journal)
+{
+	return jbd_space_needed(journal) + (journal->j_maxlen >> 2);
+}
+
+/*
+ * Set the max. transaction size.  The log space check passed by the running
+ * transaction (t_log_space_ok) depends on it, so raising it sends the next
+ * handles through the slow path of start_this_handle() again.
+ * Must be called under write_lock(&j_state_lock).
+ */
+static inline void jbd2_set_max_transaction_buffers(journal_t *journal,
+						    int max)
+{
+	if (max > journal->j_max_transaction_buffers &&
+	    journal->j_running_transaction)
+		journal->j_running_transaction->t_log_space_ok = 0;
+	journal->j_max_transaction_buffers = max;
+}
+
+/*
+ * Transactional checksums: crc32c when the journal has the CSUM_CRC32C
+ * feature (libcrc32c picks up the crypto API's accelerated crc32c),
+ * the original big-endian crc32 otherwise.
+ */
+static inline int jbd2_chksum_type(journal_t *journal)
+{
+#ifdef CONFIG_JBD2_CSUM_CRC32C
+	if (JBD2_HAS_INCOMPAT_FEATURE(journal,
+				      JBD2_FEATURE_INCOMPAT_CSUM_CRC32C))
+		return JBD2_CRC32C_CHKSUM;
+#endif
+	return JBD2_CRC32_CHKSUM;
+}
+
+static inline __u32 jbd2_chksum(journal_t *journal, __u32 crc,
+				const void *address, unsigned int length)
+{
+#ifdef CONFIG_JBD2_CSUM_CRC32C
+	if (jbd2_chksum_type(journal) == JBD2_CRC32C_CHKSUM)
+		return crc32c(crc, address, length);
+#endif
+	return crc32_be(crc, address, length);
+}
+
 /*
  * Definitions which augment the buffer_head layer
  */
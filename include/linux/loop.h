@@ -28,6 +28,8 @@ enum {
 
 struct loop_func_table;
 
+#define LOOP_MAX_READ_THREADS	16
+
 struct loop_device {
 	int		lo_number;
 	int		lo_refcnt;
@@ -62,6 +64,15 @@ struct loop_device {
 	struct task_struct	*lo_thread;
 	wait_queue_head_t	lo_event;
 
+	/* reads of a read-only device are served by lo_read_threads */
+	struct bio_list		lo_read_list;
+	int			lo_reads_active;
+	int			lo_switch_pending;	/* reads go to loop_thread */
+	int			lo_nr_read_threads;
+	struct task_struct	*lo_read_threads[LOOP_MAX_READ_THREADS];
+	wait_queue_head_t	lo_read_event;
+	wait_queue_head_t	lo_read_idle;
+
 	struct request_queue	*lo_queue;
 	struct gendisk		*lo_disk;
 };
@@ -27,6 +27,8 @@ struct mb_cache {
 	struct kmem_cache		*c_entry_cache;
 	struct list_head		*c_block_hash;
 	struct list_head		*c_index_hash;
+	spinlock_t			*c_block_locks;
+	spinlock_t			*c_index_locks;
 };
 
 /* Functions on caches */
@@ -1589,6 +1589,224 @@ DEFINE_EVENT(ext4__trim, ext4_trim_all_free,
 	TP_ARGS(sb, group, start, len)
 );
 
+DECLARE_EVENT_CLASS(ext4_snapshot__cow_enter,
+	TP_PROTO(struct super_block *sb, struct inode *inode,
+		 ext4_fsblk_t block, unsigned int group, int count, int cmd),
+
+	TP_ARGS(sb, inode, block, group, count, cmd),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	ino_t,		ino		)
+		__field(	ext4_fsblk_t,	block		)
+		__field(	unsigned int,	group		)
+		__field(	int,		count		)
+		__field(	int,		cmd		)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->ino	= inode ? inode->i_ino : 0;
+		__entry->block	= block;
+		__entry->group	= group;
+		__entry->count	= count;
+		__entry->cmd	= cmd;
+	),
+
+	TP_printk("dev %d,%d ino %lu block %llu group %u count %d cmd %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino, __entry->block,
+		  __entry->group, __entry->count, __entry->cmd)
+);
+
+DEFINE_EVENT(ext4_snapshot__cow_enter, ext4_snapshot_cow_enter,
+
+	TP_PROTO(struct super_block *sb, struct inode *inode,
+		 ext4_fsblk_t block, unsigned int group, int count, int cmd),
+
+	TP_ARGS(sb, inode, block, group, count, cmd)
+);
+
+DEFINE_EVENT(ext4_snapshot__cow_enter, ext4_snapshot_move_enter,
+
+	TP_PROTO(struct super_block *sb, struct inode *inode,
+		 ext4_fsblk_t block, unsigned int group, int count, int cmd),
+
+	TP_ARGS(sb, inode, block, group, count, cmd)
+);
+
+TRACE_EVENT(ext4_snapshot_cow_exit,
+	TP_PROTO(struct super_block *sb, ext4_fsblk_t block, int ret),
+
+	TP_ARGS(sb, block, ret),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	ext4_fsblk_t,	block		)
+		__field(	int,		ret		)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->block	= block;
+		__entry->ret	= ret;
+	),
+
+	TP_printk("dev %d,%d block %llu ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->block, __entry->ret)
+);
+
+DECLARE_EVENT_CLASS(ext4_snapshot__cow_blocks,
+	TP_PROTO(struct super_block *sb, ext4_fsblk_t block,
+		 ext4_fsblk_t sblock, int count),
+
+	TP_ARGS(sb, block, sblock, count),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	ext4_fsblk_t,	block		)
+		__field(	ext4_fsblk_t,	sblock		)
+		__field(	int,		count		)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->block	= block;
+		__entry->sblock	= sblock;
+		__entry->count	= count;
+	),
+
+	TP_printk("dev %d,%d block %llu snapshot block %llu count %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->block, __entry->sblock, __entry->count)
+);
+
+/* blocks copied to active snapshot */
+DEFINE_EVENT(ext4_snapshot__cow_blocks, ext4_snapshot_cow_copied,
+
+	TP_PROTO(struct super_block *sb, ext4_fsblk_t block,
+		 ext4_fsblk_t sblock, int count),
+
+	TP_ARGS(sb, block, sblock, count)
+);
+
+/* blocks found in COW cache of the running transaction */
+DEFINE_EVENT(ext4_snapshot__cow_blocks, ext4_snapshot_cow_cached,
+
+	TP_PROTO(struct super_block *sb, ext4_fsblk_t block,
+		 ext4_fsblk_t sblock, int count),
+
+	TP_ARGS(sb, block, sblock, count)
+);
+
+/* blocks moved to active snapshot (block == snapshot block) */
+DEFINE_EVENT(ext4_snapshot__cow_blocks, ext4_snapshot_moved,
+
+	TP_PROTO(struct super_block *sb, ext4_fsblk_t block,
+		 ext4_fsblk_t sblock, int count),
+
+	TP_ARGS(sb, block, sblock, count)
+);
+
+TRACE_EVENT(ext4_snapshot_wait_pending_cow,
+	TP_PROTO(struct buffer_head *sbh, sector_t block, s64 delay_us),
+
+	TP_ARGS(sbh, block, delay_us),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	sector_t,	block		)
+		__field(	s64,		delay_us	)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sbh->b_bdev->bd_dev;
+		__entry->block		= block;
+		__entry->delay_us	= delay_us;
+	),
+
+	TP_printk("dev %d,%d block %llu delay %lld usec",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long) __entry->block, __entry->delay_us)
+);
+
+DECLARE_EVENT_CLASS(ext4_snapshot__cow_bitmap,
+	TP_PROTO(struct super_block *sb, unsigned int group,
+		 ext4_fsblk_t cow_bitmap, s64 delay_us),
+
+	TP_ARGS(sb, group, cow_bitmap, delay_us),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	unsigned int,	group		)
+		__field(	ext4_fsblk_t,	cow_bitmap	)
+		__field(	s64,		delay_us	)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sb->s_dev;
+		__entry->group		= group;
+		__entry->cow_bitmap	= cow_bitmap;
+		__entry->delay_us	= delay_us;
+	),
+
+	TP_printk("dev %d,%d group %u cow_bitmap %llu delay %lld usec",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->group, __entry->cow_bitmap, __entry->delay_us)
+);
+
+/* COW bitmap created by copying the block bitmap */
+DEFINE_EVENT(ext4_snapshot__cow_bitmap, ext4_snapshot_cow_bitmap_init,
+
+	TP_PROTO(struct super_block *sb, unsigned int group,
+		 ext4_fsblk_t cow_bitmap, s64 delay_us),
+
+	TP_ARGS(sb, group, cow_bitmap, delay_us)
+);
+
+/* waited for another task to create the COW bitmap */
+DEFINE_EVENT(ext4_snapshot__cow_bitmap, ext4_snapshot_wait_cow_bitmap,
+
+	TP_PROTO(struct super_block *sb, unsigned int group,
+		 ext4_fsblk_t cow_bitmap, s64 delay_us),
+
+	TP_ARGS(sb, group, cow_bitmap, delay_us)
+);
+
+TRACE_EVENT(ext4_snapshot_take,
+	TP_PROTO(struct super_block *sb, __u32 id, u64 prepare_us,
+		 u64 freeze_us, u64 commit_us, u64 thaw_us, int ret),
+
+	TP_ARGS(sb, id, prepare_us, freeze_us, commit_us, thaw_us, ret),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,		dev		)
+		__field(	__u32,		id		)
+		__field(	u64,		prepare_us	)
+		__field(	u64,		freeze_us	)
+		__field(	u64,		commit_us	)
+		__field(	u64,		thaw_us		)
+		__field(	int,		ret		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= sb->s_dev;
+		__entry->id		= id;
+		__entry->prepare_us	= prepare_us;
+		__entry->freeze_us	= freeze_us;
+		__entry->commit_us	= commit_us;
+		__entry->thaw_us	= thaw_us;
+		__entry->ret		= ret;
+	),
+
+	TP_printk("dev %d,%d snapshot %u prepare %llu freeze %llu "
+		  "commit %llu thaw %llu usec ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->id,
+		  __entry->prepare_us, __entry->freeze_us,
+		  __entry->commit_us, __entry->thaw_us, __entry->ret)
+);
+
 #endif /* _TRACE_EXT4_H */
 
 /* This part must be outside protection */
@@ -169,6 +169,28 @@ TRACE_EVENT(jbd2_run_stats,
 		  __entry->blocks_logged)
 );
 
+TRACE_EVENT(jbd2_handle_wait,
+	TP_PROTO(dev_t dev, unsigned long tid, unsigned int wait),
+
+	TP_ARGS(dev, tid, wait),
+
+	TP_STRUCT__entry(
+		__field(		dev_t,	dev		)
+		__field(	unsigned long,	tid		)
+		__field(	 unsigned int,	wait		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dev;
+		__entry->tid		= tid;
+		__entry->wait		= wait;
+	),
+
+	TP_printk("dev %d,%d tid %lu wait %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->tid,
+		  __entry->wait)
+);
+
 TRACE_EVENT(jbd2_checkpoint_stats,
 	TP_PROTO(dev_t dev, unsigned long tid,
 		 struct transaction_chp_stats_s *stats),
@@ -28,13 +28,13 @@
 #include <linux/init.h>
 #include <linux/atomic.h>
 #include "crc32defs.h"
-#if CRC_LE_BITS == 8
+#if CRC_LE_BITS >= 8
 # define tole(x) __constant_cpu_to_le32(x)
 #else
 # define tole(x) (x)
 #endif
 
-#if CRC_BE_BITS == 8
+#if CRC_BE_BITS >= 8
 # define tobe(x) __constant_cpu_to_be32(x)
 #else
 # define tobe(x) (x)
@@ -93,6 +93,65 @@ crc32_body(u32 crc, unsigned char const *buf, size_t len, const u32 (*tab)[256])
 #undef DO_CRC4
 }
 #endif
+
+#if CRC_LE_BITS == 64 || CRC_BE_BITS == 64
+
+/*
+ * Slice-by-8: like crc32_body(), but two 32 bit words are folded into
+ * the crc per step, using eight tables instead of four.
+ */
+static inline u32
+crc32_body8(u32 crc, unsigned char const *buf, size_t len,
+	    const u32 (*tab)[256])
+{
+# ifdef __LITTLE_ENDIAN
+#  define DO_CRC(x) crc = tab[0][(crc ^ (x)) & 255] ^ (crc >> 8)
+#  define DO_CRC8(q, w) crc = tab[7][(q) & 255] ^ \
+		tab[6][((q) >> 8) & 255] ^ \
+		tab[5][((q) >> 16) & 255] ^ \
+		tab[4][((q) >> 24) & 255] ^ \
+		tab[3][(w) & 255] ^ \
+		tab[2][((w) >> 8) & 255] ^ \
+		tab[1][((w) >> 16) & 255] ^ \
+		tab[0][((w) >> 24) & 255]
+# else
+#  define DO_CRC(x) crc = tab[0][((crc >> 24) ^ (x)) & 255] ^ (crc << 8)
+#  define DO_CRC8(q, w) crc = tab[4][(q) & 255] ^ \
+		tab[5][((q) >> 8) & 255] ^ \
+		tab[6][((q) >> 16) & 255] ^ \
+		tab[7][((q) >> 24) & 255] ^ \
+		tab[0][(w) & 255] ^ \
+		tab[1][((w) >> 8) & 255] ^ \
+		tab[2][((w) >> 16) & 255] ^ \
+		tab[3][((w) >> 24) & 255]
+# endif
+	const u32 *b;
+	size_t    rem_len;
+	u32       q;
+
+	/* Align it */
+	if (unlikely((long)buf & 3 && len)) {
+		do {
+			DO_CRC(*buf++);
+		} while ((--len) && ((long)buf)&3);
+	}
+	rem_len = len & 7;
+	/* load data 2 x 32 bits wide, xor data 32 bits wide. */
+	len = len >> 3;
+	b = (const u32 *)buf;
+	for (; len; --len, b += 2) {
+		q = crc ^ b[0];
+		DO_CRC8(q, b[1]);
+	}
+	/* And the last few bytes */
+	buf = (unsigned char const *)b;
+	while (rem_len--)
+		DO_CRC(*buf++);
+	return crc;
+#undef DO_CRC
+#undef DO_CRC8
+}
+#endif
 /**
  * crc32_le() - Calculate bitwise little-endian Ethernet AUTODIN II CRC32
  * @crc: seed value for computation.  ~0 for Ethernet, sometimes 0 for
@@ -122,7 +181,13 @@ u32 __pure crc32_le(u32 crc, unsigned char const *p, size_t len)
 
 u32 __pure crc32_le(u32 crc, unsigned char const *p, size_t len)
 {
-# if CRC_LE_BITS == 8
+# if CRC_LE_BITS == 64
+	const u32      (*tab)[256] = crc32table_le;
+
+	crc = __cpu_to_le32(crc);
+	crc = crc32_body8(crc, p, len, tab);
+	return __le32_to_cpu(crc);
+# elif CRC_LE_BITS == 8
 	const u32      (*tab)[] = crc32table_le;
 
 	crc = __cpu_to_le32(crc);
@@ -179,7 +244,13 @@ u32 __pure crc32_be(u32 crc, unsigned char const *p, size_t len)
 #else				/* Table-based approach */
 u32 __pure crc32_be(u32 crc, unsigned char const *p, size_t len)
 {
-# if CRC_BE_BITS == 8
+# if CRC_BE_BITS == 64
+	const u32      (*tab)[256] = crc32table_be;
+
+	crc = __cpu_to_be32(crc);
+	crc = crc32_body8(crc, p, len, tab);
+	return __be32_to_cpu(crc);
+# elif CRC_BE_BITS == 8
 	const u32      (*tab)[] = crc32table_be;
 
 	crc = __cpu_to_be32(crc);
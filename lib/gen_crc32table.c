@@ -4,11 +4,23 @@
 
 #define ENTRIES_PER_LINE 4
 
-#define LE_TABLE_SIZE (1 << CRC_LE_BITS)
-#define BE_TABLE_SIZE (1 << CRC_BE_BITS)
+/* Slice-by-8 uses tables indexed by a whole byte, like CRC_xx_BITS 8 */
+#if CRC_LE_BITS > 8
+# define LE_TABLE_BITS 8
+#else
+# define LE_TABLE_BITS CRC_LE_BITS
+#endif
+#if CRC_BE_BITS > 8
+# define BE_TABLE_BITS 8
+#else
+# define BE_TABLE_BITS CRC_BE_BITS
+#endif
 
-static uint32_t crc32table_le[4][LE_TABLE_SIZE];
-static uint32_t crc32table_be[4][BE_TABLE_SIZE];
+#define LE_TABLE_SIZE (1 << LE_TABLE_BITS)
+#define BE_TABLE_SIZE (1 << BE_TABLE_BITS)
+
+static uint32_t crc32table_le[CRC_LE_TABLES][256];
+static uint32_t crc32table_be[CRC_BE_TABLES][256];
 
 /**
  * crc32init_le() - allocate and initialize LE table data
@@ -24,14 +36,14 @@ static void crc32init_le(void)
 
 	crc32table_le[0][0] = 0;
 
-	for (i = 1 << (CRC_LE_BITS - 1); i; i >>= 1) {
+	for (i = 1 << (LE_TABLE_BITS - 1); i; i >>= 1) {
 		crc = (crc >> 1) ^ ((crc & 1) ? CRCPOLY_LE : 0);
 		for (j = 0; j < LE_TABLE_SIZE; j += 2 * i)
 			crc32table_le[0][i + j] = crc ^ crc32table_le[0][j];
 	}
 	for (i = 0; i < LE_TABLE_SIZE; i++) {
 		crc = crc32table_le[0][i];
-		for (j = 1; j < 4; j++) {
+		for (j = 1; j < CRC_LE_TABLES; j++) {
 			crc = crc32table_le[0][crc & 0xff] ^ (crc >> 8);
 			crc32table_le[j][i] = crc;
 		}
@@ -55,18 +67,19 @@ static void crc32init_be(void)
 	}
 	for (i = 0; i < BE_TABLE_SIZE; i++) {
 		crc = crc32table_be[0][i];
-		for (j = 1; j < 4; j++) {
+		for (j = 1; j < CRC_BE_TABLES; j++) {
 			crc = crc32table_be[0][(crc >> 24) & 0xff] ^ (crc << 8);
 			crc32table_be[j][i] = crc;
 		}
 	}
 }
 
-static void output_table(uint32_t table[4][256], int len, char *trans)
+static void output_table(uint32_t (*table)[256], int rows, int len,
+			 char *trans)
 {
 	int i, j;
 
-	for (j = 0 ; j < 4; j++) {
+	for (j = 0 ; j < rows; j++) {
 		printf("{");
 		for (i = 0; i < len - 1; i++) {
 			if (i % ENTRIES_PER_LINE == 0)
@@ -83,15 +96,19 @@ int main(int argc, char** argv)
 
 	if (CRC_LE_BITS > 1) {
 		crc32init_le();
-		printf("static const u32 crc32table_le[4][256] = {");
-		output_table(crc32table_le, LE_TABLE_SIZE, "tole");
+		printf("static const u32 crc32table_le[%d][256] = {",
+		       CRC_LE_TABLES);
+		output_table(crc32table_le, CRC_LE_TABLES, LE_TABLE_SIZE,
+			     "tole");
 		printf("};\n");
 	}
 
 	if (CRC_BE_BITS > 1) {
 		crc32init_be();
-		printf("static const u32 crc32table_be[4][256] = {");
-		output_table(crc32table_be, BE_TABLE_SIZE, "tobe");
+		printf("static const u32 crc32table_be[%d][256] = {",
+		       CRC_BE_TABLES);
+		output_table(crc32table_be, CRC_BE_TABLES, BE_TABLE_SIZE,
+			     "tobe");
 		printf("};\n");
 	}
 
@@ -0,0 +1,136 @@
+# ext4 snapshot overhead, by process, inode and syscall
+# Licensed under the terms of the GNU GPL License version 2
+#
+# Attributes the overhead of ext4 snapshots - blocks copied (COW) and
+# moved (MOW) to the active snapshot, time spent in COW and time stalled
+# waiting for pending COW and COW bitmaps - to the processes, inodes and
+# system calls that triggered it.
+# The ext4 snapshot tracepoints need CONFIG_EXT4_FS_SNAPSHOT_TRACEPOINTS.
+#
+# usage: perf script -s ext4-snapshot-overhead.py [block-size]
+
+import os, sys
+
+sys.path.append(os.environ['PERF_EXEC_PATH'] + \
+	'/scripts/python/Perf-Trace-Util/lib/Perf/Trace')
+
+from perf_trace_context import *
+from Core import *
+from Util import *
+
+usage = "perf script -s ext4-snapshot-overhead.py [block-size]\n";
+
+# snapshots require block size == page size
+block_size = 4096
+
+if len(sys.argv) > 2:
+	sys.exit(usage)
+
+if len(sys.argv) > 1:
+	try:
+		block_size = int(sys.argv[1])
+	except:
+		sys.exit(usage)
+
+# per (comm, pid), inode and syscall: [cowed, moved, cow ns, stalled ns]
+by_pid = {}
+by_ino = {}
+by_syscall = {}
+
+process_names = {}
+thread_syscall = {}	# syscall a thread is in
+thread_cow = {}		# (ino, start ns) of the COW/MOW a thread is in
+
+COWED, MOVED, COW_NS, STALL_NS = range(4)
+
+def account(pid, what, value):
+	ino, start = thread_cow.get(pid, (0, 0))
+	for (stats, key) in ((by_pid, pid), (by_ino, ino),
+			     (by_syscall, thread_syscall.get(pid, -1))):
+		if not stats.has_key(key):
+			stats[key] = [0, 0, 0, 0]
+		stats[key][what] += value
+
+def trace_begin():
+	print "Press control+C to stop and show the summary"
+
+def trace_end():
+	print_totals("process", by_pid,
+		     lambda pid: "%s[%d]" % (process_names.get(pid, "?"), pid))
+	print_totals("inode", by_ino,
+		     lambda ino: ino and str(ino) or "(metadata)")
+	print_totals("syscall", by_syscall,
+		     lambda id: id >= 0 and syscall_name(id) or "(none)")
+
+def print_totals(title, stats, name):
+	print "\nsnapshot overhead by %s:\n" % title
+	print "%-30s %12s %12s %12s %12s" % \
+		(title, "copied KB", "moved KB", "cow msecs", "stall msecs")
+	print "%-30s %12s %12s %12s %12s" % \
+		("-" * 30, "-" * 12, "-" * 12, "-" * 12, "-" * 12)
+	for key, val in sorted(stats.iteritems(),
+			       key = lambda(k, v): (v[COW_NS] + v[STALL_NS],
+						    v[COWED]),
+			       reverse = True):
+		print "%-30s %12d %12d %12.3f %12.3f" % (name(key),
+			val[COWED] * block_size / 1024,
+			val[MOVED] * block_size / 1024,
+			val[COW_NS] / 1000000.0, val[STALL_NS] / 1000000.0)
+
+def raw_syscalls__sys_enter(event_name, context, common_cpu,
+	common_secs, common_nsecs, common_pid, common_comm,
+	id, args):
+	thread_syscall[common_pid] = id
+
+def raw_syscalls__sys_exit(event_name, context, common_cpu,
+	common_secs, common_nsecs, common_pid, common_comm,
+	id, ret):
+	if thread_syscall.has_key(common_pid):
+		del thread_syscall[common_pid]
+
+def cow_enter(secs, ns, pid, comm, ino):
+	process_names[pid] = comm
+	thread_cow[pid] = (ino, nsecs(secs, ns))
+
+def ext4__ext4_snapshot_cow_enter(event_name, context, common_cpu,
+	common_secs, common_nsecs, common_pid, common_comm,
+	dev, ino, block, group, count, cmd):
+	cow_enter(common_secs, common_nsecs, common_pid, common_comm, ino)
+
+def ext4__ext4_snapshot_move_enter(event_name, context, common_cpu,
+	common_secs, common_nsecs, common_pid, common_comm,
+	dev, ino, block, group, count, cmd):
+	cow_enter(common_secs, common_nsecs, common_pid, common_comm, ino)
+
+def ext4__ext4_snapshot_cow_exit(event_name, context, common_cpu,
+	common_secs, common_nsecs, common_pid, common_comm,
+	dev, block, ret):
+	if thread_cow.has_key(common_pid):
+		ino, start = thread_cow[common_pid]
+		account(common_pid, COW_NS,
+			nsecs(common_secs, common_nsecs) - start)
+		del thread_cow[common_pid]
+
+def ext4__ext4_snapshot_cow_copied(event_name, context, common_cpu,
+	common_secs, common_nsecs, common_pid, common_comm,
+	dev, block, sblock, count):
+	process_names[common_pid] = common_comm
+	account(common_pid, COWED, count)
+
+def ext4__ext4_snapshot_moved(event_name, context, common_cpu,
+	common_secs, common_nsecs, common_pid, common_comm,
+	dev, block, sblock, count):
+	process_names[common_pid] = common_comm
+	account(common_pid, MOVED, count)
+
+def ext4__ext4_snapshot_wait_pending_cow(event_name, context, common_cpu,
+	common_secs, common_nsecs, common_pid, common_comm,
+	dev, block, delay_us):
+	process_names[common_pid] = common_comm
+	account(common_pid, STALL_NS, delay_us * 1000)
+
+def ext4__ext4_snapshot_wait_cow_bitmap(event_name, context, common_cpu,
+	common_secs, common_nsecs, common_pid, common_comm,
+	dev, group, cow_bitmap, delay_us):
+	process_names[common_pid] = common_comm
+	account(common_pid, STALL_NS, delay_us * 1000)